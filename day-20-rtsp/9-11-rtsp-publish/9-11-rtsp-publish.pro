@@ -1,4 +1,4 @@
-TEMPLATE = app
+﻿TEMPLATE = app
 CONFIG += console c++11
 CONFIG -= app_bundle
 CONFIG -= qt
@@ -17,6 +17,16 @@ LIBS += $$PWD/ffmpeg-4.2.1-win32-dev/lib/avformat.lib   \
 #LIBS += $$PWD/SDL2/lib/x86/SDL2.lib
 }
 
+# 分配与锁竞争的插桩：qmake CONFIG+=instrument，详看instrument.h。不加时没有任何开销
+instrument {
+DEFINES += PUSH_INSTRUMENT
+}
+
+# linux下使用系统安装的ffmpeg，内嵌rtsp服务器目前只支持linux(epoll)，共享内存采集只支持linux(shm_open需要librt)
+unix {
+LIBS += -lavformat -lavcodec -lavdevice -lavfilter -lavutil -lswresample -lswscale -lpthread -lrt
+}
+
 SOURCES += main.cpp \
     commonlooper.cpp \
     dlog.cpp \
@@ -24,9 +34,33 @@ SOURCES += main.cpp \
     pushwork.cpp \
     videocapturer.cpp \
     avpublishtime.cpp \
+    audioencoder.cpp \
     aacencoder.cpp \
+    opusencoder.cpp \
+    audioconvert.cpp \
     h264encoder.cpp \
-    rtsppusher.cpp
+    rtsppusher.cpp \
+    sendpacer.cpp \
+    publishmetrics.cpp \
+    httpserver.cpp \
+    packetspiller.cpp \
+    rtppacketizer.cpp \
+    rtspserver.cpp \
+    rtspstandby.cpp \
+    silencedetector.cpp \
+    staticscenedetector.cpp \
+    simulcast.cpp \
+    encodegovernor.cpp \
+    testpattern.cpp \
+    hlssink.cpp \
+    shmring.cpp \
+    demuxsource.cpp \
+    audiomixer.cpp \
+    videocompositor.cpp \
+    timecode.cpp \
+    qualitymonitor.cpp \
+    nalparser.cpp \
+    instrument.cpp
 
 HEADERS += \
     commonlooper.h \
@@ -37,8 +71,33 @@ HEADERS += \
     pushwork.h \
     videocapturer.h \
     avpublishtime.h \
+    audioencoder.h \
     aacencoder.h \
+    opusencoder.h \
+    audioconvert.h \
     h264encoder.h \
     packetqueue.h \
     rtsppusher.h \
-    messagequeue.h
+    messagequeue.h \
+    sendpacer.h \
+    publishmetrics.h \
+    httpserver.h \
+    packetspiller.h \
+    rtppacketizer.h \
+    rtspserver.h \
+    rtspstandby.h \
+    interrupttimer.h \
+    silencedetector.h \
+    staticscenedetector.h \
+    simulcast.h \
+    encodegovernor.h \
+    testpattern.h \
+    hlssink.h \
+    shmring.h \
+    demuxsource.h \
+    audiomixer.h \
+    videocompositor.h \
+    timecode.h \
+    qualitymonitor.h \
+    nalparser.h \
+    instrument.h
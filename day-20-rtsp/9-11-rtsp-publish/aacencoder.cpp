@@ -9,11 +9,7 @@ AACEncoder::AACEncoder()
 
 AACEncoder::~AACEncoder()
 {
-    if(ctx_) {
-        avcodec_free_context(&ctx_);
-    }
-
-    //编码器codec_应该是不需要我们处理的，因为没有alloc
+    // ctx_由基类AudioEncoder释放
 }
 
 /**
@@ -70,80 +66,6 @@ RET_CODE AACEncoder::Init(const Properties &properties)
     return RET_OK;
 }
 
-/**
- * @brief 编码一帧进行返回，编码前会为采集到的frame打上时间戳。
- * @param frame         输入帧，用于编码。
- * @param pts           时间戳，用于给采集到的帧打上时间戳，即编码前的pts。后续与编码后的时间戳进行对比，是很重点。
- * @param flush         是否flush，将编码器剩余的帧冲刷。
- * @param pkt_frame     方便查看receive_packet还是send_frame的错误。0 receive_packet报错; 1 send_frame报错。
- * @param ret           只有RET_OK才不需要做异常处理。
- * @return              每次返回一个AVPacket或者NULL，返回值的判断具体需要看ret。
- *
- * 后续可以参考之前的编码音频去优化本函数。
- */
-AVPacket *AACEncoder::Encode(AVFrame *frame, const int64_t pts, int flush, int *pkt_frame, RET_CODE *ret)
-{
-    int ret1 = 0;
-    *pkt_frame = 0;
-    if(!ctx_) {
-        *ret = RET_FAIL;
-        LogError("AAC: no context");
-        return NULL;
-    }
-
-    // 1 发送帧去编码
-    if(frame) {
-
-        frame->pts = pts;                               // 打上编码前的时间戳
-
-        ret1 = avcodec_send_frame(ctx_, frame);
-        //av_frame_unref(frame);
-        if(ret1 < 0) {                                  // <0 不能正常处理该frame
-            char buf[1024] = { 0 };
-            av_strerror(ret1, buf, sizeof(buf) - 1);
-            LogError("avcodec_send_frame failed:%s", buf);
-            *pkt_frame = 1;                             // 标记avcodec_send_frame报错
-            if(ret1 == AVERROR(EAGAIN)) {               // 你赶紧读取packet，我frame send不进去了
-                *ret = RET_ERR_EAGAIN;
-                return NULL;
-            } else if(ret1 == AVERROR_EOF) {
-                *ret = RET_ERR_EOF;
-                return NULL;
-            } else {
-                *ret = RET_FAIL;                        // 真正报错，这个encoder就只能销毁了
-                return NULL;
-            }
-        }
-    }
-
-    // 2 冲刷，不过听课时没啥用，后期参考之前的音频编码的冲刷方式优化处理。
-    if(flush) {     // 只能调用一次
-        avcodec_flush_buffers(ctx_);
-    }
-
-    // 3 接收编码后的一个AVPacket数据，并返回该AVPacket
-    AVPacket *packet = av_packet_alloc();
-    ret1 = avcodec_receive_packet(ctx_, packet);
-    if(ret1 < 0) {
-        LogError("AAC: avcodec_receive_packet ret:%d", ret1);
-        av_packet_free(&packet);
-        *pkt_frame = 0;
-        if(ret1 == AVERROR(EAGAIN)) {                       // 需要继续发送 frame 我们才有packet读取
-            *ret = RET_ERR_EAGAIN;
-            return NULL;
-        }else if(ret1 == AVERROR_EOF) {
-            *ret = RET_ERR_EOF;                             // 不能在读取出来packet来了，读到文件尾部了，实时视频一般不会
-            return NULL;
-        } else {
-            *ret = RET_FAIL;                                // 真正报错，这个encoder就只能销毁了
-            return NULL;
-        }
-    }else {
-        *ret = RET_OK;
-        return packet;
-    }
-}
-
 /**
  * @brief 采集到的数据是不带adts头部的，需要为aac条件adts头。
  * @param adts_header 7字节的adts头部。
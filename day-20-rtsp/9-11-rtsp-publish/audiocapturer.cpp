@@ -20,11 +20,20 @@ AudioCapturer::~AudioCapturer()
     if(pcm_fp_) {
         fclose(pcm_fp_);
     }
+    if(pattern_) {
+        delete pattern_;
+    }
+    if(shm_) {
+        delete shm_;
+    }
 }
 
 /**
  * @brief 初始化参数。
  * @param properties 参数属性容器，由上层传入。
+ *        "source"      file 读input_pcm_name文件(缺省)，pattern 合成测试音频，shm 从共享内存读取外部采集进程的音频
+ *        "shm_name"    共享内存名字，缺省/push_audio，"shm_timeout" 等待采集进程的时长，缺省5000ms
+ *        "pattern" "frequency" "amplitude_db"等 测试音频的参数，见AudioPattern::Init
  * @return success 0 fail return a negative number。
  */
 RET_CODE AudioCapturer::Init(const Properties properties)
@@ -38,6 +47,7 @@ RET_CODE AudioCapturer::Init(const Properties properties)
 
     nb_samples_         = properties.GetProperty("nb_samples", 1024);
     format_             = properties.GetProperty("format", AV_SAMPLE_FMT_S16);
+    source_             = properties.GetProperty("source", "file");
 
     // 计算一帧所占大小，必须是根据传入参数去计算
     pcm_buf_size_       = byte_per_sample_ * channels_ *  nb_samples_;
@@ -47,7 +57,29 @@ RET_CODE AudioCapturer::Init(const Properties properties)
         return RET_ERR_OUTOFMEMORY;
     }
 
-    if(openPcmFile(input_pcm_name_.c_str()) < 0)
+    if(source_ == "pattern") {
+        if(byte_per_sample_ != 2) {
+            LogError("audio pattern only supports s16, byte_per_sample: %d", byte_per_sample_);
+            return RET_ERR_NOT_SUPPORT;
+        }
+        pattern_ = new AudioPattern();
+        if(pattern_->Init(properties) != RET_OK) {
+            LogError("AudioPattern Init failed");
+            return RET_FAIL;
+        }
+    }
+    else if(source_ == "shm") {
+        shm_name_ = properties.GetProperty("shm_name", "/push_audio");
+        shm_ = new ShmRing();
+        if(shm_->Open(shm_name_, properties.GetProperty("shm_timeout", 5000)) != RET_OK) {
+            LogError("open shm %s failed", shm_name_.c_str());
+            return RET_FAIL;
+        }
+        if(checkShmFormat() != RET_OK) {
+            return RET_ERR_PARAMISMATCH;
+        }
+    }
+    else if(openPcmFile(input_pcm_name_.c_str()) < 0)
     {
         LogError("openPcmFile %s failed", input_pcm_name_.c_str());
         return RET_FAIL;
@@ -72,6 +104,10 @@ void AudioCapturer::Loop()
         if(request_abort_) {
             break;                                          // 请求退出
         }
+        if(shm_) {
+            readShm();                                      // 没有数据时在共享内存上等待，不需要sleep
+            continue;
+        }
 
         if(readPcmFile(pcm_buf_, pcm_buf_size_) == 0) {
             // 打印采集首帧视频的时间戳，方便对比编码、推流时的时间戳，以获取延时，方便debug。
@@ -129,6 +165,11 @@ int AudioCapturer::readPcmFile(uint8_t *pcm_buf, int32_t pcm_buf_size)
      }                                                      // 给人以为卡顿；后者可以是因为发送的数据已经都是完整的帧，客户端只需要缓存接收进行播放即可
 
     // 读取数据
+    if(pattern_) {
+        pattern_->Fill((int16_t *)pcm_buf_, nb_samples_);
+        pcm_total_duration_ += frame_duration_;
+        return 0;
+    }
     size_t ret = fread(pcm_buf_, 1, pcm_buf_size, pcm_fp_);
     if(ret != pcm_buf_size) {                               // 可能读到尾部或者真的读取数据失败
         ret = fseek(pcm_fp_, 0, SEEK_SET);                  // seek到文件起始
@@ -142,6 +183,96 @@ int AudioCapturer::readPcmFile(uint8_t *pcm_buf, int32_t pcm_buf_size)
     return 0;
 }
 
+/**
+ * @brief 从共享内存取一段音频交给编码回调。slot的样本数正好是一帧时直接把slot的地址交给编码回调，不拷贝；
+ *          否则(例如采集进程每10ms写一次)拷贝到pcm_buf_凑够一帧再交给编码回调。
+ *          采集进程退出后每秒尝试重新打开一次，格式与Init时检查的一致才恢复取数据。
+ * @return void。
+ */
+void AudioCapturer::readShm()
+{
+    int64_t now = TimesUtil::GetTimeMillisecond();
+    if(!shm_->GetHeader()) {
+        msleep(100);                                    // 重新打开失败，Acquire不会等待
+    }
+    const ShmSlot *slot = shm_->Acquire(100);
+    if(!slot) {
+        if(now - shm_frame_time_ > 1000 && !shm_->ProducerAlive()) {
+            LogWarn("shm %s producer is gone, reopen", shm_name_.c_str());
+            // 重启后的采集进程可能换了格式，与Init一样检查，不一致时关闭，下一秒再试
+            if(shm_->Open(shm_name_, 0) == RET_OK && checkShmFormat() != RET_OK) {
+                shm_->Close();
+            }
+            shm_frame_time_ = now;
+            pcm_fill_ = 0;
+        }
+        return;
+    }
+    shm_frame_time_ = now;
+    if(!is_first_time_) {
+        is_first_time_ = true;
+        LogInfo("%s:t%u", AVPublishTime::GetInstance()->getAInTag(),
+                AVPublishTime::GetInstance()->getCurrenTime());
+    }
+
+    uint8_t *data = shm_->GetData(slot);
+    int32_t size = slot->size < (int32_t)shm_->GetHeader()->data_size ? slot->size : (int32_t)shm_->GetHeader()->data_size;
+    if(size == pcm_buf_size_ && pcm_fill_ == 0) {
+        if(callback_get_pcm_) {
+            callback_get_pcm_(data, size);
+        }
+    } else {
+        while(size > 0) {
+            int32_t n = pcm_buf_size_ - pcm_fill_ < size ? pcm_buf_size_ - pcm_fill_ : size;
+            memcpy(pcm_buf_ + pcm_fill_, data, n);
+            pcm_fill_ += n;
+            data += n;
+            size -= n;
+            if(pcm_fill_ == pcm_buf_size_) {
+                if(callback_get_pcm_) {
+                    callback_get_pcm_(pcm_buf_, pcm_buf_size_);
+                }
+                pcm_fill_ = 0;
+            }
+        }
+    }
+    shm_->Release();
+    logShmStats();
+}
+
+/**
+ * @brief 检查共享内存的格式，每个slot的样本数可以与编码帧不同，但是采样率、声道数与采样格式必须与编码器的配置一致。
+ * @return 成功 0 失败 other
+ */
+RET_CODE AudioCapturer::checkShmFormat()
+{
+    const ShmRingHeader *header = shm_->GetHeader();
+    if(header->media_type != E_AUDIO_TYPE || header->sample_rate != sample_rate_ || header->channels != channels_
+            || header->sample_format != format_) {
+        LogError("shm %s format %dHz %dch fmt %d mismatch, need %dHz %dch fmt %d", shm_name_.c_str(),
+                 header->sample_rate, header->channels, header->sample_format, sample_rate_, channels_, format_);
+        return RET_ERR_PARAMISMATCH;
+    }
+    return RET_OK;
+}
+
+/**
+ * @brief 每10秒打印一次共享内存采集的统计。
+ * @return void。
+ */
+void AudioCapturer::logShmStats()
+{
+    int64_t now = TimesUtil::GetTimeMillisecond();
+    if(now - pre_shm_stats_time_ < 10000) {
+        return;
+    }
+    ShmRingStats stats;
+    shm_->GetStats(&stats);
+    LogInfo("audio shm: slots-%lld, producer dropped-%u, ingest latency avg-%lldus max-%lldus",
+            stats.slots, stats.dropped, stats.slots > 0 ? stats.latency_sum / stats.slots : 0, stats.max_latency);
+    pre_shm_stats_time_ = now;
+}
+
 /**
  * @brief 关闭一个已经打开的文件。
  * @return no mean。
@@ -150,5 +281,6 @@ int AudioCapturer::closePcmFile()
 {
     if(pcm_fp_)
         fclose(pcm_fp_);
+    pcm_fp_ = NULL;                                         // 析构时不再重复关闭
     return 0;
 }
@@ -4,6 +4,8 @@
 #include <functional>
 #include "commonlooper.h"
 #include "mediabase.h"
+#include "testpattern.h"
+#include "shmring.h"
 using std::function;
 
 class AudioCapturer : public CommonLooper
@@ -29,6 +31,18 @@ private:
     int audio_test_ = 0;                                            // 该字段目前意义不大，只是表示一种模式，例如测试模式
     std::string input_pcm_name_;                                    // 输入pcm测试文件的名字
     FILE *pcm_fp_ = NULL;                                           // 输入pcm的测试文件
+    std::string source_;                                            // file 读pcm文件，pattern 合成测试音频，shm 共享内存
+    AudioPattern *pattern_ = NULL;                                  // source_为pattern时生成测试音频，只支持s16
+
+    // 共享内存采集，外部采集进程写入，详看ShmRing
+    void readShm();
+    RET_CODE checkShmFormat();
+    void logShmStats();
+    ShmRing *shm_ = NULL;
+    std::string shm_name_;
+    int32_t pcm_fill_ = 0;                                          // slot的样本数与编码帧不一致时，pcm_buf_中已经凑到的字节数
+    int64_t shm_frame_time_ = 0;
+    int64_t pre_shm_stats_time_ = 0;
     int64_t pcm_start_time_ = 0;                                    // 记录采集到首帧时的时间，单位ms。
     double pcm_total_duration_ = 0;                                 // 推流时长的统计
     //double frame_duration_ = 23.2;                                // 一帧时长，23.2表示默认是44100hz.
@@ -0,0 +1,36 @@
+﻿#include <string.h>
+#include "audioconvert.h"
+#include "dlog.h"
+
+RET_CODE AudioConvertS16(const int16_t *s16, int nb_samples, int channels, AVSampleFormat dst_fmt, uint8_t *dst)
+{
+    int total = nb_samples * channels;
+    switch(dst_fmt) {
+    case AV_SAMPLE_FMT_S16:
+        memcpy(dst, s16, total * sizeof(int16_t));
+        break;
+    case AV_SAMPLE_FMT_FLT: {
+        float *flt = (float *)dst;
+        for(int i = 0; i < total; i++) {
+            flt[i] = s16[i] / 32768.0f;
+        }
+        break;
+    }
+    case AV_SAMPLE_FMT_FLTP: {
+        // 除以32768的原因是：需要将s16两字节的内容转成浮点数比例(-1~1)，有符号的两字节是：0x7fff=32767,0~32767共32768个，故除以它。
+        float *fltp = (float *)dst;
+        for(int ch = 0; ch < channels; ch++) {
+            float *plane = fltp + ch * nb_samples;
+            const int16_t *src = s16 + ch;
+            for(int i = 0; i < nb_samples; i++) {
+                plane[i] = src[i * channels] / 32768.0f;
+            }
+        }
+        break;
+    }
+    default:
+        LogError("unsupported sample format: %s", av_get_sample_fmt_name(dst_fmt));
+        return RET_ERR_NOT_SUPPORT;
+    }
+    return RET_OK;
+}
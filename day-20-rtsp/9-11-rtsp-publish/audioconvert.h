@@ -0,0 +1,22 @@
+﻿#ifndef AUDIOCONVERT_H
+#define AUDIOCONVERT_H
+
+#include <stdint.h>
+#include "mediabase.h"
+extern "C" {
+#include <libavutil/samplefmt.h>
+}
+
+/**
+ * @brief 把采集的交错s16转换成编码器需要的采样格式，aac与opus共用。
+ *          支持AV_SAMPLE_FMT_FLTP(aac)、AV_SAMPLE_FMT_FLT与AV_SAMPLE_FMT_S16(opus，直接拷贝)。
+ * @param s16 交错的s16样本。
+ * @param nb_samples 每个通道的样本数。
+ * @param channels 通道数。
+ * @param dst_fmt 目标格式。
+ * @param dst 输出缓冲区，planar格式时各个通道依次紧凑存放，大小由av_samples_get_buffer_size(align=1)得到。
+ * @return 成功 0 失败 other
+ */
+RET_CODE AudioConvertS16(const int16_t *s16, int nb_samples, int channels, AVSampleFormat dst_fmt, uint8_t *dst);
+
+#endif // AUDIOCONVERT_H
@@ -0,0 +1,54 @@
+﻿#ifndef AUDIOENCODER_H
+#define AUDIOENCODER_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+#include "mediabase.h"
+
+// 音频编码器的基类，AACEncoder、OpusEncoder只负责打开各自的编码器，编码与参数的获取是相同的
+class AudioEncoder
+{
+public:
+    AudioEncoder();
+    virtual ~AudioEncoder();
+
+    virtual RET_CODE Init(const Properties &properties) = 0;
+
+    virtual AVPacket *Encode(AVFrame *frame, const int64_t pts, int flush, int *pkt_frame, RET_CODE *ret);
+
+    // 获取编码器内部的一些信息，注意最好别从本类的成员去返回，应该从编码器内部返回，因为都已经初始化编码器完毕并且在使用了
+    virtual int GetFormat() {
+        return ctx_->sample_fmt;
+    }
+    virtual int GetChannels() {
+        return ctx_->channels;
+    }
+    virtual int GetChannelLayout() {
+        return ctx_->channel_layout;
+    }
+    virtual int GetFrameSamples() {         // 一帧的采样点数量，只是说的一个通道，例如aac 1024，opus 20ms在48khz时是960
+        return ctx_->frame_size;
+    }
+    virtual int GetSampleRate() {           // 一秒的采样点数量，只是说的一个通道，即采用频率，例如48khz
+        return ctx_->sample_rate;
+    }
+    // 一帧占用的字节数
+    virtual int GetFrameBytes() {
+        return av_get_bytes_per_sample(ctx_->sample_fmt) * ctx_->channels * ctx_->frame_size;// frame_size是一帧的采样点数
+    }
+    virtual double GetAlgorithmicDelay();   // 一帧的时长加上编码器的预读，单位ms
+
+    AVCodecContext *GetCodecContext() {
+        return ctx_;
+    }
+    AVCodecID GetCodecId() {
+        return ctx_->codec_id;
+    }
+
+protected:
+    AVCodec *codec_         = NULL;
+    AVCodecContext  *ctx_   = NULL;
+};
+
+#endif // AUDIOENCODER_H
@@ -0,0 +1,543 @@
+﻿#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "audiomixer.h"
+#include "dlog.h"
+#include "timesutil.h"
+#if defined(__AVX2__)
+#define MIXER_USE_AVX2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MIXER_USE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#define MIXER_MIN_GAIN_DB   -96                         // 小于等于它按静音处理
+#define MIXER_MAX_GAIN_DB   6                           // Q14的增益最大不到2.0
+
+static double gainFromDb(double gain_db)
+{
+    if(gain_db <= MIXER_MIN_GAIN_DB) {
+        return 0;
+    }
+    return pow(10.0, std::min(gain_db, (double)MIXER_MAX_GAIN_DB) / 20.0);
+}
+
+static inline int16_t clipS16(int32_t value)
+{
+    return (int16_t)(value > 32767 ? 32767 : (value < -32768 ? -32768 : value));
+}
+
+RET_CODE ParseMixInputs(const std::string &str, std::vector<MixInput> *inputs)
+{
+    inputs->clear();
+    size_t begin = 0;
+    while(begin < str.size()) {
+        size_t end = str.find(',', begin);
+        if(end == std::string::npos) {
+            end = str.size();
+        }
+        std::string item = str.substr(begin, end - begin);
+        MixInput input;
+        input.gain_db = 0;
+        size_t at = item.rfind('@');
+        if(at != std::string::npos) {
+            char *gain_end = NULL;
+            input.gain_db = strtod(item.c_str() + at + 1, &gain_end);
+            if(at + 1 == item.size() || *gain_end != '\0') {
+                LogError("invalid mix input gain: %s", item.c_str());
+                return RET_ERR_PARAMISMATCH;
+            }
+            item = item.substr(0, at);
+        }
+        size_t colon = item.find(':');
+        if(colon != std::string::npos) {
+            input.source = item.substr(0, colon);
+            input.arg = item.substr(colon + 1);
+        }
+        if((input.source != "file" && input.source != "pattern" && input.source != "shm") || input.arg.empty()) {
+            LogError("invalid mix input: %s", item.c_str());
+            return RET_ERR_PARAMISMATCH;
+        }
+        inputs->push_back(input);
+        begin = end + 1;
+    }
+    return RET_OK;
+}
+
+AudioMixer::AudioMixer(): CommonLooper()
+{
+    memset(&stats_, 0, sizeof(stats_));
+}
+
+AudioMixer::~AudioMixer()
+{
+    Stop();
+    for(size_t i = 0; i < sources_.size(); i++) {
+        delete sources_[i];
+    }
+    sources_.clear();
+}
+
+/**
+ * @brief 设置混音的参数。
+ * @param properties "sample_rate" "channels"   输出与所有源的格式，缺省48000、2
+ *                   "nb_samples"               每帧的样本数(每个通道)，与编码器一致，缺省1024
+ *                   "mode"                     float(缺省)或者s16，见类的说明
+ *                   "delay"                    输出时钟比墙上时钟晚的毫秒数，要大于一帧的时长加上采集的抖动，缺省50
+ *                   "tolerance"                时间戳容差，单位ms，缺省20
+ *                   "fade_ms"                  淡入淡出的时长，缺省20
+ * @return 成功 0 失败 other
+ */
+RET_CODE AudioMixer::Init(const Properties &properties)
+{
+    sample_rate_    = properties.GetProperty("sample_rate", 48000);
+    channels_       = properties.GetProperty("channels", 2);
+    nb_samples_     = properties.GetProperty("nb_samples", 1024);
+    std::string mode = properties.GetProperty("mode", "float");
+    delay_          = properties.GetProperty("delay", 50);
+    int tolerance   = properties.GetProperty("tolerance", 20);
+    int fade_ms     = properties.GetProperty("fade_ms", 20);
+    if(sample_rate_ <= 0 || channels_ <= 0 || nb_samples_ <= 0 || (mode != "float" && mode != "s16")
+            || delay_ < 0 || tolerance < 0 || fade_ms < 0) {
+        LogError("invalid sample_rate: %d, channels: %d, nb_samples: %d, mode: %s, delay: %d, tolerance: %d or fade_ms: %d",
+                 sample_rate_, channels_, nb_samples_, mode.c_str(), delay_, tolerance, fade_ms);
+        return RET_ERR_PARAMISMATCH;
+    }
+    float_mode_     = mode == "float";
+    tolerance_      = (int64_t)tolerance * sample_rate_ / 1000;
+    fade_samples_   = std::max(1, fade_ms * sample_rate_ / 1000);
+    capacity_       = std::max((int64_t)sample_rate_, (int64_t)(delay_ + tolerance) * sample_rate_ / 1000 + 4 * nb_samples_);
+    double frame_ms = nb_samples_ * 1000.0 / sample_rate_;
+    if(delay_ < frame_ms) {
+        LogWarn("mixer delay %dms is shorter than a frame %0.1lfms, sources will underrun", delay_, frame_ms);
+    }
+    pcm_.resize(nb_samples_ * channels_);
+    acc_.resize(nb_samples_ * channels_);
+    out_.resize(nb_samples_ * channels_);
+    LogInfo("audio mixer %dHz %dch, frame: %d samples, mode: %s, delay: %dms, tolerance: %dms, fade: %dms",
+            sample_rate_, channels_, nb_samples_, mode.c_str(), delay_, tolerance, fade_ms);
+    return RET_OK;
+}
+
+/**
+ * @brief 增加一个源，在Init之后、Start之前调用。
+ * @param gain_db 增益，MIXER_MIN_GAIN_DB以下为静音，最大MIXER_MAX_GAIN_DB。
+ * @return 源的序号，Push、SetGain使用。
+ */
+int AudioMixer::AddSource(double gain_db)
+{
+    MixerSource *source = new MixerSource();
+    source->fifo.resize(capacity_ * channels_);
+    source->gain = source->target_gain = gainFromDb(gain_db);
+    sources_.push_back(source);
+    return (int)sources_.size() - 1;
+}
+
+/**
+ * @brief 修改一个源的增益，可以在任意线程调用。
+ * @param fade_ms 在这段时间内线性过渡到新的增益，0表示从下一帧开始直接生效。
+ * @return void。
+ */
+void AudioMixer::SetGain(int index, double gain_db, int fade_ms)
+{
+    if(index < 0 || index >= (int)sources_.size()) {
+        return;
+    }
+    MixerSource *source = sources_[index];
+    std::lock_guard<PushMutex> lock(source->mutex);
+    source->target_gain = gainFromDb(gain_db);
+    source->ramp_samples = std::max(0, fade_ms) * sample_rate_ / 1000;
+    source->gain_changed = true;
+}
+
+/**
+ * @brief 送入一个源的数据，在采集线程调用，不会等待混音线程。
+ * @param pcm s16交错。
+ * @param nb_samples 每个通道的样本数，可以与混音的帧长不同。
+ * @param pts 第一个样本的时间戳，TimesUtil::GetTimeMillisecond()的时钟，采集线程可以直接用取到数据的时间。
+ * @return void。
+ */
+void AudioMixer::Push(int index, const int16_t *pcm, int nb_samples, int64_t pts)
+{
+    if(index < 0 || index >= (int)sources_.size() || nb_samples <= 0) {
+        return;
+    }
+    MixerSource *source = sources_[index];
+    int64_t position = pts * sample_rate_ / 1000;
+    int64_t dropped = 0;
+    bool realigned = false;
+    {
+        std::lock_guard<PushMutex> lock(source->mutex);
+        int64_t avail = source->write - source->read;
+        if(!source->aligned) {
+            source->head_position = position - avail;
+            source->aligned = true;
+        } else {
+            int64_t diff = position - (source->head_position + avail);
+            if(diff > tolerance_ && avail > 0 && avail + diff + nb_samples <= capacity_) {
+                // 源中间断了一段，补上静音，已经缓存的数据仍然在原来的位置上
+                writeFifo(source, NULL, (int)diff);
+                realigned = true;
+            } else if(diff > tolerance_ || diff < -tolerance_) {
+                // 源的时间戳回退或者跳得太远，丢弃积压的数据，从新的位置开始
+                dropped += avail;
+                source->read = source->write;
+                source->head_position = position;
+                realigned = true;
+            }
+        }
+        // 混音线程没有取走(还没有启动或者源比输出快)，丢弃最旧的数据
+        int64_t overflow = source->write - source->read + nb_samples - capacity_;
+        if(overflow > 0) {
+            source->read += overflow;
+            source->head_position += overflow;
+            dropped += overflow;
+        }
+        writeFifo(source, pcm, nb_samples);
+    }
+    if(dropped > 0 || realigned) {
+        std::lock_guard<PushMutex> lock(stats_mutex_);
+        stats_.dropped_samples += dropped;
+        stats_.realigns += realigned ? 1 : 0;
+    }
+}
+
+/**
+ * @brief 写入源的环形缓冲，调用者持有源的锁并保证不超过容量。
+ * @param pcm NULL表示写入静音。
+ * @return void。
+ */
+void AudioMixer::writeFifo(MixerSource *source, const int16_t *pcm, int nb_samples)
+{
+    while(nb_samples > 0) {
+        int64_t offset = source->write % capacity_;
+        int n = (int)std::min((int64_t)nb_samples, capacity_ - offset);
+        if(pcm) {
+            memcpy(&source->fifo[offset * channels_], pcm, n * channels_ * sizeof(int16_t));
+            pcm += n * channels_;
+        } else {
+            memset(&source->fifo[offset * channels_], 0, n * channels_ * sizeof(int16_t));
+        }
+        source->write += n;
+        nb_samples -= n;
+    }
+}
+
+/**
+ * @brief 取一个源在一帧中的数据，没有数据的部分为静音，开始或者恢复时淡入，数据中途用完时淡出。
+ * @param position 这一帧第一个样本在输出时钟上的位置。
+ * @param pcm 传出一帧，没有数据的部分清零。
+ * @return 这一帧中最后一个有数据的样本的下一个位置，0表示整帧都是静音(pcm没有写入)。
+ */
+int AudioMixer::pullSource(MixerSource *source, int64_t position, int16_t *pcm)
+{
+    int offset = 0;
+    int n = 0;
+    int64_t dropped = 0;
+    bool underrun = false;
+    {
+        std::lock_guard<PushMutex> lock(source->mutex);
+        if(source->gain_changed) {
+            source->gain_changed = false;
+            if(source->ramp_samples > 0) {
+                source->ramp_left = source->ramp_samples;
+                source->ramp_step = (source->target_gain - source->gain) / source->ramp_samples;
+            } else {
+                source->ramp_left = 0;
+                source->gain = source->target_gain;
+            }
+        }
+        int64_t avail = source->write - source->read;
+        // 过期的样本，追上输出时钟
+        int64_t late = position - source->head_position;
+        if(source->aligned && avail > 0 && late > tolerance_) {
+            dropped = std::min(late, avail);
+            source->read += dropped;
+            source->head_position += dropped;
+            avail -= dropped;
+        }
+        int64_t lead = source->head_position - position;
+        if(!source->aligned || avail == 0 || lead >= nb_samples_) {
+            // 还没有开始的源不算断流
+            underrun = source->active && source->aligned && lead < nb_samples_;
+        } else {
+            offset = lead > 0 ? (int)lead : 0;
+            n = (int)std::min(avail, (int64_t)(nb_samples_ - offset));
+            int left = n;
+            int16_t *dst = pcm + offset * channels_;
+            while(left > 0) {
+                int64_t read_offset = source->read % capacity_;
+                int count = (int)std::min((int64_t)left, capacity_ - read_offset);
+                memcpy(dst, &source->fifo[read_offset * channels_], count * channels_ * sizeof(int16_t));
+                dst += count * channels_;
+                source->read += count;
+                left -= count;
+            }
+            source->head_position += n;
+        }
+    }
+
+    if(n > 0) {
+        memset(pcm, 0, offset * channels_ * sizeof(int16_t));
+        memset(pcm + (offset + n) * channels_, 0, (nb_samples_ - offset - n) * channels_ * sizeof(int16_t));
+        int fade_in = source->active ? 0 : std::min(fade_samples_, n);
+        int fade_out = offset + n < nb_samples_ ? std::min(fade_samples_, n) : 0;
+        int16_t *data = pcm + offset * channels_;
+        for(int i = 0; i < fade_in; i++) {
+            double k = (double)(i + 1) / (fade_in + 1);
+            for(int c = 0; c < channels_; c++) {
+                data[i * channels_ + c] = (int16_t)lrint(data[i * channels_ + c] * k);
+            }
+        }
+        for(int i = 0; i < fade_out; i++) {
+            double k = (double)(fade_out - i) / (fade_out + 1);
+            int16_t *sample = data + (n - fade_out + i) * channels_;
+            for(int c = 0; c < channels_; c++) {
+                sample[c] = (int16_t)lrint(sample[c] * k);
+            }
+        }
+        underrun = fade_out > 0;
+        source->active = !underrun;
+    } else {
+        source->active = false;
+    }
+    if(dropped > 0 || underrun) {
+        std::lock_guard<PushMutex> lock(stats_mutex_);
+        stats_.dropped_samples += dropped;
+        stats_.underruns += underrun ? 1 : 0;
+    }
+    return n > 0 ? offset + n : 0;
+}
+
+/**
+ * @brief 处理一帧的增益。过渡中时逐样本乘上线性变化的增益(标量，只在过渡的几帧)，之后按增益1混音；
+ *        否则返回固定的增益，由SIMD的混音核心相乘。
+ * @param pcm 一帧数据，NULL表示这一帧是静音，只推进过渡。
+ * @param unity 传出，true表示增益已经作用在pcm上。
+ * @param gain 传出，unity为false时混音使用的增益。
+ * @return void。
+ */
+void AudioMixer::applyGain(MixerSource *source, int16_t *pcm, int count, bool *unity, double *gain)
+{
+    *unity = false;
+    if(source->ramp_left <= 0) {
+        *gain = source->gain;
+        return;
+    }
+    int frames = count / channels_;
+    int ramp = std::min(source->ramp_left, frames);
+    if(pcm) {
+        for(int i = 0; i < frames; i++) {
+            double k = i < ramp ? source->gain + source->ramp_step * (i + 1) : source->target_gain;
+            for(int c = 0; c < channels_; c++) {
+                pcm[i * channels_ + c] = clipS16((int32_t)lrint(pcm[i * channels_ + c] * k));
+            }
+        }
+    }
+    source->ramp_left -= ramp;
+    source->gain = source->ramp_left > 0 ? source->gain + source->ramp_step * ramp : source->target_gain;
+    *unity = true;
+    *gain = 1.0;
+}
+
+/**
+ * @brief 生成一帧混音，在混音线程调用，也可以直接调用(基准测试)。
+ * @param out 传出一帧s16交错，nb_samples*channels个样本。
+ * @param position 第一个样本在Push时间戳的时钟上的位置，即时间戳(ms)*sample_rate/1000，连续调用时每次加nb_samples。
+ * @return void。
+ */
+void AudioMixer::Mix(int16_t *out, int64_t position)
+{
+    int64_t begin = TimesUtil::GetTimeMicrosecond();
+    int count = nb_samples_ * channels_;
+    if(float_mode_) {
+        memset(&acc_[0], 0, count * sizeof(float));
+    } else {
+        memset(out, 0, count * sizeof(int16_t));
+    }
+    for(size_t i = 0; i < sources_.size(); i++) {
+        MixerSource *source = sources_[i];
+        int end = pullSource(source, position, &pcm_[0]);
+        bool unity = false;
+        double gain = 1.0;
+        applyGain(source, end > 0 ? &pcm_[0] : NULL, count, &unity, &gain);
+        if(end == 0 || gain == 0) {
+            continue;
+        }
+        // end之后都是静音，不需要混
+        if(float_mode_) {
+            AccumulateFloat(&acc_[0], &pcm_[0], end * channels_, (float)gain);
+        } else {
+            AccumulateS16(out, &pcm_[0], end * channels_, std::min(32767, (int)lrint(gain * 16384)));
+        }
+    }
+    if(float_mode_) {
+        FloatToS16(out, &acc_[0], count);
+    }
+    std::lock_guard<PushMutex> lock(stats_mutex_);
+    stats_.frames++;
+    stats_.mix_time += TimesUtil::GetTimeMicrosecond() - begin;
+}
+
+/**
+ * @brief acc = sat(acc + sat((src*gain_q14 + 8192) >> 14))，gain_q14为16384时直接饱和相加。
+ * @param count 样本数(所有通道)。
+ * @return void。
+ */
+void AudioMixer::AccumulateS16(int16_t *acc, const int16_t *src, int count, int gain_q14)
+{
+    int i = 0;
+#if defined(MIXER_USE_AVX2)
+    __m256i gain = _mm256_set1_epi16((int16_t)gain_q14);
+    __m256i round = _mm256_set1_epi32(1 << 13);
+    for(; i + 16 <= count; i += 16) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i a = _mm256_loadu_si256((const __m256i *)(acc + i));
+        if(gain_q14 != 16384) {
+            // unpack与packs都在128位的lane内，顺序保持不变
+            __m256i lo = _mm256_mullo_epi16(s, gain);
+            __m256i hi = _mm256_mulhi_epi16(s, gain);
+            __m256i p0 = _mm256_srai_epi32(_mm256_add_epi32(_mm256_unpacklo_epi16(lo, hi), round), 14);
+            __m256i p1 = _mm256_srai_epi32(_mm256_add_epi32(_mm256_unpackhi_epi16(lo, hi), round), 14);
+            s = _mm256_packs_epi32(p0, p1);
+        }
+        _mm256_storeu_si256((__m256i *)(acc + i), _mm256_adds_epi16(a, s));
+    }
+#elif defined(MIXER_USE_SSE2)
+    __m128i gain = _mm_set1_epi16((int16_t)gain_q14);
+    __m128i round = _mm_set1_epi32(1 << 13);
+    for(; i + 8 <= count; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i a = _mm_loadu_si128((const __m128i *)(acc + i));
+        if(gain_q14 != 16384) {
+            __m128i lo = _mm_mullo_epi16(s, gain);
+            __m128i hi = _mm_mulhi_epi16(s, gain);
+            __m128i p0 = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), round), 14);
+            __m128i p1 = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), round), 14);
+            s = _mm_packs_epi32(p0, p1);
+        }
+        _mm_storeu_si128((__m128i *)(acc + i), _mm_adds_epi16(a, s));
+    }
+#endif
+    for(; i < count; i++) {
+        int32_t s = gain_q14 != 16384 ? clipS16((src[i] * gain_q14 + (1 << 13)) >> 14) : src[i];
+        acc[i] = clipS16(acc[i] + s);
+    }
+}
+
+/**
+ * @brief acc += src*gain。
+ * @param count 样本数(所有通道)。
+ * @return void。
+ */
+void AudioMixer::AccumulateFloat(float *acc, const int16_t *src, int count, float gain)
+{
+    int i = 0;
+#if defined(MIXER_USE_AVX2)
+    __m256 g = _mm256_set1_ps(gain);
+    for(; i + 16 <= count; i += 16) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256 f0 = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(s)));
+        __m256 f1 = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(s, 1)));
+        _mm256_storeu_ps(acc + i, _mm256_add_ps(_mm256_loadu_ps(acc + i), _mm256_mul_ps(f0, g)));
+        _mm256_storeu_ps(acc + i + 8, _mm256_add_ps(_mm256_loadu_ps(acc + i + 8), _mm256_mul_ps(f1, g)));
+    }
+#elif defined(MIXER_USE_SSE2)
+    __m128 g = _mm_set1_ps(gain);
+    for(; i + 8 <= count; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        // 与自己交错后算术右移16位，符号扩展成32位
+        __m128 f0 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+        __m128 f1 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+        _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(f0, g)));
+        _mm_storeu_ps(acc + i + 4, _mm_add_ps(_mm_loadu_ps(acc + i + 4), _mm_mul_ps(f1, g)));
+    }
+#endif
+    for(; i < count; i++) {
+        acc[i] += src[i] * gain;
+    }
+}
+
+/**
+ * @brief float转成s16，按当前的舍入模式(缺省四舍六入五成双)取整，超出范围的饱和。
+ * @param count 样本数(所有通道)。
+ * @return void。
+ */
+void AudioMixer::FloatToS16(int16_t *out, const float *acc, int count)
+{
+    int i = 0;
+#if defined(MIXER_USE_AVX2)
+    for(; i + 16 <= count; i += 16) {
+        __m256i p0 = _mm256_cvtps_epi32(_mm256_loadu_ps(acc + i));
+        __m256i p1 = _mm256_cvtps_epi32(_mm256_loadu_ps(acc + i + 8));
+        // packs在lane内交错，恢复成顺序
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(p0, p1), 0xD8);
+        _mm256_storeu_si256((__m256i *)(out + i), packed);
+    }
+#elif defined(MIXER_USE_SSE2)
+    for(; i + 8 <= count; i += 8) {
+        __m128i p0 = _mm_cvtps_epi32(_mm_loadu_ps(acc + i));
+        __m128i p1 = _mm_cvtps_epi32(_mm_loadu_ps(acc + i + 4));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(p0, p1));
+    }
+#endif
+    for(; i < count; i++) {
+        float v = std::max(-32768.0f, std::min(32767.0f, acc[i]));
+        out[i] = (int16_t)lrintf(v);
+    }
+}
+
+/**
+ * @brief 混音线程，按墙上时钟每帧输出一次，不等待源。
+ * @return void。
+ */
+void AudioMixer::Loop()
+{
+    LogInfo("into loop");
+    double frame_duration = nb_samples_ * 1000.0 / sample_rate_;
+    double total_duration = 0;
+    int64_t start_time = TimesUtil::GetTimeMillisecond();
+    int64_t position = (start_time - delay_) * sample_rate_ / 1000;
+    pre_stats_time_ = start_time;
+    while(!request_abort_) {
+        int64_t now = TimesUtil::GetTimeMillisecond();
+        if((int64_t)total_duration > now - start_time) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            continue;
+        }
+        Mix(&out_[0], position);
+        position += nb_samples_;
+        total_duration += frame_duration;
+        if(callback_) {
+            callback_((uint8_t *)&out_[0], (int32_t)(out_.size() * sizeof(int16_t)));
+        }
+        if(now - pre_stats_time_ > 10000) {
+            logStats();
+            pre_stats_time_ = now;
+        }
+    }
+    LogInfo("leave loop");
+}
+
+void AudioMixer::AddCallback(std::function<void(uint8_t *, int32_t)> callback)
+{
+    callback_ = callback;
+}
+
+void AudioMixer::GetStats(AudioMixerStats *stats)
+{
+    std::lock_guard<PushMutex> lock(stats_mutex_);
+    *stats = stats_;
+    memset(&stats_, 0, sizeof(stats_));
+}
+
+void AudioMixer::logStats()
+{
+    AudioMixerStats stats;
+    GetStats(&stats);
+    LogInfo("mixer: %d sources, frames-%lld, underruns-%lld, realigns-%lld, dropped-%lld samples, mix avg-%lldus",
+            (int)sources_.size(), stats.frames, stats.underruns, stats.realigns, stats.dropped_samples,
+            stats.frames > 0 ? stats.mix_time / stats.frames : 0);
+}
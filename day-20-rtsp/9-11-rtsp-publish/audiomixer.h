@@ -0,0 +1,121 @@
+﻿#ifndef AUDIOMIXER_H
+#define AUDIOMIXER_H
+
+#include <stdint.h>
+#include <functional>
+#include <mutex>
+#include "instrument.h"
+#include <string>
+#include <vector>
+#include "commonlooper.h"
+#include "mediabase.h"
+
+// 混音的统计信息，GetStats之后清零
+typedef struct audio_mixer_stats
+{
+    int64_t frames;                                     // 输出的帧数
+    int64_t underruns;                                  // 某个源在输出时数据不够而补静音的次数(不包括还没有开始的源)
+    int64_t realigns;                                   // 源的时间戳偏离超过容差而重新对齐的次数
+    int64_t dropped_samples;                            // 源落后输出时钟太多或者积压太多而丢弃的样本数(每个通道)
+    int64_t mix_time;                                   // Mix的总耗时，单位us
+}AudioMixerStats;
+
+// 混音的一路输入
+typedef struct mix_input
+{
+    std::string source;                                 // file、pattern或者shm，与AudioCapturer的source相同
+    std::string arg;                                    // file为pcm文件名，pattern为测试音频的类型，shm为共享内存名字
+    double gain_db;
+}MixInput;
+
+/**
+ * @brief 解析混音输入的配置，格式为"source:arg@增益dB"，增益可以省略(0dB)，多路用逗号分隔，
+ *        例如"file:bgm_48k_2ch_s16.pcm@-12,pattern:beep@-6"。
+ * @return 成功 0 失败 other
+ */
+RET_CODE ParseMixInputs(const std::string &str, std::vector<MixInput> *inputs);
+
+/**
+ * 多路s16交错pcm的混音，把麦克风与一路或者多路背景音、节目音混成一路再交给编码，格式(采样率、通道数)必须一致。
+ * 1）输出时钟：混音线程按墙上时钟每帧输出一次(与AudioCapturer的节奏相同)，不等待任何一个源，
+ *    源没有数据(断流、还没有开始)时这一路按静音处理，输出不会卡住。
+ * 2）时间戳对齐：每个源Push时带上第一个样本的时间戳(ms，TimesUtil::GetTimeMillisecond()的时钟)，
+ *    源的数据按时间戳放在输出时钟上，输出时钟比墙上时钟晚delay毫秒，吸收采集线程的抖动。
+ *    偏差在tolerance之内时按连续的样本处理，不因为抖动插入或者丢弃样本；超过时重新对齐：
+ *    源超前(中间断了一段)补静音，源回退则丢弃积压的数据；源落后输出时钟超过tolerance时丢弃过期的样本追上输出。
+ * 3）增益与淡入淡出：每个源有自己的增益(dB)，SetGain可以在fade_ms内线性过渡；源开始或者断流后恢复时淡入，
+ *    数据在一帧的中间用完时把剩下的部分淡出，避免爆音。
+ * 4）混音：mode为s16时每一路先按Q14的增益缩放再饱和相加(SSE2 _mm_adds_epi16，AVX2一次16个样本)，最快，
+ *    但是多路同时很响时每一步都会削波，结果与相加的顺序有关；mode为float时用float累加，最后一次性饱和转换成s16，
+ *    只在最终的和超出范围时削波，路数多时推荐。s16模式的SIMD与标量实现的结果完全一致。
+ *
+ * Push在采集线程调用，Mix在混音线程调用，每个源一个锁，只在拷贝数据时持有。
+ */
+class AudioMixer : public CommonLooper
+{
+public:
+    AudioMixer();
+    virtual ~AudioMixer();
+
+    RET_CODE Init(const Properties &properties);
+    int AddSource(double gain_db);                      // 在Init之后、Start之前调用，返回源的序号
+    void SetGain(int index, double gain_db, int fade_ms);
+    void Push(int index, const int16_t *pcm, int nb_samples, int64_t pts);
+    void Mix(int16_t *out, int64_t position);           // 生成position(Push时间戳的时钟上的样本序号)开始的一帧
+    virtual void Loop();
+    void AddCallback(std::function<void(uint8_t *, int32_t)> callback);
+    void GetStats(AudioMixerStats *stats);
+
+    inline int GetFrameSamples() {
+        return nb_samples_;
+    }
+
+    // 混音的核心，count为样本数(所有通道)
+    static void AccumulateS16(int16_t *acc, const int16_t *src, int count, int gain_q14);   // acc = sat(acc + sat(src*gain))
+    static void AccumulateFloat(float *acc, const int16_t *src, int count, float gain);    // acc += src*gain
+    static void FloatToS16(int16_t *out, const float *acc, int count);                     // 四舍五入(偶数)并饱和
+
+private:
+    typedef struct mixer_source
+    {
+        PushMutex mutex{PUSH_LOCK_SITE("audio_mixer_source")};
+        std::vector<int16_t> fifo;                      // 环形缓冲，按样本(每个通道)计数的读写位置
+        int64_t read = 0;
+        int64_t write = 0;
+        int64_t head_position = 0;                      // fifo中第一个样本在输出时钟上的位置
+        bool aligned = false;                           // 已经按时间戳对齐
+        bool active = false;                            // 上一帧有输出，没有时下一次有数据要淡入
+        double target_gain = 1.0;                       // SetGain设置，持有锁访问
+        int ramp_samples = 0;                           // 过渡到target_gain需要的样本数，0表示立即生效
+        bool gain_changed = false;
+        double gain = 1.0;                              // 以下只在混音线程访问
+        double ramp_step = 0;
+        int ramp_left = 0;
+    }MixerSource;
+
+    void writeFifo(MixerSource *source, const int16_t *pcm, int nb_samples);
+    int pullSource(MixerSource *source, int64_t position, int16_t *pcm);
+    void applyGain(MixerSource *source, int16_t *pcm, int count, bool *unity, double *gain);
+    void logStats();
+
+    int sample_rate_ = 48000;
+    int channels_ = 2;
+    int nb_samples_ = 1024;
+    bool float_mode_ = true;
+    int delay_ = 50;                                    // 输出时钟比墙上时钟晚的毫秒数
+    int64_t tolerance_ = 960;                           // 时间戳容差，单位样本
+    int fade_samples_ = 960;
+    int64_t capacity_ = 48000;                          // 每个源最多缓存的样本数
+
+    std::vector<MixerSource *> sources_;
+    std::vector<int16_t> pcm_;                          // 一个源的一帧
+    std::vector<float> acc_;                            // float模式的累加
+    std::vector<int16_t> out_;
+
+    PushMutex stats_mutex_{PUSH_LOCK_SITE("audio_mixer_stats")};
+    AudioMixerStats stats_;
+    int64_t pre_stats_time_ = 0;
+    std::function<void(uint8_t *, int32_t)> callback_ = NULL;
+};
+
+#endif // AUDIOMIXER_H
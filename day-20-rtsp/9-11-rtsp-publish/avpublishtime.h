@@ -43,6 +43,11 @@ public:
         start_time_ = getCurrentTimeMsec();
     }
 
+    // 开始时间，单位ms。pts加上它就是采集时的墙上时钟，用于HLS的EXT-X-PROGRAM-DATE-TIME
+    int64_t getStartTime() {
+        return start_time_;
+    }
+
     // 设置帧时长，并且更新帧时长的误差阈值
     void set_audio_frame_duration(const double frame_duration) {
         audio_frame_duration_ = frame_duration;
@@ -0,0 +1,490 @@
+﻿#include <string.h>
+#include <thread>
+#include <chrono>
+#include "demuxsource.h"
+#include "dlog.h"
+#include "timesutil.h"
+#include "avpublishtime.h"
+#include "nalparser.h"
+#include "instrument.h"
+
+#define DEMUX_MAX_JUMP  5000                            // 直播源的时间戳向前跳变超过该值(ms)认为不连续
+
+DemuxSource::DemuxSource()
+{
+    memset(&stats_, 0, sizeof(stats_));
+}
+
+DemuxSource::~DemuxSource()
+{
+    Stop();
+    closeInput();
+    if(video_ctx_) {
+        avcodec_free_context(&video_ctx_);
+    }
+    if(audio_ctx_) {
+        avcodec_free_context(&audio_ctx_);
+    }
+    if(timer_) {
+        delete timer_;
+        timer_ = NULL;
+    }
+}
+
+/**
+ * @brief 打开输入，找到H.264视频流与AAC/Opus音频流，构造用于配置各个输出的上下文。在调用线程中同步打开，失败直接返回。
+ * @param properties "url"                  文件路径或者rtsp://等网络地址
+ *                   "loop"                 文件读完后是否从头循环，缺省1
+ *                   "realtime"             是否按时间戳的节奏输出，缺省-1：文件为1，网络输入为0
+ *                   "rtsp_transport"       rtsp输入的传输方式，缺省tcp
+ *                   "timeout"              打开与读取的超时，单位ms，缺省5000
+ *                   "reconnect_interval"   网络输入断开后重连的间隔，单位ms，缺省1000
+ * @return 成功 0 失败 other
+ */
+RET_CODE DemuxSource::Init(const Properties &properties)
+{
+    url_                = properties.GetProperty("url", "");
+    loop_               = properties.GetProperty("loop", 1);
+    rtsp_transport_     = properties.GetProperty("rtsp_transport", "tcp");
+    timeout_            = properties.GetProperty("timeout", 5000);
+    reconnect_interval_ = properties.GetProperty("reconnect_interval", 1000);
+    if(url_.empty()) {
+        LogError("url is empty");
+        return RET_ERR_PARAMISMATCH;
+    }
+    network_ = url_.find("://") != std::string::npos && url_.compare(0, 5, "file:") != 0;
+    realtime_ = properties.GetProperty("realtime", -1);
+    if(realtime_ < 0) {
+        realtime_ = network_ ? 0 : 1;
+    }
+    timer_ = new InterruptTimer(timeout_);
+    RET_CODE ret = openInput();
+    if(ret != RET_OK) {
+        return ret;
+    }
+    LogInfo("demux source %s: video %dx%d@%d%s, realtime: %d, loop: %d", url_.c_str(), video_ctx_->width,
+            video_ctx_->height, fps_, audio_ctx_ ? (audio_ctx_->codec_id == AV_CODEC_ID_AAC ? " + aac" : " + opus") : "",
+            realtime_, loop_);
+    return RET_OK;
+}
+
+void DemuxSource::AddCallback(std::function<void (AVPacket *, MediaType)> callback)
+{
+    callback_ = callback;
+}
+
+/**
+ * @brief 获取统计，只在本类线程停止后或者本类线程中调用。
+ * @param stats 传出。
+ * @return void。
+ */
+void DemuxSource::GetStats(DemuxSourceStats *stats)
+{
+    *stats = stats_;
+}
+
+int DemuxSource::interruptCallback(void *opaque)
+{
+    DemuxSource *source = (DemuxSource *)opaque;
+    if(source->request_abort_) {
+        return 1;                                       // Stop时不用等到超时
+    }
+    return InterruptTimer::Callback(source->timer_);
+}
+
+/**
+ * @brief 打开输入并创建比特流过滤器，第一次打开时构造输出用的上下文，重连时检查流参数没有变化。
+ * @return 成功 0 失败 other
+ */
+RET_CODE DemuxSource::openInput()
+{
+    char str_error[512] = {0};
+    fmt_ctx_ = avformat_alloc_context();
+    if(!fmt_ctx_) {
+        LogError("avformat_alloc_context failed");
+        return RET_ERR_OUTOFMEMORY;
+    }
+    fmt_ctx_->interrupt_callback.callback = interruptCallback;
+    fmt_ctx_->interrupt_callback.opaque = this;
+    AVDictionary *options = NULL;
+    if(url_.compare(0, 7, "rtsp://") == 0) {
+        av_dict_set(&options, "rtsp_transport", rtsp_transport_.c_str(), 0);
+    }
+    timer_->Reset();
+    int ret = avformat_open_input(&fmt_ctx_, url_.c_str(), NULL, &options);     // 失败时会释放fmt_ctx_
+    av_dict_free(&options);
+    if(ret < 0) {
+        av_strerror(ret, str_error, sizeof(str_error) - 1);
+        LogError("avformat_open_input %s failed: %s", url_.c_str(), str_error);
+        return RET_FAIL;
+    }
+    timer_->Reset();
+    ret = avformat_find_stream_info(fmt_ctx_, NULL);
+    if(ret < 0) {
+        av_strerror(ret, str_error, sizeof(str_error) - 1);
+        LogError("avformat_find_stream_info failed: %s", str_error);
+        closeInput();
+        return RET_FAIL;
+    }
+
+    video_index_ = av_find_best_stream(fmt_ctx_, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if(video_index_ < 0 || fmt_ctx_->streams[video_index_]->codecpar->codec_id != AV_CODEC_ID_H264) {
+        LogError("%s has no h264 video stream", url_.c_str());
+        closeInput();
+        return RET_ERR_NOT_SUPPORT;
+    }
+    audio_index_ = av_find_best_stream(fmt_ctx_, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    if(audio_index_ >= 0) {
+        enum AVCodecID codec_id = fmt_ctx_->streams[audio_index_]->codecpar->codec_id;
+        if(codec_id != AV_CODEC_ID_AAC && codec_id != AV_CODEC_ID_OPUS) {
+            LogWarn("audio codec %s is not supported, relay video only", avcodec_get_name(codec_id));
+            audio_index_ = -1;
+        }
+    }
+    AVStream *video_stream = fmt_ctx_->streams[video_index_];
+    AVStream *audio_stream = audio_index_ >= 0 ? fmt_ctx_->streams[audio_index_] : NULL;
+    if(createFilter("h264_mp4toannexb", video_stream, &video_bsf_) != RET_OK
+            || (audio_stream && audio_stream->codecpar->codec_id == AV_CODEC_ID_AAC
+                && createFilter("aac_adtstoasc", audio_stream, &audio_bsf_) != RET_OK)) {
+        closeInput();
+        return RET_FAIL;
+    }
+
+    if(video_ctx_) {
+        // 重连，输出已经按第一次的参数配置好了
+        if(video_bsf_->par_out->width != video_ctx_->width || video_bsf_->par_out->height != video_ctx_->height
+                || (audio_ctx_ != NULL) != (audio_stream != NULL)) {
+            LogError("stream parameters of %s changed after reconnect", url_.c_str());
+            closeInput();
+            return RET_ERR_PARAMISMATCH;
+        }
+        return RET_OK;
+    }
+
+    // 视频，extradata已经是Annex-B格式的sps、pps
+    video_ctx_ = avcodec_alloc_context3(NULL);
+    if(!video_ctx_ || avcodec_parameters_to_context(video_ctx_, video_bsf_->par_out) < 0) {
+        LogError("create video context failed");
+        return RET_FAIL;
+    }
+    if(!video_ctx_->extradata || video_ctx_->extradata_size <= 0) {
+        LogError("sps and pps of %s not found", url_.c_str());
+        return RET_FAIL;
+    }
+    AVRational frame_rate = video_stream->avg_frame_rate.num > 0 ? video_stream->avg_frame_rate : video_stream->r_frame_rate;
+    if(frame_rate.num > 0 && frame_rate.den > 0) {
+        fps_ = (int)(av_q2d(frame_rate) + 0.5);
+    }
+    if(fps_ <= 0 || fps_ > 120) {
+        fps_ = 25;
+    }
+    video_ctx_->time_base = (AVRational){1, fps_};
+    video_ctx_->framerate = (AVRational){fps_, 1};
+    frame_duration_[0] = 1000.0 / fps_;
+
+    // 音频，ts中的aac只有adts头，过滤器要到第一个包才生成extradata，而sdp需要它，这里按AAC LC生成AudioSpecificConfig
+    if(audio_stream) {
+        audio_ctx_ = avcodec_alloc_context3(NULL);
+        if(!audio_ctx_ || avcodec_parameters_to_context(audio_ctx_, audio_stream->codecpar) < 0) {
+            LogError("create audio context failed");
+            return RET_FAIL;
+        }
+        if(AV_CODEC_ID_AAC == audio_ctx_->codec_id && audio_ctx_->extradata_size < 2) {
+            static const int sample_rates[] = {96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+                                               16000, 12000, 11025, 8000, 7350};
+            int freq_idx = 3;
+            for(int i = 0; i < 13; i++) {
+                if(sample_rates[i] == audio_ctx_->sample_rate) {
+                    freq_idx = i;
+                }
+            }
+            int object_type = audio_ctx_->profile >= 0 ? audio_ctx_->profile + 1 : 2;  // FF_PROFILE_AAC_LOW为1
+            av_freep(&audio_ctx_->extradata);
+            audio_ctx_->extradata = (uint8_t *)av_mallocz(2 + AV_INPUT_BUFFER_PADDING_SIZE);
+            if(!audio_ctx_->extradata) {
+                return RET_ERR_OUTOFMEMORY;
+            }
+            audio_ctx_->extradata[0] = (uint8_t)((object_type << 3) | (freq_idx >> 1));
+            audio_ctx_->extradata[1] = (uint8_t)(((freq_idx & 1) << 7) | (audio_ctx_->channels << 3));
+            audio_ctx_->extradata_size = 2;
+        }
+        if(audio_ctx_->frame_size <= 0) {
+            audio_ctx_->frame_size = AV_CODEC_ID_AAC == audio_ctx_->codec_id ? 1024 : audio_ctx_->sample_rate / 50;
+        }
+        audio_ctx_->time_base = (AVRational){1, audio_ctx_->sample_rate};
+        frame_duration_[1] = 1000.0 * audio_ctx_->frame_size / audio_ctx_->sample_rate;
+    }
+    return RET_OK;
+}
+
+void DemuxSource::closeInput()
+{
+    if(video_bsf_) {
+        av_bsf_free(&video_bsf_);
+    }
+    if(audio_bsf_) {
+        av_bsf_free(&audio_bsf_);
+    }
+    if(fmt_ctx_) {
+        avformat_close_input(&fmt_ctx_);
+    }
+}
+
+/**
+ * @brief 为一个流创建比特流过滤器，输入本来就是需要的格式时过滤器原样通过。
+ * @param name 过滤器名字。
+ * @param stream 输入流。
+ * @param bsf 传出。
+ * @return 成功 0 失败 other
+ */
+RET_CODE DemuxSource::createFilter(const char *name, AVStream *stream, AVBSFContext **bsf)
+{
+    const AVBitStreamFilter *filter = av_bsf_get_by_name(name);
+    if(!filter) {
+        LogError("bitstream filter %s not found", name);
+        return RET_ERR_NOT_SUPPORT;
+    }
+    if(av_bsf_alloc(filter, bsf) < 0) {
+        LogError("av_bsf_alloc %s failed", name);
+        return RET_ERR_OUTOFMEMORY;
+    }
+    avcodec_parameters_copy((*bsf)->par_in, stream->codecpar);
+    (*bsf)->time_base_in = stream->time_base;
+    if(av_bsf_init(*bsf) < 0) {
+        LogError("av_bsf_init %s failed", name);
+        av_bsf_free(bsf);
+        return RET_FAIL;
+    }
+    return RET_OK;
+}
+
+/**
+ * @brief 读包线程，网络输入断开时重连，文件读完时按loop_从头开始或者结束线程。
+ * @return void。
+ */
+void DemuxSource::Loop()
+{
+    LogInfo("into loop");
+    pre_stats_time_ = TimesUtil::GetTimeMillisecond();
+    while(!request_abort_) {
+        if(!fmt_ctx_) {
+            if(openInput() != RET_OK) {
+                for(int waited = 0; waited < reconnect_interval_ && !request_abort_; waited += 100) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                }
+                continue;
+            }
+            stats_.reconnects++;
+            LogInfo("reconnect %s ok", url_.c_str());
+        }
+        AVPacket *pkt = av_packet_alloc();
+        timer_->Reset();
+        int ret = av_read_frame(fmt_ctx_, pkt);
+        if(ret < 0) {
+            av_packet_free(&pkt);
+            if(request_abort_) {
+                break;
+            }
+            if(!network_ && AVERROR_EOF == ret && loop_) {
+                rewind();
+                continue;
+            }
+            char str_error[512] = {0};
+            av_strerror(ret, str_error, sizeof(str_error) - 1);
+            if(!network_) {
+                LogInfo("read %s finished: %s", url_.c_str(), str_error);
+                break;
+            }
+            LogWarn("read %s failed: %s, reconnect", url_.c_str(), str_error);
+            closeInput();
+            continue;
+        }
+        PUSH_ALLOC("demux_read_packet", sizeof(AVPacket) + pkt->size);
+        processPacket(pkt);
+
+        int64_t now = TimesUtil::GetTimeMillisecond();
+        if(now - pre_stats_time_ > 10000) {
+            LogInfo("demux: video-%lld, audio-%lld, bytes-%lld, discontinuities-%lld, loops-%lld, reconnects-%lld, max lag-%lldms",
+                    stats_.video_packets, stats_.audio_packets, stats_.bytes, stats_.discontinuities, stats_.loops,
+                    stats_.reconnects, stats_.max_lag);
+            pre_stats_time_ = now;
+        }
+    }
+    LogInfo("leave loop");
+}
+
+/**
+ * @brief 过滤一个读到的包，过滤器可能一次输出0个或多个包。
+ * @param pkt 读到的包，接管。
+ * @return void。
+ */
+void DemuxSource::processPacket(AVPacket *pkt)
+{
+    int index = pkt->stream_index == video_index_ ? 0 : (pkt->stream_index == audio_index_ ? 1 : -1);
+    AVBSFContext *bsf = 0 == index ? video_bsf_ : audio_bsf_;
+    if(index < 0) {
+        av_packet_free(&pkt);                           // 不转推的流
+        return;
+    }
+    if(!bsf) {
+        outputPacket(pkt, index);
+        return;
+    }
+    int ret = av_bsf_send_packet(bsf, pkt);
+    av_packet_free(&pkt);
+    if(ret < 0) {
+        LogWarn("av_bsf_send_packet failed: %d", ret);
+        return;
+    }
+    while(true) {
+        AVPacket *out = av_packet_alloc();
+        if(!out || av_bsf_receive_packet(bsf, out) != 0) {
+            av_packet_free(&out);
+            break;
+        }
+        outputPacket(out, index);
+    }
+}
+
+/**
+ * @brief 时间戳重定基为ms，按节奏等待，然后交给回调。
+ * @param pkt 过滤后的包，接管。
+ * @param index 0视频 1音频。
+ * @return void。
+ */
+void DemuxSource::outputPacket(AVPacket *pkt, int index)
+{
+    AVRational ms_time_base = {1, 1000};
+    AVRational time_base = fmt_ctx_->streams[0 == index ? video_index_ : audio_index_]->time_base;
+    int64_t dts;
+    if(pkt->dts != AV_NOPTS_VALUE) {
+        dts = av_rescale_q(pkt->dts, time_base, ms_time_base);
+    } else if(pkt->pts != AV_NOPTS_VALUE) {
+        dts = av_rescale_q(pkt->pts, time_base, ms_time_base);
+    } else if(last_dts_[index] != INT64_MIN) {
+        dts = last_dts_[index] + (int64_t)(frame_duration_[index] + 0.5) - offset_;    // 没有时间戳的包接在上一个后面
+    } else {
+        av_packet_free(&pkt);
+        return;
+    }
+    int64_t pts = pkt->pts != AV_NOPTS_VALUE ? av_rescale_q(pkt->pts, time_base, ms_time_base) : dts;
+    if(first_packet_) {
+        first_packet_ = false;
+        offset_ = (int64_t)AVPublishTime::GetInstance()->getCurrenTime() - dts;
+    }
+    if(0 == stats_.loops && dts < file_start_) {
+        file_start_ = dts;
+    }
+    // 直播源重连、时间戳回绕时重新对齐，两个流使用同一个offset_，音视频的相对关系不变
+    int64_t out_dts = dts + offset_;
+    if(last_dts_[index] != INT64_MIN && (out_dts < last_dts_[index] || out_dts > last_dts_[index] + DEMUX_MAX_JUMP)) {
+        int64_t shift = last_dts_[index] + (int64_t)(frame_duration_[index] + 0.5) - out_dts;
+        offset_ += shift;
+        out_dts += shift;
+        stats_.discontinuities++;
+        LogWarn("%s timestamp jumps %lldms, realign", 0 == index ? "video" : "audio", -shift);
+    }
+    pkt->dts = out_dts;
+    pkt->pts = pts + offset_;
+    pkt->duration = 0;
+    last_dts_[index] = out_dts;
+
+    if(0 == index && (pkt->flags & AV_PKT_FLAG_KEY)) {
+        pkt = insertSpsPps(pkt);
+    }
+    if(realtime_) {
+        pace(out_dts);
+    }
+    if(0 == index) {
+        stats_.video_packets++;
+    } else {
+        stats_.audio_packets++;
+    }
+    stats_.bytes += pkt->size;
+    if(callback_) {
+        callback_(pkt, 0 == index ? E_VIDEO_TYPE : E_AUDIO_TYPE);
+    } else {
+        av_packet_free(&pkt);
+    }
+}
+
+/**
+ * @brief 关键帧前面没有sps时，把extradata中的sps、pps插在前面，与H264Encoder的repeat_sps_pps一样。
+ * @param pkt Annex-B格式的关键帧，接管。
+ * @return 插入后的包，不需要插入时返回原来的包。
+ */
+AVPacket *DemuxSource::insertSpsPps(AVPacket *pkt)
+{
+    const uint8_t *extradata = video_ctx_->extradata;
+    int extradata_size = video_ctx_->extradata_size;
+    if(!NalParser::IsAnnexB(extradata, extradata_size)) {
+        return pkt;                                     // 不是Annex-B
+    }
+    NalPacketInfo info;
+    NalParser::Inspect(pkt->data, pkt->size, 0, NAL_CODEC_H264, &info);
+    if(info.has_parameter_sets) {
+        return pkt;                                     // 已经带有sps、pps
+    }
+
+    AVPacket *out = av_packet_alloc();
+    if(!out || av_new_packet(out, pkt->size + extradata_size) < 0) {
+        LogError("alloc sps pps packet failed");
+        av_packet_free(&out);
+        return pkt;
+    }
+    memcpy(out->data, extradata, extradata_size);
+    memcpy(out->data + extradata_size, pkt->data, pkt->size);
+    av_packet_copy_props(out, pkt);
+    av_packet_free(&pkt);
+    return out;
+}
+
+/**
+ * @brief 文件读完，回到开头，新一轮的时间戳接在上一轮最后一帧之后。
+ * @return void。
+ */
+void DemuxSource::rewind()
+{
+    int64_t end = INT64_MIN;
+    for(int i = 0; i < 2; i++) {
+        if(last_dts_[i] != INT64_MIN && last_dts_[i] + (int64_t)(frame_duration_[i] + 0.5) > end) {
+            end = last_dts_[i] + (int64_t)(frame_duration_[i] + 0.5);
+        }
+    }
+    int64_t start = fmt_ctx_->start_time != AV_NOPTS_VALUE ? fmt_ctx_->start_time : 0;
+    int ret = av_seek_frame(fmt_ctx_, -1, start, AVSEEK_FLAG_BACKWARD);
+    if(ret < 0) {
+        LogError("seek %s to start failed: %d", url_.c_str(), ret);
+        loop_ = 0;                                      // 下一次读到结尾时结束
+        return;
+    }
+    if(video_bsf_) {
+        av_bsf_flush(video_bsf_);
+    }
+    if(audio_bsf_) {
+        av_bsf_flush(audio_bsf_);
+    }
+    if(end != INT64_MIN && file_start_ != INT64_MAX) {
+        offset_ = end - file_start_;
+    }
+    stats_.loops++;
+}
+
+/**
+ * @brief 等到发布时钟到达dts再输出。
+ * @param dts 重定基后的dts，单位ms。
+ * @return void。
+ */
+void DemuxSource::pace(int64_t dts)
+{
+    while(!request_abort_) {
+        int64_t lag = (int64_t)AVPublishTime::GetInstance()->getCurrenTime() - dts;
+        if(lag >= 0) {
+            if(lag > stats_.max_lag) {
+                stats_.max_lag = lag;
+            }
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(-lag < 100 ? -lag : 100));
+    }
+}
@@ -0,0 +1,104 @@
+﻿#ifndef DEMUXSOURCE_H
+#define DEMUXSOURCE_H
+
+#include <functional>
+#include <string>
+#include "commonlooper.h"
+#include "mediabase.h"
+#include "interrupttimer.h"
+extern "C" {
+#include "libavformat/avformat.h"
+#include "libavcodec/avcodec.h"
+}
+
+// 转推输入的统计信息
+typedef struct demux_source_stats
+{
+    int64_t video_packets;
+    int64_t audio_packets;
+    int64_t bytes;
+    int64_t discontinuities;                            // 时间戳跳变(直播源重连、回绕)而重新对齐的次数
+    int64_t loops;                                      // 文件循环播放的次数
+    int64_t reconnects;                                 // 网络输入重连的次数
+    int64_t max_lag;                                    // 实时节奏下包晚于它的时间戳的最大值，单位ms
+}DemuxSourceStats;
+
+/**
+ * 已经编码的输入(mp4/ts文件、摄像头的rtsp流)直接转推，不解码不重新编码，代替采集+编码。
+ * 1）视频只支持H.264，经过h264_mp4toannexb把mp4的avcC/长度前缀转成Annex-B，与H264Encoder的输出一致，
+ *    内嵌rtsp服务器、rtsp推流器与HLS输出都不需要区分包是编码得到的还是转推的；输入本来就是Annex-B时原样通过。
+ *    关键帧前面没有带sps、pps时(ts、部分摄像头只在sdp中给出)，从extradata插入，中途加入的观看端也能解码。
+ * 2）音频支持AAC与Opus，AAC经过aac_adtstoasc把ts中的adts头去掉并生成AudioSpecificConfig；没有音频时只转推视频。
+ * 3）时间戳重定基：第一个包对齐到AVPublishTime的当前时间，之后保持源的间隔(包括B帧的pts/dts差)，统一换算成ms，
+ *    与采集编码路径的pts一致；文件循环时接在上一轮最后一帧之后，直播源的时间戳回退或者跳变超过5秒时重新对齐。
+ * 4）实时节奏：文件输入按dts等到对应的时间再输出，避免一次把整个文件推出去；网络输入本身就是实时的，读到就输出。
+ * 5）GetVideoCodecContext/GetAudioCodecContext返回由流参数构造的上下文(没有打开编码器)，用来配置各个输出，
+ *    time_base为1/帧率，frame_size为每帧的样本数，与编码器上下文的含义相同。
+ *
+ * 网络输入断开后按reconnect_interval重连，流参数必须与第一次打开时一致。
+ */
+class DemuxSource : public CommonLooper
+{
+public:
+    DemuxSource();
+    virtual ~DemuxSource();
+
+    RET_CODE Init(const Properties &properties);
+    virtual void Loop();
+    void AddCallback(std::function<void(AVPacket *, MediaType)> callback);  // 回调接管AVPacket，pts/dts单位ms
+
+    inline const AVCodecContext *GetVideoCodecContext() {
+        return video_ctx_;
+    }
+    inline const AVCodecContext *GetAudioCodecContext() {      // 输入没有音频时为NULL
+        return audio_ctx_;
+    }
+    inline int GetFps() {
+        return fps_;
+    }
+    void GetStats(DemuxSourceStats *stats);
+
+private:
+    RET_CODE openInput();
+    void closeInput();
+    RET_CODE createFilter(const char *name, AVStream *stream, AVBSFContext **bsf);
+    void processPacket(AVPacket *pkt);
+    void outputPacket(AVPacket *pkt, int index);
+    AVPacket *insertSpsPps(AVPacket *pkt);
+    void rewind();
+    void pace(int64_t dts);
+    static int interruptCallback(void *opaque);
+
+    // 配置
+    std::string url_;
+    int loop_ = 1;                                      // 文件读到结尾后从头开始
+    int realtime_ = 1;                                  // 按时间戳的节奏输出
+    bool network_ = false;
+    std::string rtsp_transport_ = "tcp";
+    int timeout_ = 5000;
+    int reconnect_interval_ = 1000;
+
+    // 输入
+    AVFormatContext *fmt_ctx_ = NULL;
+    InterruptTimer *timer_ = NULL;
+    int video_index_ = -1;                              // fmt_ctx_中的流索引
+    int audio_index_ = -1;
+    AVBSFContext *video_bsf_ = NULL;
+    AVBSFContext *audio_bsf_ = NULL;                    // 只有aac使用
+    AVCodecContext *video_ctx_ = NULL;
+    AVCodecContext *audio_ctx_ = NULL;
+    int fps_ = 25;
+    double frame_duration_[2] = {40, 21.3};             // 视频、音频一帧的时长，单位ms
+
+    // 时间戳重定基，下标0视频 1音频
+    bool first_packet_ = true;
+    int64_t offset_ = 0;                                // 输出的时间戳 = 源的时间戳(ms) + offset_
+    int64_t file_start_ = INT64_MAX;                    // 文件中最早的时间戳(ms)，循环时接在上一轮之后
+    int64_t last_dts_[2] = {INT64_MIN, INT64_MIN};      // 最后输出的dts，单位ms
+    int64_t pre_stats_time_ = 0;
+
+    DemuxSourceStats stats_;
+    std::function<void(AVPacket *, MediaType)> callback_ = NULL;
+};
+
+#endif // DEMUXSOURCE_H
@@ -0,0 +1,270 @@
+﻿#include "encodegovernor.h"
+#include "dlog.h"
+#include "timesutil.h"
+
+EncodeGovernor::EncodeGovernor()
+{
+    memset(&stats_, 0, sizeof(GovernorStats));
+    cost_[GOVERNOR_NORMAL]          = 1.0;
+    cost_[GOVERNOR_FAST_PRESET]     = 2.0;              // medium相对superfast，实测会在第一次降级后更新
+    cost_[GOVERNOR_HALF_FPS]        = 2.0;
+    cost_[GOVERNOR_HALF_RESOLUTION] = 2.5;              // 像素减少到1/4，但每帧有固定开销
+    cost_[GOVERNOR_DROP]            = 1.0;              // 负载按待编码的帧计算，丢帧不改变负载
+}
+
+EncodeGovernor::~EncodeGovernor()
+{
+    if(fast_encoder_) {
+        delete fast_encoder_;
+    }
+    if(small_encoder_) {
+        delete small_encoder_;
+    }
+    if(scaler_) {
+        delete scaler_;
+    }
+}
+
+/**
+ * @brief 设置调节参数，降级使用的编码器在第一次用到时才创建。
+ * @param "width" "height" "fps" "bitrate" "gop" "b_frames" "intra_refresh" "slice_max_size" 与正常级别的编码器一致
+ *        "fast_preset"     降级使用的x264 preset，默认superfast
+ *        "high_load"       负载超过该百分比降级，默认85
+ *        "low_load"        预测的升级后负载低于该百分比才升级，默认50
+ *        "ewma_alpha"      编码耗时EWMA的系数，百分比，默认10
+ *        "down_hold_ms"    在一个级别至少停留的时长，默认1000ms
+ *        "up_hold_ms"      负载持续低多久才升级，默认5000ms
+ *        "max_up_hold_ms"  升级失败时up_hold_ms加倍的上限，默认60000ms
+ *        "max_level"       最多降到哪一级，默认4丢帧
+ * @param encoder 正常级别的编码器，不接管。
+ * @return 成功 0 失败 other
+ */
+RET_CODE EncodeGovernor::Init(const Properties &properties, H264Encoder *encoder)
+{
+    width_          = properties.GetProperty("width", 0);
+    height_         = properties.GetProperty("height", 0);
+    fps_            = properties.GetProperty("fps", 25);
+    bitrate_        = properties.GetProperty("bitrate", 500*1024);
+    gop_            = properties.GetProperty("gop", fps_);
+    b_frames_       = properties.GetProperty("b_frames", 0);
+    intra_refresh_  = properties.GetProperty("intra_refresh", 0);
+    slice_max_size_ = properties.GetProperty("slice_max_size", 0);
+    fast_preset_    = properties.GetProperty("fast_preset", "superfast");
+    high_load_      = properties.GetProperty("high_load", 85);
+    low_load_       = properties.GetProperty("low_load", 50);
+    ewma_alpha_     = properties.GetProperty("ewma_alpha", 10);
+    down_hold_ms_   = properties.GetProperty("down_hold_ms", 1000);
+    up_hold_ms_     = properties.GetProperty("up_hold_ms", 5000);
+    max_up_hold_ms_ = properties.GetProperty("max_up_hold_ms", 60000);
+    max_level_      = properties.GetProperty("max_level", (int)GOVERNOR_DROP);
+    if(!encoder || width_ <= 0 || height_ <= 0 || fps_ <= 0) {
+        LogError("invalid encoder or width: %d, height: %d, fps: %d", width_, height_, fps_);
+        return RET_ERR_PARAMISMATCH;
+    }
+    if(low_load_ <= 0 || low_load_ >= high_load_ || ewma_alpha_ <= 0 || ewma_alpha_ > 100) {
+        LogError("invalid low_load: %d, high_load: %d or ewma_alpha: %d", low_load_, high_load_, ewma_alpha_);
+        return RET_ERR_PARAMISMATCH;
+    }
+    if(max_level_ < GOVERNOR_NORMAL || max_level_ > GOVERNOR_DROP) {
+        max_level_ = GOVERNOR_DROP;
+    }
+    encoder_ = encoder;
+    current_ = encoder;
+    cur_up_hold_ms_ = up_hold_ms_;
+    LogInfo("encode governor: high_load: %d%%, low_load: %d%%, fast_preset: %s, max_level: %d",
+            high_load_, low_load_, fast_preset_.c_str(), max_level_);
+    return RET_OK;
+}
+
+void EncodeGovernor::AddCallback(std::function<void (int, int)> callback)
+{
+    callable_object_ = callback;
+}
+
+/**
+ * @brief 决定这一帧是否编码，降帧率级别隔一帧编码一帧，丢帧级别在此基础上按cpu预算丢帧。
+ * @return true 编码，false 跳过。
+ */
+bool EncodeGovernor::Admit()
+{
+    stats_.frames++;
+    if(level_ >= GOVERNOR_HALF_FPS && (stats_.frames & 1) == 0) {
+        stats_.skipped_frames++;
+        return false;
+    }
+    if(level_ >= GOVERNOR_DROP) {
+        // 每个待编码帧按帧间隔的high_load还账，最多攒下一帧的预算，避免空闲后突发
+        int64_t budget = (int64_t)2 * 1000000 / fps_ * high_load_ / 100;
+        debt_ -= budget;
+        if(debt_ < -budget) {
+            debt_ = -budget;
+        }
+        if(debt_ > 0) {
+            stats_.dropped_frames++;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief 按当前级别选择编码器编码一帧，并用编码耗时更新负载。参数与返回值同H264Encoder::Encode。
+ * @param yuv 原始分辨率的帧，降分辨率级别内部缩放。
+ */
+AVPacket *EncodeGovernor::Encode(uint8_t *yuv, int size, int64_t pts, int *pkt_frame, RET_CODE *ret)
+{
+    H264Encoder *encoder = getEncoder(level_);
+    while(!encoder && level_ > GOVERNOR_NORMAL) {
+        LogWarn("encode governor: level %d unavailable, limit to %d", level_, level_ - 1);
+        max_level_ = level_ - 1;
+        setLevel(level_ - 1, TimesUtil::GetTimeMicrosecond() / 1000);
+        encoder = getEncoder(level_);
+    }
+    if(encoder != current_) {
+        encoder->ForceKeyFrame();                       // 接收端正在解码另一个编码器的码流
+        current_ = encoder;
+    }
+    encoder->SetQpOffset(qp_offset_);
+    int64_t begin = TimesUtil::GetTimeMicrosecond();
+    if(level_ >= GOVERNOR_HALF_RESOLUTION) {
+        scaler_->Scale(yuv);
+        yuv = scaler_->GetFrame(0);
+        size = scaler_->GetFrameSize(0);
+    }
+    AVPacket *packet = encoder->Encode(yuv, size, pts, pkt_frame, ret);
+    int64_t encode_time = TimesUtil::GetTimeMicrosecond() - begin;
+    stats_.encoded_frames++;
+    if(level_ >= GOVERNOR_DROP) {
+        debt_ += encode_time;
+    }
+    Update(encode_time, begin / 1000);
+    return packet;
+}
+
+/**
+ * @brief 更新负载并决定是否降级或者升级。
+ * @param encode_time 一帧的编码耗时，单位us。
+ * @param now 当前时间，单位ms。
+ * @return void。
+ */
+void EncodeGovernor::Update(int64_t encode_time, int64_t now)
+{
+    if(settle_samples_ > 0) {
+        settle_samples_--;
+        return;
+    }
+    if(!ewma_valid_) {
+        ewma_ = (double)encode_time;
+        ewma_valid_ = true;
+    } else {
+        ewma_ += (encode_time - ewma_) * ewma_alpha_ / 100.0;
+    }
+    int fps = level_ >= GOVERNOR_HALF_FPS ? fps_ / 2 : fps_;
+    int load = (int)(ewma_ * fps / 10000.0);
+    stats_.load = load;
+
+    // 降级后稳定下来的负载与降级前负载之比，就是升回去时负载的倍数。负载突增时EWMA刚越过high_load就降级，
+    // 降级前的负载偏低，测出的倍数也偏低，所以只往大调，预测偏保守最多是晚一点升级
+    if(cost_samples_ > 0 && --cost_samples_ == 0 && load > 0) {
+        double cost = load_before_down_ / load;
+        if(cost > cost_[level_]) {
+            cost_[level_] = cost > 8.0 ? 8.0 : cost;
+        }
+        LogInfo("encode governor: level %d measured cost %0.2lf, use %0.2lf", level_, cost, cost_[level_]);
+    }
+
+    if(load > high_load_ && level_ < max_level_ && now - level_time_ >= down_hold_ms_) {
+        if(up_time_ > 0 && now - up_time_ < cur_up_hold_ms_) {
+            // 刚升级又超载，说明预测偏低，推迟下一次升级
+            cur_up_hold_ms_ = cur_up_hold_ms_ * 2 > max_up_hold_ms_ ? max_up_hold_ms_ : cur_up_hold_ms_ * 2;
+        }
+        load_before_down_ = load;
+        cost_samples_ = fps_;
+        setLevel(level_ + 1, now);
+        return;
+    }
+    if(level_ > GOVERNOR_NORMAL && load * cost_[level_] < low_load_) {
+        if(0 == low_since_) {
+            low_since_ = now;
+        } else if(now - low_since_ >= cur_up_hold_ms_) {
+            up_time_ = now;
+            setLevel(level_ - 1, now);
+        }
+        return;
+    }
+    low_since_ = 0;
+    if(now - level_time_ >= max_up_hold_ms_) {
+        cur_up_hold_ms_ = up_hold_ms_;                  // 在一个级别稳定运行足够久，取消退避
+    }
+}
+
+void EncodeGovernor::GetStats(GovernorStats *stats)
+{
+    if(stats) {
+        *stats = stats_;
+    }
+}
+
+/**
+ * @brief 获取一个级别使用的编码器，第一次用到时创建。
+ * @return 失败返回NULL。
+ */
+H264Encoder *EncodeGovernor::getEncoder(int level)
+{
+    if(level < GOVERNOR_FAST_PRESET) {
+        return encoder_;
+    }
+    bool small = level >= GOVERNOR_HALF_RESOLUTION;
+    H264Encoder *&encoder = small ? small_encoder_ : fast_encoder_;
+    if(encoder) {
+        return encoder;
+    }
+    int width = small ? (width_ / 2) & ~1 : width_;
+    int height = small ? (height_ / 2) & ~1 : height_;
+    if(small && !scaler_) {
+        std::vector<VideoLayer> layers(1);
+        layers[0].width = width;
+        layers[0].height = height;
+        layers[0].bitrate = bitrate_;
+        scaler_ = new ScaleCascade();
+        if(scaler_->Init(width_, height_, layers) != RET_OK) {
+            LogError("encode governor: ScaleCascade Init failed");
+            delete scaler_;
+            scaler_ = NULL;
+            return NULL;
+        }
+    }
+    Properties properties;
+    properties.SetProperty("width", width);
+    properties.SetProperty("height", height);
+    properties.SetProperty("fps", fps_);
+    properties.SetProperty("bitrate", bitrate_);
+    properties.SetProperty("gop", gop_);
+    properties.SetProperty("b_frames", b_frames_);
+    properties.SetProperty("intra_refresh", intra_refresh_);
+    properties.SetProperty("slice_max_size", slice_max_size_);
+    properties.SetProperty("preset", fast_preset_);
+    encoder = new H264Encoder();
+    if(encoder->Init(properties) != RET_OK) {
+        LogError("encode governor: %dx%d %s encoder Init failed", width, height, fast_preset_.c_str());
+        delete encoder;
+        encoder = NULL;
+    }
+    return encoder;
+}
+
+void EncodeGovernor::setLevel(int level, int64_t now)
+{
+    LogInfo("encode governor: level %d -> %d, load: %d%%, up hold: %dms", level_, level, stats_.load, cur_up_hold_ms_);
+    level_ = level;
+    level_time_ = now;
+    low_since_ = 0;
+    ewma_valid_ = false;                                // 负载从新的级别重新测量
+    settle_samples_ = 1;                                // 切换后第一帧可能是IDR或者包含编码器初始化
+    debt_ = 0;
+    stats_.level = level;
+    stats_.level_changes++;
+    if(callable_object_) {
+        callable_object_(level, stats_.load);
+    }
+}
@@ -0,0 +1,113 @@
+﻿#ifndef ENCODEGOVERNOR_H
+#define ENCODEGOVERNOR_H
+
+#include <functional>
+#include "mediabase.h"
+#include "h264encoder.h"
+#include "simulcast.h"
+
+// 降级阶梯，每一级包含前面所有级的降级
+enum GovernorLevel
+{
+    GOVERNOR_NORMAL = 0,                                // 正常编码
+    GOVERNOR_FAST_PRESET,                               // 换用更快的x264 preset
+    GOVERNOR_HALF_FPS,                                  // 只编码一半的帧
+    GOVERNOR_HALF_RESOLUTION,                           // 宽高减半后编码
+    GOVERNOR_DROP,                                      // 按cpu预算丢帧
+    GOVERNOR_LEVEL_COUNT
+};
+
+// 编码调节器的统计信息
+typedef struct governor_stats
+{
+    int64_t frames;                                     // 采集的帧数
+    int64_t encoded_frames;                             // 编码的帧数
+    int64_t skipped_frames;                             // 降帧率跳过的帧数
+    int64_t dropped_frames;                             // 超出cpu预算丢弃的帧数
+    int64_t level_changes;                              // 级别切换的次数
+    int     level;                                      // 当前级别
+    int     load;                                       // 当前负载，编码耗时占墙上时间的百分比
+}GovernorStats;
+
+/**
+ * 编码cpu过载调节器。编码在采集线程中同步进行，cpu不够时采集线程跟不上，时间戳漂移，最后推流队列整个gop丢弃。
+ * 调节器测量每帧的编码耗时，按阶梯逐级降级，先降质量再丢帧：更快的preset -> 降帧率 -> 降分辨率 -> 丢帧。
+ * 1）负载 = 编码耗时的EWMA x 待编码的帧率，即编码占用的墙上时间比例。超过high_load并且在当前级别停留了down_hold_ms就降一级。
+ * 2）降级时记录降级前后的负载之比作为这一级的代价，升级前用它预测升级后的负载，预测值低于low_load并且持续up_hold_ms才升一级，
+ *    避免刚升级又超载。升级后很快又降级说明预测失败，up_hold_ms加倍(不超过max_up_hold_ms)，稳定后恢复。
+ * 3）丢帧级别按cpu预算丢帧：编码耗时累计为欠账，每个待编码帧按帧间隔的high_load还账，欠账为正时丢弃该帧。
+ * 4）降preset与降分辨率使用另外的编码器实例，原来的编码器保留(推流器、内嵌服务器的流参数引用它的上下文)，切换时新的编码器从IDR开始并带上sps、pps。
+ *
+ * 注意：丢弃和跳过的帧调用者仍然要累加时间戳，接收端看到的是时间戳的空洞；降分辨率时码流中途改变分辨率，依赖接收端按新的sps解码。
+ */
+class EncodeGovernor
+{
+public:
+    EncodeGovernor();
+    ~EncodeGovernor();
+
+    RET_CODE Init(const Properties &properties, H264Encoder *encoder);    // encoder为正常级别使用的编码器，不接管
+    void AddCallback(std::function<void(int level, int load)> callback);  // 级别改变时回调，在采集线程中调用
+    bool Admit();                                       // 每个采集帧调用一次，返回false时跳过编码
+    AVPacket *Encode(uint8_t *yuv, int size, int64_t pts, int *pkt_frame, RET_CODE *ret);
+    // 之后编码的帧的qp偏移，同H264Encoder::SetQpOffset，作用于当前级别使用的编码器，切换编码器后保持
+    inline void SetQpOffset(int qp_offset) {
+        qp_offset_ = qp_offset;
+    }
+    void GetStats(GovernorStats *stats);
+    inline int GetLevel() {
+        return level_;
+    }
+    // 上一帧实际使用的编码器，降级时不是Init传入的编码器
+    inline H264Encoder *GetCurrentEncoder() {
+        return current_;
+    }
+
+    // 输入一个编码耗时样本更新负载并决定级别，now单位ms。Encode内部调用，单独提供便于离线验证阶梯与滞回
+    void Update(int64_t encode_time, int64_t now);
+
+private:
+    H264Encoder *getEncoder(int level);
+    void setLevel(int level, int64_t now);
+
+    int width_ = 0;
+    int height_ = 0;
+    int fps_ = 25;
+    int bitrate_ = 0;
+    int gop_ = 25;
+    int b_frames_ = 0;
+    int intra_refresh_ = 0;
+    int slice_max_size_ = 0;
+    std::string fast_preset_;                           // 降级使用的preset
+    int high_load_ = 85;                                // 负载超过该百分比降级
+    int low_load_ = 50;                                 // 预测的升级后负载低于该百分比才升级
+    int ewma_alpha_ = 10;                               // EWMA的系数，百分比
+    int down_hold_ms_ = 1000;                           // 在一个级别至少停留的时长，让负载反映新的级别
+    int up_hold_ms_ = 5000;                             // 负载持续低的时长
+    int max_up_hold_ms_ = 60000;
+    int max_level_ = GOVERNOR_DROP;
+
+    H264Encoder *encoder_ = NULL;                       // 正常级别的编码器，不接管
+    H264Encoder *fast_encoder_ = NULL;                  // 原分辨率、更快的preset
+    H264Encoder *small_encoder_ = NULL;                 // 宽高减半、更快的preset
+    ScaleCascade *scaler_ = NULL;
+    H264Encoder *current_ = NULL;                       // 上一帧使用的编码器
+    int qp_offset_ = 0;
+    std::function<void(int, int)> callable_object_ = NULL;
+
+    int level_ = GOVERNOR_NORMAL;
+    int64_t level_time_ = 0;                            // 进入当前级别的时间
+    int64_t up_time_ = 0;                               // 最近一次升级的时间
+    int64_t low_since_ = 0;                             // 预测负载开始低于low_load的时间，0表示没有
+    int cur_up_hold_ms_ = 5000;                         // 带退避的up_hold_ms
+    double ewma_ = 0;                                   // 编码耗时的EWMA，单位us
+    bool ewma_valid_ = false;
+    int settle_samples_ = 0;                            // 切换后丢弃的样本数(新编码器的IDR、初始化耗时)
+    double cost_[GOVERNOR_LEVEL_COUNT];                 // cost_[i]为级别i-1相对级别i的负载倍数
+    double load_before_down_ = 0;                       // 降级前的负载，用于估计cost_
+    int cost_samples_ = 0;                              // 降级后还需要多少样本才估计cost_
+    int64_t debt_ = 0;                                  // 丢帧级别的cpu欠账，单位us
+    GovernorStats stats_;
+};
+
+#endif // ENCODEGOVERNOR_H
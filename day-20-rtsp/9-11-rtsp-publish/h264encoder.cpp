@@ -1,9 +1,12 @@
 ﻿#include "h264encoder.h"
+#include "nalparser.h"
+#include "instrument.h"
 #include "dlog.h"
 
 
 H264Encoder::H264Encoder()
 {
+    memset(&size_stats_, 0, sizeof(H264FrameSizeStats));
 }
 
 H264Encoder::~H264Encoder()
@@ -25,6 +28,10 @@ H264Encoder::~H264Encoder()
  *          bitrate     比特率
  *          gop         多少帧有一个I帧
  *          pix_fmt     像素格式
+ *          intra_refresh   1 使用周期帧内刷新代替周期IDR，刷新周期为gop，默认0
+ *          slice_max_size  每个slice的最大字节数，默认0不限制
+ *          repeat_sps_pps  关键帧前重复插入sps、pps，默认与intra_refresh一致
+ *          preset      x264的preset，默认medium，cpu不够时可以用更快的preset
  * @return 成功 0 失败 -1
  */
 int H264Encoder::Init(const Properties &properties)
@@ -47,6 +54,11 @@ int H264Encoder::Init(const Properties &properties)
     bitrate_    = properties.GetProperty("bitrate", 500*1024);
     gop_        = properties.GetProperty("gop", fps_);                      // 默认与帧率一样即可，gop过大会影响首帧秒开
     pix_fmt_    = properties.GetProperty("pix_fmt", AV_PIX_FMT_YUV420P);
+    intra_refresh_  = properties.GetProperty("intra_refresh", 0);
+    slice_max_size_ = properties.GetProperty("slice_max_size", 0);
+    // 帧内刷新模式下只有第一帧是IDR，sps、pps只在sdp中，中途加入的客户端需要在恢复点前拿到sps、pps
+    repeat_sps_pps_ = properties.GetProperty("repeat_sps_pps", intra_refresh_);
+    preset_         = properties.GetProperty("preset", "medium");
 
     // 1 查找H264编码器 确定是否存在
     codec_name_ = properties.GetProperty("codec_name", "default");
@@ -88,9 +100,21 @@ int H264Encoder::Init(const Properties &properties)
     ctx_->codec_type = AVMEDIA_TYPE_VIDEO;
     ctx_->max_b_frames = b_frames_;
     // 设置preset，tune，profile等参数
-    av_dict_set(&dict_, "preset", "medium", 0);
+    av_dict_set(&dict_, "preset", preset_.c_str(), 0);
     av_dict_set(&dict_, "tune", "zerolatency", 0);
     av_dict_set(&dict_, "profile", "high", 0);
+    av_dict_set(&dict_, "forced-idr", "1", 0);                  // ForceKeyFrame请求的关键帧编码成IDR，而不是普通的I帧
+    if(intra_refresh_) {
+        // 帧内刷新：每gop帧刷新一遍整个画面，每帧只带一部分帧内宏块，帧大小更平稳。对应x264的--intra-refresh
+        av_dict_set(&dict_, "intra-refresh", "1", 0);
+    }
+    if(slice_max_size_ > 0) {
+        char x264_params[64] = {0};
+        snprintf(x264_params, sizeof(x264_params), "slice-max-size=%d", slice_max_size_);
+        av_dict_set(&dict_, "x264-params", x264_params, 0);
+    }
+    LogInfo("preset: %s, intra_refresh: %d, slice_max_size: %d, repeat_sps_pps: %d", preset_.c_str(), intra_refresh_,
+            slice_max_size_, repeat_sps_pps_);
 
     ctx_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
@@ -110,34 +134,27 @@ int H264Encoder::Init(const Properties &properties)
     // 3.1 从上下文的extradata读取sps pps  其中sps、pps都是带起始码的
     if(ctx_->extradata) {
         LogInfo("extradata_size:%d", ctx_->extradata_size);
-        // 第一个为sps 7
-        // 第二个为pps 8
-
-        uint8_t *sps = ctx_->extradata + 4;                     // 直接跳到数据，写死是4字节的起始码
-        int sps_len = 0;
-        uint8_t *pps = NULL;
-        int pps_len = 0;
-
         for(int i = 0; i < ctx_->extradata_size; i++){
             printf("%#X ", ctx_->extradata[i]);
         }
         printf("\n");
 
-        // 寻找pps的数据位置
-        uint8_t *data = ctx_->extradata + 4;
-        for (int i = 0; i < ctx_->extradata_size - 4; ++i)
-        {
-            if (0 == data[i] && 0 == data[i + 1] && 0 == data[i + 2] && 1 == data[i + 3])
-            {
-                pps = &data[i+4];
-                break;
+        // 起始码可能是3或4字节，也可能有多个sps、pps，这里各取第一个
+        std::vector<NalUnit> param_sets;
+        int length_size = 0;
+        NalParser::ParseExtradata(ctx_->extradata, ctx_->extradata_size, NAL_CODEC_H264, &param_sets, &length_size);
+        for(size_t i = 0; i < param_sets.size(); i++) {
+            const NalUnit &nal = param_sets[i];
+            if(7 == nal.type && sps_.empty()) {
+                sps_.append(nal.data, nal.data + nal.size);
+            } else if(8 == nal.type && pps_.empty()) {
+                pps_.append(nal.data, nal.data + nal.size);
             }
         }
-
-        sps_len = int(pps - sps) - 4;                           // 4是00 00 00 01占用的字节
-        pps_len = ctx_->extradata_size - 4*2 - sps_len;         // 总大小减去两个起始码与sps长度就是pps的长度
-        sps_.append(sps, sps + sps_len);                        // 拷贝数据
-        pps_.append(pps, pps + pps_len);
+        if(sps_.empty() || pps_.empty()) {
+            LogError("sps or pps not found in extradata");
+            return RET_FAIL;
+        }
     }
 
     // 4 开辟帧及其帧内部的缓存
@@ -185,7 +202,9 @@ AVPacket *H264Encoder::Encode(uint8_t *yuv, int size, int64_t pts, int *pkt_fram
         }
 
         frame_->pts = pts;
-        frame_->pict_type = AV_PICTURE_TYPE_NONE;
+        frame_->pict_type = force_key_frame_ ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+        force_key_frame_ = false;
+        setQpOffsetSideData();
         ret1 = avcodec_send_frame(ctx_, frame_);
     } else {
         // 冲刷
@@ -227,6 +246,115 @@ AVPacket *H264Encoder::Encode(uint8_t *yuv, int size, int64_t pts, int *pkt_fram
         }
     }else {
         *ret = RET_OK;
+        PUSH_ALLOC("h264_encoder_packet", sizeof(AVPacket) + packet->size);
+        updateFrameSizeStats(packet);
+        if((repeat_sps_pps_ || first_key_frame_) && (packet->flags & AV_PKT_FLAG_KEY)) {
+            packet = insertSpsPps(packet);
+            first_key_frame_ = false;
+        }
+        return packet;
+    }
+}
+
+/**
+ * @brief 按qp_offset_给frame_设置一个覆盖整帧的ROI。libx264把qoffset乘以51作为每个宏块的qp偏移，所以qoffset取qp_offset_/51。
+ *          frame_会被重复使用，所以每帧先移除上一帧的边信息。
+ * @return void。
+ */
+void H264Encoder::setQpOffsetSideData()
+{
+    av_frame_remove_side_data(frame_, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    if(qp_offset_ == 0) {
+        return;
+    }
+    AVFrameSideData *sd = av_frame_new_side_data(frame_, AV_FRAME_DATA_REGIONS_OF_INTEREST, sizeof(AVRegionOfInterest));
+    if(!sd) {
+        LogWarn("av_frame_new_side_data failed");
+        return;
+    }
+    AVRegionOfInterest *roi = (AVRegionOfInterest *)sd->data;
+    roi->self_size = sizeof(AVRegionOfInterest);
+    roi->top = 0;
+    roi->bottom = height_;
+    roi->left = 0;
+    roi->right = width_;
+    roi->qoffset = av_make_q(qp_offset_, 51);
+}
+
+/**
+ * @brief 在关键帧前面插入带起始码的sps、pps。因为设置了AV_CODEC_FLAG_GLOBAL_HEADER，编码器不会在码流中重复输出sps、pps。
+ * @param packet 编码后的关键帧，成功时会被释放。
+ * @return 插入sps、pps后的新包，失败时返回原来的包。
+ */
+AVPacket *H264Encoder::insertSpsPps(AVPacket *packet)
+{
+    if(sps_.empty() || pps_.empty()) {
         return packet;
     }
+    // 已经带有sps的不需要再插入，起始码可能是3字节或者4字节
+    int offset = (packet->size > 4 && packet->data[2] == 1) ? 3 : 4;
+    if(packet->size > offset && (packet->data[offset] & 0x1f) == 7) {
+        return packet;
+    }
+
+    uint8_t start_code[] = {0, 0, 0, 1};
+    int extra_size = 4 + sps_.size() + 4 + pps_.size();
+    AVPacket *out = av_packet_alloc();
+    if(!out || av_new_packet(out, packet->size + extra_size) < 0) {
+        LogError("alloc sps pps packet failed");
+        av_packet_free(&out);
+        return packet;
+    }
+    PUSH_ALLOC("h264_sps_pps_packet", sizeof(AVPacket) + out->size);
+    uint8_t *data = out->data;
+    memcpy(data, start_code, 4);
+    data += 4;
+    memcpy(data, sps_.c_str(), sps_.size());
+    data += sps_.size();
+    memcpy(data, start_code, 4);
+    data += 4;
+    memcpy(data, pps_.c_str(), pps_.size());
+    data += pps_.size();
+    memcpy(data, packet->data, packet->size);
+    av_packet_copy_props(out, packet);                      // pts dts flags等
+    av_packet_free(&packet);
+
+    return out;
+}
+
+/**
+ * @brief 统计每帧的大小，使用Welford算法在线计算均值和方差，不需要保存每帧的大小。
+ * @param packet 编码后的包。
+ * @return void。
+ */
+void H264Encoder::updateFrameSizeStats(AVPacket *packet)
+{
+    H264FrameSizeStats &st = size_stats_;
+    st.frames++;
+    if(packet->flags & AV_PKT_FLAG_KEY) {
+        st.key_frames++;
+    }
+    if(1 == st.frames || packet->size > st.max_size) {
+        st.max_size = packet->size;
+    }
+    if(1 == st.frames || packet->size < st.min_size) {
+        st.min_size = packet->size;
+    }
+    double delta = packet->size - st.mean;
+    st.mean += delta / st.frames;
+    size_m2_ += delta * (packet->size - st.mean);
+    st.variance = st.frames > 1 ? size_m2_ / (st.frames - 1) : 0;
+}
+
+/**
+ * @brief 获取编码后帧大小的统计信息，峰均比max_size/mean可以反映I帧造成的码率峰值。
+ * @param stats 传入传出，统计信息。
+ * @return void。
+ */
+void H264Encoder::GetFrameSizeStats(H264FrameSizeStats *stats)
+{
+    if(!stats) {
+        return;
+    }
+    *stats = size_stats_;
 }
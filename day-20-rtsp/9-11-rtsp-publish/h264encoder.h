@@ -7,6 +7,17 @@ extern "C" {
 #include <libavutil/imgutils.h>
 }
 
+// 编码后每帧大小的统计，用于观察码率的波动(例如I帧造成的峰值)
+typedef struct h264_frame_size_stats
+{
+    int64_t frames;                 // 编码输出的帧数
+    int64_t key_frames;             // 其中关键帧(IDR或者帧内刷新的恢复点)的帧数
+    double  mean;                   // 平均帧大小，字节
+    double  variance;               // 帧大小的方差
+    int     max_size;               // 最大帧大小，字节
+    int     min_size;               // 最小帧大小，字节
+}H264FrameSizeStats;
+
 class H264Encoder
 {
 public:
@@ -35,6 +46,16 @@ public:
     AVCodecContext *GetCodecContext() {
         return ctx_;
     }
+    void GetFrameSizeStats(H264FrameSizeStats *stats);
+    // 之后编码的帧整帧的qp偏移，正数降低质量，0恢复正常。通过ROI边信息实现，只有libx264支持(并且不能关闭aq)
+    inline void SetQpOffset(int qp_offset) {
+        qp_offset_ = qp_offset;
+    }
+    // 下一帧编码成IDR并在前面插入sps、pps。接收端正在解码另一个编码器的码流时(例如降级切换编码器)，切换回来需要从IDR开始
+    inline void ForceKeyFrame() {
+        force_key_frame_ = true;
+        first_key_frame_ = true;
+    }
 
 private:
     int width_ = 0;
@@ -46,6 +67,13 @@ private:
     bool annexb_  = false;
     int threads_ = 1;
     int pix_fmt_ = 0;
+    int intra_refresh_ = 0;                                     // 周期帧内刷新，用一列列的帧内宏块代替周期性的IDR帧，消除I帧的码率峰值
+    int slice_max_size_ = 0;                                    // 每个slice的最大字节数，0不限制，用于得到适合网络包大小的NAL
+    int repeat_sps_pps_ = 0;                                    // 关键帧前面是否重复插入sps、pps，方便中途加入的客户端解码
+    bool first_key_frame_ = true;                               // 第一个关键帧总是插入sps、pps，接收端不依赖sdp也能立即解码
+    int qp_offset_ = 0;                                         // 整帧的qp偏移，用于静止画面降低质量
+    bool force_key_frame_ = false;                              // 下一帧强制编码成关键帧
+    std::string preset_;                                        // x264的preset
     //    std::string profile_;
     //    std::string level_id_;
 
@@ -57,6 +85,12 @@ private:
     AVDictionary *dict_     = NULL;                             // 编码器的选项设置
 
     AVFrame *frame_         = NULL;
+
+    AVPacket *insertSpsPps(AVPacket *packet);                   // 在关键帧前面插入sps、pps
+    void setQpOffsetSideData();                                 // 按qp_offset_设置frame_的ROI边信息
+    void updateFrameSizeStats(AVPacket *packet);
+    H264FrameSizeStats size_stats_;
+    double size_m2_ = 0;                                        // 帧大小与均值之差的平方和，用于计算方差
 };
 
 #endif // H264ENCODER_H
@@ -0,0 +1,631 @@
+﻿#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "hlssink.h"
+#include "dlog.h"
+#include "timesutil.h"
+#include "avpublishtime.h"
+extern "C" {
+#include "libavutil/opt.h"
+}
+
+#define HLS_AVIO_BUFFER_SIZE    (64 * 1024)
+#define HLS_PART_LIST_SEGMENTS  3               // 最后几个segment在播放列表中列出part
+#define HLS_KEEP_SEGMENTS       2               // 移出播放列表后再保留的segment数，给正在下载的客户端
+
+HlsSink::HlsSink()
+{
+    memset(&stats_, 0, sizeof(HlsSinkStats));
+    LogInfo("HlsSink create");
+}
+
+HlsSink::~HlsSink()
+{
+    DeInit();
+}
+
+/**
+ * @brief   设置参数，分配mp4 muxer。
+ * @param   "dir"               输出目录，为空只通过http输出，目录需要已经存在。
+ *          "name"              播放列表名字，默认live，即live.m3u8。
+ *          "path_prefix"       http路径前缀，默认/hls/，需要以'/'结尾。
+ *          "part_duration"     part目标时长，默认200ms。
+ *          "segment_duration"  segment最短时长，默认2000ms，在其后的第一个关键帧切segment，所以gop不要超过它。
+ *          "window"            播放列表中完整segment的个数，默认6。
+ * @return  成功 0 失败 other
+ */
+RET_CODE HlsSink::Init(const Properties &properties)
+{
+    dir_                = properties.GetProperty("dir", "");
+    name_               = properties.GetProperty("name", "live");
+    path_prefix_        = properties.GetProperty("path_prefix", "/hls/");
+    part_duration_      = properties.GetProperty("part_duration", 200);
+    segment_duration_   = properties.GetProperty("segment_duration", 2000);
+    window_             = properties.GetProperty("window", 6);
+    if(part_duration_ <= 0 || segment_duration_ < part_duration_ || window_ < 2) {
+        LogError("invalid part_duration: %d, segment_duration: %d, window: %d", part_duration_, segment_duration_, window_);
+        return RET_ERR_PARAMISMATCH;
+    }
+    if(path_prefix_.empty() || path_prefix_[path_prefix_.size() - 1] != '/') {
+        path_prefix_ += "/";
+    }
+    if(!dir_.empty() && dir_[dir_.size() - 1] != '/') {
+        dir_ += "/";
+    }
+    target_duration_ = (segment_duration_ + 999) / 1000;
+
+    int ret = avformat_alloc_output_context2(&fmt_ctx_, NULL, "mp4", NULL);
+    if(ret < 0) {
+        char str_error[512] = {0};
+        av_strerror(ret, str_error, sizeof(str_error) -1);
+        LogError("avformat_alloc_output_context2 failed:%s", str_error);
+        return RET_FAIL;
+    }
+    // 输出写到内存，由本类自己切分。direct让大块的mdat不经过avio的缓冲直接交给回调
+    uint8_t *buffer = (uint8_t *)av_malloc(HLS_AVIO_BUFFER_SIZE);
+    fmt_ctx_->pb = avio_alloc_context(buffer, HLS_AVIO_BUFFER_SIZE, 1, this, NULL, writeCallback, NULL);
+    if(!buffer || !fmt_ctx_->pb) {
+        av_free(buffer);
+        LogError("avio_alloc_context failed");
+        return RET_ERR_OUTOFMEMORY;
+    }
+    fmt_ctx_->pb->direct = 1;
+    fmt_ctx_->flags |= AVFMT_FLAG_CUSTOM_IO;
+    fmt_ctx_->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;   // opus in mp4在4.2中还是实验性的
+    return RET_OK;
+}
+
+/**
+ * @brief 停止线程并释放muxer，可以重复调用。
+ * @return void。
+ */
+void HlsSink::DeInit()
+{
+    if(queue_) {
+        queue_->Abort();
+    }
+    Stop();
+    if(fmt_ctx_) {
+        if(fmt_ctx_->pb) {
+            av_freep(&fmt_ctx_->pb->buffer);
+            avio_context_free(&fmt_ctx_->pb);
+        }
+        avformat_free_context(fmt_ctx_);
+        fmt_ctx_ = NULL;
+    }
+    if(queue_) {
+        delete queue_;
+        queue_ = NULL;
+    }
+}
+
+/**
+ * @brief 配置视频流，从编码器上下文拷贝参数(包括extradata中的sps/pps)，时长用于计算part的边界。
+ * @param ctx 视频编码器上下文。
+ * @return 成功 0 失败 -1
+ */
+RET_CODE HlsSink::ConfigVideoStream(const AVCodecContext *ctx)
+{
+    if(!fmt_ctx_ || !ctx) {
+        LogError("fmt_ctx or ctx is null");
+        return RET_FAIL;
+    }
+    video_stream_ = avformat_new_stream(fmt_ctx_, NULL);
+    if(!video_stream_) {
+        LogError("avformat_new_stream failed");
+        return RET_FAIL;
+    }
+    avcodec_parameters_from_context(video_stream_->codecpar, ctx);
+    video_stream_->codecpar->codec_tag = 0;
+    video_stream_->time_base = (AVRational){1, 90000};
+    if(ctx->time_base.num > 0 && ctx->time_base.den > 0) {
+        video_frame_duration_ = 1000.0 * ctx->time_base.num / ctx->time_base.den;   // time_base是1/fps
+    }
+    return RET_OK;
+}
+
+/**
+ * @brief 配置音频流。
+ * @param ctx 音频编码器上下文。
+ * @return 成功 0 失败 -1
+ */
+RET_CODE HlsSink::ConfigAudioStream(const AVCodecContext *ctx)
+{
+    if(!fmt_ctx_ || !ctx) {
+        LogError("fmt_ctx or ctx is null");
+        return RET_FAIL;
+    }
+    audio_stream_ = avformat_new_stream(fmt_ctx_, NULL);
+    if(!audio_stream_) {
+        LogError("avformat_new_stream failed");
+        return RET_FAIL;
+    }
+    avcodec_parameters_from_context(audio_stream_->codecpar, ctx);
+    audio_stream_->codecpar->codec_tag = 0;
+    audio_stream_->time_base = (AVRational){1, ctx->sample_rate};
+    if(ctx->frame_size > 0 && ctx->sample_rate > 0) {
+        audio_frame_duration_ = 1000.0 * ctx->frame_size / ctx->sample_rate;
+    }
+    return RET_OK;
+}
+
+/**
+ * @brief 写mp4头得到init segment，然后启动封装线程。
+ * @return 成功 0 失败 -1
+ */
+RET_CODE HlsSink::Start()
+{
+    if(!audio_stream_ && !video_stream_) {
+        return RET_FAIL;
+    }
+    AVDictionary *opts = NULL;
+    // frag_custom：只有调用av_write_frame(NULL)才输出fragment，part的边界完全由本类决定
+    av_dict_set(&opts, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+    int ret = avformat_write_header(fmt_ctx_, &opts);
+    av_dict_free(&opts);
+    if(ret < 0) {
+        char str_error[512] = {0};
+        av_strerror(ret, str_error, sizeof(str_error) -1);
+        LogError("avformat_write_header failed:%s", str_error);
+        return RET_FAIL;
+    }
+    avio_flush(fmt_ctx_->pb);
+    {
+        std::lock_guard<PushMutex> lock(mutex_);
+        init_ = std::make_shared<const std::string>(pending_);
+        playlist_.reset();                                  // 第一个part之前没有播放列表
+    }
+    if(!dir_.empty()) {
+        writeFile("init.mp4", pending_, false);
+    }
+    LogInfo("hls init segment: %d bytes, part: %dms, segment: %dms", (int)pending_.size(), part_duration_, segment_duration_);
+    pending_.clear();
+
+    start_time_ = AVPublishTime::GetInstance()->getStartTime();
+    queue_ = new PacketQueue(audio_frame_duration_, video_frame_duration_);
+    return CommonLooper::Start();
+}
+
+/**
+ * @brief 放入一个编码后的包，只增加引用计数，不拷贝数据。
+ * @param pkt 编码后的包，pts单位ms，不接管。
+ * @param media_type 包类型。
+ * @return 成功 0 失败 -1
+ */
+RET_CODE HlsSink::Push(const AVPacket *pkt, MediaType media_type)
+{
+    if(!queue_) {
+        return RET_FAIL;
+    }
+    if((E_VIDEO_TYPE == media_type && !video_stream_) || (E_AUDIO_TYPE == media_type && !audio_stream_)) {
+        return RET_OK;
+    }
+    AVPacket *clone = av_packet_clone(pkt);
+    if(!clone) {
+        return RET_ERR_OUTOFMEMORY;
+    }
+    PUSH_ALLOC("hls_sink_clone", sizeof(AVPacket));
+    if(queue_->Push(clone, media_type) < 0) {
+        av_packet_free(&clone);                             // 已经停止
+        return RET_FAIL;
+    }
+    return RET_OK;
+}
+
+/**
+ * @brief 封装线程，从队列取包写入muxer，由writePacket决定切part与segment，每10秒打印一次统计。
+ * @return void。
+ */
+void HlsSink::Loop()
+{
+    LogInfo("Loop into");
+    AVPacket *pkt = NULL;
+    MediaType media_type;
+    while(!request_abort_)
+    {
+        int ret = queue_->PopWithTimeout(&pkt, media_type, 1000);
+        if(1 == ret) {
+            writePacket(pkt, media_type);
+            av_packet_free(&pkt);
+        }
+        int64_t now = TimesUtil::GetTimeMillisecond();
+        if(now - pre_stats_time_ > 10000) {
+            HlsSinkStats stats;
+            GetStats(&stats);
+            LogInfo("hls: segments-%lld, parts-%lld, bytes-%lld, dropped-%lld, playlist latency-%0.1lfms",
+                    stats.segments, stats.parts, stats.bytes, stats.dropped_packets, stats.playlist_latency);
+            pre_stats_time_ = now;
+        }
+    }
+    LogInfo("Loop leave");
+}
+
+/**
+ * @brief 写一个包。以视频的dts决定切分：加上这一帧会超过part_duration时先切part，
+ *          关键帧并且当前segment已经达到segment_duration时先切segment。没有视频时以音频的时间切分。
+ *          第一个视频关键帧之前的包丢弃，这样第一个segment可以独立解码。
+ * @param pkt 编码后的包，pts单位ms。
+ * @param media_type 包类型。
+ * @return void。
+ */
+void HlsSink::writePacket(AVPacket *pkt, MediaType media_type)
+{
+    int64_t dts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    bool is_video = E_VIDEO_TYPE == media_type;
+    bool drive = is_video || !video_stream_;                // 驱动切分的轨道
+    bool key = !is_video || (pkt->flags & AV_PKT_FLAG_KEY);
+    double frame_duration = is_video ? video_frame_duration_ : audio_frame_duration_;
+
+    if(!started_) {
+        if(!drive || !key) {
+            stats_.dropped_packets++;
+            return;
+        }
+        started_ = true;
+        first_dts_ = dts;
+        segment_start_ = dts;
+        part_start_ = dts;
+        part_independent_ = true;
+        part_capture_end_ = pkt->pts;
+        std::lock_guard<PushMutex> lock(mutex_);
+        HlsSegment segment;
+        segment.msn = 0;
+        segment.start = dts;
+        segment.duration = 0;
+        segment.complete = false;
+        segments_.push_back(segment);
+        LogInfo("hls start at key frame dts: %lld", dts);
+    } else if(drive) {
+        bool new_segment = key && dts - segment_start_ >= segment_duration_;
+        bool new_part = dts + frame_duration - part_start_ > part_duration_ + 1;    // 1ms容忍采集时间戳的抖动
+        if(new_segment || (new_part && dts > part_start_)) {
+            cutPart(dts, new_segment, part_capture_end_);
+        }
+    } else if(pkt->pts < first_dts_) {
+        stats_.dropped_packets++;                           // 早于第一个关键帧的音频
+        return;
+    }
+
+    AVStream *stream = is_video ? video_stream_ : audio_stream_;
+    AVRational src_time_base = {1, 1000};
+    pkt->stream_index = stream->index;
+    pkt->pts = av_rescale_q(pkt->pts, src_time_base, stream->time_base);
+    pkt->dts = av_rescale_q(dts, src_time_base, stream->time_base);
+    pkt->duration = av_rescale_q((int64_t)(frame_duration + 0.5), src_time_base, stream->time_base);   // fragment的最后一个sample需要时长
+    int ret = av_write_frame(fmt_ctx_, pkt);
+    if(ret < 0) {
+        char str_error[512] = {0};
+        av_strerror(ret, str_error, sizeof(str_error) -1);
+        LogError("av_write_frame failed: %s", str_error);
+        return;
+    }
+    if(drive) {
+        int64_t capture = av_rescale_q(pkt->pts, stream->time_base, src_time_base);
+        if(capture > part_capture_end_) {
+            part_capture_end_ = capture;
+        }
+    }
+}
+
+/**
+ * @brief 结束当前part：让muxer输出moof+mdat，保存为共享缓冲，加入当前segment，需要时开始新segment，然后更新播放列表。
+ *          挂起的http请求在下一次轮询时就能看到新part。
+ * @param next_start 下一个part的起始dts，也是当前part的结束。
+ * @param new_segment 下一个part是否开始新segment。
+ * @param capture_end 当前part最后一帧的pts，用于统计采集到播放列表的延时。
+ * @return void。
+ */
+void HlsSink::cutPart(int64_t next_start, bool new_segment, int64_t capture_end)
+{
+    av_write_frame(fmt_ctx_, NULL);                         // frag_custom下输出一个fragment
+    avio_flush(fmt_ctx_->pb);
+    if(pending_.empty()) {
+        return;
+    }
+    HlsPart part;
+    part.start = part_start_;
+    part.duration = (int)(next_start - part_start_);
+    part.independent = part_independent_;
+    part.data = std::make_shared<const std::string>(std::move(pending_));
+    pending_.clear();
+
+    std::vector<HlsSegment> evicted;                        // 只用到msn与part数，part的数据由最后一个引用释放
+    int64_t msn;
+    int part_index;
+    {
+        std::lock_guard<PushMutex> lock(mutex_);
+        HlsSegment &segment = segments_.back();
+        msn = segment.msn;
+        part_index = (int)segment.parts.size();
+        segment.parts.push_back(part);
+        if(new_segment) {
+            segment.complete = true;
+            segment.duration = (int)(next_start - segment.start);
+            int target = (segment.duration + 999) / 1000;
+            if(target > target_duration_) {
+                LogWarn("segment duration %dms is longer than target duration %ds, gop too long?", segment.duration, target_duration_);
+                target_duration_ = target;
+            }
+            HlsSegment next;
+            next.msn = segment.msn + 1;
+            next.start = next_start;
+            next.duration = 0;
+            next.complete = false;
+            segments_.push_back(next);
+            while((int)segments_.size() > window_ + 1 + HLS_KEEP_SEGMENTS) {
+                evicted.push_back(segments_.front());
+                segments_.pop_front();
+            }
+            stats_.segments++;
+        }
+        playlist_ = std::make_shared<const std::string>(buildPlaylist());
+        stats_.parts++;
+        stats_.bytes += part.data->size();
+        latency_sum_ += TimesUtil::GetTimeMillisecond() - (start_time_ + capture_end);
+        latency_count_++;
+    }
+
+    if(!dir_.empty()) {
+        // 先写媒体文件再写播放列表，播放列表里出现的文件一定已经存在
+        writeFile(partName(msn, part_index), *part.data, false);
+        writeFile(segmentName(msn), *part.data, part_index > 0);
+        for(size_t i = 0; i < evicted.size(); i++) {
+            removeFile(segmentName(evicted[i].msn));
+            for(size_t j = 0; j < evicted[i].parts.size(); j++) {
+                removeFile(partName(evicted[i].msn, (int)j));
+            }
+        }
+        std::shared_ptr<const std::string> playlist;
+        {
+            std::lock_guard<PushMutex> lock(mutex_);
+            playlist = playlist_;
+        }
+        writeFile(name_ + ".m3u8", *playlist, false);
+    }
+
+    part_start_ = next_start;
+    part_independent_ = new_segment;
+    if(new_segment) {
+        segment_start_ = next_start;
+    }
+}
+
+/**
+ * @brief 生成LL-HLS播放列表：最后window_个完整segment，最后几个segment列出part，最后是下一个part的preload hint。
+ * @return 播放列表。
+ */
+std::string HlsSink::buildPlaylist()
+{
+    char line[256];
+    std::string m3u8;
+    m3u8.reserve(4096);
+    size_t first = segments_.size() > (size_t)window_ + 1 ? segments_.size() - window_ - 1 : 0;
+    m3u8 += "#EXTM3U\n#EXT-X-VERSION:9\n";
+    snprintf(line, sizeof(line), "#EXT-X-TARGETDURATION:%d\n", target_duration_);
+    m3u8 += line;
+    snprintf(line, sizeof(line), "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=%.3f\n", part_duration_ * 3 / 1000.0);
+    m3u8 += line;
+    snprintf(line, sizeof(line), "#EXT-X-PART-INF:PART-TARGET=%.3f\n", part_duration_ / 1000.0);
+    m3u8 += line;
+    snprintf(line, sizeof(line), "#EXT-X-MEDIA-SEQUENCE:%lld\n", (long long)segments_[first].msn);
+    m3u8 += line;
+    m3u8 += "#EXT-X-MAP:URI=\"init.mp4\"\n";
+
+    for(size_t i = first; i < segments_.size(); i++) {
+        const HlsSegment &segment = segments_[i];
+        if(segment.parts.empty()) {
+            continue;                                       // 刚开始的segment还没有part
+        }
+        m3u8 += "#EXT-X-PROGRAM-DATE-TIME:" + formatDateTime(start_time_ + segment.start) + "\n";
+        if(i + HLS_PART_LIST_SEGMENTS >= segments_.size()) {
+            for(size_t j = 0; j < segment.parts.size(); j++) {
+                snprintf(line, sizeof(line), "#EXT-X-PART:DURATION=%.3f,URI=\"%s\"%s\n",
+                         segment.parts[j].duration / 1000.0, partName(segment.msn, (int)j).c_str(),
+                         segment.parts[j].independent ? ",INDEPENDENT=YES" : "");
+                m3u8 += line;
+            }
+        }
+        if(segment.complete) {
+            snprintf(line, sizeof(line), "#EXTINF:%.3f,\n%s\n", segment.duration / 1000.0, segmentName(segment.msn).c_str());
+            m3u8 += line;
+        }
+    }
+    const HlsSegment &last = segments_.back();
+    snprintf(line, sizeof(line), "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"%s\"\n", partName(last.msn, (int)last.parts.size()).c_str());
+    m3u8 += line;
+    return m3u8;
+}
+
+/**
+ * @brief 阻塞刷新的条件是否满足：有_HLS_part时要求segment msn的第part个part已经生成，没有时要求segment msn已经完成。
+ * @return 满足返回true。
+ */
+bool HlsSink::isReady(int64_t msn, int part)
+{
+    if(segments_.empty()) {
+        return false;
+    }
+    const HlsSegment &last = segments_.back();
+    if(msn < last.msn) {
+        return true;
+    }
+    if(msn > last.msn) {
+        return false;
+    }
+    return part >= 0 && part < (int)last.parts.size();
+}
+
+HlsSink::HlsSegment *HlsSink::findSegment(int64_t msn)
+{
+    if(segments_.empty() || msn < segments_.front().msn || msn > segments_.back().msn) {
+        return NULL;
+    }
+    return &segments_[(size_t)(msn - segments_.front().msn)];
+}
+
+/**
+ * @brief http处理函数，路径为path_prefix_下的name_.m3u8、init.mp4、segN.m4s、partN.P.m4s。
+ *          播放列表支持_HLS_msn/_HLS_part阻塞刷新，preload hint的part也会挂起直到生成，
+ *          都在等待超过3倍目标时长后返回503。媒体数据都是共享缓冲，不拷贝。
+ * @param request 请求。
+ * @param response 响应。
+ * @return void。
+ */
+void HlsSink::HandleRequest(const HttpRequest &request, HttpResponse *response)
+{
+    std::string name = request.path.substr(path_prefix_.size());
+    long long msn = -1;
+    int part = -1;
+    response->headers = "Access-Control-Allow-Origin: *\r\n";
+
+    std::lock_guard<PushMutex> lock(mutex_);
+    if(name == name_ + ".m3u8") {
+        const char *p = strstr(request.query.c_str(), "_HLS_msn=");
+        if(p) {
+            msn = atoll(p + 9);
+            const char *q = strstr(request.query.c_str(), "_HLS_part=");
+            part = q ? atoi(q + 10) : -1;
+        }
+        int64_t next_msn = segments_.empty() ? 0 : segments_.back().msn;
+        if(msn > next_msn + 2) {
+            response->status = 400;                         // 规范要求请求太远的未来时返回400
+            response->body = "_HLS_msn too far in the future\n";
+            return;
+        }
+        if(!playlist_ || (msn >= 0 && !isReady(msn, part))) {
+            if(request.wait_time < target_duration_ * 3000) {
+                response->hold = true;
+                return;
+            }
+            response->status = 503;
+            response->body = "playlist not ready\n";
+            return;
+        }
+        response->content_type = "application/vnd.apple.mpegurl";
+        response->headers += "Cache-Control: no-cache\r\n";
+        response->chunks.push_back(playlist_);
+        return;
+    }
+
+    response->content_type = "video/mp4";
+    if(name == "init.mp4" && init_) {
+        response->headers += "Cache-Control: max-age=3600\r\n";
+        response->chunks.push_back(init_);
+        return;
+    }
+    const HlsSegment *segment = NULL;
+    if(sscanf(name.c_str(), "seg%lld.m4s", &msn) == 1 && (segment = findSegment(msn)) != NULL && segment->complete) {
+        response->headers += "Cache-Control: max-age=60\r\n";
+        for(size_t i = 0; i < segment->parts.size(); i++) {
+            response->chunks.push_back(segment->parts[i].data);     // segment就是所有part的拼接
+        }
+        return;
+    }
+    if(sscanf(name.c_str(), "part%lld.%d.m4s", &msn, &part) == 2 && !segments_.empty()) {
+        segment = findSegment(msn);
+        if(segment && part >= 0 && part < (int)segment->parts.size()) {
+            response->headers += "Cache-Control: max-age=60\r\n";
+            response->chunks.push_back(segment->parts[part].data);
+            return;
+        }
+        // preload hint的part，或者客户端提前请求的下一个segment的第一个part，等它生成
+        const HlsSegment &last = segments_.back();
+        bool hinted = (msn == last.msn && part == (int)last.parts.size()) || (msn == last.msn + 1 && part == 0);
+        if(hinted && request.wait_time < target_duration_ * 3000) {
+            response->hold = true;
+            return;
+        }
+    }
+    response->status = 404;
+    response->content_type = "text/plain; charset=utf-8";
+    response->body = "not found\n";
+}
+
+/**
+ * @brief 获取统计信息，平均延时是上次调用以来的平均值。
+ * @param stats 传入传出。
+ * @return void。
+ */
+void HlsSink::GetStats(HlsSinkStats *stats)
+{
+    std::lock_guard<PushMutex> lock(mutex_);
+    stats_.playlist_latency = latency_count_ > 0 ? (double)latency_sum_ / latency_count_ : 0;
+    latency_sum_ = 0;
+    latency_count_ = 0;
+    *stats = stats_;
+}
+
+/**
+ * @brief 写文件。播放列表先写临时文件再改名，其它客户端或者web服务器读到的总是完整的播放列表。
+ * @param name 文件名，相对于dir_。
+ * @param data 数据。
+ * @param append 追加写。
+ * @return void。
+ */
+void HlsSink::writeFile(const std::string &name, const std::string &data, bool append)
+{
+    std::string path = dir_ + name;
+    bool is_playlist = name == name_ + ".m3u8";
+    std::string tmp_path = is_playlist ? path + ".tmp" : path;
+    FILE *fp = fopen(tmp_path.c_str(), append ? "ab" : "wb");
+    if(!fp) {
+        LogError("open %s failed", tmp_path.c_str());
+        return;
+    }
+    if(fwrite(data.data(), 1, data.size(), fp) != data.size()) {
+        LogError("write %s failed", tmp_path.c_str());
+    }
+    fclose(fp);
+    if(is_playlist) {
+#ifdef _WIN32
+        remove(path.c_str());                               // windows下rename不能覆盖已经存在的文件
+#endif
+        rename(tmp_path.c_str(), path.c_str());
+    }
+}
+
+void HlsSink::removeFile(const std::string &name)
+{
+    remove((dir_ + name).c_str());
+}
+
+std::string HlsSink::partName(int64_t msn, int part)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "part%lld.%d.m4s", (long long)msn, part);
+    return name;
+}
+
+std::string HlsSink::segmentName(int64_t msn)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "seg%lld.m4s", (long long)msn);
+    return name;
+}
+
+int HlsSink::writeCallback(void *opaque, uint8_t *buf, int buf_size)
+{
+    HlsSink *sink = (HlsSink *)opaque;
+    sink->pending_.append((const char *)buf, buf_size);
+    return buf_size;
+}
+
+/**
+ * @brief 把epoch毫秒格式化为ISO 8601的UTC时间，例如2020-01-01T08:00:00.123Z。
+ * @param ms epoch毫秒。
+ * @return 格式化后的时间。
+ */
+std::string HlsSink::formatDateTime(int64_t ms)
+{
+    time_t seconds = (time_t)(ms / 1000);
+    struct tm tm;
+#ifdef _WIN32
+    gmtime_s(&tm, &seconds);
+#else
+    gmtime_r(&seconds, &tm);
+#endif
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+             tm.tm_hour, tm.tm_min, tm.tm_sec, (int)(ms % 1000));
+    return buf;
+}
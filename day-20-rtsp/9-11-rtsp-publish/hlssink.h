@@ -0,0 +1,132 @@
+﻿#ifndef HLSSINK_H
+#define HLSSINK_H
+
+#include <deque>
+#include <mutex>
+#include "instrument.h"
+#include <memory>
+#include <string>
+#include <vector>
+#include "mediabase.h"
+#include "commonlooper.h"
+#include "packetqueue.h"
+#include "httpserver.h"
+extern "C" {
+#include "libavformat/avformat.h"
+#include "libavcodec/avcodec.h"
+}
+
+// HLS输出的统计信息
+typedef struct hls_sink_stats
+{
+    int64_t segments;                                   // 完成的segment数
+    int64_t parts;                                      // 完成的part数
+    int64_t bytes;                                      // 输出的fmp4字节数(不含init)
+    int64_t dropped_packets;                            // 第一个关键帧之前丢弃的包
+    double  playlist_latency;                           // 最近10秒的平均采集到播放列表的延时，单位ms
+}HlsSinkStats;
+
+/**
+ * LL-HLS/CMAF输出。把已经编码好的H.264/AAC包封装成fmp4，切成part与segment，生成带part、preload hint的LL-HLS播放列表，
+ * 写到本地目录，同时可以通过内嵌的http服务器直接作为源站供CDN回源，不需要再部署一台拉rtsp转封装的机器。
+ *
+ * 1）封装用libavformat的mp4 muxer，movflags=frag_custom+empty_moov+default_base_moof：写头得到init.mp4(ftyp+moov)，
+ *    之后每次av_write_frame(NULL)输出一个moof+mdat，就是一个part。包只封装一次，不重新编码。
+ * 2）视频的dts加上这一帧会超过part_duration时切一个part；遇到关键帧并且segment已经达到segment_duration时切segment，
+ *    新segment的第一个part从关键帧开始(INDEPENDENT=YES)。segment就是它所有part的拼接，不另外封装。
+ * 3）part的数据封装后保存为共享的只读缓冲，播放列表、part、segment的http响应都引用它发送，不再拷贝；写目录时直接写文件。
+ * 4）http支持LL-HLS的阻塞刷新(_HLS_msn/_HLS_part)和对preload hint的part的阻塞请求，数据没准备好时挂起请求，
+ *    超过3倍目标时长返回503。
+ * 5）EXT-X-PROGRAM-DATE-TIME是采集时的墙上时钟(AVPublishTime的开始时间加pts)，本地客户端用它测量采集到播放列表的延时。
+ *
+ * 线程模型：编码线程调用Push，包增加引用计数后放进队列，本类的线程封装与切片；http线程调用HandleRequest，两者用mutex_保护切片列表。
+ */
+class HlsSink : public CommonLooper
+{
+public:
+    HlsSink();
+    virtual ~HlsSink();
+
+    RET_CODE Init(const Properties &properties);
+    RET_CODE ConfigVideoStream(const AVCodecContext *ctx);     // 需要在Start之前配置
+    RET_CODE ConfigAudioStream(const AVCodecContext *ctx);
+    virtual RET_CODE Start();                                   // 写init segment并启动线程
+    virtual void Loop();
+    void DeInit();
+
+    RET_CODE Push(const AVPacket *pkt, MediaType media_type);  // 不接管pkt，调用者仍需释放
+    void HandleRequest(const HttpRequest &request, HttpResponse *response);    // 在http线程中调用
+    void GetStats(HlsSinkStats *stats);
+    inline const std::string &GetPathPrefix() {
+        return path_prefix_;
+    }
+
+private:
+    typedef struct hls_part
+    {
+        int64_t start;                                  // 起始dts，单位ms
+        int duration;                                   // 单位ms
+        bool independent;                               // 从关键帧开始
+        std::shared_ptr<const std::string> data;        // moof+mdat
+    }HlsPart;
+
+    typedef struct hls_segment
+    {
+        int64_t msn;                                    // media sequence number
+        int64_t start;                                  // 起始dts，单位ms
+        int duration;                                   // 完成后才有效
+        bool complete;
+        std::vector<HlsPart> parts;
+    }HlsSegment;
+
+    void writePacket(AVPacket *pkt, MediaType media_type);
+    void cutPart(int64_t next_start, bool new_segment, int64_t capture_end);
+    std::string buildPlaylist();                        // 调用者持有mutex_
+    bool isReady(int64_t msn, int part);                // 调用者持有mutex_
+    HlsSegment *findSegment(int64_t msn);               // 调用者持有mutex_
+    void writeFile(const std::string &name, const std::string &data, bool append);
+    void removeFile(const std::string &name);
+    std::string partName(int64_t msn, int part);
+    std::string segmentName(int64_t msn);
+    static int writeCallback(void *opaque, uint8_t *buf, int buf_size);
+    static std::string formatDateTime(int64_t ms);
+
+    // 配置
+    std::string dir_;                                   // 输出目录，空表示不写文件
+    std::string name_ = "live";                         // 播放列表名字name_.m3u8
+    std::string path_prefix_ = "/hls/";                 // http路径前缀
+    int part_duration_ = 200;                           // part目标时长，单位ms
+    int segment_duration_ = 2000;                       // segment最短时长，实际在其后的第一个关键帧切
+    int window_ = 6;                                    // 播放列表中完整segment的个数
+
+    // 封装
+    AVFormatContext *fmt_ctx_ = NULL;
+    AVStream *video_stream_ = NULL;
+    AVStream *audio_stream_ = NULL;
+    double video_frame_duration_ = 40;                  // 单位ms
+    double audio_frame_duration_ = 21.3;
+    std::string pending_;                               // muxer在两次切part之间输出的数据
+    PacketQueue *queue_ = NULL;
+
+    // 切片状态，只在本类线程中访问
+    bool started_ = false;                              // 收到第一个视频关键帧后开始
+    int64_t first_dts_ = 0;                             // 第一个关键帧的dts，更早的音频丢弃
+    int64_t segment_start_ = 0;
+    int64_t part_start_ = 0;
+    bool part_independent_ = false;
+    int64_t part_capture_end_ = 0;                      // part中最后一帧的采集时间(pts)，单位ms
+    int64_t start_time_ = 0;                            // AVPublishTime的开始时间，pts加上它是墙上时钟
+
+    // 与http线程共享
+    PushMutex mutex_{PUSH_LOCK_SITE("hls_sink")};
+    std::shared_ptr<const std::string> init_;
+    std::shared_ptr<const std::string> playlist_;
+    std::deque<HlsSegment> segments_;                   // 最后一个是正在生成的segment
+    int target_duration_ = 2;                           // EXT-X-TARGETDURATION，单位秒，只增不减
+    HlsSinkStats stats_;
+    int64_t latency_sum_ = 0;                           // 统计平均延时
+    int64_t latency_count_ = 0;
+    int64_t pre_stats_time_ = 0;
+};
+
+#endif // HLSSINK_H
@@ -0,0 +1,369 @@
+﻿#include <string.h>
+#include "httpserver.h"
+#include "dlog.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/select.h>
+#endif
+
+#define HTTP_MAX_REQUEST_SIZE 8192
+#define HTTP_HOLD_POLL_MS     5                         // 有挂起的请求时select的超时
+
+HttpServer::HttpServer()
+{
+#ifdef _WIN32
+    WSADATA wsa_data;
+    WSAStartup(MAKEWORD(2, 2), &wsa_data);
+#endif
+}
+
+HttpServer::~HttpServer()
+{
+    DeInit();
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+/**
+ * @brief 创建监听socket。
+ * @param "ip"               监听地址，默认127.0.0.1，只允许本机访问
+ *        "port"             监听端口，必须大于0
+ *        "max_connections"  最大同时连接数，默认16
+ *        "idle_timeout"     连接空闲超时，默认5000ms
+ * @return 成功 0 失败 other
+ */
+RET_CODE HttpServer::Init(const Properties &properties)
+{
+    ip_                 = properties.GetProperty("ip", "127.0.0.1");
+    port_               = properties.GetProperty("port", 0);
+    max_connections_    = properties.GetProperty("max_connections", 16);
+    idle_timeout_       = properties.GetProperty("idle_timeout", 5000);
+    if(port_ <= 0) {
+        LogError("invalid port: %d", port_);
+        return RET_ERR_PARAMISMATCH;
+    }
+
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if(listen_fd_ == INVALID_SOCKET) {
+        LogError("socket failed: %d", GetSockError());
+        return RET_FAIL;
+    }
+    int on = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port_);
+    addr.sin_addr.s_addr = inet_addr(ip_.c_str());
+    if(bind(listen_fd_, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        LogError("bind %s:%d failed: %d", ip_.c_str(), port_, GetSockError());
+        closesocket(listen_fd_);
+        listen_fd_ = INVALID_SOCKET;
+        return RET_FAIL;
+    }
+    if(listen(listen_fd_, 8) < 0) {
+        LogError("listen failed: %d", GetSockError());
+        closesocket(listen_fd_);
+        listen_fd_ = INVALID_SOCKET;
+        return RET_FAIL;
+    }
+    setNonBlocking(listen_fd_);
+    LogInfo("http server listen on %s:%d", ip_.c_str(), port_);
+
+    return RET_OK;
+}
+
+void HttpServer::AddHandler(const std::string &path, HttpHandler handler)
+{
+    handlers_[path] = handler;
+}
+
+RET_CODE HttpServer::Start()
+{
+    if(listen_fd_ == INVALID_SOCKET) {
+        LogError("http server not init");
+        return RET_FAIL;
+    }
+    return CommonLooper::Start();
+}
+
+void HttpServer::DeInit()
+{
+    Stop();
+    for(size_t i = 0; i < connections_.size(); i++) {
+        closesocket(connections_[i].fd);
+    }
+    connections_.clear();
+    if(listen_fd_ != INVALID_SOCKET) {
+        closesocket(listen_fd_);
+        listen_fd_ = INVALID_SOCKET;
+    }
+}
+
+void HttpServer::setNonBlocking(socket_t fd)
+{
+#ifdef _WIN32
+    u_long mode = 1;
+    ioctlsocket(fd, FIONBIO, &mode);
+#else
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+/**
+ * @brief http线程，select等待监听socket和所有连接的事件，超时时间100ms，以便及时响应Stop，有挂起的请求时超时HTTP_HOLD_POLL_MS。
+ * @return void。
+ */
+void HttpServer::Loop()
+{
+    LogInfo("http server loop into");
+    while(!request_abort_)
+    {
+        fd_set read_set, write_set;
+        FD_ZERO(&read_set);
+        FD_ZERO(&write_set);
+        FD_SET(listen_fd_, &read_set);
+        socket_t max_fd = listen_fd_;
+        bool holding = false;
+        for(size_t i = 0; i < connections_.size(); i++) {
+            HttpConnection &conn = connections_[i];
+            holding = holding || conn.holding;
+            if(conn.send_buf.empty()) {
+                FD_SET(conn.fd, &read_set);
+            } else {
+                FD_SET(conn.fd, &write_set);
+            }
+            if(conn.fd > max_fd) {
+                max_fd = conn.fd;
+            }
+        }
+
+        struct timeval tv = {0, (holding ? HTTP_HOLD_POLL_MS : 100) * 1000};
+        int ret = select((int)max_fd + 1, &read_set, &write_set, NULL, &tv);
+        if(ret < 0) {
+            LogError("select failed: %d", GetSockError());
+            msleep(100);
+            continue;
+        }
+
+        int64_t now = TimesUtil::GetTimeMillisecond();
+        // 先处理已有的连接，再接受新连接，这样新连接不会在本轮中被误判
+        for(size_t i = 0; i < connections_.size(); ) {
+            HttpConnection &conn = connections_[i];
+            bool keep = true;
+            if(ret > 0 && FD_ISSET(conn.fd, &read_set)) {
+                keep = readConnection(conn);
+            } else if(ret > 0 && FD_ISSET(conn.fd, &write_set)) {
+                keep = writeConnection(conn);
+            } else if(conn.holding) {
+                dispatchRequest(conn);                  // 再问一次处理函数数据是否准备好
+                keep = conn.holding || writeConnection(conn);
+            } else if(now - conn.active_time > idle_timeout_) {
+                keep = false;
+            }
+            if(keep) {
+                i++;
+            } else {
+                closesocket(conn.fd);
+                connections_.erase(connections_.begin() + i);
+            }
+        }
+        if(ret > 0 && FD_ISSET(listen_fd_, &read_set)) {
+            acceptConnection();
+        }
+    }
+    LogInfo("http server loop leave");
+}
+
+void HttpServer::acceptConnection()
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    socket_t fd = accept(listen_fd_, (struct sockaddr *)&addr, &len);
+    if(fd == INVALID_SOCKET) {
+        return;
+    }
+    if((int)connections_.size() >= max_connections_) {
+        LogWarn("too many http connections: %d", (int)connections_.size());
+        closesocket(fd);
+        return;
+    }
+    setNonBlocking(fd);
+    HttpConnection conn;
+    conn.fd = fd;
+    conn.send_pos = 0;
+    conn.chunk_index = 0;
+    conn.chunk_pos = 0;
+    conn.holding = false;
+    conn.request_time = 0;
+    conn.active_time = TimesUtil::GetTimeMillisecond();
+    connections_.push_back(conn);
+}
+
+bool HttpServer::readConnection(HttpConnection &conn)
+{
+    char buf[2048];
+    int n = recv(conn.fd, buf, sizeof(buf), 0);
+    if(n <= 0) {
+        return false;                                   // 对方关闭或者出错
+    }
+    conn.active_time = TimesUtil::GetTimeMillisecond();
+    if(conn.holding || !conn.send_buf.empty()) {
+        return true;                                    // 短连接只处理一个请求，后面的数据忽略
+    }
+    conn.recv_buf.append(buf, n);
+    size_t header_end = conn.recv_buf.find("\r\n\r\n");
+    if(header_end == std::string::npos) {
+        return conn.recv_buf.size() < HTTP_MAX_REQUEST_SIZE;
+    }
+    handleRequest(conn, header_end);
+    return conn.holding || writeConnection(conn);       // 响应一般很小，先尝试直接发送
+}
+
+bool HttpServer::writeConnection(HttpConnection &conn)
+{
+    while(true) {
+        // 先发送响应头与body，再依次发送共享的数据块
+        const std::string *data = &conn.send_buf;
+        size_t *pos = &conn.send_pos;
+        if(conn.send_pos >= conn.send_buf.size()) {
+            while(conn.chunk_index < conn.send_chunks.size()
+                  && conn.chunk_pos >= conn.send_chunks[conn.chunk_index]->size()) {
+                conn.chunk_index++;
+                conn.chunk_pos = 0;
+            }
+            if(conn.chunk_index >= conn.send_chunks.size()) {
+                break;
+            }
+            data = conn.send_chunks[conn.chunk_index].get();
+            pos = &conn.chunk_pos;
+        }
+        int n = send(conn.fd, data->data() + *pos, (int)(data->size() - *pos), 0);
+        if(n <= 0) {
+            int err = GetSockError();
+#ifdef _WIN32
+            if(err == WSAEWOULDBLOCK) {
+#else
+            if(err == EAGAIN || err == EWOULDBLOCK) {
+#endif
+                return true;                            // 发送缓冲区满了，等下次可写
+            }
+            return false;
+        }
+        *pos += n;
+        conn.active_time = TimesUtil::GetTimeMillisecond();
+    }
+    return false;                                       // 发送完毕，短连接直接关闭
+}
+
+/**
+ * @brief 解析请求行，然后交给处理函数。只解析请求行，忽略请求头和请求体。
+ * @param conn 连接。
+ * @param header_end 请求头结束的位置。
+ * @return void。
+ */
+void HttpServer::handleRequest(HttpConnection &conn, size_t header_end)
+{
+    HttpRequest &request = conn.request;
+    std::string line = conn.recv_buf.substr(0, conn.recv_buf.find("\r\n"));
+    size_t sp1 = line.find(' ');
+    size_t sp2 = line.find(' ', sp1 + 1);
+    conn.recv_buf.clear();
+    conn.request_time = TimesUtil::GetTimeMillisecond();
+    if(sp1 == std::string::npos || sp2 == std::string::npos || header_end == 0) {
+        request.path.clear();
+        request.method.clear();
+    } else {
+        request.method = line.substr(0, sp1);
+        std::string uri = line.substr(sp1 + 1, sp2 - sp1 - 1);
+        size_t qs = uri.find('?');
+        request.path = uri.substr(0, qs);
+        if(qs != std::string::npos) {
+            request.query = uri.substr(qs + 1);
+        }
+    }
+    dispatchRequest(conn);
+}
+
+/**
+ * @brief 找到路径的处理函数，精确匹配优先，其次是以'/'结尾的最长前缀。
+ * @return 没有返回NULL。
+ */
+HttpHandler *HttpServer::findHandler(const std::string &path)
+{
+    std::map<std::string, HttpHandler>::iterator it = handlers_.find(path);
+    if(it != handlers_.end()) {
+        return &it->second;
+    }
+    HttpHandler *handler = NULL;
+    size_t length = 0;
+    for(it = handlers_.begin(); it != handlers_.end(); ++it) {
+        const std::string &prefix = it->first;
+        if(!prefix.empty() && prefix[prefix.size() - 1] == '/' && prefix.size() > length
+                && path.compare(0, prefix.size(), prefix) == 0) {
+            handler = &it->second;
+            length = prefix.size();
+        }
+    }
+    return handler;
+}
+
+/**
+ * @brief 调用处理函数生成响应，处理函数挂起请求时只记录状态，等下一轮再调用。
+ * @param conn 连接，请求已经解析到conn.request。
+ * @return void。
+ */
+void HttpServer::dispatchRequest(HttpConnection &conn)
+{
+    HttpRequest &request = conn.request;
+    HttpResponse response;
+    request.wait_time = TimesUtil::GetTimeMillisecond() - conn.request_time;
+    if(request.method.empty()) {
+        response.status = 400;
+        response.body = "bad request\n";
+    } else {
+        HttpHandler *handler = findHandler(request.path);
+        if(!handler) {
+            response.status = 404;
+            response.body = "not found\n";
+        } else {
+            (*handler)(request, &response);
+        }
+    }
+    conn.holding = response.hold;
+    if(response.hold) {
+        return;
+    }
+
+    const char *reason = "OK";
+    if(response.status == 400) {
+        reason = "Bad Request";
+    } else if(response.status == 404) {
+        reason = "Not Found";
+    } else if(response.status == 503) {
+        reason = "Service Unavailable";
+    } else if(response.status != 200) {
+        reason = "Error";
+    }
+    size_t content_length = response.body.size();
+    for(size_t i = 0; i < response.chunks.size(); i++) {
+        content_length += response.chunks[i]->size();
+    }
+    char header[256];
+    snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: close\r\n",
+             response.status, reason, response.content_type.c_str(), (int)content_length);
+    conn.send_buf = header;
+    conn.send_buf += response.headers;
+    conn.send_buf += "\r\n";
+    if(request.method != "HEAD") {
+        conn.send_buf += response.body;
+        conn.send_chunks.swap(response.chunks);
+    }
+    conn.send_pos = 0;
+    conn.chunk_index = 0;
+    conn.chunk_pos = 0;
+}
@@ -0,0 +1,94 @@
+﻿#ifndef HTTPSERVER_H
+#define HTTPSERVER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include "commonlooper.h"
+#include "timesutil.h"
+
+#ifdef _WIN32
+typedef SOCKET socket_t;
+#else
+typedef int socket_t;
+#ifndef INVALID_SOCKET
+#define INVALID_SOCKET -1
+#endif
+#endif
+
+typedef struct http_request
+{
+    std::string method;                                 // GET、POST等
+    std::string path;                                   // 不包含?后面的参数
+    std::string query;                                  // ?后面的参数，没有则为空
+    int64_t wait_time = 0;                              // 请求已经等待的时间，单位ms，用于挂起的请求判断超时
+}HttpRequest;
+
+typedef struct http_response
+{
+    int status = 200;
+    std::string content_type = "text/plain; charset=utf-8";
+    std::string body;
+    std::string headers;                                // 额外的响应头，每行以\r\n结尾
+    std::vector<std::shared_ptr<const std::string> > chunks;   // 跟在body后面发送的共享数据，不拷贝
+    bool hold = false;                                  // 处理函数设置为true表示数据还没准备好，稍后再次调用处理函数
+}HttpResponse;
+
+typedef std::function<void(const HttpRequest &, HttpResponse *)> HttpHandler;
+
+/**
+ * 内嵌的单线程http服务器，用于本地调试、抓取指标与LL-HLS源站，不追求性能。
+ * 一个线程用select处理监听和所有连接，连接都是非阻塞的，请求处理完后短连接关闭(Connection: close)。
+ * 处理函数在本线程中被调用，所以处理函数不能阻塞，也不能访问推流热路径上需要加锁的数据。
+ * 处理函数可以设置response->hold挂起请求(例如LL-HLS的阻塞刷新)，有挂起的请求时select超时缩短到HTTP_HOLD_POLL_MS，
+ * 每次超时重新调用处理函数，直到它给出响应，超时由处理函数根据request.wait_time决定。
+ * 以'/'结尾的路径是前缀匹配，例如"/hls/"处理所有/hls/下的请求，精确匹配优先。
+ */
+class HttpServer : public CommonLooper
+{
+public:
+    HttpServer();
+    virtual ~HttpServer();
+
+    RET_CODE Init(const Properties &properties);
+    void AddHandler(const std::string &path, HttpHandler handler);  // 需要在Start之前添加
+    virtual RET_CODE Start();
+    virtual void Loop();
+    void DeInit();
+
+private:
+    typedef struct http_connection
+    {
+        socket_t fd;
+        std::string recv_buf;
+        std::string send_buf;
+        size_t send_pos;
+        int64_t active_time;                            // 最后一次收发数据的时间，用于关闭空闲连接
+        std::vector<std::shared_ptr<const std::string> > send_chunks;
+        size_t chunk_index;                             // send_buf发完后正在发送的send_chunks下标
+        size_t chunk_pos;
+        bool holding;                                   // 请求被处理函数挂起
+        int64_t request_time;                           // 收到完整请求头的时间
+        HttpRequest request;
+    }HttpConnection;
+
+    void acceptConnection();
+    bool readConnection(HttpConnection &conn);          // 返回false表示需要关闭连接
+    bool writeConnection(HttpConnection &conn);
+    void handleRequest(HttpConnection &conn, size_t header_end);
+    void dispatchRequest(HttpConnection &conn);
+    HttpHandler *findHandler(const std::string &path);
+    static void setNonBlocking(socket_t fd);
+
+    std::string ip_ = "127.0.0.1";                      // 默认只监听本地
+    int port_ = 0;
+    int max_connections_ = 16;
+    int idle_timeout_ = 5000;                           // 连接空闲超时，单位ms
+    socket_t listen_fd_ = INVALID_SOCKET;
+    std::vector<HttpConnection> connections_;
+    std::map<std::string, HttpHandler> handlers_;
+};
+
+#endif // HTTPSERVER_H
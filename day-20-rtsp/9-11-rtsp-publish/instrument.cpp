@@ -0,0 +1,194 @@
+﻿#include "instrument.h"
+
+#ifdef PUSH_INSTRUMENT
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <map>
+#include <thread>
+#include "dlog.h"
+#include "timesutil.h"
+
+#define INSTRUMENT_MAX_SITES 128                        // 静态分配，保证alignas(64)生效；超出后都记到最后一个位置
+
+static InstrumentSite g_sites[INSTRUMENT_MAX_SITES];
+static int g_site_count = 0;
+static std::atomic<InstrumentSite *> g_first_site{NULL};
+static std::mutex g_sites_mutex;                        // 只在创建位置时使用，本身不插桩
+
+InstrumentSite *Instrument::GetSite(const char *name, InstrumentSiteType type)
+{
+    std::lock_guard<std::mutex> lock(g_sites_mutex);
+    for(int i = 0; i < g_site_count; i++) {
+        if(g_sites[i].type == type && 0 == strcmp(g_sites[i].name, name)) {
+            return &g_sites[i];
+        }
+    }
+    if(g_site_count == INSTRUMENT_MAX_SITES) {
+        return &g_sites[INSTRUMENT_MAX_SITES - 1];
+    }
+    InstrumentSite *site = &g_sites[g_site_count++];
+    site->name = g_site_count == INSTRUMENT_MAX_SITES ? "other" : name;
+    site->type = type;
+    for(int i = 0; i <= LOCK_WAIT_BUCKETS; i++) {
+        site->wait_buckets[i].store(0, std::memory_order_relaxed);
+    }
+    site->next = g_first_site.load(std::memory_order_relaxed);
+    g_first_site.store(site, std::memory_order_release);   // 打印线程不加锁遍历链表
+    return site;
+}
+
+InstrumentSite *Instrument::FirstSite()
+{
+    return g_first_site.load(std::memory_order_acquire);
+}
+
+/**
+ * @brief 记录一次竞争的等待时间。
+ * @param wait 单位微秒。
+ */
+void Instrument::ObserveWait(InstrumentSite *site, int64_t wait)
+{
+    int i = 0;
+    while(i < LOCK_WAIT_BUCKETS && wait > kLockWaitBuckets[i]) {
+        i++;
+    }
+    site->wait_buckets[i].fetch_add(1, std::memory_order_relaxed);
+    site->contended.fetch_add(1, std::memory_order_relaxed);
+    site->wait_sum.fetch_add(wait, std::memory_order_relaxed);
+    int64_t max = site->wait_max.load(std::memory_order_relaxed);
+    while(wait > max && !site->wait_max.compare_exchange_weak(max, wait, std::memory_order_relaxed)) {
+    }
+}
+
+void InstrumentedMutex::lock()
+{
+    // 没有竞争时不取时间，只多一次原子加
+    if(!mutex_.try_lock()) {
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        mutex_.lock();
+        int64_t wait = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - begin).count();
+        Instrument::ObserveWait(site_, wait);
+    }
+    site_->count.fetch_add(1, std::memory_order_relaxed);
+}
+
+// 上一次打印时的累计值，用来算这段时间内的增量
+typedef struct instrument_snapshot
+{
+    int64_t count;
+    int64_t contended;
+    int64_t wait_sum;
+    int64_t wait_buckets[LOCK_WAIT_BUCKETS + 1];
+    int64_t bytes;
+    int64_t frees;
+    int64_t free_bytes;
+}InstrumentSnapshot;
+
+static std::map<InstrumentSite *, InstrumentSnapshot> g_snapshots;     // 只在Dump中访问
+
+// 直方图的分位数，写出所在桶的上限，例如"<=250us"，落在+Inf桶时为">10000us"
+static void waitQuantile(const int64_t *buckets, int64_t total, double quantile, char *out, int size)
+{
+    int64_t target = (int64_t)(total * quantile + 0.5);
+    int64_t sum = 0;
+    for(int i = 0; i < LOCK_WAIT_BUCKETS; i++) {
+        sum += buckets[i];
+        if(sum >= target) {
+            snprintf(out, size, "<=%lldus", (long long)kLockWaitBuckets[i]);
+            return;
+        }
+    }
+    snprintf(out, size, ">%lldus", (long long)kLockWaitBuckets[LOCK_WAIT_BUCKETS - 1]);
+}
+
+InstrumentReporter::InstrumentReporter(int interval)
+    : interval_(interval > 0 ? interval : 10)
+{
+    pre_dump_time_ = TimesUtil::GetTimeMillisecond();
+}
+
+InstrumentReporter::~InstrumentReporter()
+{
+    Stop();
+}
+
+void InstrumentReporter::Loop()
+{
+    while(!request_abort_) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if(TimesUtil::GetTimeMillisecond() - pre_dump_time_ >= interval_ * 1000) {
+            Dump();
+        }
+    }
+    Dump();                                             // 退出前把最后一段打印出来
+}
+
+/**
+ * @brief 打印距离上一次打印这段时间内每个位置的统计，wait_max是从开始到现在的最大值。
+ * @return void。
+ */
+void InstrumentReporter::Dump()
+{
+    int64_t now = TimesUtil::GetTimeMillisecond();
+    double seconds = (now - pre_dump_time_) / 1000.0;
+    pre_dump_time_ = now;
+    if(seconds <= 0) {
+        return;
+    }
+    LogInfo("instrument: ---- last %0.1lfs ----", seconds);
+    for(InstrumentSite *site = Instrument::FirstSite(); site; site = site->next) {
+        InstrumentSnapshot current;
+        current.count = site->count.load(std::memory_order_relaxed);
+        current.contended = site->contended.load(std::memory_order_relaxed);
+        current.wait_sum = site->wait_sum.load(std::memory_order_relaxed);
+        for(int i = 0; i <= LOCK_WAIT_BUCKETS; i++) {
+            current.wait_buckets[i] = site->wait_buckets[i].load(std::memory_order_relaxed);
+        }
+        current.bytes = site->bytes.load(std::memory_order_relaxed);
+        current.frees = site->frees.load(std::memory_order_relaxed);
+        current.free_bytes = site->free_bytes.load(std::memory_order_relaxed);
+
+        InstrumentSnapshot &previous = g_snapshots[site];   // 第一次是全0
+        int64_t count = current.count - previous.count;
+        int64_t frees = current.frees - previous.frees;
+        if(0 == count && 0 == frees) {
+            previous = current;
+            continue;
+        }
+        if(INSTRUMENT_LOCK == site->type) {
+            int64_t contended = current.contended - previous.contended;
+            int64_t buckets[LOCK_WAIT_BUCKETS + 1];
+            for(int i = 0; i <= LOCK_WAIT_BUCKETS; i++) {
+                buckets[i] = current.wait_buckets[i] - previous.wait_buckets[i];
+            }
+            int64_t wait_sum = current.wait_sum - previous.wait_sum;
+            char p50[16] = "0us";
+            char p99[16] = "0us";
+            if(contended > 0) {
+                waitQuantile(buckets, contended, 0.5, p50, sizeof(p50));
+                waitQuantile(buckets, contended, 0.99, p99, sizeof(p99));
+            }
+            LogInfo("instrument: lock %s, acquire-%0.0lf/s, contended-%0.0lf/s(%0.3lf%%), wait total-%0.1lfms, "
+                    "avg-%lldus, p50-%s, p99-%s, max-%lldus",
+                    site->name, count / seconds, contended / seconds, count > 0 ? contended * 100.0 / count : 0.0,
+                    wait_sum / 1000.0, contended > 0 ? wait_sum / contended : 0LL, p50, p99,
+                    site->wait_max.load(std::memory_order_relaxed));
+        } else {
+            int64_t bytes = current.bytes - previous.bytes;
+            if(current.frees > 0) {
+                LogInfo("instrument: alloc %s, alloc-%0.0lf/s(%0.1lfKB/s), free-%0.0lf/s, live-%lld(%lldKB)",
+                        site->name, count / seconds, bytes / 1024.0 / seconds, frees / seconds,
+                        current.count - current.frees, (current.bytes - current.free_bytes) / 1024);
+            } else {
+                LogInfo("instrument: alloc %s, alloc-%0.0lf/s(%0.1lfKB/s), avg-%lldB",
+                        site->name, count / seconds, bytes / 1024.0 / seconds, count > 0 ? bytes / count : 0LL);
+            }
+        }
+        previous = current;
+    }
+}
+
+#endif // PUSH_INSTRUMENT
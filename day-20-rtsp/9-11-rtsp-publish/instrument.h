@@ -0,0 +1,136 @@
+﻿#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+/**
+ * 分配与锁竞争的插桩，只在定义了PUSH_INSTRUMENT时编译进来(qmake CONFIG+=instrument)，用来确认会话多的时候
+ * 开销是不是在分配器与锁上。
+ * 1）锁：项目里的锁都声明成PushMutex，条件变量声明成PushCondition。插桩时PushMutex先try_lock，成功只加一次获取计数；
+ *    失败才算一次竞争，计时阻塞等待的时间并记到直方图。条件变量换成condition_variable_any，wait醒来后重新加锁也会被统计。
+ * 2）分配：在分配、释放的地方调用PUSH_ALLOC、PUSH_FREE，按位置统计次数与字节数。
+ * 3）统计按位置(名字相同的锁、分配点合在一起)用relaxed原子累加，InstrumentReporter线程定时打印每个位置在这段时间内的速率。
+ *
+ * 不插桩时PushMutex就是std::mutex，PushCondition就是std::condition_variable，宏都展开为空，没有任何额外开销。
+ */
+
+#include <mutex>
+#include <condition_variable>
+
+#ifdef PUSH_INSTRUMENT
+
+#include <atomic>
+#include <stdint.h>
+#include "commonlooper.h"
+
+// 锁等待时间直方图的桶上限，单位微秒，最后还有一个+Inf桶
+#define LOCK_WAIT_BUCKETS 12
+static const int64_t kLockWaitBuckets[LOCK_WAIT_BUCKETS] = {
+    1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 5000, 10000
+};
+
+enum InstrumentSiteType
+{
+    INSTRUMENT_LOCK = 0,
+    INSTRUMENT_ALLOC
+};
+
+// 一个统计位置，创建后不会释放，单独占一个缓存行避免不同位置之间的伪共享
+struct alignas(64) InstrumentSite
+{
+    const char *name;
+    InstrumentSiteType type;
+    std::atomic<int64_t> count{0};                      // 锁的获取次数，或者分配次数
+    std::atomic<int64_t> contended{0};                  // 锁：try_lock失败的次数
+    std::atomic<int64_t> wait_sum{0};                   // 锁：等待的总时间，单位微秒
+    std::atomic<int64_t> wait_max{0};
+    std::atomic<int64_t> wait_buckets[LOCK_WAIT_BUCKETS + 1];
+    std::atomic<int64_t> bytes{0};                      // 分配：总字节数
+    std::atomic<int64_t> frees{0};                      // 分配：释放次数，只有成对插桩的位置才有
+    std::atomic<int64_t> free_bytes{0};
+    InstrumentSite *next;
+};
+
+class Instrument
+{
+public:
+    // 按名字取统计位置，没有就创建，name需要是字符串常量
+    static InstrumentSite *GetSite(const char *name, InstrumentSiteType type);
+    static InstrumentSite *FirstSite();
+
+    static inline void Alloc(InstrumentSite *site, int64_t bytes) {
+        site->count.fetch_add(1, std::memory_order_relaxed);
+        site->bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    static inline void Free(InstrumentSite *site, int64_t bytes) {
+        site->frees.fetch_add(1, std::memory_order_relaxed);
+        site->free_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    static void ObserveWait(InstrumentSite *site, int64_t wait);
+};
+
+// 带统计的互斥锁，满足Lockable，可以用于lock_guard、unique_lock与condition_variable_any
+class InstrumentedMutex
+{
+public:
+    explicit InstrumentedMutex(const char *name = "unnamed")
+        : site_(Instrument::GetSite(name, INSTRUMENT_LOCK)) {
+    }
+    InstrumentedMutex(const InstrumentedMutex &) = delete;
+    InstrumentedMutex &operator=(const InstrumentedMutex &) = delete;
+
+    void lock();
+    bool try_lock() {
+        if(!mutex_.try_lock()) {
+            return false;
+        }
+        site_->count.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    void unlock() {
+        mutex_.unlock();
+    }
+
+private:
+    std::mutex mutex_;
+    InstrumentSite *site_;
+};
+
+/**
+ * 定时打印每个统计位置的速率：锁是每秒获取次数、竞争比例、等待时间的平均、p50、p99(直方图桶上限)与最大值；
+ * 分配是每秒次数、字节数，成对插桩的还有未释放的个数。interval内没有变化的位置不打印。
+ */
+class InstrumentReporter : public CommonLooper
+{
+public:
+    explicit InstrumentReporter(int interval);          // 单位秒
+    virtual ~InstrumentReporter();
+    virtual void Loop();
+    void Dump();                                        // 立即打印一次
+
+private:
+    int interval_ = 10;
+    int64_t pre_dump_time_ = 0;
+};
+
+typedef InstrumentedMutex PushMutex;
+typedef std::condition_variable_any PushCondition;
+#define PUSH_LOCK_SITE(name) name
+#define PUSH_ALLOC(name, bytes) do { \
+        static InstrumentSite *instrument_site = Instrument::GetSite(name, INSTRUMENT_ALLOC); \
+        Instrument::Alloc(instrument_site, bytes); \
+    } while(0)
+#define PUSH_FREE(name, bytes) do { \
+        static InstrumentSite *instrument_site = Instrument::GetSite(name, INSTRUMENT_ALLOC); \
+        Instrument::Free(instrument_site, bytes); \
+    } while(0)
+
+#else
+
+typedef std::mutex PushMutex;
+typedef std::condition_variable PushCondition;
+#define PUSH_LOCK_SITE(name)
+#define PUSH_ALLOC(name, bytes) do {} while(0)
+#define PUSH_FREE(name, bytes) do {} while(0)
+
+#endif // PUSH_INSTRUMENT
+
+#endif // INSTRUMENT_H
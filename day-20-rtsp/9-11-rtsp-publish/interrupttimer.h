@@ -0,0 +1,85 @@
+﻿#ifndef INTERRUPTTIMER_H
+#define INTERRUPTTIMER_H
+
+#include <math.h>
+#include <atomic>
+#include "timesutil.h"
+#include "dlog.h"
+#include "sendpacer.h"
+
+/**
+ * 防止FFmpeg接口卡死的超时检测，作为AVFormatContext的interrupt_callback.opaque。
+ * 调用可能卡死的接口之前Reset，阻塞超过timeout后Callback返回1，FFmpeg就会退出阻塞。
+ * 设置了SendPacer时，FFmpeg每写一个RTP包之前的回调也用于平滑发送，平滑等待的时间不算作阻塞，详看SendPacer。
+ * 设置了stall_limit时，阻塞超过stall_limit也退出，用于有备用连接时尽快切换，不用等到timeout。
+ *
+ * 注意：打开网络io时FFmpeg会把interrupt_callback拷贝到内部的URLContext，之后再修改fmt_ctx->interrupt_callback是无效的，
+ *      所以一个InterruptTimer必须和它的AVFormatContext一起创建、一起转移(例如主备切换)、一起释放。
+ */
+class InterruptTimer
+{
+public:
+    InterruptTimer(int timeout) : timeout_(timeout) {}
+
+    // 重置为当前时间，每次调用FFmpeg有可能卡死的接口之前都应该调用
+    void Reset()
+    {
+        pre_time_ = TimesUtil::GetTimeMillisecond();
+    }
+    // 加fabs是防止windows下GetTickCount归0造成更大的误差
+    bool IsTimeout()
+    {
+        return fabs(TimesUtil::GetTimeMillisecond() - pre_time_) > timeout_;
+    }
+    int GetTimeout()
+    {
+        return timeout_;
+    }
+    int64_t GetBlockTime()
+    {
+        return TimesUtil::GetTimeMillisecond() - pre_time_;
+    }
+    // 只能在调用FFmpeg接口的线程中设置，NULL不平滑
+    void SetPacer(SendPacer *pacer)
+    {
+        pacer_ = pacer;
+    }
+    // 只能在调用FFmpeg接口的线程中设置，单位ms，0不限制
+    void SetStallLimit(int stall_limit)
+    {
+        stall_limit_ = stall_limit;
+    }
+
+    /**
+     * @brief 中断回调函数，赋值给interrupt_callback.callback。
+     * @param opaque InterruptTimer对象。
+     * @return 0: 继续阻塞;  1: 退出阻塞
+     */
+    static int Callback(void *opaque)
+    {
+        InterruptTimer *timer = (InterruptTimer *)opaque;
+        if(timer->pacer_) {
+            int64_t wait = timer->pacer_->OnWriteHook();
+            if(wait > 0) {
+                timer->pre_time_ += wait / 1000;        // 平滑等待的时间不算作阻塞
+            }
+        }
+        if(timer->IsTimeout()) {
+            LogWarn("interrupt callback timeout: %d ms", timer->GetTimeout());
+            return 1;
+        }
+        if(timer->stall_limit_ > 0 && timer->GetBlockTime() > timer->stall_limit_) {
+            LogWarn("interrupt callback stall: %d ms", timer->stall_limit_);
+            return 1;
+        }
+        return 0;
+    }
+
+private:
+    int timeout_;
+    std::atomic<int64_t> pre_time_{0};                  // 记录调用ffmpeg api之前的时间
+    SendPacer *pacer_ = NULL;
+    int stall_limit_ = 0;
+};
+
+#endif // INTERRUPTTIMER_H
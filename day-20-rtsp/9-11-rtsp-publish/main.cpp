@@ -60,20 +60,39 @@ int main()
         // 音频test模式
         properties.SetProperty("audio_test", 1);                    // 音频测试模式，这个配置应该是为后面切换到不同的播放模式
         properties.SetProperty("input_pcm_name", "buweishui_48000_2_s16le.pcm");
+        properties.SetProperty("audio_source", "file");             // pattern 合成测试音频，不需要pcm文件
+        properties.SetProperty("audio_pattern", "tone");            // tone sweep beep，beep每秒开头响100ms，配合帧序号检查音视频同步
+        properties.SetProperty("audio_pattern_frequency", 1000);
+        properties.SetProperty("audio_shm_name", "/push_audio");    // audio_source为shm时，由外部采集进程(例如tools/shmproducer)写入
         // 麦克风采样属性(采集部分)
         properties.SetProperty("mic_sample_fmt", AV_SAMPLE_FMT_S16);
         properties.SetProperty("mic_sample_rate", 48000);
         properties.SetProperty("mic_channels", 2);
+        // 混音：麦克风与背景音等多路输入混成一路再编码，"source:arg@增益dB"，source为file、pattern或者shm，空表示不混音
+        properties.SetProperty("audio_mix_inputs", "");            // 例如"file:bgm_48k_2ch_s16.pcm@-12,pattern:beep@-6"
+        properties.SetProperty("audio_mix_mic_gain_db", 0);
+        properties.SetProperty("audio_mix_mode", "float");          // float累加最后削波，s16逐路饱和相加更快
+        properties.SetProperty("audio_mix_delay", 50);              // 混音输出比采集晚的毫秒数，吸收各路采集的抖动
         // 音频编码属性(编码部分)
         properties.SetProperty("audio_sample_rate", 48000);
         properties.SetProperty("audio_bitrate", 64 * 1024);
         properties.SetProperty("audio_channels", 2);
+        // 音频编码器，对讲等低延时场景使用opus 10ms帧(算法延时12.5ms，aac是42.7ms)，需要ffmpeg带libopus
+        properties.SetProperty("audio_codec", "aac");               // aac or opus
+        properties.SetProperty("audio_frame_duration", 20);         // opus的帧长，10或者20ms
+        properties.SetProperty("audio_opus_application", "lowdelay");
 
         //视频test模式
         properties.SetProperty("video_test", 1);
         properties.SetProperty("input_yuv_name", "720x480_25fps_420p.yuv");
         //properties.SetProperty("input_yuv_name", "yuv420p_1280x720.yuv");
         //properties.SetProperty("input_yuv_name", "test-cmd.yuv");//1280x720
+        properties.SetProperty("video_source", "file");             // pattern 合成测试图像，分辨率帧率由desktop_*决定，可以测4K60
+        properties.SetProperty("video_pattern", "gradient");        // gradient 移动渐变，noise 叠加随机噪声
+        // properties.SetProperty("video_pattern_noise_bits", 4);   // 每个像素随机的低位数0-8，控制画面的熵
+        properties.SetProperty("video_pattern_seed", 1);            // 相同的种子每次生成完全一样的画面
+        properties.SetProperty("video_pattern_counter", 1);         // 左上角画出帧序号
+        properties.SetProperty("video_shm_name", "/push_video");    // video_source为shm时，格式必须与desktop_*一致
         // 桌面录制属性(采集部分)
         properties.SetProperty("desktop_x", 0);
         properties.SetProperty("desktop_y", 0);
@@ -83,6 +102,32 @@ int main()
         properties.SetProperty("desktop_fps", 25);                  // 测试模式时和yuv文件的帧率一致
         // 视频编码属性(编码部分)
         properties.SetProperty("video_bitrate", 512 * 1024);        // 设置码率
+        properties.SetProperty("video_intra_refresh", 0);           // 1 周期帧内刷新代替周期IDR，消除I帧的码率峰值
+        properties.SetProperty("video_slice_max_size", 0);          // 例如1200，使每个NAL都能放进一个网络包
+        // 静止画面检测，桌面、课件等画面不动时节省编码cpu
+        properties.SetProperty("video_static_mode", 0);             // 0关闭 1跳过编码(至少每秒编码一帧) 2提高qp降低质量
+        properties.SetProperty("video_static_block_threshold", 2);  // 16x16块内平均每个像素的差超过2认为该块变化
+        properties.SetProperty("video_static_qp_offset", 6);
+        // 多分辨率同时推流，例如"384x240@256"，额外推送到RTSP_URL后面加"_240p"的地址，""不开启
+        properties.SetProperty("video_layers", "");
+        // 画中画，"source:arg:源宽x源高@x,y,宽x高[,alpha]"，多个用分号分隔，source为file、pattern、shm或者image(yuv420p/yuva420p的静态图)
+        properties.SetProperty("video_overlays", "");               // 例如"pattern:noise:640x360@40,40,320x180,200"
+        // 左下角烧录时间码，tools/latencyanalyzer从rtsp服务器拉流读出来，统计端到端延时与抖动
+        properties.SetProperty("video_timecode", 0);                // 1开启
+        // 编码质量监测，每N帧采样一帧，后台解码主流计算PSNR/SSIM，结果打印到日志并输出到指标
+        properties.SetProperty("video_quality_interval", 0);        // 例如25，0不开启
+        properties.SetProperty("video_quality_max_cpu", 20);        // 监测线程最多占一个核的20%
+        // 编码cpu过载调节，负载超过85%逐级降级：superfast -> 半帧率 -> 半分辨率 -> 丢帧，负载降下来5秒后逐级恢复
+        properties.SetProperty("video_governor_enable", 0);         // 1开启
+        properties.SetProperty("video_governor_fast_preset", "superfast");
+        properties.SetProperty("video_governor_high_load", 85);
+        properties.SetProperty("video_governor_low_load", 50);
+
+        // 音频不连续传输，持续静音时跳过编码，只每隔500ms发送一帧舒适噪声
+        properties.SetProperty("audio_dtx_enable", 0);              // 1开启
+        properties.SetProperty("audio_silence_threshold_db", -50);  // 低于-50dBFS认为是静音
+        properties.SetProperty("audio_silence_hangover_ms", 300);
+        properties.SetProperty("audio_comfort_interval_ms", 500);
 
         // 配置rtsp
         //1.url
@@ -91,6 +136,35 @@ int main()
         properties.SetProperty("rtsp_transport", "udp");            // udp or tcp
         properties.SetProperty("rtsp_timeout", 5000);               // connect server timeout
         properties.SetProperty("rtsp_max_queue_duration", 1000);
+        // 发送平滑，I帧拆成的RTP包按码率逐个发出，不再一次突发，发送码率为音视频码率之和的1.5倍(百分比)
+        properties.SetProperty("rtsp_pacing_enable", 0);            // 1开启
+        properties.SetProperty("rtsp_pacing_multiple", 150);
+        // 磁盘溢出缓存，断网时队列不再drop，而是溢出到文件，恢复后按2倍速追赶
+        properties.SetProperty("rtsp_spill_enable", 0);             // 1开启
+        properties.SetProperty("rtsp_spill_file_size_mb", 256);
+        properties.SetProperty("rtsp_spill_catchup_percent", 200);
+        // 热备连接，主服务器故障时无缝切换到备用服务器，""不开启
+        properties.SetProperty("rtsp_standby_url", "");
+        properties.SetProperty("rtsp_standby_keepalive_interval", 1000);
+        properties.SetProperty("rtsp_failover_stall_time", 1000);
+        // 内嵌rtsp服务器，ffplay -rtsp_transport tcp rtsp://ip:8554/live 直接从推流端拉流，0不开启。rtsp_url设为""时只用内嵌服务器
+        properties.SetProperty("rtsp_server_port", 0);
+        properties.SetProperty("rtsp_server_path", "live");
+        properties.SetProperty("rtsp_server_rtp_port", 30000);     // udp拉流时服务器使用30000-30003
+        // LL-HLS输出，hls.js等播放 http://ip:9100/hls/live.m3u8，与指标共用http端口，hls_dir不为空时同时写到该目录
+        properties.SetProperty("hls_enable", 0);                    // 1开启
+        properties.SetProperty("hls_dir", "");
+        properties.SetProperty("hls_part_duration", 200);
+        properties.SetProperty("hls_segment_duration", 2000);
+        // 转推已经编码的H.264/AAC输入，不采集不编码，例如"input.mp4"或者摄像头的"rtsp://192.168.1.64/stream1"，""不开启
+        properties.SetProperty("passthrough_url", "");
+        properties.SetProperty("passthrough_loop", 1);              // 文件读完后从头循环
+        properties.SetProperty("passthrough_rtsp_transport", "tcp");
+        // 运行指标，0不开启，设置端口(例如9100)后 curl http://127.0.0.1:9100/metrics 查看
+        properties.SetProperty("metrics_port", 0);
+        properties.SetProperty("session_name", "livestream");
+        // 分配与锁竞争的统计打印间隔(秒)，只在qmake CONFIG+=instrument编译时有效
+        properties.SetProperty("instrument_interval", 10);
 
         if(push_work.Init(properties) != RET_OK) {
             LogError("PushWork init failed");
@@ -112,6 +186,15 @@ int main()
                 case MSG_RTSP_QUEUE_DURATION:
                     LogError("MSG_RTSP_QUEUE_DURATION a:%d, v:%d", msg.arg1, msg.arg2);
                     break;
+                case MSG_RTSP_STARTUP:
+                    LogInfo("MSG_RTSP_STARTUP connect:%dms, first key frame:%dms", msg.arg1, msg.arg2);
+                    break;
+                case MSG_RTSP_FAILOVER:
+                    LogWarn("MSG_RTSP_FAILOVER failover:%dms, resend:%d", msg.arg1, msg.arg2);
+                    break;
+                case MSG_ENCODE_GOVERNOR_LEVEL:
+                    LogWarn("MSG_ENCODE_GOVERNOR_LEVEL level:%d, load:%d%%", msg.arg1, msg.arg2);
+                    break;
                 default:
                     break;
                 }
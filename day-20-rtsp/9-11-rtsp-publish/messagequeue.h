@@ -5,6 +5,7 @@
 #include <condition_variable>
 #include <list>
 #include "dlog.h"
+#include "instrument.h"
 extern "C"
 {
 #include "libavcodec/avcodec.h"
@@ -13,6 +14,9 @@ extern "C"
 #define MSG_FLUSH                   1
 #define MSG_RTSP_ERROR              100
 #define MSG_RTSP_QUEUE_DURATION     101
+#define MSG_RTSP_STARTUP            102     // 起播耗时，arg1 连接服务器耗时ms，arg2 从开始连接到第一个关键帧发出的耗时ms
+#define MSG_RTSP_FAILOVER           103     // 切换到备用连接，arg1 从检测到故障到关键帧在备用连接发出的耗时ms，arg2 重发的视频包数
+#define MSG_ENCODE_GOVERNOR_LEVEL   104     // 编码调节器级别改变，arg1 新的级别(GovernorLevel)，arg2 当时的负载百分比
 
 // 消息处理结构体，类似做法ijkplayer的消息控制
 typedef struct AVMessage
@@ -50,7 +54,7 @@ public:
     int msg_queue_put(AVMessage *msg)
     {
         LogInfo("msg_queue_put");
-        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<PushMutex> lock(mutex_);
         int ret = msg_queue_put_private(msg);
         if(-1 == ret) {
             return -1;
@@ -76,7 +80,7 @@ public:
         }
 
         // 处理获取消息的过程
-        std::unique_lock<std::mutex> lock(mutex_);
+        std::unique_lock<PushMutex> lock(mutex_);
         AVMessage *msg1;
         int ret;
         for(;;) {
@@ -91,6 +95,7 @@ public:
                 msg1= queue_.front();
                 *msg = *msg1;
                 queue_.pop_front();
+                PUSH_FREE("message_queue_msg", sizeof(AVMessage));
                 av_free(msg1);      // 因为push时是深拷贝，所以需要释放msg1
                 ret = 1;
                 break;
@@ -140,7 +145,7 @@ public:
     */
     void msg_queue_remove(int what)
     {
-        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<PushMutex> lock(mutex_);
         while(!abort_request_ && !queue_.empty()) {
             std::list<AVMessage *>::iterator it;
             AVMessage *msg = NULL;
@@ -154,6 +159,7 @@ public:
                 if(msg->obj && msg->free_l) {
                     msg->free_l(msg->obj);
                 }
+                PUSH_FREE("message_queue_msg", sizeof(AVMessage));
                 av_free(msg);
                 queue_.remove(msg); // 每次从队列中删除一个与msg相同值的元素。注意这里是地址值，不过普通值应该也没问题。它不会把msg地址释放，需要用户自行处理该内存，它只会移除队列。
             } else {
@@ -170,7 +176,7 @@ public:
     */
     void msg_queue_erase(int what)
     {
-        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<PushMutex> lock(mutex_);
         if(abort_request_){         // 1中断，判断一次即可，不用像上面每次都判断，因为已经上锁了，整个函数都是原子操作，本次调用要么是0，要么是1.
             return;
         }
@@ -180,6 +186,7 @@ public:
                 if(msg->obj && msg->free_l){
                     msg->free_l(msg->obj);
                 }
+                PUSH_FREE("message_queue_msg", sizeof(AVMessage));
                 av_free(msg);
                 it = queue_.erase(it);
             }else{
@@ -251,6 +258,7 @@ public:
         msg.arg1 = arg1;
         msg.arg2 = arg2;
         msg.obj = av_malloc(obj_len);
+        PUSH_ALLOC("message_queue_obj", obj_len);
         msg.free_l = msg_obj_free_l;
         memcpy(msg.obj, obj, obj_len);
         msg_queue_put(&msg);
@@ -261,7 +269,7 @@ public:
     */
     void msg_queue_abort()
     {
-        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<PushMutex> lock(mutex_);
         abort_request_ = 1;
     }
 
@@ -270,13 +278,14 @@ public:
     */
     void msg_queue_flush()
     {
-        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<PushMutex> lock(mutex_);
         while (!queue_.empty()) {
             AVMessage *msg = queue_.front();
             if(msg->obj && msg->free_l) {
                 msg->free_l(msg->obj);
             }
             queue_.pop_front();
+            PUSH_FREE("message_queue_msg", sizeof(AVMessage));
             av_free(msg);
         }
     }
@@ -308,6 +317,7 @@ private:
         if(!msg1) {
             return -1;
         }
+        PUSH_ALLOC("message_queue_msg", sizeof(AVMessage));
         *msg1 = *msg;
         queue_.push_back(msg1);
 
@@ -316,8 +326,8 @@ private:
 
 private:
     int abort_request_ = 0;                 /* 是否中断，0不中断，1中断 */
-    std::mutex mutex_;                      /* 用于锁住queue_ */
-    std::condition_variable cond_;          /* 条件变量 */
+    PushMutex mutex_{PUSH_LOCK_SITE("message_queue")};     /* 用于锁住queue_ */
+    PushCondition cond_;                    /* 条件变量 */
     std::list<AVMessage *> queue_;          /* 消息队列，使用list不用vector是因为中间需要插入和删除，所以不使用vec */
 };
 
@@ -0,0 +1,427 @@
+﻿#include <string.h>
+#include "nalparser.h"
+#if defined(__AVX2__)
+#define NAL_USE_AVX2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NAL_USE_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define NAL_HEADER_BYTES    32                          // 解析slice头最多读的字节数(去掉防竞争字节后)
+
+// 最低的置位的位置，mask不为0
+static inline int lowestBit(uint32_t mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// 读指数哥伦布码的比特流，数据已经去掉防竞争字节
+typedef struct bit_reader
+{
+    const uint8_t *data;
+    int size;
+    int pos;                                            // 单位bit
+}BitReader;
+
+static int readBit(BitReader *reader)
+{
+    if(reader->pos >= reader->size * 8) {
+        return -1;
+    }
+    int bit = (reader->data[reader->pos >> 3] >> (7 - (reader->pos & 7))) & 1;
+    reader->pos++;
+    return bit;
+}
+
+// 无符号指数哥伦布码，数据不够或者超过31位返回-1
+static int readUe(BitReader *reader)
+{
+    int zeros = 0;
+    while(true) {
+        int bit = readBit(reader);
+        if(bit < 0) {
+            return -1;
+        }
+        if(bit) {
+            break;
+        }
+        if(++zeros > 30) {
+            return -1;
+        }
+    }
+    int value = 0;
+    for(int i = 0; i < zeros; i++) {
+        int bit = readBit(reader);
+        if(bit < 0) {
+            return -1;
+        }
+        value = (value << 1) | bit;
+    }
+    return (1 << zeros) - 1 + value;
+}
+
+// 把NAL头之后的最多NAL_HEADER_BYTES字节去掉防竞争字节，返回拷贝的字节数
+static int unescape(const uint8_t *data, int size, uint8_t *out)
+{
+    int count = 0;
+    int zeros = 0;
+    for(int i = 0; i < size && count < NAL_HEADER_BYTES; i++) {
+        if(zeros >= 2 && 3 == data[i]) {
+            zeros = 0;
+            continue;
+        }
+        zeros = 0 == data[i] ? zeros + 1 : 0;
+        out[count++] = data[i];
+    }
+    return count;
+}
+
+const uint8_t *NalParser::FindStartCodeC(const uint8_t *begin, const uint8_t *end, int *start_code_size)
+{
+    for(const uint8_t *p = begin; p + 3 <= end; p++) {
+        if(p[0] == 0 && p[1] == 0 && p[2] == 1) {
+            if(p > begin && p[-1] == 0) {
+                *start_code_size = 4;
+                return p - 1;
+            }
+            *start_code_size = 3;
+            return p;
+        }
+    }
+    *start_code_size = 0;
+    return end;
+}
+
+const uint8_t *NalParser::FindStartCode(const uint8_t *begin, const uint8_t *end, int *start_code_size)
+{
+    const uint8_t *p = begin;
+    // 第i位表示p[i]、p[i+1]、p[i+2]是00 00 01，三次错开一个字节的非对齐读取，最后一次读到p+2+块大小
+#if defined(NAL_USE_AVX2)
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    for(; end - p >= 34; p += 32) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 1));
+        __m256i v2 = _mm256_loadu_si256((const __m256i *)(p + 2));
+        __m256i match = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(v0, zero), _mm256_cmpeq_epi8(v1, zero)),
+                                         _mm256_cmpeq_epi8(v2, one));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(match);
+        if(mask) {
+            p += lowestBit(mask);
+            goto found;
+        }
+    }
+#elif defined(NAL_USE_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    for(; end - p >= 18; p += 16) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)p);
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(p + 1));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(p + 2));
+        __m128i match = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(v0, zero), _mm_cmpeq_epi8(v1, zero)),
+                                      _mm_cmpeq_epi8(v2, one));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(match);
+        if(mask) {
+            p += lowestBit(mask);
+            goto found;
+        }
+    }
+#endif
+    for(; p + 3 <= end; p++) {
+        if(p[0] == 0 && p[1] == 0 && p[2] == 1) {
+            goto found;
+        }
+    }
+    *start_code_size = 0;
+    return end;
+
+found:
+    if(p > begin && p[-1] == 0) {
+        *start_code_size = 4;
+        return p - 1;
+    }
+    *start_code_size = 3;
+    return p;
+}
+
+bool NalParser::IsAnnexB(const uint8_t *data, int size)
+{
+    return size >= 3 && 0 == data[0] && 0 == data[1] && (1 == data[2] || (size >= 4 && 0 == data[2] && 1 == data[3]));
+}
+
+void NalParser::ParseHeader(NalUnit *nal, NalCodec codec)
+{
+    nal->type = -1;
+    nal->ref_idc = 0;
+    nal->slice_type = NAL_SLICE_UNKNOWN;
+    int header_size = NAL_CODEC_HEVC == codec ? 2 : 1;
+    if(nal->size < header_size) {
+        return;
+    }
+    const uint8_t *data = nal->data;
+    bool slice = false;
+    if(NAL_CODEC_HEVC == codec) {
+        nal->type = (data[0] >> 1) & 0x3f;
+        // 0-14中的偶数是子层非参考的slice(TRAIL_N、TSA_N、STSA_N、RADL_N、RASL_N与保留的类型)
+        nal->ref_idc = (nal->type <= 14 && 0 == (nal->type & 1)) ? 0 : 1;
+        slice = nal->type <= 9 || (nal->type >= 16 && nal->type <= 21);
+    } else {
+        nal->type = data[0] & 0x1f;
+        nal->ref_idc = (data[0] >> 5) & 3;
+        slice = 1 == nal->type || 2 == nal->type || 5 == nal->type;   // 3、4是数据分割B、C，没有slice头
+    }
+    if(!slice) {
+        return;
+    }
+
+    uint8_t buffer[NAL_HEADER_BYTES];
+    BitReader reader;
+    reader.data = buffer;
+    reader.size = unescape(data + header_size, nal->size - header_size, buffer);
+    reader.pos = 0;
+    if(NAL_CODEC_HEVC == codec) {
+        int first_slice_segment = readBit(&reader);
+        if(first_slice_segment != 1) {
+            return;                                     // 后面的slice segment需要pps才能解析
+        }
+        if(nal->type >= 16 && nal->type <= 23 && readBit(&reader) < 0) {   // no_output_of_prior_pics_flag
+            return;
+        }
+        if(readUe(&reader) < 0) {                       // slice_pic_parameter_set_id
+            return;
+        }
+        static const int kHevcSliceTypes[3] = {NAL_SLICE_B, NAL_SLICE_P, NAL_SLICE_I};
+        int slice_type = readUe(&reader);
+        if(slice_type >= 0 && slice_type <= 2) {
+            nal->slice_type = kHevcSliceTypes[slice_type];
+        }
+    } else {
+        if(readUe(&reader) < 0) {                       // first_mb_in_slice
+            return;
+        }
+        int slice_type = readUe(&reader);
+        if(slice_type >= 0 && slice_type <= 9) {
+            nal->slice_type = slice_type % 5;
+        }
+    }
+}
+
+/**
+ * @brief 取出下一个NAL。
+ * @param pos 当前位置，传出下一次开始的位置。
+ * @param error 长度前缀超出数据时设为true。
+ * @return 有NAL返回true。
+ */
+static bool nextNal(const uint8_t **pos, const uint8_t *end, int length_size, NalUnit *nal, bool *error)
+{
+    if(0 == length_size) {
+        int start_code_size = 0;
+        const uint8_t *p = NalParser::FindStartCode(*pos, end, &start_code_size);
+        while(p < end) {
+            const uint8_t *begin = p + start_code_size;
+            const uint8_t *next = NalParser::FindStartCode(begin, end, &start_code_size);
+            int size = (int)(next - begin);
+            while(size > 0 && 0 == begin[size - 1]) {
+                size--;                                 // trailing_zero_8bits
+            }
+            if(size > 0) {
+                nal->data = begin;
+                nal->size = size;
+                *pos = next;
+                return true;
+            }
+            p = next;
+        }
+        *pos = end;
+        return false;
+    }
+    while(*pos < end) {
+        if(end - *pos < length_size) {
+            *error = true;
+            return false;
+        }
+        uint32_t size = 0;
+        for(int i = 0; i < length_size; i++) {
+            size = (size << 8) | (*pos)[i];
+        }
+        *pos += length_size;
+        if(size > (uint32_t)(end - *pos)) {
+            *error = true;
+            return false;
+        }
+        nal->data = *pos;
+        nal->size = (int)size;
+        *pos += size;
+        if(size > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool validLengthSize(int length_size)
+{
+    return 0 == length_size || 1 == length_size || 2 == length_size || 4 == length_size;
+}
+
+static bool isParameterSet(int type, NalCodec codec)
+{
+    return NAL_CODEC_HEVC == codec ? (type >= 32 && type <= 34) : (7 == type || 8 == type);
+}
+
+RET_CODE NalParser::Split(const uint8_t *data, int size, int length_size, NalCodec codec, std::vector<NalUnit> *nals)
+{
+    nals->clear();
+    if(!data || size < 0 || !validLengthSize(length_size)) {
+        return RET_ERR_ARGUMENTOUTOFRANGE;
+    }
+    const uint8_t *pos = data;
+    const uint8_t *end = data + size;
+    bool error = false;
+    NalUnit nal;
+    while(nextNal(&pos, end, length_size, &nal, &error)) {
+        ParseHeader(&nal, codec);
+        nals->push_back(nal);
+    }
+    return error ? RET_FAIL : RET_OK;
+}
+
+RET_CODE NalParser::Inspect(const uint8_t *data, int size, int length_size, NalCodec codec, NalPacketInfo *info)
+{
+    memset(info, 0, sizeof(NalPacketInfo));
+    info->slice_type = NAL_SLICE_UNKNOWN;
+    if(!data || size < 0 || !validLengthSize(length_size)) {
+        return RET_ERR_ARGUMENTOUTOFRANGE;
+    }
+    const uint8_t *pos = data;
+    const uint8_t *end = data + size;
+    bool error = false;
+    bool referenced = false;
+    NalUnit nal;
+    while(nextNal(&pos, end, length_size, &nal, &error)) {
+        info->nal_count++;
+        bool slice;
+        if(NAL_CODEC_HEVC == codec) {
+            int type = nal.size >= 2 ? (nal.data[0] >> 1) & 0x3f : -1;
+            slice = (type >= 0 && type <= 9) || (type >= 16 && type <= 21);
+            info->key_frame |= type >= 16 && type <= 23;
+            info->has_parameter_sets |= isParameterSet(type, codec);
+        } else {
+            int type = nal.data[0] & 0x1f;
+            slice = 1 == type || 2 == type || 5 == type;
+            info->key_frame |= 5 == type;
+            info->has_parameter_sets |= isParameterSet(type, codec);
+        }
+        if(!slice) {
+            continue;
+        }
+        // 只有slice需要读slice头，每帧第一个slice之后只看NAL头
+        if(0 == info->slice_count) {
+            ParseHeader(&nal, codec);
+            info->slice_type = nal.slice_type;
+        } else {
+            nal.ref_idc = NAL_CODEC_HEVC == codec ? !(((nal.data[0] >> 1) & 0x3f) <= 14 && 0 == (nal.data[0] & 2))
+                                                  : (nal.data[0] >> 5) & 3;
+        }
+        referenced |= nal.ref_idc != 0;
+        info->slice_count++;
+    }
+    info->disposable = info->slice_count > 0 && !referenced;
+    return error ? RET_FAIL : RET_OK;
+}
+
+/**
+ * @brief 从extradata取出参数集。
+ * @param data Annex-B、avcC(H.264)或者hvcC(H.265)。
+ * @return 成功 0，格式不对、数据截断或者没有参数集返回other
+ */
+RET_CODE NalParser::ParseExtradata(const uint8_t *data, int size, NalCodec codec, std::vector<NalUnit> *param_sets,
+                                   int *length_size)
+{
+    param_sets->clear();
+    *length_size = 0;
+    if(!data || size <= 0) {
+        return RET_ERR_ARGUMENTOUTOFRANGE;
+    }
+    if(IsAnnexB(data, size)) {
+        std::vector<NalUnit> nals;
+        RET_CODE ret = Split(data, size, 0, codec, &nals);
+        for(size_t i = 0; i < nals.size(); i++) {
+            if(isParameterSet(nals[i].type, codec)) {
+                param_sets->push_back(nals[i]);
+            }
+        }
+        return RET_OK == ret && !param_sets->empty() ? RET_OK : RET_FAIL;
+    }
+    if(data[0] != 1) {
+        return RET_ERR_NOT_SUPPORT;                     // configurationVersion总是1
+    }
+
+    const uint8_t *end = data + size;
+    const uint8_t *p = NULL;
+    int arrays = 0;
+    if(NAL_CODEC_HEVC == codec) {
+        if(size < 23) {
+            return RET_FAIL;
+        }
+        *length_size = (data[21] & 3) + 1;
+        arrays = data[22];
+        p = data + 23;
+    } else {
+        if(size < 7) {
+            return RET_FAIL;
+        }
+        *length_size = (data[4] & 3) + 1;
+        arrays = 2;                                     // sps一组，pps一组
+        p = data + 5;
+    }
+    if(!validLengthSize(*length_size)) {
+        *length_size = 0;
+        return RET_ERR_NOT_SUPPORT;                     // lengthSizeMinusOne为2是保留值，包无法拆分
+    }
+    for(int a = 0; a < arrays; a++) {
+        int count = 0;
+        if(NAL_CODEC_HEVC == codec) {
+            if(end - p < 3) {
+                return RET_FAIL;
+            }
+            count = (p[1] << 8) | p[2];                 // p[0]是array_completeness与NAL类型，以NAL头为准
+            p += 3;
+        } else {
+            if(end - p < 1) {
+                return RET_FAIL;
+            }
+            count = 0 == a ? (p[0] & 0x1f) : p[0];
+            p += 1;
+        }
+        for(int i = 0; i < count; i++) {
+            if(end - p < 2) {
+                return RET_FAIL;
+            }
+            int nal_size = (p[0] << 8) | p[1];
+            p += 2;
+            if(end - p < nal_size) {
+                return RET_FAIL;
+            }
+            NalUnit nal;
+            nal.data = p;
+            nal.size = nal_size;
+            ParseHeader(&nal, codec);
+            if(isParameterSet(nal.type, codec)) {
+                param_sets->push_back(nal);
+            }
+            p += nal_size;
+        }
+    }
+    return param_sets->empty() ? RET_FAIL : RET_OK;
+}
@@ -0,0 +1,79 @@
+﻿#ifndef NALPARSER_H
+#define NALPARSER_H
+
+#include <stdint.h>
+#include <vector>
+#include "mediabase.h"
+
+enum NalCodec
+{
+    NAL_CODEC_H264 = 0,
+    NAL_CODEC_HEVC
+};
+
+// slice的类型，与H.264的slice_type % 5相同，H.265的B/P/I也映射到这里
+enum NalSliceType
+{
+    NAL_SLICE_UNKNOWN = -1,                             // 不是slice或者解析不出
+    NAL_SLICE_P = 0,
+    NAL_SLICE_B,
+    NAL_SLICE_I,
+    NAL_SLICE_SP,
+    NAL_SLICE_SI
+};
+
+// 一个NAL
+typedef struct nal_unit
+{
+    const uint8_t *data;                                // 指向NAL头，不含起始码或者长度
+    int size;
+    int type;                                           // H.264 nal_unit_type(5位)，H.265 nal_unit_type(6位)
+    int ref_idc;                                        // H.264 nal_ref_idc(0-3)；H.265没有这个字段，子层非参考帧为0，其它为1
+    int slice_type;                                     // NalSliceType
+}NalUnit;
+
+// 一个包(一帧)的概要
+typedef struct nal_packet_info
+{
+    int nal_count;
+    int slice_count;
+    bool key_frame;                                     // H.264有IDR slice，H.265有IRAP slice
+    bool disposable;                                    // 有slice并且都不被参考，丢掉不影响后面的帧
+    bool has_parameter_sets;                            // 带有sps、pps(H.265还有vps)
+    int slice_type;                                     // 第一个slice的NalSliceType
+}NalPacketInfo;
+
+/**
+ * H.264/H.265的NAL扫描，支持Annex-B(起始码)与AVCC/HVCC(每个NAL前面1、2或者4字节的长度)两种格式。
+ * 1）起始码的查找与memchr一样按块比较：SSE2一次16个位置，AVX2一次32个，分别和0、0、1比较后合成掩码，
+ *    没有候选位置时整块跳过，剩下不足一块的部分用标量查找，结果与标量实现完全一致。
+ * 2）NAL头直接读出类型与nal_ref_idc；slice再去掉防竞争字节(00 00 03)读出slice头的前几个指数哥伦布码得到slice_type。
+ *    H.265只解析一帧第一个slice segment的slice_type，并假设pps的num_extra_slice_header_bits为0(x265等常见编码器都是0)。
+ * 3）extradata可以是Annex-B、avcC(H.264)或者hvcC(H.265)，ParseExtradata取出其中的参数集，并给出包中NAL的长度字节数。
+ *
+ * 输入都可能是截断或者损坏的数据，解析失败时返回错误，不会越界读。
+ */
+class NalParser
+{
+public:
+    /**
+     * @brief 查找起始码00 00 01，前面还有一个0时认为是4字节的起始码。
+     * @param start_code_size 传出起始码长度(3或4)，找不到时为0。
+     * @return 起始码的位置，找不到返回end。
+     */
+    static const uint8_t *FindStartCode(const uint8_t *begin, const uint8_t *end, int *start_code_size);
+    static const uint8_t *FindStartCodeC(const uint8_t *begin, const uint8_t *end, int *start_code_size);  // 标量实现，用于对比
+    static bool IsAnnexB(const uint8_t *data, int size);
+
+    // 拆分一个包，length_size为0表示Annex-B，1、2、4表示AVCC/HVCC
+    static RET_CODE Split(const uint8_t *data, int size, int length_size, NalCodec codec, std::vector<NalUnit> *nals);
+    // 不保存每个NAL，只汇总一个包，用于热路径
+    static RET_CODE Inspect(const uint8_t *data, int size, int length_size, NalCodec codec, NalPacketInfo *info);
+    // 从extradata取出参数集，length_size传出包中NAL的长度字节数，Annex-B为0
+    static RET_CODE ParseExtradata(const uint8_t *data, int size, NalCodec codec, std::vector<NalUnit> *param_sets,
+                                   int *length_size);
+    // 按NAL头与slice头填写type、ref_idc、slice_type，nal的data、size需要已经设置
+    static void ParseHeader(NalUnit *nal, NalCodec codec);
+};
+
+#endif // NALPARSER_H
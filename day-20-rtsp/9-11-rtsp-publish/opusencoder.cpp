@@ -0,0 +1,85 @@
+﻿#include "opusencoder.h"
+#include "dlog.h"
+extern "C" {
+#include <libavutil/opt.h>
+}
+
+OpusEncoder::OpusEncoder()
+{
+
+}
+
+OpusEncoder::~OpusEncoder()
+{
+    // ctx_由基类AudioEncoder释放
+}
+
+/**
+ * @brief 初始化libopus编码器，帧长在avcodec_open2之后由ctx_->frame_size给出。
+ *
+ * @param "sample_rate"     采样率，只能是48000、24000、16000、12000、8000，默认48000
+ *        "channels"        通道数量，默认2
+ *        "channel_layout"  通道布局，默认根据channels获取缺省的
+ *        "bitrate"         比特率，默认64*1024
+ *        "frame_duration"  帧长，单位ms，只能是5、10、20、40、60，默认20
+ *        "application"     voip、audio或者lowdelay，默认lowdelay
+ *
+ * @return 成功 0 失败 other
+ */
+RET_CODE OpusEncoder::Init(const Properties &properties)
+{
+    sample_rate_    = properties.GetProperty("sample_rate", 48000);
+    channels_       = properties.GetProperty("channels", 2);
+    channel_layout_ = properties.GetProperty("channel_layout",
+                                             (int)av_get_default_channel_layout(channels_));
+    bitrate_        = properties.GetProperty("bitrate", 64 * 1024);
+    frame_duration_ = properties.GetProperty("frame_duration", 20);
+    application_    = properties.GetProperty("application", "lowdelay");
+    if(sample_rate_ != 48000 && sample_rate_ != 24000 && sample_rate_ != 16000
+            && sample_rate_ != 12000 && sample_rate_ != 8000) {
+        LogError("Opus: unsupported sample_rate: %d", sample_rate_);
+        return RET_ERR_NOT_SUPPORT;
+    }
+    if(frame_duration_ != 5 && frame_duration_ != 10 && frame_duration_ != 20
+            && frame_duration_ != 40 && frame_duration_ != 60) {
+        LogError("Opus: unsupported frame_duration: %dms", frame_duration_);
+        return RET_ERR_NOT_SUPPORT;
+    }
+
+    // 1 查找编码器，ffmpeg自带的opus编码器还是实验性的，并且只支持20ms帧，所以只使用libopus
+    codec_ = avcodec_find_encoder_by_name("libopus");
+    if(!codec_) {
+        LogError("Opus: libopus encoder not found, ffmpeg needs --enable-libopus");
+        return RET_ERR_MISMATCH_CODE;
+    }
+    // 2 分配编码器上下文
+    ctx_ = avcodec_alloc_context3(codec_);
+    if(!ctx_) {
+        LogError("Opus: avcodec_alloc_context3 failed");
+        return RET_ERR_OUTOFMEMORY;
+    }
+    // 2.1 设置参数
+    ctx_->channels      = channels_;
+    ctx_->channel_layout= channel_layout_;
+    ctx_->sample_fmt    = AV_SAMPLE_FMT_S16;                    // libopus支持交错的s16与flt，直接使用采集的s16
+    ctx_->sample_rate   = sample_rate_;
+    ctx_->bit_rate      = bitrate_;
+
+    AVDictionary *dict = NULL;
+    av_dict_set_int(&dict, "frame_duration", frame_duration_, 0);
+    av_dict_set(&dict, "application", application_.c_str(), 0);
+    // 3 编码器与编码器上下文关联
+    int ret = avcodec_open2(ctx_, codec_, &dict);
+    av_dict_free(&dict);
+    if(ret < 0) {
+        char buf[1024] = { 0 };
+        av_strerror(ret, buf, sizeof(buf) - 1);
+        LogError("Opus: avcodec_open2 failed: %s", buf);
+        avcodec_free_context(&ctx_);
+        return RET_FAIL;
+    }
+    LogInfo("Opus: frame_size: %d, initial_padding: %d, algorithmic delay: %0.1lfms, application: %s",
+            ctx_->frame_size, ctx_->initial_padding, GetAlgorithmicDelay(), application_.c_str());
+
+    return RET_OK;
+}
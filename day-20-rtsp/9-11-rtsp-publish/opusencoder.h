@@ -0,0 +1,30 @@
+﻿#ifndef OPUSENCODER_H
+#define OPUSENCODER_H
+
+#include <string>
+#include "audioencoder.h"
+
+/**
+ * Opus编码器(通过libavcodec调用libopus，ffmpeg需要--enable-libopus)，用于对讲等低延时场景。
+ * 1）帧长可选10ms或者20ms(libopus还支持5/40/60ms)，aac固定1024个样本(48khz时21.3ms)，再加上1024个样本的预读。
+ * 2）application默认lowdelay(OPUS_APPLICATION_RESTRICTED_LOWDELAY)，只使用CELT，预读只有2.5ms；voip/audio会用到SILK，预读6.5ms。
+ * 3）输入是交错的s16，与采集的格式相同，不需要转换成planar。
+ */
+class OpusEncoder : public AudioEncoder
+{
+public:
+    OpusEncoder();
+    virtual ~OpusEncoder();
+
+    virtual RET_CODE Init(const Properties &properties);
+
+private:
+    int sample_rate_    = 48000;
+    int channels_       = 2;
+    int channel_layout_ = AV_CH_LAYOUT_STEREO;
+    int bitrate_        = 64*1024;
+    int frame_duration_ = 20;                               // 一帧的时长，单位ms
+    std::string application_ = "lowdelay";                  // voip、audio或者lowdelay
+};
+
+#endif // OPUSENCODER_H
@@ -10,6 +10,7 @@
 #include <queue>
 #include "mediabase.h"
 #include "dlog.h"
+#include "instrument.h"
 
 extern "C"
 {
@@ -98,7 +99,7 @@ public:
             return -1;
         }
 
-        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<PushMutex> lock(mutex_);
         int ret = pushPrivate(pkt, media_type);
         if (ret < 0) {
             //LogError("pushPrivate failed");
@@ -128,6 +129,7 @@ public:
             //LogError("malloc MyAVPacket failed");
             return -1;
         }
+        PUSH_ALLOC("packet_queue_node", sizeof(MyAVPacket));
         mypkt->pkt = pkt;
         mypkt->media_type = media_type;
 
@@ -176,7 +178,7 @@ public:
             return -1;
         }
 
-        std::unique_lock<std::mutex> lock(mutex_);
+        std::unique_lock<PushMutex> lock(mutex_);
         if (abort_request_) {
             //LogWarn("abort request");
             return -1;
@@ -227,6 +229,7 @@ public:
         }
 
         queue_.pop();
+        PUSH_FREE("packet_queue_node", sizeof(MyAVPacket));
         free(mypkt);
 
         return 1;
@@ -248,7 +251,7 @@ public:
             return Pop(pkt, media_type);
         }
 
-        std::unique_lock<std::mutex> lock(mutex_);
+        std::unique_lock<PushMutex> lock(mutex_);
         if (abort_request_) {
             //LogWarn("abort request");
             return -1;
@@ -294,18 +297,38 @@ public:
         }
 
         queue_.pop();
+        PUSH_FREE("packet_queue_node", sizeof(MyAVPacket));
         free(mypkt);
 
         return 1;
     }
 
+    /**
+    * @brief 等待队列有数据，但是不取出。用于取包前需要先加别的锁的场景，例如PacketSpiller。
+    * @param timeout 超时时间，单位毫秒。
+    * @return -1 abort;  0 超时返回，队列为空；1 队列不为空.
+    */
+    int Wait(int timeout)
+    {
+        std::unique_lock<PushMutex> lock(mutex_);
+        if (queue_.empty() && !abort_request_) {
+            cond_.wait_for(lock, std::chrono::milliseconds(timeout), [this] {
+                return !queue_.empty() | abort_request_;
+            });
+        }
+        if (abort_request_) {
+            return -1;
+        }
+        return queue_.empty() ? 0 : 1;
+    }
+
     /**
     * @brief 判断包队列是否为空。
     * @return 为空 true 不为空 false
     */
     bool Empty()
     {
-        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<PushMutex> lock(mutex_);
         return queue_.empty();
     }
 
@@ -315,7 +338,7 @@ public:
     */
     void Abort()
     {
-        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<PushMutex> lock(mutex_);
         abort_request_ = true;
         cond_.notify_all();
     }
@@ -330,11 +353,12 @@ public:
     *            2）all为false: 会一直drop数据，直到遇到I帧，会去判断是否drop够数据，满足则保留该关键帧，否则也会drop掉。
     * @param remain_max_duration 队列最大保留remain_max_duration时长;
     *
-    * @return no mean.
+    * @return 被drop掉的包数。
     */
     int Drop(bool all, int64_t remain_max_duration)
     {
-        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<PushMutex> lock(mutex_);
+        int drop_count = 0;
         while (!queue_.empty())
         {
             // 1 获取队列的对头包
@@ -398,14 +422,16 @@ public:
             // 5 真正drop掉数据
             av_packet_free(&mypkt->pkt);        // 先释放AVPacket
             queue_.pop();
+            PUSH_FREE("packet_queue_node", sizeof(MyAVPacket));
             free(mypkt);                        // 再释放MyAVPacket
+            drop_count++;
         }
 
         if (all) {
             Clear();
         }
 
-        return 0;
+        return drop_count;
     }
 
     /**
@@ -432,12 +458,13 @@ public:
     void queue_erase_all()
     {
 
-        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<PushMutex> lock(mutex_);
 
         while (!queue_.empty()) {
             MyAVPacket *mypkt = queue_.front();
             av_packet_free(&mypkt->pkt);        // 先释放AVPacket
             queue_.pop();
+            PUSH_FREE("packet_queue_node", sizeof(MyAVPacket));
             free(mypkt);                        // 再释放MyAVPacket
         }
 
@@ -454,7 +481,7 @@ public:
     */
     int64_t GetAudioDuration()
     {
-        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<PushMutex> lock(mutex_);
 
         if (stats_.audio_nb_packets <= 0) {
             return 0;
@@ -505,7 +532,7 @@ public:
     */
     int64_t GetVideoDuration()
     {
-        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<PushMutex> lock(mutex_);
         //以pts为准
 #ifndef MyDurationCode
         int64_t duration = video_back_pts_ - video_front_pts_;
@@ -546,7 +573,7 @@ public:
     */
     int GetAudioPackets()
     {
-        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<PushMutex> lock(mutex_);
         return stats_.audio_nb_packets;
     }
     /**
@@ -555,7 +582,7 @@ public:
     */
     int GetVideoPackets()
     {
-        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<PushMutex> lock(mutex_);
         return stats_.video_nb_packets;
     }
 
@@ -571,7 +598,7 @@ public:
             return;
         }
 
-        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<PushMutex> lock(mutex_);
 
         // 1 获取音频时长
         // 以pts为准
@@ -643,8 +670,8 @@ public:
     }
 
 private:
-    std::mutex mutex_;
-    std::condition_variable cond_;
+    PushMutex mutex_{PUSH_LOCK_SITE("packet_queue")};
+    PushCondition cond_;
     std::queue<MyAVPacket *> queue_;                    // queue_可能会残留MyAVPacket，应该要回收一下，到时看看怎么回收比较好
 
     bool abort_request_ = false;
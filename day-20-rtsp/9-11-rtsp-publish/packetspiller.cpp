@@ -0,0 +1,407 @@
+﻿#include <stdio.h>
+#include "packetspiller.h"
+#include "dlog.h"
+#include "timesutil.h"
+
+#define SPILL_RECORD_MAGIC  0x4C495053      // "SPIL"
+#define SPILL_WRAP_MAGIC    0x50415257      // "WRAP"
+
+// 溢出文件可能超过2G，需要使用64位的偏移
+static int spill_seek(FILE *fp, int64_t offset)
+{
+#ifdef _WIN32
+    return _fseeki64(fp, offset, SEEK_SET);
+#else
+    return fseeko(fp, (off_t)offset, SEEK_SET);
+#endif
+}
+
+PacketSpiller::PacketSpiller(PacketQueue *queue)
+    : queue_(queue)
+{
+    memset(&stats_, 0, sizeof(PacketSpillerStats));
+}
+
+PacketSpiller::~PacketSpiller()
+{
+    DeInit();
+}
+
+/**
+ * @brief 创建并预分配溢出文件。
+ * @param "file"                    溢出文件名，默认rtsp_spill.dat
+ *        "file_size_mb"            溢出文件大小，单位MB，默认256
+ *        "memory_threshold_kb"     内存队列超过该大小后开始溢出到文件，单位KB，默认4096
+ *        "readahead_kb"            从文件读回的预读队列的最大大小，单位KB，默认1024
+ *        "catchup_percent"         链路恢复后的追赶速度，实时速度的百分比，默认200即2倍速，<=0不限制
+ * @return 成功 0 失败 other
+ */
+RET_CODE PacketSpiller::Init(const Properties &properties)
+{
+    file_name_          = properties.GetProperty("file", "rtsp_spill.dat");
+    file_size_          = (int64_t)properties.GetProperty("file_size_mb", 256) * 1024 * 1024;
+    memory_threshold_   = properties.GetProperty("memory_threshold_kb", 4096) * 1024;
+    readahead_max_      = properties.GetProperty("readahead_kb", 1024) * 1024;
+    catchup_percent_    = properties.GetProperty("catchup_percent", 200);
+    if(!queue_ || file_size_ <= 0 || memory_threshold_ <= 0 || readahead_max_ <= 0) {
+        LogError("invalid param, file_size: %lld, memory_threshold: %d, readahead: %d",
+                 file_size_, memory_threshold_, readahead_max_);
+        return RET_ERR_PARAMISMATCH;
+    }
+
+    fp_ = fopen(file_name_.c_str(), "wb+");
+    if(!fp_) {
+        LogError("fopen %s failed", file_name_.c_str());
+        return RET_ERR_OPEN_FILE;
+    }
+    // 预分配文件大小，断网时才不会因为磁盘空间不足而写失败
+    if(spill_seek(fp_, file_size_ - 1) != 0 || fputc(0, fp_) == EOF || fflush(fp_) != 0) {
+        LogError("preallocate %s %lld bytes failed", file_name_.c_str(), file_size_);
+        fclose(fp_);
+        fp_ = NULL;
+        remove(file_name_.c_str());
+        return RET_FAIL;
+    }
+    LogInfo("spill file: %s, size: %lldMB, memory threshold: %dKB, catchup: %d%%",
+            file_name_.c_str(), file_size_ / 1024 / 1024, memory_threshold_ / 1024, catchup_percent_);
+
+    return RET_OK;
+}
+
+/**
+ * @brief 停止后台线程，释放预读队列并删除溢出文件。还没发送的溢出数据会丢失。
+ * @return void。
+ */
+void PacketSpiller::DeInit()
+{
+    Abort();
+    Stop();
+    while(!readahead_.empty()) {
+        av_packet_free(&readahead_.front().pkt);
+        readahead_.pop_front();
+    }
+    if(fp_) {
+        if(pending_packets_ > 0) {
+            LogWarn("%lld spilled packets not sent", pending_packets_);
+        }
+        fclose(fp_);
+        fp_ = NULL;
+        remove(file_name_.c_str());
+    }
+}
+
+void PacketSpiller::Abort()
+{
+    std::lock_guard<PushMutex> lock(mutex_);
+    abort_ = true;
+    cond_.notify_all();
+    work_cond_.notify_all();
+}
+
+/**
+ * @brief 后台线程，每10ms检测一次内存队列，并把溢出文件中的包读回到预读队列。
+ * @return void。
+ */
+void PacketSpiller::Loop()
+{
+    LogInfo("spill loop into");
+    while(!request_abort_)
+    {
+        spillOut();
+        readAhead();
+
+        std::unique_lock<PushMutex> lock(mutex_);
+        stats_.file_used = used_;
+        if(abort_) {
+            break;
+        }
+        work_cond_.wait_for(lock, std::chrono::milliseconds(10));
+    }
+    LogInfo("spill loop leave");
+}
+
+/**
+ * @brief 内存队列超过阈值时，把头部(最旧)的包取出来，直到内存队列降到阈值的一半，然后写到溢出文件。
+ *          取包与增加pending_packets_在同一个锁内完成，这样推流线程不会在这期间从内存队列取到更新的包。
+ * @return void。
+ */
+void PacketSpiller::spillOut()
+{
+    PacketQueueStats queue_stats;
+    queue_->GetStats(&queue_stats);
+    int64_t memory_size = queue_stats.audio_size + queue_stats.video_size;
+    if(memory_size <= memory_threshold_) {
+        return;
+    }
+
+    std::vector<MyAVPacket> packets;
+    {
+        std::lock_guard<PushMutex> lock(mutex_);
+        while(memory_size > memory_threshold_ / 2) {
+            MyAVPacket mypkt;
+            if(queue_->PopWithTimeout(&mypkt.pkt, mypkt.media_type, 0) != 1) {
+                break;
+            }
+            memory_size -= mypkt.pkt->size;
+            packets.push_back(mypkt);
+        }
+        if(0 == pending_packets_ && !packets.empty()) {
+            LogWarn("spill start, memory: %lld bytes", memory_size);
+        }
+        pending_packets_ += packets.size();
+    }
+
+    int64_t dropped = 0;
+    for(size_t i = 0; i < packets.size(); i++) {
+        if(!writeRecord(packets[i].pkt, packets[i].media_type)) {
+            dropped++;
+        }
+        av_packet_free(&packets[i].pkt);
+    }
+    std::lock_guard<PushMutex> lock(mutex_);
+    pending_packets_ -= dropped;
+    stats_.dropped_packets += dropped;
+    stats_.spilled_packets += packets.size() - dropped;
+    if(dropped > 0) {
+        LogWarn("spill file full, drop %lld packets", dropped);
+    }
+}
+
+/**
+ * @brief 把一个包追加到环形文件中。尾部放不下时写一个回绕标记(放不下记录头就不写)，从文件开头继续写。
+ * @return 成功 true; 文件已满或者写失败 false，此时会等到下一个视频关键帧才恢复写入。
+ */
+bool PacketSpiller::writeRecord(AVPacket *pkt, MediaType media_type)
+{
+    if(wait_key_frame_) {
+        if(E_VIDEO_TYPE != media_type || !(pkt->flags & AV_PKT_FLAG_KEY)) {
+            return false;
+        }
+    }
+
+    int64_t len = sizeof(SpillRecord) + pkt->size;
+    if(0 == used_) {
+        write_pos_ = 0;                             // 文件中没有数据时从头开始，减少回绕
+        read_pos_ = 0;
+    }
+    bool full = false;
+    if(used_ > 0 && write_pos_ == read_pos_) {
+        full = true;
+    } else if(write_pos_ >= read_pos_) {
+        int64_t tail = file_size_ - write_pos_;
+        if(len > tail) {
+            if(len > read_pos_) {
+                full = true;
+            } else {
+                if(tail >= (int64_t)sizeof(SpillRecord)) {
+                    SpillRecord wrap;
+                    memset(&wrap, 0, sizeof(SpillRecord));
+                    wrap.magic = SPILL_WRAP_MAGIC;
+                    spill_seek(fp_, write_pos_);
+                    fwrite(&wrap, 1, sizeof(SpillRecord), fp_);
+                }
+                used_ += tail;                      // 尾部跳过的字节也算已用，读到这里时再释放
+                write_pos_ = 0;
+            }
+        }
+    } else if(len > read_pos_ - write_pos_) {
+        full = true;
+    }
+    if(full) {
+        wait_key_frame_ = true;
+        return false;
+    }
+
+    SpillRecord record;
+    record.magic = SPILL_RECORD_MAGIC;
+    record.media_type = media_type;
+    record.flags = pkt->flags;
+    record.size = pkt->size;
+    record.pts = pkt->pts;
+    record.dts = pkt->dts;
+    spill_seek(fp_, write_pos_);
+    if(fwrite(&record, 1, sizeof(SpillRecord), fp_) != sizeof(SpillRecord)
+            || fwrite(pkt->data, 1, pkt->size, fp_) != (size_t)pkt->size) {
+        LogError("write spill file failed");
+        wait_key_frame_ = true;
+        return false;
+    }
+    write_pos_ += len;
+    used_ += len;
+    file_records_++;
+    wait_key_frame_ = false;
+    return true;
+}
+
+/**
+ * @brief 按顺序从溢出文件读回包，直到预读队列满或者文件中没有数据。
+ * @return void。
+ */
+void PacketSpiller::readAhead()
+{
+    if(file_records_ > 0) {
+        fflush(fp_);                                // 读写同一个文件，读之前先把写缓冲刷下去
+    }
+    while(file_records_ > 0)
+    {
+        {
+            std::lock_guard<PushMutex> lock(mutex_);
+            if(abort_ || stats_.readahead_size >= readahead_max_) {
+                return;
+            }
+        }
+
+        SpillRecord record;
+        if(file_size_ - read_pos_ < (int64_t)sizeof(SpillRecord)) {
+            record.magic = SPILL_WRAP_MAGIC;
+        } else {
+            spill_seek(fp_, read_pos_);
+            if(fread(&record, 1, sizeof(SpillRecord), fp_) != sizeof(SpillRecord)) {
+                record.magic = 0;
+            }
+        }
+        if(SPILL_WRAP_MAGIC == record.magic) {
+            used_ -= file_size_ - read_pos_;
+            read_pos_ = 0;
+            continue;
+        }
+
+        AVPacket *pkt = NULL;
+        if(SPILL_RECORD_MAGIC == record.magic && record.size >= 0) {
+            pkt = av_packet_alloc();
+            if(av_new_packet(pkt, record.size) < 0
+                    || fread(pkt->data, 1, record.size, fp_) != (size_t)record.size) {
+                av_packet_free(&pkt);
+            }
+        }
+        if(!pkt) {
+            // 文件内容损坏，后面的数据都不可信，全部丢弃
+            LogError("spill file corrupted at %lld, drop %lld packets", read_pos_, file_records_);
+            std::lock_guard<PushMutex> lock(mutex_);
+            pending_packets_ -= file_records_;
+            stats_.dropped_packets += file_records_;
+            file_records_ = 0;
+            used_ = 0;
+            wait_key_frame_ = true;
+            cond_.notify_all();
+            return;
+        }
+        pkt->pts = record.pts;
+        pkt->dts = record.dts;
+        pkt->flags = record.flags;
+        read_pos_ += sizeof(SpillRecord) + record.size;
+        used_ -= sizeof(SpillRecord) + record.size;
+        file_records_--;
+
+        MyAVPacket mypkt;
+        mypkt.pkt = pkt;
+        mypkt.media_type = (MediaType)record.media_type;
+        std::lock_guard<PushMutex> lock(mutex_);
+        readahead_.push_back(mypkt);
+        stats_.readahead_size += pkt->size;
+        cond_.notify_one();
+    }
+}
+
+/**
+ * @brief 追赶速度限制：本轮追赶开始后，经过now-start的时间，最多只能发送到start_pts+(now-start)*percent/100的数据。
+ *          需要在mutex_内调用。
+ * @param pts 预读队列头部的包的pts，单位ms。
+ * @param now 当前时间，单位ms。
+ * @return 还需要等待的毫秒数，<=0可以立即发送。
+ */
+int PacketSpiller::catchupWait(int64_t pts, int64_t now)
+{
+    if(catchup_percent_ <= 0) {
+        return 0;
+    }
+    if(0 == catchup_start_time_) {
+        catchup_start_time_ = now;
+        catchup_start_pts_ = pts;
+        return 0;
+    }
+    int64_t allowed_pts = catchup_start_pts_ + (now - catchup_start_time_) * catchup_percent_ / 100;
+    if(pts <= allowed_pts) {
+        return 0;
+    }
+    int64_t wait = (pts - allowed_pts) * 100 / catchup_percent_ + 1;
+    if(wait > 100) {
+        // pts不连续(例如跳变)时不能一直等，重新开始一轮追赶
+        catchup_start_time_ = now;
+        catchup_start_pts_ = pts;
+        return 0;
+    }
+    return (int)wait;
+}
+
+/**
+ * @brief 推流线程取包，代替queue->PopWithTimeout。还有溢出数据时只从预读队列取(按追赶速度)，否则从内存队列取。
+ * @param pkt 传入传出，取出一个包。
+ * @param media_type 取出的包类型。
+ * @param timeout 超时时间，单位毫秒。
+ * @return -1 abort;  0 超时返回，没有包；1 取到包.
+ */
+int PacketSpiller::Pop(AVPacket **pkt, MediaType &media_type, int timeout)
+{
+    int64_t deadline = TimesUtil::GetTimeMillisecond() + timeout;
+    while(true)
+    {
+        {
+            std::unique_lock<PushMutex> lock(mutex_);
+            if(abort_) {
+                return -1;
+            }
+            if(pending_packets_ > 0) {
+                int64_t now = TimesUtil::GetTimeMillisecond();
+                int wait = 10;                                  // 预读队列为空时，等后台线程读回
+                if(!readahead_.empty()) {
+                    MyAVPacket &front = readahead_.front();
+                    wait = catchupWait(front.pkt->pts, now);
+                    if(wait <= 0) {
+                        *pkt = front.pkt;
+                        media_type = front.media_type;
+                        readahead_.pop_front();
+                        stats_.readahead_size -= (*pkt)->size;
+                        stats_.restored_packets++;
+                        pending_packets_--;
+                        if(0 == pending_packets_) {
+                            LogInfo("spill catch up finish, restored: %lld", stats_.restored_packets);
+                            catchup_start_time_ = 0;
+                        }
+                        work_cond_.notify_one();
+                        return 1;
+                    }
+                }
+                int64_t remain = deadline - now;
+                if(remain <= 0) {
+                    return 0;
+                }
+                cond_.wait_for(lock, std::chrono::milliseconds(remain < wait ? remain : wait));
+                continue;
+            }
+            // 没有溢出数据，直接从内存队列取，必须在锁内取，防止后台线程同时把更旧的包溢出到文件
+            int ret = queue_->PopWithTimeout(pkt, media_type, 0);
+            if(ret != 0) {
+                return ret;
+            }
+        }
+        int64_t remain = deadline - TimesUtil::GetTimeMillisecond();
+        if(remain <= 0) {
+            return 0;
+        }
+        int ret = queue_->Wait((int)remain);
+        if(ret <= 0) {
+            return ret;
+        }
+    }
+}
+
+void PacketSpiller::GetStats(PacketSpillerStats *stats)
+{
+    if(!stats) {
+        return;
+    }
+    std::lock_guard<PushMutex> lock(mutex_);
+    *stats = stats_;
+    stats->pending_packets = pending_packets_;
+}
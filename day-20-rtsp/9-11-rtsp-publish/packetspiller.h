@@ -0,0 +1,101 @@
+﻿#ifndef PACKETSPILLER_H
+#define PACKETSPILLER_H
+
+#include <stdio.h>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include "instrument.h"
+#include "commonlooper.h"
+#include "packetqueue.h"
+
+/**
+ * 磁盘溢出缓存。上行链路长时间卡住时，PacketQueue::Drop会把编码后的数据永久丢掉，
+ * 对于取证、先录后传这类场景，宁愿先把数据存下来，等链路恢复后再追上。
+ *
+ * 工作方式：
+ * 1）后台线程监测内存队列的大小，超过spill_memory_threshold_kb后，把内存队列头部(最旧)的包取出来，
+ *      顺序追加写到一个预分配大小的环形文件中，直到内存队列降到阈值的一半。
+ * 2）只要还有溢出的数据没发送，推流线程就只从溢出缓存取包(磁盘中的数据总是比内存队列中的旧)，
+ *      后台线程把文件中的包按顺序读回到一个大小受限的预读队列，推流线程从预读队列中取。
+ * 3）追赶速度按实时速度的百分比限制(spill_catchup_percent)，防止链路刚恢复就被积压的数据打满。
+ * 4）溢出的数据全部发送完后，推流线程重新直接从内存队列取包。
+ *
+ * 内存占用：内存队列不超过阈值，预读队列不超过spill_readahead_kb，所以长时间断网时内存是受限的。
+ * 溢出文件写满后，新的溢出包会被丢弃，直到文件有空间并且遇到视频关键帧才恢复溢出，保证解码端能正常解码。
+ *
+ * 包的顺序：后台线程从内存队列取包、推流线程判断是否还有溢出数据并从内存队列取包，都在mutex_内完成，
+ * 所以溢出的包总是一段连续的、比内存队列中更旧的数据，发送顺序与编码顺序一致。
+ */
+
+// 溢出缓存的统计信息
+typedef struct packet_spiller_stats
+{
+    int64_t spilled_packets;            // 累计写入溢出文件的包数量
+    int64_t restored_packets;           // 累计从溢出文件读回并发送的包数量
+    int64_t dropped_packets;            // 溢出文件写满而丢弃的包数量
+    int64_t pending_packets;            // 目前还没发送的溢出包数量(文件中+预读队列中)
+    int64_t file_used;                  // 溢出文件已用的字节数
+    int64_t readahead_size;             // 预读队列的字节数
+}PacketSpillerStats;
+
+class PacketSpiller : public CommonLooper
+{
+public:
+    PacketSpiller(PacketQueue *queue);
+    virtual ~PacketSpiller();
+
+    RET_CODE Init(const Properties &properties);
+    void DeInit();
+    virtual void Loop();
+
+    int Pop(AVPacket **pkt, MediaType &media_type, int timeout);    // 代替queue->PopWithTimeout，返回值同PopWithTimeout
+    void Abort();
+    void GetStats(PacketSpillerStats *stats);
+
+private:
+    // 溢出文件中每个包的记录头，后面紧跟size字节的包数据
+    typedef struct spill_record
+    {
+        uint32_t magic;                 // SPILL_RECORD_MAGIC，或者SPILL_WRAP_MAGIC表示从文件开头继续
+        int32_t media_type;
+        int32_t flags;                  // AVPacket的flags，主要是关键帧标志
+        int32_t size;
+        int64_t pts;
+        int64_t dts;
+    }SpillRecord;
+
+    void spillOut();                                    // 内存队列超过阈值时，把头部的包写到溢出文件
+    bool writeRecord(AVPacket *pkt, MediaType media_type);
+    void readAhead();                                   // 从溢出文件读回包到预读队列
+    int catchupWait(int64_t pts, int64_t now);          // 按追赶速度，pts为该值的包还需要等待多久才能发送，单位毫秒
+
+    PacketQueue *queue_ = NULL;                         // 内存队列，由RtspPusher管理
+
+    std::string file_name_;
+    int64_t file_size_          = 0;                    // 溢出文件大小，字节
+    int memory_threshold_       = 4 * 1024 * 1024;      // 内存队列的字节数阈值
+    int readahead_max_          = 1024 * 1024;          // 预读队列的最大字节数
+    int catchup_percent_        = 200;                  // 追赶速度，实时速度的百分比，<=0不限制
+
+    FILE *fp_                   = NULL;
+    // 下面4个成员只在后台线程中访问
+    int64_t write_pos_          = 0;
+    int64_t read_pos_           = 0;
+    int64_t used_               = 0;                    // 包含环形回绕时文件尾部跳过的字节
+    int64_t file_records_       = 0;                    // 文件中还没有读回的包数量
+    bool wait_key_frame_        = false;                // 文件写满丢包后，要等到视频关键帧才恢复溢出
+
+    PushMutex mutex_{PUSH_LOCK_SITE("packet_spiller")};
+    PushCondition cond_;                                // 预读队列有数据时唤醒推流线程
+    PushCondition work_cond_;                           // 预读队列被取走数据时唤醒后台线程
+    std::deque<MyAVPacket> readahead_;
+    int64_t pending_packets_    = 0;                    // 还没发送的溢出包数量，大于0时推流线程只能从溢出缓存取包
+    int64_t catchup_start_time_ = 0;                    // 本轮追赶开始的时间和pts，单位ms
+    int64_t catchup_start_pts_  = 0;
+    bool abort_                 = false;
+    PacketSpillerStats stats_;
+};
+
+#endif // PACKETSPILLER_H
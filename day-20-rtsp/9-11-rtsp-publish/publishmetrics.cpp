@@ -0,0 +1,163 @@
+﻿#include "publishmetrics.h"
+#include "timesutil.h"
+
+/**
+ * @brief 注册一个推流会话的指标。
+ * @param name 会话名字，输出时作为session标签。
+ * @param metrics 会话的指标，由会话自己管理，注销前不能释放。
+ */
+void MetricsExporter::AddSession(const std::string &name, PublishMetrics *metrics)
+{
+    std::lock_guard<PushMutex> lock(mutex_);
+    MetricsSession session;
+    session.name = name;
+    session.metrics = metrics;
+    session.last_time = TimesUtil::GetTimeMillisecond();
+    session.last_video_frames = PublishMetrics::Get(metrics->video_encoded_frames_);
+    session.last_sent_bytes = PublishMetrics::Get(metrics->video_sent_bytes_) + PublishMetrics::Get(metrics->audio_sent_bytes_);
+    session.encode_fps = 0;
+    session.bitrate = 0;
+    sessions_.push_back(session);
+}
+
+void MetricsExporter::RemoveSession(PublishMetrics *metrics)
+{
+    std::lock_guard<PushMutex> lock(mutex_);
+    for(auto it = sessions_.begin(); it != sessions_.end(); it++) {
+        if(it->metrics == metrics) {
+            sessions_.erase(it);
+            break;
+        }
+    }
+}
+
+static void append_help(std::string &out, const char *name, const char *type, const char *help)
+{
+    out += "# HELP ";
+    out += name;
+    out += " ";
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += " ";
+    out += type;
+    out += "\n";
+}
+
+static void append_value(std::string &out, const char *name, const std::string &labels, double value)
+{
+    char line[512];
+    snprintf(line, sizeof(line), "%s{%s} %.6g\n", name, labels.c_str(), value);
+    out += line;
+}
+
+/**
+ * @brief 输出所有会话的指标，prometheus文本格式。
+ * @return 指标文本。
+ */
+std::string MetricsExporter::Render()
+{
+    std::lock_guard<PushMutex> lock(mutex_);
+    std::string out;
+    int64_t now = TimesUtil::GetTimeMillisecond();
+
+    // 1 根据与上次抓取的差值更新帧率和码率
+    for(size_t i = 0; i < sessions_.size(); i++) {
+        MetricsSession &s = sessions_[i];
+        int64_t frames = PublishMetrics::Get(s.metrics->video_encoded_frames_);
+        int64_t bytes = PublishMetrics::Get(s.metrics->video_sent_bytes_) + PublishMetrics::Get(s.metrics->audio_sent_bytes_);
+        int64_t elapsed = now - s.last_time;
+        if(elapsed >= 500) {                                // 抓取太频繁时沿用上次的结果，防止抖动太大
+            s.encode_fps = (frames - s.last_video_frames) * 1000.0 / elapsed;
+            s.bitrate = (bytes - s.last_sent_bytes) * 8 * 1000.0 / elapsed;
+            s.last_time = now;
+            s.last_video_frames = frames;
+            s.last_sent_bytes = bytes;
+        }
+    }
+
+    // 2 计数器与仪表盘
+    typedef struct counter_desc
+    {
+        const char *name;
+        const char *type;
+        const char *help;
+        const char *media;                                  // 不为NULL时带上media标签
+        std::atomic<int64_t> PublishMetrics::*member;
+    }CounterDesc;
+    static const CounterDesc descs[] = {
+        {"publish_encoded_frames_total", "counter", "Encoded frames.", "video", &PublishMetrics::video_encoded_frames_},
+        {"publish_encoded_frames_total", "counter", NULL, "audio", &PublishMetrics::audio_encoded_frames_},
+        {"publish_encoded_bytes_total", "counter", "Encoded bytes.", "video", &PublishMetrics::video_encoded_bytes_},
+        {"publish_encoded_bytes_total", "counter", NULL, "audio", &PublishMetrics::audio_encoded_bytes_},
+        {"publish_sent_packets_total", "counter", "Packets written to the output.", "video", &PublishMetrics::video_sent_packets_},
+        {"publish_sent_packets_total", "counter", NULL, "audio", &PublishMetrics::audio_sent_packets_},
+        {"publish_sent_bytes_total", "counter", "Bytes written to the output.", "video", &PublishMetrics::video_sent_bytes_},
+        {"publish_sent_bytes_total", "counter", NULL, "audio", &PublishMetrics::audio_sent_bytes_},
+        {"publish_dropped_packets_total", "counter", "Packets dropped from the send queue.", NULL, &PublishMetrics::dropped_packets_},
+        {"publish_write_errors_total", "counter", "Failed av_write_frame calls.", NULL, &PublishMetrics::write_errors_},
+        {"publish_reconnects_total", "counter", "Reconnects or failovers of the output.", NULL, &PublishMetrics::reconnects_},
+        {"publish_queue_duration_ms", "gauge", "Buffered duration in the send queue.", "video", &PublishMetrics::video_queue_duration_},
+        {"publish_queue_duration_ms", "gauge", NULL, "audio", &PublishMetrics::audio_queue_duration_},
+        {"publish_queue_bytes", "gauge", "Buffered bytes in the send queue.", NULL, &PublishMetrics::queue_bytes_},
+        {"publish_quality_samples_total", "counter", "Sampled frames compared against the decoded output.", NULL, &PublishMetrics::quality_samples_},
+        {"publish_quality_lost_samples_total", "counter", "Sampled frames skipped or not matched by a decoded frame.", NULL, &PublishMetrics::quality_lost_samples_},
+    };
+    for(size_t d = 0; d < sizeof(descs) / sizeof(descs[0]); d++) {
+        if(descs[d].help) {
+            append_help(out, descs[d].name, descs[d].type, descs[d].help);
+        }
+        for(size_t i = 0; i < sessions_.size(); i++) {
+            std::string labels = "session=\"" + sessions_[i].name + "\"";
+            if(descs[d].media) {
+                labels += std::string(",media=\"") + descs[d].media + "\"";
+            }
+            append_value(out, descs[d].name, labels, (double)PublishMetrics::Get(sessions_[i].metrics->*descs[d].member));
+        }
+    }
+
+    append_help(out, "publish_encode_fps", "gauge", "Video encode frame rate since the previous scrape.");
+    for(size_t i = 0; i < sessions_.size(); i++) {
+        append_value(out, "publish_encode_fps", "session=\"" + sessions_[i].name + "\"", sessions_[i].encode_fps);
+    }
+    append_help(out, "publish_bitrate_bps", "gauge", "Output bitrate since the previous scrape.");
+    for(size_t i = 0; i < sessions_.size(); i++) {
+        append_value(out, "publish_bitrate_bps", "session=\"" + sessions_[i].name + "\"", sessions_[i].bitrate);
+    }
+
+    append_help(out, "publish_quality_psnr_db", "gauge", "PSNR of the latest sampled frame.");
+    for(size_t i = 0; i < sessions_.size(); i++) {
+        std::string session = "session=\"" + sessions_[i].name + "\"";
+        append_value(out, "publish_quality_psnr_db", session + ",plane=\"all\"",
+                     PublishMetrics::Get(sessions_[i].metrics->quality_psnr_) / 1000.0);
+        append_value(out, "publish_quality_psnr_db", session + ",plane=\"y\"",
+                     PublishMetrics::Get(sessions_[i].metrics->quality_psnr_y_) / 1000.0);
+    }
+    append_help(out, "publish_quality_ssim", "gauge", "Luma SSIM of the latest sampled frame.");
+    for(size_t i = 0; i < sessions_.size(); i++) {
+        append_value(out, "publish_quality_ssim", "session=\"" + sessions_[i].name + "\"",
+                     PublishMetrics::Get(sessions_[i].metrics->quality_ssim_) / 1000000.0);
+    }
+
+    // 3 写帧耗时直方图，prometheus的桶是累计的
+    append_help(out, "publish_write_latency_seconds", "histogram", "av_write_frame latency.");
+    for(size_t i = 0; i < sessions_.size(); i++) {
+        PublishMetrics *m = sessions_[i].metrics;
+        std::string session = "session=\"" + sessions_[i].name + "\"";
+        int64_t cumulative = 0;
+        char le[64];
+        for(int b = 0; b <= WRITE_LATENCY_BUCKETS; b++) {
+            cumulative += PublishMetrics::Get(m->write_latency_buckets_[b]);
+            if(b < WRITE_LATENCY_BUCKETS) {
+                snprintf(le, sizeof(le), ",le=\"%g\"", kWriteLatencyBuckets[b] / 1000000.0);
+            } else {
+                snprintf(le, sizeof(le), ",le=\"+Inf\"");
+            }
+            append_value(out, "publish_write_latency_seconds_bucket", session + le, (double)cumulative);
+        }
+        append_value(out, "publish_write_latency_seconds_sum", session, PublishMetrics::Get(m->write_latency_sum_) / 1000000.0);
+        append_value(out, "publish_write_latency_seconds_count", session, (double)PublishMetrics::Get(m->write_latency_count_));
+    }
+
+    return out;
+}
@@ -0,0 +1,113 @@
+﻿#ifndef PUBLISHMETRICS_H
+#define PUBLISHMETRICS_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "mediabase.h"
+#include "instrument.h"
+
+// 写帧耗时直方图的桶上限，单位微秒，最后还有一个+Inf桶
+#define WRITE_LATENCY_BUCKETS 12
+static const int64_t kWriteLatencyBuckets[WRITE_LATENCY_BUCKETS] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000
+};
+
+/**
+ * 推流会话的运行指标。编码线程、推流线程只做原子加或者原子写(relaxed)，不加锁，
+ * 抓取指标的http线程只做原子读，所以每秒抓取一次对推流的热路径几乎没有影响。
+ */
+class PublishMetrics
+{
+public:
+    PublishMetrics() {
+        for(int i = 0; i <= WRITE_LATENCY_BUCKETS; i++) {
+            write_latency_buckets_[i] = 0;
+        }
+    }
+
+    // 计数器加上一个值
+    static inline void Add(std::atomic<int64_t> &counter, int64_t value) {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+    // 设置仪表盘的值
+    static inline void Set(std::atomic<int64_t> &gauge, int64_t value) {
+        gauge.store(value, std::memory_order_relaxed);
+    }
+    static inline int64_t Get(const std::atomic<int64_t> &value) {
+        return value.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief 记录一次av_write_frame的耗时。
+     * @param latency 耗时，单位微秒。
+     */
+    void ObserveWriteLatency(int64_t latency) {
+        int i = 0;
+        while(i < WRITE_LATENCY_BUCKETS && latency > kWriteLatencyBuckets[i]) {
+            i++;
+        }
+        Add(write_latency_buckets_[i], 1);                  // 只记录落在哪个桶，输出时再累加成prometheus的累计桶
+        Add(write_latency_sum_, latency);
+        Add(write_latency_count_, 1);
+    }
+
+    // 编码(计数器)
+    std::atomic<int64_t> video_encoded_frames_{0};
+    std::atomic<int64_t> video_encoded_bytes_{0};
+    std::atomic<int64_t> audio_encoded_frames_{0};
+    std::atomic<int64_t> audio_encoded_bytes_{0};
+    // 推流(计数器)
+    std::atomic<int64_t> video_sent_packets_{0};
+    std::atomic<int64_t> video_sent_bytes_{0};
+    std::atomic<int64_t> audio_sent_packets_{0};
+    std::atomic<int64_t> audio_sent_bytes_{0};
+    std::atomic<int64_t> dropped_packets_{0};               // 队列超时长被drop掉的包
+    std::atomic<int64_t> write_errors_{0};                  // av_write_frame失败的次数
+    std::atomic<int64_t> reconnects_{0};                    // 重连(或者切换到备用连接)的次数
+    // 队列(仪表盘)
+    std::atomic<int64_t> audio_queue_duration_{0};          // 单位ms
+    std::atomic<int64_t> video_queue_duration_{0};
+    std::atomic<int64_t> queue_bytes_{0};
+    // 写帧耗时直方图
+    std::atomic<int64_t> write_latency_buckets_[WRITE_LATENCY_BUCKETS + 1];
+    std::atomic<int64_t> write_latency_sum_{0};             // 单位微秒
+    std::atomic<int64_t> write_latency_count_{0};
+    // 编码质量监测，详看QualityMonitor。仪表盘是最近一个采样帧的值
+    std::atomic<int64_t> quality_samples_{0};               // 计数器
+    std::atomic<int64_t> quality_lost_samples_{0};          // 计数器，没有采样或者没有解码出对应帧的
+    std::atomic<int64_t> quality_psnr_{0};                  // 单位0.001dB，三个平面合起来
+    std::atomic<int64_t> quality_psnr_y_{0};
+    std::atomic<int64_t> quality_ssim_{0};                  // 乘以1000000
+};
+
+/**
+ * 把一个或多个推流会话的指标输出成prometheus的文本格式，由http线程调用。
+ * 编码帧率、码率这两个仪表盘是根据两次抓取之间计数器的差值算出来的，所以只保存在本类中，不需要热路径参与。
+ */
+class MetricsExporter
+{
+public:
+    void AddSession(const std::string &name, PublishMetrics *metrics);
+    void RemoveSession(PublishMetrics *metrics);
+    std::string Render();
+
+private:
+    typedef struct metrics_session
+    {
+        std::string name;
+        PublishMetrics *metrics;
+        int64_t last_time;                                  // 上一次抓取的时间，单位ms
+        int64_t last_video_frames;
+        int64_t last_sent_bytes;
+        double encode_fps;
+        double bitrate;                                     // 发送码率，bps
+    }MetricsSession;
+
+    PushMutex mutex_{PUSH_LOCK_SITE("publish_metrics")};   // 只保护sessions_的增删，与热路径无关
+    std::vector<MetricsSession> sessions_;
+};
+
+#endif // PUBLISHMETRICS_H
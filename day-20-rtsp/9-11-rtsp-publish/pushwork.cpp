@@ -1,7 +1,9 @@
 ﻿#include <functional>
+#include <math.h>
 #include "pushwork.h"
 #include "dlog.h"
 #include "avpublishtime.h"
+#include "audioconvert.h"
 
 PushWork::PushWork(MessageQueue *msg_queue)
     : msg_queue_(msg_queue)
@@ -19,25 +21,56 @@ PushWork::~PushWork()
     // 从源头开始释放资源
     // 先释放音频、视频捕获
     // 注意：不是继承关系，所以不用先析构派生再析构基类的做法，这里是同类内的成员析构，不要与这里混淆了。
+    if(demux_source_) {                         // 转推的读包线程，各个输出使用它的上下文，所以最先停止、最后释放
+        demux_source_->Stop();
+    }
     if(audio_capturer_) {
         delete audio_capturer_;
         audio_capturer_ = NULL;
     }
+    for(size_t i = 0; i < mix_capturers_.size(); i++) {
+        delete mix_capturers_[i];
+    }
+    mix_capturers_.clear();
+    if(audio_mixer_) {                          // 采集线程都停了再停混音线程，它回调PcmCallback编码
+        delete audio_mixer_;
+        audio_mixer_ = NULL;
+    }
     if(video_capturer_) {
         delete video_capturer_;
         video_capturer_ = NULL;
     }
+    for(size_t i = 0; i < overlay_capturers_.size(); i++) {
+        delete overlay_capturers_[i];
+    }
+    overlay_capturers_.clear();
+    if(video_compositor_) {                     // 主画面与叠加源的采集线程都停了才能释放
+        delete video_compositor_;
+        video_compositor_ = NULL;
+    }
+    if(timecode_stamper_) {
+        delete timecode_stamper_;
+        timecode_stamper_ = NULL;
+    }
     if(audio_encoder_) {
         delete audio_encoder_;
         audio_encoder_ = NULL;
     }
+    if(quality_monitor_) {                      // 采集线程停了就不会再有包进来
+        delete quality_monitor_;
+        quality_monitor_ = NULL;
+    }
+    if(encode_governor_) {                      // 降级用的编码器由它释放
+        delete encode_governor_;
+        encode_governor_ = NULL;
+    }
     if(video_encoder_) {
         delete video_encoder_;
         video_encoder_ = NULL;
     }
 
-    if(fltp_buf_) {// 音频采集线程会使用，所以停了采集线程就可以回收这个buf。
-        av_free(fltp_buf_);
+    if(audio_buf_) {// 音频采集线程会使用，所以停了采集线程就可以回收这个buf。
+        av_free(audio_buf_);
     }
     if(pcm_s16le_fp_){// 音频采集线程会使用，所以停了采集线程就可以回收这个描述符。
         fclose(pcm_s16le_fp_);
@@ -56,11 +89,63 @@ PushWork::~PushWork()
     if(audio_frame_) {
         av_frame_free(&audio_frame_);
     }
+    if(silence_detector_) {
+        delete silence_detector_;
+        silence_detector_ = NULL;
+    }
+    if(scene_detector_) {
+        delete scene_detector_;
+        scene_detector_ = NULL;
+    }
+    // 先停各层的编码线程，再释放它们使用的推流器
+    for(size_t i = 0; i < simulcast_layers_.size(); i++) {
+        delete simulcast_layers_[i];
+    }
+    simulcast_layers_.clear();
+    for(size_t i = 0; i < simulcast_pushers_.size(); i++) {
+        delete simulcast_pushers_[i];
+    }
+    simulcast_pushers_.clear();
+    if(scale_cascade_) {
+        delete scale_cascade_;
+        scale_cascade_ = NULL;
+    }
 
     if(rtsp_pusher_) {
         delete rtsp_pusher_;
         rtsp_pusher_ = NULL;
     }
+    if(rtsp_server_) {
+        delete rtsp_server_;
+        rtsp_server_ = NULL;
+    }
+    // 先停http线程，再释放指标与hls输出，因为http线程会读取它们
+    if(http_server_) {
+        delete http_server_;
+        http_server_ = NULL;
+    }
+    if(hls_sink_) {
+        delete hls_sink_;
+        hls_sink_ = NULL;
+    }
+    if(metrics_exporter_) {
+        delete metrics_exporter_;
+        metrics_exporter_ = NULL;
+    }
+    if(metrics_) {
+        delete metrics_;
+        metrics_ = NULL;
+    }
+    if(demux_source_) {
+        delete demux_source_;
+        demux_source_ = NULL;
+    }
+#ifdef PUSH_INSTRUMENT
+    if(instrument_reporter_) {                  // 最后停止，退出前打印的最后一段包含释放的过程
+        delete instrument_reporter_;
+        instrument_reporter_ = NULL;
+    }
+#endif
     LogInfo("~PushWork()");
 }
 
@@ -86,10 +171,13 @@ PushWork::~PushWork()
  */
 RET_CODE PushWork::Init(const Properties &properties)
 {
-    int ret = 0;
     // 音频test模式
     audio_test_         = properties.GetProperty("audio_test", 0);
     input_pcm_name_     = properties.GetProperty("input_pcm_name", "input_48k_2ch_s16.pcm");
+    audio_source_       = properties.GetProperty("audio_source", "file");                   // pattern 合成测试音频代替pcm文件，shm 外部采集进程
+    audio_shm_name_     = properties.GetProperty("audio_shm_name", "/push_audio");
+    audio_pattern_      = properties.GetProperty("audio_pattern", "tone");                  // tone sweep beep
+    audio_pattern_frequency_ = properties.GetProperty("audio_pattern_frequency", 1000);
 
     // 麦克风采样属性
     mic_sample_rate_    = properties.GetProperty("mic_sample_rate", 48000);
@@ -101,11 +189,36 @@ RET_CODE PushWork::Init(const Properties &properties)
     audio_bitrate_      = properties.GetProperty("audio_bitrate", 128*1024);
     audio_channels_     = properties.GetProperty("audio_channels", mic_channels_);
     audio_ch_layout_    = av_get_default_channel_layout(audio_channels_);                   // 由audio_channels_决定
+    audio_codec_        = properties.GetProperty("audio_codec", "aac");
+    audio_frame_duration_   = properties.GetProperty("audio_frame_duration", 20);
+    audio_opus_application_ = properties.GetProperty("audio_opus_application", "lowdelay");
+    audio_dtx_enable_               = properties.GetProperty("audio_dtx_enable", 0);
+    audio_silence_threshold_db_     = properties.GetProperty("audio_silence_threshold_db", -50);
+    audio_silence_hangover_ms_      = properties.GetProperty("audio_silence_hangover_ms", 300);
+    audio_comfort_interval_ms_      = properties.GetProperty("audio_comfort_interval_ms", 500);
+
+    // 混音
+    audio_mix_inputs_str_   = properties.GetProperty("audio_mix_inputs", "");
+    audio_mix_mic_gain_db_  = properties.GetProperty("audio_mix_mic_gain_db", 0);
+    audio_mix_mode_         = properties.GetProperty("audio_mix_mode", "float");
+    audio_mix_delay_        = properties.GetProperty("audio_mix_delay", 50);
+    audio_mix_tolerance_    = properties.GetProperty("audio_mix_tolerance", 20);
+    audio_mix_fade_ms_      = properties.GetProperty("audio_mix_fade_ms", 20);
+    if(ParseMixInputs(audio_mix_inputs_str_, &audio_mix_inputs_) != RET_OK) {
+        LogError("invalid audio_mix_inputs: %s", audio_mix_inputs_str_.c_str());
+        return RET_ERR_PARAMISMATCH;
+    }
 
 
     // 视频test模式
     video_test_         = properties.GetProperty("video_test", 0);
     input_yuv_name_     = properties.GetProperty("input_yuv_name", "input_1280_720_420p.yuv");
+    video_source_       = properties.GetProperty("video_source", "file");                   // pattern 合成测试图像代替yuv文件，shm 外部采集进程
+    video_shm_name_     = properties.GetProperty("video_shm_name", "/push_video");
+    video_pattern_      = properties.GetProperty("video_pattern", "gradient");              // gradient noise
+    video_pattern_noise_bits_   = properties.GetProperty("video_pattern_noise_bits", -1);
+    video_pattern_seed_         = properties.GetProperty("video_pattern_seed", 1);
+    video_pattern_counter_      = properties.GetProperty("video_pattern_counter", 1);
 
     // 桌面录制属性
     desktop_x_          = properties.GetProperty("desktop_x", 0);
@@ -122,57 +235,333 @@ RET_CODE PushWork::Init(const Properties &properties)
     video_gop_          = properties.GetProperty("video_gop", video_fps_);
     video_bitrate_      = properties.GetProperty("video_bitrate", 1024*1024);               // 先默认1M fixedme
     video_b_frames_     = properties.GetProperty("video_b_frames", 0);                      // b帧数量
+    video_intra_refresh_    = properties.GetProperty("video_intra_refresh", 0);             // 周期帧内刷新，消除I帧码率峰值
+    video_slice_max_size_   = properties.GetProperty("video_slice_max_size", 0);            // slice最大字节数
+    video_static_mode_              = properties.GetProperty("video_static_mode", 0);
+    video_static_block_threshold_   = properties.GetProperty("video_static_block_threshold", 2);
+    video_static_max_changed_blocks_ = properties.GetProperty("video_static_max_changed_blocks", 0);
+    video_static_hangover_frames_   = properties.GetProperty("video_static_hangover_frames", 5);
+    video_static_max_skip_frames_   = properties.GetProperty("video_static_max_skip_frames", video_fps_);  // 默认至少1秒编码一帧
+    video_static_qp_offset_         = properties.GetProperty("video_static_qp_offset", 6);
+    video_layers_str_               = properties.GetProperty("video_layers", "");
+    video_overlays_str_             = properties.GetProperty("video_overlays", "");
+    video_timecode_                 = properties.GetProperty("video_timecode", 0);
+    video_quality_interval_         = properties.GetProperty("video_quality_interval", 0);
+    video_quality_max_pending_      = properties.GetProperty("video_quality_max_pending", 4);
+    video_quality_max_cpu_          = properties.GetProperty("video_quality_max_cpu", 20);
+    video_governor_enable_          = properties.GetProperty("video_governor_enable", 0);
+    video_governor_fast_preset_     = properties.GetProperty("video_governor_fast_preset", "superfast");
+    video_governor_high_load_       = properties.GetProperty("video_governor_high_load", 85);
+    video_governor_low_load_        = properties.GetProperty("video_governor_low_load", 50);
+    video_governor_up_hold_ms_      = properties.GetProperty("video_governor_up_hold_ms", 5000);
+    video_governor_max_level_       = properties.GetProperty("video_governor_max_level", (int)GOVERNOR_DROP);
 
     // rtsp推流属性
     rtsp_url_                   = properties.GetProperty("rtsp_url", "");
     rtsp_transport_             = properties.GetProperty("rtsp_transport", "");
     rtsp_timeout_               = properties.GetProperty("rtsp_timeout", 5000);
     rtsp_max_queue_duration_    = properties.GetProperty("rtsp_max_queue_duration", 500);
+    rtsp_pacing_enable_         = properties.GetProperty("rtsp_pacing_enable", 0);
+    rtsp_pacing_multiple_       = properties.GetProperty("rtsp_pacing_multiple", 150);
+    rtsp_pacing_max_delay_      = properties.GetProperty("rtsp_pacing_max_delay", 500);
+    rtsp_spill_enable_          = properties.GetProperty("rtsp_spill_enable", 0);
+    rtsp_spill_file_            = properties.GetProperty("rtsp_spill_file", "rtsp_spill.dat");
+    rtsp_spill_file_size_mb_    = properties.GetProperty("rtsp_spill_file_size_mb", 256);
+    rtsp_spill_memory_threshold_kb_ = properties.GetProperty("rtsp_spill_memory_threshold_kb", 4096);
+    rtsp_spill_catchup_percent_ = properties.GetProperty("rtsp_spill_catchup_percent", 200);
+    rtsp_standby_url_           = properties.GetProperty("rtsp_standby_url", "");
+    rtsp_standby_keepalive_interval_ = properties.GetProperty("rtsp_standby_keepalive_interval", 1000);
+    rtsp_failover_stall_time_   = properties.GetProperty("rtsp_failover_stall_time", 1000);
+
+    // 内嵌rtsp服务器属性
+    rtsp_server_port_           = properties.GetProperty("rtsp_server_port", 0);
+    rtsp_server_path_           = properties.GetProperty("rtsp_server_path", "live");
+    rtsp_server_rtp_port_       = properties.GetProperty("rtsp_server_rtp_port", 30000);
+    rtsp_server_max_clients_    = properties.GetProperty("rtsp_server_max_clients", 64);
+
+    // LL-HLS输出属性
+    hls_enable_                 = properties.GetProperty("hls_enable", 0);
+    hls_dir_                    = properties.GetProperty("hls_dir", "");
+    hls_part_duration_          = properties.GetProperty("hls_part_duration", 200);
+    hls_segment_duration_       = properties.GetProperty("hls_segment_duration", 2000);
+    hls_window_                 = properties.GetProperty("hls_window", 6);
+    hls_http_port_              = properties.GetProperty("hls_http_port", 0);
+
+    // 转推属性
+    passthrough_url_            = properties.GetProperty("passthrough_url", "");
+    passthrough_loop_           = properties.GetProperty("passthrough_loop", 1);
+    passthrough_realtime_       = properties.GetProperty("passthrough_realtime", -1);
+    passthrough_rtsp_transport_ = properties.GetProperty("passthrough_rtsp_transport", "tcp");
+    if(rtsp_url_.empty() && rtsp_server_port_ <= 0 && !hls_enable_) {
+        LogError("rtsp_url is empty, rtsp_server_port is 0 and hls is disabled, nowhere to publish");
+        return RET_ERR_PARAMISMATCH;
+    }
+    if(ParseVideoLayers(video_layers_str_, &video_layers_) != RET_OK
+            || (!video_layers_.empty() && rtsp_url_.empty())) {
+        LogError("invalid video_layers: %s, or rtsp_url is empty", video_layers_str_.c_str());
+        return RET_ERR_PARAMISMATCH;
+    }
+    if(!passthrough_url_.empty() && !video_layers_.empty()) {
+        LogError("video_layers needs re-encoding, it can not be used with passthrough_url");
+        return RET_ERR_PARAMISMATCH;
+    }
+    if(!passthrough_url_.empty() && !audio_mix_inputs_.empty()) {
+        LogError("audio_mix_inputs needs re-encoding, it can not be used with passthrough_url");
+        return RET_ERR_PARAMISMATCH;
+    }
+    if(ParseVideoOverlays(video_overlays_str_, &video_overlays_) != RET_OK) {
+        LogError("invalid video_overlays: %s", video_overlays_str_.c_str());
+        return RET_ERR_PARAMISMATCH;
+    }
+    if(!passthrough_url_.empty() && !video_overlays_.empty()) {
+        LogError("video_overlays needs re-encoding, it can not be used with passthrough_url");
+        return RET_ERR_PARAMISMATCH;
+    }
+    if(!passthrough_url_.empty() && video_timecode_) {
+        LogError("video_timecode needs re-encoding, it can not be used with passthrough_url");
+        return RET_ERR_PARAMISMATCH;
+    }
+    if(!passthrough_url_.empty() && video_quality_interval_ > 0) {
+        LogError("video_quality_interval needs re-encoding, it can not be used with passthrough_url");
+        return RET_ERR_PARAMISMATCH;
+    }
+
+    // 运行指标
+    metrics_port_       = properties.GetProperty("metrics_port", 0);
+    metrics_ip_         = properties.GetProperty("metrics_ip", "127.0.0.1");
+    session_name_       = properties.GetProperty("session_name", "default");
+#ifdef PUSH_INSTRUMENT
+    instrument_reporter_ = new InstrumentReporter(properties.GetProperty("instrument_interval", 10));   // 单位秒
+    if(instrument_reporter_->Start() != RET_OK) {
+        LogError("InstrumentReporter Start failed");
+        return RET_FAIL;
+    }
+#endif
+    // 指标与hls共用一个http服务器
+    if(hls_enable_ && metrics_port_ > 0 && hls_http_port_ > 0 && hls_http_port_ != metrics_port_) {
+        LogError("hls_http_port %d must be same as metrics_port %d", hls_http_port_, metrics_port_);
+        return RET_ERR_PARAMISMATCH;
+    }
+    if(hls_enable_ && metrics_port_ <= 0 && hls_http_port_ <= 0 && hls_dir_.empty()) {
+        LogError("hls is enabled but no http port and no hls_dir");
+        return RET_ERR_PARAMISMATCH;
+    }
 
     // 初始化publish time，即记录start_time_，但放这里不会有误差吗？个人感觉放在音视频采集Start前更好。
     AVPublishTime::GetInstance()->Rest();                                                   // 推流打时间戳的问题
 
-    // 1 初始化音视频编码器
+    // 1 初始化音视频编码器。转推已经编码的输入时不需要编码器，各个输出按输入的流参数配置
+    const AVCodecContext *video_ctx = NULL;
+    const AVCodecContext *audio_ctx = NULL;
+    if(!passthrough_url_.empty()) {
+        demux_source_ = new DemuxSource();
+        Properties demux_properties;
+        demux_properties.SetProperty("url", passthrough_url_);
+        demux_properties.SetProperty("loop", passthrough_loop_);
+        demux_properties.SetProperty("realtime", passthrough_realtime_);
+        demux_properties.SetProperty("rtsp_transport", passthrough_rtsp_transport_);
+        demux_properties.SetProperty("timeout", rtsp_timeout_);
+        if(demux_source_->Init(demux_properties) != RET_OK) {
+            LogError("DemuxSource Init failed");
+            return RET_FAIL;
+        }
+        video_ctx = demux_source_->GetVideoCodecContext();
+        audio_ctx = demux_source_->GetAudioCodecContext();
+        video_fps_ = demux_source_->GetFps();
+    } else {
+        if(initEncoders() != RET_OK) {
+            return RET_FAIL;
+        }
+        video_ctx = video_encoder_->GetCodecContext();
+        audio_ctx = audio_encoder_->GetCodecContext();
+    }
+
+    if(metrics_port_ > 0) {
+        metrics_ = new PublishMetrics();
+    }
+    if(quality_monitor_) {
+        quality_monitor_->SetMetrics(metrics_);
+        if(quality_monitor_->Start() != RET_OK) {
+            LogError("QualityMonitor Start failed");
+            return RET_FAIL;
+        }
+        pre_quality_stats_time_ = TimesUtil::GetTimeMillisecond();
+    }
+
+    // 2 初始化rtsp推流器。在音视频编码器初始化完， 音视频捕获前。rtsp_url为空时只使用内嵌的rtsp服务器
+    if(!rtsp_url_.empty()) {
+        rtsp_pusher_ = createPusher("", video_ctx, audio_ctx, video_bitrate_);
+        if(!rtsp_pusher_) {
+            return RET_FAIL;
+        }
+    }
+    // 每个分辨率层推送到 rtsp_url_高p，例如rtsp://host/live/livestream_360p，音频与主流共用
+    for(size_t i = 0; i < simulcast_layers_.size(); i++) {
+        SimulcastLayer *layer = simulcast_layers_[i];
+        RtspPusher *pusher = createPusher("_" + std::to_string(layer->GetHeight()) + "p",
+                                          layer->GetEncoder()->GetCodecContext(), audio_ctx, video_layers_[i].bitrate);
+        if(!pusher) {
+            return RET_FAIL;
+        }
+        simulcast_pushers_.push_back(pusher);
+        layer->AddCallback([pusher](AVPacket *packet) {
+            pusher->Push(packet, E_VIDEO_TYPE);
+        });
+        if(layer->Start() != RET_OK) {
+            LogError("SimulcastLayer Start failed");
+            return RET_FAIL;
+        }
+    }
+
+    // 内嵌rtsp服务器，客户端可以直接拉流 rtsp://ip:rtsp_server_port/rtsp_server_path
+    if(rtsp_server_port_ > 0) {
+        rtsp_server_ = new RtspServer();
+        Properties server_properties;
+        server_properties.SetProperty("port", rtsp_server_port_);
+        server_properties.SetProperty("path", rtsp_server_path_);
+        server_properties.SetProperty("rtp_port", rtsp_server_rtp_port_);
+        server_properties.SetProperty("max_clients", rtsp_server_max_clients_);
+        if(rtsp_server_->Init(server_properties) != RET_OK) {
+            LogError("RtspServer Init failed");
+            return RET_FAIL;
+        }
+        if(rtsp_server_->ConfigVideoStream(video_ctx) != RET_OK
+                || (audio_ctx && rtsp_server_->ConfigAudioStream(audio_ctx) != RET_OK)) {
+            LogError("RtspServer config stream failed");
+            return RET_FAIL;
+        }
+        if(rtsp_server_->Start() != RET_OK) {
+            LogError("RtspServer Start failed");
+            return RET_FAIL;
+        }
+    }
+
+//    AVPublishTime::GetInstance()->Rest();                                                   // 推流打时间戳的问题
+
+    // LL-HLS输出，直接使用编码后的包，不重新编码
+    if(hls_enable_) {
+        if(!demux_source_ && video_gop_ * 1000 > hls_segment_duration_ * video_fps_) {
+            LogWarn("video gop %d frames is longer than hls_segment_duration %dms", video_gop_, hls_segment_duration_);
+        }
+        hls_sink_ = new HlsSink();
+        Properties hls_properties;
+        hls_properties.SetProperty("dir", hls_dir_);
+        hls_properties.SetProperty("part_duration", hls_part_duration_);
+        hls_properties.SetProperty("segment_duration", hls_segment_duration_);
+        hls_properties.SetProperty("window", hls_window_);
+        if(hls_sink_->Init(hls_properties) != RET_OK
+                || hls_sink_->ConfigVideoStream(video_ctx) != RET_OK
+                || (audio_ctx && hls_sink_->ConfigAudioStream(audio_ctx) != RET_OK)) {
+            LogError("HlsSink Init failed");
+            return RET_FAIL;
+        }
+        if(hls_sink_->Start() != RET_OK) {
+            LogError("HlsSink Start failed");
+            return RET_FAIL;
+        }
+    }
+
+    // 开启指标与LL-HLS的http服务，放在采集之前，这样可以看到完整的编码计数
+    int http_port = metrics_port_ > 0 ? metrics_port_ : hls_http_port_;
+    if(metrics_ || (hls_sink_ && http_port > 0)) {
+        http_server_ = new HttpServer();
+        Properties http_properties;
+        http_properties.SetProperty("ip", metrics_ip_);
+        http_properties.SetProperty("port", http_port);
+        if(hls_sink_) {
+            http_properties.SetProperty("max_connections", 64);     // 每个播放器有挂起的播放列表请求与part请求
+        }
+        if(http_server_->Init(http_properties) != RET_OK) {
+            LogError("HttpServer Init failed");
+            return RET_FAIL;
+        }
+        if(metrics_) {
+            metrics_exporter_ = new MetricsExporter();
+            metrics_exporter_->AddSession(session_name_, metrics_);
+            MetricsExporter *exporter = metrics_exporter_;
+            http_server_->AddHandler("/metrics", [exporter](const HttpRequest &, HttpResponse *response) {
+                response->content_type = "text/plain; version=0.0.4";
+                response->body = exporter->Render();
+            });
+        }
+        if(hls_sink_) {
+            HlsSink *sink = hls_sink_;
+            http_server_->AddHandler(sink->GetPathPrefix(), [sink](const HttpRequest &request, HttpResponse *response) {
+                sink->HandleRequest(request, response);
+            });
+            LogInfo("hls: http://%s:%d%slive.m3u8", metrics_ip_.c_str(), http_port, sink->GetPathPrefix().c_str());
+        }
+        if(http_server_->Start() != RET_OK) {
+            LogError("HttpServer Start failed");
+            return RET_FAIL;
+        }
+    }
+
+    // 3 转推时启动读包线程，否则设置音视频捕获
+    if(demux_source_) {
+        demux_source_->AddCallback(std::bind(&PushWork::PacketCallback, this, std::placeholders::_1,
+                                             std::placeholders::_2));
+        if(demux_source_->Start() != RET_OK) {
+            LogError("DemuxSource Start failed");
+            return RET_FAIL;
+        }
+        return RET_OK;
+    }
+    return initCapturers();
+}
 
+/**
+ * @brief 初始化音视频编码器以及依赖编码的静音检测、编码调节、多分辨率层与静止画面检测。
+ * @return 成功 0，失败 other。
+ */
+RET_CODE PushWork::initEncoders()
+{
+    int ret = 0;
     // 设置音频编码器，先音频捕获初始化(上面是获取到对应的音视频编码属性，这里是设置)
-    audio_encoder_ = new AACEncoder();
-    if(!audio_encoder_)
-    {
-        LogError("new AACEncoder() failed");
-        return RET_FAIL;
+    if(audio_codec_ == "opus") {
+        audio_encoder_ = new OpusEncoder();
+    } else if(audio_codec_ == "aac") {
+        audio_encoder_ = new AACEncoder();
+    } else {
+        LogError("unsupported audio_codec: %s", audio_codec_.c_str());
+        return RET_ERR_NOT_SUPPORT;
     }
     Properties  aud_codec_properties;
     aud_codec_properties.SetProperty("sample_rate", audio_sample_rate_);
     aud_codec_properties.SetProperty("channels", audio_channels_);
     aud_codec_properties.SetProperty("bitrate", audio_bitrate_);                            // 这里没有去设置采样格式
-    // 需要什么样的采样格式是从编码器读取出来的
+    aud_codec_properties.SetProperty("frame_duration", audio_frame_duration_);              // 只有opus使用
+    aud_codec_properties.SetProperty("application", audio_opus_application_);
+    // 需要什么样的采样格式、一帧多少个样本都是从编码器读取出来的
     if(audio_encoder_->Init(aud_codec_properties) != RET_OK)
     {
-        LogError("AACEncoder Init failed");
+        LogError("%s encoder Init failed", audio_codec_.c_str());
         return RET_FAIL;
     }
+    // 音频时间戳按编码器的帧长累加
+    AVPublishTime::GetInstance()->set_audio_frame_duration(audio_encoder_->GetFrameSamples() * 1000.0 / audio_encoder_->GetSampleRate());
+    LogInfo("audio codec: %s, frame: %d samples, algorithmic delay: %0.1lfms", audio_codec_.c_str(),
+            audio_encoder_->GetFrameSamples(), audio_encoder_->GetAlgorithmicDelay());
 
     int frame_bytes2 = 0;
-    // 默认读取出来的数据是s16的，编码器需要的是fltp, 需要做重采样
-    // 手动把s16转成fltp
-    fltp_buf_size_ = av_samples_get_buffer_size(NULL, audio_encoder_->GetChannels(),
-                                                audio_encoder_->GetFrameSamples(),
-                                                (enum AVSampleFormat)audio_encoder_->GetFormat(), 1);
-    fltp_buf_ = (uint8_t *)av_malloc(fltp_buf_size_);
-    if(!fltp_buf_) {
-        LogError("fltp_buf_ av_malloc failed");
+    // 默认读取出来的数据是s16的，aac需要的是fltp，opus直接使用s16，由AudioConvertS16转换
+    audio_buf_size_ = av_samples_get_buffer_size(NULL, audio_encoder_->GetChannels(),
+                                                 audio_encoder_->GetFrameSamples(),
+                                                 (enum AVSampleFormat)audio_encoder_->GetFormat(), 1);
+    audio_buf_ = (uint8_t *)av_malloc(audio_buf_size_);
+    if(!audio_buf_) {
+        LogError("audio_buf_ av_malloc failed");
         return RET_ERR_OUTOFMEMORY;
     }
 
     audio_frame_ = av_frame_alloc();
     audio_frame_->format = audio_encoder_->GetFormat();
-    audio_frame_->format = AV_SAMPLE_FMT_FLTP;
     audio_frame_->nb_samples = audio_encoder_->GetFrameSamples();
     audio_frame_->channels = audio_encoder_->GetChannels();
     audio_frame_->channel_layout = audio_encoder_->GetChannelLayout();
     frame_bytes2  = audio_encoder_->GetFrameBytes();
-    if(fltp_buf_size_ != frame_bytes2) {
-        LogError("frame_bytes1: %d != frame_bytes2: %d", fltp_buf_size_, frame_bytes2);
+    if(audio_buf_size_ != frame_bytes2) {
+        LogError("frame_bytes1: %d != frame_bytes2: %d", audio_buf_size_, frame_bytes2);
         return RET_FAIL;
     }
     ret = av_frame_get_buffer(audio_frame_, 0);
@@ -181,6 +570,20 @@ RET_CODE PushWork::Init(const Properties &properties)
         return RET_FAIL;
     }
 
+    // 静音检测
+    if(audio_dtx_enable_) {
+        silence_detector_ = new SilenceDetector();
+        Properties silence_properties;
+        silence_properties.SetProperty("threshold_db", audio_silence_threshold_db_);
+        silence_properties.SetProperty("hangover_ms", audio_silence_hangover_ms_);
+        silence_properties.SetProperty("comfort_interval_ms", audio_comfort_interval_ms_);
+        silence_properties.SetProperty("frame_duration_ms", audio_encoder_->GetFrameSamples() * 1000 / audio_encoder_->GetSampleRate());
+        if(silence_detector_->Init(silence_properties) != RET_OK) {
+            LogError("SilenceDetector Init failed");
+            return RET_FAIL;
+        }
+    }
+
     // 初始化视频编码器
     video_encoder_ = new H264Encoder();
     Properties  vid_codec_properties;
@@ -190,55 +593,110 @@ RET_CODE PushWork::Init(const Properties &properties)
     vid_codec_properties.SetProperty("b_frames", video_b_frames_);
     vid_codec_properties.SetProperty("bitrate", video_bitrate_);    // 码率
     vid_codec_properties.SetProperty("gop", video_gop_);            // gop
+    vid_codec_properties.SetProperty("intra_refresh", video_intra_refresh_);
+    vid_codec_properties.SetProperty("slice_max_size", video_slice_max_size_);
     if(video_encoder_->Init(vid_codec_properties) != RET_OK)
     {
         LogError("H264Encoder Init failed");
         return RET_FAIL;
     }
 
-    // 2 初始化rtsp推流器。在音视频编码器初始化完， 音视频捕获前
-    rtsp_pusher_ = new RtspPusher(msg_queue_);
-    if(!rtsp_pusher_) {
-        LogError("new RTSPPusher() failed");
-        return RET_FAIL;
-    }
-    Properties  rtsp_properties;
-    rtsp_properties.SetProperty("url", rtsp_url_);
-    rtsp_properties.SetProperty("timeout", rtsp_timeout_);
-    rtsp_properties.SetProperty("rtsp_transport", rtsp_transport_);
-    rtsp_properties.SetProperty("max_queue_duration", rtsp_max_queue_duration_);
-    if(audio_encoder_) {
-        rtsp_properties.SetProperty("audio_frame_duration", audio_encoder_->GetFrameSamples()*1000/audio_encoder_->GetSampleRate());    // 设置音频一帧的时长
-    }
-    if(video_encoder_) {
-        rtsp_properties.SetProperty("video_frame_duration", 1000/video_encoder_->GetFps());                                             // 设置视频一帧的时长
+    // 编码质量监测，线程在指标创建之后再启动
+    if(video_quality_interval_ > 0) {
+        quality_monitor_ = new QualityMonitor();
+        Properties quality_properties;
+        quality_properties.SetProperty("interval", video_quality_interval_);
+        quality_properties.SetProperty("max_pending", video_quality_max_pending_);
+        quality_properties.SetProperty("max_cpu", video_quality_max_cpu_);
+        if(quality_monitor_->Init(quality_properties, video_encoder_->GetCodecContext()) != RET_OK) {
+            LogError("QualityMonitor Init failed");
+            return RET_FAIL;
+        }
     }
 
-    if(rtsp_pusher_->Init(rtsp_properties) != RET_OK) {// 里面主要是分配AVFormatContext。
-        LogError("rtsp_pusher_->Init failed");
-        return RET_FAIL;
+    // 编码cpu过载调节，降级用的编码器在第一次降级时才创建
+    if(video_governor_enable_) {
+        encode_governor_ = new EncodeGovernor();
+        Properties governor_properties;
+        governor_properties.SetProperty("width", video_width_);
+        governor_properties.SetProperty("height", video_height_);
+        governor_properties.SetProperty("fps", video_fps_);
+        governor_properties.SetProperty("bitrate", video_bitrate_);
+        governor_properties.SetProperty("gop", video_gop_);
+        governor_properties.SetProperty("b_frames", video_b_frames_);
+        governor_properties.SetProperty("intra_refresh", video_intra_refresh_);
+        governor_properties.SetProperty("slice_max_size", video_slice_max_size_);
+        governor_properties.SetProperty("fast_preset", video_governor_fast_preset_);
+        governor_properties.SetProperty("high_load", video_governor_high_load_);
+        governor_properties.SetProperty("low_load", video_governor_low_load_);
+        governor_properties.SetProperty("up_hold_ms", video_governor_up_hold_ms_);
+        governor_properties.SetProperty("max_level", video_governor_max_level_);
+        if(encode_governor_->Init(governor_properties, video_encoder_) != RET_OK) {
+            LogError("EncodeGovernor Init failed");
+            return RET_FAIL;
+        }
+        MessageQueue *msg_queue = msg_queue_;
+        encode_governor_->AddCallback([msg_queue](int level, int load) {
+            if(msg_queue) {
+                msg_queue->notify_msg3(MSG_ENCODE_GOVERNOR_LEVEL, level, load);
+            }
+        });
     }
 
-    // 创建音频流、音视频流
-    if(video_encoder_) {
-        if(rtsp_pusher_->ConfigVideoStream(video_encoder_->GetCodecContext()) != RET_OK) {
-            LogError("rtsp_pusher ConfigVideoSteam failed");
+    // 多分辨率层，编码线程在推流器连接之后再启动
+    if(!video_layers_.empty()) {
+        scale_cascade_ = new ScaleCascade();
+        if(scale_cascade_->Init(video_width_, video_height_, video_layers_) != RET_OK) {
+            LogError("ScaleCascade Init failed");
             return RET_FAIL;
         }
+        for(size_t i = 0; i < video_layers_.size(); i++) {
+            SimulcastLayer *layer = new SimulcastLayer();
+            simulcast_layers_.push_back(layer);
+            Properties layer_properties;
+            layer_properties.SetProperty("width", video_layers_[i].width);
+            layer_properties.SetProperty("height", video_layers_[i].height);
+            layer_properties.SetProperty("fps", video_fps_);
+            layer_properties.SetProperty("b_frames", video_b_frames_);
+            layer_properties.SetProperty("bitrate", video_layers_[i].bitrate);
+            layer_properties.SetProperty("gop", video_gop_);
+            layer_properties.SetProperty("intra_refresh", video_intra_refresh_);
+            layer_properties.SetProperty("slice_max_size", video_slice_max_size_);
+            if(layer->Init(layer_properties) != RET_OK) {
+                LogError("SimulcastLayer Init failed");
+                return RET_FAIL;
+            }
+        }
+        pre_cpu_time_ = TimesUtil::GetProcessCpuMicrosecond();
+        pre_cpu_wall_time_ = TimesUtil::GetTimeMicrosecond();
     }
-    if(audio_encoder_) {
-        if(rtsp_pusher_->ConfigAudioStream(audio_encoder_->GetCodecContext()) != RET_OK) {
-            LogError("rtsp_pusher ConfigAudioStream failed");
+
+    // 静止画面检测
+    if(video_static_mode_ > 0) {
+        scene_detector_ = new StaticSceneDetector();
+        Properties scene_properties;
+        scene_properties.SetProperty("width", video_width_);
+        scene_properties.SetProperty("height", video_height_);
+        scene_properties.SetProperty("mode", video_static_mode_ == 1 ? "skip" : "qp");
+        scene_properties.SetProperty("block_threshold", video_static_block_threshold_);
+        scene_properties.SetProperty("max_changed_blocks", video_static_max_changed_blocks_);
+        scene_properties.SetProperty("hangover_frames", video_static_hangover_frames_);
+        scene_properties.SetProperty("max_skip_frames", video_static_max_skip_frames_);
+        if(scene_detector_->Init(scene_properties) != RET_OK) {
+            LogError("StaticSceneDetector Init failed");
             return RET_FAIL;
         }
     }
-    if(rtsp_pusher_->Connect() != RET_OK) {// 这里连接服务器后，rtsp推流器会开启一个线程，不断从packet_queue取数据，没数据时会休眠
-        LogError("rtsp_pusher Connect() failed");
-        return RET_FAIL;
-    }
 
-//    AVPublishTime::GetInstance()->Rest();                                                   // 推流打时间戳的问题
+    return RET_OK;
+}
 
+/**
+ * @brief 初始化并启动音视频采集，采集到的数据在PcmCallback、YuvCallback中编码。
+ * @return 成功 0，失败 other。
+ */
+RET_CODE PushWork::initCapturers()
+{
     // 3 设置音视频捕获
     // 设置音频捕获
     audio_capturer_ = new AudioCapturer();
@@ -246,9 +704,14 @@ RET_CODE PushWork::Init(const Properties &properties)
     aud_cap_properties.SetProperty("audio_test", 1);
     aud_cap_properties.SetProperty("input_pcm_name", input_pcm_name_);
     aud_cap_properties.SetProperty("channels", mic_channels_);
-    aud_cap_properties.SetProperty("nb_samples", 1024);     // 由编码器提供 // fix me
+    aud_cap_properties.SetProperty("sample_rate", mic_sample_rate_);
+    aud_cap_properties.SetProperty("nb_samples", audio_encoder_->GetFrameSamples());     // 由编码器提供，aac 1024，opus 10ms是480
     aud_cap_properties.SetProperty("format", mic_sample_fmt_);
     aud_cap_properties.SetProperty("byte_per_sample", 2);   // fix me，默认读出来的是交错的s16，故固定为2字节。
+    aud_cap_properties.SetProperty("source", audio_source_);
+    aud_cap_properties.SetProperty("shm_name", audio_shm_name_);
+    aud_cap_properties.SetProperty("pattern", audio_pattern_);
+    aud_cap_properties.SetProperty("frequency", audio_pattern_frequency_);
     if(audio_capturer_->Init(aud_cap_properties) != RET_OK)
     {
         LogError("AudioCapturer Init failed");
@@ -256,14 +719,38 @@ RET_CODE PushWork::Init(const Properties &properties)
     }
 
     // 设置音频回调采集，但是此时还没执行。function+bind实现调用类内函数，std::placeholders::_1、2代表两个参数占位符
-    audio_capturer_->AddCallback(std::bind(&PushWork::PcmCallback, this, std::placeholders::_1,
-                                           std::placeholders::_2));
+    // 混音时麦克风是混音的第0路，由混音线程按自己的时钟回调PcmCallback
+    if(!audio_mix_inputs_.empty()) {
+        if(initMixer() != RET_OK) {
+            return RET_FAIL;
+        }
+        AudioMixer *mixer = audio_mixer_;
+        int bytes_per_sample = 2 * mic_channels_;
+        audio_capturer_->AddCallback([mixer, bytes_per_sample](uint8_t *pcm, int32_t size) {
+            mixer->Push(0, (int16_t *)pcm, size / bytes_per_sample, TimesUtil::GetTimeMillisecond());
+        });
+    } else {
+        audio_capturer_->AddCallback(std::bind(&PushWork::PcmCallback, this, std::placeholders::_1,
+                                               std::placeholders::_2));
+    }
     // 这里才是真正的开始采集音频数据
     if(audio_capturer_->Start()!= RET_OK) {
         LogError("AudioCapturer Start failed");
         return RET_FAIL;
     }
 
+    // 叠加源先启动，主画面的前几帧可能还没有叠加层
+    if(!video_overlays_.empty() && initCompositor() != RET_OK) {
+        return RET_FAIL;
+    }
+    if(video_timecode_) {
+        timecode_stamper_ = new TimecodeStamper();
+        if(timecode_stamper_->Init(desktop_width_, desktop_height_) != RET_OK) {
+            LogError("TimecodeStamper Init failed");
+            return RET_FAIL;
+        }
+    }
+
     // 设置视频捕获
     video_capturer_ = new VideoCapturer();
     Properties  vid_cap_properties;
@@ -271,6 +758,15 @@ RET_CODE PushWork::Init(const Properties &properties)
     vid_cap_properties.SetProperty("input_yuv_name", input_yuv_name_);
     vid_cap_properties.SetProperty("width", desktop_width_);
     vid_cap_properties.SetProperty("height", desktop_height_);
+    vid_cap_properties.SetProperty("fps", desktop_fps_);
+    vid_cap_properties.SetProperty("source", video_source_);
+    vid_cap_properties.SetProperty("shm_name", video_shm_name_);
+    vid_cap_properties.SetProperty("pattern", video_pattern_);
+    if(video_pattern_noise_bits_ >= 0) {
+        vid_cap_properties.SetProperty("noise_bits", video_pattern_noise_bits_);
+    }
+    vid_cap_properties.SetProperty("seed", video_pattern_seed_);
+    vid_cap_properties.SetProperty("counter", video_pattern_counter_);
     if(video_capturer_->Init(vid_cap_properties) != RET_OK)
     {
         LogError("VideoCapturer Init failed");
@@ -289,6 +785,202 @@ RET_CODE PushWork::Init(const Properties &properties)
     return RET_OK;
 }
 
+/**
+ * @brief 初始化混音并启动麦克风之外的各路输入的采集，格式与麦克风相同，每帧的样本数与编码器一致。
+ * @return 成功 0，失败 other。
+ */
+RET_CODE PushWork::initMixer()
+{
+    audio_mixer_ = new AudioMixer();
+    Properties mixer_properties;
+    mixer_properties.SetProperty("sample_rate", mic_sample_rate_);
+    mixer_properties.SetProperty("channels", mic_channels_);
+    mixer_properties.SetProperty("nb_samples", audio_encoder_->GetFrameSamples());
+    mixer_properties.SetProperty("mode", audio_mix_mode_);
+    mixer_properties.SetProperty("delay", audio_mix_delay_);
+    mixer_properties.SetProperty("tolerance", audio_mix_tolerance_);
+    mixer_properties.SetProperty("fade_ms", audio_mix_fade_ms_);
+    if(audio_mixer_->Init(mixer_properties) != RET_OK) {
+        LogError("AudioMixer Init failed");
+        return RET_FAIL;
+    }
+    audio_mixer_->AddSource(audio_mix_mic_gain_db_);
+    for(size_t i = 0; i < audio_mix_inputs_.size(); i++) {
+        const MixInput &input = audio_mix_inputs_[i];
+        int index = audio_mixer_->AddSource(input.gain_db);
+        AudioCapturer *capturer = new AudioCapturer();
+        mix_capturers_.push_back(capturer);
+        Properties cap_properties;
+        cap_properties.SetProperty("channels", mic_channels_);
+        cap_properties.SetProperty("sample_rate", mic_sample_rate_);
+        cap_properties.SetProperty("nb_samples", audio_encoder_->GetFrameSamples());
+        cap_properties.SetProperty("format", mic_sample_fmt_);
+        cap_properties.SetProperty("byte_per_sample", 2);
+        cap_properties.SetProperty("source", input.source);
+        cap_properties.SetProperty("input_pcm_name", input.arg);
+        cap_properties.SetProperty("pattern", input.arg);
+        cap_properties.SetProperty("shm_name", input.arg);
+        if(capturer->Init(cap_properties) != RET_OK) {
+            LogError("mix input %s:%s Init failed", input.source.c_str(), input.arg.c_str());
+            return RET_FAIL;
+        }
+        AudioMixer *mixer = audio_mixer_;
+        int bytes_per_sample = 2 * mic_channels_;
+        capturer->AddCallback([mixer, index, bytes_per_sample](uint8_t *pcm, int32_t size) {
+            mixer->Push(index, (int16_t *)pcm, size / bytes_per_sample, TimesUtil::GetTimeMillisecond());
+        });
+        LogInfo("mix input %d: %s:%s, gain: %0.1lfdB", index, input.source.c_str(), input.arg.c_str(), input.gain_db);
+    }
+    audio_mixer_->AddCallback(std::bind(&PushWork::PcmCallback, this, std::placeholders::_1,
+                                        std::placeholders::_2));
+    if(audio_mixer_->Start() != RET_OK) {
+        LogError("AudioMixer Start failed");
+        return RET_FAIL;
+    }
+    for(size_t i = 0; i < mix_capturers_.size(); i++) {
+        if(mix_capturers_[i]->Start() != RET_OK) {
+            LogError("mix input %d Start failed", (int)i + 1);
+            return RET_FAIL;
+        }
+    }
+    return RET_OK;
+}
+
+/**
+ * @brief 初始化画中画合成并启动各个叠加源。image一次读入yuv420p(文件更大时后面紧跟源大小的alpha平面，即yuva420p)，
+ *          其它的叠加源各用一个VideoCapturer按主画面的帧率采集，在采集线程缩放后交给合成。
+ * @return 成功 0，失败 other。
+ */
+RET_CODE PushWork::initCompositor()
+{
+    video_compositor_ = new VideoCompositor();
+    if(video_compositor_->Init(desktop_width_, desktop_height_, video_overlays_) != RET_OK) {
+        LogError("VideoCompositor Init failed");
+        return RET_FAIL;
+    }
+    for(size_t i = 0; i < video_overlays_.size(); i++) {
+        const VideoOverlay &overlay = video_overlays_[i];
+        int index = (int)i;
+        int plane = overlay.src_width * overlay.src_height;
+        if(overlay.source == "image") {
+            std::vector<uint8_t> image(plane * 5 / 2);
+            FILE *fp = fopen(overlay.arg.c_str(), "rb");
+            size_t size = fp ? fread(&image[0], 1, image.size(), fp) : 0;
+            if(fp) {
+                fclose(fp);
+            }
+            if(size != (size_t)plane * 3 / 2 && size != image.size()) {
+                LogError("overlay image %s is not a %dx%d yuv420p or yuva420p frame", overlay.arg.c_str(),
+                         overlay.src_width, overlay.src_height);
+                return RET_FAIL;
+            }
+            video_compositor_->SetOverlayFrame(index, &image[0], size == image.size() ? &image[plane * 3 / 2] : NULL);
+            continue;
+        }
+        VideoCapturer *capturer = new VideoCapturer();
+        overlay_capturers_.push_back(capturer);
+        Properties cap_properties;
+        cap_properties.SetProperty("width", overlay.src_width);
+        cap_properties.SetProperty("height", overlay.src_height);
+        cap_properties.SetProperty("fps", desktop_fps_);
+        cap_properties.SetProperty("source", overlay.source);
+        cap_properties.SetProperty("input_yuv_name", overlay.arg);
+        cap_properties.SetProperty("pattern", overlay.arg);
+        cap_properties.SetProperty("shm_name", overlay.arg);
+        cap_properties.SetProperty("counter", 0);
+        if(capturer->Init(cap_properties) != RET_OK) {
+            LogError("overlay %s:%s Init failed", overlay.source.c_str(), overlay.arg.c_str());
+            return RET_FAIL;
+        }
+        VideoCompositor *compositor = video_compositor_;
+        capturer->AddCallback([compositor, index](uint8_t *yuv, int32_t) {
+            compositor->SetOverlayFrame(index, yuv, NULL);
+        });
+        if(capturer->Start() != RET_OK) {
+            LogError("overlay %s:%s Start failed", overlay.source.c_str(), overlay.arg.c_str());
+            return RET_FAIL;
+        }
+    }
+    pre_compositor_stats_time_ = TimesUtil::GetTimeMillisecond();
+    return RET_OK;
+}
+
+/**
+ * @brief 创建rtsp推流器并连接服务器。
+ * @param suffix 附加在rtsp_url_与磁盘溢出文件名后面的后缀，""表示主流，只有主流开启热备连接与运行指标。
+ * @param video_ctx 视频编码器上下文，转推时是由输入流参数构造的上下文，time_base为1/帧率。
+ * @param audio_ctx 音频编码器上下文，NULL表示没有音频。
+ * @param video_bitrate 视频码率，用于发送平滑。
+ * @return 成功返回推流器，失败返回NULL。
+ */
+RtspPusher *PushWork::createPusher(const std::string &suffix, const AVCodecContext *video_ctx,
+                                   const AVCodecContext *audio_ctx, int video_bitrate)
+{
+    RtspPusher *rtsp_pusher = new RtspPusher(msg_queue_);
+    if(!rtsp_pusher) {
+        LogError("new RTSPPusher() failed");
+        return NULL;
+    }
+    bool primary = suffix.empty();
+    Properties  rtsp_properties;
+    rtsp_properties.SetProperty("url", rtsp_url_ + suffix);
+    rtsp_properties.SetProperty("timeout", rtsp_timeout_);
+    rtsp_properties.SetProperty("rtsp_transport", rtsp_transport_);
+    rtsp_properties.SetProperty("max_queue_duration", rtsp_max_queue_duration_);
+    rtsp_properties.SetProperty("pacing_enable", rtsp_pacing_enable_);
+    rtsp_properties.SetProperty("pacing_multiple", rtsp_pacing_multiple_);
+    rtsp_properties.SetProperty("pacing_max_delay", rtsp_pacing_max_delay_);
+    rtsp_properties.SetProperty("audio_bitrate", audio_bitrate_);
+    rtsp_properties.SetProperty("video_bitrate", video_bitrate);
+    rtsp_properties.SetProperty("spill_enable", rtsp_spill_enable_);
+    rtsp_properties.SetProperty("spill_file", rtsp_spill_file_ + suffix);
+    rtsp_properties.SetProperty("spill_file_size_mb", rtsp_spill_file_size_mb_);
+    rtsp_properties.SetProperty("spill_memory_threshold_kb", rtsp_spill_memory_threshold_kb_);
+    rtsp_properties.SetProperty("spill_catchup_percent", rtsp_spill_catchup_percent_);
+    if(primary) {                                   // 热备连接只用于主流
+        rtsp_properties.SetProperty("standby_url", rtsp_standby_url_);
+    }
+    rtsp_properties.SetProperty("standby_keepalive_interval", rtsp_standby_keepalive_interval_);
+    rtsp_properties.SetProperty("failover_stall_time", rtsp_failover_stall_time_);
+    if(audio_ctx) {
+        rtsp_properties.SetProperty("audio_frame_duration", audio_ctx->frame_size*1000/audio_ctx->sample_rate);      // 设置音频一帧的时长
+    }
+    if(video_ctx) {
+        rtsp_properties.SetProperty("video_frame_duration", 1000*video_ctx->time_base.num/video_ctx->time_base.den);  // 设置视频一帧的时长
+    }
+
+    if(rtsp_pusher->Init(rtsp_properties) != RET_OK) {// 里面主要是分配AVFormatContext。
+        LogError("rtsp_pusher->Init failed");
+        delete rtsp_pusher;
+        return NULL;
+    }
+    if(metrics_ && primary) {                       // 指标只统计主流
+        rtsp_pusher->SetMetrics(metrics_);
+    }
+
+    // 创建音频流、音视频流
+    if(video_ctx) {
+        if(rtsp_pusher->ConfigVideoStream(video_ctx) != RET_OK) {
+            LogError("rtsp_pusher ConfigVideoSteam failed");
+            delete rtsp_pusher;
+            return NULL;
+        }
+    }
+    if(audio_ctx) {
+        if(rtsp_pusher->ConfigAudioStream(audio_ctx) != RET_OK) {
+            LogError("rtsp_pusher ConfigAudioStream failed");
+            delete rtsp_pusher;
+            return NULL;
+        }
+    }
+    if(rtsp_pusher->Connect() != RET_OK) {// 这里连接服务器后，rtsp推流器会开启一个线程，不断从packet_queue取数据，没数据时会休眠
+        LogError("rtsp_pusher Connect() failed");
+        delete rtsp_pusher;
+        return NULL;
+    }
+    return rtsp_pusher;
+}
+
 /**
  * @brief 回收音视频采集器。DeInit目前这样写并没意义并且暂未被调用，后续可以将析构的内容弄到这里。
  * @return no mean.
@@ -300,32 +992,34 @@ RET_CODE PushWork::DeInit()
         delete audio_capturer_;
         audio_capturer_ = NULL;
     }
+    for(size_t i = 0; i < mix_capturers_.size(); i++) {
+        mix_capturers_[i]->Stop();
+        delete mix_capturers_[i];
+    }
+    mix_capturers_.clear();
+    if(audio_mixer_) {
+        audio_mixer_->Stop();
+        delete audio_mixer_;
+        audio_mixer_ = NULL;
+    }
     if(video_capturer_){
         video_capturer_->Stop();
         delete video_capturer_;
         video_capturer_ = NULL;
     }
-    return RET_OK;
-}
-
-/**
- * @brief 只支持2通道 s16交错模式 -> float planar格式。
- * @param s16le s16的pcm数据。
- * @param fltp 输出参数，转换fltp32后的输出缓冲区。
- * @param nb_samples 采样点个数。
- * @return void。
- */
-void s16le_convert_to_fltp(short *s16le, float *fltp, int nb_samples) {
-    float *fltp_l = fltp;   // -1~1
-    float *fltp_r = fltp + nb_samples;
-    for(int i = 0; i < nb_samples; i++) {
-        fltp_l[i] = s16le[i*2] / 32768.0;     // 0 2 4，除以32768的原因是：需要将s16两字节的内容转成浮点数比例，有符号的两字节是：0x7fff=32767,0~32767共32768个，故除以它。
-        fltp_r[i] = s16le[i*2+1] / 32768.0;   // 1 3 5
+    for(size_t i = 0; i < overlay_capturers_.size(); i++) {
+        overlay_capturers_[i]->Stop();
+        delete overlay_capturers_[i];
+    }
+    overlay_capturers_.clear();
+    if(demux_source_) {
+        demux_source_->Stop();                  // 输出还在使用它的上下文，析构时再释放
     }
+    return RET_OK;
 }
 
 /**
- * @brief 音频回调，将读取出来的s16数据转成fltp32，并编码成aac后push到packet_queue队列中。
+ * @brief 音频回调，将读取出来的s16数据转成编码器需要的格式，并编码成aac或者opus后push到packet_queue队列中。
  * @param pcm 读出来的pcm数据。
  * @param size pcm数据的大小。
  * @return void。
@@ -344,21 +1038,35 @@ void PushWork::PcmCallback(uint8_t *pcm, int32_t size)
         fflush(pcm_s16le_fp_);// 冲刷文件描述符
     }
 
+    // 持续静音时跳过转换与编码，时间戳仍然要累加，这样静音之后发送的帧时间戳是连续的
+    if(silence_detector_) {
+        SilenceAction action = silence_detector_->Process((int16_t *)pcm, audio_frame_->nb_samples * audio_frame_->channels);
+        logSilenceStats();
+        if(SILENCE_SKIP == action) {
+            AVPublishTime::GetInstance()->get_audio_pts();
+            return;
+        }
+    }
+    int64_t encode_begin = TimesUtil::GetTimeMicrosecond();
+
     // 这里就约定好，音频捕获的时候，采样点数和编码器需要的点数是一样的
-    s16le_convert_to_fltp((short *)pcm, (float *)fltp_buf_, audio_frame_->nb_samples);
+    if(AudioConvertS16((int16_t *)pcm, audio_frame_->nb_samples, audio_frame_->channels,
+                       (AVSampleFormat)audio_frame_->format, audio_buf_) != RET_OK) {
+        return;
+    }
     ret = av_frame_make_writable(audio_frame_);
     if(ret < 0) {
         LogError("av_frame_make_writable failed");
         return;
     }
-    // 将fltp_buf_写入frame
+    // 将audio_buf_写入frame，audio_buf_是紧凑存放的，所以按1字节对齐
     ret = av_samples_fill_arrays(audio_frame_->data,
                                  audio_frame_->linesize,
-                                 fltp_buf_,
+                                 audio_buf_,
                                  audio_frame_->channels,
                                  audio_frame_->nb_samples,
                                  (AVSampleFormat)audio_frame_->format,
-                                 0);
+                                 1);
     if(ret < 0) {
         LogError("av_samples_fill_arrays failed");
         return;
@@ -369,8 +1077,14 @@ void PushWork::PcmCallback(uint8_t *pcm, int32_t size)
     int pkt_frame = 0;
     RET_CODE encode_ret = RET_OK;
     AVPacket *packet = audio_encoder_->Encode(audio_frame_, pts, 0, &pkt_frame, &encode_ret);// 他这里打时间戳pts是帧间隔+系统时间去打。当误差过大就会使用系统时间
-    // dump编码后的音频数据，方便出问题时排查
-    if(encode_ret == RET_OK && packet) {
+    audio_encode_time_ += TimesUtil::GetTimeMicrosecond() - encode_begin;
+    audio_encode_count_++;
+    if(packet) {
+        audio_encode_bytes_ += packet->size;
+    }
+    logAudioEncodeStats();
+    // dump编码后的音频数据，方便出问题时排查，opus没有adts这样的自同步头，不dump
+    if(encode_ret == RET_OK && packet && AV_CODEC_ID_AAC == audio_encoder_->GetCodecId()) {
         if(!aac_fp_) {
             aac_fp_ = fopen("push_dump.aac", "wb");
             if(!aac_fp_) {
@@ -380,7 +1094,7 @@ void PushWork::PcmCallback(uint8_t *pcm, int32_t size)
         }
         if(aac_fp_) {
             uint8_t adts_header[7];
-            if(audio_encoder_->GetAdtsHeader(adts_header, packet->size) != RET_OK) {
+            if(static_cast<AACEncoder *>(audio_encoder_)->GetAdtsHeader(adts_header, packet->size) != RET_OK) {
                 LogError("GetAdtsHeader failed");
                 return;
             }
@@ -393,12 +1107,163 @@ void PushWork::PcmCallback(uint8_t *pcm, int32_t size)
     //    LogInfo("PcmCallback pts: %ld", pts);
     if(packet) {
     //    LogInfo("PcmCallback packet->pts: %ld", packet->pts);
-        rtsp_pusher_->Push(packet, E_AUDIO_TYPE);
+        dispatchPacket(packet, E_AUDIO_TYPE);
     }else {
         LogInfo("audio_encoder_ packet is null");
     }
 }
 
+/**
+ * @brief 每10秒打印一次音频编码的cpu耗时(转换+编码，按每个通道每秒音频计算)与算法延时，用于对比aac与opus。
+ * @return void。
+ */
+void PushWork::logAudioEncodeStats()
+{
+    int frames_10s = audio_encoder_->GetSampleRate() * 10 / audio_encoder_->GetFrameSamples();
+    if(audio_encode_count_ % frames_10s != 0) {
+        return;
+    }
+    double seconds = (double)audio_encode_count_ * audio_encoder_->GetFrameSamples() / audio_encoder_->GetSampleRate();
+    LogInfo("audio encode: codec-%s, frames-%lld, cpu-%0.2lfms/s per channel, bitrate-%0.1lfkbps, algorithmic delay-%0.1lfms",
+            audio_codec_.c_str(), audio_encode_count_,
+            audio_encode_time_ / 1000.0 / seconds / audio_encoder_->GetChannels(),
+            audio_encode_bytes_ * 8 / 1000.0 / seconds, audio_encoder_->GetAlgorithmicDelay());
+}
+
+/**
+ * @brief 每10秒打印一次静音检测的统计，节省的cpu与码率按编码帧的平均耗时、平均大小乘以跳过的帧数估算。
+ * @return void。
+ */
+void PushWork::logSilenceStats()
+{
+    SilenceStats stats;
+    silence_detector_->GetStats(&stats);
+    int frames_10s = audio_encoder_->GetSampleRate() * 10 / audio_encoder_->GetFrameSamples();
+    if(stats.frames % frames_10s != 0 || audio_encode_count_ == 0) {
+        return;
+    }
+    double seconds = (double)stats.frames * audio_encoder_->GetFrameSamples() / audio_encoder_->GetSampleRate();
+    double saved_cpu = (double)audio_encode_time_ / audio_encode_count_ * stats.skipped_frames / 1000.0 / seconds;
+    double saved_kbps = (double)audio_encode_bytes_ / audio_encode_count_ * stats.skipped_frames * 8 / 1000.0 / seconds;
+    LogInfo("silence: level-%0.1lfdBFS, frames-%lld, skipped-%lld(%0.1lf%%), comfort-%lld, periods-%lld, "
+            "saved cpu-%0.2lfms/s, saved bitrate-%0.1lfkbps",
+            stats.last_level, stats.frames, stats.skipped_frames, stats.skipped_frames * 100.0 / stats.frames,
+            stats.comfort_frames, stats.silent_periods, saved_cpu, saved_kbps);
+}
+
+/**
+ * @brief 每10秒打印一次静止画面检测的统计，节省的cpu按编码帧的平均耗时乘以跳过的帧数估算。
+ * @return void。
+ */
+void PushWork::logSceneStats()
+{
+    SceneStats stats;
+    scene_detector_->GetStats(&stats);
+    if(video_fps_ <= 0 || stats.frames % (video_fps_ * 10) != 0 || video_encode_count_ == 0) {
+        return;
+    }
+    double seconds = (double)stats.frames / video_fps_;
+    double saved_cpu = (double)video_encode_time_ / video_encode_count_ * stats.skipped_frames / 1000.0 / seconds;
+    LogInfo("static scene: frames-%lld, skipped-%lld(%0.1lf%%), static-%lld, periods-%lld, changed blocks-%d, "
+            "detect-%0.1lfus/frame, encode-%0.2lfms/frame, saved cpu-%0.2lfms/s",
+            stats.frames, stats.skipped_frames, stats.skipped_frames * 100.0 / stats.frames, stats.static_frames,
+            stats.static_periods, stats.last_changed_blocks, (double)stats.detect_time / stats.frames,
+            (double)video_encode_time_ / video_encode_count_ / 1000.0, saved_cpu);
+}
+
+/**
+ * @brief 每10秒打印一次画中画合成的耗时，合成在编码线程，平均耗时直接增加每帧的编码延时。
+ * @return void。
+ */
+void PushWork::logCompositorStats()
+{
+    int64_t now = TimesUtil::GetTimeMillisecond();
+    if(now - pre_compositor_stats_time_ < 10000) {
+        return;
+    }
+    pre_compositor_stats_time_ = now;
+    VideoCompositorStats stats;
+    video_compositor_->GetStats(&stats);
+    if(stats.frames == 0) {
+        return;
+    }
+    LogInfo("compositor: %d overlays, frames-%lld, compose avg-%0.1lfus, max-%lldus, overlay frames-%lld, scale avg-%0.1lfus",
+            video_compositor_->GetOverlayCount(), stats.frames, (double)stats.compose_time / stats.frames,
+            stats.max_compose_time, stats.overlay_frames,
+            stats.overlay_frames > 0 ? (double)stats.scale_time / stats.overlay_frames : 0);
+}
+
+/**
+ * @brief 每10秒打印一次各层的统计与进程的cpu占用，cpu占用是所有线程之和，100%表示一个核。
+ * @return void。
+ */
+void PushWork::logSimulcastStats()
+{
+    if(video_fps_ <= 0 || simulcast_frames_ % (video_fps_ * 10) != 0) {
+        return;
+    }
+    int64_t cpu_time = TimesUtil::GetProcessCpuMicrosecond();
+    int64_t now = TimesUtil::GetTimeMicrosecond();
+    double cpu_percent = now > pre_cpu_wall_time_ ? (cpu_time - pre_cpu_time_) * 100.0 / (now - pre_cpu_wall_time_) : 0;
+    pre_cpu_time_ = cpu_time;
+    pre_cpu_wall_time_ = now;
+    LogInfo("simulcast: layers-%d, process cpu-%0.1lf%%, main encode-%0.2lfms/frame, scale-%0.2lfms/frame",
+            (int)simulcast_layers_.size(), cpu_percent,
+            video_encode_count_ > 0 ? (double)video_encode_time_ / video_encode_count_ / 1000.0 : 0,
+            (double)scale_cascade_->GetScaleTime() / simulcast_frames_ / 1000.0);
+    for(size_t i = 0; i < simulcast_layers_.size(); i++) {
+        SimulcastLayerStats stats;
+        simulcast_layers_[i]->GetStats(&stats);
+        LogInfo("layer %dx%d: frames-%lld, encoded-%lld, dropped-%lld, encode-%0.2lfms/frame, bitrate-%0.1lfkbps",
+                simulcast_layers_[i]->GetWidth(), simulcast_layers_[i]->GetHeight(), stats.frames,
+                stats.encoded_frames, stats.dropped_frames,
+                stats.encoded_frames > 0 ? (double)stats.encode_time / stats.encoded_frames / 1000.0 : 0,
+                stats.encoded_bytes * 8 / 1000.0 / ((double)stats.frames / video_fps_));
+    }
+}
+
+/**
+ * @brief 每10秒打印一次编码调节器的统计。
+ * @return void。
+ */
+void PushWork::logGovernorStats()
+{
+    GovernorStats stats;
+    encode_governor_->GetStats(&stats);
+    if(video_fps_ <= 0 || stats.frames % (video_fps_ * 10) != 0) {
+        return;
+    }
+    LogInfo("encode governor: level-%d, load-%d%%, frames-%lld, encoded-%lld, skipped-%lld, dropped-%lld, changes-%lld",
+            stats.level, stats.load, stats.frames, stats.encoded_frames, stats.skipped_frames, stats.dropped_frames,
+            stats.level_changes);
+}
+
+/**
+ * @brief 每10秒打印一次编码质量监测的平均PSNR/SSIM，同时可以对照调节器的级别与码率看画质的变化。
+ * @return void。
+ */
+void PushWork::logQualityStats()
+{
+    int64_t now = TimesUtil::GetTimeMillisecond();
+    if(now - pre_quality_stats_time_ < 10000) {
+        return;
+    }
+    pre_quality_stats_time_ = now;
+    QualityStats stats;
+    quality_monitor_->GetStats(&stats);
+    if(stats.samples == 0) {
+        LogInfo("quality: no samples, dropped-%lld, lost-%lld, resyncs-%lld", stats.dropped_samples,
+                stats.lost_samples, stats.resyncs);
+        return;
+    }
+    LogInfo("quality: samples-%lld, psnr avg-%0.2lfdB(y-%0.2lf), min-%0.2lfdB, ssim avg-%0.4lf, min-%0.4lf, "
+            "dropped-%lld, lost-%lld, resyncs-%lld, decode avg-%0.1lfus, compare avg-%0.1lfus",
+            stats.samples, stats.psnr_sum / stats.samples, stats.psnr_y_sum / stats.samples, stats.min_psnr,
+            stats.ssim_sum / stats.samples, stats.min_ssim, stats.dropped_samples, stats.lost_samples, stats.resyncs,
+            stats.decoded_frames > 0 ? (double)stats.decode_time / stats.decoded_frames : 0,
+            (double)stats.compare_time / stats.samples);
+}
+
 /**
  * @brief 视频回调，将读取出来的yuv数据编码成h264后，push到packet_queue队列中。
  * @param yuv 读出来的yuv数据。
@@ -407,6 +1272,15 @@ void PushWork::PcmCallback(uint8_t *pcm, int32_t size)
  */
 void PushWork::YuvCallback(uint8_t *yuv, int32_t size)
 {
+    // 画中画合成放在最前面，录制、静止画面检测、多分辨率层与编码看到的都是合成后的画面
+    if(video_compositor_) {
+        video_compositor_->Compose(yuv);
+        logCompositorStats();
+    }
+    // 时间码画在叠加层的上面，时间取采集回调的墙上时钟，接收端解码后与自己的时钟相减就是端到端延时
+    if(timecode_stamper_) {
+        timecode_stamper_->Stamp(yuv, TimesUtil::GetTimeMillisecond());
+    }
     // yuv视频数据不需要类似音频s16转fltp的做法，直接编码即可。
     if(!yuv_fp_)
     {
@@ -422,10 +1296,48 @@ void PushWork::YuvCallback(uint8_t *yuv, int32_t size)
 
     // LogInfo("YuvCallback size: %d", size);
     int64_t pts = (int64_t)AVPublishTime::GetInstance()->get_video_pts();
+    if(scene_detector_) {
+        SceneAction action = scene_detector_->Process(yuv, video_width_);
+        logSceneStats();
+        if(SCENE_SKIP == action) {
+            return;                                 // 时间戳已经累加，接收端继续显示上一帧
+        }
+        int qp_offset = SCENE_STATIC == action ? video_static_qp_offset_ : 0;
+        if(encode_governor_) {
+            encode_governor_->SetQpOffset(qp_offset);  // 降级时实际编码的是另外的编码器
+        } else {
+            video_encoder_->SetQpOffset(qp_offset);
+        }
+    }
+    // 先把缩放后的帧交给各层的编码线程，与下面主流的编码并行
+    if(scale_cascade_) {
+        scale_cascade_->Scale(yuv);
+        for(size_t i = 0; i < simulcast_layers_.size(); i++) {
+            simulcast_layers_[i]->Submit(scale_cascade_->GetFrame(i), pts);
+        }
+        simulcast_frames_++;
+        logSimulcastStats();
+    }
+    if(encode_governor_) {
+        bool admit = encode_governor_->Admit();
+        logGovernorStats();
+        if(!admit) {
+            return;                                 // cpu不够，时间戳已经累加
+        }
+    }
+    if(quality_monitor_) {
+        quality_monitor_->Sample(yuv, pts);     // 只采样真正送去编码的帧
+    }
     int pkt_frame = 0;
     RET_CODE encode_ret = RET_OK;
-    AVPacket *packet = video_encoder_->Encode(yuv, size, pts,  &pkt_frame, &encode_ret);
+    int64_t encode_begin = TimesUtil::GetTimeMicrosecond();
+    AVPacket *packet = encode_governor_ ? encode_governor_->Encode(yuv, size, pts, &pkt_frame, &encode_ret)
+                                        : video_encoder_->Encode(yuv, size, pts,  &pkt_frame, &encode_ret);
+    video_encode_time_ += TimesUtil::GetTimeMicrosecond() - encode_begin;
+    video_encode_count_++;
     if(encode_ret == RET_OK && packet) {
+        // 降级时这一帧是由调控器的另外的编码器编出来的，sps、pps与帧大小统计都要用它的
+        H264Encoder *encoder = encode_governor_ ? encode_governor_->GetCurrentEncoder() : video_encoder_;
         if(!h264_fp_) {
             h264_fp_ = fopen("push_dump.h264", "wb");
             if(!h264_fp_) {
@@ -435,13 +1347,23 @@ void PushWork::YuvCallback(uint8_t *yuv, int32_t size)
             // 写入sps 和 pps(只需要开头写一次)
             uint8_t start_code[] = {0, 0, 0, 1};
             fwrite(start_code, 1, 4, h264_fp_);
-            fwrite(video_encoder_->get_sps_data(), 1, video_encoder_->get_sps_size(), h264_fp_);
+            fwrite(encoder->get_sps_data(), 1, encoder->get_sps_size(), h264_fp_);
             fwrite(start_code, 1, 4, h264_fp_);
-            fwrite(video_encoder_->get_pps_data(), 1, video_encoder_->get_pps_size(), h264_fp_);
+            fwrite(encoder->get_pps_data(), 1, encoder->get_pps_size(), h264_fp_);
         }
 
         fwrite(packet->data, 1,  packet->size, h264_fp_);
         fflush(h264_fp_);
+
+        // 每10秒打印一次帧大小的统计，峰均比反映I帧造成的码率峰值
+        H264FrameSizeStats size_stats;
+        encoder->GetFrameSizeStats(&size_stats);
+        if(video_fps_ > 0 && size_stats.frames % (video_fps_ * 10) == 0) {
+            LogInfo("frame size: avg-%0.0lf, max-%d, min-%d, stddev-%0.0lf, peak/avg-%0.2lf, key-%lld/%lld",
+                    size_stats.mean, size_stats.max_size, size_stats.min_size, sqrt(size_stats.variance),
+                    size_stats.mean > 0 ? size_stats.max_size / size_stats.mean : 0,
+                    size_stats.key_frames, size_stats.frames);
+        }
     }else{
         LogError("============encode_ret: %d, size: %d==============", encode_ret, size);
     }
@@ -450,8 +1372,61 @@ void PushWork::YuvCallback(uint8_t *yuv, int32_t size)
     //    LogInfo("YuvCallback pts: %ld", pts);
     if(packet) {
     //    LogInfo("YuvCallback packet->pts: %ld", packet->pts);
-        rtsp_pusher_->Push(packet, E_VIDEO_TYPE);
+        if(quality_monitor_) {
+            quality_monitor_->Push(packet);     // 在推流器重定时间基之前引用，pts与Sample的相同
+            logQualityStats();
+        }
+        dispatchPacket(packet, E_VIDEO_TYPE);
     }else {
         LogInfo("video_encoder_ packet is null");
     }
 }
+
+/**
+ * @brief 转推回调，输入的包已经是H.264/AAC(Opus)，不经过编码直接交给各个输出。
+ * @param packet 重定基后的包，pts单位ms，接管。
+ * @param media_type 包类型。
+ * @return void。
+ */
+void PushWork::PacketCallback(AVPacket *packet, MediaType media_type)
+{
+    dispatchPacket(packet, media_type);
+}
+
+/**
+ * @brief 把一个编码后的包交给内嵌rtsp服务器、LL-HLS输出、各分辨率层的推流器(只有音频)和主推流器，并统计指标。
+ * @param packet 编码后的包，接管。
+ * @param media_type 包类型。
+ * @return void。
+ */
+void PushWork::dispatchPacket(AVPacket *packet, MediaType media_type)
+{
+    if(metrics_) {
+        if(E_VIDEO_TYPE == media_type) {
+            PublishMetrics::Add(metrics_->video_encoded_frames_, 1);
+            PublishMetrics::Add(metrics_->video_encoded_bytes_, packet->size);
+        } else {
+            PublishMetrics::Add(metrics_->audio_encoded_frames_, 1);
+            PublishMetrics::Add(metrics_->audio_encoded_bytes_, packet->size);
+        }
+    }
+    if(rtsp_server_) {
+        rtsp_server_->Push(packet, media_type);         // 不接管packet
+    }
+    if(hls_sink_) {
+        hls_sink_->Push(packet, media_type);            // 不接管packet
+    }
+    if(E_AUDIO_TYPE == media_type) {
+        for(size_t i = 0; i < simulcast_pushers_.size(); i++) {
+            AVPacket *layer_packet = av_packet_clone(packet);       // 各层共用同一份编码后的音频，只增加引用计数
+            if(layer_packet) {
+                simulcast_pushers_[i]->Push(layer_packet, E_AUDIO_TYPE);
+            }
+        }
+    }
+    if(rtsp_pusher_) {
+        rtsp_pusher_->Push(packet, media_type);
+    } else {
+        av_packet_free(&packet);
+    }
+}
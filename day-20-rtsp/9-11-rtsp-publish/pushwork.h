@@ -5,9 +5,24 @@
 #include "audiocapturer.h"
 #include "videocapturer.h"
 #include "aacencoder.h"
+#include "opusencoder.h"
 #include "h264encoder.h"
 #include "rtsppusher.h"
 #include "messagequeue.h"
+#include "publishmetrics.h"
+#include "httpserver.h"
+#include "hlssink.h"
+#include "rtspserver.h"
+#include "silencedetector.h"
+#include "staticscenedetector.h"
+#include "simulcast.h"
+#include "encodegovernor.h"
+#include "demuxsource.h"
+#include "audiomixer.h"
+#include "videocompositor.h"
+#include "timecode.h"
+#include "qualitymonitor.h"
+#include "instrument.h"
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libswresample/swresample.h>
@@ -25,29 +40,79 @@ public:
 private:
     void PcmCallback(uint8_t *pcm, int32_t size);
     void YuvCallback(uint8_t* yuv, int32_t size);
+    void PacketCallback(AVPacket *packet, MediaType media_type);   // 转推，包不经过编码
 private:
+    RET_CODE initEncoders();
+    RET_CODE initCapturers();
+    RET_CODE initMixer();
+    RET_CODE initCompositor();
+    void dispatchPacket(AVPacket *packet, MediaType media_type);   // 把编码后的包交给各个输出，接管packet
+    void logSilenceStats();                                     // 定时打印静音检测的统计
+    void logSceneStats();                                       // 定时打印静止画面检测的统计
+    void logSimulcastStats();                                   // 定时打印多分辨率层的统计与进程cpu占用
+    void logAudioEncodeStats();                                 // 定时打印音频编码的cpu与算法延时
+    void logGovernorStats();                                    // 定时打印编码调节器的统计
+    void logCompositorStats();                                  // 定时打印画中画合成的耗时
+    void logQualityStats();                                     // 定时打印编码质量监测的PSNR/SSIM
+    RtspPusher *createPusher(const std::string &suffix, const AVCodecContext *video_ctx,
+                             const AVCodecContext *audio_ctx, int video_bitrate);
+
     AudioCapturer *audio_capturer_ = NULL;
     // 音频test模式
     int audio_test_         = 0;
     std::string input_pcm_name_;
-    uint8_t *fltp_buf_      = NULL;
-    int fltp_buf_size_      = 0;
+    std::string audio_source_;                                  // file 读pcm文件，pattern 合成测试音频，shm 共享内存
+    std::string audio_pattern_;
+    std::string audio_shm_name_;                                // audio_source_为shm时的共享内存名字
+    int audio_pattern_frequency_ = 1000;
+    uint8_t *audio_buf_     = NULL;                             // s16转换成编码器采样格式后的缓存
+    int audio_buf_size_     = 0;
     // 麦克风采样属性
     int mic_sample_rate_    = 48000;
     int mic_sample_fmt_     = AV_SAMPLE_FMT_S16;
     int mic_channels_       = 2;
 
-    AACEncoder *audio_encoder_;
+    // 混音：audio_mix_inputs_不为空时麦克风与这些输入混成一路再编码，详看AudioMixer
+    std::string audio_mix_inputs_str_;
+    std::vector<MixInput> audio_mix_inputs_;
+    int audio_mix_mic_gain_db_      = 0;
+    std::string audio_mix_mode_     = "float";                  // float或者s16
+    int audio_mix_delay_            = 50;
+    int audio_mix_tolerance_        = 20;
+    int audio_mix_fade_ms_          = 20;
+    AudioMixer *audio_mixer_        = NULL;
+    std::vector<AudioCapturer *> mix_capturers_;                // 麦克风之外的输入，第i个是混音的第i+1路
+
+    AudioEncoder *audio_encoder_ = NULL;
     // 音频编码参数
+    std::string audio_codec_        = "aac";                    // aac或者opus
+    int audio_frame_duration_       = 20;                       // opus的帧长，单位ms，10或者20，aac固定1024个样本
+    std::string audio_opus_application_ = "lowdelay";
     int audio_sample_rate_  = AV_SAMPLE_FMT_S16;
     int audio_bitrate_      = 128*1024;                         // 码率128k，刚好128*8=1024=1M带宽
     int audio_channels_     = 2;
     int audio_sample_fmt_ ;                                     // 具体由编码器决定，从编码器读取相应的信息
     int audio_ch_layout_;                                       // 由audio_channels_决定
 
+    // 音频不连续传输(DTX)，持续静音时跳过转换与编码，详看SilenceDetector
+    int audio_dtx_enable_               = 0;
+    int audio_silence_threshold_db_     = -50;
+    int audio_silence_hangover_ms_      = 300;
+    int audio_comfort_interval_ms_      = 500;
+    SilenceDetector *silence_detector_  = NULL;
+    int64_t audio_encode_time_          = 0;                    // 转换+编码累计耗时，单位us，用于估算静音节省的cpu
+    int64_t audio_encode_count_         = 0;
+    int64_t audio_encode_bytes_         = 0;
+
     // 视频test模式
     int video_test_ = 0;
     std::string input_yuv_name_;
+    std::string video_source_;                                  // file 读yuv文件，pattern 合成测试图像，shm 共享内存
+    std::string video_pattern_;
+    std::string video_shm_name_;                                // video_source_为shm时的共享内存名字
+    int video_pattern_noise_bits_ = -1;                         // -1 由pattern决定
+    int video_pattern_seed_ = 1;
+    int video_pattern_counter_ = 1;
 
     // 桌面录制属性
     int desktop_x_ = 0;
@@ -65,6 +130,61 @@ private:
     int video_gop_;
     int video_bitrate_;
     int video_b_frames_;                                        // b帧数量
+    int video_intra_refresh_ = 0;                               // 周期帧内刷新代替周期IDR
+    int video_slice_max_size_ = 0;                              // slice最大字节数，0不限制
+
+    // 静止画面检测，画面不动时跳过编码或者降低质量，详看StaticSceneDetector
+    int video_static_mode_              = 0;                    // 0关闭 1跳过编码 2提高qp
+    int video_static_block_threshold_   = 2;
+    int video_static_max_changed_blocks_ = 0;
+    int video_static_hangover_frames_   = 5;
+    int video_static_max_skip_frames_   = 25;
+    int video_static_qp_offset_         = 6;
+    StaticSceneDetector *scene_detector_ = NULL;
+    int64_t video_encode_time_          = 0;                    // 编码累计耗时，单位us，用于估算静止画面节省的cpu
+    int64_t video_encode_count_         = 0;
+
+    // 多分辨率同时推流(simulcast)，一次采集逐级缩放出多个分辨率层，每层独立编码线程与推流器，音频共用，详看SimulcastLayer
+    std::string video_layers_str_;                              // 例如"1280x720@1024,640x360@512"，""不开启
+    std::vector<VideoLayer> video_layers_;
+    ScaleCascade *scale_cascade_    = NULL;
+    std::vector<SimulcastLayer *> simulcast_layers_;
+    std::vector<RtspPusher *> simulcast_pushers_;
+    int64_t simulcast_frames_       = 0;
+    int64_t pre_cpu_time_           = 0;                        // 上次打印时的进程cpu时间，单位us
+    int64_t pre_cpu_wall_time_      = 0;
+
+    // 画中画，编码前把第二路摄像头、台标等叠加到主画面上，详看VideoCompositor
+    std::string video_overlays_str_;                            // 例如"pattern:noise:1280x720@1440,60,400x224"，""不开启
+    std::vector<VideoOverlay> video_overlays_;
+    VideoCompositor *video_compositor_ = NULL;
+    std::vector<VideoCapturer *> overlay_capturers_;            // 每个非image的叠加层一个采集线程
+    int64_t pre_compositor_stats_time_ = 0;
+
+    // 烧录时间码，用于测量端到端延时，详看TimecodeStamper与tools/latencyanalyzer
+    int video_timecode_             = 0;
+    TimecodeStamper *timecode_stamper_ = NULL;
+
+    // 编码质量监测，抽样解码主流计算PSNR/SSIM，详看QualityMonitor
+    int video_quality_interval_     = 0;                        // 每N帧采样一帧，0不开启
+    int video_quality_max_pending_  = 4;
+    int video_quality_max_cpu_      = 20;
+    QualityMonitor *quality_monitor_ = NULL;
+    int64_t pre_quality_stats_time_ = 0;
+
+#ifdef PUSH_INSTRUMENT
+    // 分配与锁竞争的统计，只在CONFIG+=instrument编译时存在，详看instrument.h
+    InstrumentReporter *instrument_reporter_ = NULL;
+#endif
+
+    // 编码cpu过载调节，编码跟不上采集时逐级降preset、帧率、分辨率，最后丢帧，详看EncodeGovernor。只调节主流
+    int video_governor_enable_      = 0;
+    std::string video_governor_fast_preset_;
+    int video_governor_high_load_   = 85;
+    int video_governor_low_load_    = 50;
+    int video_governor_up_hold_ms_  = 5000;
+    int video_governor_max_level_   = GOVERNOR_DROP;
+    EncodeGovernor *encode_governor_ = NULL;
 
     // 视频相关
     VideoCapturer *video_capturer_  = NULL;
@@ -82,8 +202,50 @@ private:
     std::string rtsp_transport_     = "";
     int rtsp_timeout_               = 5000;
     int rtsp_max_queue_duration_    = 500;
+    int rtsp_pacing_enable_         = 0;                        // 发送平滑，详看SendPacer
+    int rtsp_pacing_multiple_       = 150;
+    int rtsp_pacing_max_delay_      = 500;
+    int rtsp_spill_enable_          = 0;                        // 磁盘溢出缓存，详看PacketSpiller
+    std::string rtsp_spill_file_;
+    int rtsp_spill_file_size_mb_    = 256;
+    int rtsp_spill_memory_threshold_kb_ = 4096;
+    int rtsp_spill_catchup_percent_ = 200;
+    std::string rtsp_standby_url_;                              // 热备连接，详看RtspStandby
+    int rtsp_standby_keepalive_interval_ = 1000;
+    int rtsp_failover_stall_time_   = 1000;
     RtspPusher *rtsp_pusher_        = NULL;
+
+    // 内嵌rtsp服务器，rtsp_server_port_大于0时开启，详看RtspServer
+    int rtsp_server_port_           = 0;
+    std::string rtsp_server_path_   = "live";
+    int rtsp_server_rtp_port_       = 30000;
+    int rtsp_server_max_clients_    = 64;
+    RtspServer *rtsp_server_        = NULL;
     MessageQueue *msg_queue_        = NULL;
+
+    // 运行指标，metrics_port_大于0时通过http输出prometheus格式的指标，例如 curl http://127.0.0.1:9100/metrics
+    int metrics_port_               = 0;
+    std::string metrics_ip_         = "127.0.0.1";
+    std::string session_name_       = "default";                // 指标中session标签的值
+    PublishMetrics *metrics_        = NULL;
+    MetricsExporter *metrics_exporter_ = NULL;
+    HttpServer *http_server_        = NULL;
+
+    // LL-HLS输出，hls_enable_为1时开启，http与指标共用端口，没有指标端口时使用hls_http_port_，详看HlsSink
+    int hls_enable_                 = 0;
+    std::string hls_dir_;
+    int hls_part_duration_          = 200;
+    int hls_segment_duration_       = 2000;
+    int hls_window_                 = 6;
+    int hls_http_port_              = 0;
+    HlsSink *hls_sink_              = NULL;
+
+    // 转推已经编码的输入(mp4/ts文件或者摄像头的rtsp流)，passthrough_url_不为空时代替采集与编码，详看DemuxSource
+    std::string passthrough_url_;
+    int passthrough_loop_           = 1;
+    int passthrough_realtime_       = -1;                       // -1 文件按时间戳节奏，网络输入读到就发
+    std::string passthrough_rtsp_transport_ = "tcp";
+    DemuxSource *demux_source_      = NULL;
 };
 
 #endif // PUSHWORK_H
@@ -0,0 +1,492 @@
+﻿#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include "qualitymonitor.h"
+#include "timesutil.h"
+#include "dlog.h"
+#if defined(__AVX2__)
+#define QUALITY_USE_AVX2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define QUALITY_USE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#define QUALITY_MAX_PSNR    100.0                       // 完全相同时的PSNR
+
+static double psnr(uint64_t sse, int64_t pixels)
+{
+    if(0 == sse) {
+        return QUALITY_MAX_PSNR;
+    }
+    double value = 10.0 * log10(255.0 * 255.0 * pixels / sse);
+    return value > QUALITY_MAX_PSNR ? QUALITY_MAX_PSNR : value;
+}
+
+// 与x264的ssim_end1相同，s1、s2、ss、s12是相邻2x2个4x4块(64个像素)的和
+static float ssimEnd(int s1, int s2, int ss, int s12)
+{
+    static const int c1 = (int)(.01 * .01 * 255 * 255 * 64 + .5);
+    static const int c2 = (int)(.03 * .03 * 255 * 255 * 64 * 63 + .5);
+    int vars = ss * 64 - s1 * s1 - s2 * s2;
+    int covar = s12 * 64 - s1 * s2;
+    return (float)(2 * s1 * s2 + c1) * (float)(2 * covar + c2)
+            / ((float)(s1 * s1 + s2 * s2 + c1) * (float)(vars + c2));
+}
+
+QualityMonitor::QualityMonitor()
+{
+    memset(&stats_, 0, sizeof(QualityStats));
+}
+
+QualityMonitor::~QualityMonitor()
+{
+    Stop();
+    while(!packets_.empty()) {
+        av_packet_free(&packets_.front());
+        packets_.pop_front();
+    }
+    if(decoder_) {
+        avcodec_free_context(&decoder_);
+    }
+    if(frame_) {
+        av_frame_free(&frame_);
+    }
+}
+
+/**
+ * @brief 打开解码器并分配采样帧的缓存。
+ * @param "interval"     每interval帧采样一帧，默认30
+ *        "max_pending"  最多同时等待解码的采样帧数，默认4
+ *        "max_packets"  包队列的上限，默认120
+ *        "max_cpu"      解码与计算最多占一个核的百分比，默认20
+ * @param encoder_ctx 主流编码器的上下文，用它的宽高、extradata(sps、pps)打开解码器。
+ * @return 成功 0 失败 other
+ */
+RET_CODE QualityMonitor::Init(const Properties &properties, AVCodecContext *encoder_ctx)
+{
+    width_          = encoder_ctx->width;
+    height_         = encoder_ctx->height;
+    interval_       = properties.GetProperty("interval", 30);
+    max_packets_    = properties.GetProperty("max_packets", 120);
+    max_cpu_        = properties.GetProperty("max_cpu", 20);
+    int max_pending = properties.GetProperty("max_pending", 4);
+    if(interval_ <= 0 || max_packets_ <= 0 || max_cpu_ <= 0 || max_pending <= 0) {
+        LogError("invalid interval: %d, max_packets: %d, max_cpu: %d or max_pending: %d",
+                 interval_, max_packets_, max_cpu_, max_pending);
+        return RET_ERR_NOT_SUPPORT;
+    }
+
+    AVCodec *codec = avcodec_find_decoder(encoder_ctx->codec_id);
+    decoder_ = avcodec_alloc_context3(codec);
+    AVCodecParameters *par = avcodec_parameters_alloc();
+    if(!codec || !decoder_ || !par || avcodec_parameters_from_context(par, encoder_ctx) < 0
+            || avcodec_parameters_to_context(decoder_, par) < 0) {
+        LogError("create %s decoder failed", avcodec_get_name(encoder_ctx->codec_id));
+        avcodec_parameters_free(&par);
+        return RET_FAIL;
+    }
+    avcodec_parameters_free(&par);
+    decoder_->thread_count = 1;                         // cpu预算按一个线程统计
+    if(avcodec_open2(decoder_, codec, NULL) < 0) {
+        LogError("open %s decoder failed", avcodec_get_name(encoder_ctx->codec_id));
+        return RET_FAIL;
+    }
+    frame_ = av_frame_alloc();
+    if(!frame_) {
+        LogError("av_frame_alloc failed");
+        return RET_ERR_OUTOFMEMORY;
+    }
+
+    samples_.resize(max_pending);
+    for(size_t i = 0; i < samples_.size(); i++) {
+        samples_[i].yuv.resize(width_ * height_ * 3 / 2);
+        samples_[i].pts = 0;
+        samples_[i].state = SAMPLE_FREE;
+    }
+    LogInfo("quality monitor: %dx%d, 1/%d frames, max_pending: %d, max_packets: %d, max_cpu: %d%%",
+            width_, height_, interval_, max_pending, max_packets_, max_cpu_);
+    return RET_OK;
+}
+
+void QualityMonitor::SetMetrics(PublishMetrics *metrics)
+{
+    metrics_ = metrics;
+}
+
+/**
+ * @brief 每interval帧拷贝一帧编码前的yuv，没有空闲的缓存或者解码器正在等关键帧时放弃这一次采样。
+ * @param pts 与传给编码器的pts相同，用于找到解码出的帧。
+ * @return void。
+ */
+void QualityMonitor::Sample(const uint8_t *yuv, int64_t pts)
+{
+    if(frames_++ % interval_ != 0) {
+        return;
+    }
+    QualitySample *sample = NULL;
+    {
+        std::lock_guard<PushMutex> lock(mutex_);
+        for(size_t i = 0; i < samples_.size() && !resyncing_; i++) {
+            if(SAMPLE_FREE == samples_[i].state) {
+                sample = &samples_[i];
+                sample->state = SAMPLE_FILLING;
+                break;
+            }
+        }
+        if(!sample) {
+            stats_.dropped_samples++;
+            if(metrics_) {
+                PublishMetrics::Add(metrics_->quality_lost_samples_, 1);
+            }
+            return;
+        }
+    }
+    memcpy(&sample->yuv[0], yuv, sample->yuv.size());  // 不持有锁，监测线程不会访问FILLING状态的缓存
+    std::lock_guard<PushMutex> lock(mutex_);
+    sample->pts = pts;
+    sample->state = SAMPLE_PENDING;
+}
+
+/**
+ * @brief 把主流编码后的包放进队列，队列满时清空，监测线程从下一个关键帧重新开始解码。
+ * @param packet 编码后的包，只增加引用计数，不接管。
+ * @return void。
+ */
+void QualityMonitor::Push(const AVPacket *packet)
+{
+    AVPacket *ref = av_packet_clone(packet);
+    if(!ref) {
+        return;
+    }
+    std::lock_guard<PushMutex> lock(mutex_);
+    if((int)packets_.size() >= max_packets_) {
+        while(!packets_.empty()) {
+            av_packet_free(&packets_.front());
+            packets_.pop_front();
+        }
+        flush_ = true;
+        resyncing_ = true;
+        stats_.resyncs++;
+    }
+    packets_.push_back(ref);
+    cond_.notify_one();
+}
+
+void QualityMonitor::Stop()
+{
+    {
+        std::lock_guard<PushMutex> lock(mutex_);
+        request_abort_ = true;
+        cond_.notify_one();
+    }
+    CommonLooper::Stop();
+}
+
+/**
+ * @brief 统计窗口(1秒)内的解码与计算耗时是否超过预算。
+ * @param now 单位us。
+ */
+bool QualityMonitor::overBudget(int64_t now)
+{
+    if(now - window_begin_ >= 1000000) {
+        window_begin_ = now;
+        window_busy_ = 0;
+    }
+    return window_busy_ > 10000LL * max_cpu_;
+}
+
+void QualityMonitor::Loop()
+{
+    LogInfo("quality monitor loop into");
+    while(true) {
+        AVPacket *packet = NULL;
+        {
+            std::unique_lock<PushMutex> lock(mutex_);
+            cond_.wait(lock, [this] { return request_abort_ || !packets_.empty(); });
+            if(request_abort_) {
+                break;
+            }
+            packet = packets_.front();
+            packets_.pop_front();
+            if(flush_) {
+                flush_ = false;
+                need_key_frame_ = true;
+            }
+        }
+
+        int64_t begin = TimesUtil::GetTimeMicrosecond();
+        if(need_key_frame_) {
+            // 参考帧已经断了，只能从关键帧开始；超出预算时关键帧也丢掉
+            if(!(packet->flags & AV_PKT_FLAG_KEY) || overBudget(begin)) {
+                av_packet_free(&packet);
+                continue;
+            }
+            avcodec_flush_buffers(decoder_);
+            need_key_frame_ = false;
+            resyncing_ = false;
+        }
+        int64_t decode_time = 0;
+        if(avcodec_send_packet(decoder_, packet) == 0) {
+            while(true) {
+                int64_t decode_begin = TimesUtil::GetTimeMicrosecond();
+                int ret = avcodec_receive_frame(decoder_, frame_);
+                decode_time += TimesUtil::GetTimeMicrosecond() - decode_begin;
+                if(ret != 0) {
+                    break;
+                }
+                compare(frame_);
+                av_frame_unref(frame_);
+            }
+        }
+        av_packet_free(&packet);
+        int64_t end = TimesUtil::GetTimeMicrosecond();
+        {
+            std::lock_guard<PushMutex> lock(mutex_);
+            stats_.decode_time += decode_time;
+        }
+        window_busy_ += end - begin;
+        if(overBudget(end)) {
+            need_key_frame_ = true;
+            resyncing_ = true;
+            std::lock_guard<PushMutex> lock(mutex_);
+            stats_.resyncs++;
+        }
+    }
+    LogInfo("quality monitor loop leave");
+}
+
+/**
+ * @brief 找到解码出的帧对应的采样帧并计算PSNR、SSIM，pts更小的采样帧已经不可能解码出来了，一并作废。
+ * @return void。
+ */
+void QualityMonitor::compare(AVFrame *frame)
+{
+    int64_t pts = frame->pts != AV_NOPTS_VALUE ? frame->pts : frame->pkt_dts;
+    QualitySample *sample = NULL;
+    int64_t lost = 0;
+    {
+        std::lock_guard<PushMutex> lock(mutex_);
+        stats_.decoded_frames++;
+        for(size_t i = 0; i < samples_.size(); i++) {
+            if(samples_[i].state != SAMPLE_PENDING) {
+                continue;
+            }
+            if(samples_[i].pts < pts) {
+                samples_[i].state = SAMPLE_FREE;
+                lost++;
+            } else if(samples_[i].pts == pts) {
+                samples_[i].state = SAMPLE_COMPARING;
+                sample = &samples_[i];
+            }
+        }
+        if(sample && (frame->width != width_ || frame->height != height_
+                      || (frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P))) {
+            sample->state = SAMPLE_FREE;                // 降级缩小了分辨率
+            sample = NULL;
+            lost++;
+        }
+        stats_.lost_samples += lost;
+    }
+    if(metrics_ && lost > 0) {
+        PublishMetrics::Add(metrics_->quality_lost_samples_, lost);
+    }
+    if(!sample) {
+        return;
+    }
+
+    int64_t begin = TimesUtil::GetTimeMicrosecond();
+    const uint8_t *y_plane = &sample->yuv[0];
+    const uint8_t *u_plane = y_plane + width_ * height_;
+    const uint8_t *v_plane = u_plane + width_ * height_ / 4;
+    uint64_t sse_y = SquaredError(y_plane, width_, frame->data[0], frame->linesize[0], width_, height_);
+    uint64_t sse_u = SquaredError(u_plane, width_ / 2, frame->data[1], frame->linesize[1], width_ / 2, height_ / 2);
+    uint64_t sse_v = SquaredError(v_plane, width_ / 2, frame->data[2], frame->linesize[2], width_ / 2, height_ / 2);
+    double ssim = Ssim(y_plane, width_, frame->data[0], frame->linesize[0], width_, height_);
+    int64_t pixels = (int64_t)width_ * height_;
+    double psnr_y = psnr(sse_y, pixels);
+    double psnr_all = psnr(sse_y + sse_u + sse_v, pixels + pixels / 2);
+    int64_t compare_time = TimesUtil::GetTimeMicrosecond() - begin;
+
+    std::lock_guard<PushMutex> lock(mutex_);
+    sample->state = SAMPLE_FREE;
+    if(0 == stats_.samples || psnr_all < stats_.min_psnr) {
+        stats_.min_psnr = psnr_all;
+    }
+    if(0 == stats_.samples || ssim < stats_.min_ssim) {
+        stats_.min_ssim = ssim;
+    }
+    stats_.samples++;
+    stats_.psnr_y_sum += psnr_y;
+    stats_.psnr_sum += psnr_all;
+    stats_.ssim_sum += ssim;
+    stats_.compare_time += compare_time;
+    if(metrics_) {
+        PublishMetrics::Add(metrics_->quality_samples_, 1);
+        PublishMetrics::Set(metrics_->quality_psnr_, llround(psnr_all * 1000));
+        PublishMetrics::Set(metrics_->quality_psnr_y_, llround(psnr_y * 1000));
+        PublishMetrics::Set(metrics_->quality_ssim_, llround(ssim * 1000000));
+    }
+}
+
+void QualityMonitor::GetStats(QualityStats *stats)
+{
+    std::lock_guard<PushMutex> lock(mutex_);
+    *stats = stats_;
+    memset(&stats_, 0, sizeof(QualityStats));
+}
+
+uint64_t QualityMonitor::SquaredError(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height)
+{
+    uint64_t sse = 0;
+    for(int y = 0; y < height; y++) {
+        const uint8_t *pa = a + y * a_stride;
+        const uint8_t *pb = b + y * b_stride;
+        int x = 0;
+        // 每个32位的通道一行最多累加width/8个平方，8192宽也不会溢出
+#if defined(QUALITY_USE_AVX2)
+        __m256i zero = _mm256_setzero_si256();
+        __m256i acc = _mm256_setzero_si256();
+        for(; x + 32 <= width; x += 32) {
+            __m256i va = _mm256_loadu_si256((const __m256i *)(pa + x));
+            __m256i vb = _mm256_loadu_si256((const __m256i *)(pb + x));
+            __m256i d = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+            __m256i lo = _mm256_unpacklo_epi8(d, zero);
+            __m256i hi = _mm256_unpackhi_epi8(d, zero);
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(lo, lo));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(hi, hi));
+        }
+        uint32_t lanes[8];
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        for(int i = 0; i < 8; i++) {
+            sse += lanes[i];
+        }
+#elif defined(QUALITY_USE_SSE2)
+        __m128i zero = _mm_setzero_si128();
+        __m128i acc = _mm_setzero_si128();
+        for(; x + 16 <= width; x += 16) {
+            __m128i va = _mm_loadu_si128((const __m128i *)(pa + x));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(pb + x));
+            __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+            __m128i lo = _mm_unpacklo_epi8(d, zero);
+            __m128i hi = _mm_unpackhi_epi8(d, zero);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+        }
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        for(int i = 0; i < 4; i++) {
+            sse += lanes[i];
+        }
+#endif
+        for(; x < width; x++) {
+            int d = pa[x] - pb[x];
+            sse += d * d;
+        }
+    }
+    return sse;
+}
+
+void QualityMonitor::SsimBlockSums(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int blocks, int (*sums)[4])
+{
+    int k = 0;
+#if defined(QUALITY_USE_AVX2) || defined(QUALITY_USE_SSE2)
+    // 16个像素(4个块)一组，_mm_madd_epi16把相邻两个像素的和(积)加成32位，每个块是相邻的两个32位通道
+#if defined(QUALITY_USE_AVX2)
+    __m256i ones = _mm256_set1_epi16(1);
+#else
+    __m128i zero = _mm_setzero_si128();
+    __m128i ones = _mm_set1_epi16(1);
+#endif
+    for(; k + 4 <= blocks; k += 4) {
+        int32_t lanes[4][8];
+#if defined(QUALITY_USE_AVX2)
+        __m256i s1 = _mm256_setzero_si256(), s2 = s1, ss = s1, s12 = s1;
+        for(int row = 0; row < 4; row++) {
+            __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(a + row * a_stride + k * 4)));
+            __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(b + row * b_stride + k * 4)));
+            s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(va, ones));
+            s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(vb, ones));
+            ss = _mm256_add_epi32(ss, _mm256_add_epi32(_mm256_madd_epi16(va, va), _mm256_madd_epi16(vb, vb)));
+            s12 = _mm256_add_epi32(s12, _mm256_madd_epi16(va, vb));
+        }
+        _mm256_storeu_si256((__m256i *)lanes[0], s1);
+        _mm256_storeu_si256((__m256i *)lanes[1], s2);
+        _mm256_storeu_si256((__m256i *)lanes[2], ss);
+        _mm256_storeu_si256((__m256i *)lanes[3], s12);
+#else
+        __m128i s1l = _mm_setzero_si128(), s1h = s1l, s2l = s1l, s2h = s1l, ssl = s1l, ssh = s1l, s12l = s1l, s12h = s1l;
+        for(int row = 0; row < 4; row++) {
+            __m128i va = _mm_loadu_si128((const __m128i *)(a + row * a_stride + k * 4));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(b + row * b_stride + k * 4));
+            __m128i al = _mm_unpacklo_epi8(va, zero), ah = _mm_unpackhi_epi8(va, zero);
+            __m128i bl = _mm_unpacklo_epi8(vb, zero), bh = _mm_unpackhi_epi8(vb, zero);
+            s1l = _mm_add_epi32(s1l, _mm_madd_epi16(al, ones));
+            s1h = _mm_add_epi32(s1h, _mm_madd_epi16(ah, ones));
+            s2l = _mm_add_epi32(s2l, _mm_madd_epi16(bl, ones));
+            s2h = _mm_add_epi32(s2h, _mm_madd_epi16(bh, ones));
+            ssl = _mm_add_epi32(ssl, _mm_add_epi32(_mm_madd_epi16(al, al), _mm_madd_epi16(bl, bl)));
+            ssh = _mm_add_epi32(ssh, _mm_add_epi32(_mm_madd_epi16(ah, ah), _mm_madd_epi16(bh, bh)));
+            s12l = _mm_add_epi32(s12l, _mm_madd_epi16(al, bl));
+            s12h = _mm_add_epi32(s12h, _mm_madd_epi16(ah, bh));
+        }
+        _mm_storeu_si128((__m128i *)lanes[0], s1l);
+        _mm_storeu_si128((__m128i *)(lanes[0] + 4), s1h);
+        _mm_storeu_si128((__m128i *)lanes[1], s2l);
+        _mm_storeu_si128((__m128i *)(lanes[1] + 4), s2h);
+        _mm_storeu_si128((__m128i *)lanes[2], ssl);
+        _mm_storeu_si128((__m128i *)(lanes[2] + 4), ssh);
+        _mm_storeu_si128((__m128i *)lanes[3], s12l);
+        _mm_storeu_si128((__m128i *)(lanes[3] + 4), s12h);
+#endif
+        for(int i = 0; i < 4; i++) {
+            for(int j = 0; j < 4; j++) {
+                sums[k + i][j] = lanes[j][i * 2] + lanes[j][i * 2 + 1];
+            }
+        }
+    }
+#endif
+    for(; k < blocks; k++) {
+        int s1 = 0, s2 = 0, ss = 0, s12 = 0;
+        for(int y = 0; y < 4; y++) {
+            for(int x = 0; x < 4; x++) {
+                int va = a[y * a_stride + k * 4 + x];
+                int vb = b[y * b_stride + k * 4 + x];
+                s1 += va;
+                s2 += vb;
+                ss += va * va + vb * vb;
+                s12 += va * vb;
+            }
+        }
+        sums[k][0] = s1;
+        sums[k][1] = s2;
+        sums[k][2] = ss;
+        sums[k][3] = s12;
+    }
+}
+
+double QualityMonitor::Ssim(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height)
+{
+    int blocks_x = width / 4;
+    int blocks_y = height / 4;
+    if(blocks_x < 2 || blocks_y < 2) {
+        return 1.0;
+    }
+    std::vector<int> rows(blocks_x * 4 * 2);
+    int (*pre)[4] = (int (*)[4])&rows[0];
+    int (*cur)[4] = (int (*)[4])&rows[blocks_x * 4];
+    SsimBlockSums(a, a_stride, b, b_stride, blocks_x, pre);
+    double sum = 0;
+    for(int by = 1; by < blocks_y; by++) {
+        SsimBlockSums(a + by * 4 * a_stride, a_stride, b + by * 4 * b_stride, b_stride, blocks_x, cur);
+        for(int bx = 0; bx + 1 < blocks_x; bx++) {
+            int s[4];
+            for(int j = 0; j < 4; j++) {
+                s[j] = pre[bx][j] + pre[bx + 1][j] + cur[bx][j] + cur[bx + 1][j];
+            }
+            sum += ssimEnd(s[0], s[1], s[2], s[3]);
+        }
+        std::swap(pre, cur);
+    }
+    return sum / ((blocks_x - 1) * (blocks_y - 1));
+}
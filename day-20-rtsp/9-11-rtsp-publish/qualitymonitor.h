@@ -0,0 +1,108 @@
+﻿#ifndef QUALITYMONITOR_H
+#define QUALITYMONITOR_H
+
+#include <stdint.h>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <condition_variable>
+#include "commonlooper.h"
+#include "mediabase.h"
+#include "instrument.h"
+#include "publishmetrics.h"
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+// 质量监测的统计信息，GetStats之后清零
+typedef struct quality_stats
+{
+    int64_t samples;                                    // 算出了PSNR/SSIM的采样帧数
+    double  psnr_y_sum;                                 // 亮度的PSNR之和，单位dB
+    double  psnr_sum;                                   // 三个平面合起来的PSNR之和
+    double  min_psnr;                                   // 最差的一帧(三个平面合起来)
+    double  ssim_sum;                                   // 亮度的SSIM之和
+    double  min_ssim;
+    int64_t dropped_samples;                            // 缓存已满或者正在等关键帧而没有采样的帧数
+    int64_t lost_samples;                               // 采样了但是没有解码出对应的帧(重新同步、分辨率不同)
+    int64_t decoded_frames;
+    int64_t resyncs;                                    // 队列溢出或者超出cpu预算后丢包等关键帧的次数
+    int64_t decode_time;                                // 解码累计耗时，单位us
+    int64_t compare_time;                               // 计算PSNR/SSIM累计耗时，单位us
+}QualityStats;
+
+/**
+ * 在线的编码质量监测：编码线程每interval帧采样一帧，拷贝一份编码前的yuv，监测线程把主流编码后的包解码出来，
+ * 按pts找到对应的采样帧计算PSNR(Y、U、V与合起来的)与亮度的SSIM，用于观察降级、码率调节对画质的影响。
+ * 1）不阻塞编码线程：Sample只在采样帧拷贝一次yuv，锁只用于状态切换；Push只增加包的引用计数放进队列。
+ * 2）内存有上限：最多max_pending个采样帧，都在等待时不再采样；包队列最多max_packets个，溢出时清空队列，
+ *    解码器等下一个关键帧重新同步，这期间的采样作废。
+ * 3）cpu有上限：解码必须连续(参考帧)，监测线程每秒统计解码与计算的耗时，超过一个核的max_cpu%后同样丢包等关键帧。
+ * 4）SSIM与x264相同：先算4x4块的和(s1、s2、平方和、乘积和)，再按相邻2x2块组成的8x8窗口(步长4)算SSIM取平均。
+ *    SSE与块的和用SSE2(AVX2)的_mm_madd_epi16，与标量实现的结果完全一致。
+ *
+ * 只支持yuv420p，解码出的分辨率与采样帧不同(降级缩小了分辨率)时这一帧不比较，记为lost。
+ */
+class QualityMonitor : public CommonLooper
+{
+public:
+    QualityMonitor();
+    virtual ~QualityMonitor();
+
+    RET_CODE Init(const Properties &properties, AVCodecContext *encoder_ctx);
+    void SetMetrics(PublishMetrics *metrics);           // 每个采样更新指标，需要在Start之前设置，NULL不统计
+    void Sample(const uint8_t *yuv, int64_t pts);       // 编码线程，在编码这一帧之前调用，yuv为紧凑的yuv420p
+    void Push(const AVPacket *packet);                  // 编码线程，不接管packet
+    virtual void Stop();
+    virtual void Loop();
+    void GetStats(QualityStats *stats);
+
+    // 两个平面的差的平方和
+    static uint64_t SquaredError(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height);
+    // 一行中连续blocks个4x4块的s1、s2、平方和、乘积和
+    static void SsimBlockSums(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int blocks, int (*sums)[4]);
+    static double Ssim(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height);
+
+private:
+    enum SampleState
+    {
+        SAMPLE_FREE = 0,
+        SAMPLE_FILLING,                                 // 编码线程正在拷贝
+        SAMPLE_PENDING,                                 // 等待解码出对应的帧
+        SAMPLE_COMPARING                                // 监测线程正在计算
+    };
+    typedef struct quality_sample
+    {
+        std::vector<uint8_t> yuv;
+        int64_t pts;
+        SampleState state;
+    }QualitySample;
+
+    void compare(AVFrame *frame);
+    bool overBudget(int64_t now);
+
+    int width_ = 0;
+    int height_ = 0;
+    int interval_ = 30;                                 // 每interval帧采样一帧
+    int max_packets_ = 120;
+    int max_cpu_ = 20;                                  // 一个核的百分比
+    int64_t frames_ = 0;                                // Sample收到的帧数，只在编码线程访问
+
+    AVCodecContext *decoder_ = NULL;
+    AVFrame *frame_ = NULL;
+    bool need_key_frame_ = true;                        // 只在监测线程访问
+    std::atomic<bool> resyncing_{true};                 // 给编码线程看的need_key_frame_，等关键帧时不采样
+    int64_t window_begin_ = 0;                          // cpu预算的统计窗口，单位us
+    int64_t window_busy_ = 0;
+
+    PushMutex mutex_{PUSH_LOCK_SITE("quality_monitor")};
+    PushCondition cond_;
+    std::deque<AVPacket *> packets_;
+    bool flush_ = false;                                // 队列溢出，监测线程需要等关键帧
+    std::vector<QualitySample> samples_;
+    QualityStats stats_;
+    PublishMetrics *metrics_ = NULL;
+};
+
+#endif // QUALITYMONITOR_H
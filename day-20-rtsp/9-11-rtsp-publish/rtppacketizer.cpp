@@ -0,0 +1,199 @@
+﻿#include <stdlib.h>
+#include "rtppacketizer.h"
+#include "nalparser.h"
+#include "instrument.h"
+#include "dlog.h"
+
+RtpPacketizer::RtpPacketizer()
+{
+}
+
+/**
+ * @brief 设置打包参数。
+ * @param "codec"           h264、aac或者opus
+ *        "payload_type"    RTP负载类型，默认96
+ *        "clock_rate"      RTP时钟频率，视频90000，音频为采样率
+ *        "channel"         rtsp over tcp时的interleaved通道号
+ *        "mtu"             RTP负载的最大字节数，默认1400
+ * @return 成功 0 失败 other
+ */
+RET_CODE RtpPacketizer::Init(const Properties &properties)
+{
+    codec_          = properties.GetProperty("codec", "h264");
+    payload_type_   = properties.GetProperty("payload_type", 96);
+    clock_rate_     = properties.GetProperty("clock_rate", 90000);
+    channel_        = properties.GetProperty("channel", 0);
+    mtu_            = properties.GetProperty("mtu", 1400);
+    if(codec_ != "h264" && codec_ != "aac" && codec_ != "opus") {
+        LogError("unsupported codec: %s", codec_.c_str());
+        return RET_ERR_NOT_SUPPORT;
+    }
+    if(clock_rate_ <= 0 || mtu_ < 100) {
+        LogError("invalid clock_rate: %d or mtu: %d", clock_rate_, mtu_);
+        return RET_ERR_PARAMISMATCH;
+    }
+    // ssrc、起始序号与起始时间戳都使用随机值，RFC 3550的要求
+    ssrc_ = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+    seq_ = (uint16_t)rand();
+    timestamp_base_ = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+    return RET_OK;
+}
+
+const uint8_t *RtpPacketizer::FindStartCode(const uint8_t *begin, const uint8_t *end, int *start_code_size)
+{
+    return NalParser::FindStartCode(begin, end, start_code_size);
+}
+
+uint8_t *RtpPacketizer::writeHeader(uint8_t *out, int payload_size, bool marker, uint32_t timestamp)
+{
+    int rtp_size = RTP_HEADER_SIZE + payload_size;
+    out[0] = '$';
+    out[1] = (uint8_t)channel_;
+    out[2] = (uint8_t)(rtp_size >> 8);
+    out[3] = (uint8_t)rtp_size;
+    out += RTP_INTERLEAVED_SIZE;
+
+    out[0] = 0x80;                                          // V=2
+    out[1] = (uint8_t)((marker ? 0x80 : 0) | payload_type_);
+    out[2] = (uint8_t)(seq_ >> 8);
+    out[3] = (uint8_t)seq_;
+    out[4] = (uint8_t)(timestamp >> 24);
+    out[5] = (uint8_t)(timestamp >> 16);
+    out[6] = (uint8_t)(timestamp >> 8);
+    out[7] = (uint8_t)timestamp;
+    out[8] = (uint8_t)(ssrc_ >> 24);
+    out[9] = (uint8_t)(ssrc_ >> 16);
+    out[10] = (uint8_t)(ssrc_ >> 8);
+    out[11] = (uint8_t)ssrc_;
+    seq_++;
+    return out + RTP_HEADER_SIZE;
+}
+
+/**
+ * @brief 按RFC 6184打包H264，out为NULL时只计算需要的字节数。
+ * @return 打包后的总字节数。
+ */
+int RtpPacketizer::packetizeH264(const uint8_t *data, int size, uint32_t timestamp, uint8_t *out)
+{
+    const uint8_t *end = data + size;
+    int start_code_size = 0;
+    const uint8_t *nal = FindStartCode(data, end, &start_code_size);
+    int total = 0;
+    while(nal < end)
+    {
+        nal += start_code_size;
+        const uint8_t *next = FindStartCode(nal, end, &start_code_size);
+        int nal_size = (int)(next - nal);
+        bool last_nal = (next == end);
+        if(nal_size <= 0) {
+            nal = next;
+            continue;
+        }
+
+        if(nal_size <= mtu_) {
+            // 单NAL包
+            total += RTP_INTERLEAVED_SIZE + RTP_HEADER_SIZE + nal_size;
+            if(out) {
+                uint8_t *payload = writeHeader(out, nal_size, last_nal, timestamp);
+                memcpy(payload, nal, nal_size);
+                out = payload + nal_size;
+            }
+        } else {
+            // FU-A分片，去掉1字节的NAL头，每片带2字节的FU indicator与FU header
+            const uint8_t *p = nal + 1;
+            int left = nal_size - 1;
+            bool first = true;
+            while(left > 0) {
+                int chunk = left > mtu_ - 2 ? mtu_ - 2 : left;
+                bool last = (chunk == left);
+                total += RTP_INTERLEAVED_SIZE + RTP_HEADER_SIZE + 2 + chunk;
+                if(out) {
+                    uint8_t *payload = writeHeader(out, 2 + chunk, last_nal && last, timestamp);
+                    payload[0] = (nal[0] & 0xE0) | 28;                  // FU indicator: F、NRI与type=28
+                    payload[1] = (first ? 0x80 : 0) | (last ? 0x40 : 0) | (nal[0] & 0x1F);
+                    memcpy(payload + 2, p, chunk);
+                    out = payload + 2 + chunk;
+                }
+                p += chunk;
+                left -= chunk;
+                first = false;
+            }
+        }
+        nal = next;
+    }
+    return total;
+}
+
+/**
+ * @brief 按RFC 3640 AAC-hbr打包AAC，AU-headers-length为16位，AU-header为13位长度+3位索引。
+ * @return 打包后的总字节数。
+ */
+int RtpPacketizer::packetizeAac(const uint8_t *data, int size, uint32_t timestamp, uint8_t *out)
+{
+    int total = RTP_INTERLEAVED_SIZE + RTP_HEADER_SIZE + 4 + size;
+    if(out) {
+        uint8_t *payload = writeHeader(out, 4 + size, true, timestamp);
+        payload[0] = 0;
+        payload[1] = 16;                                    // AU-headers-length，单位bit
+        payload[2] = (uint8_t)(size >> 5);
+        payload[3] = (uint8_t)((size & 0x1F) << 3);
+        memcpy(payload + 4, data, size);
+    }
+    return total;
+}
+
+/**
+ * @brief 按RFC 7587打包opus，负载就是一个完整的opus包。marker总是0，静音跳过编码时接收端按时间戳的空洞处理。
+ * @return 打包后的总字节数。
+ */
+int RtpPacketizer::packetizeOpus(const uint8_t *data, int size, uint32_t timestamp, uint8_t *out)
+{
+    int total = RTP_INTERLEAVED_SIZE + RTP_HEADER_SIZE + size;
+    if(out) {
+        uint8_t *payload = writeHeader(out, size, false, timestamp);
+        memcpy(payload, data, size);
+    }
+    return total;
+}
+
+/**
+ * @brief 把一帧编码数据打包成RTP包。
+ * @param pkt 编码后的包，pts单位为ms。
+ * @return 打包后的包，pts、flags与输入一致，失败返回NULL。
+ */
+AVPacket *RtpPacketizer::Packetize(const AVPacket *pkt)
+{
+    if(!pkt || pkt->size <= 0) {
+        return NULL;
+    }
+    if(codec_ == "aac" && pkt->size > 8191) {
+        LogError("aac frame too large: %d", pkt->size);     // AU-header中长度只有13位
+        return NULL;
+    }
+    uint32_t timestamp = timestamp_base_ + (uint32_t)av_rescale(pkt->pts, clock_rate_, 1000);
+    bool h264 = (codec_ == "h264");
+    bool opus = (codec_ == "opus");
+    int size = h264 ? packetizeH264(pkt->data, pkt->size, timestamp, NULL)
+                    : (opus ? packetizeOpus(pkt->data, pkt->size, timestamp, NULL)
+                            : packetizeAac(pkt->data, pkt->size, timestamp, NULL));
+    if(size <= 0) {
+        return NULL;
+    }
+    AVPacket *out = av_packet_alloc();
+    if(!out || av_new_packet(out, size) < 0) {
+        av_packet_free(&out);
+        return NULL;
+    }
+    PUSH_ALLOC("rtp_packetizer_packet", sizeof(AVPacket) + size);
+    if(h264) {
+        packetizeH264(pkt->data, pkt->size, timestamp, out->data);
+    } else if(opus) {
+        packetizeOpus(pkt->data, pkt->size, timestamp, out->data);
+    } else {
+        packetizeAac(pkt->data, pkt->size, timestamp, out->data);
+    }
+    out->pts = pkt->pts;
+    out->dts = pkt->dts;
+    out->flags = pkt->flags;
+    return out;
+}
@@ -0,0 +1,55 @@
+﻿#ifndef RTPPACKETIZER_H
+#define RTPPACKETIZER_H
+
+#include <stdint.h>
+#include "mediabase.h"
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#define RTP_HEADER_SIZE         12
+#define RTP_INTERLEAVED_SIZE    4                   // rtsp over tcp的interleaved头: '$' channel len(2字节)
+
+/**
+ * RTP打包器，一个轨道一个。编码后的一帧只打包一次，打包结果是一个引用计数的AVPacket，
+ * data中顺序存放若干个 [4字节interleaved头][12字节RTP头][负载]。
+ * 这样所有客户端共用同一份数据(av_packet_ref)：TCP客户端整块发送，UDP客户端逐个发送时跳过4字节的interleaved头。
+ *
+ * 支持：
+ * 1）H264，RFC 6184，单NAL包与FU-A分片(packetization-mode=1)，输入是带起始码的Annex-B格式。
+ * 2）AAC，RFC 3640，mpeg4-generic AAC-hbr，一个RTP包一个AU，输入是不带ADTS头的裸数据。
+ * 3）Opus，RFC 7587，一个RTP包一个opus包，负载就是编码后的数据，RTP时钟固定48000。
+ *
+ * 注意：本类不加锁，同一个轨道只能在一个线程中打包。
+ */
+class RtpPacketizer
+{
+public:
+    RtpPacketizer();
+
+    RET_CODE Init(const Properties &properties);
+    AVPacket *Packetize(const AVPacket *pkt);       // 返回新分配的包，由调用者释放，失败返回NULL
+
+    uint32_t GetSsrc() { return ssrc_; }
+    int GetChannel() { return channel_; }
+
+    // 在Annex-B码流中查找起始码，返回起始码的位置，*start_code_size传出起始码长度(3或4)，找不到返回end
+    static const uint8_t *FindStartCode(const uint8_t *begin, const uint8_t *end, int *start_code_size);
+
+private:
+    int packetizeH264(const uint8_t *data, int size, uint32_t timestamp, uint8_t *out);
+    int packetizeAac(const uint8_t *data, int size, uint32_t timestamp, uint8_t *out);
+    int packetizeOpus(const uint8_t *data, int size, uint32_t timestamp, uint8_t *out);
+    uint8_t *writeHeader(uint8_t *out, int payload_size, bool marker, uint32_t timestamp);
+
+    std::string codec_      = "h264";               // h264、aac或者opus
+    int payload_type_       = 96;
+    int clock_rate_         = 90000;                // 时钟频率，视频90000，音频为采样率
+    int channel_            = 0;                    // interleaved通道号，RTCP为channel_+1
+    int mtu_                = 1400;                 // RTP负载的最大字节数
+    uint32_t ssrc_          = 0;
+    uint16_t seq_           = 0;
+    uint32_t timestamp_base_ = 0;                   // RTP时间戳的随机起始值
+};
+
+#endif // RTPPACKETIZER_H
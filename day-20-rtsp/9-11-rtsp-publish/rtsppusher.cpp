@@ -1,4 +1,5 @@
 ﻿#include "rtsppusher.h"
+#include "instrument.h"
 #include "dlog.h"
 #include "timesutil.h"
 
@@ -14,23 +15,6 @@ RtspPusher::~RtspPusher()
     DeInit();       // 释放资源
 }
 
-/**
- * @brief 中断回调函数，防止FFmpeg的某些api可能卡死的情况。
- * @param ctx rtsp推流对象。
- * @return false: 继续阻塞;  true: 退出阻塞
- */
-static int decode_interrupt_cb(void *ctx)
-{
-    RtspPusher *rtsp_puser = (RtspPusher *)ctx;
-    if(rtsp_puser->IsTimeout()) {
-        LogWarn("decode_interrupt_cb timeout: %d ms", rtsp_puser->GetTimeout());
-        return 1;
-    }
-
-    //    LogInfo("block time:%lld", rtsp_puser->GetBlockTime());
-    return 0;
-}
-
 /**
  * @brief   设置相关参数，主要是分配AVFormatContext。
  * @param   url_                    推流url。
@@ -39,6 +23,20 @@ static int decode_interrupt_cb(void *ctx)
  *          video_frame_duration_   视频一帧的时长。
  *          timeout_                超时时长。
  *          max_queue_duration_     最大队列的包的保留时长。
+ *          pacing_enable_          是否开启发送平滑，默认0不开启。
+ *          pacing_multiple_        平滑发送码率相对于音视频目标码率之和的倍数，百分比，默认150。
+ *          pacing_max_delay_       一帧在发送过程中的最大平滑等待时长，默认500ms。
+ *          audio_bitrate_          音频目标码率，用于计算平滑的发送码率。
+ *          video_bitrate_          视频目标码率，用于计算平滑的发送码率。
+ *          spill_enable_           是否开启磁盘溢出缓存，开启后队列超过最大时长不再drop，默认0不开启。
+ *          spill_file_             溢出文件名。
+ *          spill_file_size_mb_     溢出文件预分配的大小，单位MB。
+ *          spill_memory_threshold_kb_  内存队列超过该大小后，头部的包溢出到文件，单位KB。
+ *          spill_catchup_percent_  链路恢复后的追赶速度，实时速度的百分比。
+ *          standby_url_            备用服务器的地址，不为空时开启热备连接。
+ *          standby_keepalive_interval_ 备用连接保活的间隔，默认1000ms。
+ *          failover_stall_time_    一次写帧超过该时长认为主连接卡住，切换到备用连接，默认1000ms。
+ *                                  备用连接可用时在中断回调中检查，超过就中断写帧。
  * @return  成功 0 失败 other
  */
 RET_CODE RtspPusher::Init(const Properties &properties)
@@ -49,6 +47,19 @@ RET_CODE RtspPusher::Init(const Properties &properties)
     video_frame_duration_   = properties.GetProperty("video_frame_duration", 0);
     timeout_                = properties.GetProperty("timeout", 5000);    // 默认为5秒
     max_queue_duration_     = properties.GetProperty("max_queue_duration", 500);
+    pacing_enable_          = properties.GetProperty("pacing_enable", 0);
+    pacing_multiple_        = properties.GetProperty("pacing_multiple", 150);
+    pacing_max_delay_       = properties.GetProperty("pacing_max_delay", 500);
+    audio_bitrate_          = properties.GetProperty("audio_bitrate", 0);
+    video_bitrate_          = properties.GetProperty("video_bitrate", 0);
+    spill_enable_           = properties.GetProperty("spill_enable", 0);
+    spill_file_             = properties.GetProperty("spill_file", "rtsp_spill.dat");
+    spill_file_size_mb_     = properties.GetProperty("spill_file_size_mb", 256);
+    spill_memory_threshold_kb_  = properties.GetProperty("spill_memory_threshold_kb", 4096);
+    spill_catchup_percent_  = properties.GetProperty("spill_catchup_percent", 200);
+    standby_url_            = properties.GetProperty("standby_url", "");
+    standby_keepalive_interval_ = properties.GetProperty("standby_keepalive_interval", 1000);
+    failover_stall_time_    = properties.GetProperty("failover_stall_time", 1000);
     if(url_ == "") {
         LogError("url is null");
         return RET_FAIL;
@@ -87,8 +98,9 @@ RET_CODE RtspPusher::Init(const Properties &properties)
         return RET_FAIL;
     }
     // 设置超时回调，防止卡死
-    fmt_ctx_->interrupt_callback.callback = decode_interrupt_cb;
-    fmt_ctx_->interrupt_callback.opaque = this;
+    timer_ = new InterruptTimer(timeout_);
+    fmt_ctx_->interrupt_callback.callback = InterruptTimer::Callback;
+    fmt_ctx_->interrupt_callback.opaque = timer_;
 
     // 4 创建队列
     queue_ = new PacketQueue(audio_frame_duration_, video_frame_duration_);
@@ -97,6 +109,49 @@ RET_CODE RtspPusher::Init(const Properties &properties)
         return RET_ERR_OUTOFMEMORY;
     }
 
+    // 5 创建发送平滑器
+    if(pacing_enable_) {
+        pacer_ = new SendPacer();
+        Properties pacer_properties;
+        pacer_properties.SetProperty("bitrate", audio_bitrate_ + video_bitrate_);
+        pacer_properties.SetProperty("multiple", pacing_multiple_);
+        pacer_properties.SetProperty("frame_duration", (int)video_frame_duration_);
+        pacer_properties.SetProperty("max_delay", pacing_max_delay_);
+        if(pacer_->Init(pacer_properties) != RET_OK) {
+            LogError("SendPacer Init failed");
+            return RET_FAIL;
+        }
+        timer_->SetPacer(pacer_);                           // 在中断回调中按RTP包平滑
+    }
+
+    // 6 创建磁盘溢出缓存，它有自己的线程，负责把内存队列的溢出部分写到文件以及读回
+    if(spill_enable_) {
+        spiller_ = new PacketSpiller(queue_);
+        Properties spill_properties;
+        spill_properties.SetProperty("file", spill_file_);
+        spill_properties.SetProperty("file_size_mb", spill_file_size_mb_);
+        spill_properties.SetProperty("memory_threshold_kb", spill_memory_threshold_kb_);
+        spill_properties.SetProperty("catchup_percent", spill_catchup_percent_);
+        if(spiller_->Init(spill_properties) != RET_OK || spiller_->Start() != RET_OK) {
+            LogError("PacketSpiller Init failed");
+            return RET_FAIL;
+        }
+    }
+
+    // 7 创建热备连接，主连接握手成功后才开始连接备用服务器，详看Connect
+    if(!standby_url_.empty()) {
+        standby_ = new RtspStandby();
+        Properties standby_properties;
+        standby_properties.SetProperty("url", standby_url_);
+        standby_properties.SetProperty("rtsp_transport", rtsp_transport_);
+        standby_properties.SetProperty("timeout", timeout_);
+        standby_properties.SetProperty("keepalive_interval", standby_keepalive_interval_);
+        if(standby_->Init(standby_properties) != RET_OK) {
+            LogError("RtspStandby Init failed");
+            return RET_FAIL;
+        }
+    }
+
     return RET_OK;
 }
 
@@ -109,18 +164,41 @@ void RtspPusher::DeInit()
     if(queue_) {
         queue_->Abort();
     }
+    if(spiller_) {
+        spiller_->Abort();
+    }
     // 1
     Stop();
-    // 2
+    // 2 备用连接线程会关闭自己持有的连接
+    if(standby_) {
+        delete standby_;
+        standby_ = NULL;
+    }
+    while(!gop_cache_.empty()) {
+        av_packet_free(&gop_cache_.front());
+        gop_cache_.pop_front();
+    }
     if(fmt_ctx_) {
         avformat_free_context(fmt_ctx_);
         fmt_ctx_ = NULL;
     }
-    // 3 注意上面要先中断，并且其它类有些回收是需要注意顺序的，这里不用考虑顺序。
+    if(timer_) {
+        delete timer_;
+        timer_ = NULL;
+    }
+    // 3 注意上面要先中断，并且其它类有些回收是需要注意顺序的，这里只有溢出缓存引用了队列，需要先于队列释放。
+    if(spiller_) {
+        delete spiller_;                                    // 析构时会停止溢出线程并删除溢出文件
+        spiller_ = NULL;
+    }
     if(queue_) {
         delete queue_;
         queue_ = NULL;
     }
+    if(pacer_) {
+        delete pacer_;
+        pacer_ = NULL;
+    }
 }
 
 /**
@@ -152,6 +230,7 @@ RET_CODE RtspPusher::Connect()
 
     LogInfo("connect to: %s", url_.c_str());
     // 连接服务器
+    connect_begin_time_ = TimesUtil::GetTimeMillisecond();
     RestTiemout();                                          // 每次调用FFmpeg有可能卡死的接口都应该更新该值。if条件应加多一个重连该接口条件，解决GetTickCount归0问题。
     int ret = avformat_write_header(fmt_ctx_, NULL);
     if(ret < 0) {
@@ -161,13 +240,25 @@ RET_CODE RtspPusher::Connect()
         return RET_FAIL;
     }
 
-    LogInfo("avformat_write_header ok");
+    connect_time_ = (int)(TimesUtil::GetTimeMillisecond() - connect_begin_time_);
+    LogInfo("avformat_write_header ok, connect time: %dms", connect_time_);
+    started_ = (video_stream_ == NULL);                         // 纯音频时不需要等关键帧
+
+    // 主连接成功后再启动备用连接，流的配置与主连接一致
+    if(standby_) {
+        if(standby_->ConfigStreams(video_ctx_, video_index_, audio_ctx_, audio_index_) != RET_OK
+                || standby_->Start() != RET_OK) {
+            LogError("RtspStandby Start failed");
+            return RET_FAIL;
+        }
+    }
     return this->Start();                                       // 启动线程
 }
 
 /**
  * @brief rtsp的推流线程回调，内部从编码后的packet队列中去取数据进行推流，
  *          会定时debug包队列，并且会检测包队列的时长，如果时长大于最大时长，会进行drop包，以减少时长。
+ *          连接成功后立即开始发送，第一个视频关键帧之前的视频与更早的音频都丢弃，详看checkStartup。
  *
  * @return void。
  */
@@ -178,12 +269,6 @@ void RtspPusher::Loop()
     AVPacket *pkt = NULL;
     MediaType media_type;
 
-    LogInfo("sleep_for into");
-    // 人为制造延迟，目的是想看长时间不去Pop包推流，debugQueue出来的队列情况会是什么情况，结果：过了10s后，可以看到下面的debugQueue会对视频进行drop挺多帧的。
-    // 后面可以删掉这个延时
-    std::this_thread::sleep_for(std::chrono::seconds(10));
-    LogInfo("sleep_for leave");
-
     while (true)
     {
         if(request_abort_) {
@@ -193,8 +278,16 @@ void RtspPusher::Loop()
 
         debugQueue(debug_interval_);                            // 定时打印一下队列的状态信息
         checkPacketQueueDuration();                             // 可以每隔一秒check一次，看是否需要drop包。
+        if(standby_) {
+            checkFailover();                                    // 主连接故障时切换到备用连接
+        }
 
-        ret = queue_->PopWithTimeout(&pkt, media_type, 1000);   // 获取一个packet，记住这里每次从队列取完一个包后，都是需要free掉，因为编码后的包都在这个队列中处理。
+        // 获取一个packet，记住这里每次从队列取完一个包后，都是需要free掉，因为编码后的包都在这个队列中处理。
+        if(spiller_) {
+            ret = spiller_->Pop(&pkt, media_type, 1000);             // 有溢出数据时先发送溢出的数据
+        } else {
+            ret = queue_->PopWithTimeout(&pkt, media_type, 1000);
+        }
         if(1 == ret) // 1代表 读取到消息
         {
             if(request_abort_) {
@@ -202,6 +295,10 @@ void RtspPusher::Loop()
                 av_packet_free(&pkt);
                 break;
             }
+            if(!checkStartup(pkt, media_type)) {
+                av_packet_free(&pkt);
+                continue;
+            }
 
             // 下面步骤虽然是一样，但是分开写更方便调试，例如对比编码前后与推流时的pts。
             switch (media_type)
@@ -246,14 +343,10 @@ void RtspPusher::Loop()
 */
 bool RtspPusher::IsTimeout()
 {
-    //if(TimesUtil::GetTimeMillisecond() - pre_time_ > timeout_) {
     // 我加的fabs绝对值，防止windows下GetTickCount归0造成更大的误差.
     // 不是说加了fabs就没误差，只是出错情况变小了。不加fabs，也会可能卡死，例如pre_time_很大，GetTimeMillisecond()很小，
     // 而假设fabs这种情况虽然判断为超时，但总比卡死好，这种情况让接口再次调用一下能够解决。
-    if(fabs(TimesUtil::GetTimeMillisecond() - pre_time_) > timeout_) {
-        return true;    // 超时
-    }
-    return false;
+    return timer_ ? timer_->IsTimeout() : false;
 }
 
 /**
@@ -262,7 +355,9 @@ bool RtspPusher::IsTimeout()
 */
 void RtspPusher::RestTiemout()
 {
-    pre_time_ = TimesUtil::GetTimeMillisecond();        // 重置为当前时间
+    if(timer_) {
+        timer_->Reset();                                // 重置为当前时间
+    }
 }
 
 /**
@@ -278,7 +373,7 @@ int RtspPusher::GetTimeout()
 */
 int64_t RtspPusher::GetBlockTime()
 {
-    return TimesUtil::GetTimeMillisecond() - pre_time_;
+    return timer_ ? timer_->GetBlockTime() : 0;
 }
 
 /**
@@ -294,6 +389,21 @@ void RtspPusher::debugQueue(int64_t interval)
         PacketQueueStats stats;             // debug时，应该看这个变量，不应再看queue_的内容，因为释放锁后，其它线程可能在操作队列
         queue_->GetStats(&stats);
         LogInfo("duration:a-%lldms, v-%lldms", stats.audio_duration, stats.video_duration);
+        if(pacer_) {
+            SendPacerStats pacer_stats;
+            pacer_->GetStats(&pacer_stats);
+            LogInfo("pacer: paced-%lld, delayed-%lld, bypass-%lld, avg_delay-%lldus, max_delay-%lldus, chunks-%lld, hooks-%0.2lf/rtp",
+                    pacer_stats.paced_packets, pacer_stats.delayed_packets, pacer_stats.bypass_packets,
+                    pacer_stats.paced_packets > 0 ? pacer_stats.total_delay / pacer_stats.paced_packets : 0,
+                    pacer_stats.max_delay, pacer_stats.paced_chunks, pacer_stats.hooks_per_packet);
+        }
+        if(spiller_) {
+            PacketSpillerStats spill_stats;
+            spiller_->GetStats(&spill_stats);
+            LogInfo("spill: spilled-%lld, restored-%lld, dropped-%lld, pending-%lld, file-%lldKB, readahead-%lldKB",
+                    spill_stats.spilled_packets, spill_stats.restored_packets, spill_stats.dropped_packets,
+                    spill_stats.pending_packets, spill_stats.file_used / 1024, spill_stats.readahead_size / 1024);
+        }
         pre_debug_time_ = cur_time;         // 更新定时打印的起始时间
     }
 }
@@ -306,14 +416,50 @@ void RtspPusher::checkPacketQueueDuration()
 {
     PacketQueueStats stats;
     queue_->GetStats(&stats);
-    if(stats.audio_duration > max_queue_duration_ || stats.video_duration > max_queue_duration_) {
+    // 开启溢出缓存时不drop，内存队列的大小由溢出缓存控制
+    if(!spiller_ && (stats.audio_duration > max_queue_duration_ || stats.video_duration > max_queue_duration_)) {
         // 这里生成消息到消息队列有啥作用吗？他的意思是：可以交由上层去drop或者这里直接drop，这里选择直接drop了。
         msg_queue_->notify_msg3(MSG_RTSP_QUEUE_DURATION, stats.audio_duration, stats.video_duration);
         LogWarn("drop packet -> a: %lld, v: %lld, max: %d", stats.audio_duration, stats.video_duration, max_queue_duration_);
-        queue_->Drop(false, max_queue_duration_);       // 从队列头部开始drop
+        int drop_count = queue_->Drop(false, max_queue_duration_);       // 从队列头部开始drop
+        if(metrics_) {
+            PublishMetrics::Add(metrics_->dropped_packets_, drop_count);
+        }
+    }
+    if(metrics_) {
+        PublishMetrics::Set(metrics_->audio_queue_duration_, stats.audio_duration);
+        PublishMetrics::Set(metrics_->video_queue_duration_, stats.video_duration);
+        PublishMetrics::Set(metrics_->queue_bytes_, stats.audio_size + stats.video_size);
     }
 }
 
+/**
+ * @brief 获取发送平滑器的统计信息，没开启平滑时统计全为0。注意平滑器只在推流线程中使用，这里只是用于debug。
+ * @param stats 传入传出，统计信息。
+ * @return void。
+ */
+void RtspPusher::GetPacerStats(SendPacerStats *stats)
+{
+    if(!stats) {
+        return;
+    }
+    if(!pacer_) {
+        memset(stats, 0, sizeof(SendPacerStats));
+        return;
+    }
+    pacer_->GetStats(stats);
+}
+
+/**
+ * @brief 设置运行指标，推流线程只对它做原子操作。需要在Connect之前设置，并且在推流线程退出之前不能释放。
+ * @param metrics 运行指标，NULL不统计。
+ * @return void。
+ */
+void RtspPusher::SetMetrics(PublishMetrics *metrics)
+{
+    metrics_ = metrics;
+}
+
 /**
  * @brief 写帧推流，但是在写帧之前内部会进行pts的单位转换，转成容器的时基进行推流。
  * @param pkt 编码后的数据包。
@@ -336,12 +482,53 @@ int RtspPusher::sendPacket(AVPacket *pkt, MediaType media_type)
         LogError("unknown mediatype:%d", media_type);
         return -1;
     }
+    if(standby_) {
+        if(E_VIDEO_TYPE == media_type) {
+            cacheGop(pkt);                                              // 写之前保留，写失败的这一帧切换后也会重发
+        } else {
+            standby_->KeepAlive(pkt, media_type);
+        }
+    }
     pkt->pts = av_rescale_q(pkt->pts, src_time_base, dst_time_base);    // 将编码后的包的pts的时基转成容器的时基单位。(pts*1/1000)/(1/90000)=pts*90000/1000=pts*90
+    if(pkt->dts != AV_NOPTS_VALUE) {
+        pkt->dts = av_rescale_q(pkt->dts, src_time_base, dst_time_base);    // 转推带B帧的输入时dts与pts不同，也要转换
+    }
     pkt->duration = 0;
+    int size = pkt->size;                                               // av_write_frame后pkt的内容可能被清空
 
-    // 2 开始写帧，进行推流。
+    // 2 开始写帧，进行推流。开启平滑时视频的RTP包在中断回调中按令牌逐个发出，音频只扣除令牌。
+    if(pacer_) {
+        pacer_->BeginWrite(size, E_VIDEO_TYPE == media_type);
+    }
+    // 备用连接可用时，主连接阻塞超过failover_stall_time就在中断回调中退出，不用等到timeout才切换
+    if(standby_) {
+        timer_->SetStallLimit(!failover_pending_ && standby_->IsReady() ? failover_stall_time_ : 0);
+    }
     RestTiemout();
+    int64_t begin = metrics_ ? TimesUtil::GetTimeMicrosecond() : 0;
+    int64_t write_begin = TimesUtil::GetTimeMillisecond();
     int ret = av_write_frame(fmt_ctx_, pkt);
+    if(pacer_) {
+        pacer_->EndWrite();
+    }
+    bool stalled = timer_->GetBlockTime() > failover_stall_time_;      // 不包括平滑等待的时间
+    if(standby_ && !failover_pending_ && (ret < 0 || stalled)) {
+        LogWarn("primary output %s, ret: %d, failover to standby", stalled ? "stalled" : "failed", ret);
+        failover_pending_ = true;
+        failover_begin_time_ = write_begin;
+    }
+    if(metrics_) {
+        metrics_->ObserveWriteLatency(TimesUtil::GetTimeMicrosecond() - begin);
+        if(ret < 0) {
+            PublishMetrics::Add(metrics_->write_errors_, 1);
+        } else if(E_VIDEO_TYPE == media_type) {
+            PublishMetrics::Add(metrics_->video_sent_packets_, 1);
+            PublishMetrics::Add(metrics_->video_sent_bytes_, size);
+        } else {
+            PublishMetrics::Add(metrics_->audio_sent_packets_, 1);
+            PublishMetrics::Add(metrics_->audio_sent_bytes_, size);
+        }
+    }
     if(ret < 0) {
         msg_queue_->notify_msg2(MSG_RTSP_ERROR, ret);                   // 服务器断开时，这里就会报错例如Broken Pipe.
         char str_error[512] = {0};
@@ -349,10 +536,127 @@ int RtspPusher::sendPacket(AVPacket *pkt, MediaType media_type)
         LogError("av_write_frame failed: %s", str_error);               // 出错没有回调给PushWork？？？ 没有？？？
         return -1;
     }
+    if(!startup_reported_) {
+        reportStartup(media_type);
+    }
 
     return 0;
 }
 
+/**
+ * @brief 起播前的过滤。第一个视频关键帧之前的视频不能解码，直接丢弃；
+ *          音频以第一个关键帧的pts对齐，因为队列中的音视频不是严格按pts排序的，关键帧之后取出的音频也可能早于关键帧，同样丢弃。
+ * @param pkt 从队列取出的包。
+ * @param media_type 包类型。
+ * @return true 发送，false 丢弃。
+ */
+bool RtspPusher::checkStartup(AVPacket *pkt, MediaType media_type)
+{
+    if(started_) {
+        if(E_AUDIO_TYPE == media_type && video_stream_ && pkt->pts < first_key_pts_) {
+            startup_dropped_++;
+            return false;
+        }
+        return true;
+    }
+    if(E_VIDEO_TYPE == media_type && (pkt->flags & AV_PKT_FLAG_KEY)) {
+        started_ = true;
+        first_key_pts_ = pkt->pts;
+        LogInfo("first key frame pts: %lld, dropped %d packets before it", first_key_pts_, startup_dropped_);
+        return true;
+    }
+    startup_dropped_++;
+    return false;
+}
+
+/**
+ * @brief 保留当前GOP的视频包(pts单位ms)，遇到关键帧时清空重新开始，还没遇到关键帧时不保留。
+ * @param pkt 将要发送的视频包，不接管。
+ * @return void。
+ */
+void RtspPusher::cacheGop(AVPacket *pkt)
+{
+    if(pkt->flags & AV_PKT_FLAG_KEY) {
+        while(!gop_cache_.empty()) {
+            av_packet_free(&gop_cache_.front());
+            gop_cache_.pop_front();
+        }
+    } else if(gop_cache_.empty()) {
+        return;
+    }
+    AVPacket *clone = av_packet_clone(pkt);                 // 只增加引用计数
+    if(clone) {
+        PUSH_ALLOC("gop_cache_clone", sizeof(AVPacket));
+        gop_cache_.push_back(clone);
+    }
+}
+
+/**
+ * @brief 主连接故障后，等备用连接准备好就切换：交换连接，然后从保留的GOP的关键帧开始重发，不需要等编码器的下一个关键帧。
+ *          原来的主连接由备用连接线程关闭，并重新连接作为新的备用。
+ * @return void。
+ */
+void RtspPusher::checkFailover()
+{
+    if(!failover_pending_ || !standby_->IsReady()) {
+        return;
+    }
+    RtspOutput output;
+    output.fmt_ctx = fmt_ctx_;
+    output.timer = timer_;
+    output.video_stream = video_stream_;
+    output.audio_stream = audio_stream_;
+    output.url = url_;
+    timer_->SetPacer(NULL);                                 // 原来的主连接交给备用线程后不能再使用平滑器
+    timer_->SetStallLimit(0);                               // 由备用线程按timeout关闭
+    if(standby_->TakeOver(&output) != RET_OK) {
+        timer_->SetPacer(pacer_);
+        return;
+    }
+    fmt_ctx_ = output.fmt_ctx;
+    timer_ = output.timer;
+    timer_->SetPacer(pacer_);
+    video_stream_ = output.video_stream;
+    audio_stream_ = output.audio_stream;
+    url_ = output.url;
+    failover_pending_ = false;
+    if(metrics_) {
+        PublishMetrics::Add(metrics_->reconnects_, 1);
+    }
+
+    // 重发保留的GOP，sendPacket会把它们重新放进gop_cache_
+    std::deque<AVPacket *> gop;
+    gop.swap(gop_cache_);
+    int resend = (int)gop.size();
+    while(!gop.empty()) {
+        AVPacket *pkt = gop.front();
+        gop.pop_front();
+        if(sendPacket(pkt, E_VIDEO_TYPE) < 0) {
+            LogError("resend gop failed");
+        }
+        av_packet_free(&pkt);
+    }
+    int failover_time = (int)(TimesUtil::GetTimeMillisecond() - failover_begin_time_);
+    LogWarn("failover to %s, resend %d video packets, failover time: %dms", url_.c_str(), resend, failover_time);
+    msg_queue_->notify_msg3(MSG_RTSP_FAILOVER, failover_time, resend);
+}
+
+/**
+ * @brief 第一个视频关键帧(纯音频时为第一个音频包)发送成功后，通过消息队列上报起播耗时。
+ * @param media_type 刚发送成功的包类型。
+ * @return void。
+ */
+void RtspPusher::reportStartup(MediaType media_type)
+{
+    if(E_VIDEO_TYPE != media_type && video_stream_) {
+        return;
+    }
+    startup_reported_ = true;
+    int first_key_time = (int)(TimesUtil::GetTimeMillisecond() - connect_begin_time_);
+    LogInfo("startup: connect %dms, first key frame sent %dms", connect_time_, first_key_time);
+    msg_queue_->notify_msg3(MSG_RTSP_STARTUP, connect_time_, first_key_time);
+}
+
 /**
  * @brief   配置视频流信息，从传入的编码器上下文中拷贝该编码器上下文到流中，然后保存该编码器上下文，也会把new出来的流保存。
  * @param   传入的编码器上下文，用于初始化流信息。
@@ -401,7 +705,14 @@ RET_CODE RtspPusher::ConfigAudioStream(const AVCodecContext *ctx)
         LogError("ctx is null");
         return RET_FAIL;
     }
-    // 添加视频流
+    // RFC 7587：opus的RTP时钟固定为48000，sdp固定写opus/48000/2，而ffmpeg的RTP封装按采样率设置时间基，
+    // 所以只能推48khz的opus；并且只支持单流(最多2个通道)，双声道时ffmpeg会在sdp中写入sprop-stereo=1。
+    if(AV_CODEC_ID_OPUS == ctx->codec_id && (ctx->sample_rate != 48000 || ctx->channels > 2)) {
+        LogError("opus over rtp needs 48000hz and at most 2 channels, sample_rate: %d, channels: %d",
+                 ctx->sample_rate, ctx->channels);
+        return RET_ERR_NOT_SUPPORT;
+    }
+    // 添加音频流
     AVStream *as = avformat_new_stream(fmt_ctx_, NULL);
     if(!as) {
         LogError("avformat_new_stream failed");
@@ -1,10 +1,15 @@
 ﻿#ifndef RTSPPUSHER_H
 #define RTSPPUSHER_H
 
+#include <deque>
 #include "mediabase.h"
 #include "commonlooper.h"
 #include "packetqueue.h"
 #include "messagequeue.h"
+#include "sendpacer.h"
+#include "publishmetrics.h"
+#include "packetspiller.h"
+#include "rtspstandby.h"
 extern "C" {
 #include "libavformat/avformat.h"
 #include "libavformat/avio.h"
@@ -38,6 +43,9 @@ public:
     int GetTimeout();
     int64_t GetBlockTime();
 
+    void GetPacerStats(SendPacerStats *stats);      // 获取发送平滑器的统计信息，没开启平滑时统计全为0
+    void SetMetrics(PublishMetrics *metrics);       // 设置运行指标，需要在Connect之前设置，NULL不统计
+
 private:
     int64_t pre_debug_time_ = 0;                    // 定时打印队列信息的起始时间，默认0开始即可。
     int64_t debug_interval_ = 2000;                 // 定时打印队列状态信息的间隔，这里默认是2s。
@@ -45,6 +53,10 @@ private:
     // 监测队列的缓存情况
     void checkPacketQueueDuration();
     int sendPacket(AVPacket *pkt, MediaType media_type);
+    bool checkStartup(AVPacket *pkt, MediaType media_type); // 起播前的过滤，返回false表示该包需要丢弃
+    void cacheGop(AVPacket *pkt);                   // 保留当前GOP，切换到备用连接后从关键帧开始重发
+    void checkFailover();
+    void reportStartup(MediaType media_type);       // 第一个关键帧发出后上报起播耗时
 
     // 整个输出流的上下文
     AVFormatContext *fmt_ctx_  = NULL;
@@ -70,9 +82,44 @@ private:
     // 队列最大限制时长
     int max_queue_duration_ = 500;                  // 默认500ms或者100ms两三帧也行，看情况。
 
+    // 发送平滑
+    SendPacer *pacer_ = NULL;                       // 为NULL时不平滑，开启时挂在timer_上，切换连接时跟着转移
+    int pacing_enable_ = 0;
+    int pacing_multiple_ = 150;                     // 平滑发送码率相对于目标码率的倍数，百分比
+    int pacing_max_delay_ = 500;                    // 一帧在发送过程中的最大平滑等待时长，单位毫秒
+    int audio_bitrate_ = 0;                         // 音视频的目标码率，用于计算平滑的发送码率
+    int video_bitrate_ = 0;
+
+    // 磁盘溢出缓存，长时间断网时代替Drop
+    PacketSpiller *spiller_ = NULL;                 // 为NULL时不溢出，队列超时长后drop
+    int spill_enable_ = 0;
+    std::string spill_file_ = "rtsp_spill.dat";
+    int spill_file_size_mb_ = 256;
+    int spill_memory_threshold_kb_ = 4096;          // 内存队列超过该大小后开始溢出到文件
+    int spill_catchup_percent_ = 200;               // 链路恢复后的追赶速度，实时速度的百分比
+
+    PublishMetrics *metrics_ = NULL;                // 运行指标，由外部管理
+
+    // 快速起播，从第一个带sps、pps的关键帧开始发送
+    bool started_ = false;                          // 是否已经取到第一个视频关键帧
+    bool startup_reported_ = false;                 // 是否已经上报了起播耗时
+    int64_t first_key_pts_ = 0;                     // 第一个关键帧的pts，早于它的音频丢弃，保证音视频从同一时刻开始
+    int64_t connect_begin_time_ = 0;                // 开始连接服务器的时间
+    int connect_time_ = 0;                          // avformat_write_header的耗时，单位ms
+    int startup_dropped_ = 0;                       // 起播前丢弃的包数
+
+    // 热备连接，主连接写失败或者卡住时切换
+    RtspStandby *standby_ = NULL;                   // 为NULL时不开启
+    std::string standby_url_ = "";
+    int standby_keepalive_interval_ = 1000;         // 备用连接保活的间隔，单位ms
+    int failover_stall_time_ = 1000;                // 一次av_write_frame超过该时长认为主连接卡住，单位ms，备用连接可用时在中断回调中中断写帧
+    bool failover_pending_ = false;                 // 主连接已经故障，等备用连接准备好后切换
+    int64_t failover_begin_time_ = 0;               // 检测到故障的时间
+    std::deque<AVPacket *> gop_cache_;              // 当前GOP已经发送的视频包，第一个是关键帧，pts单位ms
+
     // 处理超时
     int timeout_;
-    int64_t pre_time_ = 0;                          // 记录调用ffmpeg api之前的时间，防止api卡死
+    InterruptTimer *timer_ = NULL;                  // 防止api卡死，跟随fmt_ctx_，切换连接时一起交换
     MessageQueue *msg_queue_ = NULL;                // 消息队列，这里由构造初始化，浅拷贝，所以应当由外部释放，析构不处理
 };
 
@@ -0,0 +1,941 @@
+﻿#include <stdio.h>
+#include "rtspserver.h"
+#include "nalparser.h"
+#include "dlog.h"
+extern "C" {
+#include <libavutil/base64.h>
+}
+#ifdef __linux__
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#endif
+
+#define RTSP_SERVER_MAX_REQUEST 8192                    // 请求头与body各自的上限，超过时关闭连接
+#define RTSP_SERVER_MAX_RECV    (4 + 65535)             // 一次最多缓存的接收数据，tcp方式的RTCP最长4+65535字节
+
+RtspServer::RtspServer()
+{
+    memset(&stats_, 0, sizeof(RtspServerStats));
+}
+
+RtspServer::~RtspServer()
+{
+    DeInit();
+}
+
+/**
+ * @brief 配置视频轨道，从编码器上下文的extradata(Annex-B或avcC格式)中读取sps、pps用于生成SDP。
+ * @param ctx H264编码器上下文，需要设置AV_CODEC_FLAG_GLOBAL_HEADER。
+ * @return 成功 0 失败 other
+ */
+RET_CODE RtspServer::ConfigVideoStream(const AVCodecContext *ctx)
+{
+    if(!ctx || ctx->codec_id != AV_CODEC_ID_H264 || !ctx->extradata) {
+        LogError("only h264 with extradata is supported");
+        return RET_ERR_NOT_SUPPORT;
+    }
+    std::vector<NalUnit> param_sets;
+    int length_size = 0;
+    NalParser::ParseExtradata(ctx->extradata, ctx->extradata_size, NAL_CODEC_H264, &param_sets, &length_size);
+    for(size_t i = 0; i < param_sets.size(); i++) {
+        const NalUnit &nal = param_sets[i];
+        char base64[512] = {0};
+        if(AV_BASE64_SIZE(nal.size) <= (int)sizeof(base64)) {
+            av_base64_encode(base64, sizeof(base64), nal.data, nal.size);
+            if(7 == nal.type && nal.size >= 4) {
+                char profile[8];
+                snprintf(profile, sizeof(profile), "%02X%02X%02X", nal.data[1], nal.data[2], nal.data[3]);
+                profile_level_id_ = profile;
+                sprop_sps_ = base64;
+            } else if(8 == nal.type) {
+                sprop_pps_ = base64;
+            }
+        }
+    }
+    if(sprop_sps_.empty() || sprop_pps_.empty()) {
+        LogError("sps or pps not found in extradata");
+        return RET_FAIL;
+    }
+
+    Properties properties;
+    properties.SetProperty("codec", "h264");
+    properties.SetProperty("payload_type", 96);
+    properties.SetProperty("clock_rate", 90000);
+    properties.SetProperty("channel", 0);
+    properties.SetProperty("mtu", mtu_);
+    if(packetizer_[0].Init(properties) != RET_OK) {
+        return RET_FAIL;
+    }
+    has_track_[0] = true;
+    return RET_OK;
+}
+
+/**
+ * @brief 配置音频轨道。aac的extradata中有AudioSpecificConfig就直接使用，否则按AAC LC生成；opus按RFC 7587，时钟固定48000。
+ * @param ctx AAC或者Opus编码器上下文。
+ * @return 成功 0 失败 other
+ */
+RET_CODE RtspServer::ConfigAudioStream(const AVCodecContext *ctx)
+{
+    if(!ctx || (ctx->codec_id != AV_CODEC_ID_AAC && ctx->codec_id != AV_CODEC_ID_OPUS)) {
+        LogError("only aac and opus are supported");
+        return RET_ERR_NOT_SUPPORT;
+    }
+    audio_codec_id_ = ctx->codec_id;
+    audio_sample_rate_ = ctx->sample_rate;
+    audio_channels_ = ctx->channels;
+    if(AV_CODEC_ID_OPUS == audio_codec_id_) {
+        if(audio_sample_rate_ != 48000 || audio_channels_ > 2) {
+            LogError("opus over rtp needs 48000hz and at most 2 channels");
+            return RET_ERR_NOT_SUPPORT;
+        }
+        Properties properties;
+        properties.SetProperty("codec", "opus");
+        properties.SetProperty("payload_type", 97);
+        properties.SetProperty("clock_rate", 48000);
+        properties.SetProperty("channel", 2);
+        properties.SetProperty("mtu", mtu_);
+        if(packetizer_[1].Init(properties) != RET_OK) {
+            return RET_FAIL;
+        }
+        has_track_[1] = true;
+        return RET_OK;
+    }
+    char config[64] = {0};
+    if(ctx->extradata && ctx->extradata_size >= 2 && ctx->extradata_size < 16) {
+        for(int i = 0; i < ctx->extradata_size; i++) {
+            snprintf(config + i * 2, 3, "%02X", ctx->extradata[i]);
+        }
+    } else {
+        static const int sample_rates[] = {96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+                                           16000, 12000, 11025, 8000, 7350};
+        int freq_idx = 4;
+        for(int i = 0; i < 13; i++) {
+            if(sample_rates[i] == audio_sample_rate_) {
+                freq_idx = i;
+            }
+        }
+        int object_type = 2;                            // AAC LC
+        snprintf(config, sizeof(config), "%02X%02X", (object_type << 3) | (freq_idx >> 1),
+                 ((freq_idx & 1) << 7) | (audio_channels_ << 3));
+    }
+    aac_config_ = config;
+
+    Properties properties;
+    properties.SetProperty("codec", "aac");
+    properties.SetProperty("payload_type", 97);
+    properties.SetProperty("clock_rate", audio_sample_rate_);
+    properties.SetProperty("channel", 2);
+    properties.SetProperty("mtu", mtu_);
+    if(packetizer_[1].Init(properties) != RET_OK) {
+        return RET_FAIL;
+    }
+    has_track_[1] = true;
+    return RET_OK;
+}
+
+std::string RtspServer::buildSdp()
+{
+    char buf[2048];
+    std::string sdp = "v=0\r\n"
+                      "o=- 0 0 IN IP4 127.0.0.1\r\n"
+                      "s=9-11-rtsp-publish\r\n"
+                      "c=IN IP4 0.0.0.0\r\n"
+                      "t=0 0\r\n"
+                      "a=control:*\r\n";
+    if(has_track_[0]) {
+        snprintf(buf, sizeof(buf),
+                 "m=video 0 RTP/AVP 96\r\n"
+                 "a=rtpmap:96 H264/90000\r\n"
+                 "a=fmtp:96 packetization-mode=1;profile-level-id=%s;sprop-parameter-sets=%s,%s\r\n"
+                 "a=control:trackID=0\r\n",
+                 profile_level_id_.c_str(), sprop_sps_.c_str(), sprop_pps_.c_str());
+        sdp += buf;
+    }
+    if(has_track_[1] && AV_CODEC_ID_OPUS == audio_codec_id_) {
+        // RFC 7587：rtpmap固定写opus/48000/2，实际的通道数用sprop-stereo说明
+        snprintf(buf, sizeof(buf),
+                 "m=audio 0 RTP/AVP 97\r\n"
+                 "a=rtpmap:97 opus/48000/2\r\n"
+                 "a=fmtp:97 sprop-stereo=%d\r\n"
+                 "a=control:trackID=1\r\n",
+                 audio_channels_ == 2 ? 1 : 0);
+        sdp += buf;
+    } else if(has_track_[1]) {
+        snprintf(buf, sizeof(buf),
+                 "m=audio 0 RTP/AVP 97\r\n"
+                 "a=rtpmap:97 MPEG4-GENERIC/%d/%d\r\n"
+                 "a=fmtp:97 streamtype=5;profile-level-id=1;mode=AAC-hbr;sizelength=13;indexlength=3;indexdeltalength=3;config=%s\r\n"
+                 "a=control:trackID=1\r\n",
+                 audio_sample_rate_, audio_channels_, aac_config_.c_str());
+        sdp += buf;
+    }
+    return sdp;
+}
+
+/**
+ * @brief 编码线程调用，把一帧打包成RTP后放进收件箱，由服务器线程分发给各个客户端。
+ *          没有客户端在播放时直接返回。同一个轨道只能在一个线程中Push。
+ * @param pkt 编码后的包，pts单位ms，不接管。
+ * @param media_type 包类型。
+ * @return 成功 0 失败 other
+ */
+RET_CODE RtspServer::Push(const AVPacket *pkt, MediaType media_type)
+{
+    int track = (E_VIDEO_TYPE == media_type) ? 0 : 1;
+    if(!pkt || (media_type != E_VIDEO_TYPE && media_type != E_AUDIO_TYPE) || !has_track_[track]) {
+        return RET_FAIL;
+    }
+    if(playing_clients_.load() <= 0 || event_fd_ < 0) {
+        return RET_OK;
+    }
+    AVPacket *rtp = packetizer_[track].Packetize(pkt);
+    if(!rtp) {
+        return RET_FAIL;
+    }
+    {
+        std::lock_guard<PushMutex> lock(inbox_mutex_);
+        MyAVPacket mypkt;
+        mypkt.pkt = rtp;
+        mypkt.media_type = media_type;
+        inbox_.push_back(mypkt);
+    }
+#ifdef __linux__
+    uint64_t one = 1;
+    if(write(event_fd_, &one, sizeof(one)) < 0) {
+        // eventfd计数溢出才会失败，此时服务器线程肯定会被唤醒，忽略即可
+    }
+#endif
+    return RET_OK;
+}
+
+void RtspServer::GetStats(RtspServerStats *stats)
+{
+    if(!stats) {
+        return;
+    }
+    std::lock_guard<PushMutex> lock(stats_mutex_);
+    *stats = stats_;
+}
+
+#ifdef __linux__
+
+static void set_non_blocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * @brief 创建监听socket、rtp/rtcp的UDP socket与epoll。
+ * @param "port"                rtsp端口，默认8554
+ *        "path"                流的路径，默认live，即rtsp://ip:8554/live
+ *        "rtp_port"            服务器UDP起始端口，需要4个连续端口，默认30000
+ *        "max_clients"         最大客户端数，默认64
+ *        "client_queue_kb"     每个客户端发送队列的最大大小，默认2048KB
+ *        "mtu"                 RTP负载的最大字节数，默认1400
+ * @return 成功 0 失败 other
+ */
+RET_CODE RtspServer::Init(const Properties &properties)
+{
+    port_               = properties.GetProperty("port", 8554);
+    path_               = properties.GetProperty("path", "live");
+    rtp_port_           = properties.GetProperty("rtp_port", 30000);
+    max_clients_        = properties.GetProperty("max_clients", 64);
+    client_queue_max_   = properties.GetProperty("client_queue_kb", 2048) * 1024;
+    mtu_                = properties.GetProperty("mtu", 1400);
+
+    epoll_fd_ = epoll_create1(0);
+    event_fd_ = eventfd(0, EFD_NONBLOCK);
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if(epoll_fd_ < 0 || event_fd_ < 0 || listen_fd_ < 0) {
+        LogError("create epoll/eventfd/socket failed: %d", errno);
+        return RET_FAIL;
+    }
+    int on = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port_);
+    if(bind(listen_fd_, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd_, 64) < 0) {
+        LogError("bind or listen port %d failed: %d", port_, errno);
+        return RET_FAIL;
+    }
+    set_non_blocking(listen_fd_);
+
+    for(int i = 0; i < RTSP_SERVER_TRACKS * 2; i++) {
+        udp_fd_[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        addr.sin_port = htons(rtp_port_ + i);
+        if(udp_fd_[i] < 0 || bind(udp_fd_[i], (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            LogError("bind udp port %d failed: %d", rtp_port_ + i, errno);
+            return RET_FAIL;
+        }
+        int sndbuf = 4 * 1024 * 1024;
+        setsockopt(udp_fd_[i], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        set_non_blocking(udp_fd_[i]);
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+    ev.data.fd = event_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev);
+    for(int i = 0; i < RTSP_SERVER_TRACKS * 2; i++) {
+        ev.data.fd = udp_fd_[i];
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, udp_fd_[i], &ev);   // 只是把客户端发来的RTCP读掉
+    }
+    LogInfo("rtsp server listen on rtsp://0.0.0.0:%d/%s, rtp port: %d-%d", port_, path_.c_str(),
+            rtp_port_, rtp_port_ + RTSP_SERVER_TRACKS * 2 - 1);
+    return RET_OK;
+}
+
+RET_CODE RtspServer::Start()
+{
+    if(epoll_fd_ < 0 || (!has_track_[0] && !has_track_[1])) {
+        LogError("rtsp server not init or no track");
+        return RET_FAIL;
+    }
+    return CommonLooper::Start();
+}
+
+void RtspServer::DeInit()
+{
+    Stop();
+    while(!clients_.empty()) {
+        closeClient(clients_.begin()->second);
+    }
+    {
+        std::lock_guard<PushMutex> lock(inbox_mutex_);
+        while(!inbox_.empty()) {
+            av_packet_free(&inbox_.front().pkt);
+            inbox_.pop_front();
+        }
+    }
+    int *fds[] = {&listen_fd_, &event_fd_, &udp_fd_[0], &udp_fd_[1], &udp_fd_[2], &udp_fd_[3], &epoll_fd_};
+    for(size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if(*fds[i] >= 0) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
+
+/**
+ * @brief 服务器线程，所有的socket都是非阻塞的，epoll等待最多100ms，以便及时响应Stop。
+ *          有UDP客户端因为发送缓冲区满而没发完时，等待时间缩短到5ms后重试。
+ * @return void。
+ */
+void RtspServer::Loop()
+{
+    LogInfo("rtsp server loop into");
+    struct epoll_event events[64];
+    bool udp_pending = false;
+    pre_stats_time_ = TimesUtil::GetTimeMillisecond();
+    while(!request_abort_)
+    {
+        int n = epoll_wait(epoll_fd_, events, 64, udp_pending ? 5 : 100);
+        if(n < 0 && errno != EINTR) {
+            LogError("epoll_wait failed: %d", errno);
+            break;
+        }
+        for(int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if(fd == listen_fd_) {
+                acceptClients();
+            } else if(fd == event_fd_) {
+                uint64_t count;
+                if(read(event_fd_, &count, sizeof(count)) < 0) {
+                    // 已经被读过了，忽略
+                }
+                dispatchInbox();
+            } else if(clients_.count(fd)) {
+                RtspClient *client = clients_[fd];
+                if(events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    closeClient(client);
+                    continue;
+                }
+                if(events[i].events & EPOLLIN) {
+                    readClient(client);
+                    if(!clients_.count(fd)) {
+                        continue;
+                    }
+                }
+                if((events[i].events & EPOLLOUT) && !flushClient(client)) {
+                    closeClient(client);
+                }
+            } else {
+                char buf[1500];
+                while(recv(fd, buf, sizeof(buf), 0) > 0) {
+                    // 客户端的RTCP包，不处理
+                }
+            }
+        }
+
+        // UDP发送缓冲区满时没发完的包，这里重试
+        udp_pending = false;
+        for(std::map<int, RtspClient *>::iterator it = clients_.begin(); it != clients_.end(); ) {
+            RtspClient *client = it->second;
+            it++;
+            if(client->playing && !client->queue.empty() && !client->want_write) {
+                if(!flushClient(client)) {
+                    closeClient(client);
+                    continue;
+                }
+                udp_pending |= !client->queue.empty() && !client->want_write;
+            }
+        }
+        logStats();
+    }
+    LogInfo("rtsp server loop leave");
+}
+
+void RtspServer::acceptClients()
+{
+    while(true)
+    {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int fd = accept(listen_fd_, (struct sockaddr *)&addr, &len);
+        if(fd < 0) {
+            break;
+        }
+        if((int)clients_.size() >= max_clients_) {
+            LogWarn("too many rtsp clients: %d", (int)clients_.size());
+            close(fd);
+            continue;
+        }
+        set_non_blocking(fd);
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        RtspClient *client = new RtspClient();
+        client->fd = fd;
+        client->addr = addr;
+        client->send_pos = 0;
+        client->playing = false;
+        client->wait_key = true;
+        client->close_after_send = false;
+        client->want_write = false;
+        memset(client->tracks, 0, sizeof(client->tracks));
+        client->queue_bytes = 0;
+        client->offset = 0;
+        clients_[fd] = client;
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+        LogInfo("rtsp client connect: %s:%d, clients: %d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port),
+                (int)clients_.size());
+    }
+    std::lock_guard<PushMutex> lock(stats_mutex_);
+    stats_.clients = clients_.size();
+}
+
+void RtspServer::closeClient(RtspClient *client)
+{
+    LogInfo("rtsp client close: %s:%d", inet_ntoa(client->addr.sin_addr), ntohs(client->addr.sin_port));
+    if(client->playing) {
+        playing_clients_--;
+    }
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    clearQueue(client, false);
+    clients_.erase(client->fd);
+    delete client;
+
+    std::lock_guard<PushMutex> lock(stats_mutex_);
+    stats_.clients = clients_.size();
+    stats_.playing_clients = playing_clients_.load();
+}
+
+void RtspServer::clearQueue(RtspClient *client, bool keep_partial)
+{
+    while(!client->queue.empty()) {
+        if(keep_partial && client->queue.size() == 1 && client->offset > 0) {
+            break;                                      // 队头的帧发了一半，必须发完，否则interleaved数据会错乱
+        }
+        MyAVPacket &mypkt = client->queue.back();
+        client->queue_bytes -= mypkt.pkt->size;
+        av_packet_free(&mypkt.pkt);
+        client->queue.pop_back();
+    }
+    if(client->queue.empty()) {
+        client->offset = 0;
+    }
+}
+
+void RtspServer::updateWrite(RtspClient *client, bool want_write)
+{
+    if(client->want_write == want_write) {
+        return;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (uint32_t)EPOLLIN | (want_write ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.fd = client->fd;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, client->fd, &ev);
+    client->want_write = want_write;
+}
+
+void RtspServer::readClient(RtspClient *client)
+{
+    char buf[4096];
+    while(client->recv_buf.size() < RTSP_SERVER_MAX_RECV) {     // 水平触发，没读完的下次再读
+        int n = recv(client->fd, buf, sizeof(buf), 0);
+        if(n > 0) {
+            client->recv_buf.append(buf, n);
+            continue;
+        }
+        if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            closeClient(client);
+            return;
+        }
+        break;
+    }
+
+    while(!client->recv_buf.empty())
+    {
+        std::string &data = client->recv_buf;
+        if(data[0] == '$') {
+            // tcp方式下客户端发来的RTCP，跳过
+            if(data.size() < 4) {
+                break;
+            }
+            size_t len = ((uint8_t)data[2] << 8) | (uint8_t)data[3];
+            if(data.size() < 4 + len) {
+                break;
+            }
+            data.erase(0, 4 + len);
+            continue;
+        }
+        size_t header_end = data.find("\r\n\r\n");
+        if(header_end == std::string::npos || header_end > RTSP_SERVER_MAX_REQUEST) {
+            if(data.size() > RTSP_SERVER_MAX_REQUEST) {
+                closeClient(client);
+                return;
+            }
+            break;
+        }
+        size_t content_length = 0;
+        size_t pos = data.find("Content-Length:");
+        if(pos != std::string::npos && pos < header_end) {
+            // 负数或者过大时会一直等body，缓存也会一直增长，直接关闭
+            const char *value = data.c_str() + pos + 15;
+            char *value_end = NULL;
+            long length = strtol(value, &value_end, 10);
+            if(value_end == value || length < 0 || length > RTSP_SERVER_MAX_REQUEST) {
+                LogWarn("rtsp client fd %d invalid Content-Length, close", client->fd);
+                closeClient(client);
+                return;
+            }
+            content_length = (size_t)length;
+        }
+        if(data.size() < header_end + 4 + content_length) {
+            break;
+        }
+        std::string request = data.substr(0, header_end + 4);
+        data.erase(0, header_end + 4 + content_length);
+        if(!handleRequest(client, request)) {
+            closeClient(client);
+            return;
+        }
+    }
+    if(!flushClient(client)) {
+        closeClient(client);
+    }
+}
+
+static std::string get_header(const std::string &request, const char *name)
+{
+    std::string key = std::string("\r\n") + name + ":";
+    size_t pos = request.find(key);
+    if(pos == std::string::npos) {
+        return "";
+    }
+    pos += key.size();
+    while(pos < request.size() && request[pos] == ' ') {
+        pos++;
+    }
+    size_t end = request.find("\r\n", pos);
+    return request.substr(pos, end - pos);
+}
+
+/**
+ * @brief 取出请求url的路径部分，rtsp://host:port/live/?a=b 返回 /live。
+ *          去掉查询参数和末尾的'/'，DESCRIBE与SETUP用它和配置的路径完整比较。
+ */
+static std::string get_url_path(const std::string &url)
+{
+    size_t begin = 0;
+    size_t scheme = url.find("://");
+    if(scheme != std::string::npos) {
+        begin = url.find('/', scheme + 3);          // 跳过host:port
+        if(begin == std::string::npos) {
+            return "/";
+        }
+    }
+    size_t end = url.find_first_of("?#", begin);
+    std::string path = url.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+    while(path.size() > 1 && path[path.size() - 1] == '/') {
+        path.erase(path.size() - 1);
+    }
+    return path;
+}
+
+/**
+ * @brief 生成会话id，PLAY只凭它确认客户端，所以不能用rand()这类可以猜出来的值。
+ * @return 16个十六进制字符，读/dev/urandom失败时返回空。
+ */
+static std::string make_session_id()
+{
+    uint8_t random[8];
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return "";
+    }
+    ssize_t n = read(fd, random, sizeof(random));
+    close(fd);
+    if(n != (ssize_t)sizeof(random)) {
+        return "";
+    }
+    char session[sizeof(random) * 2 + 1];
+    for(size_t i = 0; i < sizeof(random); i++) {
+        snprintf(session + i * 2, 3, "%02X", random[i]);
+    }
+    return session;
+}
+
+void RtspServer::reply(RtspClient *client, int code, const char *reason, const std::string &cseq,
+                       const std::string &headers, const std::string &body)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "RTSP/1.0 %d %s\r\nCSeq: %s\r\nServer: 9-11-rtsp-publish\r\n", code, reason, cseq.c_str());
+    client->send_buf += line;
+    client->send_buf += headers;
+    if(!body.empty()) {
+        snprintf(line, sizeof(line), "Content-Length: %d\r\n", (int)body.size());
+        client->send_buf += line;
+    }
+    client->send_buf += "\r\n";
+    client->send_buf += body;
+}
+
+/**
+ * @brief 处理一个rtsp请求，应答放进send_buf。
+ * @return false表示请求格式错误，需要关闭连接。
+ */
+bool RtspServer::handleRequest(RtspClient *client, const std::string &request)
+{
+    size_t sp1 = request.find(' ');
+    size_t sp2 = request.find(' ', sp1 + 1);
+    if(sp1 == std::string::npos || sp2 == std::string::npos) {
+        return false;
+    }
+    std::string method = request.substr(0, sp1);
+    std::string url = request.substr(sp1 + 1, sp2 - sp1 - 1);
+    std::string cseq = get_header(request, "CSeq");
+    std::string session_header = "Session: " + client->session + ";timeout=60\r\n";
+
+    if(method == "OPTIONS") {
+        reply(client, 200, "OK", cseq, "Public: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN, GET_PARAMETER\r\n", "");
+    } else if(method == "DESCRIBE") {
+        if(get_url_path(url) != "/" + path_) {
+            reply(client, 404, "Not Found", cseq, "", "");
+            return true;
+        }
+        std::string base = url;
+        if(base.empty() || base[base.size() - 1] != '/') {
+            base += "/";
+        }
+        reply(client, 200, "OK", cseq, "Content-Base: " + base + "\r\nContent-Type: application/sdp\r\n", buildSdp());
+    } else if(method == "SETUP") {
+        // url是Content-Base加上a=control，即/路径/trackID=n，路径与DESCRIBE一样完整比较
+        std::string path = get_url_path(url);
+        size_t slash = path.rfind('/');
+        std::string base = slash == 0 ? "/" : path.substr(0, slash == std::string::npos ? 0 : slash);
+        int track = -1;
+        if(slash != std::string::npos && base == "/" + path_ && path.compare(slash + 1, 8, "trackID=") == 0) {
+            const char *value = path.c_str() + slash + 9;
+            char *value_end = NULL;
+            long id = strtol(value, &value_end, 10);
+            track = (value_end != value && *value_end == '\0') ? (int)id : -1;
+        }
+        if(track < 0 || track >= RTSP_SERVER_TRACKS || !has_track_[track]) {
+            reply(client, 404, "Not Found", cseq, "", "");
+            return true;
+        }
+        if(client->session.empty()) {
+            client->session = make_session_id();
+            if(client->session.empty()) {
+                LogError("rtsp server generate session id failed");
+                reply(client, 500, "Internal Server Error", cseq, "", "");
+                return true;
+            }
+            session_header = "Session: " + client->session + ";timeout=60\r\n";
+        }
+        std::string transport = get_header(request, "Transport");
+        RtspTrackTransport &tt = client->tracks[track];
+        char reply_transport[256];
+        if(transport.find("RTP/AVP/TCP") != std::string::npos || transport.find("interleaved") != std::string::npos) {
+            // 通道号由服务器决定，这样所有客户端可以共享带interleaved头的打包数据
+            tt.tcp = true;
+            snprintf(reply_transport, sizeof(reply_transport), "Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d;ssrc=%08X\r\n",
+                     packetizer_[track].GetChannel(), packetizer_[track].GetChannel() + 1, packetizer_[track].GetSsrc());
+        } else {
+            size_t pos = transport.find("client_port=");
+            if(pos == std::string::npos) {
+                reply(client, 461, "Unsupported Transport", cseq, "", "");
+                return true;
+            }
+            int client_port = atoi(transport.c_str() + pos + 12);
+            tt.tcp = false;
+            tt.rtp_addr = client->addr;
+            tt.rtp_addr.sin_port = htons(client_port);
+            snprintf(reply_transport, sizeof(reply_transport),
+                     "Transport: RTP/AVP;unicast;client_port=%d-%d;server_port=%d-%d;ssrc=%08X\r\n",
+                     client_port, client_port + 1, rtp_port_ + track * 2, rtp_port_ + track * 2 + 1,
+                     packetizer_[track].GetSsrc());
+        }
+        tt.setup = true;
+        reply(client, 200, "OK", cseq, std::string(reply_transport) + session_header, "");
+    } else if(method == "PLAY") {
+        if(client->session.empty() || get_header(request, "Session").find(client->session) != 0) {
+            reply(client, 454, "Session Not Found", cseq, "", "");
+            return true;
+        }
+        if(!client->playing) {
+            client->playing = true;
+            client->wait_key = true;                    // 从下一个视频关键帧开始发送
+            playing_clients_++;
+            std::lock_guard<PushMutex> lock(stats_mutex_);
+            stats_.playing_clients = playing_clients_.load();
+        }
+        reply(client, 200, "OK", cseq, session_header + "Range: npt=0.000-\r\n", "");
+    } else if(method == "TEARDOWN") {
+        reply(client, 200, "OK", cseq, session_header, "");
+        client->close_after_send = true;
+    } else if(method == "GET_PARAMETER" || method == "SET_PARAMETER") {
+        reply(client, 200, "OK", cseq, session_header, "");     // 客户端的心跳
+    } else {
+        reply(client, 501, "Not Implemented", cseq, "", "");
+    }
+    return true;
+}
+
+void RtspServer::dispatchInbox()
+{
+    std::deque<MyAVPacket> packets;
+    {
+        std::lock_guard<PushMutex> lock(inbox_mutex_);
+        packets.swap(inbox_);
+    }
+    while(!packets.empty()) {
+        dispatchPacket(packets.front().pkt, packets.front().media_type);
+        av_packet_free(&packets.front().pkt);
+        packets.pop_front();
+    }
+}
+
+/**
+ * @brief 把一帧分发给所有正在播放的客户端，只增加引用计数，不拷贝数据。
+ * @return void。
+ */
+void RtspServer::dispatchPacket(AVPacket *pkt, MediaType media_type)
+{
+    int track = (E_VIDEO_TYPE == media_type) ? 0 : 1;
+    bool key = (E_VIDEO_TYPE == media_type) && (pkt->flags & AV_PKT_FLAG_KEY);
+    int64_t dropped = 0;
+    for(std::map<int, RtspClient *>::iterator it = clients_.begin(); it != clients_.end(); ) {
+        RtspClient *client = it->second;
+        it++;
+        if(!client->playing || !client->tracks[track].setup) {
+            continue;
+        }
+        if(client->wait_key) {
+            // 没有SETUP视频时不需要等关键帧
+            if(client->tracks[0].setup && !key) {
+                continue;
+            }
+            client->wait_key = false;
+        }
+        if(client->queue_bytes + pkt->size > client_queue_max_) {
+            // 客户端太慢，清空队列，等下一个关键帧
+            LogWarn("client %s:%d too slow, queue: %lld bytes, wait key frame", inet_ntoa(client->addr.sin_addr),
+                    ntohs(client->addr.sin_port), client->queue_bytes);
+            dropped += client->queue.size();
+            clearQueue(client, true);
+            client->wait_key = client->tracks[0].setup;
+            dropped++;
+            continue;
+        }
+        MyAVPacket mypkt;
+        mypkt.pkt = av_packet_clone(pkt);               // 只增加引用计数
+        mypkt.media_type = media_type;
+        if(!mypkt.pkt) {
+            continue;
+        }
+        PUSH_ALLOC("rtsp_server_clone", sizeof(AVPacket));
+        client->queue.push_back(mypkt);
+        client->queue_bytes += pkt->size;
+        if(!client->want_write && !flushClient(client)) {
+            closeClient(client);
+        }
+    }
+    if(dropped > 0) {
+        std::lock_guard<PushMutex> lock(stats_mutex_);
+        stats_.dropped_frames += dropped;
+    }
+}
+
+/**
+ * @brief 发送客户端的rtsp应答与发送队列中的帧。TCP写不完时注册EPOLLOUT，UDP发送缓冲区满时留到下次重试。
+ * @return false表示连接出错需要关闭。
+ */
+bool RtspServer::flushClient(RtspClient *client)
+{
+    int64_t sent_bytes = 0;
+    int64_t sent_frames = 0;
+    bool blocked = false;
+    while(!blocked)
+    {
+        // 1 rtsp应答只能在两帧之间发送
+        if(client->offset == 0 && client->send_pos < client->send_buf.size()) {
+            int n = send(client->fd, client->send_buf.data() + client->send_pos,
+                         client->send_buf.size() - client->send_pos, MSG_NOSIGNAL);
+            if(n < 0) {
+                if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                    return false;
+                }
+                blocked = true;
+                break;
+            }
+            client->send_pos += n;
+            if(client->send_pos < client->send_buf.size()) {
+                blocked = true;
+                break;
+            }
+            client->send_buf.clear();
+            client->send_pos = 0;
+        }
+        if(client->close_after_send) {
+            return false;
+        }
+        if(client->queue.empty()) {
+            break;
+        }
+
+        // 2 发送队头的帧
+        MyAVPacket &mypkt = client->queue.front();
+        int track = (E_VIDEO_TYPE == mypkt.media_type) ? 0 : 1;
+        RtspTrackTransport &tt = client->tracks[track];
+        uint8_t *data = mypkt.pkt->data;
+        int size = mypkt.pkt->size;
+        if(tt.tcp) {
+            int n = send(client->fd, data + client->offset, size - client->offset, MSG_NOSIGNAL);
+            if(n < 0) {
+                if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                    return false;
+                }
+                updateWrite(client, true);
+                blocked = true;
+                break;
+            }
+            client->offset += n;
+            sent_bytes += n;
+        } else {
+            int udp_fd = udp_fd_[track * 2];
+            while(client->offset < size) {
+                int rtp_size = (data[client->offset + 2] << 8) | data[client->offset + 3];
+                int n = sendto(udp_fd, data + client->offset + RTP_INTERLEAVED_SIZE, rtp_size, 0,
+                               (struct sockaddr *)&tt.rtp_addr, sizeof(tt.rtp_addr));
+                if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    blocked = true;                     // 由Loop稍后重试
+                    break;
+                }
+                client->offset += RTP_INTERLEAVED_SIZE + rtp_size;  // 其它错误(例如ICMP不可达)直接跳过该包
+                sent_bytes += rtp_size;
+            }
+        }
+        if(client->offset >= size) {
+            client->queue_bytes -= size;
+            av_packet_free(&mypkt.pkt);
+            client->queue.pop_front();
+            client->offset = 0;
+            sent_frames++;
+        }
+    }
+    if(!blocked) {
+        updateWrite(client, false);
+    } else if(client->send_pos < client->send_buf.size() && client->offset == 0) {
+        updateWrite(client, true);
+    }
+    if(sent_bytes > 0) {
+        std::lock_guard<PushMutex> lock(stats_mutex_);
+        stats_.sent_bytes += sent_bytes;
+        stats_.sent_frames += sent_frames;
+    }
+    return true;
+}
+
+/**
+ * @brief 每5秒打印一次服务器的状态，包括服务器线程的cpu占用，用于评估单核能带多少个客户端。
+ * @return void。
+ */
+void RtspServer::logStats()
+{
+    int64_t now = TimesUtil::GetTimeMillisecond();
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    int64_t cpu = (int64_t)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec
+                  + (int64_t)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+    std::lock_guard<PushMutex> lock(stats_mutex_);
+    stats_.cpu_time = cpu;
+    if(now - pre_stats_time_ < 5000) {
+        return;
+    }
+    double elapsed = (now - pre_stats_time_) / 1000.0;
+    LogInfo("rtsp server: clients-%d, playing-%d, send-%0.0lfkbps, dropped-%lld, cpu-%0.1lf%%",
+            stats_.clients, stats_.playing_clients, (stats_.sent_bytes - pre_stats_bytes_) * 8 / 1000.0 / elapsed,
+            stats_.dropped_frames, (cpu - pre_stats_cpu_) / 10000.0 / elapsed);
+    pre_stats_time_ = now;
+    pre_stats_bytes_ = stats_.sent_bytes;
+    pre_stats_cpu_ = cpu;
+}
+
+#else // __linux__
+
+RET_CODE RtspServer::Init(const Properties &properties)
+{
+    LogError("rtsp server only support linux(epoll) now");
+    return RET_ERR_NOT_SUPPORT;
+}
+
+RET_CODE RtspServer::Start()
+{
+    return RET_ERR_NOT_SUPPORT;
+}
+
+void RtspServer::Loop()
+{
+}
+
+void RtspServer::DeInit()
+{
+    Stop();
+    std::lock_guard<PushMutex> lock(inbox_mutex_);
+    while(!inbox_.empty()) {
+        av_packet_free(&inbox_.front().pkt);
+        inbox_.pop_front();
+    }
+}
+
+#endif // __linux__
@@ -0,0 +1,135 @@
+﻿#ifndef RTSPSERVER_H
+#define RTSPSERVER_H
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include "instrument.h"
+#include <atomic>
+#include <string>
+#include "commonlooper.h"
+#include "packetqueue.h"
+#include "rtppacketizer.h"
+#include "timesutil.h"
+
+#define RTSP_SERVER_TRACKS 2                            // 0 视频 1 音频
+
+// rtsp服务器的统计信息
+typedef struct rtsp_server_stats
+{
+    int     clients;                                    // 当前的rtsp连接数
+    int     playing_clients;                            // 正在播放的客户端数
+    int64_t sent_bytes;                                 // 累计发送的字节数(所有客户端)
+    int64_t sent_frames;                                // 累计发送的帧数(所有客户端)
+    int64_t dropped_frames;                             // 客户端发送队列满而丢弃的帧数
+    int64_t cpu_time;                                   // 服务器线程累计占用的cpu时间，单位微秒，只有linux支持
+}RtspServerStats;
+
+/**
+ * 内嵌的rtsp服务器，客户端可以直接从推流端拉流，不需要再经过一个流媒体服务器转发。
+ * 支持DESCRIBE/SETUP/PLAY/TEARDOWN，传输方式支持UDP与TCP interleaved。
+ *
+ * 线程模型：
+ * 1）编码线程调用Push，每个轨道的RtpPacketizer把一帧只打包一次，得到一个引用计数的AVPacket，放进收件箱并通过eventfd唤醒服务器线程。
+ *      没有客户端在播放时Push直接返回，不做打包。
+ * 2）服务器线程用epoll处理监听、rtsp信令、收件箱与发送。收件箱中的每一帧用av_packet_ref分发到每个客户端的发送队列，
+ *      所有客户端共享同一份数据，不拷贝。
+ * 3）每个客户端的发送队列有字节数上限，慢的客户端超过上限后清空队列，等下一个视频关键帧再继续，不会影响其它客户端和推流。
+ *
+ * 目前只支持linux(epoll)，其它平台Init返回RET_ERR_NOT_SUPPORT。
+ */
+class RtspServer : public CommonLooper
+{
+public:
+    RtspServer();
+    virtual ~RtspServer();
+
+    RET_CODE Init(const Properties &properties);
+    RET_CODE ConfigVideoStream(const AVCodecContext *ctx);     // 需要在Start之前配置
+    RET_CODE ConfigAudioStream(const AVCodecContext *ctx);
+    virtual RET_CODE Start();
+    virtual void Loop();
+    void DeInit();
+
+    RET_CODE Push(const AVPacket *pkt, MediaType media_type);  // 不接管pkt，调用者仍需释放
+    void GetStats(RtspServerStats *stats);
+
+private:
+    typedef struct rtsp_track_transport
+    {
+        bool setup;
+        bool tcp;                                       // true: interleaved通道号为track*2; false: 发到rtp_addr
+        struct sockaddr_in rtp_addr;
+    }RtspTrackTransport;
+
+    typedef struct rtsp_client
+    {
+        int fd;
+        struct sockaddr_in addr;
+        std::string recv_buf;
+        std::string send_buf;                           // 待发送的rtsp应答，tcp时只能在两个RTP帧之间发送
+        size_t send_pos;
+        std::string session;
+        bool playing;
+        bool wait_key;                                  // 刚开始播放或者丢帧后，要等视频关键帧
+        bool close_after_send;                          // TEARDOWN后发完应答就关闭
+        bool want_write;                                // 是否已经注册了EPOLLOUT
+        RtspTrackTransport tracks[RTSP_SERVER_TRACKS];
+        std::deque<MyAVPacket> queue;                   // 发送队列，包是av_packet_ref出来的，共享打包后的数据
+        int64_t queue_bytes;
+        int offset;                                     // 队头的包已经发送的字节数
+    }RtspClient;
+
+    void acceptClients();
+    void readClient(RtspClient *client);
+    bool handleRequest(RtspClient *client, const std::string &request);
+    void reply(RtspClient *client, int code, const char *reason, const std::string &cseq,
+               const std::string &headers, const std::string &body);
+    void dispatchInbox();
+    void dispatchPacket(AVPacket *pkt, MediaType media_type);
+    bool flushClient(RtspClient *client);               // 返回false表示连接出错需要关闭
+    void updateWrite(RtspClient *client, bool want_write);
+    void closeClient(RtspClient *client);
+    void clearQueue(RtspClient *client, bool keep_partial);
+    std::string buildSdp();
+    void logStats();
+
+    // 配置
+    int port_ = 8554;
+    std::string path_ = "live";                         // rtsp://ip:port/live
+    int rtp_port_ = 30000;                              // 服务器的UDP端口，视频rtp_port_/+1，音频rtp_port_+2/+3
+    int max_clients_ = 64;
+    int client_queue_max_ = 2 * 1024 * 1024;            // 每个客户端发送队列的最大字节数
+    int mtu_ = 1400;
+
+    // 轨道信息
+    bool has_track_[RTSP_SERVER_TRACKS] = {false, false};
+    RtpPacketizer packetizer_[RTSP_SERVER_TRACKS];
+    std::string sprop_sps_;                             // base64的sps
+    std::string sprop_pps_;
+    std::string profile_level_id_;
+    std::string aac_config_;                            // AudioSpecificConfig的十六进制字符串
+    AVCodecID audio_codec_id_ = AV_CODEC_ID_AAC;        // aac或者opus
+    int audio_sample_rate_ = 48000;
+    int audio_channels_ = 2;
+
+    // socket
+    int epoll_fd_ = -1;
+    int listen_fd_ = -1;
+    int event_fd_ = -1;                                 // Push唤醒服务器线程
+    int udp_fd_[RTSP_SERVER_TRACKS * 2] = {-1, -1, -1, -1};  // 每个轨道一对rtp、rtcp
+    std::map<int, RtspClient *> clients_;
+
+    // 收件箱，编码线程与服务器线程之间的唯一共享数据
+    PushMutex inbox_mutex_{PUSH_LOCK_SITE("rtsp_server_inbox")};
+    std::deque<MyAVPacket> inbox_;
+    std::atomic<int> playing_clients_{0};
+
+    PushMutex stats_mutex_{PUSH_LOCK_SITE("rtsp_server_stats")};
+    RtspServerStats stats_;
+    int64_t pre_stats_time_ = 0;
+    int64_t pre_stats_bytes_ = 0;
+    int64_t pre_stats_cpu_ = 0;
+};
+
+#endif // RTSPSERVER_H
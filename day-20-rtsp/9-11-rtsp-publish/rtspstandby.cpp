@@ -0,0 +1,274 @@
+﻿#include "rtspstandby.h"
+#include "dlog.h"
+#include "timesutil.h"
+extern "C" {
+#include "libavutil/opt.h"
+}
+
+static void reset_output(RtspOutput *output)
+{
+    output->fmt_ctx = NULL;
+    output->timer = NULL;
+    output->video_stream = NULL;
+    output->audio_stream = NULL;
+    output->url.clear();
+}
+
+RtspStandby::RtspStandby()
+{
+    reset_output(&output_);
+    reset_output(&retired_);
+}
+
+RtspStandby::~RtspStandby()
+{
+    DeInit();
+}
+
+/**
+ * @brief 设置备用连接的参数。
+ * @param "url"                 备用服务器的地址
+ *        "rtsp_transport"      udp或者tcp
+ *        "timeout"             ffmpeg接口的超时时长，默认5000ms
+ *        "retry_interval"      连接失败后的重试间隔，默认2000ms
+ *        "keepalive_interval"  保活写包的间隔，默认1000ms
+ * @return 成功 0 失败 other
+ */
+RET_CODE RtspStandby::Init(const Properties &properties)
+{
+    url_                = properties.GetProperty("url", "");
+    rtsp_transport_     = properties.GetProperty("rtsp_transport", "udp");
+    timeout_            = properties.GetProperty("timeout", 5000);
+    retry_interval_     = properties.GetProperty("retry_interval", 2000);
+    keepalive_interval_ = properties.GetProperty("keepalive_interval", 1000);
+    if(url_.empty()) {
+        LogError("standby url is null");
+        return RET_FAIL;
+    }
+    return RET_OK;
+}
+
+RET_CODE RtspStandby::ConfigStreams(const AVCodecContext *video_ctx, int video_index,
+                                    const AVCodecContext *audio_ctx, int audio_index)
+{
+    if(!video_ctx && !audio_ctx) {
+        LogError("no stream");
+        return RET_FAIL;
+    }
+    video_ctx_ = video_ctx;
+    video_index_ = video_ctx ? video_index : -1;
+    audio_ctx_ = audio_ctx;
+    audio_index_ = audio_ctx ? audio_index : -1;
+    return RET_OK;
+}
+
+void RtspStandby::DeInit()
+{
+    Stop();
+    std::lock_guard<PushMutex> lock(mutex_);
+    av_packet_free(&keepalive_pkt_);
+    closeOutput(&retired_);
+    closeOutput(&output_);
+}
+
+bool RtspStandby::IsReady()
+{
+    std::lock_guard<PushMutex> lock(mutex_);
+    return output_.fmt_ctx != NULL;
+}
+
+/**
+ * @brief 创建一路rtsp输出并完成握手，流按index的顺序创建，与主连接保持一致。
+ * @return 成功 0 失败 other
+ */
+RET_CODE RtspStandby::openOutput(const std::string &url, RtspOutput *output)
+{
+    reset_output(output);
+    output->url = url;
+    int ret = avformat_alloc_output_context2(&output->fmt_ctx, NULL, "rtsp", url.c_str());
+    if(ret < 0) {
+        return RET_FAIL;
+    }
+    av_opt_set(output->fmt_ctx->priv_data, "rtsp_transport", rtsp_transport_.c_str(), 0);
+    output->timer = new InterruptTimer(timeout_);
+    output->fmt_ctx->interrupt_callback.callback = InterruptTimer::Callback;
+    output->fmt_ctx->interrupt_callback.opaque = output->timer;
+
+    for(int index = 0; index < 2; index++) {
+        const AVCodecContext *ctx = NULL;
+        if(index == video_index_) {
+            ctx = video_ctx_;
+        } else if(index == audio_index_) {
+            ctx = audio_ctx_;
+        } else {
+            continue;
+        }
+        AVStream *st = avformat_new_stream(output->fmt_ctx, NULL);
+        if(!st || st->index != index) {
+            LogError("standby stream index mismatch");
+            closeOutput(output);
+            return RET_FAIL;
+        }
+        avcodec_parameters_from_context(st->codecpar, ctx);
+        st->codecpar->codec_tag = 0;
+        if(index == video_index_) {
+            output->video_stream = st;
+        } else {
+            output->audio_stream = st;
+        }
+    }
+
+    output->timer->Reset();
+    ret = avformat_write_header(output->fmt_ctx, NULL);
+    if(ret < 0) {
+        char str_error[512] = {0};
+        av_strerror(ret, str_error, sizeof(str_error) - 1);
+        LogWarn("standby connect %s failed: %s", url.c_str(), str_error);
+        avformat_free_context(output->fmt_ctx);     // 没有写头成功不能写尾
+        output->fmt_ctx = NULL;
+        closeOutput(output);
+        return RET_FAIL;
+    }
+    return RET_OK;
+}
+
+void RtspStandby::closeOutput(RtspOutput *output)
+{
+    if(output->fmt_ctx) {
+        output->timer->Reset();
+        av_write_trailer(output->fmt_ctx);          // 服务器已经断开时会失败，但是会关闭socket
+        avformat_free_context(output->fmt_ctx);
+    }
+    if(output->timer) {
+        delete output->timer;
+    }
+    reset_output(output);
+}
+
+/**
+ * @brief 备用连接线程：关闭切换下来的连接，没有备用连接时按重试间隔不断连接。
+ * @return void。
+ */
+void RtspStandby::Loop()
+{
+    LogInfo("standby loop into");
+    int64_t next_connect_time = 0;
+    while(!request_abort_)
+    {
+        RtspOutput retired;
+        reset_output(&retired);
+        std::string url;
+        bool connected;
+        {
+            std::lock_guard<PushMutex> lock(mutex_);
+            std::swap(retired, retired_);
+            connected = (output_.fmt_ctx != NULL);
+            url = url_;
+        }
+        if(retired.fmt_ctx || retired.timer) {
+            closeOutput(&retired);                  // 可能要等到超时，所以不能持有锁
+            next_connect_time = 0;                  // 切换后尽快建立新的备用连接
+        }
+        if(connected) {
+            writeKeepAlive();
+            msleep(50);
+            continue;
+        }
+        if(TimesUtil::GetTimeMillisecond() < next_connect_time) {
+            msleep(50);
+            continue;
+        }
+
+        RtspOutput output;
+        if(openOutput(url, &output) == RET_OK) {
+            LogInfo("standby connected: %s", url.c_str());
+            std::lock_guard<PushMutex> lock(mutex_);
+            output_ = output;
+            last_keepalive_time_ = 0;
+            last_keepalive_pts_ = -1;
+        } else {
+            next_connect_time = TimesUtil::GetTimeMillisecond() + retry_interval_;
+        }
+    }
+    LogInfo("standby loop leave");
+}
+
+/**
+ * @brief 保活，每隔keepalive_interval把一个音频包拷贝一份交给备用连接线程，只交pts递增的包。
+ *          推流线程调用，不写网络，上一个保活包还没有写出时不再拷贝。
+ * @param pkt 要发送的包，不接管，pts单位ms。
+ * @param media_type 包类型，只处理音频。
+ * @return void。
+ */
+void RtspStandby::KeepAlive(const AVPacket *pkt, MediaType media_type)
+{
+    std::lock_guard<PushMutex> lock(mutex_);
+    if(!output_.fmt_ctx || !output_.audio_stream || E_AUDIO_TYPE != media_type || keepalive_pkt_) {
+        return;
+    }
+    int64_t now = TimesUtil::GetTimeMillisecond();
+    if(now - last_keepalive_time_ < keepalive_interval_ || pkt->pts <= last_keepalive_pts_) {
+        return;
+    }
+    keepalive_pkt_ = av_packet_clone(pkt);             // 引用计数，不拷贝数据
+    if(!keepalive_pkt_) {
+        return;
+    }
+    last_keepalive_time_ = now;
+    last_keepalive_pts_ = pkt->pts;
+}
+
+/**
+ * @brief 备用连接线程中写出推流线程交过来的保活包，写的时候不持有锁，期间TakeOver返回失败。写失败时关闭该连接，重新连接。
+ * @return void。
+ */
+void RtspStandby::writeKeepAlive()
+{
+    AVPacket *keepalive = NULL;
+    RtspOutput output;
+    {
+        std::lock_guard<PushMutex> lock(mutex_);
+        if(!keepalive_pkt_ || !output_.fmt_ctx) {
+            return;
+        }
+        keepalive = keepalive_pkt_;
+        keepalive_pkt_ = NULL;
+        output = output_;
+        keepalive_writing_ = true;
+    }
+    AVRational src_time_base = {1, 1000};
+    keepalive->stream_index = output.audio_stream->index;
+    keepalive->pts = av_rescale_q(keepalive->pts, src_time_base, output.audio_stream->time_base);
+    keepalive->dts = keepalive->pts;
+    keepalive->duration = 0;
+    output.timer->Reset();
+    int ret = av_write_frame(output.fmt_ctx, keepalive);
+    av_packet_free(&keepalive);
+
+    std::lock_guard<PushMutex> lock(mutex_);
+    keepalive_writing_ = false;
+    if(ret < 0) {
+        LogWarn("standby keepalive failed: %d, reconnect %s", ret, output_.url.c_str());
+        std::swap(retired_, output_);               // 下一次循环关闭并重新连接
+        reset_output(&output_);
+    }
+}
+
+/**
+ * @brief 切换，传入当前的主连接，传出已经握手完成的备用连接。原来的主连接由本线程关闭，并重新连接它的地址作为新的备用。
+ * @param output 传入传出。
+ * @return 成功 0，备用连接还没有准备好返回 RET_FAIL。
+ */
+RET_CODE RtspStandby::TakeOver(RtspOutput *output)
+{
+    std::lock_guard<PushMutex> lock(mutex_);
+    if(!output_.fmt_ctx || retired_.fmt_ctx || keepalive_writing_) {
+        return RET_FAIL;                            // 正在写保活包时不能切换，推流线程下一次循环再试
+    }
+    av_packet_free(&keepalive_pkt_);                // 切换后由推流线程写，不再需要保活
+    retired_ = *output;
+    *output = output_;
+    reset_output(&output_);
+    url_ = retired_.url;
+    return RET_OK;
+}
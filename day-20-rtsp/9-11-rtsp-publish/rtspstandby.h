@@ -0,0 +1,76 @@
+﻿#ifndef RTSPSTANDBY_H
+#define RTSPSTANDBY_H
+
+#include <mutex>
+#include "instrument.h"
+#include <string>
+#include "mediabase.h"
+#include "commonlooper.h"
+#include "interrupttimer.h"
+extern "C" {
+#include "libavformat/avformat.h"
+#include "libavcodec/avcodec.h"
+}
+
+// 一路rtsp输出，主备切换时整体交换
+typedef struct rtsp_output
+{
+    AVFormatContext *fmt_ctx;
+    InterruptTimer  *timer;                             // 跟随fmt_ctx，详看InterruptTimer
+    AVStream        *video_stream;
+    AVStream        *audio_stream;
+    std::string     url;
+}RtspOutput;
+
+/**
+ * 热备连接。在自己的线程中与备用服务器完成握手(avformat_write_header)，然后保持连接，供RtspPusher在主连接出错或卡住时切换。
+ * 1）保活：推流线程每隔keepalive_interval把最新的一个音频包拷贝一份交给本线程，由本线程写到备用连接，服务器不会因为没有数据而断开会话。
+ *    备用连接写包可能阻塞到timeout，所以不能在推流线程中写，也不能持有锁写。
+ * 2）切换：推流线程调用TakeOver与备用连接交换RtspOutput，原来的主连接交给本线程关闭，然后本线程重新连接原来的主服务器作为新的备用。
+ *
+ * 测试方法：用tools/rtspreceiver在本地启动两个接收端，例如 rtspreceiver -p 8554 与 rtspreceiver -p 8555，
+ * rtsp_url与rtsp_standby_url分别指向它们，推流过程中kill掉8554那个，MSG_RTSP_FAILOVER会给出切换耗时。
+ */
+class RtspStandby : public CommonLooper
+{
+public:
+    RtspStandby();
+    virtual ~RtspStandby();
+
+    RET_CODE Init(const Properties &properties);
+    // 流的顺序必须和主连接一致，切换后stream_index才不会变，index为-1表示没有该流
+    RET_CODE ConfigStreams(const AVCodecContext *video_ctx, int video_index,
+                           const AVCodecContext *audio_ctx, int audio_index);
+    virtual void Loop();
+    void DeInit();
+
+    bool IsReady();                                     // 备用连接是否已经握手完成
+    void KeepAlive(const AVPacket *pkt, MediaType media_type);  // 推流线程调用，只拷贝不写，pts单位ms
+    RET_CODE TakeOver(RtspOutput *output);              // 推流线程调用，与备用连接交换
+
+private:
+    RET_CODE openOutput(const std::string &url, RtspOutput *output);
+    void closeOutput(RtspOutput *output);
+    void writeKeepAlive();
+
+    std::string url_;                                   // 备用连接要连接的地址，切换后变为原来主连接的地址
+    std::string rtsp_transport_ = "udp";
+    int timeout_ = 5000;
+    int retry_interval_ = 2000;                         // 连接失败后的重试间隔，单位ms
+    int keepalive_interval_ = 1000;                     // 保活写包的间隔，单位ms
+
+    const AVCodecContext *video_ctx_ = NULL;
+    const AVCodecContext *audio_ctx_ = NULL;
+    int video_index_ = -1;
+    int audio_index_ = -1;
+
+    PushMutex mutex_{PUSH_LOCK_SITE("rtsp_standby")};  // 保护下面的成员，推流线程与本线程共享
+    RtspOutput output_;                                 // 已经握手完成的备用连接，fmt_ctx为NULL表示还没连上
+    RtspOutput retired_;                                // 切换下来等待本线程关闭的连接
+    AVPacket *keepalive_pkt_ = NULL;                    // 推流线程交过来、等待本线程写的保活包
+    bool keepalive_writing_ = false;                    // 本线程正在不持有锁地写output_，此时不能切换
+    int64_t last_keepalive_time_ = 0;
+    int64_t last_keepalive_pts_ = -1;
+};
+
+#endif // RTSPSTANDBY_H
@@ -0,0 +1,163 @@
+﻿#include "sendpacer.h"
+#include <thread>
+#include "dlog.h"
+#include "timesutil.h"
+
+#define PACER_RTP_PAYLOAD_SIZE      1460            // rtsp封装的RTP包最大1472字节(RTSP_TCP_MAX_PACKET_SIZE)，去掉12字节的RTP头
+#define PACER_CALIBRATE_MIN_PACKETS 4               // 不到4个RTP包的帧，回调次数主要是固定开销，不用于校准
+
+SendPacer::SendPacer()
+{
+    memset(&stats_, 0, sizeof(SendPacerStats));
+}
+
+SendPacer::~SendPacer()
+{
+}
+
+/**
+ * @brief 初始化令牌桶的参数。
+ * @param "bitrate"         目标码率，单位bps，一般是音视频编码码率之和
+ *        "multiple"        发送码率相对于目标码率的倍数，百分比，默认150即1.5倍
+ *        "frame_duration"  视频帧间隔，单位毫秒，默认40ms
+ *        "max_delay"       一帧在发送过程中的最大等待时长，单位毫秒，默认500ms
+ * @return 成功 0 失败 other
+ */
+RET_CODE SendPacer::Init(const Properties &properties)
+{
+    bitrate_        = properties.GetProperty("bitrate", 0);
+    multiple_       = properties.GetProperty("multiple", 150);
+    frame_duration_ = properties.GetProperty("frame_duration", 40);
+    max_delay_      = properties.GetProperty("max_delay", 500);
+    if(bitrate_ <= 0 || multiple_ <= 0) {
+        LogError("invalid bitrate: %d or multiple: %d", bitrate_, multiple_);
+        return RET_ERR_PARAMISMATCH;
+    }
+    if(frame_duration_ <= 0) {
+        frame_duration_ = 40;
+    }
+
+    // bps -> 字节/微秒
+    rate_ = (double)bitrate_ * multiple_ / 100 / 8 / 1000000;
+    // 桶深为一个帧间隔能发送的字节数，P帧一般可以直接发出，I帧超出的部分按码率平滑
+    bucket_size_ = rate_ * frame_duration_ * 1000;
+    tokens_ = bucket_size_;
+    last_refill_time_ = 0;
+    LogInfo("pacer rate: %0.0lfbps, bucket: %0.0lf bytes", rate_ * 8 * 1000000, bucket_size_);
+
+    return RET_OK;
+}
+
+void SendPacer::refill(int64_t now)
+{
+    if(0 == last_refill_time_) {
+        last_refill_time_ = now;
+        return;
+    }
+    int64_t elapsed = now - last_refill_time_;
+    if(elapsed <= 0) {
+        return;
+    }
+    tokens_ += rate_ * elapsed;
+    if(tokens_ > bucket_size_) {
+        tokens_ = bucket_size_;                     // 令牌不能无限积累，否则长时间空闲后又会产生突发
+    }
+    last_refill_time_ = now;
+}
+
+/**
+ * @brief 开始写一个包，按估计的回调次数把包的大小分成若干份，每次回调扣除一份。
+ * @param size 包的大小。
+ * @param paced true 视频，令牌不足时等待; false 音频，只扣除令牌。
+ * @return void。
+ */
+void SendPacer::BeginWrite(int size, bool paced)
+{
+    writing_ = true;
+    paced_ = paced;
+    write_size_ = size;
+    charged_ = 0;
+    hooks_ = 0;
+    write_wait_ = 0;
+    bypass_ = false;
+    double hooks = hooks_per_packet_ * ((size + PACER_RTP_PAYLOAD_SIZE - 1) / PACER_RTP_PAYLOAD_SIZE);
+    chunk_size_ = hooks > 1 ? size / hooks : size;
+}
+
+/**
+ * @brief 中断回调中调用，FFmpeg每写一个RTP包之前都会调用中断回调。视频包在令牌不足时等待到令牌补充为0，然后扣除一份令牌。
+ *          不在BeginWrite、EndWrite之间(例如写头、读服务器的回复)时直接返回。
+ * @return 这次等待的时长，单位微秒，调用者需要把它从阻塞时间中扣除。
+ */
+int64_t SendPacer::OnWriteHook()
+{
+    if(!writing_) {
+        return 0;
+    }
+    hooks_++;
+    if(!paced_ || charged_ >= write_size_) {
+        return 0;
+    }
+    int64_t now = TimesUtil::GetTimeMicrosecond();
+    refill(now);
+    int64_t wait = 0;
+    if(tokens_ < 0 && !bypass_) {
+        wait = (int64_t)(-tokens_ / rate_) + 1;
+        int64_t left = (int64_t)max_delay_ * 1000 - write_wait_;
+        if(wait >= left) {
+            wait = left > 0 ? left : 0;
+            bypass_ = true;                         // 这一帧等待太久，剩下的部分不再平滑
+            stats_.bypass_packets++;
+        }
+        if(wait > 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(wait));
+            int64_t after = TimesUtil::GetTimeMicrosecond();
+            wait = after - now;                     // 实际睡眠的时长
+            write_wait_ += wait;
+            refill(after);
+        }
+    }
+    double chunk = chunk_size_ < write_size_ - charged_ ? chunk_size_ : write_size_ - charged_;
+    tokens_ -= chunk;
+    charged_ += chunk;
+    stats_.paced_chunks++;
+    return wait;
+}
+
+/**
+ * @brief 写完一个包，扣除回调中没有扣除的令牌，并用这一帧实际的回调次数校准每个RTP包的回调次数。
+ * @return void。
+ */
+void SendPacer::EndWrite()
+{
+    if(!writing_) {
+        return;
+    }
+    writing_ = false;
+    refill(TimesUtil::GetTimeMicrosecond());
+    tokens_ -= write_size_ - charged_;
+    if(!paced_) {
+        return;
+    }
+    int packets = (write_size_ + PACER_RTP_PAYLOAD_SIZE - 1) / PACER_RTP_PAYLOAD_SIZE;
+    if(packets >= PACER_CALIBRATE_MIN_PACKETS && hooks_ > 0) {
+        hooks_per_packet_ += ((double)hooks_ / packets - hooks_per_packet_) / 4;
+    }
+    stats_.paced_packets++;
+    if(write_wait_ > 1000) {                        // 超过1ms才认为是被平滑器延迟了
+        stats_.delayed_packets++;
+    }
+    stats_.total_delay += write_wait_;
+    if(write_wait_ > stats_.max_delay) {
+        stats_.max_delay = write_wait_;
+    }
+}
+
+void SendPacer::GetStats(SendPacerStats *stats)
+{
+    if(!stats) {
+        return;
+    }
+    *stats = stats_;
+    stats->hooks_per_packet = hooks_per_packet_;
+}
@@ -0,0 +1,75 @@
+﻿#ifndef SENDPACER_H
+#define SENDPACER_H
+
+#include "mediabase.h"
+
+/**
+ * 发送平滑器(令牌桶)，在RTP包的粒度上平滑发送。
+ * 编码后的I帧可能是P帧的5-10倍，rtsp封装在一次av_write_frame中把一帧拆成几十上百个RTP包连续写出，
+ * 在带宽受限的上行链路上会造成突发，从而导致丢包和抖动。
+ * FFmpeg 4.2的rtsp封装在内部打开tcp/udp的URLContext，没有公开的写回调，但是每次ffurl_write写一个RTP包之前
+ * 都会调用interrupt_callback，所以在中断回调(InterruptTimer::Callback)中等待令牌，一帧的RTP包就会按设定的码率逐个发出：
+ * 1）av_write_frame之前BeginWrite告诉平滑器这一帧的大小，回调每调用一次OnWriteHook就扣除一份令牌，
+ *    即 帧大小/预计的回调次数，令牌不足时在回调中等待。
+ * 2）写一个RTP包调用几次回调由FFmpeg的实现决定(tcp等待可写时也会调用)，所以按1460字节一个RTP包估计包数、
+ *    按每个包的回调次数估计回调次数，EndWrite时用实际次数校准。估少了这一帧的尾部不经平滑写出，
+ *    估多了这一帧发得快一些、剩下的令牌在EndWrite时扣除，校准后都会回到设定的码率。
+ * 3）音频不等待令牌(优先)，但是同样扣除令牌，保证整体的发送码率不超过设定值。
+ * 4）一帧累计等待超过max_delay后不再等待，防止链路本身比设定码率慢时延迟无限累积。
+ *
+ * 注意：中断回调在调用av_write_frame的线程中同步执行，本类只在推流线程中使用，所以没有加锁。
+ */
+
+// 发送平滑器的统计信息
+typedef struct send_pacer_stats
+{
+    int64_t paced_packets;              // 经过平滑器发送的视频包数量
+    int64_t delayed_packets;            // 发送过程中因令牌不足而等待过的视频包数量
+    int64_t bypass_packets;             // 等待超过最大延迟后不再平滑的视频包数量
+    int64_t total_delay;                // 累计的平滑等待时长，单位微秒
+    int64_t max_delay;                  // 一个视频包最大的平滑等待时长，单位微秒
+    int64_t paced_chunks;               // 在中断回调中扣除令牌的次数，大致是平滑发送的RTP包数的倍数
+    double  hooks_per_packet;           // 当前估计的每个RTP包的回调次数
+}SendPacerStats;
+
+class SendPacer
+{
+public:
+    SendPacer();
+    ~SendPacer();
+
+    RET_CODE Init(const Properties &properties);
+
+    void BeginWrite(int size, bool paced);          // av_write_frame之前调用，paced为false时(音频)不等待令牌
+    void EndWrite();                                // av_write_frame返回后调用，扣除剩余的令牌并校准回调次数
+    int64_t OnWriteHook();                          // 在中断回调中调用，返回这次等待的时长，单位微秒
+    void GetStats(SendPacerStats *stats);
+
+private:
+    void refill(int64_t now);                       // 按经过的时间补充令牌
+
+    int bitrate_            = 0;                    // 目标码率，音视频码率之和，单位bps
+    int multiple_           = 150;                  // 发送码率相对于目标码率的倍数，百分比，150即1.5倍
+    int frame_duration_     = 40;                   // 视频帧间隔，单位毫秒，令牌桶的深度为一个帧间隔可以发送的数据量
+    int max_delay_          = 500;                  // 一帧在发送过程中的最大等待时长，单位毫秒，超过则不再等待
+
+    double rate_            = 0;                    // 令牌产生的速度，单位 字节/微秒
+    double bucket_size_     = 0;                    // 令牌桶深度，单位字节
+    double tokens_          = 0;                    // 当前令牌数，可以为负数，表示透支
+    int64_t last_refill_time_ = 0;
+
+    // 当前正在写的包
+    bool writing_           = false;
+    bool paced_             = false;
+    int write_size_         = 0;
+    double chunk_size_      = 0;                    // 每次回调扣除的令牌
+    double charged_         = 0;                    // 已经扣除的令牌
+    int hooks_              = 0;                    // 回调的次数
+    int64_t write_wait_     = 0;                    // 累计等待的时长，单位微秒
+    bool bypass_            = false;
+    double hooks_per_packet_ = 2;                   // tcp、udp都是ffurl_write的重试循环与等待可写(或者rtp协议内层的ffurl_write)各一次
+
+    SendPacerStats stats_;
+};
+
+#endif // SENDPACER_H
@@ -0,0 +1,349 @@
+﻿#include <string.h>
+#include <errno.h>
+#include <thread>
+#include <chrono>
+#include "shmring.h"
+#include "dlog.h"
+#ifdef __linux__
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+static_assert(sizeof(ShmSlot) == SHM_SLOT_ALIGN, "ShmSlot must be one cache line");
+
+#ifdef __linux__
+// 共享内存中的futex不能用FUTEX_PRIVATE_FLAG，等待与唤醒在不同的进程
+static int futexWait(std::atomic<uint32_t> *addr, uint32_t expected, int timeout)
+{
+    struct timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    return (int)syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT, expected, &ts, NULL, 0);
+}
+
+static void futexWake(std::atomic<uint32_t> *addr)
+{
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+#endif
+
+ShmRing::ShmRing()
+{
+}
+
+ShmRing::~ShmRing()
+{
+    Close();
+}
+
+int64_t ShmRing::GetWallTimeMicrosecond()
+{
+#ifdef __linux__
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief 生产者创建共享内存，已经存在的同名共享内存(例如上次异常退出留下的)会被删除重建。
+ * @param name 共享内存名字，以'/'开头，例如/push_video，对应/dev/shm/push_video。
+ * @param properties "slot_count"   slot个数，缺省4，越多越能容忍消费者的抖动，但排队的延时也越大
+ *                   "data_size"    每个slot最大的数据字节数，视频一般为一帧yuv的大小
+ *                   "media_type"   MediaType，E_VIDEO_TYPE或E_AUDIO_TYPE
+ *                   "width" "height" "pixel_format"            视频格式
+ *                   "sample_rate" "channels" "sample_format"   音频格式
+ * @return 成功 0 失败 other
+ */
+RET_CODE ShmRing::Create(const std::string &name, const Properties &properties)
+{
+#ifdef __linux__
+    int slot_count = properties.GetProperty("slot_count", 4);
+    int data_size = properties.GetProperty("data_size", 0);
+    if(slot_count < 2 || data_size <= 0) {
+        LogError("invalid slot_count: %d or data_size: %d", slot_count, data_size);
+        return RET_ERR_PARAMISMATCH;
+    }
+    uint32_t slot_size = (uint32_t)(SHM_SLOT_ALIGN + (data_size + SHM_SLOT_ALIGN - 1) / SHM_SLOT_ALIGN * SHM_SLOT_ALIGN);
+    size_t header_size = (sizeof(ShmRingHeader) + SHM_SLOT_ALIGN - 1) / SHM_SLOT_ALIGN * SHM_SLOT_ALIGN;
+    size_t size = header_size + (size_t)slot_size * slot_count;
+
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if(fd < 0) {
+        LogError("shm_open %s failed: %s", name.c_str(), strerror(errno));
+        return RET_FAIL;
+    }
+    if(ftruncate(fd, (off_t)size) < 0) {
+        LogError("ftruncate %s failed: %s", name.c_str(), strerror(errno));
+        close(fd);
+        shm_unlink(name.c_str());
+        return RET_FAIL;
+    }
+    RET_CODE ret = map(fd, size);
+    close(fd);                                          // 映射之后不再需要fd
+    if(ret != RET_OK) {
+        shm_unlink(name.c_str());
+        return ret;
+    }
+    name_ = name;
+    owner_ = true;
+    seq_ = 0;
+
+    // ftruncate出来的内存都是0，只需要填写格式，magic最后写入
+    header_->version        = SHM_RING_VERSION;
+    header_->slot_count     = slot_count;
+    header_->slot_size      = slot_size;
+    header_->data_size      = data_size;
+    header_->media_type     = properties.GetProperty("media_type", (int)E_VIDEO_TYPE);
+    header_->width          = properties.GetProperty("width", 0);
+    header_->height         = properties.GetProperty("height", 0);
+    header_->pixel_format   = properties.GetProperty("pixel_format", 0);
+    header_->sample_rate    = properties.GetProperty("sample_rate", 0);
+    header_->channels       = properties.GetProperty("channels", 0);
+    header_->sample_format  = properties.GetProperty("sample_format", 1);
+    header_->producer_pid   = getpid();
+    std::atomic_thread_fence(std::memory_order_release);
+    header_->magic          = SHM_RING_MAGIC;
+    LogInfo("shm ring %s created, slots: %d x %u bytes", name.c_str(), slot_count, slot_size);
+    return RET_OK;
+#else
+    LogError("shm ring is only supported on linux");
+    return RET_ERR_NOT_SUPPORT;
+#endif
+}
+
+/**
+ * @brief 生产者获取下一个可写的slot。消费者还没释放时ring是满的，本帧丢弃并计数，不会覆盖消费者正在使用的slot。
+ * @param slot 传出，slot头，提交前需要填好size、pts，视频还需要width、height、stride。
+ * @return slot的数据地址，ring满时返回NULL。
+ */
+uint8_t *ShmRing::BeginWrite(ShmSlot **slot)
+{
+    if(!header_) {
+        return NULL;
+    }
+    uint32_t read_seq = header_->read_seq.load(std::memory_order_acquire);
+    if(seq_ - read_seq >= header_->slot_count) {
+        header_->dropped.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+    ShmSlot *s = slotAt(seq_);
+    s->seq = seq_;
+    *slot = s;
+    return GetData(s);
+}
+
+/**
+ * @brief 生产者提交slot，消费者在等待时唤醒它。
+ * @return void。
+ */
+void ShmRing::CommitWrite()
+{
+    seq_++;
+    header_->write_seq.store(seq_, std::memory_order_seq_cst);
+#ifdef __linux__
+    // 与Acquire中先写consumer_waiting再读write_seq配对，两边都是seq_cst，不会出现双方都没看到对方的写入而丢失唤醒
+    // 等待标志由消费者自己清除，生产者清除的话可能会清掉消费者下一次等待设置的标志而丢失唤醒
+    if(header_->consumer_waiting.load(std::memory_order_seq_cst)) {
+        futexWake(&header_->write_seq);
+    }
+#endif
+}
+
+/**
+ * @brief 消费者打开生产者创建的共享内存，等待生产者写好头部，然后跳过ring中已有的旧帧。
+ * @param name 共享内存名字。
+ * @param timeout 等待生产者的时长，单位ms。
+ * @return 成功 0 失败 other
+ */
+RET_CODE ShmRing::Open(const std::string &name, int timeout)
+{
+#ifdef __linux__
+    Close();
+    int64_t begin = GetWallTimeMicrosecond();
+    while(true) {
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if(fd >= 0) {
+            struct stat st;
+            if(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ShmRingHeader)) {
+                RET_CODE ret = map(fd, (size_t)st.st_size);
+                close(fd);
+                if(ret != RET_OK) {
+                    return ret;
+                }
+                if(header_->magic == SHM_RING_MAGIC) {
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    break;
+                }
+                Close();                                // 生产者还没写好头部
+            } else {
+                close(fd);
+            }
+        }
+        if(GetWallTimeMicrosecond() - begin > timeout * 1000LL) {
+            LogError("open shm ring %s timeout", name.c_str());
+            return RET_FAIL;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if(header_->version != SHM_RING_VERSION) {
+        LogError("shm ring %s version %u is not supported", name.c_str(), header_->version);
+        Close();
+        return RET_ERR_NOT_SUPPORT;
+    }
+    size_t header_size = (sizeof(ShmRingHeader) + SHM_SLOT_ALIGN - 1) / SHM_SLOT_ALIGN * SHM_SLOT_ALIGN;
+    if(header_->slot_count == 0 || header_->slot_size < SHM_SLOT_ALIGN + header_->data_size
+            || map_size_ < header_size + (size_t)header_->slot_size * header_->slot_count) {
+        LogError("shm ring %s is corrupted", name.c_str());
+        Close();
+        return RET_FAIL;
+    }
+    name_ = name;
+    owner_ = false;
+    seq_ = header_->write_seq.load(std::memory_order_acquire);
+    header_->read_seq.store(seq_, std::memory_order_release);     // 旧帧全部释放
+    LogInfo("shm ring %s opened, slots: %u x %u bytes, producer pid: %d", name.c_str(),
+            header_->slot_count, header_->slot_size, header_->producer_pid);
+    return RET_OK;
+#else
+    LogError("shm ring is only supported on linux");
+    return RET_ERR_NOT_SUPPORT;
+#endif
+}
+
+/**
+ * @brief 消费者等待下一个slot。有数据时直接返回，没有数据时futex等待生产者唤醒。
+ * @param timeout 最长等待时间，单位ms。
+ * @return slot，超时返回NULL。在Release之前生产者不会覆盖它，可以直接使用其中的数据。
+ */
+const ShmSlot *ShmRing::Acquire(int timeout)
+{
+#ifdef __linux__
+    if(!header_) {
+        return NULL;                                    // 重新打开失败
+    }
+    int64_t deadline = GetWallTimeMicrosecond() + timeout * 1000LL;
+    bool waiting = false;
+    while(true) {
+        if(header_->write_seq.load(std::memory_order_acquire) != seq_) {
+            if(waiting) {
+                header_->consumer_waiting.store(0, std::memory_order_relaxed);
+            }
+            ShmSlot *slot = slotAt(seq_);
+            int64_t latency = GetWallTimeMicrosecond() - slot->pts;
+            stats_.slots++;
+            stats_.latency_sum += latency;
+            if(latency > stats_.max_latency) {
+                stats_.max_latency = latency;
+            }
+            return slot;
+        }
+        waiting = true;
+        header_->consumer_waiting.store(1, std::memory_order_seq_cst);
+        if(header_->write_seq.load(std::memory_order_seq_cst) != seq_) {
+            continue;                                   // 设置等待标志前生产者已经提交
+        }
+        int64_t remain = deadline - GetWallTimeMicrosecond();
+        if(remain <= 0) {
+            header_->consumer_waiting.store(0, std::memory_order_relaxed);
+            return NULL;
+        }
+        futexWait(&header_->write_seq, seq_, (int)((remain + 999) / 1000));
+    }
+#else
+    return NULL;
+#endif
+}
+
+/**
+ * @brief 消费者释放Acquire得到的slot，之后生产者可以重新写入它。
+ * @return void。
+ */
+void ShmRing::Release()
+{
+    if(!header_) {
+        return;
+    }
+    seq_++;
+    header_->read_seq.store(seq_, std::memory_order_release);
+}
+
+/**
+ * @brief 生产者进程是否还在，消费者长时间没有数据时用来判断是否需要重新打开。
+ * @return 在返回true。
+ */
+bool ShmRing::ProducerAlive()
+{
+#ifdef __linux__
+    return header_ && (kill(header_->producer_pid, 0) == 0 || errno == EPERM);
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief 获取消费者的统计，获取后清零，只能在消费者线程中调用。
+ * @param stats 传入传出。
+ * @return void。
+ */
+void ShmRing::GetStats(ShmRingStats *stats)
+{
+    stats_.dropped = header_ ? header_->dropped.load(std::memory_order_relaxed) : 0;
+    *stats = stats_;
+    stats_.slots = 0;
+    stats_.latency_sum = 0;
+    stats_.max_latency = 0;
+}
+
+/**
+ * @brief 解除映射，生产者同时删除共享内存，可以重复调用。
+ * @return void。
+ */
+void ShmRing::Close()
+{
+#ifdef __linux__
+    if(base_) {
+        munmap(base_, map_size_);
+        base_ = NULL;
+        header_ = NULL;
+        map_size_ = 0;
+    }
+    if(owner_) {
+        shm_unlink(name_.c_str());
+        owner_ = false;
+    }
+#endif
+}
+
+ShmSlot *ShmRing::slotAt(uint32_t seq)
+{
+    size_t header_size = (sizeof(ShmRingHeader) + SHM_SLOT_ALIGN - 1) / SHM_SLOT_ALIGN * SHM_SLOT_ALIGN;
+    return (ShmSlot *)(base_ + header_size + (size_t)(seq % header_->slot_count) * header_->slot_size);
+}
+
+RET_CODE ShmRing::map(int fd, size_t size)
+{
+#ifdef __linux__
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(addr == MAP_FAILED) {
+        LogError("mmap failed: %s", strerror(errno));
+        return RET_FAIL;
+    }
+    base_ = (uint8_t *)addr;
+    map_size_ = size;
+    header_ = (ShmRingHeader *)base_;
+    return RET_OK;
+#else
+    return RET_ERR_NOT_SUPPORT;
+#endif
+}
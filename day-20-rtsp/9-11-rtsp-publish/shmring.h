@@ -0,0 +1,115 @@
+﻿#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include "mediabase.h"
+
+#define SHM_RING_MAGIC      0x52534850          // "PHSR"
+#define SHM_RING_VERSION    1
+#define SHM_SLOT_ALIGN      64                  // slot与数据的对齐，避免生产者与消费者false sharing，也方便SIMD读取
+
+/**
+ * 共享内存的头部，由生产者创建时填写，magic最后写入，消费者看到magic才认为头部完整。
+ * 只使用定长的类型，生产者可以是另一个编译器或者语言编写的采集进程，只要按同样的布局写入即可。
+ */
+typedef struct shm_ring_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;                        // slot个数
+    uint32_t slot_size;                         // 每个slot的大小，包括ShmSlot头，SHM_SLOT_ALIGN对齐
+    uint32_t data_size;                         // 每个slot最大的数据字节数
+    int32_t  media_type;                        // MediaType
+    int32_t  width;                             // 视频格式，音频为0
+    int32_t  height;
+    int32_t  pixel_format;                      // AVPixelFormat
+    int32_t  sample_rate;                       // 音频格式，视频为0
+    int32_t  channels;
+    int32_t  sample_format;                     // AVSampleFormat，目前只支持交错的s16
+    int32_t  producer_pid;
+    uint32_t reserved[3];
+    alignas(SHM_SLOT_ALIGN) std::atomic<uint32_t> write_seq;   // 生产者已经提交的slot数，也是futex等待的地址
+    std::atomic<uint32_t> consumer_waiting;     // 消费者在futex上等待时为1，生产者只在它为1时才唤醒，省掉系统调用
+    std::atomic<uint32_t> dropped;              // 消费者跟不上、ring满了时生产者丢弃的帧数
+    alignas(SHM_SLOT_ALIGN) std::atomic<uint32_t> read_seq;    // 消费者已经释放的slot数
+}ShmRingHeader;
+
+/**
+ * 每个slot的头部，数据紧跟在它后面(偏移SHM_SLOT_ALIGN)。一个slot存放一帧视频或者一段音频。
+ */
+typedef struct shm_slot
+{
+    uint32_t seq;                               // 第几个slot，与write_seq对应
+    int32_t  size;                              // 数据字节数
+    int64_t  pts;                               // 生产者采集时的墙上时钟(gettimeofday)，单位us
+    int32_t  width;                             // 视频：本帧的宽高与每个平面的行字节数，平面按y、u、v顺序紧密排列
+    int32_t  height;
+    int32_t  stride[3];
+    int32_t  nb_samples;                        // 音频：每个通道的样本数
+    int32_t  flags;
+    uint32_t reserved[5];
+}ShmSlot;
+
+// 消费者的统计，GetStats之后清零
+typedef struct shm_ring_stats
+{
+    int64_t slots;                              // 取到的slot数
+    int64_t latency_sum;                        // 生产者提交到消费者取到的延时(按slot的pts计算)之和，单位us
+    int64_t max_latency;
+    uint32_t dropped;                           // 生产者累计丢弃的帧数
+}ShmRingStats;
+
+/**
+ * 共享内存的帧环形缓冲，用于外部的采集进程把音视频帧交给推流端，不经过socket/pipe，不拷贝。
+ * 1）布局：ShmRingHeader + slot_count个slot，每个slot是ShmSlot头 + 一帧数据，一帧一个slot，采集进程可以直接把帧写到slot中。
+ * 2）单生产者单消费者：生产者写满slot后递增write_seq(release)，消费者处理完后递增read_seq(release)。
+ *    ring满(消费者跟不上)时生产者丢弃新帧并计数，不会覆盖消费者正在使用的slot，所以消费者可以直接拿slot的指针去编码。
+ * 3）通知：消费者没有数据时在write_seq上futex等待，生产者提交后只在consumer_waiting为1时才futex唤醒，
+ *    消费者跟得上时每帧没有系统调用。futex不需要像eventfd那样在进程之间传递fd，只需要共享内存的名字。
+ * 4）生产者用Create创建(已存在的同名共享内存会被删除重建)，消费者用Open打开，开始时跳过ring中已有的旧帧。
+ *
+ * 只支持linux(shm_open + mmap + futex)，其它平台Create/Open返回RET_ERR_NOT_SUPPORT。
+ */
+class ShmRing
+{
+public:
+    ShmRing();
+    ~ShmRing();
+
+    // 生产者
+    RET_CODE Create(const std::string &name, const Properties &properties);
+    uint8_t *BeginWrite(ShmSlot **slot);        // 获取下一个可写的slot，ring满时返回NULL(本帧应该丢弃)
+    void CommitWrite();                         // 提交BeginWrite得到的slot，需要先填好slot的size、pts等
+
+    // 消费者
+    RET_CODE Open(const std::string &name, int timeout);
+    const ShmSlot *Acquire(int timeout);        // 等待下一个slot，超时返回NULL，返回的slot在Release之前一直有效
+    void Release();                             // 释放Acquire得到的slot
+    bool ProducerAlive();
+    void GetStats(ShmRingStats *stats);
+
+    void Close();
+    inline const ShmRingHeader *GetHeader() {
+        return header_;
+    }
+    inline uint8_t *GetData(const ShmSlot *slot) {
+        return (uint8_t *)slot + SHM_SLOT_ALIGN;
+    }
+    static int64_t GetWallTimeMicrosecond();    // 与ShmSlot::pts相同的时钟
+
+private:
+    ShmSlot *slotAt(uint32_t seq);
+    RET_CODE map(int fd, size_t size);
+
+    std::string name_;
+    bool owner_ = false;                        // 生产者退出时删除共享内存
+    uint8_t *base_ = NULL;
+    size_t map_size_ = 0;
+    ShmRingHeader *header_ = NULL;
+    uint32_t seq_ = 0;                          // 生产者下一个写的seq，消费者下一个读的seq
+    ShmRingStats stats_ = {0, 0, 0, 0};
+};
+
+#endif // SHMRING_H
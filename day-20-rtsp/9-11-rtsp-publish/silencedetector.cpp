@@ -0,0 +1,112 @@
+﻿#include <math.h>
+#include <string.h>
+#include "silencedetector.h"
+#include "dlog.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SILENCE_USE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+SilenceDetector::SilenceDetector()
+{
+    memset(&stats_, 0, sizeof(SilenceStats));
+}
+
+/**
+ * @brief 设置检测参数。
+ * @param "threshold_db"        静音阈值，单位dBFS，默认-50
+ *        "hangover_ms"         连续静音超过该时长才跳过编码，默认300ms
+ *        "comfort_interval_ms" 静音期间舒适噪声帧的间隔，默认500ms，0不发送
+ *        "frame_duration_ms"   一帧的时长，默认21ms(48khz 1024个采样点)
+ * @return 成功 0 失败 other
+ */
+RET_CODE SilenceDetector::Init(const Properties &properties)
+{
+    threshold_db_           = properties.GetProperty("threshold_db", -50);
+    hangover_ms_            = properties.GetProperty("hangover_ms", 300);
+    comfort_interval_ms_    = properties.GetProperty("comfort_interval_ms", 500);
+    frame_duration_ms_      = properties.GetProperty("frame_duration_ms", 21);
+    if(frame_duration_ms_ <= 0 || threshold_db_ >= 0) {
+        LogError("invalid frame_duration_ms: %d or threshold_db: %d", frame_duration_ms_, threshold_db_);
+        return RET_ERR_PARAMISMATCH;
+    }
+    hangover_frames_ = (hangover_ms_ + frame_duration_ms_ - 1) / frame_duration_ms_;
+    comfort_frames_interval_ = comfort_interval_ms_ > 0 ? (comfort_interval_ms_ + frame_duration_ms_ - 1) / frame_duration_ms_ : 0;
+    // dBFS = 10*log10(平均能量/32768^2)，反过来求出阈值对应的平均能量，检测时就不需要算log了
+    threshold_energy_ = (int64_t)(pow(10.0, threshold_db_ / 10.0) * 32768.0 * 32768.0);
+    LogInfo("silence threshold: %ddBFS, hangover: %d frames, comfort interval: %d frames",
+            threshold_db_, hangover_frames_, comfort_frames_interval_);
+    return RET_OK;
+}
+
+/**
+ * @brief 计算s16样本的平方和。_mm_madd_epi16把相邻两个样本的平方相加得到32位结果，最大为2*32768^2=2^31，
+ *          按无符号数解释不会溢出，所以这里零扩展到64位再累加。
+ * @param pcm s16样本。
+ * @param nb_samples 样本数。
+ * @return 平方和。
+ */
+int64_t SilenceDetector::SumOfSquares(const int16_t *pcm, int nb_samples)
+{
+    int64_t sum = 0;
+    int i = 0;
+#ifdef SILENCE_USE_SSE2
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();                  // 两个64位的累加器
+    for(; i + 8 <= nb_samples; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(pcm + i));
+        __m128i sq = _mm_madd_epi16(v, v);              // 4个32位: s0^2+s1^2 ...
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+    }
+    int64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    sum = lanes[0] + lanes[1];
+#endif
+    for(; i < nb_samples; i++) {
+        sum += (int32_t)pcm[i] * pcm[i];
+    }
+    return sum;
+}
+
+/**
+ * @brief 检测一帧pcm。
+ * @param pcm s16交错的样本。
+ * @param nb_samples 所有通道的样本总数。
+ * @return 这一帧的处理方式。
+ */
+SilenceAction SilenceDetector::Process(const int16_t *pcm, int nb_samples)
+{
+    if(!pcm || nb_samples <= 0) {
+        return SILENCE_ENCODE;
+    }
+    stats_.frames++;
+    int64_t energy = SumOfSquares(pcm, nb_samples);
+    stats_.last_level = energy > 0 ? 10 * log10((double)energy / nb_samples / (32768.0 * 32768.0)) : -96;
+    if(energy >= threshold_energy_ * nb_samples) {
+        silent_count_ = 0;                              // 有声音，立即恢复编码
+        return SILENCE_ENCODE;
+    }
+
+    silent_count_++;
+    if(silent_count_ <= hangover_frames_) {
+        return SILENCE_ENCODE;                          // 拖尾期内仍然编码
+    }
+    if(silent_count_ == hangover_frames_ + 1) {
+        stats_.silent_periods++;
+    }
+    int skipped = silent_count_ - hangover_frames_;
+    if(comfort_frames_interval_ > 0 && skipped % comfort_frames_interval_ == 0) {
+        stats_.comfort_frames++;
+        return SILENCE_COMFORT;
+    }
+    stats_.skipped_frames++;
+    return SILENCE_SKIP;
+}
+
+void SilenceDetector::GetStats(SilenceStats *stats)
+{
+    if(stats) {
+        *stats = stats_;
+    }
+}
@@ -0,0 +1,58 @@
+﻿#ifndef SILENCEDETECTOR_H
+#define SILENCEDETECTOR_H
+
+#include <stdint.h>
+#include "mediabase.h"
+
+// 一帧pcm的处理方式
+enum SilenceAction
+{
+    SILENCE_ENCODE = 0,                                 // 有声音(或者还在拖尾期内)，正常编码
+    SILENCE_COMFORT,                                    // 持续静音，但需要发送一帧舒适噪声，让接收端知道流还活着
+    SILENCE_SKIP                                        // 持续静音，跳过转换与编码
+};
+
+// 静音检测的统计信息
+typedef struct silence_stats
+{
+    int64_t frames;                                     // 检测过的帧数
+    int64_t skipped_frames;                             // 跳过编码的帧数
+    int64_t comfort_frames;                             // 静音期间发送的舒适噪声帧数
+    int64_t silent_periods;                             // 进入静音的次数
+    double  last_level;                                 // 最近一帧的电平，单位dBFS
+}SilenceStats;
+
+/**
+ * 基于能量的静音检测(简单VAD)，用于音频的不连续传输(DTX)。
+ * 1）每帧计算s16样本的均方能量，转成dBFS与阈值比较。x86上用SSE2的_mm_madd_epi16一次处理8个样本，其它平台用标量实现，结果完全一致。
+ * 2）连续静音超过hangover_ms才进入静音状态，避免把词与词之间的短停顿切掉；一旦有声音立即退出静音状态。
+ * 3）静音期间每隔comfort_interval_ms返回一次SILENCE_COMFORT，由调用者把这一帧(真实的背景噪声)正常编码发送，其余帧跳过。
+ *
+ * 注意：跳过的帧调用者仍然要累加时间戳(AVPublishTime::get_audio_pts)，这样发送的帧时间戳是连续的真实时间，接收端看到的是时间戳的空洞。
+ */
+class SilenceDetector
+{
+public:
+    SilenceDetector();
+
+    RET_CODE Init(const Properties &properties);
+    SilenceAction Process(const int16_t *pcm, int nb_samples);     // nb_samples为所有通道的样本总数
+    void GetStats(SilenceStats *stats);
+
+    // 计算s16样本的平方和，x86上使用SSE2
+    static int64_t SumOfSquares(const int16_t *pcm, int nb_samples);
+
+private:
+    int threshold_db_ = -50;                            // 低于该电平认为是静音，单位dBFS
+    int hangover_ms_ = 300;                             // 连续静音超过该时长才跳过编码
+    int comfort_interval_ms_ = 500;                     // 静音期间舒适噪声帧的间隔，0表示完全不发送
+    int frame_duration_ms_ = 21;                        // 一帧的时长，用于把上面的时长转成帧数
+
+    int hangover_frames_ = 0;
+    int comfort_frames_interval_ = 0;
+    int silent_count_ = 0;                              // 连续静音的帧数
+    int64_t threshold_energy_ = 0;                      // 阈值对应的每个样本的平均能量
+    SilenceStats stats_;
+};
+
+#endif // SILENCEDETECTOR_H
@@ -0,0 +1,223 @@
+﻿#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "simulcast.h"
+#include "dlog.h"
+#include "timesutil.h"
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+
+RET_CODE ParseVideoLayers(const std::string &str, std::vector<VideoLayer> *layers)
+{
+    layers->clear();
+    size_t begin = 0;
+    while(begin < str.size()) {
+        size_t end = str.find(',', begin);
+        if(end == std::string::npos) {
+            end = str.size();
+        }
+        std::string item = str.substr(begin, end - begin);
+        VideoLayer layer;
+        int kbps = 0;
+        if(sscanf(item.c_str(), "%dx%d@%d", &layer.width, &layer.height, &kbps) != 3
+                || layer.width <= 0 || layer.height <= 0 || kbps <= 0
+                || (layer.width & 1) || (layer.height & 1)) {     // yuv420p的宽高必须是偶数
+            LogError("invalid video layer: %s", item.c_str());
+            return RET_ERR_PARAMISMATCH;
+        }
+        layer.bitrate = kbps * 1024;
+        layers->push_back(layer);
+        begin = end + 1;
+    }
+    std::sort(layers->begin(), layers->end(), [](const VideoLayer &a, const VideoLayer &b) {
+        return a.width * a.height > b.width * b.height;
+    });
+    return RET_OK;
+}
+
+ScaleCascade::ScaleCascade()
+{
+}
+
+ScaleCascade::~ScaleCascade()
+{
+    for(size_t i = 0; i < levels_.size(); i++) {
+        sws_freeContext(levels_[i].sws);
+    }
+}
+
+/**
+ * @brief 为每一层创建缩放上下文，第一层的输入是原始帧，之后每层的输入是上一层。
+ * @return 成功 0 失败 other
+ */
+RET_CODE ScaleCascade::Init(int src_width, int src_height, const std::vector<VideoLayer> &layers)
+{
+    int in_width = src_width;
+    int in_height = src_height;
+    for(size_t i = 0; i < layers.size(); i++) {
+        if(layers[i].width > in_width || layers[i].height > in_height) {
+            LogError("layer %dx%d is larger than its input %dx%d", layers[i].width, layers[i].height, in_width, in_height);
+            return RET_ERR_PARAMISMATCH;
+        }
+        ScaleLevel level;
+        level.src_width = in_width;
+        level.src_height = in_height;
+        level.width = layers[i].width;
+        level.height = layers[i].height;
+        level.sws = sws_getContext(in_width, in_height, AV_PIX_FMT_YUV420P, level.width, level.height,
+                                   AV_PIX_FMT_YUV420P, SWS_BILINEAR, NULL, NULL, NULL);
+        if(!level.sws) {
+            LogError("sws_getContext %dx%d->%dx%d failed", in_width, in_height, level.width, level.height);
+            return RET_FAIL;
+        }
+        level.frame.resize(level.width * level.height * 3 / 2);
+        levels_.push_back(level);
+        in_width = level.width;
+        in_height = level.height;
+    }
+    return RET_OK;
+}
+
+void ScaleCascade::Scale(const uint8_t *src)
+{
+    int64_t begin = TimesUtil::GetTimeMicrosecond();
+    const uint8_t *in = src;
+    for(size_t i = 0; i < levels_.size(); i++) {
+        ScaleLevel &level = levels_[i];
+        uint8_t *src_data[4], *dst_data[4];
+        int src_linesize[4], dst_linesize[4];
+        av_image_fill_arrays(src_data, src_linesize, in, AV_PIX_FMT_YUV420P, level.src_width, level.src_height, 1);
+        av_image_fill_arrays(dst_data, dst_linesize, &level.frame[0], AV_PIX_FMT_YUV420P, level.width, level.height, 1);
+        sws_scale(level.sws, src_data, src_linesize, 0, level.src_height, dst_data, dst_linesize);
+        in = &level.frame[0];
+    }
+    scale_time_ += TimesUtil::GetTimeMicrosecond() - begin;
+}
+
+uint8_t *ScaleCascade::GetFrame(int index)
+{
+    return &levels_[index].frame[0];
+}
+
+int ScaleCascade::GetFrameSize(int index)
+{
+    return (int)levels_[index].frame.size();
+}
+
+int64_t ScaleCascade::GetScaleTime()
+{
+    return scale_time_;
+}
+
+SimulcastLayer::SimulcastLayer()
+{
+    memset(&stats_, 0, sizeof(SimulcastLayerStats));
+}
+
+SimulcastLayer::~SimulcastLayer()
+{
+    Stop();
+    if(encoder_) {
+        delete encoder_;
+        encoder_ = NULL;
+    }
+}
+
+/**
+ * @brief 初始化这一层的编码器。
+ * @param "width"、"height"、"fps"、"bitrate"、"gop" 与H264Encoder相同
+ * @return 成功 0 失败 other
+ */
+RET_CODE SimulcastLayer::Init(const Properties &properties)
+{
+    width_ = properties.GetProperty("width", 0);
+    height_ = properties.GetProperty("height", 0);
+    frame_size_ = width_ * height_ * 3 / 2;
+    encoder_ = new H264Encoder();
+    if(encoder_->Init(properties) != RET_OK) {
+        LogError("layer %dx%d H264Encoder Init failed", width_, height_);
+        return RET_FAIL;
+    }
+    pending_.resize(frame_size_);
+    working_.resize(frame_size_);
+    return RET_OK;
+}
+
+void SimulcastLayer::AddCallback(std::function<void (AVPacket *)> callback)
+{
+    callable_object_ = callback;
+}
+
+H264Encoder *SimulcastLayer::GetEncoder()
+{
+    return encoder_;
+}
+
+void SimulcastLayer::Submit(const uint8_t *yuv, int64_t pts)
+{
+    std::lock_guard<PushMutex> lock(mutex_);
+    stats_.frames++;
+    if(has_pending_) {
+        stats_.dropped_frames++;                        // 上一帧还没被取走，直接覆盖
+    }
+    memcpy(&pending_[0], yuv, frame_size_);
+    pending_pts_ = pts;
+    has_pending_ = true;
+    cond_.notify_one();
+}
+
+void SimulcastLayer::Stop()
+{
+    {
+        std::lock_guard<PushMutex> lock(mutex_);
+        request_abort_ = true;
+        cond_.notify_one();
+    }
+    CommonLooper::Stop();
+}
+
+void SimulcastLayer::Loop()
+{
+    LogInfo("layer %dx%d loop into", width_, height_);
+    while(true) {
+        int64_t pts = 0;
+        {
+            std::unique_lock<PushMutex> lock(mutex_);
+            cond_.wait(lock, [this] { return request_abort_ || has_pending_; });
+            if(request_abort_) {
+                break;
+            }
+            std::swap(pending_, working_);
+            pts = pending_pts_;
+            has_pending_ = false;
+        }
+
+        int pkt_frame = 0;
+        RET_CODE encode_ret = RET_OK;
+        int64_t begin = TimesUtil::GetTimeMicrosecond();
+        AVPacket *packet = encoder_->Encode(&working_[0], frame_size_, pts, &pkt_frame, &encode_ret);
+        int64_t encode_time = TimesUtil::GetTimeMicrosecond() - begin;
+        {
+            std::lock_guard<PushMutex> lock(mutex_);
+            stats_.encoded_frames++;
+            stats_.encode_time += encode_time;
+            stats_.encoded_bytes += packet ? packet->size : 0;
+        }
+        if(!packet) {
+            continue;
+        }
+        if(callable_object_) {
+            callable_object_(packet);
+        } else {
+            av_packet_free(&packet);
+        }
+    }
+    LogInfo("layer %dx%d loop leave", width_, height_);
+}
+
+void SimulcastLayer::GetStats(SimulcastLayerStats *stats)
+{
+    std::lock_guard<PushMutex> lock(mutex_);
+    *stats = stats_;
+}
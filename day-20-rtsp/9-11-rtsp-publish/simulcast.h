@@ -0,0 +1,111 @@
+﻿#ifndef SIMULCAST_H
+#define SIMULCAST_H
+
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include "instrument.h"
+#include "mediabase.h"
+#include "commonlooper.h"
+#include "h264encoder.h"
+extern "C" {
+#include <libswscale/swscale.h>
+}
+
+// 一个分辨率层
+typedef struct video_layer
+{
+    int width;
+    int height;
+    int bitrate;                                        // 单位bps
+}VideoLayer;
+
+// 一个分辨率层的统计信息
+typedef struct simulcast_layer_stats
+{
+    int64_t frames;                                     // 提交的帧数
+    int64_t encoded_frames;                             // 编码的帧数
+    int64_t dropped_frames;                             // 编码跟不上采集被覆盖的帧数
+    int64_t encoded_bytes;
+    int64_t encode_time;                                // 编码累计耗时，单位us
+}SimulcastLayerStats;
+
+/**
+ * @brief 解析分辨率层的配置，格式为"宽x高@码率kbps"，多个层用逗号分隔，例如"1280x720@1024,640x360@512"。
+ * @return 成功 0 失败 other，结果按分辨率从大到小排列。
+ */
+RET_CODE ParseVideoLayers(const std::string &str, std::vector<VideoLayer> *layers);
+
+/**
+ * 逐级缩放：第一层从采集的原始帧缩放，之后每一层从上一层(更大的一层)缩放，而不是每层都从原始帧缩放，
+ * 例如1080p->720p->360p，360p只需要读取720p的数据，总的缩放开销接近只缩放一次。所有帧都是紧凑的yuv420p。
+ */
+class ScaleCascade
+{
+public:
+    ScaleCascade();
+    ~ScaleCascade();
+
+    RET_CODE Init(int src_width, int src_height, const std::vector<VideoLayer> &layers);  // layers按从大到小排列
+    void Scale(const uint8_t *src);                     // 缩放出所有层
+    uint8_t *GetFrame(int index);
+    int GetFrameSize(int index);
+    int64_t GetScaleTime();                             // 缩放累计耗时，单位us
+
+private:
+    typedef struct scale_level
+    {
+        SwsContext *sws;
+        int src_width;
+        int src_height;
+        int width;
+        int height;
+        std::vector<uint8_t> frame;
+    }ScaleLevel;
+
+    std::vector<ScaleLevel> levels_;
+    int64_t scale_time_ = 0;
+};
+
+/**
+ * 一个分辨率层：独立的编码线程，编码后的包通过回调交给各自的推流器。采集线程通过Submit提交缩放后的帧，编码线程取出最新的一帧编码后推送。
+ * 只保留一帧待编码，编码跟不上采集时新的帧覆盖旧的帧(计入dropped_frames)，不会阻塞采集线程和其它层。
+ */
+class SimulcastLayer : public CommonLooper
+{
+public:
+    SimulcastLayer();
+    virtual ~SimulcastLayer();
+
+    RET_CODE Init(const Properties &properties);
+    void AddCallback(std::function<void(AVPacket *)> callback);    // 编码后的包交给回调，由回调接管，需要在Start之前设置
+    H264Encoder *GetEncoder();
+    void Submit(const uint8_t *yuv, int64_t pts);       // 拷贝一帧，唤醒编码线程
+    virtual void Stop();
+    virtual void Loop();
+    void GetStats(SimulcastLayerStats *stats);
+    inline int GetWidth() {
+        return width_;
+    }
+    inline int GetHeight() {
+        return height_;
+    }
+
+private:
+    int width_ = 0;
+    int height_ = 0;
+    int frame_size_ = 0;
+    H264Encoder *encoder_ = NULL;
+    std::function<void(AVPacket *)> callable_object_ = NULL;
+
+    PushMutex mutex_{PUSH_LOCK_SITE("simulcast")};
+    PushCondition cond_;
+    std::vector<uint8_t> pending_;                      // 采集线程写入，等待编码的帧
+    std::vector<uint8_t> working_;                      // 编码线程正在编码的帧
+    bool has_pending_ = false;
+    int64_t pending_pts_ = 0;
+    SimulcastLayerStats stats_;
+};
+
+#endif // SIMULCAST_H
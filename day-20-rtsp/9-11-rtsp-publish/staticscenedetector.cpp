@@ -0,0 +1,212 @@
+﻿#include <string.h>
+#include <stdlib.h>
+#include "staticscenedetector.h"
+#include "dlog.h"
+#include "timesutil.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SCENE_USE_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#define SCENE_USE_AVX2 1
+#include <immintrin.h>
+#endif
+
+#define SCENE_BLOCK_SIZE 16
+
+StaticSceneDetector::StaticSceneDetector()
+{
+    memset(&stats_, 0, sizeof(SceneStats));
+}
+
+/**
+ * @brief 设置检测参数。
+ * @param "width"               亮度平面的宽
+ *        "height"              亮度平面的高
+ *        "mode"                "skip"跳过编码，"qp"只降低质量，默认"skip"
+ *        "block_threshold"     块内平均每个像素的差超过该值认为该块变化了，默认2
+ *        "max_changed_blocks"  变化的块数不超过该值认为画面静止，默认0
+ *        "hangover_frames"     连续静止超过该帧数才进入静止状态，默认5
+ *        "max_skip_frames"     跳过模式下连续跳过的最大帧数，默认25
+ * @return 成功 0 失败 other
+ */
+RET_CODE StaticSceneDetector::Init(const Properties &properties)
+{
+    width_              = properties.GetProperty("width", 0);
+    height_             = properties.GetProperty("height", 0);
+    std::string mode    = properties.GetProperty("mode", "skip");
+    block_threshold_    = properties.GetProperty("block_threshold", 2);
+    max_changed_blocks_ = properties.GetProperty("max_changed_blocks", 0);
+    hangover_frames_    = properties.GetProperty("hangover_frames", 5);
+    max_skip_frames_    = properties.GetProperty("max_skip_frames", 25);
+    if(width_ <= 0 || height_ <= 0 || block_threshold_ < 0 || (mode != "skip" && mode != "qp")) {
+        LogError("invalid width: %d, height: %d, block_threshold: %d or mode: %s",
+                 width_, height_, block_threshold_, mode.c_str());
+        return RET_ERR_PARAMISMATCH;
+    }
+    skip_ = (mode == "skip");
+    reference_.resize(width_ * height_);
+    has_reference_ = false;
+    LogInfo("static scene mode: %s, block threshold: %d, max changed blocks: %d, hangover: %d frames, max skip: %d frames",
+            mode.c_str(), block_threshold_, max_changed_blocks_, hangover_frames_, max_skip_frames_);
+    return RET_OK;
+}
+
+/**
+ * @brief 计算一个16x16块的SAD。_mm_sad_epu8对16个字节求绝对差，分别在低、高64位得到前8个与后8个字节的和。
+ * @return SAD，最大16*16*255，32位不会溢出。
+ */
+uint32_t StaticSceneDetector::BlockSad16x16(const uint8_t *src1, int stride1, const uint8_t *src2, int stride2)
+{
+#ifdef SCENE_USE_SSE2
+    __m128i acc = _mm_setzero_si128();
+    for(int i = 0; i < SCENE_BLOCK_SIZE; i++) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src1 + i * stride1));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src2 + i * stride2));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(a, b));
+    }
+    return (uint32_t)(_mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8)));
+#else
+    uint32_t sad = 0;
+    for(int i = 0; i < SCENE_BLOCK_SIZE; i++) {
+        for(int j = 0; j < SCENE_BLOCK_SIZE; j++) {
+            sad += abs(src1[i * stride1 + j] - src2[i * stride2 + j]);
+        }
+    }
+    return sad;
+#endif
+}
+
+// 任意大小的块，用于右边、下边不足16的部分
+static uint32_t block_sad_c(const uint8_t *src1, int stride1, const uint8_t *src2, int stride2, int w, int h)
+{
+    uint32_t sad = 0;
+    for(int i = 0; i < h; i++) {
+        for(int j = 0; j < w; j++) {
+            sad += abs(src1[i * stride1 + j] - src2[i * stride2 + j]);
+        }
+    }
+    return sad;
+}
+
+#ifdef SCENE_USE_AVX2
+// 相邻的两个16x16块，_mm256_sad_epu8的4个64位结果中，0、1属于左边的块，2、3属于右边的块
+static void block_sad_32x16_avx2(const uint8_t *src1, int stride1, const uint8_t *src2, int stride2,
+                                 uint32_t *sad_left, uint32_t *sad_right)
+{
+    __m256i acc = _mm256_setzero_si256();
+    for(int i = 0; i < SCENE_BLOCK_SIZE; i++) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src1 + i * stride1));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src2 + i * stride2));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(a, b));
+    }
+    __m128i lo = _mm256_castsi256_si128(acc);
+    __m128i hi = _mm256_extracti128_si256(acc, 1);
+    *sad_left = (uint32_t)(_mm_cvtsi128_si32(lo) + _mm_cvtsi128_si32(_mm_srli_si128(lo, 8)));
+    *sad_right = (uint32_t)(_mm_cvtsi128_si32(hi) + _mm_cvtsi128_si32(_mm_srli_si128(hi, 8)));
+}
+#endif
+
+/**
+ * @brief 统计与参考帧相比变化的块数，超过max_changed_blocks后提前返回。
+ * @return 变化的块数。
+ */
+int StaticSceneDetector::countChangedBlocks(const uint8_t *y, int stride)
+{
+    const uint8_t *ref = &reference_[0];
+    uint32_t full_threshold = (uint32_t)block_threshold_ * SCENE_BLOCK_SIZE * SCENE_BLOCK_SIZE;
+    int changed = 0;
+    for(int by = 0; by < height_; by += SCENE_BLOCK_SIZE) {
+        int h = height_ - by < SCENE_BLOCK_SIZE ? height_ - by : SCENE_BLOCK_SIZE;
+        const uint8_t *cur_row = y + by * stride;
+        const uint8_t *ref_row = ref + by * width_;
+        int bx = 0;
+        if(h == SCENE_BLOCK_SIZE) {
+#ifdef SCENE_USE_AVX2
+            for(; bx + SCENE_BLOCK_SIZE * 2 <= width_; bx += SCENE_BLOCK_SIZE * 2) {
+                uint32_t sad_left, sad_right;
+                block_sad_32x16_avx2(cur_row + bx, stride, ref_row + bx, width_, &sad_left, &sad_right);
+                changed += (sad_left > full_threshold) + (sad_right > full_threshold);
+                if(changed > max_changed_blocks_) {
+                    return changed;
+                }
+            }
+#endif
+            for(; bx + SCENE_BLOCK_SIZE <= width_; bx += SCENE_BLOCK_SIZE) {
+                if(BlockSad16x16(cur_row + bx, stride, ref_row + bx, width_) > full_threshold
+                        && ++changed > max_changed_blocks_) {
+                    return changed;
+                }
+            }
+        }
+        // 右边、下边不足16的部分，阈值按实际的像素数计算
+        for(; bx < width_; bx += SCENE_BLOCK_SIZE) {
+            int w = width_ - bx < SCENE_BLOCK_SIZE ? width_ - bx : SCENE_BLOCK_SIZE;
+            if(block_sad_c(cur_row + bx, stride, ref_row + bx, width_, w, h) > (uint32_t)block_threshold_ * w * h
+                    && ++changed > max_changed_blocks_) {
+                return changed;
+            }
+        }
+    }
+    return changed;
+}
+
+void StaticSceneDetector::updateReference(const uint8_t *y, int stride)
+{
+    for(int i = 0; i < height_; i++) {
+        memcpy(&reference_[i * width_], y + i * stride, width_);
+    }
+    has_reference_ = true;
+}
+
+/**
+ * @brief 检测一帧。返回SCENE_ENCODE或者SCENE_STATIC时这一帧会作为新的参考帧。
+ * @param y 亮度平面。
+ * @param stride 亮度平面每行的字节数。
+ * @return 这一帧的处理方式。
+ */
+SceneAction StaticSceneDetector::Process(const uint8_t *y, int stride)
+{
+    if(!y || stride < width_) {
+        return SCENE_ENCODE;
+    }
+    stats_.frames++;
+    if(!has_reference_) {
+        updateReference(y, stride);
+        return SCENE_ENCODE;
+    }
+    int64_t begin = TimesUtil::GetTimeMicrosecond();
+    stats_.last_changed_blocks = countChangedBlocks(y, stride);
+    stats_.detect_time += TimesUtil::GetTimeMicrosecond() - begin;
+    if(stats_.last_changed_blocks > max_changed_blocks_) {
+        static_count_ = 0;                              // 画面有变化，立即恢复正常编码
+        skip_count_ = 0;
+        updateReference(y, stride);
+        return SCENE_ENCODE;
+    }
+
+    static_count_++;
+    if(static_count_ <= hangover_frames_) {
+        updateReference(y, stride);                     // 拖尾期内仍然正常编码
+        return SCENE_ENCODE;
+    }
+    if(static_count_ == hangover_frames_ + 1) {
+        stats_.static_periods++;
+    }
+    if(skip_ && skip_count_ < max_skip_frames_) {
+        skip_count_++;
+        stats_.skipped_frames++;
+        return SCENE_SKIP;                              // 参考帧保持不变
+    }
+    skip_count_ = 0;
+    stats_.static_frames++;
+    updateReference(y, stride);
+    return SCENE_STATIC;
+}
+
+void StaticSceneDetector::GetStats(SceneStats *stats)
+{
+    if(stats) {
+        *stats = stats_;
+    }
+}
@@ -0,0 +1,69 @@
+﻿#ifndef STATICSCENEDETECTOR_H
+#define STATICSCENEDETECTOR_H
+
+#include <stdint.h>
+#include <vector>
+#include "mediabase.h"
+
+// 一帧yuv的处理方式
+enum SceneAction
+{
+    SCENE_ENCODE = 0,                                   // 画面在变化(或者还在拖尾期内)，正常编码
+    SCENE_STATIC,                                       // 静止画面，编码但可以降低质量(提高qp)，跳过模式下也用于定期刷新
+    SCENE_SKIP                                          // 静止画面，跳过编码，接收端继续显示上一帧
+};
+
+// 静止画面检测的统计信息
+typedef struct scene_stats
+{
+    int64_t frames;                                     // 检测过的帧数
+    int64_t static_frames;                              // 返回SCENE_STATIC的帧数
+    int64_t skipped_frames;                             // 返回SCENE_SKIP的帧数
+    int64_t static_periods;                             // 进入静止状态的次数
+    int64_t detect_time;                                // 检测累计耗时，单位us
+    int     last_changed_blocks;                        // 最近一帧变化的块数(超过max_changed_blocks后不再继续统计)
+}SceneStats;
+
+/**
+ * 静止画面检测，用于桌面、课件等大部分时间画面不动的场景，节省视频编码的cpu。
+ * 1）把亮度平面分成16x16的块，计算当前帧与参考帧每块的SAD(绝对差之和)，平均每个像素的差超过block_threshold认为该块变化了，
+ *    可以容忍采集带来的轻微噪声。x86上用SSE2的_mm_sad_epu8一次处理一行16个像素，编译时开启AVX2(-mavx2或者/arch:AVX2)
+ *    则用_mm256_sad_epu8一次处理相邻两个块，其它平台用标量实现，结果完全一致。变化的块数一旦超过max_changed_blocks就提前结束。
+ * 2）参考帧是最近一次送去编码的帧，而不是上一帧，这样缓慢的渐变累积起来也能被检测到，不会一直跳过。
+ * 3）画面静止超过hangover_frames帧才进入静止状态，让编码器有几帧时间把刚停下来的画面质量补上来；一旦有变化立即退出。
+ * 4）跳过模式下连续跳过max_skip_frames帧后返回一次SCENE_STATIC强制编码一帧，保持码流不断，避免接收端或者服务器认为流超时。
+ *
+ * 注意：跳过的帧调用者仍然要累加时间戳(AVPublishTime::get_video_pts)，接收端看到的是时间戳的空洞，期间继续显示上一帧。
+ */
+class StaticSceneDetector
+{
+public:
+    StaticSceneDetector();
+
+    RET_CODE Init(const Properties &properties);
+    SceneAction Process(const uint8_t *y, int stride);             // y为亮度平面，stride为每行的字节数
+    void GetStats(SceneStats *stats);
+
+    // 计算一个16x16块的SAD，x86上使用SSE2
+    static uint32_t BlockSad16x16(const uint8_t *src1, int stride1, const uint8_t *src2, int stride2);
+
+private:
+    int countChangedBlocks(const uint8_t *y, int stride);
+    void updateReference(const uint8_t *y, int stride);
+
+    int width_ = 0;
+    int height_ = 0;
+    int skip_ = 0;                                      // 1跳过编码，0只降低质量
+    int block_threshold_ = 2;                           // 块内平均每个像素的差超过该值认为该块变化了
+    int max_changed_blocks_ = 0;                        // 变化的块数不超过该值认为画面静止，桌面场景下鼠标的移动只影响几个块
+    int hangover_frames_ = 5;                           // 连续静止超过该帧数才进入静止状态
+    int max_skip_frames_ = 25;                          // 跳过模式下连续跳过的最大帧数
+
+    std::vector<uint8_t> reference_;                    // 参考帧的亮度平面，紧凑存放
+    bool has_reference_ = false;
+    int static_count_ = 0;                              // 连续静止的帧数
+    int skip_count_ = 0;                                // 连续跳过的帧数
+    SceneStats stats_;
+};
+
+#endif // STATICSCENEDETECTOR_H
@@ -0,0 +1,287 @@
+﻿#include <math.h>
+#include <string.h>
+#include "testpattern.h"
+#include "dlog.h"
+#if defined(__AVX2__)
+#define PATTERN_USE_AVX2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PATTERN_USE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// 3x5点阵的数字，每个数字15位，从上到下、从左到右
+static const uint16_t kDigitFont[10] = {
+    0x7B6F, 0x2C97, 0x73E7, 0x73CF, 0x5BC9, 0x79CF, 0x79EF, 0x7249, 0x7BEF, 0x7BCF
+};
+#define COUNTER_DIGITS  8
+
+static uint32_t splitmix(uint64_t *z)
+{
+    uint64_t r = (*z += 0x9E3779B97F4A7C15ULL);
+    r = (r ^ (r >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    r = (r ^ (r >> 27)) * 0x94D049BB133111EBULL;
+    r ^= r >> 31;
+    return (uint32_t)r | 1;                             // xorshift的状态不能为0
+}
+
+/**
+ * @brief 设置测试图像的参数。
+ * @param "width" "height"  宽高，必须是偶数
+ *        "pattern"         gradient或者noise，noise等价于gradient加上noise_bits=8
+ *        "noise_bits"      每个像素随机的低位数，0-8，默认gradient为0
+ *        "seed"            随机数种子，默认1
+ *        "counter"         1 左上角画出帧序号，默认1
+ * @return 成功 0 失败 other
+ */
+RET_CODE VideoPattern::Init(const Properties &properties)
+{
+    width_      = properties.GetProperty("width", 0);
+    height_     = properties.GetProperty("height", 0);
+    std::string pattern = properties.GetProperty("pattern", "gradient");
+    noise_bits_ = properties.GetProperty("noise_bits", pattern == "noise" ? 8 : 0);
+    seed_       = (uint32_t)properties.GetProperty("seed", 1);
+    counter_    = properties.GetProperty("counter", 1);
+    if(width_ <= 0 || height_ <= 0 || (width_ % 2) != 0 || (height_ % 2) != 0) {
+        LogError("invalid width: %d or height: %d", width_, height_);
+        return RET_ERR_PARAMISMATCH;
+    }
+    if((pattern != "gradient" && pattern != "noise") || noise_bits_ < 0 || noise_bits_ > 8) {
+        LogError("invalid pattern: %s or noise_bits: %d", pattern.c_str(), noise_bits_);
+        return RET_ERR_PARAMISMATCH;
+    }
+    ramp_.resize(width_ + 256);
+    for(size_t i = 0; i < ramp_.size(); i++) {
+        ramp_[i] = (uint8_t)i;
+    }
+    LogInfo("video pattern %dx%d: %s, noise_bits: %d, seed: %u", width_, height_, pattern.c_str(), noise_bits_, seed_);
+    return RET_OK;
+}
+
+/**
+ * @brief 填充一个平面，像素值为(offset + x*x_step + y*y_step) & 0xff，x_step只能是0或者1。
+ *        噪声逐行紧接着渐变叠加，行还在L1缓存里，整帧只写一遍内存。
+ * @param rng 8路xorshift32的状态，NULL表示不加噪声。
+ * @return void。
+ */
+void VideoPattern::fillPlane(uint8_t *plane, int width, int height, int x_step, int y_step, int offset, uint32_t *rng)
+{
+    uint8_t mask = (uint8_t)((1 << noise_bits_) - 1);
+    for(int y = 0; y < height; y++) {
+        uint8_t *row = plane + y * width;
+        uint8_t base = (uint8_t)(offset + y * y_step);
+        if(x_step) {
+            memcpy(row, &ramp_[base], width);
+        } else {
+            memset(row, base, width);
+        }
+        if(rng) {
+            AddNoise(row, width, rng, mask);
+        }
+    }
+}
+
+/**
+ * @brief 生成第index帧。
+ * @param yuv 紧凑的yuv420p，大小GetFrameSize()。
+ * @param index 帧序号，决定渐变的位置与随机数。
+ * @return void。
+ */
+void VideoPattern::Fill(uint8_t *yuv, int64_t index)
+{
+    int chroma_width = width_ / 2;
+    int chroma_height = height_ / 2;
+    uint8_t *y_plane = yuv;
+    uint8_t *u_plane = y_plane + width_ * height_;
+    uint8_t *v_plane = u_plane + chroma_width * chroma_height;
+    uint32_t rng[8];
+    uint32_t *noise = NULL;
+    if(noise_bits_ > 0) {
+        uint64_t z = ((uint64_t)seed_ << 32) ^ (uint64_t)index;
+        for(int lane = 0; lane < 8; lane++) {
+            rng[lane] = splitmix(&z);
+        }
+        noise = rng;
+    }
+    int i = (int)(index & 0xff);
+    fillPlane(y_plane, width_, height_, 1, 1, 3 * i, noise);
+    fillPlane(u_plane, chroma_width, chroma_height, 0, 1, 128 + 2 * i, noise);
+    fillPlane(v_plane, chroma_width, chroma_height, 1, 0, 64 + 5 * i, noise);
+    if(counter_) {
+        drawCounter(y_plane, index);
+    }
+}
+
+/**
+ * @brief 给一段字节加上随机噪声(按字节回绕相加)，每32字节8路xorshift32各前进一步，第k路的4个字节按小端放在k*4处。
+ * @param row 传入传出。
+ * @param width 字节数。
+ * @param rng 传入传出，8路状态。
+ * @param mask 随机数的掩码，(1<<noise_bits)-1。
+ * @return void。
+ */
+void VideoPattern::AddNoise(uint8_t *row, int width, uint32_t rng[8], uint8_t mask)
+{
+    int x = 0;
+#if defined(PATTERN_USE_AVX2)
+    __m256i s = _mm256_loadu_si256((const __m256i *)rng);
+    __m256i m = _mm256_set1_epi8((char)mask);
+    for(; x + 32 <= width; x += 32) {
+        s = _mm256_xor_si256(s, _mm256_slli_epi32(s, 13));
+        s = _mm256_xor_si256(s, _mm256_srli_epi32(s, 17));
+        s = _mm256_xor_si256(s, _mm256_slli_epi32(s, 5));
+        __m256i v = _mm256_loadu_si256((const __m256i *)(row + x));
+        _mm256_storeu_si256((__m256i *)(row + x), _mm256_add_epi8(v, _mm256_and_si256(s, m)));
+    }
+    _mm256_storeu_si256((__m256i *)rng, s);
+#elif defined(PATTERN_USE_SSE2)
+    __m128i s0 = _mm_loadu_si128((const __m128i *)rng);
+    __m128i s1 = _mm_loadu_si128((const __m128i *)(rng + 4));
+    __m128i m = _mm_set1_epi8((char)mask);
+    for(; x + 32 <= width; x += 32) {
+        s0 = _mm_xor_si128(s0, _mm_slli_epi32(s0, 13));
+        s1 = _mm_xor_si128(s1, _mm_slli_epi32(s1, 13));
+        s0 = _mm_xor_si128(s0, _mm_srli_epi32(s0, 17));
+        s1 = _mm_xor_si128(s1, _mm_srli_epi32(s1, 17));
+        s0 = _mm_xor_si128(s0, _mm_slli_epi32(s0, 5));
+        s1 = _mm_xor_si128(s1, _mm_slli_epi32(s1, 5));
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(row + x));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(row + x + 16));
+        _mm_storeu_si128((__m128i *)(row + x), _mm_add_epi8(v0, _mm_and_si128(s0, m)));
+        _mm_storeu_si128((__m128i *)(row + x + 16), _mm_add_epi8(v1, _mm_and_si128(s1, m)));
+    }
+    _mm_storeu_si128((__m128i *)rng, s0);
+    _mm_storeu_si128((__m128i *)(rng + 4), s1);
+#endif
+    // 标量实现，x86上只处理不足32字节的尾部
+    while(x < width) {
+        uint8_t bytes[32];
+        for(int lane = 0; lane < 8; lane++) {
+            uint32_t r = rng[lane];
+            r ^= r << 13;
+            r ^= r >> 17;
+            r ^= r << 5;
+            rng[lane] = r;
+            for(int k = 0; k < 4; k++) {
+                bytes[lane * 4 + k] = (uint8_t)(r >> (8 * k));
+            }
+        }
+        int n = width - x < 32 ? width - x : 32;
+        for(int k = 0; k < n; k++) {
+            row[x + k] = (uint8_t)(row[x + k] + (bytes[k] & mask));
+        }
+        x += n;
+    }
+}
+
+/**
+ * @brief 在亮度平面左上角画出8位十进制的帧序号，黑底白字，每个点阵格子scale x scale个像素。
+ * @return void。
+ */
+void VideoPattern::drawCounter(uint8_t *y_plane, int64_t index)
+{
+    int scale = height_ / 60 > 2 ? height_ / 60 : 2;
+    int box_width = (COUNTER_DIGITS * 4 + 1) * scale;
+    int box_height = 7 * scale;
+    if(box_width > width_ || box_height > height_) {
+        return;
+    }
+    for(int y = 0; y < box_height; y++) {
+        memset(y_plane + y * width_, 16, box_width);
+    }
+    int64_t value = index;
+    for(int d = COUNTER_DIGITS - 1; d >= 0; d--) {
+        uint16_t glyph = kDigitFont[value % 10];
+        value /= 10;
+        int left = (d * 4 + 1) * scale;
+        for(int row = 0; row < 5; row++) {
+            for(int col = 0; col < 3; col++) {
+                if(!(glyph & (1 << (14 - row * 3 - col)))) {
+                    continue;
+                }
+                for(int y = 0; y < scale; y++) {
+                    memset(y_plane + ((row + 1) * scale + y) * width_ + left + col * scale, 235, scale);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief 设置测试音频的参数。
+ * @param "sample_rate" "channels"  采样率与通道数
+ *        "pattern"         tone、sweep或者beep，默认tone
+ *        "frequency"       tone与beep的频率，默认1000hz
+ *        "sweep_start" "sweep_end" 扫频的起止频率，默认100hz到10000hz
+ *        "sweep_period_ms" 扫频周期，默认5000ms
+ *        "beep_ms"         beep每秒发声的时长，默认100ms
+ *        "amplitude_db"    正弦波的峰值，单位dBFS，默认-12
+ * @return 成功 0 失败 other
+ */
+RET_CODE AudioPattern::Init(const Properties &properties)
+{
+    sample_rate_    = properties.GetProperty("sample_rate", 48000);
+    channels_       = properties.GetProperty("channels", 2);
+    std::string pattern = properties.GetProperty("pattern", "tone");
+    frequency_      = properties.GetProperty("frequency", 1000);
+    sweep_start_    = properties.GetProperty("sweep_start", 100);
+    sweep_end_      = properties.GetProperty("sweep_end", 10000);
+    int sweep_period_ms = properties.GetProperty("sweep_period_ms", 5000);
+    int beep_ms     = properties.GetProperty("beep_ms", 100);
+    int amplitude_db = properties.GetProperty("amplitude_db", -12);
+    if(pattern == "tone") {
+        pattern_ = 0;
+    } else if(pattern == "sweep") {
+        pattern_ = 1;
+    } else if(pattern == "beep") {
+        pattern_ = 2;
+    } else {
+        LogError("unsupported audio pattern: %s", pattern.c_str());
+        return RET_ERR_NOT_SUPPORT;
+    }
+    if(sample_rate_ <= 0 || channels_ <= 0 || sweep_start_ <= 0 || sweep_end_ >= sample_rate_ / 2
+            || sweep_period_ms <= 0 || amplitude_db > 0) {
+        LogError("invalid sample_rate: %d, sweep: %0.0lf-%0.0lf or amplitude_db: %d", sample_rate_,
+                 sweep_start_, sweep_end_, amplitude_db);
+        return RET_ERR_PARAMISMATCH;
+    }
+    sweep_period_ = (int64_t)sample_rate_ * sweep_period_ms / 1000;
+    beep_samples_ = (int64_t)sample_rate_ * beep_ms / 1000;
+    amplitude_ = (int)(32767 * pow(10.0, amplitude_db / 20.0));
+    sine_.resize(4096);
+    for(int i = 0; i < 4096; i++) {
+        sine_[i] = (int16_t)(amplitude_ * sin(2 * M_PI * i / 4096));
+    }
+    LogInfo("audio pattern: %s, %dhz %dch, amplitude: %ddBFS", pattern.c_str(), sample_rate_, channels_, amplitude_db);
+    return RET_OK;
+}
+
+void AudioPattern::Fill(int16_t *pcm, int nb_samples)
+{
+    const double phase_per_hz = 4294967296.0 / sample_rate_;
+    // 对数扫频每个样本频率乘以固定的倍数
+    const double sweep_ratio = pow(sweep_end_ / sweep_start_, 1.0 / sweep_period_);
+    for(int i = 0; i < nb_samples; i++, samples_++) {
+        double frequency = frequency_;
+        if(1 == pattern_) {
+            if(0 == samples_ % sweep_period_) {
+                sweep_frequency_ = sweep_start_;
+            }
+            frequency = sweep_frequency_;
+            sweep_frequency_ *= sweep_ratio;
+        }
+        bool on = true;
+        if(2 == pattern_) {
+            int64_t pos = samples_ % sample_rate_;
+            if(0 == pos) {
+                phase_ = 0;                             // 每次beep从0相位开始，接收端按过零点定位
+            }
+            on = pos < beep_samples_;
+        }
+        int16_t value = on ? sine_[phase_ >> 20] : 0;
+        phase_ += (uint32_t)(frequency * phase_per_hz);
+        for(int c = 0; c < channels_; c++) {
+            pcm[i * channels_ + c] = value;
+        }
+    }
+}
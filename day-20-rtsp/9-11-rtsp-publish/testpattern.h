@@ -0,0 +1,71 @@
+﻿#ifndef TESTPATTERN_H
+#define TESTPATTERN_H
+
+#include <stdint.h>
+#include <vector>
+#include "mediabase.h"
+
+/**
+ * 合成的yuv420p测试图像，代替yuv文件做高分辨率、长时间的测试，不受磁盘读取速度限制。
+ * 1）gradient：与muxing.c的fill_yuv_image一样的移动渐变，Y=x+y+3i，U=128+y+2i，V=64+x+5i。每行都是一段连续递增的字节，
+ *    从预先生成的递增表memcpy得到，由libc的向量化memcpy完成，4K每帧只是几次内存拷贝。
+ * 2）noise：在渐变上叠加随机噪声，noise_bits(0-8)控制每个像素随机的低位数，即画面的熵，8为完全随机(编码器最难压缩)。
+ *    随机数是8路并行的xorshift32，x86上用AVX2一次生成32字节，或者SSE2分两半生成，其它平台用标量逐路模拟，三种实现的输出完全一致。
+ *    每帧的随机数状态由seed与帧序号决定，同样的参数每次运行得到完全一样的画面，便于重复对比编码器。
+ * 3）counter：左上角画出帧序号，方便接收端肉眼或者截图对比延时、丢帧。
+ */
+class VideoPattern
+{
+public:
+    RET_CODE Init(const Properties &properties);
+    void Fill(uint8_t *yuv, int64_t index);             // 生成第index帧，yuv为紧凑的yuv420p，大小width*height*3/2
+    inline int GetFrameSize() {
+        return width_ * height_ * 3 / 2;
+    }
+
+    // 给一行加上随机噪声，rng为8路xorshift32的状态
+    static void AddNoise(uint8_t *row, int width, uint32_t rng[8], uint8_t mask);
+
+private:
+    void fillPlane(uint8_t *plane, int width, int height, int x_step, int y_step, int offset, uint32_t *rng);
+    void drawCounter(uint8_t *y_plane, int64_t index);
+
+    int width_ = 0;
+    int height_ = 0;
+    int noise_bits_ = 0;
+    uint32_t seed_ = 1;
+    int counter_ = 1;
+    std::vector<uint8_t> ramp_;                         // ramp_[k] = k & 0xff，一行渐变从ramp_[起始值]开始拷贝
+};
+
+/**
+ * 合成的s16交错测试音频，代替pcm文件。
+ * 1）tone：固定频率的正弦波。
+ * 2）sweep：对数扫频，从sweep_start到sweep_end，每sweep_period_ms重复一次，可以检查编码器在整个频带上的表现。
+ * 3）beep：每秒开始时的beep_ms毫秒是正弦波，其余静音，与视频的帧序号一起用于检查音视频同步、测量端到端延时，也可以触发DTX。
+ * 相位用32位累加器，高12位查4096点的正弦表，不需要每个样本调用sin，样本序号从0开始，同样的参数每次运行输出完全一样。
+ */
+class AudioPattern
+{
+public:
+    RET_CODE Init(const Properties &properties);
+    void Fill(int16_t *pcm, int nb_samples);            // 生成接下来的nb_samples个样本(每个通道)
+
+private:
+    int sample_rate_ = 48000;
+    int channels_ = 2;
+    int pattern_ = 0;                                   // 0 tone 1 sweep 2 beep
+    double frequency_ = 1000;
+    double sweep_start_ = 100;
+    double sweep_end_ = 10000;
+    int64_t sweep_period_ = 0;                          // 单位样本
+    int64_t beep_samples_ = 0;
+    int amplitude_ = 8192;                              // 正弦波的峰值
+
+    uint32_t phase_ = 0;
+    double sweep_frequency_ = 100;                      // 扫频的当前频率
+    int64_t samples_ = 0;                               // 已经生成的样本数(每个通道)
+    std::vector<int16_t> sine_;
+};
+
+#endif // TESTPATTERN_H
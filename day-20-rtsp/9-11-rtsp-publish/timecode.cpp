@@ -0,0 +1,163 @@
+﻿#include <stdio.h>
+#include <string.h>
+#include "timecode.h"
+#include "dlog.h"
+
+#define TIMECODE_BYTES      (TIMECODE_COLUMNS * TIMECODE_ROWS / 8)
+#define TIMECODE_BLACK      16
+#define TIMECODE_WHITE      235
+
+// 3x5点阵的数字与':' '.'，每个字符15位，从上到下、从左到右，与testpattern.cpp的帧序号一样
+static const uint16_t kTimecodeFont[12] = {
+    0x7B6F, 0x2C97, 0x73E7, 0x73CF, 0x5BC9, 0x79CF, 0x79EF, 0x7249, 0x7BEF, 0x7BCF, 0x0410, 0x0002
+};
+#define TIMECODE_CHARS      12                          // HH:MM:SS.mmm
+
+static uint8_t crc8(const uint8_t *data, int size)
+{
+    uint8_t crc = 0;
+    for(int i = 0; i < size; i++) {
+        crc ^= data[i];
+        for(int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+int TimecodeStamper::GetBlockSize(int width)
+{
+    int block = (width / 80) & ~1;
+    return block < 4 ? 4 : block;
+}
+
+/**
+ * @brief 检查画面是否放得下时间码。
+ * @param width height 画面的宽高，必须是偶数
+ * @return 成功 0 失败 other
+ */
+RET_CODE TimecodeStamper::Init(int width, int height)
+{
+    width_ = width;
+    height_ = height;
+    block_ = GetBlockSize(width);
+    scale_ = block_ / 2 > 2 ? block_ / 2 : 2;
+    int digits_width = (TIMECODE_CHARS * 4 + 1) * scale_;
+    int bottom = height_ - (TIMECODE_ROWS + 1) * block_;
+    if(width_ <= 0 || height_ <= 0 || (width_ & 1) || (height_ & 1)
+            || (TIMECODE_COLUMNS + 2) * block_ > width_ || block_ + digits_width > width_
+            || bottom - 7 * scale_ < 0) {
+        LogError("timecode does not fit in %dx%d", width_, height_);
+        return RET_ERR_NOT_SUPPORT;
+    }
+    LogInfo("timecode: %dx%d, block %d, digit scale %d", width_, height_, block_, scale_);
+    return RET_OK;
+}
+
+/**
+ * @brief 把时间与帧序号画到画面的左下角。
+ * @param time 时间，单位ms，一般是采集的墙上时钟TimesUtil::GetTimeMillisecond()。
+ * @return void。
+ */
+void TimecodeStamper::Stamp(uint8_t *yuv, int64_t time)
+{
+    uint8_t bytes[TIMECODE_BYTES];
+    bytes[0] = TIMECODE_SYNC;
+    for(int i = 0; i < 6; i++) {
+        bytes[1 + i] = (uint8_t)(time >> (40 - i * 8));
+    }
+    bytes[7] = (uint8_t)(frame_ >> 8);
+    bytes[8] = (uint8_t)frame_;
+    bytes[9] = crc8(bytes + 1, 8);
+    frame_++;
+
+    int left = block_;
+    int top = height_ - (TIMECODE_ROWS + 1) * block_;
+    for(int i = 0; i < TIMECODE_BYTES * 8; i++) {
+        uint8_t value = (bytes[i / 8] & (0x80 >> (i % 8))) ? TIMECODE_WHITE : TIMECODE_BLACK;
+        uint8_t *dst = yuv + (top + i / TIMECODE_COLUMNS * block_) * width_ + left + i % TIMECODE_COLUMNS * block_;
+        for(int y = 0; y < block_; y++) {
+            memset(dst + y * width_, value, block_);
+        }
+    }
+
+    // 人眼可读的时间，UTC
+    int64_t ms = time % 86400000;
+    char text[32];
+    snprintf(text, sizeof(text), "%02d:%02d:%02d.%03d", (int)(ms / 3600000), (int)(ms / 60000 % 60),
+             (int)(ms / 1000 % 60), (int)(ms % 1000));
+    int digits_top = top - 7 * scale_;
+    drawDigits(yuv, left, digits_top, text);
+
+    // 色度置为128，方块与数字都是纯灰度，压缩后亮度更容易还原
+    int right = left + TIMECODE_COLUMNS * block_;
+    if(right < left + (TIMECODE_CHARS * 4 + 1) * scale_) {
+        right = left + (TIMECODE_CHARS * 4 + 1) * scale_;
+    }
+    uint8_t *u_plane = yuv + width_ * height_;
+    uint8_t *v_plane = u_plane + width_ * height_ / 4;
+    for(int y = digits_top / 2; y < (top + TIMECODE_ROWS * block_) / 2; y++) {
+        memset(u_plane + y * width_ / 2 + left / 2, 128, (right - left) / 2);
+        memset(v_plane + y * width_ / 2 + left / 2, 128, (right - left) / 2);
+    }
+}
+
+void TimecodeStamper::drawDigits(uint8_t *y_plane, int x, int y, const char *text)
+{
+    int box_width = (TIMECODE_CHARS * 4 + 1) * scale_;
+    for(int row = 0; row < 7 * scale_; row++) {
+        memset(y_plane + (y + row) * width_ + x, TIMECODE_BLACK, box_width);
+    }
+    for(int i = 0; i < TIMECODE_CHARS && text[i]; i++) {
+        uint16_t glyph = ':' == text[i] ? kTimecodeFont[10] : ('.' == text[i] ? kTimecodeFont[11] : kTimecodeFont[(text[i] - '0') % 10]);
+        int left = x + (i * 4 + 1) * scale_;
+        for(int row = 0; row < 5; row++) {
+            for(int col = 0; col < 3; col++) {
+                if(!(glyph & (1 << (14 - row * 3 - col)))) {
+                    continue;
+                }
+                for(int k = 0; k < scale_; k++) {
+                    memset(y_plane + (y + (row + 1) * scale_ + k) * width_ + left + col * scale_, TIMECODE_WHITE, scale_);
+                }
+            }
+        }
+    }
+}
+
+bool TimecodeStamper::Decode(const uint8_t *y_plane, int stride, int width, int height, int64_t *time, int *frame)
+{
+    int block = GetBlockSize(width);
+    int left = block;
+    int top = height - (TIMECODE_ROWS + 1) * block;
+    if((TIMECODE_COLUMNS + 2) * block > width || top < 0) {
+        return false;
+    }
+    // 只取每块中心的一半，避开块边缘的振铃与色度下采样的影响
+    int inset = block / 4;
+    int size = block / 2;
+    uint8_t bytes[TIMECODE_BYTES];
+    memset(bytes, 0, sizeof(bytes));
+    for(int i = 0; i < TIMECODE_BYTES * 8; i++) {
+        const uint8_t *src = y_plane + (top + i / TIMECODE_COLUMNS * block + inset) * stride
+                + left + i % TIMECODE_COLUMNS * block + inset;
+        int sum = 0;
+        for(int y = 0; y < size; y++) {
+            for(int x = 0; x < size; x++) {
+                sum += src[y * stride + x];
+            }
+        }
+        if(sum >= 128 * size * size) {
+            bytes[i / 8] |= 0x80 >> (i % 8);
+        }
+    }
+    if(bytes[0] != TIMECODE_SYNC || crc8(bytes + 1, 8) != bytes[9]) {
+        return false;
+    }
+    int64_t value = 0;
+    for(int i = 0; i < 6; i++) {
+        value = (value << 8) | bytes[1 + i];
+    }
+    *time = value;
+    *frame = (bytes[7] << 8) | bytes[8];
+    return true;
+}
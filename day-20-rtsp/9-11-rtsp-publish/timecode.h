@@ -0,0 +1,47 @@
+﻿#ifndef TIMECODE_H
+#define TIMECODE_H
+
+#include <stdint.h>
+#include "mediabase.h"
+
+#define TIMECODE_COLUMNS    40                          // 每行的块数
+#define TIMECODE_ROWS       2
+#define TIMECODE_SYNC       0xB2                        // 前8位固定的同步码，用于判断这里是不是时间码
+
+/**
+ * 烧录在画面里的时间码，用于测量从采集到观看端解码出画面的端到端(glass-to-glass)延时。
+ * 1）机器可读部分：画面左下角2行x40个黑白方块，每块一位，依次是8位同步码、48位时间(ms，TimesUtil::GetTimeMillisecond()的时钟)、
+ *    16位帧序号、8位CRC-8(多项式0x07，覆盖时间与帧序号)。方块的边长是画面宽度的1/80(偶数，最小4)，黑16白235，
+ *    对应的色度置为128，经过有损压缩后取每块中心一半区域的平均亮度与128比较即可还原，CRC不对的帧丢弃。
+ *    几何位置只与画面的宽高有关，按比例缩放后的画面(simulcast的层)在宽度是80的倍数时也能读出。
+ * 2）人眼可读部分：方块的上方用3x5点阵画出HH:MM:SS.mmm(UTC)，截图或者拍屏时可以直接对比。
+ *
+ * 时间码的区域每帧都在变化，开启后静止画面检测不会跳过这些帧，只在测量延时时开启。
+ */
+class TimecodeStamper
+{
+public:
+    RET_CODE Init(int width, int height);
+    void Stamp(uint8_t *yuv, int64_t time);             // yuv为紧凑的yuv420p，原地修改，帧序号自动递增
+
+    /**
+     * @brief 从亮度平面读出时间码。
+     * @param stride 亮度平面一行的字节数，解码出来的AVFrame可以直接传linesize[0]。
+     * @param time 时间，单位ms。
+     * @param frame 帧序号的低16位。
+     * @return 成功 true，同步码或者CRC不对返回false
+     */
+    static bool Decode(const uint8_t *y_plane, int stride, int width, int height, int64_t *time, int *frame);
+    static int GetBlockSize(int width);
+
+private:
+    void drawDigits(uint8_t *y_plane, int x, int y, const char *text);
+
+    int width_ = 0;
+    int height_ = 0;
+    int block_ = 0;                                     // 方块的边长
+    int scale_ = 0;                                     // 数字点阵每个点的边长
+    uint16_t frame_ = 0;
+};
+
+#endif // TIMECODE_H
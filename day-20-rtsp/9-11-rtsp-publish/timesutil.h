@@ -24,6 +24,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/times.h>
+#include <sys/resource.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <netinet/in.h>
@@ -73,6 +74,32 @@ public:
 //        return duration_cast<chrono::milliseconds>(high_resolution_clock::now() - m_begin).count();
 
     }
+
+    // 获取单调递增的时间，单位微秒，只用于计算时间差(例如发送平滑、耗时统计)，不能当作绝对时间使用。
+    // 使用steady_clock是为了不受系统时间调整和windows下GetTickCount归0的影响。
+    static inline int64_t GetTimeMicrosecond()
+    {
+        return duration_cast<chrono::microseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    // 获取本进程所有线程累计使用的cpu时间(用户态+内核态)，单位微秒，两次相减除以经过的时间就是cpu占用(可以超过100%)
+    static inline int64_t GetProcessCpuMicrosecond()
+    {
+        #ifdef _WIN32
+            FILETIME create_time, exit_time, kernel_time, user_time;
+            if(!GetProcessTimes(GetCurrentProcess(), &create_time, &exit_time, &kernel_time, &user_time)) {
+                return 0;
+            }
+            // FILETIME的单位是100ns
+            return (int64_t)((((uint64_t)kernel_time.dwHighDateTime << 32) | kernel_time.dwLowDateTime)
+                             + (((uint64_t)user_time.dwHighDateTime << 32) | user_time.dwLowDateTime)) / 10;
+        #else
+            struct rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            return (int64_t)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec
+                    + (int64_t)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+        #endif
+    }
 //private:
 //    static time_point<high_resolution_clock> m_begin;
 };
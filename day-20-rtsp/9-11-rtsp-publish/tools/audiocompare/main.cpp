@@ -0,0 +1,126 @@
+﻿/**
+ * 对比aac与opus(20ms、10ms帧)的编码cpu耗时与算法延时。
+ * cpu按每个通道每秒音频计算(转换+编码的进程cpu时间)；算法延时是采集满一帧的时长加上编码器的预读，不包含采集与网络的延时。
+ *
+ * 用法：audiocompare [pcm文件(48000 2 s16le)] [秒数] [码率kbps]
+ * 例如：audiocompare buweishui_48000_2_s16le.pcm 60 64
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <vector>
+#include "dlog.h"
+#include "aacencoder.h"
+#include "opusencoder.h"
+#include "audioconvert.h"
+
+#define SAMPLE_RATE     48000
+#define CHANNELS        2
+
+typedef struct codec_result
+{
+    int frame_samples;
+    double delay_ms;                    // 算法延时
+    double cpu_ms;                      // 转换+编码的进程cpu时间
+    int64_t bytes;
+}CodecResult;
+
+static std::vector<int16_t> load_pcm(const char *pcm_name, int seconds)
+{
+    std::vector<int16_t> pcm;
+    FILE *fp = pcm_name ? fopen(pcm_name, "rb") : NULL;
+    if(fp) {
+        int16_t buf[4096];
+        size_t n;
+        while((n = fread(buf, sizeof(int16_t), 4096, fp)) > 0) {
+            pcm.insert(pcm.end(), buf, buf + n);
+        }
+        fclose(fp);
+    }
+    if(pcm.size() < (size_t)SAMPLE_RATE * CHANNELS) {
+        printf("no pcm file, use synthetic tone\n");
+        pcm.resize((size_t)SAMPLE_RATE * CHANNELS * 10);
+        for(size_t i = 0; i < pcm.size() / CHANNELS; i++) {
+            double v = 8000 * sin(2 * M_PI * 440 * i / SAMPLE_RATE) * (0.6 + 0.4 * sin(2 * M_PI * 3 * i / SAMPLE_RATE));
+            pcm[i * 2] = pcm[i * 2 + 1] = (int16_t)v;
+        }
+    }
+    std::vector<int16_t> signal((size_t)SAMPLE_RATE * CHANNELS * seconds);
+    for(size_t i = 0; i < signal.size(); i++) {
+        signal[i] = pcm[i % pcm.size()];                    // 文件太短就循环
+    }
+    return signal;
+}
+
+static int run(const std::vector<int16_t> &signal, AudioEncoder *encoder, const Properties &properties,
+               CodecResult *result)
+{
+    memset(result, 0, sizeof(CodecResult));
+    if(encoder->Init(properties) != RET_OK) {
+        return -1;
+    }
+    int nb_samples = encoder->GetFrameSamples();
+    result->frame_samples = nb_samples;
+    result->delay_ms = encoder->GetAlgorithmicDelay();
+
+    AVFrame *frame = av_frame_alloc();
+    frame->format = encoder->GetFormat();
+    frame->nb_samples = nb_samples;
+    frame->channels = CHANNELS;
+    frame->channel_layout = encoder->GetChannelLayout();
+    av_frame_get_buffer(frame, 0);
+    std::vector<uint8_t> buf(encoder->GetFrameBytes());
+
+    clock_t begin = clock();
+    int64_t frames = 0;
+    for(size_t pos = 0; pos + nb_samples * CHANNELS <= signal.size(); pos += nb_samples * CHANNELS) {
+        AudioConvertS16(&signal[pos], nb_samples, CHANNELS, (AVSampleFormat)frame->format, &buf[0]);
+        av_frame_make_writable(frame);
+        av_samples_fill_arrays(frame->data, frame->linesize, &buf[0], CHANNELS, nb_samples,
+                               (AVSampleFormat)frame->format, 1);
+        int pkt_frame = 0;
+        RET_CODE ret = RET_OK;
+        AVPacket *packet = encoder->Encode(frame, frames * nb_samples * 1000 / SAMPLE_RATE, 0, &pkt_frame, &ret);
+        frames++;
+        if(packet) {
+            result->bytes += packet->size;
+            av_packet_free(&packet);
+        }
+    }
+    result->cpu_ms = (clock() - begin) * 1000.0 / CLOCKS_PER_SEC;
+    av_frame_free(&frame);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *pcm_name = argc > 1 ? argv[1] : "buweishui_48000_2_s16le.pcm";
+    int seconds = argc > 2 ? atoi(argv[2]) : 60;
+    int bitrate = (argc > 3 ? atoi(argv[3]) : 64) * 1024;
+    init_logger("audiocompare.log", S_WARN);
+
+    std::vector<int16_t> signal = load_pcm(pcm_name, seconds);
+    printf("codec        frame(samples)  delay(ms)  kbps     cpu(ms/s per channel)  cpu(%% of core per channel)\n");
+    const char *names[] = {"aac", "opus-20ms", "opus-10ms"};
+    for(int i = 0; i < 3; i++) {
+        Properties properties;
+        properties.SetProperty("sample_rate", SAMPLE_RATE);
+        properties.SetProperty("channels", CHANNELS);
+        properties.SetProperty("bitrate", bitrate);
+        properties.SetProperty("frame_duration", i == 2 ? 10 : 20);
+        properties.SetProperty("application", "lowdelay");
+        AudioEncoder *encoder = (i == 0) ? (AudioEncoder *)new AACEncoder() : (AudioEncoder *)new OpusEncoder();
+        CodecResult r;
+        if(run(signal, encoder, properties, &r) != 0) {
+            printf("%-12s init failed\n", names[i]);
+            delete encoder;
+            continue;
+        }
+        double per_channel = r.cpu_ms / seconds / CHANNELS;
+        printf("%-12s %-15d %-10.1lf %-8.1lf %-22.3lf %.3lf\n", names[i], r.frame_samples, r.delay_ms,
+               r.bytes * 8 / 1000.0 / seconds, per_channel, per_channel / 10.0);
+        delete encoder;
+    }
+    return 0;
+}
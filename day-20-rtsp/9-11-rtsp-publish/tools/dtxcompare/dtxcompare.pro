@@ -0,0 +1,23 @@
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle
+CONFIG -= qt
+
+# 复用推流端的编码器与静音检测源码
+PUBLISH_DIR = $$PWD/../..
+INCLUDEPATH += $$PUBLISH_DIR
+
+win32 {
+INCLUDEPATH += $$PUBLISH_DIR/ffmpeg-4.2.1-win32-dev/include
+LIBS += $$PUBLISH_DIR/ffmpeg-4.2.1-win32-dev/lib/avcodec.lib    \
+        $$PUBLISH_DIR/ffmpeg-4.2.1-win32-dev/lib/avutil.lib
+}
+unix {
+LIBS += -lavcodec -lavutil -lpthread
+}
+
+SOURCES += main.cpp \
+    $$PUBLISH_DIR/dlog.cpp \
+    $$PUBLISH_DIR/audioencoder.cpp \
+    $$PUBLISH_DIR/aacencoder.cpp \
+    $$PUBLISH_DIR/silencedetector.cpp
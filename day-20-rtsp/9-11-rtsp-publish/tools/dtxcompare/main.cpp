@@ -0,0 +1,159 @@
+﻿/**
+ * 对比音频正常编码与不连续传输(DTX，静音时跳过编码)的cpu耗时与码率。
+ * 测试信号由有声段与静音段交替组成：有声段取自pcm文件(没有文件时用合成的音调)，静音段是指定电平的白噪声，模拟安静的房间。
+ *
+ * 用法：dtxcompare [pcm文件(48000 2 s16le)] [总秒数] [有声秒数] [静音秒数] [静音电平dBFS]
+ * 例如：dtxcompare buweishui_48000_2_s16le.pcm 120 10 30 -65
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <vector>
+#include "dlog.h"
+#include "aacencoder.h"
+#include "silencedetector.h"
+
+#define SAMPLE_RATE     48000
+#define CHANNELS        2
+
+typedef struct dtx_result
+{
+    int64_t frames;
+    int64_t encoded_frames;
+    int64_t bytes;
+    double  cpu_ms;                     // 检测+转换+编码的进程cpu时间
+}DtxResult;
+
+static void s16_to_fltp(const int16_t *s16, float *fltp, int nb_samples)
+{
+    float *left = fltp;
+    float *right = fltp + nb_samples;
+    for(int i = 0; i < nb_samples; i++) {
+        left[i] = s16[i * 2] / 32768.0f;
+        right[i] = s16[i * 2 + 1] / 32768.0f;
+    }
+}
+
+/**
+ * @brief 生成测试信号。
+ * @return 交错的s16样本。
+ */
+static std::vector<int16_t> make_signal(const char *pcm_name, int seconds, int voiced_seconds,
+                                        int silent_seconds, int noise_db)
+{
+    std::vector<int16_t> voiced;
+    FILE *fp = pcm_name ? fopen(pcm_name, "rb") : NULL;
+    if(fp) {
+        int16_t buf[4096];
+        size_t n;
+        while((n = fread(buf, sizeof(int16_t), 4096, fp)) > 0) {
+            voiced.insert(voiced.end(), buf, buf + n);
+        }
+        fclose(fp);
+    }
+    if(voiced.size() < (size_t)SAMPLE_RATE * CHANNELS) {
+        printf("no pcm file, use synthetic tone\n");
+        voiced.resize((size_t)SAMPLE_RATE * CHANNELS * 10);
+        for(size_t i = 0; i < voiced.size() / CHANNELS; i++) {
+            double v = 8000 * sin(2 * M_PI * 440 * i / SAMPLE_RATE) * (0.6 + 0.4 * sin(2 * M_PI * 3 * i / SAMPLE_RATE));
+            voiced[i * 2] = voiced[i * 2 + 1] = (int16_t)v;
+        }
+    }
+
+    srand(1);
+    double noise_amp = pow(10.0, noise_db / 20.0) * 32768.0 * sqrt(3.0);   // 均匀分布的rms是幅度的1/sqrt(3)
+    std::vector<int16_t> signal((size_t)SAMPLE_RATE * CHANNELS * seconds);
+    size_t voiced_pos = 0;
+    size_t period = (size_t)SAMPLE_RATE * CHANNELS * (voiced_seconds + silent_seconds);
+    size_t voiced_len = (size_t)SAMPLE_RATE * CHANNELS * voiced_seconds;
+    for(size_t i = 0; i < signal.size(); i++) {
+        if(i % period < voiced_len) {
+            signal[i] = voiced[voiced_pos++ % voiced.size()];
+        } else {
+            signal[i] = (int16_t)((rand() / (double)RAND_MAX * 2 - 1) * noise_amp);
+        }
+    }
+    return signal;
+}
+
+static int run(const std::vector<int16_t> &signal, bool dtx, DtxResult *result)
+{
+    memset(result, 0, sizeof(DtxResult));
+    AACEncoder encoder;
+    Properties properties;
+    properties.SetProperty("sample_rate", SAMPLE_RATE);
+    properties.SetProperty("channels", CHANNELS);
+    properties.SetProperty("bitrate", 128 * 1024);
+    if(encoder.Init(properties) != RET_OK) {
+        printf("AACEncoder Init failed\n");
+        return -1;
+    }
+    int nb_samples = encoder.GetFrameSamples();
+    SilenceDetector detector;
+    Properties silence_properties;
+    silence_properties.SetProperty("frame_duration_ms", nb_samples * 1000 / SAMPLE_RATE);
+    detector.Init(silence_properties);
+
+    AVFrame *frame = av_frame_alloc();
+    frame->format = encoder.GetFormat();
+    frame->nb_samples = nb_samples;
+    frame->channels = CHANNELS;
+    frame->channel_layout = encoder.GetChannelLayout();
+    av_frame_get_buffer(frame, 0);
+    std::vector<float> fltp(nb_samples * CHANNELS);
+
+    clock_t begin = clock();
+    for(size_t pos = 0; pos + nb_samples * CHANNELS <= signal.size(); pos += nb_samples * CHANNELS) {
+        const int16_t *pcm = &signal[pos];
+        int64_t pts = result->frames * nb_samples * 1000 / SAMPLE_RATE;
+        result->frames++;
+        if(dtx && detector.Process(pcm, nb_samples * CHANNELS) == SILENCE_SKIP) {
+            continue;
+        }
+        s16_to_fltp(pcm, &fltp[0], nb_samples);
+        av_frame_make_writable(frame);
+        av_samples_fill_arrays(frame->data, frame->linesize, (uint8_t *)&fltp[0], CHANNELS, nb_samples,
+                               (AVSampleFormat)frame->format, 0);
+        int pkt_frame = 0;
+        RET_CODE ret = RET_OK;
+        AVPacket *packet = encoder.Encode(frame, pts, 0, &pkt_frame, &ret);
+        result->encoded_frames++;
+        if(packet) {
+            result->bytes += packet->size;
+            av_packet_free(&packet);
+        }
+    }
+    result->cpu_ms = (clock() - begin) * 1000.0 / CLOCKS_PER_SEC;
+    av_frame_free(&frame);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *pcm_name = argc > 1 ? argv[1] : "buweishui_48000_2_s16le.pcm";
+    int seconds = argc > 2 ? atoi(argv[2]) : 120;
+    int voiced_seconds = argc > 3 ? atoi(argv[3]) : 10;
+    int silent_seconds = argc > 4 ? atoi(argv[4]) : 30;
+    int noise_db = argc > 5 ? atoi(argv[5]) : -65;
+    init_logger("dtxcompare.log", S_WARN);
+
+    std::vector<int16_t> signal = make_signal(pcm_name, seconds, voiced_seconds, silent_seconds, noise_db);
+    printf("signal: %ds, voiced %ds / silent %ds at %ddBFS\n", seconds, voiced_seconds, silent_seconds, noise_db);
+
+    DtxResult normal, dtx;
+    if(run(signal, false, &normal) != 0 || run(signal, true, &dtx) != 0) {
+        return -1;
+    }
+    printf("mode     frames   encoded  kbps     cpu(ms)\n");
+    printf("normal   %-8lld %-8lld %-8.1lf %.1lf\n", (long long)normal.frames, (long long)normal.encoded_frames,
+           normal.bytes * 8 / 1000.0 / seconds, normal.cpu_ms);
+    printf("dtx      %-8lld %-8lld %-8.1lf %.1lf\n", (long long)dtx.frames, (long long)dtx.encoded_frames,
+           dtx.bytes * 8 / 1000.0 / seconds, dtx.cpu_ms);
+    if(normal.bytes > 0 && normal.cpu_ms > 0) {
+        printf("saved: bitrate %.1lf%%, cpu %.1lf%%\n", 100.0 - dtx.bytes * 100.0 / normal.bytes,
+               100.0 - dtx.cpu_ms * 100.0 / normal.cpu_ms);
+    }
+    return 0;
+}
@@ -0,0 +1,130 @@
+﻿/**
+ * 对比H264Encoder在标准GOP模式与周期帧内刷新模式下的帧大小峰均比与编码延时。
+ *
+ * 用法：gopcompare [yuv文件] [宽] [高] [帧率] [码率kbps] [帧数] [slice_max_size]
+ * 缺省使用推流端自带的测试文件 720x480_25fps_420p.yuv(注意实际分辨率是768x480)。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include "dlog.h"
+#include "timesutil.h"
+#include "h264encoder.h"
+
+typedef struct compare_result
+{
+    H264FrameSizeStats size_stats;
+    double avg_latency;                 // 每帧编码耗时的平均值，单位ms
+    double p99_latency;
+    double max_latency;
+    double max_1s_kbps;                 // 任意1秒(帧率个帧)内的最大码率
+}CompareResult;
+
+static int run_encode(FILE *fp, int width, int height, int fps, int bitrate, int frames,
+                      int intra_refresh, int slice_max_size, CompareResult *result)
+{
+    H264Encoder encoder;
+    Properties properties;
+    properties.SetProperty("width", width);
+    properties.SetProperty("height", height);
+    properties.SetProperty("fps", fps);
+    properties.SetProperty("bitrate", bitrate);
+    properties.SetProperty("gop", fps);
+    properties.SetProperty("intra_refresh", intra_refresh);
+    properties.SetProperty("slice_max_size", slice_max_size);
+    if(encoder.Init(properties) != RET_OK) {
+        printf("H264Encoder Init failed\n");
+        return -1;
+    }
+
+    int frame_size = width * height * 3 / 2;
+    std::vector<uint8_t> yuv(frame_size);
+    std::vector<double> latency;
+    std::vector<int> sizes;
+    fseek(fp, 0, SEEK_SET);
+    for(int i = 0; i < frames; i++) {
+        if(fread(&yuv[0], 1, frame_size, fp) != (size_t)frame_size) {
+            fseek(fp, 0, SEEK_SET);             // 文件太短就循环读取
+            if(fread(&yuv[0], 1, frame_size, fp) != (size_t)frame_size) {
+                printf("read yuv failed\n");
+                return -1;
+            }
+        }
+        int pkt_frame = 0;
+        RET_CODE ret = RET_OK;
+        int64_t begin = TimesUtil::GetTimeMicrosecond();
+        AVPacket *packet = encoder.Encode(&yuv[0], frame_size, i * 1000 / fps, &pkt_frame, &ret);
+        latency.push_back((TimesUtil::GetTimeMicrosecond() - begin) / 1000.0);
+        if(packet) {
+            sizes.push_back(packet->size);
+            av_packet_free(&packet);
+        }
+    }
+
+    encoder.GetFrameSizeStats(&result->size_stats);
+    std::sort(latency.begin(), latency.end());
+    double sum = 0;
+    for(size_t i = 0; i < latency.size(); i++) {
+        sum += latency[i];
+    }
+    result->avg_latency = sum / latency.size();
+    result->p99_latency = latency[latency.size() * 99 / 100];
+    result->max_latency = latency.back();
+
+    // 滑动1秒窗口的最大码率
+    int64_t window = 0, max_window = 0;
+    for(size_t i = 0; i < sizes.size(); i++) {
+        window += sizes[i];
+        if(i >= (size_t)fps) {
+            window -= sizes[i - fps];
+        }
+        max_window = std::max(max_window, window);
+    }
+    result->max_1s_kbps = max_window * 8.0 / 1000;
+    return 0;
+}
+
+static void print_result(const char *name, CompareResult *r)
+{
+    H264FrameSizeStats &st = r->size_stats;
+    printf("%-14s %-8.0f %-8d %-8.0f %-9.2f %-6lld %-12.1f %-9.2f %-9.2f %-9.2f\n", name, st.mean, st.max_size,
+           sqrt(st.variance), st.mean > 0 ? st.max_size / st.mean : 0, (long long)st.key_frames,
+           r->max_1s_kbps, r->avg_latency, r->p99_latency, r->max_latency);
+}
+
+int main(int argc, char **argv)
+{
+    const char *yuv_name = argc > 1 ? argv[1] : "720x480_25fps_420p.yuv";
+    int width           = argc > 2 ? atoi(argv[2]) : 768;
+    int height          = argc > 3 ? atoi(argv[3]) : 480;
+    int fps             = argc > 4 ? atoi(argv[4]) : 25;
+    int bitrate         = (argc > 5 ? atoi(argv[5]) : 512) * 1024;
+    int frames          = argc > 6 ? atoi(argv[6]) : 250;
+    int slice_max_size  = argc > 7 ? atoi(argv[7]) : 0;
+
+    init_logger("gopcompare.log", S_WARN);
+
+    FILE *fp = fopen(yuv_name, "rb");
+    if(!fp) {
+        printf("open %s failed\n", yuv_name);
+        return -1;
+    }
+
+    CompareResult gop_result, refresh_result;
+    if(run_encode(fp, width, height, fps, bitrate, frames, 0, slice_max_size, &gop_result) < 0
+            || run_encode(fp, width, height, fps, bitrate, frames, 1, slice_max_size, &refresh_result) < 0) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    printf("%s %dx%d %dfps %dkbps %d frames slice_max_size %d\n", yuv_name, width, height, fps, bitrate / 1024,
+           frames, slice_max_size);
+    printf("%-14s %-8s %-8s %-8s %-9s %-6s %-12s %-9s %-9s %-9s\n", "mode", "avg(B)", "max(B)", "stddev",
+           "peak/avg", "key", "max1s(kbps)", "lat(ms)", "p99(ms)", "max(ms)");
+    print_result("gop", &gop_result);
+    print_result("intra-refresh", &refresh_result);
+    return 0;
+}
@@ -0,0 +1,221 @@
+﻿/**
+ * 在合成的cpu负载下对比开启与关闭编码调节器(EncodeGovernor)的实时性。
+ * 按帧率实时采集(与VideoCapturer一样，落后时不再等待直接追赶)并在采集线程中同步编码，运行到第hog_start秒时启动若干个空转线程
+ * 抢占cpu，第hog_end秒停止。每秒打印一行：级别、这一秒编码的帧数、采集相对计划时间的落后(ms)。
+ * 落后持续增长就是推流端时间戳漂移、队列最终整个gop丢弃的原因；开启调节器后落后应该在降级后回到一个帧间隔以内。
+ *
+ * 用法：governorbench [yuv文件] [宽x高] [帧率] [码率kbps] [秒数] [空转线程数] [hog_start] [hog_end]
+ * 例如：governorbench 720x480_25fps_420p.yuv 768x480 25 1024 60 8 10 40
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "dlog.h"
+#include "timesutil.h"
+#include "h264encoder.h"
+#include "encodegovernor.h"
+
+typedef struct bench_config
+{
+    const char *yuv_name;
+    int width;
+    int height;
+    int fps;
+    int bitrate;
+    int seconds;
+    int hog_threads;
+    int hog_start;
+    int hog_end;
+}BenchConfig;
+
+typedef struct bench_result
+{
+    int64_t encoded_frames;
+    int64_t late_frames;                // 落后超过一个帧间隔的帧数
+    int64_t max_lag;                    // 最大落后，单位ms
+    int64_t end_lag;                    // 结束时的落后，单位ms
+    int64_t level_changes;
+}BenchResult;
+
+static std::atomic<bool> g_hog_run(false);
+static std::atomic<bool> g_hog_exit(false);
+
+// 空转线程，g_hog_run为true时占满一个核
+static void hog_thread()
+{
+    volatile double x = 1.0;
+    while(!g_hog_exit) {
+        if(!g_hog_run) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        for(int i = 0; i < 100000; i++) {
+            x = x * 1.0000001 + 0.0000001;
+        }
+    }
+}
+
+// 读取yuv文件的所有帧，没有文件时合成移动的渐变加噪声，保证编码器有真实的负载
+static int load_frames(const BenchConfig &cfg, std::vector<std::vector<uint8_t> > *frames)
+{
+    int frame_size = cfg.width * cfg.height * 3 / 2;
+    FILE *fp = fopen(cfg.yuv_name, "rb");
+    std::vector<uint8_t> frame(frame_size);
+    while(fp && frames->size() < (size_t)cfg.fps * 10 && fread(&frame[0], 1, frame_size, fp) == (size_t)frame_size) {
+        frames->push_back(frame);
+    }
+    if(fp) {
+        fclose(fp);
+    }
+    if(!frames->empty()) {
+        return 0;
+    }
+    printf("no yuv file, use synthetic frames\n");
+    srand(1);
+    for(int n = 0; n < cfg.fps * 2; n++) {
+        for(int y = 0; y < cfg.height; y++) {
+            for(int x = 0; x < cfg.width; x++) {
+                frame[y * cfg.width + x] = (uint8_t)((x + y + n * 4) & 0xff) ^ (uint8_t)(rand() & 0x0f);
+            }
+        }
+        memset(&frame[cfg.width * cfg.height], 128, cfg.width * cfg.height / 2);
+        frames->push_back(frame);
+    }
+    return 0;
+}
+
+static int run(const BenchConfig &cfg, const std::vector<std::vector<uint8_t> > &frames, bool governed,
+               BenchResult *result)
+{
+    memset(result, 0, sizeof(BenchResult));
+    H264Encoder encoder;
+    Properties properties;
+    properties.SetProperty("width", cfg.width);
+    properties.SetProperty("height", cfg.height);
+    properties.SetProperty("fps", cfg.fps);
+    properties.SetProperty("bitrate", cfg.bitrate);
+    properties.SetProperty("gop", cfg.fps);
+    if(encoder.Init(properties) != RET_OK) {
+        printf("H264Encoder Init failed\n");
+        return -1;
+    }
+    EncodeGovernor governor;
+    if(governed && governor.Init(properties, &encoder) != RET_OK) {
+        printf("EncodeGovernor Init failed\n");
+        return -1;
+    }
+    governor.AddCallback([](int level, int load) {
+        printf("    level -> %d, load %d%%\n", level, load);
+    });
+
+    int frame_size = cfg.width * cfg.height * 3 / 2;
+    int64_t interval = 1000000 / cfg.fps;
+    int64_t begin = TimesUtil::GetTimeMicrosecond();
+    int64_t second_encoded = 0;
+    int64_t second_max_lag = 0;
+    printf("  second  level  encoded  lag(ms)\n");
+    for(int i = 0; i < cfg.seconds * cfg.fps; i++) {
+        int64_t due = begin + i * interval;
+        int64_t now = TimesUtil::GetTimeMicrosecond();
+        if(due > now) {
+            std::this_thread::sleep_for(std::chrono::microseconds(due - now));
+            now = TimesUtil::GetTimeMicrosecond();
+        }
+        int64_t lag = (now - due) / 1000;
+        g_hog_run = i >= cfg.hog_start * cfg.fps && i < cfg.hog_end * cfg.fps;
+        if(lag * 1000 > interval) {
+            result->late_frames++;
+        }
+        if(lag > result->max_lag) {
+            result->max_lag = lag;
+        }
+        if(lag > second_max_lag) {
+            second_max_lag = lag;
+        }
+        result->end_lag = lag;
+
+        uint8_t *yuv = (uint8_t *)&frames[i % frames.size()][0];
+        int64_t pts = (int64_t)i * 1000 / cfg.fps;
+        int pkt_frame = 0;
+        RET_CODE ret = RET_OK;
+        AVPacket *packet = NULL;
+        if(!governed) {
+            packet = encoder.Encode(yuv, frame_size, pts, &pkt_frame, &ret);
+            second_encoded++;
+        } else if(governor.Admit()) {
+            packet = governor.Encode(yuv, frame_size, pts, &pkt_frame, &ret);
+            second_encoded++;
+        }
+        if(packet) {
+            av_packet_free(&packet);
+        }
+        if((i + 1) % cfg.fps == 0) {
+            printf("  %-7d %-6d %-8lld %lld\n", (i + 1) / cfg.fps, governed ? governor.GetLevel() : 0,
+                   (long long)second_encoded, (long long)second_max_lag);
+            result->encoded_frames += second_encoded;
+            second_encoded = 0;
+            second_max_lag = 0;
+        }
+    }
+    g_hog_run = false;
+    if(governed) {
+        GovernorStats stats;
+        governor.GetStats(&stats);
+        result->level_changes = stats.level_changes;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    BenchConfig cfg;
+    cfg.yuv_name = argc > 1 ? argv[1] : "720x480_25fps_420p.yuv";
+    cfg.width = 768;
+    cfg.height = 480;
+    if(argc > 2) {
+        sscanf(argv[2], "%dx%d", &cfg.width, &cfg.height);
+    }
+    cfg.fps = argc > 3 ? atoi(argv[3]) : 25;
+    cfg.bitrate = (argc > 4 ? atoi(argv[4]) : 1024) * 1024;
+    cfg.seconds = argc > 5 ? atoi(argv[5]) : 60;
+    cfg.hog_threads = argc > 6 ? atoi(argv[6]) : (int)std::thread::hardware_concurrency() * 2;
+    cfg.hog_start = argc > 7 ? atoi(argv[7]) : 10;
+    cfg.hog_end = argc > 8 ? atoi(argv[8]) : 40;
+    init_logger("governorbench.log", S_WARN);
+
+    std::vector<std::vector<uint8_t> > frames;
+    if(cfg.fps <= 0 || cfg.width <= 0 || cfg.height <= 0 || load_frames(cfg, &frames) != 0) {
+        return -1;
+    }
+    printf("source %dx%d@%dfps %dkbps, %ds, %d hog threads from %ds to %ds\n", cfg.width, cfg.height, cfg.fps,
+           cfg.bitrate / 1024, cfg.seconds, cfg.hog_threads, cfg.hog_start, cfg.hog_end);
+    std::vector<std::thread *> hogs;
+    for(int i = 0; i < cfg.hog_threads; i++) {
+        hogs.push_back(new std::thread(hog_thread));
+    }
+
+    BenchResult results[2];
+    const char *names[] = {"fixed", "governed"};
+    for(int i = 0; i < 2; i++) {
+        printf("%s:\n", names[i]);
+        if(run(cfg, frames, i == 1, &results[i]) != 0) {
+            break;
+        }
+    }
+    g_hog_exit = true;
+    for(size_t i = 0; i < hogs.size(); i++) {
+        hogs[i]->join();
+        delete hogs[i];
+    }
+
+    printf("mode       encoded  late     max lag(ms)  end lag(ms)  level changes\n");
+    for(int i = 0; i < 2; i++) {
+        printf("%-10s %-8lld %-8lld %-12lld %-12lld %lld\n", names[i], (long long)results[i].encoded_frames,
+               (long long)results[i].late_frames, (long long)results[i].max_lag, (long long)results[i].end_lag,
+               (long long)results[i].level_changes);
+    }
+    return 0;
+}
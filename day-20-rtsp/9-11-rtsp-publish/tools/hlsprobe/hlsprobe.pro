@@ -0,0 +1,7 @@
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle
+CONFIG -= qt
+
+# 只支持linux/unix，使用posix socket
+SOURCES += main.cpp
@@ -0,0 +1,282 @@
+﻿/**
+ * 本地LL-HLS客户端，测量推流端HLS输出的采集到播放列表(glass-to-playlist)延时。
+ * 第一次普通请求播放列表，之后一直用阻塞刷新请求下一个part(_HLS_msn/_HLS_part)，每次收到的播放列表中出现了新part，
+ * 就用 收到的时间 - (该part所在segment的PROGRAM-DATE-TIME + segment中该part及之前part的时长) 作为一个延时样本，
+ * PROGRAM-DATE-TIME是推流端采集时的墙上时钟，所以推流端与本工具需要在同一台机器或者时钟已经同步。
+ *
+ * 用法：hlsprobe [-u 播放列表url] [-t 运行秒数] [-o 输出csv]
+ * 例如：hlsprobe -u http://127.0.0.1:9100/hls/live.m3u8 -t 60
+ *
+ * csv每行的格式：收到的时间(墙上时钟ms),msn,part,延时ms,请求挂起的时长ms
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// 播放列表中最后一个part的信息
+typedef struct last_part
+{
+    long long msn;                      // -1表示播放列表中没有part
+    int part;
+    int64_t end_time;                   // part结束时的墙上时钟，单位ms
+}LastPart;
+
+static volatile int s_quit = 0;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    s_quit = 1;
+}
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief 解析ISO 8601的UTC时间，例如2020-01-01T08:00:00.123Z。
+ * @return epoch毫秒，失败返回-1。
+ */
+static int64_t parse_date_time(const char *str)
+{
+    struct tm tm;
+    int ms = 0;
+    memset(&tm, 0, sizeof(tm));
+    if(sscanf(str, "%d-%d-%dT%d:%d:%d.%dZ", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+              &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &ms) < 6) {
+        return -1;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return (int64_t)timegm(&tm) * 1000 + ms;
+}
+
+/**
+ * @brief 找到播放列表中最后一个part，计算它结束时的墙上时钟。
+ * @param m3u8 播放列表。
+ * @param last 传出。
+ */
+static void parse_playlist(const std::string &m3u8, LastPart *last)
+{
+    long long msn = 0;
+    int part = 0;
+    int64_t pdt = -1;
+    int64_t offset = 0;                 // 当前segment中已经列出的part的时长之和
+    last->msn = -1;
+    last->part = 0;
+    last->end_time = 0;
+    size_t pos = 0;
+    while(pos < m3u8.size()) {
+        size_t end = m3u8.find('\n', pos);
+        if(end == std::string::npos) {
+            end = m3u8.size();
+        }
+        std::string line = m3u8.substr(pos, end - pos);
+        pos = end + 1;
+        if(line.compare(0, 22, "#EXT-X-MEDIA-SEQUENCE:") == 0) {
+            msn = atoll(line.c_str() + 22);
+        } else if(line.compare(0, 25, "#EXT-X-PROGRAM-DATE-TIME:") == 0) {
+            pdt = parse_date_time(line.c_str() + 25);
+            offset = 0;
+            part = 0;
+        } else if(line.compare(0, 21, "#EXT-X-PART:DURATION=") == 0) {
+            offset += (int64_t)(atof(line.c_str() + 21) * 1000 + 0.5);
+            if(pdt >= 0) {
+                last->msn = msn;
+                last->part = part;
+                last->end_time = pdt + offset;
+            }
+            part++;
+        } else if(!line.empty() && line[0] != '#') {
+            msn++;                      // segment的uri，下一个segment
+            part = 0;
+            offset = 0;
+        }
+    }
+}
+
+/**
+ * @brief 发送一个GET请求，读到对方关闭连接为止(服务器的响应是Connection: close)。
+ * @param body 传出，响应体。
+ * @return http状态码，连接失败返回-1。
+ */
+static int http_get(const struct sockaddr_in &addr, const std::string &host, const std::string &path, std::string *body)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) {
+        return -1;
+    }
+    if(connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + host + "\r\nConnection: close\r\n\r\n";
+    if(send(fd, request.data(), request.size(), 0) != (ssize_t)request.size()) {
+        close(fd);
+        return -1;
+    }
+    std::string response;
+    char buf[16384];
+    ssize_t n;
+    while((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        response.append(buf, n);
+    }
+    close(fd);
+    size_t header_end = response.find("\r\n\r\n");
+    if(header_end == std::string::npos || response.compare(0, 5, "HTTP/") != 0) {
+        return -1;
+    }
+    body->assign(response, header_end + 4, std::string::npos);
+    return atoi(response.c_str() + response.find(' ') + 1);
+}
+
+static void print_stats(const char *title, std::vector<int64_t> samples)
+{
+    if(samples.empty()) {
+        printf("%s: no samples\n", title);
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    int64_t sum = 0;
+    for(size_t i = 0; i < samples.size(); i++) {
+        sum += samples[i];
+    }
+    printf("%s: samples %d, min %lldms, avg %.1fms, p50 %lldms, p95 %lldms, max %lldms\n", title, (int)samples.size(),
+           (long long)samples.front(), (double)sum / samples.size(), (long long)samples[samples.size() / 2],
+           (long long)samples[samples.size() * 95 / 100], (long long)samples.back());
+}
+
+int main(int argc, char **argv)
+{
+    const char *url = "http://127.0.0.1:9100/hls/live.m3u8";
+    const char *out_name = NULL;
+    int seconds = 30;
+    int opt;
+    while((opt = getopt(argc, argv, "u:t:o:")) != -1) {
+        switch(opt) {
+        case 'u': url = optarg; break;
+        case 't': seconds = atoi(optarg); break;
+        case 'o': out_name = optarg; break;
+        default:
+            printf("usage: %s [-u playlist_url] [-t seconds] [-o latency.csv]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    // 解析url，只支持http://host[:port]/path
+    std::string str(url);
+    if(str.compare(0, 7, "http://") != 0) {
+        fprintf(stderr, "only http:// is supported: %s\n", url);
+        return -1;
+    }
+    size_t slash = str.find('/', 7);
+    std::string host = str.substr(7, slash == std::string::npos ? std::string::npos : slash - 7);
+    std::string path = slash == std::string::npos ? "/" : str.substr(slash);
+    int port = 80;
+    size_t colon = host.find(':');
+    if(colon != std::string::npos) {
+        port = atoi(host.c_str() + colon + 1);
+        host = host.substr(0, colon);
+    }
+    struct hostent *he = gethostbyname(host.c_str());
+    if(!he) {
+        fprintf(stderr, "resolve %s failed\n", host.c_str());
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    memcpy(&addr.sin_addr, he->h_addr_list[0], sizeof(addr.sin_addr));
+
+    FILE *out_fp = NULL;
+    if(out_name) {
+        out_fp = fopen(out_name, "w");
+        if(!out_fp) {
+            fprintf(stderr, "open %s failed\n", out_name);
+            return -1;
+        }
+        fprintf(out_fp, "receive_ms,msn,part,latency_ms,hold_ms\n");
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<int64_t> latencies;
+    std::vector<int64_t> holds;
+    LastPart last;
+    last.msn = -1;
+    last.part = 0;
+    int errors = 0;
+    int64_t begin = now_ms();
+    int64_t pre_print_time = begin;
+    size_t pre_print_count = 0;
+    while(!s_quit && now_ms() - begin < seconds * 1000LL) {
+        std::string request_path = path;
+        if(last.msn >= 0) {
+            char query[64];
+            snprintf(query, sizeof(query), "?_HLS_msn=%lld&_HLS_part=%d", last.msn, last.part + 1);
+            request_path += query;
+        }
+        std::string body;
+        int64_t request_time = now_ms();
+        int status = http_get(addr, host, request_path, &body);
+        int64_t receive_time = now_ms();
+        if(status != 200) {
+            if(++errors % 10 == 1) {
+                fprintf(stderr, "GET %s failed, status: %d\n", request_path.c_str(), status);
+            }
+            if(status == 400 || status < 0) {
+                last.msn = -1;                  // 推流端重启了，重新开始
+            }
+            usleep(100 * 1000);
+            continue;
+        }
+
+        LastPart current;
+        parse_playlist(body, &current);
+        if(current.msn < 0) {
+            usleep(50 * 1000);                  // 还没有part，服务器不支持LL-HLS时也会这样
+            continue;
+        }
+        if(last.msn >= 0 && (current.msn > last.msn || (current.msn == last.msn && current.part > last.part))) {
+            int64_t latency = receive_time - current.end_time;
+            latencies.push_back(latency);
+            holds.push_back(receive_time - request_time);
+            if(out_fp) {
+                fprintf(out_fp, "%lld,%lld,%d,%lld,%lld\n", (long long)receive_time, current.msn, current.part,
+                        (long long)latency, (long long)(receive_time - request_time));
+            }
+        }
+        last = current;
+
+        if(receive_time - pre_print_time >= 5000 && latencies.size() > pre_print_count) {
+            std::vector<int64_t> recent(latencies.begin() + pre_print_count, latencies.end());
+            print_stats("last 5s glass-to-playlist", recent);
+            pre_print_time = receive_time;
+            pre_print_count = latencies.size();
+        }
+    }
+
+    printf("\n%s, errors: %d\n", url, errors);
+    print_stats("glass-to-playlist", latencies);
+    print_stats("blocking reload hold", holds);
+    if(out_fp) {
+        fclose(out_fp);
+    }
+    return 0;
+}
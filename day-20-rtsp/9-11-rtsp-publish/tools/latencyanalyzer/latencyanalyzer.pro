@@ -0,0 +1,16 @@
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle
+CONFIG -= qt
+
+# 复用推流端的时间码解码，只支持linux/unix(getopt)
+PUBLISH_DIR = $$PWD/../..
+INCLUDEPATH += $$PUBLISH_DIR
+
+unix {
+LIBS += -lavformat -lavcodec -lavutil -lpthread
+}
+
+SOURCES += main.cpp \
+    $$PUBLISH_DIR/dlog.cpp \
+    $$PUBLISH_DIR/timecode.cpp
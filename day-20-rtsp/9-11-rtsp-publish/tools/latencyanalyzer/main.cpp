@@ -0,0 +1,290 @@
+﻿/**
+ * 端到端(glass-to-glass)延时分析：拉取推流端的流并解码，读出推流端video_timecode烧录在画面里的时间码(TimecodeStamper)，
+ * 统计每帧的延时与抖动，最后打印延时随时间变化的字符图。
+ * 1）网络输入(rtsp等，例如推流端内嵌的rtsp服务器)：延时 = 解码出这一帧时的墙上时钟 - 时间码的时间(采集时的墙上时钟)，
+ *    包括编码、发送、网络、接收缓冲与解码，不包括显示，推流端与本工具需要在同一台机器或者时钟已经同步。
+ *    解码器用单线程与低延时模式，不额外缓冲帧。
+ * 2）文件输入(录制下来的mp4/ts等)：没有接收时间，延时一列是时间码相对第一帧的增量减去pts相对第一帧的增量，
+ *    即采集时钟与时间戳的偏差，用于检查时间戳的校正(AVPublishTime)与采集的抖动。
+ * 抖动按RFC3550的方法平滑：J += (|D(i) - D(i-1)| - J) / 16，D为每帧的延时。
+ * 帧序号不连续说明中间有帧没有送到：推流端跳过编码(静止画面、降级)、网络丢包导致解码失败等。
+ *
+ * 用法：latencyanalyzer [-i 输入url或者文件] [-t 运行秒数] [-o 输出csv] [-u]
+ * 例如：推流端设置video_timecode=1、rtsp_server_port=8554，然后 latencyanalyzer -i rtsp://127.0.0.1:8554/live -t 60
+ * -u rtsp使用udp传输，默认tcp。
+ *
+ * csv每行的格式：解码出的帧序号,时间码的帧序号,时间码(ms),收到的时间(ms),pts(ms),延时ms,抖动ms
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "dlog.h"
+#include "timesutil.h"
+#include "timecode.h"
+extern "C" {
+#include "libavformat/avformat.h"
+#include "libavcodec/avcodec.h"
+#include "libavutil/pixdesc.h"
+}
+
+#define PLOT_WIDTH      72
+#define PLOT_HEIGHT     16
+
+// 一帧的测量结果
+typedef struct frame_sample
+{
+    int64_t time;                       // 解码出的时间或者相对第一帧的时间，单位ms，用于画图的横轴
+    int64_t latency;
+}FrameSample;
+
+static volatile int s_quit = 0;
+static int64_t s_deadline = 0;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    s_quit = 1;
+}
+
+// av_read_frame阻塞时也能按时退出
+static int interrupt_cb(void *opaque)
+{
+    (void)opaque;
+    return s_quit || TimesUtil::GetTimeMillisecond() > s_deadline;
+}
+
+static void print_stats(const char *title, std::vector<int64_t> samples)
+{
+    if(samples.empty()) {
+        printf("%s: no samples\n", title);
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    double square = 0;
+    for(size_t i = 0; i < samples.size(); i++) {
+        sum += samples[i];
+        square += (double)samples[i] * samples[i];
+    }
+    double avg = sum / samples.size();
+    printf("%s: samples %d, min %lldms, avg %.1fms, stddev %.1fms, p50 %lldms, p95 %lldms, p99 %lldms, max %lldms\n",
+           title, (int)samples.size(), (long long)samples.front(), avg, sqrt(fabs(square / samples.size() - avg * avg)),
+           (long long)samples[samples.size() / 2], (long long)samples[samples.size() * 95 / 100],
+           (long long)samples[samples.size() * 99 / 100], (long long)samples.back());
+}
+
+/**
+ * @brief 画出延时随时间变化的字符图，每一列是一段时间内的帧，'|'是这些帧的最小到最大延时，'*'是平均值。
+ */
+static void plot(const std::vector<FrameSample> &samples)
+{
+    if(samples.size() < 2) {
+        return;
+    }
+    int columns = (int)samples.size() < PLOT_WIDTH ? (int)samples.size() : PLOT_WIDTH;
+    std::vector<int64_t> lows(columns, INT64_MAX);
+    std::vector<int64_t> highs(columns, INT64_MIN);
+    std::vector<double> sums(columns, 0);
+    std::vector<int> counts(columns, 0);
+    for(size_t i = 0; i < samples.size(); i++) {
+        int c = (int)(i * columns / samples.size());
+        lows[c] = std::min(lows[c], samples[i].latency);
+        highs[c] = std::max(highs[c], samples[i].latency);
+        sums[c] += samples[i].latency;
+        counts[c]++;
+    }
+    int64_t low = *std::min_element(lows.begin(), lows.end());
+    int64_t high = *std::max_element(highs.begin(), highs.end());
+    if(high == low) {
+        high = low + 1;
+    }
+    // 行号0在最上面，对应high
+    auto to_row = [low, high](double value) {
+        return (int)((high - value) * (PLOT_HEIGHT - 1) / (high - low) + 0.5);
+    };
+    std::vector<std::string> rows(PLOT_HEIGHT, std::string(columns, ' '));
+    for(int c = 0; c < columns; c++) {
+        for(int r = to_row((double)highs[c]); r <= to_row((double)lows[c]); r++) {
+            rows[r][c] = '|';
+        }
+        rows[to_row(sums[c] / counts[c])][c] = '*';
+    }
+    printf("\nlatency(ms), %d frames per column, '*' avg, '|' min-max\n", (int)((samples.size() + columns - 1) / columns));
+    for(int r = 0; r < PLOT_HEIGHT; r++) {
+        double value = high - (double)(high - low) * r / (PLOT_HEIGHT - 1);
+        printf("%8.0f |%s\n", value, rows[r].c_str());
+    }
+    printf("         +%s\n", std::string(columns, '-').c_str());
+    printf("          0s%*s%.1fs\n", columns - 6, "",
+           (samples.back().time - samples.front().time) / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+    const char *input = "rtsp://127.0.0.1:8554/live";
+    const char *out_name = NULL;
+    int seconds = 30;
+    int udp = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "i:t:o:u")) != -1) {
+        switch(opt) {
+        case 'i': input = optarg; break;
+        case 't': seconds = atoi(optarg); break;
+        case 'o': out_name = optarg; break;
+        case 'u': udp = 1; break;
+        default:
+            printf("usage: %s [-i input] [-t seconds] [-o latency.csv] [-u]\n", argv[0]);
+            return -1;
+        }
+    }
+    init_logger("latencyanalyzer_log", S_INFO);
+    av_log_set_level(AV_LOG_ERROR);
+    avformat_network_init();
+    signal(SIGINT, on_signal);
+    bool live = strstr(input, "://") != NULL && strncmp(input, "file:", 5) != 0;
+
+    // 打开输入，尽量不缓冲
+    AVFormatContext *fmt_ctx = avformat_alloc_context();
+    fmt_ctx->interrupt_callback.callback = interrupt_cb;
+    fmt_ctx->flags |= AVFMT_FLAG_NOBUFFER;
+    s_deadline = TimesUtil::GetTimeMillisecond() + seconds * 1000LL;
+    AVDictionary *options = NULL;
+    av_dict_set(&options, "rtsp_transport", udp ? "udp" : "tcp", 0);
+    av_dict_set(&options, "fflags", "nobuffer", 0);
+    int ret = avformat_open_input(&fmt_ctx, input, NULL, &options);
+    av_dict_free(&options);
+    if(ret < 0) {
+        fprintf(stderr, "open %s failed\n", input);
+        return -1;
+    }
+    if(avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+        fprintf(stderr, "find stream info failed\n");
+        avformat_close_input(&fmt_ctx);
+        return -1;
+    }
+    int video_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if(video_index < 0) {
+        fprintf(stderr, "no video stream in %s\n", input);
+        avformat_close_input(&fmt_ctx);
+        return -1;
+    }
+    AVStream *stream = fmt_ctx->streams[video_index];
+    AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    AVCodecContext *dec_ctx = avcodec_alloc_context3(codec);
+    if(!codec || !dec_ctx || avcodec_parameters_to_context(dec_ctx, stream->codecpar) < 0) {
+        fprintf(stderr, "no decoder for %s\n", avcodec_get_name(stream->codecpar->codec_id));
+        avformat_close_input(&fmt_ctx);
+        return -1;
+    }
+    dec_ctx->thread_count = 1;                  // 帧级多线程会让解码器缓冲帧，增加延时
+    dec_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    if(avcodec_open2(dec_ctx, codec, NULL) < 0) {
+        fprintf(stderr, "open decoder failed\n");
+        avcodec_free_context(&dec_ctx);
+        avformat_close_input(&fmt_ctx);
+        return -1;
+    }
+
+    FILE *out_fp = NULL;
+    if(out_name) {
+        out_fp = fopen(out_name, "w");
+        if(!out_fp) {
+            fprintf(stderr, "open %s failed\n", out_name);
+            avcodec_free_context(&dec_ctx);
+            avformat_close_input(&fmt_ctx);
+            return -1;
+        }
+        fprintf(out_fp, "frame,timecode_frame,timecode_ms,receive_ms,pts_ms,latency_ms,jitter_ms\n");
+    }
+
+    std::vector<FrameSample> samples;
+    std::vector<int64_t> latencies;
+    int64_t frames = 0;
+    int64_t unreadable = 0;                     // 读不出时间码的帧
+    int64_t missing = 0;                        // 帧序号不连续，中间缺的帧数
+    int pre_frame = -1;
+    int64_t pre_latency = 0;
+    double jitter = 0;
+    int64_t first_timecode = 0;
+    int64_t first_pts = AV_NOPTS_VALUE;
+    int64_t begin = TimesUtil::GetTimeMillisecond();
+    int64_t pre_print_time = begin;
+    size_t pre_print_count = 0;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    while(!s_quit && av_read_frame(fmt_ctx, packet) >= 0) {
+        if(packet->stream_index != video_index || avcodec_send_packet(dec_ctx, packet) < 0) {
+            av_packet_unref(packet);
+            continue;
+        }
+        av_packet_unref(packet);
+        while(avcodec_receive_frame(dec_ctx, frame) == 0) {
+            int64_t receive_time = TimesUtil::GetTimeMillisecond();
+            frames++;
+            const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+            int64_t timecode = 0;
+            int timecode_frame = 0;
+            if(!desc || (desc->flags & AV_PIX_FMT_FLAG_RGB) || desc->comp[0].depth != 8
+                    || !TimecodeStamper::Decode(frame->data[0], frame->linesize[0], frame->width, frame->height,
+                                                &timecode, &timecode_frame)) {
+                unreadable++;
+                av_frame_unref(frame);
+                continue;
+            }
+            int64_t pts = frame->best_effort_timestamp == AV_NOPTS_VALUE ? 0
+                    : av_rescale_q(frame->best_effort_timestamp, stream->time_base, AVRational{1, 1000});
+            if(first_pts == AV_NOPTS_VALUE) {
+                first_pts = pts;
+                first_timecode = timecode;
+            }
+            int64_t latency = live ? receive_time - timecode : (timecode - first_timecode) - (pts - first_pts);
+            if(pre_frame >= 0) {
+                missing += (timecode_frame - pre_frame - 1) & 0xffff;
+                jitter += (llabs(latency - pre_latency) - jitter) / 16;
+            }
+            pre_frame = timecode_frame;
+            pre_latency = latency;
+
+            FrameSample sample;
+            sample.time = live ? receive_time : timecode;
+            sample.latency = latency;
+            samples.push_back(sample);
+            latencies.push_back(latency);
+            if(out_fp) {
+                fprintf(out_fp, "%lld,%d,%lld,%lld,%lld,%lld,%.2f\n", (long long)frames, timecode_frame,
+                        (long long)timecode, live ? (long long)receive_time : 0LL, (long long)pts,
+                        (long long)latency, jitter);
+            }
+            av_frame_unref(frame);
+        }
+        int64_t now = TimesUtil::GetTimeMillisecond();
+        if(live && now - pre_print_time >= 5000 && latencies.size() > pre_print_count) {
+            std::vector<int64_t> recent(latencies.begin() + pre_print_count, latencies.end());
+            print_stats("last 5s glass-to-glass", recent);
+            printf("jitter %.1fms\n", jitter);
+            pre_print_time = now;
+            pre_print_count = latencies.size();
+        }
+    }
+
+    printf("\n%s, decoded frames %lld, unreadable timecode %lld, missing frames %lld\n", input, (long long)frames,
+           (long long)unreadable, (long long)missing);
+    print_stats(live ? "glass-to-glass latency" : "timecode - pts offset", latencies);
+    printf("jitter(RFC3550) %.1fms\n", jitter);
+    plot(samples);
+
+    if(out_fp) {
+        fclose(out_fp);
+    }
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&dec_ctx);
+    avformat_close_input(&fmt_ctx);
+    return 0;
+}
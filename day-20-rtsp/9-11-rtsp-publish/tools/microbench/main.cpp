@@ -0,0 +1,725 @@
+﻿/**
+ * 推流端热点组件的微基准测试：PacketQueue、MessageQueue、AudioConvertS16(原s16le_convert_to_fltp)、H264Encoder::Encode、
+ * AACEncoder::GetAdtsHeader、write_log、VideoPattern/AudioPattern、AudioMixer、VideoCompositor、NalParser。输入都是内存中合成的数据，不依赖文件与网络。
+ *
+ * 每个用例的迭代次数是固定的(不随机器速度自动调整)，先预热一轮再测量reps轮，输出每次操作的耗时(ns)的最小值、中位数与平均值，
+ * 两次构建(例如优化前后)用相同的参数运行，按name对比ns_median即可。
+ *
+ * 用法：microbench [--format json|csv] [--out 文件] [--reps 轮数] [--filter 名字包含的字符串]
+ * 例如：microbench --format csv --out before.csv
+ * 结果写到--out指定的文件(缺省输出到标准输出)，进度打印到标准错误。运行用例时把标准输出重定向到空设备，
+ * write_log与H264Encoder::Init会printf到终端，既影响测量也会混进结果。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#if defined(WIN32)
+#include <io.h>
+#define dup _dup
+#define dup2 _dup2
+#define close _close
+#define fileno _fileno
+#define NULL_DEVICE "NUL"
+#else
+#include <unistd.h>
+#define NULL_DEVICE "/dev/null"
+#endif
+#include "dlog.h"
+#include "packetqueue.h"
+#include "messagequeue.h"
+#include "audioconvert.h"
+#include "h264encoder.h"
+#include "aacencoder.h"
+#include "testpattern.h"
+#include "audiomixer.h"
+#include "videocompositor.h"
+#include "nalparser.h"
+
+typedef struct bench_case
+{
+    const char *name;
+    int iterations;                     // 每轮的操作次数，固定不变
+    int bytes_per_op;                   // 每次操作处理的字节数，0表示不计算吞吐
+    std::function<int(int)> setup;      // 每个用例运行前调用一次，失败返回非0
+    std::function<void(int)> run;       // 执行iterations次操作
+    std::function<void()> teardown;
+}BenchCase;
+
+typedef struct bench_result
+{
+    std::string name;
+    int iterations;
+    int reps;
+    double ns_min;
+    double ns_median;
+    double ns_mean;
+    int bytes_per_op;
+}BenchResult;
+
+static int64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 作用域内把标准输出重定向到空设备
+class StdoutSilencer
+{
+public:
+    StdoutSilencer() {
+        fflush(stdout);
+        saved_ = dup(fileno(stdout));
+        FILE *null_fp = fopen(NULL_DEVICE, "w");
+        if(null_fp) {
+            dup2(fileno(null_fp), fileno(stdout));
+            fclose(null_fp);
+        }
+    }
+    ~StdoutSilencer() {
+        fflush(stdout);
+        if(saved_ >= 0) {
+            dup2(saved_, fileno(stdout));
+            close(saved_);
+        }
+    }
+private:
+    int saved_ = -1;
+};
+
+/* ---------------- PacketQueue ---------------- */
+static PacketQueue *g_packet_queue = NULL;
+static std::vector<AVPacket *> g_packets;
+
+static int packet_queue_setup(int)
+{
+    g_packet_queue = new PacketQueue(21.3, 40);
+    for(int i = 0; i < 64; i++) {
+        AVPacket *pkt = av_packet_alloc();
+        av_new_packet(pkt, 1200);
+        pkt->pts = i * 40;
+        g_packets.push_back(pkt);
+    }
+    return 0;
+}
+
+static void packet_queue_teardown()
+{
+    delete g_packet_queue;
+    g_packet_queue = NULL;
+    for(size_t i = 0; i < g_packets.size(); i++) {
+        av_packet_free(&g_packets[i]);
+    }
+    g_packets.clear();
+}
+
+// 单线程，每次推入64个包再全部取出，测量锁、链表与时长统计的开销
+static void packet_queue_push_pop(int iterations)
+{
+    MediaType media_type;
+    AVPacket *pkt = NULL;
+    for(int i = 0; i < iterations; i += 64) {
+        for(int j = 0; j < 64; j++) {
+            g_packet_queue->Push(g_packets[j], (j & 3) ? E_VIDEO_TYPE : E_AUDIO_TYPE);
+        }
+        for(int j = 0; j < 64; j++) {
+            g_packet_queue->Pop(&pkt, media_type);
+        }
+    }
+}
+
+// 一个生产线程一个消费线程，与采集线程推入、推流线程取出的用法一致
+static void packet_queue_two_threads(int iterations)
+{
+    std::thread producer([iterations]() {
+        for(int i = 0; i < iterations; i++) {
+            g_packet_queue->Push(g_packets[i & 63], E_VIDEO_TYPE);
+        }
+    });
+    MediaType media_type;
+    AVPacket *pkt = NULL;
+    for(int i = 0; i < iterations; i++) {
+        g_packet_queue->Pop(&pkt, media_type);
+    }
+    producer.join();
+}
+
+/* ---------------- MessageQueue ---------------- */
+static MessageQueue *g_msg_queue = NULL;
+
+static void msg_queue_put_get(int iterations)
+{
+    AVMessage msg;
+    for(int i = 0; i < iterations; i++) {
+        g_msg_queue->notify_msg3(MSG_RTSP_QUEUE_DURATION, i, i);
+        g_msg_queue->msg_queue_get(&msg, 0);
+    }
+}
+
+/* ---------------- AudioConvertS16 ---------------- */
+static std::vector<int16_t> g_s16;
+static std::vector<uint8_t> g_fltp;
+
+static int audio_convert_setup(int)
+{
+    g_s16.resize(1024 * 2);
+    srand(1);
+    for(size_t i = 0; i < g_s16.size(); i++) {
+        g_s16[i] = (int16_t)(rand() - RAND_MAX / 2);
+    }
+    g_fltp.resize(1024 * 2 * sizeof(float));
+    return 0;
+}
+
+static void audio_convert_s16_fltp(int iterations)
+{
+    for(int i = 0; i < iterations; i++) {
+        AudioConvertS16(&g_s16[0], 1024, 2, AV_SAMPLE_FMT_FLTP, &g_fltp[0]);
+    }
+}
+
+/* ---------------- H264Encoder ---------------- */
+#define H264_WIDTH      640
+#define H264_HEIGHT     360
+static H264Encoder *g_h264_encoder = NULL;
+static std::vector<std::vector<uint8_t> > g_yuv_frames;
+static int64_t g_h264_pts = 0;
+
+static int h264_encode_setup(int)
+{
+    g_h264_encoder = new H264Encoder();
+    Properties properties;
+    properties.SetProperty("width", H264_WIDTH);
+    properties.SetProperty("height", H264_HEIGHT);
+    properties.SetProperty("fps", 25);
+    properties.SetProperty("bitrate", 1024 * 1024);
+    properties.SetProperty("gop", 25);
+    if(g_h264_encoder->Init(properties) != RET_OK) {
+        return -1;
+    }
+    // 移动的渐变加固定种子的噪声，每次运行的输入完全一样
+    srand(1);
+    int frame_size = H264_WIDTH * H264_HEIGHT * 3 / 2;
+    for(int n = 0; n < 25; n++) {
+        std::vector<uint8_t> frame(frame_size, 128);
+        for(int y = 0; y < H264_HEIGHT; y++) {
+            for(int x = 0; x < H264_WIDTH; x++) {
+                frame[y * H264_WIDTH + x] = (uint8_t)(((x + y + n * 4) & 0xff) ^ (rand() & 0x0f));
+            }
+        }
+        g_yuv_frames.push_back(frame);
+    }
+    return 0;
+}
+
+static void h264_encode_teardown()
+{
+    delete g_h264_encoder;
+    g_h264_encoder = NULL;
+    g_yuv_frames.clear();
+}
+
+static void h264_encode_frame(int iterations)
+{
+    for(int i = 0; i < iterations; i++) {
+        std::vector<uint8_t> &frame = g_yuv_frames[g_h264_pts % g_yuv_frames.size()];
+        int pkt_frame = 0;
+        RET_CODE ret = RET_OK;
+        AVPacket *packet = g_h264_encoder->Encode(&frame[0], frame.size(), g_h264_pts++ * 40, &pkt_frame, &ret);
+        if(packet) {
+            av_packet_free(&packet);
+        }
+    }
+}
+
+/* ---------------- VideoPattern/AudioPattern ---------------- */
+#define PATTERN_WIDTH   3840
+#define PATTERN_HEIGHT  2160
+static VideoPattern *g_video_pattern = NULL;
+static std::vector<uint8_t> g_pattern_frame;
+static AudioPattern *g_audio_pattern = NULL;
+static std::vector<int16_t> g_pattern_pcm;
+
+static int video_pattern_setup(const char *pattern)
+{
+    g_video_pattern = new VideoPattern();
+    Properties properties;
+    properties.SetProperty("width", PATTERN_WIDTH);
+    properties.SetProperty("height", PATTERN_HEIGHT);
+    properties.SetProperty("pattern", pattern);
+    if(g_video_pattern->Init(properties) != RET_OK) {
+        return -1;
+    }
+    g_pattern_frame.resize(g_video_pattern->GetFrameSize());
+    return 0;
+}
+
+static void video_pattern_teardown()
+{
+    delete g_video_pattern;
+    g_video_pattern = NULL;
+    g_pattern_frame.clear();
+}
+
+// 每次生成一帧4K，ns_median除以16.7ms就是4K60占用一个核的比例
+static void video_pattern_fill(int iterations)
+{
+    for(int i = 0; i < iterations; i++) {
+        g_video_pattern->Fill(&g_pattern_frame[0], i);
+    }
+}
+
+static int audio_pattern_setup(int)
+{
+    g_audio_pattern = new AudioPattern();
+    Properties properties;
+    properties.SetProperty("sample_rate", 48000);
+    properties.SetProperty("channels", 2);
+    properties.SetProperty("pattern", "sweep");
+    g_pattern_pcm.resize(1024 * 2);
+    return g_audio_pattern->Init(properties) == RET_OK ? 0 : -1;
+}
+
+static void audio_pattern_teardown()
+{
+    delete g_audio_pattern;
+    g_audio_pattern = NULL;
+}
+
+static void audio_pattern_fill(int iterations)
+{
+    for(int i = 0; i < iterations; i++) {
+        g_audio_pattern->Fill(&g_pattern_pcm[0], 1024);
+    }
+}
+
+/* ---------------- AudioMixer ---------------- */
+#define MIXER_FRAME_SAMPLES 1024
+static AudioMixer *g_mixer = NULL;
+static int g_mixer_sources = 0;
+static int64_t g_mixer_frame = 0;
+static std::vector<std::vector<int16_t> > g_mixer_inputs;
+static std::vector<int16_t> g_mixer_out;
+
+// 每一路是不同频率的扫频，增益-6dB，避免走增益为1的捷径
+static int audio_mixer_setup(int sources, const char *mode)
+{
+    g_mixer = new AudioMixer();
+    Properties properties;
+    properties.SetProperty("sample_rate", 48000);
+    properties.SetProperty("channels", 2);
+    properties.SetProperty("nb_samples", MIXER_FRAME_SAMPLES);
+    properties.SetProperty("mode", mode);
+    if(g_mixer->Init(properties) != RET_OK) {
+        return -1;
+    }
+    g_mixer_sources = sources;
+    g_mixer_frame = 0;
+    g_mixer_inputs.resize(sources);
+    for(int i = 0; i < sources; i++) {
+        g_mixer->AddSource(-6);
+        AudioPattern pattern;
+        Properties pattern_properties;
+        pattern_properties.SetProperty("sample_rate", 48000);
+        pattern_properties.SetProperty("channels", 2);
+        pattern_properties.SetProperty("pattern", "sweep");
+        pattern_properties.SetProperty("sweep_start", 100 + i * 50);
+        if(pattern.Init(pattern_properties) != RET_OK) {
+            return -1;
+        }
+        g_mixer_inputs[i].resize(MIXER_FRAME_SAMPLES * 2);
+        pattern.Fill(&g_mixer_inputs[i][0], MIXER_FRAME_SAMPLES);
+    }
+    g_mixer_out.resize(MIXER_FRAME_SAMPLES * 2);
+    return 0;
+}
+
+static void audio_mixer_teardown()
+{
+    delete g_mixer;
+    g_mixer = NULL;
+    g_mixer_inputs.clear();
+}
+
+// 每次每一路送入一帧再混出一帧，包括Push的加锁与拷贝，ns_median除以21.3ms就是占用一个核的比例
+static void audio_mixer_mix(int iterations)
+{
+    for(int i = 0; i < iterations; i++) {
+        int64_t position = g_mixer_frame * MIXER_FRAME_SAMPLES;
+        int64_t pts = position * 1000 / 48000;
+        for(int k = 0; k < g_mixer_sources; k++) {
+            g_mixer->Push(k, &g_mixer_inputs[k][0], MIXER_FRAME_SAMPLES, pts);
+        }
+        g_mixer->Mix(&g_mixer_out[0], position);
+        g_mixer_frame++;
+    }
+}
+
+/* ---------------- VideoCompositor ---------------- */
+#define COMPOSITOR_WIDTH    1920
+#define COMPOSITOR_HEIGHT   1080
+#define OVERLAY_WIDTH       480
+#define OVERLAY_HEIGHT      270
+static VideoCompositor *g_compositor = NULL;
+static std::vector<uint8_t> g_compositor_frame;
+
+// 叠加层480x270，沿着右边排列，奇数层用整体alpha，偶数层用逐像素alpha(渐变)，只测编码线程的Compose
+static int video_compositor_setup(int overlays)
+{
+    std::vector<VideoOverlay> configs;
+    for(int i = 0; i < overlays; i++) {
+        VideoOverlay overlay;
+        overlay.source = "pattern";
+        overlay.arg = "gradient";
+        overlay.src_width = OVERLAY_WIDTH;
+        overlay.src_height = OVERLAY_HEIGHT;
+        overlay.x = COMPOSITOR_WIDTH - OVERLAY_WIDTH - 40;
+        overlay.y = 40 + i * OVERLAY_HEIGHT * 7 / 8;
+        overlay.width = OVERLAY_WIDTH;
+        overlay.height = OVERLAY_HEIGHT;
+        overlay.alpha = 200;
+        configs.push_back(overlay);
+    }
+    g_compositor = new VideoCompositor();
+    if(g_compositor->Init(COMPOSITOR_WIDTH, COMPOSITOR_HEIGHT, configs) != RET_OK) {
+        return -1;
+    }
+    VideoPattern pattern;
+    Properties properties;
+    properties.SetProperty("width", OVERLAY_WIDTH);
+    properties.SetProperty("height", OVERLAY_HEIGHT);
+    if(pattern.Init(properties) != RET_OK) {
+        return -1;
+    }
+    std::vector<uint8_t> yuv(pattern.GetFrameSize());
+    std::vector<uint8_t> alpha(OVERLAY_WIDTH * OVERLAY_HEIGHT);
+    for(size_t k = 0; k < alpha.size(); k++) {
+        alpha[k] = (uint8_t)(k % OVERLAY_WIDTH * 255 / OVERLAY_WIDTH);
+    }
+    for(int i = 0; i < overlays; i++) {
+        pattern.Fill(&yuv[0], i);
+        g_compositor->SetOverlayFrame(i, &yuv[0], (i & 1) ? &alpha[0] : NULL);
+    }
+    g_compositor_frame.resize(COMPOSITOR_WIDTH * COMPOSITOR_HEIGHT * 3 / 2, 128);
+    return 0;
+}
+
+static void video_compositor_teardown()
+{
+    delete g_compositor;
+    g_compositor = NULL;
+    g_compositor_frame.clear();
+}
+
+// 每次合成一帧，ns_median除以40ms(25fps)就是占用编码线程的比例
+static void video_compositor_compose(int iterations)
+{
+    for(int i = 0; i < iterations; i++) {
+        g_compositor->Compose(&g_compositor_frame[0]);
+    }
+}
+
+/* ---------------- NalParser ---------------- */
+#define NAL_STREAM_SIZE     (1 << 20)
+#define NAL_FRAME_SLICES    4
+static std::vector<uint8_t> g_nal_stream;               // 1MB的Annex-B码流，NAL长度1000-60000字节
+static std::vector<uint8_t> g_nal_frame;                // sps + pps + 4个IDR slice，约64KB
+static volatile int g_nal_sink = 0;
+
+// 随机的NAL负载，按编码器的规则插入防竞争字节，不会出现起始码
+static void append_nal(std::vector<uint8_t> &out, uint8_t header, int size, uint32_t *seed)
+{
+    static const uint8_t start_code[4] = {0, 0, 0, 1};
+    out.insert(out.end(), start_code, start_code + 4);
+    out.push_back(header);
+    out.push_back(0x88);                                // first_mb_in_slice = 0，slice_type = 7(I)
+    int zeros = 0;
+    for(int i = 2; i < size; i++) {
+        *seed = *seed * 1103515245 + 12345;
+        // 负载里0比较多，让标量查找经常进入比较分支
+        uint8_t byte = (*seed >> 16) % 3 ? (uint8_t)(*seed >> 8) : 0;
+        if(zeros >= 2 && byte <= 3) {
+            out.push_back(3);
+            zeros = 0;
+        }
+        out.push_back(byte);
+        zeros = 0 == byte ? zeros + 1 : 0;
+    }
+    if(0 == out.back()) {
+        out.push_back(0x80);                            // rbsp_trailing_bits
+    }
+}
+
+static int nal_parser_setup(int)
+{
+    uint32_t seed = 1;
+    g_nal_stream.clear();
+    while(g_nal_stream.size() < NAL_STREAM_SIZE) {
+        seed = seed * 1103515245 + 12345;
+        append_nal(g_nal_stream, 0x41, 1000 + (seed >> 8) % 59000, &seed);
+    }
+    g_nal_stream.resize(NAL_STREAM_SIZE);
+    g_nal_frame.clear();
+    append_nal(g_nal_frame, 0x67, 24, &seed);
+    append_nal(g_nal_frame, 0x68, 6, &seed);
+    for(int i = 0; i < NAL_FRAME_SLICES; i++) {
+        append_nal(g_nal_frame, 0x65, 16384, &seed);
+    }
+    return 0;
+}
+
+static void nal_parser_teardown()
+{
+    g_nal_stream.clear();
+    g_nal_frame.clear();
+}
+
+template<const uint8_t *(*find)(const uint8_t *, const uint8_t *, int *)>
+static void nal_find_start_code(int iterations)
+{
+    const uint8_t *end = &g_nal_stream[0] + g_nal_stream.size();
+    for(int i = 0; i < iterations; i++) {
+        int start_code_size = 0;
+        int count = 0;
+        const uint8_t *p = find(&g_nal_stream[0], end, &start_code_size);
+        while(p < end) {
+            count++;
+            p = find(p + start_code_size, end, &start_code_size);
+        }
+        g_nal_sink += count;
+    }
+}
+
+// 每个包调用一次，ns_median就是推流端每帧多出的开销
+static void nal_inspect_frame(int iterations)
+{
+    NalPacketInfo info;
+    for(int i = 0; i < iterations; i++) {
+        NalParser::Inspect(&g_nal_frame[0], (int)g_nal_frame.size(), 0, NAL_CODEC_H264, &info);
+        g_nal_sink += info.slice_count;
+    }
+}
+
+/* ---------------- AACEncoder::GetAdtsHeader ---------------- */
+static AACEncoder *g_aac_encoder = NULL;
+static volatile uint8_t g_adts_sink = 0;
+
+static int adts_header_setup(int)
+{
+    g_aac_encoder = new AACEncoder();
+    Properties properties;
+    properties.SetProperty("sample_rate", 48000);
+    properties.SetProperty("channels", 2);
+    properties.SetProperty("bitrate", 128 * 1024);
+    return g_aac_encoder->Init(properties) == RET_OK ? 0 : -1;
+}
+
+static void adts_header_teardown()
+{
+    delete g_aac_encoder;
+    g_aac_encoder = NULL;
+}
+
+static void aac_get_adts_header(int iterations)
+{
+    uint8_t header[7];
+    for(int i = 0; i < iterations; i++) {
+        g_aac_encoder->GetAdtsHeader(header, 300 + (i & 255));
+        g_adts_sink ^= header[5];
+    }
+}
+
+/* ---------------- write_log ---------------- */
+static void write_log_written(int iterations)
+{
+    for(int i = 0; i < iterations; i++) {
+        LogWarn("microbench write_log %d, pts: %lld, size: %d", i, (long long)i * 40, 1200);
+    }
+}
+
+// 低于日志级别被过滤掉的调用，大部分LogInfo在运行时都是这种情况
+static void write_log_filtered(int iterations)
+{
+    for(int i = 0; i < iterations; i++) {
+        LogDebug("microbench write_log %d, pts: %lld, size: %d", i, (long long)i * 40, 1200);
+    }
+}
+
+static int no_setup(int)
+{
+    return 0;
+}
+
+static void no_teardown()
+{
+}
+
+static BenchResult run_case(const BenchCase &c, int reps)
+{
+    BenchResult result;
+    result.name = c.name;
+    result.iterations = c.iterations;
+    result.reps = reps;
+    result.bytes_per_op = c.bytes_per_op;
+    std::vector<double> samples;
+    c.run(c.iterations);                // 预热：缓存、分配器、编码器的前几帧
+    for(int r = 0; r < reps; r++) {
+        int64_t begin = now_ns();
+        c.run(c.iterations);
+        samples.push_back((double)(now_ns() - begin) / c.iterations);
+    }
+    std::sort(samples.begin(), samples.end());
+    result.ns_min = samples.front();
+    result.ns_median = samples[samples.size() / 2];
+    double sum = 0;
+    for(size_t i = 0; i < samples.size(); i++) {
+        sum += samples[i];
+    }
+    result.ns_mean = sum / samples.size();
+    return result;
+}
+
+static void write_results(FILE *fp, const std::string &format, const std::vector<BenchResult> &results)
+{
+    if(format == "csv") {
+        fprintf(fp, "name,iterations,reps,ns_min,ns_median,ns_mean,bytes_per_op,mb_per_s\n");
+        for(size_t i = 0; i < results.size(); i++) {
+            const BenchResult &r = results[i];
+            fprintf(fp, "%s,%d,%d,%.1f,%.1f,%.1f,%d,%.1f\n", r.name.c_str(), r.iterations, r.reps, r.ns_min,
+                    r.ns_median, r.ns_mean, r.bytes_per_op, r.bytes_per_op > 0 ? r.bytes_per_op * 1000.0 / r.ns_median : 0);
+        }
+        return;
+    }
+    fprintf(fp, "{\n  \"suite\": \"rtsp-publish-microbench\",\n  \"compiler\": \"%s\",\n  \"results\": [\n",
+#if defined(__VERSION__)
+            __VERSION__
+#else
+            "unknown"
+#endif
+            );
+    for(size_t i = 0; i < results.size(); i++) {
+        const BenchResult &r = results[i];
+        fprintf(fp, "    {\"name\": \"%s\", \"iterations\": %d, \"reps\": %d, \"ns_min\": %.1f, \"ns_median\": %.1f, "
+                "\"ns_mean\": %.1f, \"bytes_per_op\": %d, \"mb_per_s\": %.1f}%s\n", r.name.c_str(), r.iterations,
+                r.reps, r.ns_min, r.ns_median, r.ns_mean, r.bytes_per_op,
+                r.bytes_per_op > 0 ? r.bytes_per_op * 1000.0 / r.ns_median : 0, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+    std::string format = "json";
+    const char *out_name = NULL;
+    const char *filter = NULL;
+    int reps = 9;
+    for(int i = 1; i + 1 < argc; i += 2) {
+        if(!strcmp(argv[i], "--format")) {
+            format = argv[i + 1];
+        } else if(!strcmp(argv[i], "--out")) {
+            out_name = argv[i + 1];
+        } else if(!strcmp(argv[i], "--reps")) {
+            reps = atoi(argv[i + 1]);
+        } else if(!strcmp(argv[i], "--filter")) {
+            filter = argv[i + 1];
+        }
+    }
+    if((format != "json" && format != "csv") || reps <= 0) {
+        fprintf(stderr, "usage: microbench [--format json|csv] [--out file] [--reps n] [--filter name]\n");
+        return -1;
+    }
+    // LogInfo被过滤，write_log_written用LogWarn写文件
+    init_logger("microbench_log", S_WARN);
+    av_log_set_level(AV_LOG_QUIET);
+
+    std::vector<BenchCase> cases;
+    cases.push_back({"packet_queue_push_pop", 1 << 20, 0, packet_queue_setup, packet_queue_push_pop,
+                     packet_queue_teardown});
+    cases.push_back({"packet_queue_two_threads", 1 << 18, 0, packet_queue_setup, packet_queue_two_threads,
+                     packet_queue_teardown});
+    cases.push_back({"msg_queue_put_get", 1 << 18, 0,
+                     [](int) { g_msg_queue = new MessageQueue(); return 0; }, msg_queue_put_get,
+                     []() { delete g_msg_queue; g_msg_queue = NULL; }});
+    cases.push_back({"audio_convert_s16_fltp_1024x2", 1 << 15, 1024 * 2 * 2, audio_convert_setup,
+                     audio_convert_s16_fltp, no_teardown});
+    cases.push_back({"h264_encode_640x360", 50, H264_WIDTH * H264_HEIGHT * 3 / 2, h264_encode_setup,
+                     h264_encode_frame, h264_encode_teardown});
+    cases.push_back({"aac_get_adts_header", 1 << 22, 0, adts_header_setup, aac_get_adts_header,
+                     adts_header_teardown});
+    cases.push_back({"video_pattern_gradient_2160p", 60, PATTERN_WIDTH * PATTERN_HEIGHT * 3 / 2,
+                     [](int) { return video_pattern_setup("gradient"); }, video_pattern_fill, video_pattern_teardown});
+    cases.push_back({"video_pattern_noise_2160p", 60, PATTERN_WIDTH * PATTERN_HEIGHT * 3 / 2,
+                     [](int) { return video_pattern_setup("noise"); }, video_pattern_fill, video_pattern_teardown});
+    cases.push_back({"audio_pattern_sweep_1024x2", 1 << 12, 1024 * 2 * 2, audio_pattern_setup,
+                     audio_pattern_fill, audio_pattern_teardown});
+    const int mixer_sources[] = {2, 8, 32};
+    static const char *mixer_names[][2] = {{"audio_mixer_2_float", "audio_mixer_2_s16"},
+                                           {"audio_mixer_8_float", "audio_mixer_8_s16"},
+                                           {"audio_mixer_32_float", "audio_mixer_32_s16"}};
+    for(int i = 0; i < 3; i++) {
+        int sources = mixer_sources[i];
+        cases.push_back({mixer_names[i][0], 1 << 11, MIXER_FRAME_SAMPLES * 2 * 2 * sources,
+                         [sources](int) { return audio_mixer_setup(sources, "float"); }, audio_mixer_mix,
+                         audio_mixer_teardown});
+        cases.push_back({mixer_names[i][1], 1 << 11, MIXER_FRAME_SAMPLES * 2 * 2 * sources,
+                         [sources](int) { return audio_mixer_setup(sources, "s16"); }, audio_mixer_mix,
+                         audio_mixer_teardown});
+    }
+    const int compositor_overlays[] = {1, 2, 4};
+    static const char *compositor_names[] = {"video_compositor_1080p_1", "video_compositor_1080p_2",
+                                             "video_compositor_1080p_4"};
+    for(int i = 0; i < 3; i++) {
+        int overlays = compositor_overlays[i];
+        cases.push_back({compositor_names[i], 1 << 10, OVERLAY_WIDTH * OVERLAY_HEIGHT * 3 / 2 * overlays,
+                         [overlays](int) { return video_compositor_setup(overlays); }, video_compositor_compose,
+                         video_compositor_teardown});
+    }
+    cases.push_back({"nal_find_start_code_1mb", 1 << 7, NAL_STREAM_SIZE, nal_parser_setup,
+                     nal_find_start_code<NalParser::FindStartCode>, nal_parser_teardown});
+    cases.push_back({"nal_find_start_code_scalar_1mb", 1 << 7, NAL_STREAM_SIZE, nal_parser_setup,
+                     nal_find_start_code<NalParser::FindStartCodeC>, nal_parser_teardown});
+    cases.push_back({"nal_inspect_frame_64k", 1 << 11, NAL_FRAME_SLICES * 16384, nal_parser_setup, nal_inspect_frame,
+                     nal_parser_teardown});
+    cases.push_back({"write_log_written", 1 << 14, 0, no_setup, write_log_written, no_teardown});
+    cases.push_back({"write_log_filtered", 1 << 22, 0, no_setup, write_log_filtered, no_teardown});
+
+    std::vector<BenchResult> results;
+    for(size_t i = 0; i < cases.size(); i++) {
+        const BenchCase &c = cases[i];
+        if(filter && !strstr(c.name, filter)) {
+            continue;
+        }
+        BenchResult result;
+        bool ok;
+        {
+            StdoutSilencer silencer;
+            ok = c.setup(c.iterations) == 0;
+            if(ok) {
+                result = run_case(c, reps);
+            }
+            c.teardown();
+        }
+        if(!ok) {
+            fprintf(stderr, "%s setup failed, skipped\n", c.name);
+            continue;
+        }
+        fprintf(stderr, "%-32s %12.1f ns/op (median of %d x %d)\n", c.name, result.ns_median, reps, c.iterations);
+        results.push_back(result);
+    }
+
+    FILE *fp = out_name ? fopen(out_name, "w") : stdout;
+    if(!fp) {
+        fprintf(stderr, "open %s failed\n", out_name);
+        return -1;
+    }
+    write_results(fp, format, results);
+    if(fp != stdout) {
+        fclose(fp);
+    }
+    return 0;
+}
@@ -0,0 +1,479 @@
+﻿/**
+ * NalParser的模糊测试与等价性检查，输入都是随机合成的数据，不依赖文件、网络与FFmpeg。
+ * 1）起始码查找：0-96字节的所有位置放置起始码的穷举用例，加上随机码流(0、1、3较多，随机插入3、4字节的起始码)，
+ *    从不同的位置开始逐个查找到结尾，FindStartCode(SIMD)与FindStartCodeC(标量)的每一个结果都必须相同。
+ * 2）包与extradata的解析：合成合法的Annex-B/AVCC包与avcC/hvcC，随机改写若干字节、截断到随机长度，再加上纯随机的数据，
+ *    调用Split、Inspect、ParseExtradata。检查返回的NAL都在输入范围内，Inspect的汇总与按Split的结果计算的一致，
+ *    ParseExtradata成功时给出的length_size可以直接用于Split。
+ * 每个输入都分别放在紧挨后面、紧挨前面是不可访问页(PROT_NONE)的位置各运行一次，越界读会直接段错误。
+ * 不可访问页用mmap/mprotect实现，只支持Linux与macOS。
+ *
+ * 用法：nalfuzz [-n 迭代次数] [-s 随机种子] [-m 最大输入字节数]
+ * 例如：nalfuzz -n 200000 -s 1
+ * 有不一致时打印第一个失败用例的种子与输入并返回1，全部通过返回0。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <string>
+#include <vector>
+#include "nalparser.h"
+
+// 随机数，每个用例从自己的种子开始，失败时可以用-s与-n 1单独复现
+static uint32_t next_rand(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/**
+ * 前后各有一个不可访问页的缓冲，输入放在紧挨某一个不可访问页的位置。
+ */
+class GuardedBuffer
+{
+public:
+    GuardedBuffer(size_t max_size)
+    {
+        page_ = (size_t)sysconf(_SC_PAGESIZE);
+        data_size_ = (max_size + page_ - 1) / page_ * page_;
+        map_size_ = data_size_ + 2 * page_;
+        void *base = mmap(NULL, map_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(MAP_FAILED == base) {
+            perror("mmap");
+            exit(-1);
+        }
+        base_ = (uint8_t *)base;
+        mprotect(base_, page_, PROT_NONE);
+        mprotect(base_ + page_ + data_size_, page_, PROT_NONE);
+    }
+    ~GuardedBuffer()
+    {
+        munmap(base_, map_size_);
+    }
+    // tail为true时输入的结尾紧挨后面的不可访问页，否则开头紧挨前面的不可访问页
+    uint8_t *Place(const uint8_t *data, size_t size, bool tail)
+    {
+        uint8_t *dst = tail ? base_ + page_ + data_size_ - size : base_ + page_;
+        if(size > 0) {
+            memcpy(dst, data, size);
+        }
+        return dst;
+    }
+
+private:
+    size_t page_ = 4096;
+    size_t data_size_ = 0;
+    size_t map_size_ = 0;
+    uint8_t *base_ = NULL;
+};
+
+typedef struct fuzz_stats
+{
+    int64_t find_calls;                 // FindStartCode与FindStartCodeC的对比次数
+    int64_t find_found;                 // 其中找到起始码的次数
+    int64_t parse_inputs;               // 解析的输入个数
+    int64_t split_ok;
+    int64_t extradata_ok;
+    int failures;
+}FuzzStats;
+
+static FuzzStats s_stats;
+static std::string s_case;              // 当前用例的描述，失败时打印
+
+static void dump_input(const uint8_t *data, int size)
+{
+    fprintf(stderr, "  input(%d bytes):", size);
+    for(int i = 0; i < size && i < 256; i++) {
+        fprintf(stderr, "%s%02x", i % 32 ? " " : "\n    ", data[i]);
+    }
+    fprintf(stderr, "%s\n", size > 256 ? " ..." : "");
+}
+
+static void report(const char *what, const uint8_t *data, int size)
+{
+    if(0 == s_stats.failures++) {
+        fprintf(stderr, "FAIL %s: %s\n", s_case.c_str(), what);
+        dump_input(data, size);
+    }
+}
+
+/* ---------------- 起始码查找 ---------------- */
+
+// 从begin开始逐个查找到结尾，每次都对比两种实现；下一次从找到的起始码内部的随机位置开始，覆盖00 00 00 01的重叠情况
+static void check_find(const uint8_t *data, int size, int begin, uint32_t *state)
+{
+    const uint8_t *end = data + size;
+    const uint8_t *p = data + begin;
+    while(true) {
+        int simd_size = -1;
+        int scalar_size = -1;
+        const uint8_t *simd = NalParser::FindStartCode(p, end, &simd_size);
+        const uint8_t *scalar = NalParser::FindStartCodeC(p, end, &scalar_size);
+        s_stats.find_calls++;
+        if(simd != scalar || simd_size != scalar_size) {
+            char what[256];
+            snprintf(what, sizeof(what), "FindStartCode from %d: simd %d/%d, scalar %d/%d", (int)(p - data),
+                     (int)(simd - data), simd_size, (int)(scalar - data), scalar_size);
+            report(what, data, size);
+            return;
+        }
+        if(simd >= end) {
+            return;
+        }
+        s_stats.find_found++;
+        p = simd + 1 + next_rand(state) % simd_size;
+    }
+}
+
+static void check_find_both(GuardedBuffer *buffer, const std::vector<uint8_t> &input, int begin, uint32_t *state)
+{
+    for(int tail = 0; tail < 2; tail++) {
+        const uint8_t *data = buffer->Place(input.data(), input.size(), tail != 0);
+        check_find(data, (int)input.size(), begin, state);
+    }
+}
+
+// 0-96字节(覆盖AVX2的32字节块加上尾部)，每个位置放一个3或4字节的起始码，其余填充0xff或者0
+static void fuzz_find_exhaustive(GuardedBuffer *buffer)
+{
+    uint32_t state = 1;
+    for(int size = 0; size <= 96; size++) {
+        for(int filler = 0; filler < 2; filler++) {
+            std::vector<uint8_t> input(size, filler ? 0x00 : 0xff);
+            s_case = "exhaustive size " + std::to_string(size) + " filler " + std::to_string(filler) + " none";
+            check_find_both(buffer, input, 0, &state);
+            for(int pos = 0; pos + 3 <= size; pos++) {
+                for(int zero = 0; zero < 2; zero++) {
+                    std::vector<uint8_t> with_code = input;
+                    with_code[pos] = 0;
+                    with_code[pos + 1] = 0;
+                    with_code[pos + 2] = 1;
+                    if(zero && pos > 0) {
+                        with_code[pos - 1] = 0;
+                    }
+                    s_case = "exhaustive size " + std::to_string(size) + " filler " + std::to_string(filler)
+                             + " pos " + std::to_string(pos) + " zero " + std::to_string(zero);
+                    for(int begin = 0; begin <= pos + 1 && begin <= size; begin++) {
+                        check_find_both(buffer, with_code, begin, &state);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void random_stream(std::vector<uint8_t> *out, int size, uint32_t *state)
+{
+    out->resize(size);
+    for(int i = 0; i < size; i++) {
+        uint32_t r = next_rand(state);
+        int kind = r % 16;
+        (*out)[i] = kind < 8 ? 0 : (kind < 10 ? 1 : (kind < 11 ? 3 : (uint8_t)(r >> 8)));
+    }
+    int codes = size > 0 ? next_rand(state) % 8 : 0;
+    for(int i = 0; i < codes; i++) {
+        int pos = next_rand(state) % size;
+        static const uint8_t code[4] = {0, 0, 0, 1};
+        int len = next_rand(state) % 2 ? 4 : 3;
+        for(int j = 0; j < len && pos + j < size; j++) {
+            (*out)[pos + j] = code[4 - len + j];
+        }
+    }
+}
+
+/* ---------------- Split、Inspect、ParseExtradata ---------------- */
+
+// 一个合成的NAL，H.264的头1字节，H.265的头2字节，slice带一个合法的slice头开头
+static void append_nal(std::vector<uint8_t> *nal, NalCodec codec, int type, int payload, uint32_t *state)
+{
+    nal->clear();
+    if(NAL_CODEC_HEVC == codec) {
+        nal->push_back((uint8_t)(type << 1));
+        nal->push_back(1);                              // nuh_temporal_id_plus1
+    } else {
+        int ref_idc = 1 == type ? next_rand(state) % 4 : 3;
+        nal->push_back((uint8_t)((ref_idc << 5) | type));
+    }
+    // first_mb_in_slice = 0 / first_slice_segment_in_pic_flag = 1，后面是随机的slice_type等
+    nal->push_back((uint8_t)(0x80 | (next_rand(state) & 0x7f)));
+    for(int i = 0; i < payload; i++) {
+        nal->push_back((uint8_t)next_rand(state));
+    }
+}
+
+static void random_nal_types(NalCodec codec, std::vector<int> *types, uint32_t *state)
+{
+    static const int h264_types[] = {7, 8, 6, 5, 1, 1, 9, 2};
+    static const int hevc_types[] = {32, 33, 34, 39, 19, 1, 0, 21};
+    const int *table = NAL_CODEC_HEVC == codec ? hevc_types : h264_types;
+    types->clear();
+    int count = 1 + next_rand(state) % 6;
+    for(int i = 0; i < count; i++) {
+        types->push_back(table[next_rand(state) % 8]);
+    }
+}
+
+// 一个包，length_size为0时Annex-B，否则每个NAL前面length_size字节的长度
+static void build_packet(std::vector<uint8_t> *out, NalCodec codec, int length_size, uint32_t *state)
+{
+    std::vector<int> types;
+    random_nal_types(codec, &types, state);
+    int max_payload = 1 == length_size ? 200 : 3000;
+    out->clear();
+    std::vector<uint8_t> nal;
+    for(size_t i = 0; i < types.size(); i++) {
+        append_nal(&nal, codec, types[i], next_rand(state) % max_payload, state);
+        if(0 == length_size) {
+            static const uint8_t code[4] = {0, 0, 0, 1};
+            int len = next_rand(state) % 2 ? 4 : 3;
+            out->insert(out->end(), code + 4 - len, code + 4);
+        } else {
+            for(int b = length_size - 1; b >= 0; b--) {
+                out->push_back((uint8_t)(nal.size() >> (8 * b)));
+            }
+        }
+        out->insert(out->end(), nal.begin(), nal.end());
+    }
+}
+
+static void append_be16(std::vector<uint8_t> *out, int value)
+{
+    out->push_back((uint8_t)(value >> 8));
+    out->push_back((uint8_t)value);
+}
+
+// avcC或者hvcC，lengthSizeMinusOne随机取0-3(3是非法的)
+static void build_extradata(std::vector<uint8_t> *out, NalCodec codec, uint32_t *state)
+{
+    out->clear();
+    std::vector<uint8_t> nal;
+    int length_size_minus_one = next_rand(state) % 4;
+    if(NAL_CODEC_HEVC == codec) {
+        out->push_back(1);
+        for(int i = 1; i < 21; i++) {
+            out->push_back((uint8_t)next_rand(state));
+        }
+        out->push_back((uint8_t)(0xfc | length_size_minus_one));
+        static const int array_types[3] = {32, 33, 34};
+        int arrays = 1 + next_rand(state) % 3;
+        out->push_back((uint8_t)arrays);
+        for(int a = 0; a < arrays; a++) {
+            int count = 1 + next_rand(state) % 2;
+            out->push_back((uint8_t)(0x80 | array_types[a]));
+            append_be16(out, count);
+            for(int i = 0; i < count; i++) {
+                append_nal(&nal, codec, array_types[a], next_rand(state) % 40, state);
+                append_be16(out, (int)nal.size());
+                out->insert(out->end(), nal.begin(), nal.end());
+            }
+        }
+        return;
+    }
+    out->push_back(1);
+    out->push_back(0x64);
+    out->push_back(0);
+    out->push_back(0x1f);
+    out->push_back((uint8_t)(0xfc | length_size_minus_one));
+    for(int a = 0; a < 2; a++) {
+        int count = 1 + next_rand(state) % 2;
+        out->push_back((uint8_t)(0 == a ? 0xe0 | count : count));
+        for(int i = 0; i < count; i++) {
+            append_nal(&nal, codec, 0 == a ? 7 : 8, next_rand(state) % 40, state);
+            append_be16(out, (int)nal.size());
+            out->insert(out->end(), nal.begin(), nal.end());
+        }
+    }
+}
+
+// 随机改写几个字节，再以1/2的概率截断到随机长度
+static void mutate(std::vector<uint8_t> *input, uint32_t *state)
+{
+    int changes = next_rand(state) % 4;
+    for(int i = 0; i < changes && !input->empty(); i++) {
+        uint32_t r = next_rand(state);
+        uint8_t &byte = (*input)[r % input->size()];
+        byte = (r >> 24) & 1 ? (uint8_t)(byte ^ (1 << ((r >> 16) & 7))) : (uint8_t)(r >> 8);
+    }
+    if(next_rand(state) % 2) {
+        input->resize(next_rand(state) % (input->size() + 1));
+    }
+}
+
+static bool nal_in_range(const NalUnit &nal, const uint8_t *data, int size)
+{
+    return nal.size > 0 && nal.data >= data && nal.data + nal.size <= data + size;
+}
+
+// 按Split的结果计算一个包的汇总，与Inspect的结果对比
+static void summarize(const std::vector<NalUnit> &nals, NalCodec codec, NalPacketInfo *info)
+{
+    memset(info, 0, sizeof(NalPacketInfo));
+    info->slice_type = NAL_SLICE_UNKNOWN;
+    bool referenced = false;
+    for(size_t i = 0; i < nals.size(); i++) {
+        const NalUnit &nal = nals[i];
+        info->nal_count++;
+        bool slice;
+        if(NAL_CODEC_HEVC == codec) {
+            slice = (nal.type >= 0 && nal.type <= 9) || (nal.type >= 16 && nal.type <= 21);
+            info->key_frame |= nal.type >= 16 && nal.type <= 23;
+            info->has_parameter_sets |= nal.type >= 32 && nal.type <= 34;
+        } else {
+            slice = 1 == nal.type || 2 == nal.type || 5 == nal.type;
+            info->key_frame |= 5 == nal.type;
+            info->has_parameter_sets |= 7 == nal.type || 8 == nal.type;
+        }
+        if(!slice) {
+            continue;
+        }
+        if(0 == info->slice_count) {
+            info->slice_type = nal.slice_type;
+        }
+        referenced |= nal.ref_idc != 0;
+        info->slice_count++;
+    }
+    info->disposable = info->slice_count > 0 && !referenced;
+}
+
+static void check_packet(const uint8_t *data, int size, int length_size, NalCodec codec)
+{
+    std::vector<NalUnit> nals;
+    RET_CODE split_ret = NalParser::Split(data, size, length_size, codec, &nals);
+    NalPacketInfo info;
+    RET_CODE inspect_ret = NalParser::Inspect(data, size, length_size, codec, &info);
+    if(RET_OK == split_ret) {
+        s_stats.split_ok++;
+    }
+    for(size_t i = 0; i < nals.size(); i++) {
+        if(!nal_in_range(nals[i], data, size)) {
+            report("Split returned a NAL outside the input", data, size);
+            return;
+        }
+    }
+    if(split_ret != inspect_ret) {
+        report("Split and Inspect return different codes", data, size);
+        return;
+    }
+    NalPacketInfo expect;
+    summarize(nals, codec, &expect);
+    if(info.nal_count != expect.nal_count || info.slice_count != expect.slice_count
+            || info.key_frame != expect.key_frame || info.disposable != expect.disposable
+            || info.has_parameter_sets != expect.has_parameter_sets || info.slice_type != expect.slice_type) {
+        char what[256];
+        snprintf(what, sizeof(what), "Inspect nal %d slice %d key %d disposable %d ps %d type %d, "
+                 "Split nal %d slice %d key %d disposable %d ps %d type %d",
+                 info.nal_count, info.slice_count, info.key_frame, info.disposable, info.has_parameter_sets, info.slice_type,
+                 expect.nal_count, expect.slice_count, expect.key_frame, expect.disposable, expect.has_parameter_sets,
+                 expect.slice_type);
+        report(what, data, size);
+    }
+}
+
+static void check_extradata(const uint8_t *data, int size, NalCodec codec)
+{
+    std::vector<NalUnit> param_sets;
+    int length_size = -1;
+    RET_CODE ret = NalParser::ParseExtradata(data, size, codec, &param_sets, &length_size);
+    if(RET_OK != ret) {
+        return;
+    }
+    s_stats.extradata_ok++;
+    for(size_t i = 0; i < param_sets.size(); i++) {
+        if(!nal_in_range(param_sets[i], data, size)) {
+            report("ParseExtradata returned a parameter set outside the input", data, size);
+            return;
+        }
+    }
+    std::vector<NalUnit> nals;
+    uint8_t dummy = 0;
+    if(NalParser::Split(&dummy, 0, length_size, codec, &nals) != RET_OK) {
+        char what[128];
+        snprintf(what, sizeof(what), "ParseExtradata returned length_size %d that Split rejects", length_size);
+        report(what, data, size);
+    }
+}
+
+// 每个输入在两种位置各解析一次，包按两种codec、合成时的length_size与一个随机的length_size解析
+static void check_parse(GuardedBuffer *buffer, const std::vector<uint8_t> &input, int length_size, uint32_t *state)
+{
+    static const int length_sizes[4] = {0, 1, 2, 4};
+    int other = length_sizes[next_rand(state) % 4];
+    s_stats.parse_inputs++;
+    for(int tail = 0; tail < 2; tail++) {
+        const uint8_t *data = buffer->Place(input.data(), input.size(), tail != 0);
+        int size = (int)input.size();
+        for(int c = 0; c < 2; c++) {
+            NalCodec codec = 0 == c ? NAL_CODEC_H264 : NAL_CODEC_HEVC;
+            check_packet(data, size, length_size, codec);
+            check_packet(data, size, other, codec);
+            check_extradata(data, size, codec);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 100000;
+    uint32_t seed = 1;
+    int max_size = 4096;
+    int ch;
+    while((ch = getopt(argc, argv, "n:s:m:")) != -1) {
+        switch(ch) {
+        case 'n': iterations = atoi(optarg); break;
+        case 's': seed = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'm': max_size = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-s seed] [-m max_size]\n", argv[0]);
+            return -1;
+        }
+    }
+    if(iterations <= 0 || max_size < 16) {
+        fprintf(stderr, "invalid iterations %d or max_size %d\n", iterations, max_size);
+        return -1;
+    }
+    GuardedBuffer buffer(max_size > 65536 ? max_size : 65536);
+
+    fuzz_find_exhaustive(&buffer);
+    printf("exhaustive start code: %lld calls, %lld found, %d failures\n",
+           (long long)s_stats.find_calls, (long long)s_stats.find_found, s_stats.failures);
+
+    std::vector<uint8_t> input;
+    for(int i = 0; i < iterations && 0 == s_stats.failures; i++) {
+        uint32_t case_seed = seed + (uint32_t)i;
+        uint32_t state = case_seed * 2654435761u + 1;   // xorshift的状态不能为0
+        s_case = "seed " + std::to_string(case_seed);
+        random_stream(&input, next_rand(&state) % (max_size + 1), &state);
+        check_find_both(&buffer, input, input.empty() ? 0 : next_rand(&state) % input.size(), &state);
+
+        int kind = next_rand(&state) % 3;
+        int length_size = 0;
+        NalCodec codec = next_rand(&state) % 2 ? NAL_CODEC_HEVC : NAL_CODEC_H264;
+        if(0 == kind) {
+            static const int length_sizes[4] = {0, 1, 2, 4};
+            length_size = length_sizes[next_rand(&state) % 4];
+            build_packet(&input, codec, length_size, &state);
+        } else if(1 == kind) {
+            build_extradata(&input, codec, &state);
+        } else {
+            input.resize(next_rand(&state) % 64);       // 纯随机的短输入
+            for(size_t j = 0; j < input.size(); j++) {
+                input[j] = (uint8_t)next_rand(&state);
+            }
+        }
+        mutate(&input, &state);
+        if(input.size() > (size_t)max_size) {
+            input.resize(max_size);
+        }
+        check_parse(&buffer, input, length_size, &state);
+    }
+    printf("random: %lld start code calls (%lld found), %lld parse inputs (split ok %lld, extradata ok %lld), %d failures\n",
+           (long long)s_stats.find_calls, (long long)s_stats.find_found, (long long)s_stats.parse_inputs,
+           (long long)s_stats.split_ok, (long long)s_stats.extradata_ok, s_stats.failures);
+    return s_stats.failures ? 1 : 0;
+}
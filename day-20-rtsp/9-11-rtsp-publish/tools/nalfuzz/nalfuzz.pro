@@ -0,0 +1,14 @@
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle
+CONFIG -= qt
+# 用优化的构建，SIMD的代码路径与推流端一致；需要AVX2路径时加 QMAKE_CXXFLAGS += -mavx2
+CONFIG -= debug
+CONFIG += release
+
+# 只依赖推流端的NAL解析源码，不需要FFmpeg
+PUBLISH_DIR = $$PWD/../..
+INCLUDEPATH += $$PUBLISH_DIR
+
+SOURCES += main.cpp \
+    $$PUBLISH_DIR/nalparser.cpp
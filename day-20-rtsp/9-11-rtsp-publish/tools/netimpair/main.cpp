@@ -0,0 +1,1186 @@
+﻿/**
+ * 网络损伤代理，在本机测试推流端的拥塞处理、丢包与断线重连，不需要真实的远端服务器与真实的网络故障。
+ *     推流端 -> netimpair(-l 8555) -> rtsp接收端(-r 127.0.0.1:8554，例如tools/rtspreceiver)
+ *
+ * 1）tcp：按rtsp消息与interleaved包切分后转发。带宽上限用令牌桶；时延与抖动只推迟发送时间，不改变顺序；
+ *    tcp上不能真的丢包，丢包按重传处理：这个包多等-R毫秒，后面的包跟着排队(队头阻塞)。
+ *    积压超过-q后不再读推流端的数据，推流端的发送缓冲满了就会阻塞，与真实的网络一样。
+ * 2）udp：改写SETUP回复中的server_port，让推流端把rtp、rtcp发给代理，再由代理转给接收端；丢包直接丢弃，
+ *    抖动会造成乱序，积压超过-q时丢弃新到的包(尾部丢弃)。
+ * 3）脚本(-s)：每行"秒数 动作 参数"，#后面是注释：
+ *      0  set rate=4000 delay=30 jitter=10 loss=0    带宽kbps(0不限)、单向时延ms、抖动ms、丢包%，只写要改的项
+ *      20 blackout 5                                  5秒内两个方向都不转发(tcp积压，udp丢弃)
+ *      40 reset                                       用RST断开所有tcp连接，推流端需要重连
+ *      60 end                                         结束
+ *    带宽与丢包只作用于推流端到接收端的方向，时延与抖动两个方向都有。
+ *
+ * 统计的是代理发给接收端的数据，也就是接收端收到的数据：
+ *  - 每秒一行csv(-o)：入/出码率、代理内的积压、视频/音频帧数、seq丢包、udp丢弃、媒体延时、代理内最大的传输时延。
+ *  - 退出时打印汇总：每个轨道的包数、seq丢包、推流端丢帧(rtp时间戳跳变)、最长帧间隔与卡顿次数、最大媒体延时，
+ *    每次blackout、reset之后的恢复时间与重连次数。
+ *    媒体延时 = (到达时间 - 会话首帧到达时间) - (rtp时间戳 - 首帧时间戳) / 时钟，再减去会话内的最小值，
+ *    即比最顺畅时多出来的延时；恢复时间是损伤结束到第一个媒体延时回到-c毫秒以内的视频帧的时间，重连后的新会话从0算起。
+ *  - -e 给出判定条件，有一条不满足时退出码为1，用于本地的自动化浸泡测试，例如：
+ *      -e "drop_rate<=5,recovery_ms<=3000,lag_ms<=2000,reconnects<=1,frames>=500"
+ *    可用的项：drop_rate(视频丢帧%)、loss_rate(rtp丢包%)、recovery_ms、lag_ms、transit_p95_ms、stalls、reconnects、frames。
+ *
+ * 用法：netimpair [-l 监听端口] [-r 接收端ip:端口] [-s 脚本] [-o 每秒统计csv] [-t 运行秒数] [-q 最大积压KB]
+ *                [-b 带宽kbps] [-d 时延ms] [-j 抖动ms] [-L 丢包%] [-R 重传等待ms] [-c 恢复门限ms] [-g 卡顿门限ms]
+ *                [-S 随机种子] [-e 判定条件]
+ * 推流端的url写成 rtsp://127.0.0.1:8555/live/test 即可，tcp、udp两种传输方式都支持。随机数的种子固定，同样的脚本结果可以复现。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+
+#define MAX_TRACKS          8
+#define TRANSIT_BUCKETS     10001               // 代理内传输时延的直方图，1ms一个桶，最后一个桶是>=10s
+#define MAX_RTSP_MESSAGE    65536               // 超过还没有找到消息结尾时当成普通数据转发
+
+// 损伤参数，脚本的set可以只改其中几项
+typedef struct impair_params
+{
+    int rate;                                   // 带宽上限，kbps，0不限
+    int delay;                                  // 单向时延，ms
+    int jitter;                                 // 抖动，发送时间在delay±jitter内均匀分布，ms
+    double loss;                                // 丢包率，%
+}ImpairParams;
+
+typedef struct script_event
+{
+    double time;                                // 秒
+    std::string action;                         // set、blackout、reset、end
+    std::string args;
+}ScriptEvent;
+
+// blackout、reset之后等待恢复
+typedef struct recovery
+{
+    std::string action;
+    double time;                                // 损伤开始的时间，秒
+    int64_t end;                                // 损伤结束的时间，us
+    int64_t recovered;                          // 恢复用时，us，-1表示还没有恢复
+}Recovery;
+
+// 转发的一个单元：一个rtsp消息、一个interleaved包或者一个udp包
+typedef struct unit
+{
+    std::string data;
+    int64_t ingress;                            // 代理收到的时间，us
+    int64_t release;                            // 最早可以发出的时间
+    int track;                                  // -1表示rtsp消息
+    bool rtcp;
+    int relay;                                  // udp包来自哪个转发socket，tcp为-1
+}Unit;
+
+// tcp的一个方向
+typedef struct direction
+{
+    std::string pending;                        // 还没有组成完整单元的数据
+    std::deque<Unit> queue;
+    int64_t queued_bytes;
+    size_t offset;                              // queue.front()已经发出的字节数
+    int64_t last_release;                       // 保证tcp的顺序
+    bool upstream;                              // 推流端到接收端的方向
+}Direction;
+
+// udp方式时，一个轨道的rtp或者rtcp的转发socket
+typedef struct udp_relay
+{
+    int fd;
+    int track;
+    bool rtcp;
+    struct sockaddr_in upstream;
+}UdpRelay;
+
+// 一个会话内每个轨道的状态，重连后重新开始
+typedef struct track_state
+{
+    int last_seq;                               // -1表示还没收到包
+    bool has_frame;
+    uint32_t last_ts;
+    int64_t unwrapped_ts;
+    int64_t first_time;
+    std::vector<int64_t> deltas;                // 开始的若干个帧间隔，取中位数作为正常的帧间隔
+    int64_t frame_delta;
+    int64_t last_frame_time;
+    int64_t min_lag;
+}TrackState;
+
+// 所有会话合起来的每个轨道的统计
+typedef struct track_stats
+{
+    std::string media;
+    int64_t packets;
+    int64_t bytes;
+    int64_t lost;                               // seq不连续
+    int64_t reordered;
+    int64_t frames;                             // rtp时间戳不同的包数
+    int64_t missing_frames;                     // 时间戳跳过的帧，即推流端丢掉的帧
+    int64_t max_gap;                            // 最长的帧间隔，us
+    int64_t stalls;                             // 帧间隔超过卡顿门限的次数
+    int64_t max_lag;                            // 最大的媒体延时，us
+    int64_t lag;                                // 最近一帧的媒体延时
+}TrackStats;
+
+typedef struct session
+{
+    int id;
+    int client_fd;
+    int upstream_fd;
+    Direction up;
+    Direction down;
+    std::vector<UdpRelay> relays;
+    std::multimap<int64_t, Unit> udp_queue;     // 按发送时间排序，抖动会造成乱序
+    int64_t udp_queued_bytes;
+    std::string media[MAX_TRACKS];
+    int clock_rate[MAX_TRACKS];
+    int channel_track[256];                     // interleaved的channel对应的轨道
+    int setup_track;                            // 最近一次SETUP请求的轨道，用于改写它的回复
+    TrackState tracks[MAX_TRACKS];
+}Session;
+
+// 每秒的统计，写一行csv后清零
+typedef struct second_stats
+{
+    int64_t in_bytes;
+    int64_t out_bytes;
+    int64_t video_frames;
+    int64_t audio_frames;
+    int64_t lost;
+    int64_t udp_dropped;
+    int64_t transit_max;
+}SecondStats;
+
+static volatile int s_quit = 0;
+static ImpairParams s_params = {0, 0, 0, 0};
+static int64_t s_blackout_end = 0;
+static int64_t s_max_queue = 512 * 1024;
+static int64_t s_loss_rto = 200 * 1000;         // tcp丢包的重传等待，us
+static int64_t s_recover_lag = 500 * 1000;
+static int64_t s_stall = 1000 * 1000;
+static uint32_t s_seed = 1;
+static double s_tokens = 0;                     // 上行令牌桶，字节
+static int64_t s_tokens_time = 0;
+static struct sockaddr_in s_upstream_addr;
+static TrackStats s_tracks[MAX_TRACKS];
+static std::vector<Recovery> s_recoveries;
+static std::vector<int64_t> s_transit(TRANSIT_BUCKETS, 0);
+static SecondStats s_second;
+static int64_t s_sessions = 0;
+static int64_t s_udp_dropped = 0;
+static int64_t s_retransmits = 0;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    s_quit = 1;
+}
+
+static int64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 固定种子的随机数，返回[0, 1)
+static double random01()
+{
+    s_seed ^= s_seed << 13;
+    s_seed ^= s_seed >> 17;
+    s_seed ^= s_seed << 5;
+    return (s_seed >> 8) / 16777216.0;
+}
+
+static std::string get_header(const std::string &msg, const char *name)
+{
+    std::string key = std::string("\r\n") + name + ":";
+    size_t pos = msg.find(key);
+    if(pos == std::string::npos) {
+        return "";
+    }
+    pos += key.size();
+    while(pos < msg.size() && msg[pos] == ' ') {
+        pos++;
+    }
+    size_t end = msg.find("\r\n", pos);
+    return msg.substr(pos, end - pos);
+}
+
+/**
+ * @brief 解析"rate=4000 delay=30"形式的参数，只修改出现的项。
+ * @return 0 成功; -1 有不认识的项。
+ */
+static int parse_params(const std::string &args, ImpairParams *params)
+{
+    size_t pos = 0;
+    while(pos < args.size()) {
+        size_t end = args.find_first_of(" \t,", pos);
+        if(end == std::string::npos) {
+            end = args.size();
+        }
+        std::string item = args.substr(pos, end - pos);
+        pos = end + 1;
+        if(item.empty()) {
+            continue;
+        }
+        size_t eq = item.find('=');
+        if(eq == std::string::npos) {
+            return -1;
+        }
+        std::string key = item.substr(0, eq);
+        double value = atof(item.c_str() + eq + 1);
+        if(key == "rate") {
+            params->rate = (int)value;
+        } else if(key == "delay") {
+            params->delay = (int)value;
+        } else if(key == "jitter") {
+            params->jitter = (int)value;
+        } else if(key == "loss") {
+            params->loss = value;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 读取脚本，按时间排序。
+ * @return 0 成功; -1 打开失败或者有不认识的动作。
+ */
+static int load_script(const char *name, std::vector<ScriptEvent> *events)
+{
+    FILE *fp = fopen(name, "r");
+    if(!fp) {
+        fprintf(stderr, "open script %s failed\n", name);
+        return -1;
+    }
+    char line[512];
+    int line_no = 0;
+    while(fgets(line, sizeof(line), fp)) {
+        line_no++;
+        char *comment = strchr(line, '#');
+        if(comment) {
+            *comment = '\0';
+        }
+        char action[32] = {0};
+        double time = 0;
+        int consumed = 0;
+        if(sscanf(line, "%lf %31s %n", &time, action, &consumed) < 2) {
+            continue;                                   // 空行
+        }
+        ScriptEvent event;
+        event.time = time;
+        event.action = action;
+        event.args = line + consumed;
+        while(!event.args.empty() && strchr(" \t\r\n", event.args[event.args.size() - 1])) {
+            event.args.erase(event.args.size() - 1);
+        }
+        ImpairParams check = s_params;
+        if((event.action == "set" && parse_params(event.args, &check) < 0)
+                || (event.action != "set" && event.action != "blackout" && event.action != "reset"
+                    && event.action != "end")) {
+            fprintf(stderr, "%s:%d: invalid event: %s", name, line_no, line);
+            fclose(fp);
+            return -1;
+        }
+        events->push_back(event);
+    }
+    fclose(fp);
+    std::stable_sort(events->begin(), events->end(),
+                     [](const ScriptEvent &a, const ScriptEvent &b) { return a.time < b.time; });
+    return 0;
+}
+
+static void close_fd(int fd, bool reset)
+{
+    if(fd < 0) {
+        return;
+    }
+    if(reset) {
+        struct linger lg;
+        lg.l_onoff = 1;
+        lg.l_linger = 0;                                // close时发送RST
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    close(fd);
+}
+
+static void destroy_session(Session *session, bool reset)
+{
+    close_fd(session->client_fd, reset);
+    close_fd(session->upstream_fd, reset);
+    for(size_t i = 0; i < session->relays.size(); i++) {
+        close(session->relays[i].fd);
+    }
+    printf("session %d closed%s, backlog %lldB\n", session->id, reset ? " by reset" : "",
+           (long long)(session->up.queued_bytes + session->udp_queued_bytes));
+    delete session;
+}
+
+static void set_nonblock(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static Session *create_session(int client_fd)
+{
+    int upstream_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(upstream_fd < 0 || connect(upstream_fd, (struct sockaddr *)&s_upstream_addr, sizeof(s_upstream_addr)) < 0) {
+        fprintf(stderr, "connect receiver failed: %s\n", strerror(errno));
+        close_fd(upstream_fd, false);
+        close(client_fd);
+        return NULL;
+    }
+    int on = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(upstream_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    set_nonblock(client_fd);
+    set_nonblock(upstream_fd);
+
+    Session *session = new Session();
+    session->id = (int)++s_sessions;
+    session->client_fd = client_fd;
+    session->upstream_fd = upstream_fd;
+    session->up.queued_bytes = session->down.queued_bytes = 0;
+    session->up.offset = session->down.offset = 0;
+    session->up.last_release = session->down.last_release = 0;
+    session->up.upstream = true;
+    session->down.upstream = false;
+    session->udp_queued_bytes = 0;
+    for(int i = 0; i < MAX_TRACKS; i++) {
+        session->clock_rate[i] = 90000;
+        session->tracks[i].last_seq = -1;
+        session->tracks[i].has_frame = false;
+        session->tracks[i].frame_delta = 0;
+    }
+    for(int i = 0; i < 256; i++) {
+        session->channel_track[i] = i / 2 < MAX_TRACKS ? i / 2 : -1;
+    }
+    session->setup_track = -1;
+    printf("session %d accepted\n", session->id);
+    return session;
+}
+
+// 推流端的ANNOUNCE，按m=的顺序记录每个轨道的媒体类型与时钟
+static void parse_sdp(Session *session, const std::string &msg)
+{
+    size_t body = msg.find("\r\n\r\n");
+    int track = -1;
+    size_t pos = body == std::string::npos ? msg.size() : body + 4;
+    while(pos < msg.size()) {
+        size_t end = msg.find('\n', pos);
+        if(end == std::string::npos) {
+            end = msg.size();
+        }
+        std::string line = msg.substr(pos, end - pos);
+        pos = end + 1;
+        if(0 == line.compare(0, 2, "m=") && track + 1 < MAX_TRACKS) {
+            track++;
+            session->media[track] = line.substr(2, line.find(' ') - 2);
+        } else if(track >= 0 && 0 == line.compare(0, 9, "a=rtpmap:")) {
+            size_t slash = line.find('/');
+            if(slash != std::string::npos && atoi(line.c_str() + slash + 1) > 0) {
+                session->clock_rate[track] = atoi(line.c_str() + slash + 1);
+            }
+        }
+    }
+}
+
+// 推流端的SETUP，记录轨道与interleaved的channel
+static void parse_setup(Session *session, const std::string &msg)
+{
+    int track = 0;
+    size_t pos = msg.find("streamid=");
+    if(pos != std::string::npos && pos < msg.find("\r\n")) {
+        track = atoi(msg.c_str() + pos + 9);
+    }
+    if(track < 0 || track >= MAX_TRACKS) {
+        track = 0;
+    }
+    session->setup_track = track;
+    std::string transport = get_header(msg, "Transport");
+    pos = transport.find("interleaved=");
+    if(pos != std::string::npos) {
+        int rtp = 0, rtcp = 0;
+        if(sscanf(transport.c_str() + pos + 12, "%d-%d", &rtp, &rtcp) == 2 && rtp >= 0 && rtp < 256
+                && rtcp >= 0 && rtcp < 256) {
+            session->channel_track[rtp] = track;
+            session->channel_track[rtcp] = track;
+        }
+    }
+}
+
+static int bind_udp()
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = 0;
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    set_nonblock(fd);
+    return fd;
+}
+
+static int local_port(int fd)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * @brief 接收端对udp SETUP的回复，为rtp、rtcp各开一个转发socket，把server_port改成转发socket的端口。
+ * @return 改写后的回复，不是udp的SETUP回复时原样返回。
+ */
+static std::string rewrite_setup_reply(Session *session, const std::string &msg)
+{
+    std::string transport = get_header(msg, "Transport");
+    size_t pos = transport.find("server_port=");
+    int rtp_port = 0, rtcp_port = 0;
+    if(session->setup_track < 0 || pos == std::string::npos
+            || sscanf(transport.c_str() + pos + 12, "%d-%d", &rtp_port, &rtcp_port) != 2) {
+        return msg;
+    }
+    int ports[2] = {rtp_port, rtcp_port};
+    int local[2] = {0, 0};
+    for(int i = 0; i < 2; i++) {
+        UdpRelay relay;
+        relay.fd = bind_udp();
+        if(relay.fd < 0) {
+            fprintf(stderr, "bind udp failed\n");
+            return msg;
+        }
+        relay.track = session->setup_track;
+        relay.rtcp = 1 == i;
+        relay.upstream = s_upstream_addr;
+        relay.upstream.sin_port = htons(ports[i]);
+        local[i] = local_port(relay.fd);
+        session->relays.push_back(relay);
+    }
+    char old_ports[64], new_ports[64];
+    snprintf(old_ports, sizeof(old_ports), "server_port=%d-%d", rtp_port, rtcp_port);
+    snprintf(new_ports, sizeof(new_ports), "server_port=%d-%d", local[0], local[1]);
+    std::string out = msg;
+    pos = out.find(old_ports);
+    if(pos != std::string::npos) {
+        out.replace(pos, strlen(old_ports), new_ports);
+    }
+    printf("session %d track %d udp relay %d-%d -> %d-%d\n", session->id, session->setup_track, local[0], local[1],
+           rtp_port, rtcp_port);
+    session->setup_track = -1;
+    return out;
+}
+
+// 发送时间：delay±jitter，tcp再加上丢包的重传等待，并且不早于前一个单元
+static int64_t release_time(int64_t now, bool upstream, bool ordered)
+{
+    int64_t delay = (int64_t)s_params.delay * 1000;
+    if(s_params.jitter > 0) {
+        delay += (int64_t)((random01() * 2 - 1) * s_params.jitter * 1000);
+    }
+    if(ordered && upstream && s_params.loss > 0 && random01() * 100 < s_params.loss) {
+        delay += s_loss_rto;
+        s_retransmits++;
+    }
+    return now + (delay > 0 ? delay : 0);
+}
+
+/**
+ * @brief 从tcp数据中切出完整的单元放进队列。
+ */
+static void ingest_tcp(Session *session, Direction *dir, int64_t now)
+{
+    std::string &buf = dir->pending;
+    while(!buf.empty()) {
+        Unit unit;
+        unit.track = -1;
+        unit.rtcp = false;
+        unit.relay = -1;
+        size_t total = 0;
+        if(buf[0] == '$') {
+            // '$' + channel(1字节) + 长度(2字节) + 数据，偶数channel是rtp，奇数是rtcp
+            if(buf.size() < 4) {
+                break;
+            }
+            total = 4 + (((uint8_t)buf[2] << 8) | (uint8_t)buf[3]);
+            if(buf.size() < total) {
+                break;
+            }
+            int channel = (uint8_t)buf[1];
+            unit.track = session->channel_track[channel];
+            unit.rtcp = channel & 1;
+        } else {
+            size_t end = buf.find("\r\n\r\n");
+            if(end == std::string::npos) {
+                if(buf.size() < MAX_RTSP_MESSAGE) {
+                    break;
+                }
+                total = buf.size();                     // 不是rtsp，原样转发
+            } else {
+                total = end + 4 + atoi(get_header(buf.substr(0, end + 2), "Content-Length").c_str());
+                if(buf.size() < total) {
+                    break;
+                }
+            }
+        }
+        unit.data = buf.substr(0, total);
+        buf.erase(0, total);
+        if(unit.track < 0 && dir->upstream) {
+            if(0 == unit.data.compare(0, 9, "ANNOUNCE ")) {
+                parse_sdp(session, unit.data);
+            } else if(0 == unit.data.compare(0, 6, "SETUP ")) {
+                parse_setup(session, unit.data);
+            }
+        } else if(unit.track < 0) {
+            unit.data = rewrite_setup_reply(session, unit.data);
+        }
+        unit.ingress = now;
+        unit.release = std::max(release_time(now, dir->upstream, true), dir->last_release);
+        dir->last_release = unit.release;
+        dir->queued_bytes += unit.data.size();
+        dir->queue.push_back(unit);
+    }
+}
+
+static void ingest_udp(Session *session, int relay_index, const uint8_t *data, int size, int64_t now)
+{
+    const UdpRelay &relay = session->relays[relay_index];
+    if(now < s_blackout_end || (s_params.loss > 0 && random01() * 100 < s_params.loss)
+            || session->udp_queued_bytes + size > s_max_queue) {
+        s_udp_dropped++;
+        s_second.udp_dropped++;
+        return;
+    }
+    Unit unit;
+    unit.data.assign((const char *)data, size);
+    unit.ingress = now;
+    unit.release = release_time(now, true, false);
+    unit.track = relay.track;
+    unit.rtcp = relay.rtcp;
+    unit.relay = relay_index;
+    session->udp_queued_bytes += size;
+    session->udp_queue.insert(std::make_pair(unit.release, unit));
+}
+
+// 上行的令牌，不限速时返回-1
+static double refill_tokens(int64_t now)
+{
+    if(s_params.rate <= 0) {
+        return -1;
+    }
+    double bytes_per_us = s_params.rate * 1000.0 / 8 / 1000000;
+    double burst = std::max(bytes_per_us * 20000, 4096.0);     // 最多攒20ms的突发
+    s_tokens = std::min(burst, s_tokens + (now - s_tokens_time) * bytes_per_us);
+    s_tokens_time = now;
+    return s_tokens;
+}
+
+/**
+ * @brief 接收端收到了一个单元，更新统计。
+ */
+static void record_egress(Session *session, const Unit &unit, int64_t now)
+{
+    if(unit.track < 0 || unit.track >= MAX_TRACKS || unit.rtcp || unit.data.size() < 12) {
+        return;
+    }
+    const uint8_t *rtp = (const uint8_t *)unit.data.data() + (unit.relay < 0 ? 4 : 0);
+    int size = (int)unit.data.size() - (unit.relay < 0 ? 4 : 0);
+    if(size < 12) {
+        return;
+    }
+    int64_t transit = (now - unit.ingress) / 1000;
+    s_transit[std::min<int64_t>(transit, TRANSIT_BUCKETS - 1)]++;
+    s_second.transit_max = std::max(s_second.transit_max, transit);
+
+    int seq = (rtp[2] << 8) | rtp[3];
+    uint32_t ts = ((uint32_t)rtp[4] << 24) | (rtp[5] << 16) | (rtp[6] << 8) | rtp[7];
+    TrackStats *st = &s_tracks[unit.track];
+    TrackState *state = &session->tracks[unit.track];
+    if(!session->media[unit.track].empty()) {
+        st->media = session->media[unit.track];
+    }
+    bool video = st->media == "video";
+    st->packets++;
+    st->bytes += size;
+    if(state->last_seq >= 0) {
+        int diff = (seq - state->last_seq) & 0xffff;
+        if(diff > 0 && diff < 0x8000) {
+            st->lost += diff - 1;
+            s_second.lost += diff - 1;
+            state->last_seq = seq;
+        } else if(diff >= 0x8000) {
+            st->reordered++;                           // 之前按丢包算了
+            if(st->lost > 0) {
+                st->lost--;
+            }
+        }
+    } else {
+        state->last_seq = seq;
+    }
+
+    // 时间戳变了就是新的一帧
+    if(state->has_frame && (int32_t)(ts - state->last_ts) <= 0) {
+        return;
+    }
+    int64_t clock = session->clock_rate[unit.track];
+    if(!state->has_frame) {
+        state->has_frame = true;
+        state->unwrapped_ts = 0;
+        state->first_time = now;
+        state->last_frame_time = now;
+        state->min_lag = 0;
+    } else {
+        int64_t delta = (int32_t)(ts - state->last_ts);
+        state->unwrapped_ts += delta;
+        if(0 == state->frame_delta) {
+            state->deltas.push_back(delta);
+            if(state->deltas.size() >= 25) {
+                std::sort(state->deltas.begin(), state->deltas.end());
+                state->frame_delta = state->deltas[state->deltas.size() / 2];
+            }
+        } else if(delta * 2 > state->frame_delta * 3) {
+            st->missing_frames += (delta + state->frame_delta / 2) / state->frame_delta - 1;
+        }
+        int64_t gap = now - state->last_frame_time;
+        st->max_gap = std::max(st->max_gap, gap);
+        if(gap > s_stall) {
+            st->stalls++;
+        }
+        state->last_frame_time = now;
+    }
+    state->last_ts = ts;
+    st->frames++;
+    (video ? s_second.video_frames : s_second.audio_frames)++;
+
+    int64_t lag = (now - state->first_time) - state->unwrapped_ts * 1000000 / clock;
+    state->min_lag = std::min(state->min_lag, lag);
+    st->lag = lag - state->min_lag;
+    st->max_lag = std::max(st->max_lag, st->lag);
+    if(video && st->lag <= s_recover_lag) {
+        for(size_t i = 0; i < s_recoveries.size(); i++) {
+            if(s_recoveries[i].recovered < 0 && now >= s_recoveries[i].end) {
+                s_recoveries[i].recovered = now - s_recoveries[i].end;
+                printf("%s at %.1fs recovered in %lldms\n", s_recoveries[i].action.c_str(), s_recoveries[i].time,
+                       (long long)s_recoveries[i].recovered / 1000);
+            }
+        }
+    }
+}
+
+/**
+ * @brief 把到了发送时间的单元发给对端，上行受令牌桶限制。
+ * @return 0 正常; -1 连接断开。
+ */
+static int flush_tcp(Session *session, Direction *dir, int fd, int64_t now)
+{
+    while(!dir->queue.empty() && now >= s_blackout_end) {
+        Unit &unit = dir->queue.front();
+        if(unit.release > now) {
+            break;
+        }
+        size_t len = unit.data.size() - dir->offset;
+        if(dir->upstream) {
+            double tokens = refill_tokens(now);
+            if(tokens >= 0 && tokens < 1) {
+                break;
+            }
+            if(tokens >= 0) {
+                len = std::min(len, (size_t)tokens);
+            }
+        }
+        ssize_t n = send(fd, unit.data.data() + dir->offset, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(n < 0) {
+            return (EAGAIN == errno || EWOULDBLOCK == errno) ? 0 : -1;
+        }
+        if(dir->upstream) {
+            if(s_params.rate > 0) {
+                s_tokens -= n;
+            }
+            s_second.out_bytes += n;
+        }
+        dir->offset += n;
+        if(dir->offset < unit.data.size()) {
+            continue;
+        }
+        if(dir->upstream) {
+            record_egress(session, unit, now);
+        }
+        dir->queued_bytes -= unit.data.size();
+        dir->offset = 0;
+        dir->queue.pop_front();
+    }
+    return 0;
+}
+
+static void flush_udp(Session *session, int64_t now)
+{
+    while(!session->udp_queue.empty()) {
+        std::multimap<int64_t, Unit>::iterator it = session->udp_queue.begin();
+        if(it->first > now) {
+            break;
+        }
+        const Unit &unit = it->second;
+        if(now < s_blackout_end) {
+            s_udp_dropped++;                            // 正在路上的包也丢掉
+            s_second.udp_dropped++;
+        } else {
+            double tokens = refill_tokens(now);
+            if(tokens >= 0 && tokens < unit.data.size()) {
+                break;
+            }
+            const UdpRelay &relay = session->relays[unit.relay];
+            if(sendto(relay.fd, unit.data.data(), unit.data.size(), 0, (const struct sockaddr *)&relay.upstream,
+                      sizeof(relay.upstream)) > 0) {
+                if(tokens >= 0) {
+                    s_tokens -= unit.data.size();
+                }
+                s_second.out_bytes += unit.data.size();
+                record_egress(session, unit, now);
+            }
+        }
+        session->udp_queued_bytes -= unit.data.size();
+        session->udp_queue.erase(it);
+    }
+}
+
+// 下一次需要处理队列的时间，没有时返回-1
+static int64_t next_release(const std::vector<Session *> &sessions, int64_t now)
+{
+    int64_t next = -1;
+    for(size_t i = 0; i < sessions.size(); i++) {
+        const Session *session = sessions[i];
+        int64_t candidates[3] = {-1, -1, -1};
+        if(!session->up.queue.empty()) {
+            candidates[0] = session->up.queue.front().release;
+        }
+        if(!session->down.queue.empty()) {
+            candidates[1] = session->down.queue.front().release;
+        }
+        if(!session->udp_queue.empty()) {
+            candidates[2] = session->udp_queue.begin()->first;
+        }
+        for(int k = 0; k < 3; k++) {
+            if(candidates[k] < 0) {
+                continue;
+            }
+            int64_t t = std::max(candidates[k], now < s_blackout_end ? s_blackout_end : 0);
+            if(k != 1 && s_params.rate > 0 && t <= now) {
+                t = now + 1000;                         // 在等令牌
+            }
+            next = next < 0 ? t : std::min(next, t);
+        }
+    }
+    return next;
+}
+
+static void run_event(const ScriptEvent &event, std::vector<Session *> *sessions, int64_t now)
+{
+    printf("%.1fs: %s%s%s\n", event.time, event.action.c_str(), event.args.empty() ? "" : " ", event.args.c_str());
+    if(event.action == "set") {
+        parse_params(event.args, &s_params);
+    } else if(event.action == "blackout") {
+        s_blackout_end = now + (int64_t)(atof(event.args.c_str()) * 1000000);
+        Recovery recovery = {"blackout", event.time, s_blackout_end, -1};
+        s_recoveries.push_back(recovery);
+    } else if(event.action == "reset") {
+        for(size_t i = 0; i < sessions->size(); i++) {
+            destroy_session((*sessions)[i], true);
+        }
+        sessions->clear();
+        Recovery recovery = {"reset", event.time, now, -1};
+        s_recoveries.push_back(recovery);
+    } else if(event.action == "end") {
+        s_quit = 1;
+    }
+}
+
+static int64_t transit_percentile(double percentile)
+{
+    int64_t total = 0;
+    for(int i = 0; i < TRANSIT_BUCKETS; i++) {
+        total += s_transit[i];
+    }
+    int64_t target = (int64_t)(total * percentile / 100 + 0.5);
+    int64_t sum = 0;
+    for(int i = 0; i < TRANSIT_BUCKETS; i++) {
+        sum += s_transit[i];
+        if(sum >= target && sum > 0) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 打印汇总并按判定条件检查。
+ * @return 0 全部满足; 1 有不满足的条件。
+ */
+static int print_summary(const std::string &expectations)
+{
+    printf("track  media  packets  bytes      lost   reorder  frames  missing  max_gap(ms)  stalls  max_lag(ms)\n");
+    int64_t packets = 0, lost = 0, video_frames = 0, video_missing = 0, stalls = 0, max_lag = 0;
+    for(int i = 0; i < MAX_TRACKS; i++) {
+        TrackStats *st = &s_tracks[i];
+        if(0 == st->packets) {
+            continue;
+        }
+        printf("%-6d %-6s %-8lld %-10lld %-6lld %-8lld %-7lld %-8lld %-12lld %-7lld %lld\n", i, st->media.c_str(),
+               (long long)st->packets, (long long)st->bytes, (long long)st->lost, (long long)st->reordered,
+               (long long)st->frames, (long long)st->missing_frames, (long long)st->max_gap / 1000,
+               (long long)st->stalls, (long long)st->max_lag / 1000);
+        packets += st->packets;
+        lost += st->lost;
+        if(st->media == "video") {
+            video_frames += st->frames;
+            video_missing += st->missing_frames;
+            stalls += st->stalls;
+            max_lag = std::max(max_lag, st->max_lag);
+        }
+    }
+    int64_t max_recovery = 0;
+    for(size_t i = 0; i < s_recoveries.size(); i++) {
+        if(s_recoveries[i].recovered < 0) {
+            printf("%s at %.1fs: not recovered\n", s_recoveries[i].action.c_str(), s_recoveries[i].time);
+            max_recovery = INT64_MAX;
+        } else {
+            max_recovery = std::max(max_recovery, s_recoveries[i].recovered);
+        }
+    }
+    double drop_rate = video_frames + video_missing > 0 ? video_missing * 100.0 / (video_frames + video_missing) : 0;
+    double loss_rate = packets + lost > 0 ? lost * 100.0 / (packets + lost) : 0;
+    std::map<std::string, double> values;
+    values["drop_rate"] = drop_rate;
+    values["loss_rate"] = loss_rate;
+    values["recovery_ms"] = INT64_MAX == max_recovery ? 1e18 : max_recovery / 1000.0;
+    values["lag_ms"] = max_lag / 1000.0;
+    values["transit_p95_ms"] = (double)transit_percentile(95);
+    values["stalls"] = (double)stalls;
+    values["reconnects"] = (double)std::max<int64_t>(s_sessions - 1, 0);
+    values["frames"] = (double)video_frames;
+    printf("sessions-%lld, video drop_rate-%.2f%%, rtp loss_rate-%.2f%%, udp dropped-%lld, tcp retransmits-%lld\n",
+           (long long)s_sessions, drop_rate, loss_rate, (long long)s_udp_dropped, (long long)s_retransmits);
+    printf("transit p50-%lldms, p95-%lldms, p99-%lldms, max recovery-%s\n", (long long)transit_percentile(50),
+           (long long)transit_percentile(95), (long long)transit_percentile(99),
+           s_recoveries.empty() ? "none" : (INT64_MAX == max_recovery ? "never" :
+                                            (std::to_string(max_recovery / 1000) + "ms").c_str()));
+
+    // 判定条件：key<=value或者key>=value，逗号分隔
+    int failed = 0;
+    size_t pos = 0;
+    while(pos < expectations.size()) {
+        size_t end = expectations.find(',', pos);
+        if(end == std::string::npos) {
+            end = expectations.size();
+        }
+        std::string item = expectations.substr(pos, end - pos);
+        pos = end + 1;
+        size_t op = item.find_first_of("<>");
+        if(op == std::string::npos || op + 1 >= item.size() || item[op + 1] != '=') {
+            continue;                                   // main中已经检查过
+        }
+        std::string key = item.substr(0, op);
+        double limit = atof(item.c_str() + op + 2);
+        double value = values[key];
+        bool ok = '<' == item[op] ? value <= limit : value >= limit;
+        if(key == "recovery_ms" && INT64_MAX == max_recovery) {
+            printf("%s %s (actual never)\n", ok ? "PASS" : "FAIL", item.c_str());
+        } else {
+            printf("%s %s (actual %.2f)\n", ok ? "PASS" : "FAIL", item.c_str(), value);
+        }
+        failed |= !ok;
+    }
+    return failed;
+}
+
+// 检查判定条件的格式与项目
+static int check_expectations(const std::string &expectations)
+{
+    static const char *keys[] = {"drop_rate", "loss_rate", "recovery_ms", "lag_ms", "transit_p95_ms", "stalls",
+                                 "reconnects", "frames"};
+    size_t pos = 0;
+    while(pos < expectations.size()) {
+        size_t end = expectations.find(',', pos);
+        if(end == std::string::npos) {
+            end = expectations.size();
+        }
+        std::string item = expectations.substr(pos, end - pos);
+        pos = end + 1;
+        size_t op = item.find_first_of("<>");
+        if(op == std::string::npos || op + 1 >= item.size() || item[op + 1] != '=') {
+            fprintf(stderr, "invalid expectation: %s\n", item.c_str());
+            return -1;
+        }
+        std::string key = item.substr(0, op);
+        bool known = false;
+        for(size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+            known |= key == keys[i];
+        }
+        if(!known) {
+            fprintf(stderr, "unknown expectation key: %s\n", key.c_str());
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int port = 8555;
+    std::string upstream = "127.0.0.1:8554";
+    const char *script_name = NULL;
+    const char *out_name = NULL;
+    int run_seconds = 0;
+    std::string expectations;
+    int opt;
+    while((opt = getopt(argc, argv, "l:r:s:o:t:q:b:d:j:L:R:c:g:S:e:")) != -1) {
+        switch (opt) {
+        case 'l': port = atoi(optarg); break;
+        case 'r': upstream = optarg; break;
+        case 's': script_name = optarg; break;
+        case 'o': out_name = optarg; break;
+        case 't': run_seconds = atoi(optarg); break;
+        case 'q': s_max_queue = (int64_t)atoi(optarg) * 1024; break;
+        case 'b': s_params.rate = atoi(optarg); break;
+        case 'd': s_params.delay = atoi(optarg); break;
+        case 'j': s_params.jitter = atoi(optarg); break;
+        case 'L': s_params.loss = atof(optarg); break;
+        case 'R': s_loss_rto = (int64_t)atoi(optarg) * 1000; break;
+        case 'c': s_recover_lag = (int64_t)atoi(optarg) * 1000; break;
+        case 'g': s_stall = (int64_t)atoi(optarg) * 1000; break;
+        case 'S': s_seed = (uint32_t)atoi(optarg) | 1; break;
+        case 'e': expectations = optarg; break;
+        default:
+            printf("usage: %s [-l listen_port] [-r receiver_ip:port] [-s script] [-o stats.csv] [-t seconds]\n"
+                   "       [-q max_queue_kb] [-b rate_kbps] [-d delay_ms] [-j jitter_ms] [-L loss_percent]\n"
+                   "       [-R tcp_rto_ms] [-c recover_lag_ms] [-g stall_ms] [-S seed] [-e expectations]\n", argv[0]);
+            return -1;
+        }
+    }
+    size_t colon = upstream.find(':');
+    memset(&s_upstream_addr, 0, sizeof(s_upstream_addr));
+    s_upstream_addr.sin_family = AF_INET;
+    s_upstream_addr.sin_port = htons(colon == std::string::npos ? 8554 : atoi(upstream.c_str() + colon + 1));
+    if(inet_pton(AF_INET, upstream.substr(0, colon).c_str(), &s_upstream_addr.sin_addr) != 1) {
+        fprintf(stderr, "invalid receiver address: %s\n", upstream.c_str());
+        return -1;
+    }
+    std::vector<ScriptEvent> events;
+    if(script_name && load_script(script_name, &events) < 0) {
+        return -1;
+    }
+    if(check_expectations(expectations) < 0) {
+        return -1;
+    }
+    for(int i = 0; i < MAX_TRACKS; i++) {
+        s_tracks[i].packets = s_tracks[i].bytes = s_tracks[i].lost = s_tracks[i].reordered = 0;
+        s_tracks[i].frames = s_tracks[i].missing_frames = s_tracks[i].max_gap = s_tracks[i].stalls = 0;
+        s_tracks[i].max_lag = s_tracks[i].lag = 0;
+    }
+    memset(&s_second, 0, sizeof(s_second));
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    FILE *out_fp = NULL;
+    if(out_name) {
+        out_fp = fopen(out_name, "w");
+        if(!out_fp) {
+            fprintf(stderr, "open %s failed\n", out_name);
+            return -1;
+        }
+        fprintf(out_fp, "time_s,in_kbps,out_kbps,backlog_kb,video_frames,audio_frames,lost,udp_dropped,lag_ms,"
+                        "transit_max_ms,sessions,blackout\n");
+    }
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 8) < 0) {
+        fprintf(stderr, "listen on %d failed: %s\n", port, strerror(errno));
+        return -1;
+    }
+    printf("netimpair listen on %d, forward to %s\n", port, upstream.c_str());
+
+    std::vector<Session *> sessions;
+    size_t next_event = 0;
+    int64_t start_time = now_us();
+    int64_t second_start = start_time;
+    s_tokens_time = start_time;
+    while(!s_quit) {
+        int64_t now = now_us();
+        if(run_seconds > 0 && now - start_time > (int64_t)run_seconds * 1000000) {
+            break;
+        }
+        while(next_event < events.size() && now - start_time >= (int64_t)(events[next_event].time * 1000000)) {
+            run_event(events[next_event++], &sessions, now);
+        }
+
+        // 1 发出到时间的数据
+        for(int i = (int)sessions.size() - 1; i >= 0; i--) {
+            Session *session = sessions[i];
+            if(flush_tcp(session, &session->up, session->upstream_fd, now) < 0
+                    || flush_tcp(session, &session->down, session->client_fd, now) < 0) {
+                destroy_session(session, false);
+                sessions.erase(sessions.begin() + i);
+                continue;
+            }
+            flush_udp(session, now);
+        }
+
+        // 2 每秒一行统计
+        if(now - second_start >= 1000000) {
+            double seconds = (now - second_start) / 1000000.0;
+            int64_t backlog = 0;
+            for(size_t i = 0; i < sessions.size(); i++) {
+                backlog += sessions[i]->up.queued_bytes + sessions[i]->udp_queued_bytes;
+            }
+            int64_t lag = 0;
+            for(int i = 0; i < MAX_TRACKS; i++) {
+                if(s_tracks[i].media == "video") {
+                    lag = std::max(lag, s_tracks[i].lag);
+                }
+            }
+            if(out_fp) {
+                fprintf(out_fp, "%.1f,%.1f,%.1f,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%d,%d\n",
+                        (now - start_time) / 1000000.0, s_second.in_bytes * 8 / 1000.0 / seconds,
+                        s_second.out_bytes * 8 / 1000.0 / seconds, (long long)backlog / 1024,
+                        (long long)s_second.video_frames, (long long)s_second.audio_frames, (long long)s_second.lost,
+                        (long long)s_second.udp_dropped, (long long)lag / 1000, (long long)s_second.transit_max,
+                        (int)sessions.size(), now < s_blackout_end);
+                fflush(out_fp);
+            }
+            memset(&s_second, 0, sizeof(s_second));
+            second_start = now;
+        }
+
+        // 3 等待数据或者下一个发送时间
+        std::vector<struct pollfd> fds;
+        std::vector<std::pair<int, int> > owners;       // <会话索引, -1推流端 -2接收端 >=0转发socket>
+        struct pollfd pfd;
+        pfd.fd = listen_fd;
+        pfd.events = POLLIN;
+        fds.push_back(pfd);
+        owners.push_back(std::make_pair(-1, 0));
+        for(size_t i = 0; i < sessions.size(); i++) {
+            Session *session = sessions[i];
+            pfd.fd = session->client_fd;
+            pfd.events = session->up.queued_bytes < s_max_queue ? POLLIN : 0;     // 积压太多时不读，推流端被阻塞
+            if(!session->down.queue.empty() && session->down.queue.front().release <= now && now >= s_blackout_end) {
+                pfd.events |= POLLOUT;
+            }
+            fds.push_back(pfd);
+            owners.push_back(std::make_pair((int)i, -1));
+            pfd.fd = session->upstream_fd;
+            pfd.events = POLLIN;
+            if(!session->up.queue.empty() && session->up.queue.front().release <= now && now >= s_blackout_end
+                    && s_params.rate <= 0) {
+                pfd.events |= POLLOUT;
+            }
+            fds.push_back(pfd);
+            owners.push_back(std::make_pair((int)i, -2));
+            for(size_t k = 0; k < session->relays.size(); k++) {
+                pfd.fd = session->relays[k].fd;
+                pfd.events = POLLIN;
+                fds.push_back(pfd);
+                owners.push_back(std::make_pair((int)i, (int)k));
+            }
+        }
+        int timeout = 100;
+        int64_t next = next_release(sessions, now);
+        if(next >= 0) {
+            timeout = (int)std::min<int64_t>(timeout, std::max<int64_t>((next - now + 999) / 1000, 1));
+        }
+        if(poll(&fds[0], fds.size(), timeout) <= 0) {
+            continue;
+        }
+        now = now_us();
+        std::vector<int> closed;
+        for(size_t k = 0; k < fds.size(); k++) {
+            if(!(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            if(0 == k) {
+                int client_fd = accept(listen_fd, NULL, NULL);
+                Session *session = client_fd >= 0 ? create_session(client_fd) : NULL;
+                if(session) {
+                    sessions.push_back(session);
+                }
+                continue;
+            }
+            Session *session = sessions[owners[k].first];
+            uint8_t buf[65536];
+            if(owners[k].second >= 0) {
+                int n = recv(fds[k].fd, buf, sizeof(buf), 0);
+                if(n > 0) {
+                    s_second.in_bytes += n;
+                    ingest_udp(session, owners[k].second, buf, n, now);
+                }
+                continue;
+            }
+            bool from_client = -1 == owners[k].second;
+            int n = recv(fds[k].fd, buf, sizeof(buf), 0);
+            if(0 == n || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                closed.push_back(owners[k].first);
+                continue;
+            }
+            if(n < 0) {
+                continue;
+            }
+            Direction *dir = from_client ? &session->up : &session->down;
+            if(from_client) {
+                s_second.in_bytes += n;
+            }
+            dir->pending.append((const char *)buf, n);
+            ingest_tcp(session, dir, now);
+        }
+        // 从后往前删除，防止索引错乱
+        std::sort(closed.begin(), closed.end());
+        closed.erase(std::unique(closed.begin(), closed.end()), closed.end());
+        for(int i = (int)closed.size() - 1; i >= 0; i--) {
+            destroy_session(sessions[closed[i]], false);
+            sessions.erase(sessions.begin() + closed[i]);
+        }
+    }
+
+    for(size_t i = 0; i < sessions.size(); i++) {
+        destroy_session(sessions[i], false);
+    }
+    close(listen_fd);
+    if(out_fp) {
+        fclose(out_fp);
+    }
+    return print_summary(expectations);
+}
@@ -0,0 +1,237 @@
+﻿/**
+ * 对比已经编码的输入(mp4/ts文件或者rtsp流)的两种推流方式的cpu占用：
+ * 1）passthrough：DemuxSource直接转推，只解封装与过滤比特流，即PushWork的passthrough_url；
+ * 2）reencode：同样的输入解码成yuv/pcm后再用H264Encoder/AACEncoder编码，相当于原来只能输入原始数据时，
+ *    先用另一个进程解码再交给PushWork采集编码(解码的开销也算在内，编码参数与输入相同：分辨率、帧率，码率取输入的码率)。
+ * 两种方式都同时运行streams路，按输入的时间戳实时输出，统计整个进程的cpu时间，cpu占用100%表示一个核。
+ * 输出的包直接丢弃，不测网络发送，两种方式的发送开销是一样的。
+ *
+ * 用法：passthroughbench 输入文件或者url [秒数] [路数]
+ * 例如：passthroughbench test_1280x720.mp4 20 4
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include "dlog.h"
+#include "timesutil.h"
+#include "demuxsource.h"
+#include "h264encoder.h"
+#include "aacencoder.h"
+extern "C" {
+#include "libavutil/imgutils.h"
+}
+
+// 一路转推，包直接丢弃
+class PassthroughStream
+{
+public:
+    int Init(const char *url) {
+        Properties properties;
+        properties.SetProperty("url", url);
+        properties.SetProperty("realtime", 1);          // 网络输入也按时间戳，两种方式的节奏相同
+        if(source_.Init(properties) != RET_OK) {
+            return -1;
+        }
+        std::atomic<int64_t> *packets = &packets_;
+        source_.AddCallback([packets](AVPacket *packet, MediaType) {
+            (*packets)++;
+            av_packet_free(&packet);
+        });
+        return 0;
+    }
+    void Start() {
+        source_.Start();
+    }
+    void Stop() {
+        source_.Stop();
+    }
+    int64_t GetPackets() {
+        return packets_;
+    }
+private:
+    DemuxSource source_;
+    std::atomic<int64_t> packets_{0};
+};
+
+// 一路解码后重新编码
+class ReencodeStream
+{
+public:
+    ~ReencodeStream() {
+        source_.Stop();
+        avcodec_free_context(&video_dec_);
+        avcodec_free_context(&audio_dec_);
+        av_frame_free(&frame_);
+    }
+    int Init(const char *url) {
+        Properties properties;
+        properties.SetProperty("url", url);
+        properties.SetProperty("realtime", 1);
+        if(source_.Init(properties) != RET_OK) {
+            return -1;
+        }
+        const AVCodecContext *video_ctx = source_.GetVideoCodecContext();
+        const AVCodecContext *audio_ctx = source_.GetAudioCodecContext();
+        if(video_ctx->pix_fmt != AV_PIX_FMT_YUV420P && video_ctx->pix_fmt != AV_PIX_FMT_YUVJ420P) {
+            printf("only yuv420p input is supported, pix_fmt: %d\n", video_ctx->pix_fmt);
+            return -1;
+        }
+        if(openDecoder(video_ctx, &video_dec_) != 0 || (audio_ctx && openDecoder(audio_ctx, &audio_dec_) != 0)) {
+            return -1;
+        }
+        Properties video_properties;
+        video_properties.SetProperty("width", video_ctx->width);
+        video_properties.SetProperty("height", video_ctx->height);
+        video_properties.SetProperty("fps", source_.GetFps());
+        video_properties.SetProperty("gop", source_.GetFps());
+        video_properties.SetProperty("bitrate", video_ctx->bit_rate > 0 ? (int)video_ctx->bit_rate : 1024 * 1024);
+        if(video_encoder_.Init(video_properties) != RET_OK) {
+            return -1;
+        }
+        if(audio_ctx) {
+            Properties audio_properties;
+            audio_properties.SetProperty("sample_rate", audio_ctx->sample_rate);
+            audio_properties.SetProperty("channels", audio_ctx->channels);
+            audio_properties.SetProperty("bitrate", audio_ctx->bit_rate > 0 ? (int)audio_ctx->bit_rate : 128 * 1024);
+            if(audio_encoder_.Init(audio_properties) != RET_OK) {
+                return -1;
+            }
+        }
+        yuv_.resize(av_image_get_buffer_size(AV_PIX_FMT_YUV420P, video_ctx->width, video_ctx->height, 1));
+        frame_ = av_frame_alloc();
+        source_.AddCallback(std::bind(&ReencodeStream::onPacket, this, std::placeholders::_1, std::placeholders::_2));
+        return 0;
+    }
+    void Start() {
+        source_.Start();
+    }
+    void Stop() {
+        source_.Stop();
+    }
+    int64_t GetPackets() {
+        return packets_;
+    }
+private:
+    static int openDecoder(const AVCodecContext *ctx, AVCodecContext **dec) {
+        AVCodec *codec = avcodec_find_decoder(ctx->codec_id);
+        AVCodecParameters *par = avcodec_parameters_alloc();
+        *dec = avcodec_alloc_context3(codec);
+        if(!codec || !par || !*dec || avcodec_parameters_from_context(par, ctx) < 0
+                || avcodec_parameters_to_context(*dec, par) < 0 || avcodec_open2(*dec, codec, NULL) < 0) {
+            printf("open %s decoder failed\n", avcodec_get_name(ctx->codec_id));
+            avcodec_parameters_free(&par);
+            return -1;
+        }
+        avcodec_parameters_free(&par);
+        return 0;
+    }
+    // 在DemuxSource的线程中调用
+    void onPacket(AVPacket *packet, MediaType media_type) {
+        AVCodecContext *dec = E_VIDEO_TYPE == media_type ? video_dec_ : audio_dec_;
+        if(avcodec_send_packet(dec, packet) == 0) {
+            while(avcodec_receive_frame(dec, frame_) == 0) {
+                int pkt_frame = 0;
+                RET_CODE ret = RET_OK;
+                AVPacket *out = NULL;
+                if(E_VIDEO_TYPE == media_type) {
+                    av_image_copy_to_buffer(&yuv_[0], (int)yuv_.size(), frame_->data, frame_->linesize,
+                                            AV_PIX_FMT_YUV420P, frame_->width, frame_->height, 1);
+                    out = video_encoder_.Encode(&yuv_[0], (int)yuv_.size(), frame_->pts, &pkt_frame, &ret);
+                } else if(frame_->nb_samples == audio_encoder_.GetFrameSamples()
+                          && frame_->format == audio_encoder_.GetFormat()) {
+                    out = audio_encoder_.Encode(frame_, frame_->pts, 0, &pkt_frame, &ret);
+                }
+                if(out) {
+                    packets_++;
+                    av_packet_free(&out);
+                }
+                av_frame_unref(frame_);
+            }
+        }
+        av_packet_free(&packet);
+    }
+
+    DemuxSource source_;
+    AVCodecContext *video_dec_ = NULL;
+    AVCodecContext *audio_dec_ = NULL;
+    AVFrame *frame_ = NULL;
+    std::vector<uint8_t> yuv_;
+    H264Encoder video_encoder_;
+    AACEncoder audio_encoder_;
+    std::atomic<int64_t> packets_{0};
+};
+
+/**
+ * @brief 同时运行streams路，返回整个进程的cpu占用百分比。
+ */
+template<typename T>
+static double run(const char *url, int seconds, int streams, int64_t *packets)
+{
+    std::vector<T *> workers;
+    for(int i = 0; i < streams; i++) {
+        T *worker = new T();
+        if(worker->Init(url) != 0) {
+            delete worker;
+            for(size_t j = 0; j < workers.size(); j++) {
+                delete workers[j];
+            }
+            return -1;
+        }
+        workers.push_back(worker);
+    }
+    int64_t cpu_begin = TimesUtil::GetProcessCpuMicrosecond();
+    int64_t wall_begin = TimesUtil::GetTimeMicrosecond();
+    for(size_t i = 0; i < workers.size(); i++) {
+        workers[i]->Start();
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    *packets = 0;
+    for(size_t i = 0; i < workers.size(); i++) {
+        workers[i]->Stop();
+        *packets += workers[i]->GetPackets();
+    }
+    double cpu = (TimesUtil::GetProcessCpuMicrosecond() - cpu_begin) * 100.0 / (TimesUtil::GetTimeMicrosecond() - wall_begin);
+    for(size_t i = 0; i < workers.size(); i++) {
+        delete workers[i];
+    }
+    return cpu;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 2) {
+        printf("usage: %s input [seconds] [streams]\n", argv[0]);
+        return -1;
+    }
+    const char *url = argv[1];
+    int seconds = argc > 2 ? atoi(argv[2]) : 20;
+    int streams = argc > 3 ? atoi(argv[3]) : 1;
+    if(seconds <= 0 || streams <= 0) {
+        printf("invalid seconds: %d or streams: %d\n", seconds, streams);
+        return -1;
+    }
+    init_logger("passthroughbench_log", S_INFO);
+    av_log_set_level(AV_LOG_ERROR);
+
+    int64_t passthrough_packets = 0;
+    int64_t reencode_packets = 0;
+    double passthrough_cpu = run<PassthroughStream>(url, seconds, streams, &passthrough_packets);
+    double reencode_cpu = run<ReencodeStream>(url, seconds, streams, &reencode_packets);
+    if(passthrough_cpu < 0 || reencode_cpu < 0) {
+        printf("open %s failed\n", url);
+        return -1;
+    }
+    printf("%s, %d streams, %d seconds\n", url, streams, seconds);
+    printf("passthrough: cpu %6.1f%%, %6.2f%% per stream, packets %lld\n", passthrough_cpu, passthrough_cpu / streams,
+           (long long)passthrough_packets);
+    printf("reencode:    cpu %6.1f%%, %6.2f%% per stream, packets %lld\n", reencode_cpu, reencode_cpu / streams,
+           (long long)reencode_packets);
+    if(passthrough_cpu > 0) {
+        printf("reencode / passthrough: %.1fx\n", reencode_cpu / passthrough_cpu);
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle
+CONFIG -= qt
+
+# 复用推流端的转推输入、编码器源码
+PUBLISH_DIR = $$PWD/../..
+INCLUDEPATH += $$PUBLISH_DIR
+
+win32 {
+INCLUDEPATH += $$PUBLISH_DIR/ffmpeg-4.2.1-win32-dev/include
+LIBS += $$PUBLISH_DIR/ffmpeg-4.2.1-win32-dev/lib/avformat.lib   \
+        $$PUBLISH_DIR/ffmpeg-4.2.1-win32-dev/lib/avcodec.lib    \
+        $$PUBLISH_DIR/ffmpeg-4.2.1-win32-dev/lib/avutil.lib
+}
+unix {
+LIBS += -lavformat -lavcodec -lavutil -lpthread
+}
+
+SOURCES += main.cpp \
+    $$PUBLISH_DIR/dlog.cpp \
+    $$PUBLISH_DIR/commonlooper.cpp \
+    $$PUBLISH_DIR/avpublishtime.cpp \
+    $$PUBLISH_DIR/nalparser.cpp \
+    $$PUBLISH_DIR/rtppacketizer.cpp \
+    $$PUBLISH_DIR/demuxsource.cpp \
+    $$PUBLISH_DIR/h264encoder.cpp \
+    $$PUBLISH_DIR/audioencoder.cpp \
+    $$PUBLISH_DIR/aacencoder.cpp
@@ -0,0 +1,360 @@
+﻿/**
+ * 内嵌rtsp服务器的压测工具，测量单核能带多少个拉流客户端。
+ * 进程内启动一个RtspServer，用合成的H264/AAC帧按设定的码率推送；再启动N个本地拉流客户端(TCP interleaved或UDP)，
+ * 客户端在一个epoll线程中只收数据不解码。结束时打印每个客户端的接收码率、服务器线程的cpu占用与估算的单核客户端数。
+ *
+ * 用法：rtspbench [-n 客户端数] [-b 视频码率kbps] [-f 帧率] [-g gop] [-t 运行秒数] [-p 端口] [-u]
+ *      -u 客户端使用UDP，默认TCP interleaved
+ *
+ * 注意：客户端与服务器在同一台机器上，客户端的cpu开销不计入服务器线程，cpu占用取自getrusage(RUSAGE_THREAD)。
+ * qmake CONFIG+=instrument编译时，每10秒把服务器的锁竞争与分配统计写到rtspbench.log，详看instrument.h。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include "rtspserver.h"
+#include "instrument.h"
+#include "dlog.h"
+
+// 一个拉流客户端
+typedef struct bench_client
+{
+    int     fd;                         // rtsp连接
+    int     udp_fd[RTSP_SERVER_TRACKS]; // udp方式时每个轨道的rtp socket
+    int64_t bytes;                      // 收到的字节数，包括interleaved头与RTP头
+}BenchClient;
+
+static volatile int s_quit = 0;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    s_quit = 1;
+}
+
+/**
+ * @brief 阻塞发送一个rtsp请求并读取应答(包括Content-Length指定的body)。
+ * @return 成功返回应答的状态码，失败返回-1。
+ */
+static int rtsp_request(int fd, const std::string &request, std::string *response)
+{
+    if(send(fd, request.data(), request.size(), 0) != (ssize_t)request.size()) {
+        return -1;
+    }
+    std::string data;
+    char buf[4096];
+    while(true) {
+        size_t header_end = data.find("\r\n\r\n");
+        if(header_end != std::string::npos) {
+            size_t content_length = 0;
+            size_t pos = data.find("Content-Length:");
+            if(pos != std::string::npos && pos < header_end) {
+                content_length = atoi(data.c_str() + pos + 15);
+            }
+            if(data.size() >= header_end + 4 + content_length) {
+                break;
+            }
+        }
+        int n = recv(fd, buf, sizeof(buf), 0);
+        if(n <= 0) {
+            return -1;
+        }
+        data.append(buf, n);
+    }
+    *response = data;
+    return atoi(data.c_str() + 9);                  // "RTSP/1.0 200 OK"
+}
+
+static std::string get_session(const std::string &response)
+{
+    size_t pos = response.find("Session: ");
+    if(pos == std::string::npos) {
+        return "";
+    }
+    pos += 9;
+    size_t end = response.find_first_of(";\r", pos);
+    return response.substr(pos, end - pos);
+}
+
+/**
+ * @brief 建立一个拉流客户端：DESCRIBE、SETUP两个轨道、PLAY。
+ * @return 成功 0 失败 -1
+ */
+static int open_client(BenchClient *client, int port, bool udp)
+{
+    client->fd = socket(AF_INET, SOCK_STREAM, 0);
+    client->udp_fd[0] = client->udp_fd[1] = -1;
+    client->bytes = 0;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if(connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        return -1;
+    }
+    char url[128];
+    snprintf(url, sizeof(url), "rtsp://127.0.0.1:%d/live", port);
+    std::string response;
+    char request[512];
+    snprintf(request, sizeof(request), "DESCRIBE %s RTSP/1.0\r\nCSeq: 1\r\nAccept: application/sdp\r\n\r\n", url);
+    if(rtsp_request(client->fd, request, &response) != 200) {
+        return -1;
+    }
+    std::string session;
+    for(int track = 0; track < RTSP_SERVER_TRACKS; track++) {
+        char transport[128];
+        if(udp) {
+            client->udp_fd[track] = socket(AF_INET, SOCK_DGRAM, 0);
+            struct sockaddr_in local;
+            memset(&local, 0, sizeof(local));
+            local.sin_family = AF_INET;
+            local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socklen_t len = sizeof(local);
+            int rcvbuf = 1024 * 1024;
+            setsockopt(client->udp_fd[track], SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+            if(bind(client->udp_fd[track], (struct sockaddr *)&local, sizeof(local)) < 0
+                    || getsockname(client->udp_fd[track], (struct sockaddr *)&local, &len) < 0) {
+                return -1;
+            }
+            int rtp_port = ntohs(local.sin_port);
+            snprintf(transport, sizeof(transport), "RTP/AVP;unicast;client_port=%d-%d", rtp_port, rtp_port + 1);
+        } else {
+            snprintf(transport, sizeof(transport), "RTP/AVP/TCP;unicast;interleaved=%d-%d", track * 2, track * 2 + 1);
+        }
+        std::string session_header = session.empty() ? "" : "Session: " + session + "\r\n";
+        snprintf(request, sizeof(request), "SETUP %s/trackID=%d RTSP/1.0\r\nCSeq: %d\r\nTransport: %s\r\n%s\r\n",
+                 url, track, track + 2, transport, session_header.c_str());
+        if(rtsp_request(client->fd, request, &response) != 200) {
+            return -1;
+        }
+        session = get_session(response);
+    }
+    snprintf(request, sizeof(request), "PLAY %s RTSP/1.0\r\nCSeq: 4\r\nSession: %s\r\nRange: npt=0.000-\r\n\r\n",
+             url, session.c_str());
+    if(rtsp_request(client->fd, request, &response) != 200) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 生成一帧合成的数据：视频为带起始码的单个NAL，负载用伪随机数填充；音频为裸AAC数据。
+ * @return 新分配的包，由调用者释放。
+ */
+static AVPacket *make_packet(int size, bool video, bool key, int64_t pts)
+{
+    AVPacket *pkt = av_packet_alloc();
+    av_new_packet(pkt, size);
+    for(int i = 0; i < size; i++) {
+        pkt->data[i] = (uint8_t)(rand() | 0x01);    // 保证负载中不出现起始码
+    }
+    if(video) {
+        pkt->data[0] = 0;
+        pkt->data[1] = 0;
+        pkt->data[2] = 0;
+        pkt->data[3] = 1;
+        pkt->data[4] = key ? 0x65 : 0x41;
+    }
+    pkt->pts = pkt->dts = pts;
+    pkt->flags = key ? AV_PKT_FLAG_KEY : 0;
+    return pkt;
+}
+
+/**
+ * @brief 按帧率与码率推送合成的音视频帧，I帧大小为P帧的5倍。
+ */
+static void produce(RtspServer *server, int bitrate_kbps, int fps, int gop)
+{
+    int frame_bytes = bitrate_kbps * 1000 / 8 / fps;
+    int p_bytes = frame_bytes * gop / (gop + 4);
+    int i_bytes = p_bytes * 5;
+    int audio_bytes = 128 * 1000 / 8 * 1024 / 48000;    // 128kbps 48kHz
+    int64_t start = TimesUtil::GetTimeMillisecond();
+    int64_t video_frames = 0;
+    int64_t audio_frames = 0;
+    while(!s_quit) {
+        int64_t now = TimesUtil::GetTimeMillisecond() - start;
+        while(video_frames * 1000 / fps <= now) {
+            bool key = (video_frames % gop == 0);
+            AVPacket *pkt = make_packet(key ? i_bytes : p_bytes, true, key, video_frames * 1000 / fps);
+            server->Push(pkt, E_VIDEO_TYPE);
+            av_packet_free(&pkt);
+            video_frames++;
+        }
+        while(audio_frames * 1024 * 1000 / 48000 <= now) {
+            AVPacket *pkt = make_packet(audio_bytes, false, false, audio_frames * 1024 * 1000 / 48000);
+            server->Push(pkt, E_AUDIO_TYPE);
+            av_packet_free(&pkt);
+            audio_frames++;
+        }
+        usleep(2000);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int nb_clients = 50;
+    int bitrate_kbps = 2000;
+    int fps = 25;
+    int gop = 50;
+    int seconds = 20;
+    int port = 18554;
+    bool udp = false;
+    int opt;
+    while((opt = getopt(argc, argv, "n:b:f:g:t:p:u")) != -1) {
+        switch(opt) {
+        case 'n': nb_clients = atoi(optarg); break;
+        case 'b': bitrate_kbps = atoi(optarg); break;
+        case 'f': fps = atoi(optarg); break;
+        case 'g': gop = atoi(optarg); break;
+        case 't': seconds = atoi(optarg); break;
+        case 'p': port = atoi(optarg); break;
+        case 'u': udp = true; break;
+        default:
+            printf("usage: %s [-n clients] [-b video_kbps] [-f fps] [-g gop] [-t seconds] [-p port] [-u]\n", argv[0]);
+            return 0;
+        }
+    }
+    if(fps <= 0 || gop <= 0 || nb_clients <= 0) {
+        fprintf(stderr, "invalid fps, gop or clients\n");
+        return -1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+#ifdef PUSH_INSTRUMENT
+    init_logger("rtspbench.log", S_INFO);                   // 统计用LogInfo打印
+    InstrumentReporter reporter(10);                        // main返回时停止，退出前再打印一次
+    reporter.Start();
+#else
+    init_logger("rtspbench.log", S_WARN);
+#endif
+
+    // 1 构造编码器上下文，只用来给服务器生成SDP
+    static const uint8_t extradata[] = {0, 0, 0, 1, 0x67, 0x64, 0x00, 0x1F, 0xAC, 0xD9,
+                                        0, 0, 0, 1, 0x68, 0xEB, 0xE3, 0xCB};
+    AVCodecContext *video_ctx = avcodec_alloc_context3(NULL);
+    video_ctx->codec_id = AV_CODEC_ID_H264;
+    video_ctx->extradata = (uint8_t *)av_mallocz(sizeof(extradata) + AV_INPUT_BUFFER_PADDING_SIZE);
+    memcpy(video_ctx->extradata, extradata, sizeof(extradata));
+    video_ctx->extradata_size = sizeof(extradata);
+    AVCodecContext *audio_ctx = avcodec_alloc_context3(NULL);
+    audio_ctx->codec_id = AV_CODEC_ID_AAC;
+    audio_ctx->sample_rate = 48000;
+    audio_ctx->channels = 2;
+
+    RtspServer server;
+    Properties properties;
+    properties.SetProperty("port", port);
+    properties.SetProperty("rtp_port", port + 10000);
+    properties.SetProperty("max_clients", nb_clients + 16);
+    if(server.Init(properties) != RET_OK || server.ConfigVideoStream(video_ctx) != RET_OK
+            || server.ConfigAudioStream(audio_ctx) != RET_OK || server.Start() != RET_OK) {
+        fprintf(stderr, "start rtsp server failed\n");
+        return -1;
+    }
+    std::thread producer(produce, &server, bitrate_kbps, fps, gop);
+
+    // 2 建立客户端
+    std::vector<BenchClient> clients(nb_clients);
+    int epoll_fd = epoll_create1(0);
+    for(int i = 0; i < nb_clients; i++) {
+        if(open_client(&clients[i], port, udp) != 0) {
+            fprintf(stderr, "open client %d failed: %s\n", i, strerror(errno));
+            s_quit = 1;
+            producer.join();
+            return -1;
+        }
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = ((uint64_t)i << 8) | 0xFF;
+        fcntl(clients[i].fd, F_SETFL, fcntl(clients[i].fd, F_GETFL, 0) | O_NONBLOCK);
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, clients[i].fd, &ev);
+        for(int track = 0; udp && track < RTSP_SERVER_TRACKS; track++) {
+            ev.data.u64 = ((uint64_t)i << 8) | track;
+            fcntl(clients[i].udp_fd[track], F_SETFL, fcntl(clients[i].udp_fd[track], F_GETFL, 0) | O_NONBLOCK);
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, clients[i].udp_fd[track], &ev);
+        }
+    }
+    printf("%d %s clients playing, video %dkbps %dfps gop %d, run %ds\n", nb_clients, udp ? "udp" : "tcp",
+           bitrate_kbps, fps, gop, seconds);
+
+    // 3 收数据，只统计字节数。前1秒作为预热，不计入统计
+    RtspServerStats begin_stats;
+    memset(&begin_stats, 0, sizeof(begin_stats));
+    int64_t begin_time = 0;
+    int64_t start = TimesUtil::GetTimeMillisecond();
+    struct epoll_event events[256];
+    char buf[65536];
+    while(!s_quit) {
+        int64_t now = TimesUtil::GetTimeMillisecond();
+        if(begin_time == 0 && now - start >= 1000) {
+            server.GetStats(&begin_stats);
+            for(int i = 0; i < nb_clients; i++) {
+                clients[i].bytes = 0;
+            }
+            begin_time = now;
+        }
+        if(now - start >= (seconds + 1) * 1000) {
+            break;
+        }
+        int n = epoll_wait(epoll_fd, events, 256, 100);
+        for(int i = 0; i < n; i++) {
+            BenchClient &client = clients[events[i].data.u64 >> 8];
+            int which = (int)(events[i].data.u64 & 0xFF);
+            int fd = (which == 0xFF) ? client.fd : client.udp_fd[which];
+            int len;
+            while((len = recv(fd, buf, sizeof(buf), 0)) > 0) {
+                client.bytes += len;
+            }
+        }
+    }
+    int64_t elapsed = TimesUtil::GetTimeMillisecond() - begin_time;
+    RtspServerStats end_stats;
+    server.GetStats(&end_stats);
+    s_quit = 1;
+    producer.join();
+
+    // 4 输出统计
+    std::vector<double> kbps;
+    for(int i = 0; i < nb_clients; i++) {
+        kbps.push_back(clients[i].bytes * 8.0 / elapsed);
+        close(clients[i].fd);
+        for(int track = 0; udp && track < RTSP_SERVER_TRACKS; track++) {
+            close(clients[i].udp_fd[track]);
+        }
+    }
+    std::sort(kbps.begin(), kbps.end());
+    double sum = 0;
+    for(size_t i = 0; i < kbps.size(); i++) {
+        sum += kbps[i];
+    }
+    double cpu_percent = (end_stats.cpu_time - begin_stats.cpu_time) / 10.0 / elapsed;
+    printf("client kbps: min-%0.1lf, median-%0.1lf, max-%0.1lf, total-%0.1lf\n", kbps.front(),
+           kbps[kbps.size() / 2], kbps.back(), sum);
+    printf("server: sent-%lldframes, dropped-%lldframes, cpu-%0.1lf%%\n",
+           (long long)(end_stats.sent_frames - begin_stats.sent_frames),
+           (long long)(end_stats.dropped_frames - begin_stats.dropped_frames), cpu_percent);
+    if(cpu_percent > 0) {
+        printf("estimated clients per core: %0.0lf\n", nb_clients * 100.0 / cpu_percent);
+    }
+
+    server.DeInit();
+    close(epoll_fd);
+    avcodec_free_context(&video_ctx);
+    avcodec_free_context(&audio_ctx);
+    return 0;
+}
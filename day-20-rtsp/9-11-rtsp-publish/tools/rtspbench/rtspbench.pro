@@ -0,0 +1,24 @@
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle
+CONFIG -= qt
+
+# 复用推流端的rtsp服务器源码，只支持linux(epoll)
+PUBLISH_DIR = $$PWD/../..
+INCLUDEPATH += $$PUBLISH_DIR
+
+instrument {
+DEFINES += PUSH_INSTRUMENT
+}
+
+unix {
+LIBS += -lavcodec -lavutil -lpthread
+}
+
+SOURCES += main.cpp \
+    $$PUBLISH_DIR/commonlooper.cpp \
+    $$PUBLISH_DIR/dlog.cpp \
+    $$PUBLISH_DIR/nalparser.cpp \
+    $$PUBLISH_DIR/rtppacketizer.cpp \
+    $$PUBLISH_DIR/rtspserver.cpp \
+    $$PUBLISH_DIR/instrument.cpp
@@ -0,0 +1,433 @@
+﻿/**
+ * 本地RTSP接收端替身(只支持推流端的ANNOUNCE/SETUP/RECORD)，用于在没有真正流媒体服务器的情况下测试推流端。
+ * 收到的每个RTP/RTCP包都会记录到达时间，输出到csv文件，退出时打印每个轨道的统计，包括丢包(seq不连续)与突发程度。
+ *
+ * 用法：rtspreceiver [-p 端口] [-o 输出csv] [-w 统计突发的时间窗口ms] [-t 运行秒数]
+ * 推流端把url写成 rtsp://127.0.0.1:8554/live/test 即可，tcp、udp两种传输方式都支持。
+ *
+ * csv每行的格式：到达时间(墙上时钟us),轨道,类型(rtp/rtcp),包大小,seq,rtp时间戳,marker,payload type
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#define MAX_TRACKS 8
+
+// 每个轨道的统计
+typedef struct track_stats
+{
+    int64_t packets;
+    int64_t bytes;
+    int64_t lost;                       // 依据seq不连续统计的丢包数
+    int     last_seq;                   // -1表示还没收到包
+    int64_t first_time;                 // 首包、尾包的到达时间，单位us
+    int64_t last_time;
+    int64_t window_start;               // 当前统计窗口的起始时间
+    int64_t window_bytes;               // 当前统计窗口内收到的字节数
+    int64_t peak_window_bytes;          // 所有窗口中最大的字节数，用于衡量突发
+}TrackStats;
+
+static volatile int s_quit = 0;
+static FILE *s_out_fp = NULL;
+static int64_t s_window = 10 * 1000;    // 统计突发的窗口，单位us
+static TrackStats s_tracks[MAX_TRACKS];
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    s_quit = 1;
+}
+
+static int64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief 记录收到的一个包。
+ * @param track 轨道索引，即SETUP时url中的streamid。
+ * @param is_rtcp 是否是rtcp包。
+ */
+static void record_packet(int track, int is_rtcp, const uint8_t *data, int size)
+{
+    int64_t t = now_us();
+    int seq = -1, marker = 0, pt = -1;
+    uint32_t ts = 0;
+    if(!is_rtcp && size >= 12) {
+        marker = data[1] >> 7;
+        pt = data[1] & 0x7f;
+        seq = (data[2] << 8) | data[3];
+        ts = ((uint32_t)data[4] << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+    }
+    if(s_out_fp) {
+        fprintf(s_out_fp, "%lld,%d,%s,%d,%d,%u,%d,%d\n", (long long)t, track, is_rtcp ? "rtcp" : "rtp",
+                size, seq, ts, marker, pt);
+    }
+    if(is_rtcp || track < 0 || track >= MAX_TRACKS) {
+        return;
+    }
+
+    TrackStats *st = &s_tracks[track];
+    if(0 == st->packets) {
+        st->first_time = t;
+        st->window_start = t;
+    }
+    st->packets++;
+    st->bytes += size;
+    st->last_time = t;
+    if(st->last_seq >= 0) {
+        int gap = (seq - st->last_seq - 1 + 65536) % 65536;
+        if(gap < 30000) {                               // 太大说明是乱序或者重传，不计入丢包
+            st->lost += gap;
+        }
+    }
+    st->last_seq = seq;
+    if(t - st->window_start >= s_window) {
+        if(st->window_bytes > st->peak_window_bytes) {
+            st->peak_window_bytes = st->window_bytes;
+        }
+        st->window_start = t;
+        st->window_bytes = 0;
+    }
+    st->window_bytes += size;
+}
+
+static void print_summary()
+{
+    printf("track  packets  bytes      lost   duration(ms)  avg(kbps)  peak/avg(%lldms window)\n", (long long)s_window / 1000);
+    for(int i = 0; i < MAX_TRACKS; i++) {
+        TrackStats *st = &s_tracks[i];
+        if(st->packets == 0) {
+            continue;
+        }
+        if(st->window_bytes > st->peak_window_bytes) {
+            st->peak_window_bytes = st->window_bytes;       // 最后一个窗口
+        }
+        int64_t duration = st->last_time - st->first_time;
+        double avg_kbps = duration > 0 ? st->bytes * 8.0 * 1000 / duration : 0;
+        double avg_window = duration > 0 ? (double)st->bytes * s_window / duration : 0;
+        printf("%-6d %-8lld %-10lld %-6lld %-13lld %-10.1f %.2f\n", i, (long long)st->packets, (long long)st->bytes,
+               (long long)st->lost, (long long)duration / 1000, avg_kbps,
+               avg_window > 0 ? st->peak_window_bytes / avg_window : 0);
+    }
+}
+
+// 一个rtsp会话，推流端一条tcp连接
+typedef struct rtsp_session
+{
+    int fd;
+    std::string buf;                                    // 接收缓存，可能包含rtsp请求与interleaved的rtp数据
+    int udp_fds[MAX_TRACKS][2];                         // udp方式时，每个轨道的rtp、rtcp socket
+}RtspSession;
+
+static int bind_udp(int port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int local_port(int fd)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+static std::string get_header(const std::string &req, const char *name)
+{
+    std::string key = std::string("\r\n") + name + ":";
+    size_t pos = req.find(key);
+    if(pos == std::string::npos) {
+        return "";
+    }
+    pos += key.size();
+    while(pos < req.size() && req[pos] == ' ') {
+        pos++;
+    }
+    size_t end = req.find("\r\n", pos);
+    return req.substr(pos, end - pos);
+}
+
+/**
+ * @brief 处理一个rtsp请求并回复。
+ * @return 0 正常; -1 需要关闭连接。
+ */
+static int handle_request(RtspSession *session, const std::string &req)
+{
+    std::string method = req.substr(0, req.find(' '));
+    std::string cseq = get_header(req, "CSeq");
+    std::string extra;
+    int close_after = 0;
+
+    if(method == "OPTIONS") {
+        extra = "Public: OPTIONS, ANNOUNCE, SETUP, RECORD, TEARDOWN, GET_PARAMETER\r\n";
+    } else if(method == "ANNOUNCE") {
+        size_t body = req.find("\r\n\r\n");
+        printf("ANNOUNCE sdp:\n%s\n", req.substr(body + 4).c_str());
+    } else if(method == "SETUP") {
+        // 推流端的url形如 rtsp://ip:port/live/test/streamid=0
+        int track = 0;
+        size_t pos = req.find("streamid=");
+        if(pos != std::string::npos && pos < req.find("\r\n")) {
+            track = atoi(req.c_str() + pos + 9);
+        }
+        if(track < 0 || track >= MAX_TRACKS) {
+            track = 0;
+        }
+        std::string transport = get_header(req, "Transport");
+        if(transport.find("interleaved") != std::string::npos) {
+            extra = "Transport: " + transport + "\r\n";
+        } else {
+            // udp: 绑定一对端口接收rtp、rtcp
+            int rtp_fd = -1, rtcp_fd = -1;
+            for(int port = 20000 + track * 2; port < 60000 && rtcp_fd < 0; port += 2 * MAX_TRACKS) {
+                rtp_fd = bind_udp(port);
+                if(rtp_fd < 0) {
+                    continue;
+                }
+                rtcp_fd = bind_udp(port + 1);
+                if(rtcp_fd < 0) {
+                    close(rtp_fd);
+                    rtp_fd = -1;
+                }
+            }
+            if(rtcp_fd < 0) {
+                fprintf(stderr, "bind udp failed\n");
+                return -1;
+            }
+            session->udp_fds[track][0] = rtp_fd;
+            session->udp_fds[track][1] = rtcp_fd;
+            size_t semi = transport.find(";mode");
+            std::string base = semi == std::string::npos ? transport : transport.substr(0, semi);
+            char server_port[64];
+            snprintf(server_port, sizeof(server_port), ";server_port=%d-%d", local_port(rtp_fd), local_port(rtcp_fd));
+            extra = "Transport: " + base + server_port + "\r\n";
+        }
+        extra += "Session: 12345678\r\n";
+    } else if(method == "RECORD") {
+        extra = "Session: 12345678\r\n";
+        printf("RECORD, start receiving\n");
+    } else if(method == "TEARDOWN") {
+        close_after = 1;
+    }
+
+    std::string rsp = "RTSP/1.0 200 OK\r\nCSeq: " + cseq + "\r\n" + extra + "\r\n";
+    if(send(session->fd, rsp.c_str(), rsp.size(), MSG_NOSIGNAL) < 0) {
+        return -1;
+    }
+    return close_after ? -1 : 0;
+}
+
+/**
+ * @brief 解析接收缓存中的完整rtsp请求与interleaved包。
+ * @return 0 正常; -1 需要关闭连接。
+ */
+static int parse_buffer(RtspSession *session)
+{
+    std::string &buf = session->buf;
+    while(!buf.empty()) {
+        if(buf[0] == '$') {
+            // tcp interleaved: '$' + channel(1字节) + 长度(2字节) + 数据，偶数channel是rtp，奇数是rtcp
+            if(buf.size() < 4) {
+                return 0;
+            }
+            int channel = (uint8_t)buf[1];
+            int len = ((uint8_t)buf[2] << 8) | (uint8_t)buf[3];
+            if((int)buf.size() < 4 + len) {
+                return 0;
+            }
+            record_packet(channel / 2, channel % 2, (const uint8_t *)buf.data() + 4, len);
+            buf.erase(0, 4 + len);
+            continue;
+        }
+        size_t end = buf.find("\r\n\r\n");
+        if(end == std::string::npos) {
+            return 0;
+        }
+        int content_length = atoi(get_header(buf.substr(0, end + 2), "Content-Length").c_str());
+        size_t total = end + 4 + content_length;
+        if(buf.size() < total) {
+            return 0;
+        }
+        std::string req = buf.substr(0, total);
+        buf.erase(0, total);
+        if(handle_request(session, req) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void close_session(RtspSession *session)
+{
+    close(session->fd);
+    for(int i = 0; i < MAX_TRACKS; i++) {
+        for(int j = 0; j < 2; j++) {
+            if(session->udp_fds[i][j] >= 0) {
+                close(session->udp_fds[i][j]);
+                session->udp_fds[i][j] = -1;
+            }
+        }
+    }
+    printf("session closed\n");
+}
+
+int main(int argc, char **argv)
+{
+    int port = 8554;
+    int run_seconds = 0;
+    const char *out_name = "rtsp_arrivals.csv";
+    int opt;
+    while((opt = getopt(argc, argv, "p:o:w:t:")) != -1) {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 'o': out_name = optarg; break;
+        case 'w': s_window = atoi(optarg) * 1000; break;
+        case 't': run_seconds = atoi(optarg); break;
+        default:
+            printf("usage: %s [-p port] [-o arrivals.csv] [-w window_ms] [-t seconds]\n", argv[0]);
+            return -1;
+        }
+    }
+    for(int i = 0; i < MAX_TRACKS; i++) {
+        memset(&s_tracks[i], 0, sizeof(TrackStats));
+        s_tracks[i].last_seq = -1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    s_out_fp = fopen(out_name, "w");
+    if(!s_out_fp) {
+        fprintf(stderr, "open %s failed\n", out_name);
+        return -1;
+    }
+    fprintf(s_out_fp, "arrival_us,track,type,size,seq,rtp_timestamp,marker,pt\n");
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 8) < 0) {
+        fprintf(stderr, "listen on %d failed: %s\n", port, strerror(errno));
+        return -1;
+    }
+    printf("rtsp receiver listen on %d, record to %s\n", port, out_name);
+
+    std::vector<RtspSession> sessions;
+    int64_t start_time = now_us();
+    while(!s_quit) {
+        if(run_seconds > 0 && now_us() - start_time > (int64_t)run_seconds * 1000000) {
+            break;
+        }
+        // 依次是 监听socket、每个会话的tcp socket、每个会话的udp socket
+        std::vector<struct pollfd> fds;
+        std::vector<std::pair<int, int> > owners;       // <会话索引, 轨道*2+是否rtcp>，-1表示tcp
+        struct pollfd pfd;
+        pfd.fd = listen_fd;
+        pfd.events = POLLIN;
+        fds.push_back(pfd);
+        owners.push_back(std::make_pair(-1, -1));
+        for(size_t i = 0; i < sessions.size(); i++) {
+            pfd.fd = sessions[i].fd;
+            fds.push_back(pfd);
+            owners.push_back(std::make_pair((int)i, -1));
+            for(int t = 0; t < MAX_TRACKS; t++) {
+                for(int j = 0; j < 2; j++) {
+                    if(sessions[i].udp_fds[t][j] >= 0) {
+                        pfd.fd = sessions[i].udp_fds[t][j];
+                        fds.push_back(pfd);
+                        owners.push_back(std::make_pair((int)i, t * 2 + j));
+                    }
+                }
+            }
+        }
+
+        int ret = poll(&fds[0], fds.size(), 100);
+        if(ret <= 0) {
+            continue;
+        }
+        std::vector<int> closed;
+        for(size_t k = 0; k < fds.size(); k++) {
+            if(!(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            if(k == 0) {
+                RtspSession session;
+                session.fd = accept(listen_fd, NULL, NULL);
+                if(session.fd >= 0) {
+                    memset(session.udp_fds, -1, sizeof(session.udp_fds));
+                    sessions.push_back(session);
+                    printf("accept new session\n");
+                }
+                continue;
+            }
+            RtspSession *session = &sessions[owners[k].first];
+            uint8_t buf[65536];
+            if(owners[k].second < 0) {
+                int n = recv(session->fd, buf, sizeof(buf), 0);
+                if(n <= 0) {
+                    closed.push_back(owners[k].first);
+                    continue;
+                }
+                session->buf.append((const char *)buf, n);
+                if(parse_buffer(session) < 0) {
+                    closed.push_back(owners[k].first);
+                }
+            } else {
+                int n = recv(fds[k].fd, buf, sizeof(buf), 0);
+                if(n > 0) {
+                    record_packet(owners[k].second / 2, owners[k].second % 2, buf, n);
+                }
+            }
+        }
+        // 从后往前删除，防止索引错乱
+        for(int i = (int)sessions.size() - 1; i >= 0; i--) {
+            for(size_t j = 0; j < closed.size(); j++) {
+                if(closed[j] == i) {
+                    close_session(&sessions[i]);
+                    sessions.erase(sessions.begin() + i);
+                    break;
+                }
+            }
+        }
+    }
+
+    for(size_t i = 0; i < sessions.size(); i++) {
+        close_session(&sessions[i]);
+    }
+    close(listen_fd);
+    fclose(s_out_fp);
+    print_summary();
+    return 0;
+}
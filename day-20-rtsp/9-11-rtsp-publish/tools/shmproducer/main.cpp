@@ -0,0 +1,468 @@
+﻿/**
+ * 共享内存采集的本地生产者，模拟外部采集进程通过ShmRing把音视频帧交给推流端(audio_source/video_source为shm)。
+ * 1）生产模式：按帧率把VideoPattern的测试图像直接画到slot中(不经过中间缓冲)，可选同时写AudioPattern的音频，
+ *    推流端先启动或者后启动都可以，推流端跟不上时ring满，本工具丢帧并定时打印丢帧数。
+ * 2）对比模式(-b)：fork一个消费者进程，对比三种把一帧yuv交给另一个进程的方式：
+ *    shm    本工具的ShmRing，生产者直接画到slot，消费者直接读slot
+ *    pipe   生产者画到自己的缓冲，write到pipe，消费者read到自己的缓冲，各拷贝一次并有系统调用
+ *    file   推流端原来的文件输入，消费者fread预先写好的yuv文件(在page cache中)，没有跨进程的交接，只作为读取开销的参照
+ *    每种方式先不限速测吞吐(fps)，再按帧率测交接延时(生产者提交到消费者拿到整帧)，消费者每帧都读一遍数据，模拟编码器读取。
+ *
+ * 用法：shmproducer [-v 视频共享内存名] [-W 宽] [-H 高] [-f 帧率] [-a 音频共享内存名] [-r 采样率] [-c 通道数]
+ *                   [-s 每个slot的样本数] [-n slot个数] [-t 运行秒数] [-b]
+ * 例如：shmproducer -v /push_video -W 1920 -H 1080 -f 25 -a /push_audio
+ *       shmproducer -b -W 1920 -H 1080 -f 60 -t 10
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "dlog.h"
+#include "shmring.h"
+#include "testpattern.h"
+extern "C" {
+#include "libavutil/pixfmt.h"
+#include "libavutil/samplefmt.h"
+}
+
+// 对比模式中pipe方式每帧前面的头
+typedef struct pipe_frame_header
+{
+    int64_t pts;                        // 生产者提交时的墙上时钟，单位us，-1表示结束
+    int32_t size;
+    int32_t reserved;
+}PipeFrameHeader;
+
+static volatile int s_quit = 0;
+static volatile uint64_t s_sink = 0;  // 保存touch的结果，防止读取被优化掉
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    s_quit = 1;
+}
+
+static void sleep_until(int64_t wall_us)
+{
+    int64_t remain = wall_us - ShmRing::GetWallTimeMicrosecond();
+    if(remain > 0) {
+        usleep((useconds_t)remain);
+    }
+}
+
+// 按8字节读一遍整帧，模拟编码器读取数据
+static uint64_t touch(const uint8_t *data, int size)
+{
+    uint64_t sum = 0;
+    const uint64_t *p = (const uint64_t *)data;
+    for(int i = 0; i < size / 8; i++) {
+        sum += p[i];
+    }
+    return sum;
+}
+
+static bool read_full(int fd, uint8_t *buf, size_t size)
+{
+    while(size > 0) {
+        ssize_t n = read(fd, buf, size);
+        if(n <= 0) {
+            return false;
+        }
+        buf += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const uint8_t *buf, size_t size)
+{
+    while(size > 0) {
+        ssize_t n = write(fd, buf, size);
+        if(n <= 0) {
+            return false;
+        }
+        buf += n;
+        size -= n;
+    }
+    return true;
+}
+
+static void print_result(const char *title, int frames, int64_t elapsed, std::vector<int64_t> latencies, uint32_t dropped)
+{
+    if(latencies.empty()) {
+        printf("%-6s throughput: %d frames in %.1fms, %.1f fps\n", title, frames, elapsed / 1000.0,
+               elapsed > 0 ? frames * 1000000.0 / elapsed : 0);
+        return;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    printf("%-6s latency: frames %d, p50 %lldus, p99 %lldus, max %lldus, dropped %u\n", title, (int)latencies.size(),
+           (long long)latencies[latencies.size() / 2], (long long)latencies[latencies.size() * 99 / 100],
+           (long long)latencies.back(), dropped);
+}
+
+/**
+ * @brief 生产模式，按帧率写视频与音频，直到运行时间到或者收到SIGINT。
+ * @return 成功 0 失败 -1
+ */
+static int produce(const char *video_name, const char *audio_name, int width, int height, int fps,
+                   int sample_rate, int channels, int nb_samples, int slot_count, int seconds)
+{
+    ShmRing video_ring;
+    ShmRing audio_ring;
+    VideoPattern video_pattern;
+    AudioPattern audio_pattern;
+    Properties properties;
+    properties.SetProperty("width", width);
+    properties.SetProperty("height", height);
+    properties.SetProperty("pixel_format", AV_PIX_FMT_YUV420P);
+    properties.SetProperty("slot_count", slot_count);
+    properties.SetProperty("data_size", width * height * 3 / 2);
+    properties.SetProperty("media_type", E_VIDEO_TYPE);
+    if(video_pattern.Init(properties) != RET_OK || video_ring.Create(video_name, properties) != RET_OK) {
+        fprintf(stderr, "create video ring %s failed\n", video_name);
+        return -1;
+    }
+    if(audio_name) {
+        Properties audio_properties;
+        audio_properties.SetProperty("sample_rate", sample_rate);
+        audio_properties.SetProperty("channels", channels);
+        audio_properties.SetProperty("sample_format", AV_SAMPLE_FMT_S16);
+        audio_properties.SetProperty("slot_count", slot_count * 2);
+        audio_properties.SetProperty("data_size", nb_samples * channels * 2);
+        audio_properties.SetProperty("media_type", E_AUDIO_TYPE);
+        if(audio_pattern.Init(audio_properties) != RET_OK || audio_ring.Create(audio_name, audio_properties) != RET_OK) {
+            fprintf(stderr, "create audio ring %s failed\n", audio_name);
+            return -1;
+        }
+    }
+    printf("producing %dx%d@%d to %s%s%s, Ctrl+C to stop\n", width, height, fps, video_name,
+           audio_name ? " and audio to " : "", audio_name ? audio_name : "");
+
+    int64_t begin = ShmRing::GetWallTimeMicrosecond();
+    int64_t video_index = 0;
+    int64_t audio_index = 0;
+    int64_t video_dropped = 0;
+    int64_t audio_dropped = 0;
+    int64_t pre_print_time = begin;
+    while(!s_quit && (seconds <= 0 || ShmRing::GetWallTimeMicrosecond() - begin < seconds * 1000000LL)) {
+        int64_t video_time = begin + video_index * 1000000 / fps;
+        int64_t audio_time = audio_name ? begin + audio_index * nb_samples * 1000000LL / sample_rate : INT64_MAX;
+        if(audio_time < video_time) {
+            sleep_until(audio_time);
+            ShmSlot *slot = NULL;
+            uint8_t *data = audio_ring.BeginWrite(&slot);
+            if(data) {
+                audio_pattern.Fill((int16_t *)data, nb_samples);
+                slot->size = nb_samples * channels * 2;
+                slot->nb_samples = nb_samples;
+                slot->pts = ShmRing::GetWallTimeMicrosecond();
+                audio_ring.CommitWrite();
+            } else {
+                std::vector<int16_t> discard(nb_samples * channels);
+                audio_pattern.Fill(discard.data(), nb_samples);                  // 保持音频连续
+                audio_dropped++;
+            }
+            audio_index++;
+            continue;
+        }
+        sleep_until(video_time);
+        ShmSlot *slot = NULL;
+        uint8_t *data = video_ring.BeginWrite(&slot);
+        if(data) {
+            video_pattern.Fill(data, video_index);          // 直接画到共享内存中
+            slot->size = width * height * 3 / 2;
+            slot->width = width;
+            slot->height = height;
+            slot->stride[0] = width;
+            slot->stride[1] = width / 2;
+            slot->stride[2] = width / 2;
+            slot->pts = ShmRing::GetWallTimeMicrosecond();
+            video_ring.CommitWrite();
+        } else {
+            video_dropped++;
+        }
+        video_index++;
+
+        int64_t now = ShmRing::GetWallTimeMicrosecond();
+        if(now - pre_print_time >= 5000000) {
+            printf("video frames: %lld, dropped: %lld; audio slots: %lld, dropped: %lld\n", (long long)video_index,
+                   (long long)video_dropped, (long long)audio_index, (long long)audio_dropped);
+            pre_print_time = now;
+        }
+    }
+    video_ring.Close();
+    audio_ring.Close();
+    return 0;
+}
+
+/**
+ * @brief 对比模式中的shm方式。
+ * @param paced true按帧率发送测延时，false不限速测吞吐。
+ */
+static void bench_shm(int width, int height, int fps, int frames, int slot_count, bool paced)
+{
+    const char *name = "/shmproducer_bench";
+    int frame_size = width * height * 3 / 2;
+    VideoPattern pattern;
+    ShmRing ring;
+    Properties properties;
+    properties.SetProperty("width", width);
+    properties.SetProperty("height", height);
+    properties.SetProperty("slot_count", slot_count);
+    properties.SetProperty("data_size", frame_size);
+    properties.SetProperty("media_type", E_VIDEO_TYPE);
+    if(pattern.Init(properties) != RET_OK || ring.Create(name, properties) != RET_OK) {
+        fprintf(stderr, "create shm ring failed\n");
+        return;
+    }
+    int ready[2];
+    if(pipe(ready) < 0) {
+        return;
+    }
+    fflush(stdout);                                         // 子进程会继承没有输出的缓冲
+    pid_t pid = fork();
+    if(pid == 0) {
+        // 消费者
+        ShmRing consumer;
+        char c = 0;
+        if(consumer.Open(name, 1000) != RET_OK) {
+            _exit(1);
+        }
+        write(ready[1], &c, 1);
+        std::vector<int64_t> latencies;
+        uint64_t sum = 0;
+        int count = 0;
+        int64_t first = 0;
+        while(true) {
+            const ShmSlot *slot = consumer.Acquire(2000);
+            if(!slot || slot->flags == 1) {
+                break;
+            }
+            sum += touch(consumer.GetData(slot), slot->size);
+            int64_t now = ShmRing::GetWallTimeMicrosecond();
+            if(count++ == 0) {
+                first = now;
+            }
+            if(paced) {
+                latencies.push_back(now - slot->pts);
+            }
+            consumer.Release();
+        }
+        int64_t elapsed = ShmRing::GetWallTimeMicrosecond() - first;
+        ShmRingStats stats;
+        consumer.GetStats(&stats);
+        print_result("shm", count, elapsed, latencies, stats.dropped);
+        fflush(stdout);
+        s_sink = sum;
+        _exit(0);
+    }
+    char c;
+    read(ready[0], &c, 1);
+    int64_t begin = ShmRing::GetWallTimeMicrosecond();
+    for(int i = 0; i < frames; i++) {
+        if(paced) {
+            sleep_until(begin + (int64_t)i * 1000000 / fps);
+        }
+        ShmSlot *slot = NULL;
+        uint8_t *data;
+        while(!(data = ring.BeginWrite(&slot))) {
+            if(paced) {
+                break;                                      // 与生产模式一样丢帧
+            }
+            usleep(0);                                      // 测吞吐时等待消费者
+        }
+        if(!data) {
+            continue;
+        }
+        pattern.Fill(data, i);
+        slot->size = frame_size;
+        slot->flags = 0;
+        slot->pts = ShmRing::GetWallTimeMicrosecond();
+        ring.CommitWrite();
+    }
+    ShmSlot *slot = NULL;
+    while(!ring.BeginWrite(&slot)) {
+        usleep(1000);
+    }
+    slot->size = 0;
+    slot->flags = 1;                                        // 结束
+    ring.CommitWrite();
+    waitpid(pid, NULL, 0);
+    close(ready[0]);
+    close(ready[1]);
+    ring.Close();
+}
+
+static void bench_pipe(int width, int height, int fps, int frames, bool paced)
+{
+    int frame_size = width * height * 3 / 2;
+    VideoPattern pattern;
+    Properties properties;
+    properties.SetProperty("width", width);
+    properties.SetProperty("height", height);
+    if(pattern.Init(properties) != RET_OK) {
+        return;
+    }
+    int fds[2];
+    if(pipe(fds) < 0) {
+        return;
+    }
+    fcntl(fds[1], F_SETPIPE_SZ, 1024 * 1024);               // 与shm的ring一样能缓冲几帧(受/proc/sys/fs/pipe-max-size限制)
+    fflush(stdout);                                         // 子进程会继承没有输出的缓冲
+    pid_t pid = fork();
+    if(pid == 0) {
+        close(fds[1]);
+        std::vector<uint8_t> buf(frame_size);
+        std::vector<int64_t> latencies;
+        uint64_t sum = 0;
+        int count = 0;
+        int64_t first = 0;
+        PipeFrameHeader header;
+        while(read_full(fds[0], (uint8_t *)&header, sizeof(header)) && header.pts >= 0
+              && read_full(fds[0], buf.data(), header.size)) {
+            sum += touch(buf.data(), header.size);
+            int64_t now = ShmRing::GetWallTimeMicrosecond();
+            if(count++ == 0) {
+                first = now;
+            }
+            if(paced) {
+                latencies.push_back(now - header.pts);
+            }
+        }
+        print_result("pipe", count, ShmRing::GetWallTimeMicrosecond() - first, latencies, 0);
+        fflush(stdout);
+        s_sink = sum;
+        _exit(0);
+    }
+    close(fds[0]);
+    std::vector<uint8_t> buf(frame_size);
+    int64_t begin = ShmRing::GetWallTimeMicrosecond();
+    for(int i = 0; i < frames; i++) {
+        if(paced) {
+            sleep_until(begin + (int64_t)i * 1000000 / fps);
+        }
+        pattern.Fill(buf.data(), i);
+        PipeFrameHeader header = {ShmRing::GetWallTimeMicrosecond(), frame_size, 0};
+        if(!write_full(fds[1], (const uint8_t *)&header, sizeof(header)) || !write_full(fds[1], buf.data(), frame_size)) {
+            break;
+        }
+    }
+    PipeFrameHeader end = {-1, 0, 0};
+    write_full(fds[1], (const uint8_t *)&end, sizeof(end));
+    close(fds[1]);
+    waitpid(pid, NULL, 0);
+}
+
+// 推流端的文件输入：fread一帧yuv，文件已经在page cache中
+static void bench_file(int width, int height, int frames)
+{
+    const char *file_name = "/tmp/shmproducer_bench.yuv";
+    int frame_size = width * height * 3 / 2;
+    int file_frames = frames < 50 ? frames : 50;            // 循环读取，与推流端读到文件尾后重新开始一样
+    VideoPattern pattern;
+    Properties properties;
+    properties.SetProperty("width", width);
+    properties.SetProperty("height", height);
+    if(pattern.Init(properties) != RET_OK) {
+        return;
+    }
+    std::vector<uint8_t> buf(frame_size);
+    FILE *fp = fopen(file_name, "wb");
+    if(!fp) {
+        return;
+    }
+    for(int i = 0; i < file_frames; i++) {
+        pattern.Fill(buf.data(), i);
+        fwrite(buf.data(), 1, frame_size, fp);
+    }
+    fclose(fp);
+    fp = fopen(file_name, "rb");
+    if(!fp) {
+        return;
+    }
+    std::vector<int64_t> read_times;
+    uint64_t sum = 0;
+    int64_t begin = ShmRing::GetWallTimeMicrosecond();
+    for(int i = 0; i < frames; i++) {
+        int64_t start = ShmRing::GetWallTimeMicrosecond();
+        if(fread(buf.data(), 1, frame_size, fp) != (size_t)frame_size) {
+            fseek(fp, 0, SEEK_SET);
+            i--;
+            continue;
+        }
+        sum += touch(buf.data(), frame_size);
+        read_times.push_back(ShmRing::GetWallTimeMicrosecond() - start);
+    }
+    int64_t elapsed = ShmRing::GetWallTimeMicrosecond() - begin;
+    fclose(fp);
+    unlink(file_name);
+    s_sink = sum;
+    print_result("file", frames, elapsed, std::vector<int64_t>(), 0);
+    print_result("file", frames, elapsed, read_times, 0);
+    printf("       (file latency is the fread time of one frame, there is no cross-process handoff)\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *video_name = "/push_video";
+    const char *audio_name = NULL;
+    int width = 1920;
+    int height = 1080;
+    int fps = 25;
+    int sample_rate = 48000;
+    int channels = 2;
+    int nb_samples = 1024;
+    int slot_count = 4;
+    int seconds = 0;
+    bool bench = false;
+    int opt;
+    while((opt = getopt(argc, argv, "v:W:H:f:a:r:c:s:n:t:b")) != -1) {
+        switch(opt) {
+        case 'v': video_name = optarg; break;
+        case 'W': width = atoi(optarg); break;
+        case 'H': height = atoi(optarg); break;
+        case 'f': fps = atoi(optarg); break;
+        case 'a': audio_name = optarg; break;
+        case 'r': sample_rate = atoi(optarg); break;
+        case 'c': channels = atoi(optarg); break;
+        case 's': nb_samples = atoi(optarg); break;
+        case 'n': slot_count = atoi(optarg); break;
+        case 't': seconds = atoi(optarg); break;
+        case 'b': bench = true; break;
+        default:
+            printf("usage: %s [-v video_shm] [-W width] [-H height] [-f fps] [-a audio_shm] [-r sample_rate] [-c channels]\n"
+                   "       [-s samples_per_slot] [-n slot_count] [-t seconds] [-b]\n", argv[0]);
+            return -1;
+        }
+    }
+    if(width <= 0 || height <= 0 || fps <= 0 || sample_rate <= 0 || channels <= 0 || nb_samples <= 0 || slot_count < 2) {
+        fprintf(stderr, "invalid parameters\n");
+        return -1;
+    }
+    init_logger("shmproducer_log", S_WARN);
+    signal(SIGINT, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    if(!bench) {
+        return produce(video_name, audio_name, width, height, fps, sample_rate, channels, nb_samples, slot_count, seconds);
+    }
+
+    int throughput_frames = 300;
+    int paced_frames = fps * (seconds > 0 ? seconds : 5);
+    printf("%dx%d yuv420p, %d bytes per frame, %d slots\n", width, height, width * height * 3 / 2, slot_count);
+    printf("unpaced, %d frames:\n", throughput_frames);
+    bench_shm(width, height, fps, throughput_frames, slot_count, false);
+    bench_pipe(width, height, fps, throughput_frames, false);
+    printf("paced at %d fps, %d frames:\n", fps, paced_frames);
+    bench_shm(width, height, fps, paced_frames, slot_count, true);
+    bench_pipe(width, height, fps, paced_frames, true);
+    printf("file input, %d frames:\n", throughput_frames);
+    bench_file(width, height, throughput_frames);
+    return 0;
+}
@@ -0,0 +1,18 @@
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle
+CONFIG -= qt
+# 只支持linux，使用shm_open + futex
+
+# 复用推流端的共享内存环形缓冲、测试图像与日志源码
+PUBLISH_DIR = $$PWD/../..
+INCLUDEPATH += $$PUBLISH_DIR
+
+unix {
+LIBS += -lpthread -lrt
+}
+
+SOURCES += main.cpp \
+    $$PUBLISH_DIR/dlog.cpp \
+    $$PUBLISH_DIR/shmring.cpp \
+    $$PUBLISH_DIR/testpattern.cpp
@@ -0,0 +1,307 @@
+﻿/**
+ * 对比多分辨率推流的两种部署方式的cpu占用：
+ * 1）shared：一个进程一次采集，逐级缩放出各层，每层独立编码线程，音频只编码一次(即PushWork的video_layers)；
+ * 2）separate：每个分辨率一个独立的流水线(模拟每个分辨率一个PushWork进程)，各自读取yuv文件、从原始帧缩放、编码视频和音频。
+ * 两种方式都按帧率实时采集，统计整个进程的cpu时间，cpu占用100%表示一个核。
+ *
+ * 用法：simulcastbench [yuv文件] [宽] [高] [帧率] [主流码率kbps] [分辨率层] [帧数]
+ * 例如：simulcastbench 720x480_25fps_420p.yuv 768x480 25 1024 "512x320@512,256x160@192" 250
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <thread>
+#include <vector>
+#include "dlog.h"
+#include "timesutil.h"
+#include "h264encoder.h"
+#include "aacencoder.h"
+#include "simulcast.h"
+
+#define SAMPLE_RATE     48000
+#define CHANNELS        2
+
+typedef struct bench_config
+{
+    const char *yuv_name;
+    int width;
+    int height;
+    int fps;
+    int bitrate;
+    int frames;
+}BenchConfig;
+
+// 循环读取yuv文件，模拟采集
+class YuvSource
+{
+public:
+    YuvSource(const char *name, int frame_size) : frame_(frame_size) {
+        fp_ = fopen(name, "rb");
+    }
+    ~YuvSource() {
+        if(fp_) {
+            fclose(fp_);
+        }
+    }
+    uint8_t *Read() {
+        if(!fp_) {
+            return NULL;
+        }
+        if(fread(&frame_[0], 1, frame_.size(), fp_) != frame_.size()) {
+            fseek(fp_, 0, SEEK_SET);
+            if(fread(&frame_[0], 1, frame_.size(), fp_) != frame_.size()) {
+                return NULL;
+            }
+        }
+        return &frame_[0];
+    }
+private:
+    FILE *fp_ = NULL;
+    std::vector<uint8_t> frame_;
+};
+
+// 音频流水线：合成的s16音调->fltp->aac，按视频帧的时间补齐应该编码的音频帧
+class AudioPipeline
+{
+public:
+    int Init() {
+        Properties properties;
+        properties.SetProperty("sample_rate", SAMPLE_RATE);
+        properties.SetProperty("channels", CHANNELS);
+        properties.SetProperty("bitrate", 64 * 1024);
+        if(encoder_.Init(properties) != RET_OK) {
+            return -1;
+        }
+        nb_samples_ = encoder_.GetFrameSamples();
+        frame_ = av_frame_alloc();
+        frame_->format = encoder_.GetFormat();
+        frame_->nb_samples = nb_samples_;
+        frame_->channels = CHANNELS;
+        frame_->channel_layout = encoder_.GetChannelLayout();
+        av_frame_get_buffer(frame_, 0);
+        s16_.resize(nb_samples_ * CHANNELS);
+        fltp_.resize(nb_samples_ * CHANNELS);
+        return 0;
+    }
+    ~AudioPipeline() {
+        av_frame_free(&frame_);
+    }
+    void EncodeUntil(int64_t time_ms) {
+        while(samples_ * 1000 / SAMPLE_RATE < time_ms) {
+            for(int i = 0; i < nb_samples_; i++) {
+                s16_[i * 2] = s16_[i * 2 + 1] = (int16_t)(8000 * sin(2 * M_PI * 440 * (samples_ + i) / SAMPLE_RATE));
+            }
+            for(int i = 0; i < nb_samples_; i++) {
+                fltp_[i] = s16_[i * 2] / 32768.0f;
+                fltp_[nb_samples_ + i] = s16_[i * 2 + 1] / 32768.0f;
+            }
+            av_frame_make_writable(frame_);
+            av_samples_fill_arrays(frame_->data, frame_->linesize, (uint8_t *)&fltp_[0], CHANNELS, nb_samples_,
+                                   (AVSampleFormat)frame_->format, 0);
+            int pkt_frame = 0;
+            RET_CODE ret = RET_OK;
+            AVPacket *packet = encoder_.Encode(frame_, samples_ * 1000 / SAMPLE_RATE, 0, &pkt_frame, &ret);
+            if(packet) {
+                av_packet_free(&packet);
+            }
+            samples_ += nb_samples_;
+        }
+    }
+private:
+    AACEncoder encoder_;
+    AVFrame *frame_ = NULL;
+    int nb_samples_ = 1024;
+    int64_t samples_ = 0;
+    std::vector<int16_t> s16_;
+    std::vector<float> fltp_;
+};
+
+static int init_encoder(H264Encoder *encoder, int width, int height, int fps, int bitrate)
+{
+    Properties properties;
+    properties.SetProperty("width", width);
+    properties.SetProperty("height", height);
+    properties.SetProperty("fps", fps);
+    properties.SetProperty("bitrate", bitrate);
+    properties.SetProperty("gop", fps);
+    return encoder->Init(properties) == RET_OK ? 0 : -1;
+}
+
+static void encode_frame(H264Encoder *encoder, uint8_t *yuv, int size, int64_t pts)
+{
+    int pkt_frame = 0;
+    RET_CODE ret = RET_OK;
+    AVPacket *packet = encoder->Encode(yuv, size, pts, &pkt_frame, &ret);
+    if(packet) {
+        av_packet_free(&packet);
+    }
+}
+
+// 按帧率等待到第index帧的采集时间
+static void wait_frame(int64_t begin, int index, int fps)
+{
+    int64_t due = begin + (int64_t)index * 1000000 / fps;
+    int64_t now = TimesUtil::GetTimeMicrosecond();
+    if(due > now) {
+        std::this_thread::sleep_for(std::chrono::microseconds(due - now));
+    }
+}
+
+static int run_shared(const BenchConfig &cfg, const std::vector<VideoLayer> &layers, int64_t *dropped)
+{
+    int frame_size = cfg.width * cfg.height * 3 / 2;
+    YuvSource source(cfg.yuv_name, frame_size);
+    H264Encoder encoder;
+    AudioPipeline audio;
+    ScaleCascade cascade;
+    if(init_encoder(&encoder, cfg.width, cfg.height, cfg.fps, cfg.bitrate) != 0 || audio.Init() != 0
+            || cascade.Init(cfg.width, cfg.height, layers) != RET_OK) {
+        return -1;
+    }
+    std::vector<SimulcastLayer *> workers;
+    for(size_t i = 0; i < layers.size(); i++) {
+        SimulcastLayer *worker = new SimulcastLayer();
+        Properties properties;
+        properties.SetProperty("width", layers[i].width);
+        properties.SetProperty("height", layers[i].height);
+        properties.SetProperty("fps", cfg.fps);
+        properties.SetProperty("bitrate", layers[i].bitrate);
+        properties.SetProperty("gop", cfg.fps);
+        if(worker->Init(properties) != RET_OK) {
+            return -1;
+        }
+        worker->Start();
+        workers.push_back(worker);
+    }
+
+    int64_t begin = TimesUtil::GetTimeMicrosecond();
+    for(int i = 0; i < cfg.frames; i++) {
+        wait_frame(begin, i, cfg.fps);
+        uint8_t *yuv = source.Read();
+        if(!yuv) {
+            printf("read %s failed\n", cfg.yuv_name);
+            return -1;
+        }
+        int64_t pts = (int64_t)i * 1000 / cfg.fps;
+        cascade.Scale(yuv);
+        for(size_t j = 0; j < workers.size(); j++) {
+            workers[j]->Submit(cascade.GetFrame(j), pts);
+        }
+        encode_frame(&encoder, yuv, frame_size, pts);
+        audio.EncodeUntil(pts);
+    }
+    *dropped = 0;
+    for(size_t j = 0; j < workers.size(); j++) {
+        SimulcastLayerStats stats;
+        workers[j]->GetStats(&stats);
+        *dropped += stats.dropped_frames;
+        delete workers[j];
+    }
+    return 0;
+}
+
+// 一个独立的流水线，相当于一个只推一个分辨率的PushWork进程
+static void run_separate_pipeline(const BenchConfig &cfg, VideoLayer layer, int *result)
+{
+    *result = -1;
+    int src_size = cfg.width * cfg.height * 3 / 2;
+    YuvSource source(cfg.yuv_name, src_size);
+    H264Encoder encoder;
+    AudioPipeline audio;
+    ScaleCascade scale;                                 // 只有一级，直接从原始帧缩放
+    std::vector<VideoLayer> levels;
+    bool need_scale = layer.width != cfg.width || layer.height != cfg.height;
+    if(need_scale) {
+        levels.push_back(layer);
+    }
+    if(init_encoder(&encoder, layer.width, layer.height, cfg.fps, layer.bitrate) != 0 || audio.Init() != 0
+            || scale.Init(cfg.width, cfg.height, levels) != RET_OK) {
+        return;
+    }
+    int64_t begin = TimesUtil::GetTimeMicrosecond();
+    for(int i = 0; i < cfg.frames; i++) {
+        wait_frame(begin, i, cfg.fps);
+        uint8_t *yuv = source.Read();
+        if(!yuv) {
+            return;
+        }
+        int64_t pts = (int64_t)i * 1000 / cfg.fps;
+        if(need_scale) {
+            scale.Scale(yuv);
+            encode_frame(&encoder, scale.GetFrame(0), scale.GetFrameSize(0), pts);
+        } else {
+            encode_frame(&encoder, yuv, src_size, pts);
+        }
+        audio.EncodeUntil(pts);
+    }
+    *result = 0;
+}
+
+static int run_separate(const BenchConfig &cfg, const std::vector<VideoLayer> &layers)
+{
+    std::vector<VideoLayer> all;
+    VideoLayer main_layer = {cfg.width, cfg.height, cfg.bitrate};
+    all.push_back(main_layer);
+    all.insert(all.end(), layers.begin(), layers.end());
+    std::vector<int> results(all.size());
+    std::vector<std::thread *> threads;
+    for(size_t i = 0; i < all.size(); i++) {
+        threads.push_back(new std::thread(run_separate_pipeline, std::cref(cfg), all[i], &results[i]));
+    }
+    int ret = 0;
+    for(size_t i = 0; i < threads.size(); i++) {
+        threads[i]->join();
+        delete threads[i];
+        ret |= results[i];
+    }
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    BenchConfig cfg;
+    cfg.yuv_name = argc > 1 ? argv[1] : "720x480_25fps_420p.yuv";
+    cfg.width = 768;
+    cfg.height = 480;
+    if(argc > 2) {
+        sscanf(argv[2], "%dx%d", &cfg.width, &cfg.height);
+    }
+    cfg.fps = argc > 3 ? atoi(argv[3]) : 25;
+    cfg.bitrate = (argc > 4 ? atoi(argv[4]) : 1024) * 1024;
+    const char *layers_str = argc > 5 ? argv[5] : "512x320@512,256x160@192";
+    cfg.frames = argc > 6 ? atoi(argv[6]) : 250;
+    init_logger("simulcastbench.log", S_WARN);
+
+    std::vector<VideoLayer> layers;
+    if(ParseVideoLayers(layers_str, &layers) != RET_OK || layers.empty()) {
+        printf("invalid layers: %s\n", layers_str);
+        return -1;
+    }
+    printf("source %dx%d@%dfps %dkbps, layers %s, %d frames\n", cfg.width, cfg.height, cfg.fps,
+           cfg.bitrate / 1024, layers_str, cfg.frames);
+
+    double seconds = (double)cfg.frames / cfg.fps;
+    printf("mode       cpu(ms)   cpu(%%)   dropped\n");
+    int64_t cpu_begin = TimesUtil::GetProcessCpuMicrosecond();
+    int64_t dropped = 0;
+    if(run_shared(cfg, layers, &dropped) != 0) {
+        printf("shared run failed\n");
+        return -1;
+    }
+    double shared_cpu = (TimesUtil::GetProcessCpuMicrosecond() - cpu_begin) / 1000.0;
+    printf("shared     %-9.0lf %-8.1lf %lld\n", shared_cpu, shared_cpu / 10.0 / seconds, (long long)dropped);
+
+    cpu_begin = TimesUtil::GetProcessCpuMicrosecond();
+    if(run_separate(cfg, layers) != 0) {
+        printf("separate run failed\n");
+        return -1;
+    }
+    double separate_cpu = (TimesUtil::GetProcessCpuMicrosecond() - cpu_begin) / 1000.0;
+    printf("separate   %-9.0lf %-8.1lf -\n", separate_cpu, separate_cpu / 10.0 / seconds);
+    if(separate_cpu > 0) {
+        printf("shared saves %.1lf%% cpu against %d separate processes\n",
+               100.0 - shared_cpu * 100.0 / separate_cpu, (int)layers.size() + 1);
+    }
+    return 0;
+}
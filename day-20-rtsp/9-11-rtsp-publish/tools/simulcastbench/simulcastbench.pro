@@ -0,0 +1,27 @@
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle
+CONFIG -= qt
+
+# 复用推流端的编码器与多分辨率层源码
+PUBLISH_DIR = $$PWD/../..
+INCLUDEPATH += $$PUBLISH_DIR
+
+win32 {
+INCLUDEPATH += $$PUBLISH_DIR/ffmpeg-4.2.1-win32-dev/include
+LIBS += $$PUBLISH_DIR/ffmpeg-4.2.1-win32-dev/lib/avcodec.lib    \
+        $$PUBLISH_DIR/ffmpeg-4.2.1-win32-dev/lib/avutil.lib     \
+        $$PUBLISH_DIR/ffmpeg-4.2.1-win32-dev/lib/swscale.lib
+}
+unix {
+LIBS += -lavcodec -lavutil -lswscale -lpthread
+}
+
+SOURCES += main.cpp \
+    $$PUBLISH_DIR/dlog.cpp \
+    $$PUBLISH_DIR/commonlooper.cpp \
+    $$PUBLISH_DIR/nalparser.cpp \
+    $$PUBLISH_DIR/h264encoder.cpp \
+    $$PUBLISH_DIR/audioencoder.cpp \
+    $$PUBLISH_DIR/aacencoder.cpp \
+    $$PUBLISH_DIR/simulcast.cpp
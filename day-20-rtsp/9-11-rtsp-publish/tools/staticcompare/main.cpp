@@ -0,0 +1,143 @@
+﻿/**
+ * 对比静止画面检测的三种模式(关闭、跳过编码、提高qp)在静止与运动两个测试片段上的编码cpu耗时与码率。
+ * 静止片段由yuv文件的第一帧重复组成，并加上±1的随机噪声模拟采集噪声；运动片段就是yuv文件本身(循环读取)。
+ *
+ * 用法：staticcompare [yuv文件] [宽] [高] [帧率] [码率kbps] [帧数]
+ * 缺省使用推流端自带的测试文件 720x480_25fps_420p.yuv(注意实际分辨率是768x480)。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include "dlog.h"
+#include "h264encoder.h"
+#include "staticscenedetector.h"
+
+typedef struct scene_result
+{
+    int64_t encoded_frames;
+    int64_t bytes;
+    double  cpu_ms;                     // 检测+编码的进程cpu时间
+    double  detect_us;                  // 平均每帧的检测耗时
+}SceneResult;
+
+static int load_clip(const char *yuv_name, int frame_size, int frames, bool still, std::vector<uint8_t> *clip)
+{
+    FILE *fp = fopen(yuv_name, "rb");
+    if(!fp) {
+        printf("open %s failed\n", yuv_name);
+        return -1;
+    }
+    clip->resize((size_t)frame_size * frames);
+    srand(1);
+    for(int i = 0; i < frames; i++) {
+        uint8_t *frame = &(*clip)[(size_t)frame_size * i];
+        if(still && i > 0) {
+            memcpy(frame, &(*clip)[0], frame_size);
+            for(int j = 0; j < frame_size; j += 3) {
+                int v = frame[j] + rand() % 3 - 1;
+                frame[j] = (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+            }
+            continue;
+        }
+        if(fread(frame, 1, frame_size, fp) != (size_t)frame_size) {
+            fseek(fp, 0, SEEK_SET);             // 文件太短就循环读取
+            if(fread(frame, 1, frame_size, fp) != (size_t)frame_size) {
+                printf("read yuv failed\n");
+                fclose(fp);
+                return -1;
+            }
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static int run(const std::vector<uint8_t> &clip, int width, int height, int fps, int bitrate, int frames,
+               int mode, SceneResult *result)
+{
+    memset(result, 0, sizeof(SceneResult));
+    H264Encoder encoder;
+    Properties properties;
+    properties.SetProperty("width", width);
+    properties.SetProperty("height", height);
+    properties.SetProperty("fps", fps);
+    properties.SetProperty("bitrate", bitrate);
+    properties.SetProperty("gop", fps);
+    if(encoder.Init(properties) != RET_OK) {
+        printf("H264Encoder Init failed\n");
+        return -1;
+    }
+    StaticSceneDetector detector;
+    Properties scene_properties;
+    scene_properties.SetProperty("width", width);
+    scene_properties.SetProperty("height", height);
+    scene_properties.SetProperty("mode", mode == 1 ? "skip" : "qp");
+    scene_properties.SetProperty("max_skip_frames", fps);
+    detector.Init(scene_properties);
+
+    int frame_size = width * height * 3 / 2;
+    clock_t begin = clock();
+    for(int i = 0; i < frames; i++) {
+        uint8_t *yuv = (uint8_t *)&clip[(size_t)frame_size * i];
+        if(mode > 0) {
+            SceneAction action = detector.Process(yuv, width);
+            if(SCENE_SKIP == action) {
+                continue;
+            }
+            encoder.SetQpOffset(SCENE_STATIC == action ? 6 : 0);
+        }
+        int pkt_frame = 0;
+        RET_CODE ret = RET_OK;
+        AVPacket *packet = encoder.Encode(yuv, frame_size, i * 1000 / fps, &pkt_frame, &ret);
+        result->encoded_frames++;
+        if(packet) {
+            result->bytes += packet->size;
+            av_packet_free(&packet);
+        }
+    }
+    result->cpu_ms = (clock() - begin) * 1000.0 / CLOCKS_PER_SEC;
+    SceneStats stats;
+    detector.GetStats(&stats);
+    result->detect_us = stats.frames > 0 ? (double)stats.detect_time / stats.frames : 0;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *yuv_name = argc > 1 ? argv[1] : "720x480_25fps_420p.yuv";
+    int width           = argc > 2 ? atoi(argv[2]) : 768;
+    int height          = argc > 3 ? atoi(argv[3]) : 480;
+    int fps             = argc > 4 ? atoi(argv[4]) : 25;
+    int bitrate         = (argc > 5 ? atoi(argv[5]) : 512) * 1024;
+    int frames          = argc > 6 ? atoi(argv[6]) : 250;
+
+    init_logger("staticcompare.log", S_WARN);
+
+    const char *clip_names[] = {"static", "moving"};
+    const char *mode_names[] = {"off", "skip", "qp"};
+    int frame_size = width * height * 3 / 2;
+    double seconds = (double)frames / fps;
+    printf("clip     mode   encoded  kbps      cpu(ms)   detect(us/frame)  cpu saved\n");
+    for(int c = 0; c < 2; c++) {
+        std::vector<uint8_t> clip;
+        if(load_clip(yuv_name, frame_size, frames, c == 0, &clip) != 0) {
+            return -1;
+        }
+        double base_cpu = 0;
+        for(int mode = 0; mode < 3; mode++) {
+            SceneResult r;
+            if(run(clip, width, height, fps, bitrate, frames, mode, &r) != 0) {
+                return -1;
+            }
+            if(mode == 0) {
+                base_cpu = r.cpu_ms;
+            }
+            printf("%-8s %-6s %-8lld %-9.1lf %-9.1lf %-17.1lf %.1lf%%\n", clip_names[c], mode_names[mode],
+                   (long long)r.encoded_frames, r.bytes * 8 / 1000.0 / seconds, r.cpu_ms, r.detect_us,
+                   base_cpu > 0 ? 100.0 - r.cpu_ms * 100.0 / base_cpu : 0);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,19 @@
+﻿# 推流端的辅助工具，每个工具是一个独立的可执行程序
+TEMPLATE = subdirs
+
+SUBDIRS += \
+    rtspreceiver \
+    gopcompare \
+    rtspbench \
+    dtxcompare \
+    staticcompare \
+    simulcastbench \
+    audiocompare \
+    governorbench \
+    microbench \
+    hlsprobe \
+    shmproducer \
+    passthroughbench \
+    latencyanalyzer \
+    netimpair \
+    nalfuzz
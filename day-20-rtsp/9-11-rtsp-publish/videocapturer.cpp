@@ -17,6 +17,12 @@ VideoCapturer::~VideoCapturer()
     if(yuv_fp_) {
         fclose(yuv_fp_);
     }
+    if(pattern_) {
+        delete pattern_;
+    }
+    if(shm_) {
+        delete shm_;
+    }
 }
 
 /**
@@ -27,6 +33,10 @@ VideoCapturer::~VideoCapturer()
  *          "height"            高度，缺省为屏幕高度
  *          "pixel_format"      像素格式，AVPixelFormat对应的值，缺省为AV_PIX_FMT_YUV420P
  *          "fps"               帧数，缺省为25
+ *          "source"            file 读input_yuv_name文件(缺省)，pattern 合成测试图像，shm 从共享内存读取外部采集进程的帧
+ *          "pattern" "noise_bits" "seed" "counter" 测试图像的参数，见VideoPattern::Init
+ *          "shm_name"          共享内存名字，缺省/push_video
+ *          "shm_timeout"       等待采集进程创建共享内存的时长，缺省5000ms
  *
  * @return success 0 fail return a negative number。
  */
@@ -42,6 +52,25 @@ RET_CODE VideoCapturer::Init(const Properties &properties)
     pixel_format_       = properties.GetProperty("pixel_format", 0);
     fps_                = properties.GetProperty("fps", 25);
     frame_duration_     = 1000.0 / fps_;                                                // 单位是毫秒的
+    source_             = properties.GetProperty("source", "file");
+
+    if(source_ == "pattern") {
+        pattern_ = new VideoPattern();
+        if(pattern_->Init(properties) != RET_OK) {
+            LogError("VideoPattern Init failed");
+            return RET_FAIL;
+        }
+        return RET_OK;
+    }
+    if(source_ == "shm") {
+        shm_name_ = properties.GetProperty("shm_name", "/push_video");
+        shm_ = new ShmRing();
+        if(shm_->Open(shm_name_, properties.GetProperty("shm_timeout", 5000)) != RET_OK) {
+            LogError("open shm %s failed", shm_name_.c_str());
+            return RET_FAIL;
+        }
+        return checkShmFormat();
+    }
 
     // 打开文件
     if(openYuvFile(input_yuv_name_.c_str()) != 0)
@@ -77,6 +106,10 @@ void VideoCapturer::Loop()
         if(request_abort_) {
             break;
         }
+        if(shm_) {
+            readShm();                                                          // 没有帧时在共享内存上等待，不需要sleep
+            continue;
+        }
 
         if(readYuvFile(yuv_buf_, yuv_buf_size) == 0)
         {
@@ -148,6 +181,11 @@ int VideoCapturer::readYuvFile(uint8_t *yuv_buf, int32_t yuv_buf_size)
         return 1;
 
     // 2 该读取数据了
+    if(pattern_) {
+        pattern_->Fill(yuv_buf, frame_index_++);
+        yuv_total_duration_ += frame_duration_;
+        return 0;
+    }
     size_t ret = fread(yuv_buf, 1, yuv_buf_size, yuv_fp_);
     if(ret != yuv_buf_size)
     {
@@ -167,6 +205,120 @@ int VideoCapturer::readYuvFile(uint8_t *yuv_buf, int32_t yuv_buf_size)
     return 0;
 }
 
+/**
+ * @brief 从共享内存取一帧交给编码回调。平面紧密排列时直接把slot的地址交给编码器，不拷贝，编码回调返回后才释放slot；
+ *          行字节数有填充时先拷贝到yuv_buf_。采集进程退出后每秒尝试重新打开一次，采集进程重启后自动恢复。
+ *          帧的节奏由采集进程决定，pts仍由编码回调打，取到帧与采集之间只有微秒级的延时，详看logShmStats。
+ * @return void。
+ */
+void VideoCapturer::readShm()
+{
+    int64_t now = TimesUtil::GetTimeMillisecond();
+    if(!shm_->GetHeader()) {
+        msleep(100);                                                    // 重新打开失败，Acquire不会等待
+    }
+    const ShmSlot *slot = shm_->Acquire(100);
+    if(!slot) {
+        if(now - shm_frame_time_ > 1000 && !shm_->ProducerAlive()) {
+            LogWarn("shm %s producer is gone, reopen", shm_name_.c_str());
+            // 重启后的采集进程可能换了格式，与Init一样检查，不一致时关闭，下一秒再试
+            if(shm_->Open(shm_name_, 0) == RET_OK && checkShmFormat() != RET_OK) {
+                shm_->Close();
+            }
+            shm_frame_time_ = now;
+        }
+        return;
+    }
+    shm_frame_time_ = now;
+    if(slot->width != width_ || slot->height != height_) {
+        LogError("shm frame %dx%d mismatch, drop", slot->width, slot->height);
+        shm_->Release();
+        return;
+    }
+    // stride由采集进程写入，不能信任：行字节数不能小于平面的宽度，所有平面加起来不能超出slot的数据区
+    int half_width = (width_ + 1) / 2;
+    int half_height = (height_ + 1) / 2;
+    int64_t plane_bytes = 0;
+    bool stride_valid = true;
+    for(int plane = 0; plane < 3; plane++) {
+        int w = plane == 0 ? width_ : half_width;
+        int h = plane == 0 ? height_ : half_height;
+        if(slot->stride[plane] < w) {
+            stride_valid = false;
+            break;
+        }
+        plane_bytes += (int64_t)h * slot->stride[plane];
+    }
+    if(!stride_valid || plane_bytes > shm_->GetHeader()->data_size) {
+        LogError("shm frame stride %d/%d/%d invalid, drop", slot->stride[0], slot->stride[1], slot->stride[2]);
+        shm_->Release();
+        return;
+    }
+    if(!is_first_frame_) {
+        is_first_frame_ = true;
+        LogInfo("%s:t%u", AVPublishTime::GetInstance()->getVInTag(),
+                AVPublishTime::GetInstance()->getCurrenTime());
+    }
+
+    uint8_t *data = shm_->GetData(slot);
+    if(slot->stride[0] != width_ || slot->stride[1] != half_width || slot->stride[2] != half_width) {
+        // 按行拷贝到紧密排列的yuv_buf_，平面在slot中仍然是y、u、v依次排列
+        uint8_t *dst = yuv_buf_;
+        const uint8_t *src = data;
+        for(int plane = 0; plane < 3; plane++) {
+            int w = plane == 0 ? width_ : half_width;
+            int h = plane == 0 ? height_ : half_height;
+            for(int i = 0; i < h; i++) {
+                memcpy(dst, src + (size_t)i * slot->stride[plane], w);
+                dst += w;
+            }
+            src += (size_t)h * slot->stride[plane];
+        }
+        data = yuv_buf_;
+        shm_repacked_++;
+    }
+    if(callable_object_) {
+        callable_object_(data, yuv_buf_size);
+    }
+    shm_->Release();
+    logShmStats();
+}
+
+/**
+ * @brief 检查共享内存的格式，格式由采集进程决定，必须与编码器的配置一致，编码器不做缩放与转换。
+ * @return 成功 0 失败 other
+ */
+RET_CODE VideoCapturer::checkShmFormat()
+{
+    const ShmRingHeader *header = shm_->GetHeader();
+    if(header->media_type != E_VIDEO_TYPE || header->width != width_ || header->height != height_
+            || header->pixel_format != pixel_format_
+            || header->data_size < (uint32_t)((width_ + (width_ % 2)) * (height_ + (height_ % 2)) * 3 / 2)) {
+        LogError("shm %s format %dx%d fmt %d mismatch, need %dx%d fmt %d", shm_name_.c_str(),
+                 header->width, header->height, header->pixel_format, width_, height_, pixel_format_);
+        return RET_ERR_PARAMISMATCH;
+    }
+    return RET_OK;
+}
+
+/**
+ * @brief 每10秒打印一次共享内存采集的统计。
+ * @return void。
+ */
+void VideoCapturer::logShmStats()
+{
+    int64_t now = TimesUtil::GetTimeMillisecond();
+    if(now - pre_shm_stats_time_ < 10000) {
+        return;
+    }
+    ShmRingStats stats;
+    shm_->GetStats(&stats);
+    LogInfo("video shm: frames-%lld, repacked-%lld, producer dropped-%u, ingest latency avg-%lldus max-%lldus",
+            stats.slots, shm_repacked_, stats.dropped,
+            stats.slots > 0 ? stats.latency_sum / stats.slots : 0, stats.max_latency);
+    pre_shm_stats_time_ = now;
+}
+
 /**
  * @brief 关闭一个已经打开的文件。
  * @return no mean。
@@ -175,6 +327,7 @@ int VideoCapturer::closeYuvFile()
 {
     if(yuv_fp_)
         fclose(yuv_fp_);
+    yuv_fp_ = NULL;                                                                     // 析构时不再重复关闭
     return 0;
 }
 
@@ -4,6 +4,8 @@
 #include <functional>
 #include "commonlooper.h"
 #include "mediabase.h"
+#include "testpattern.h"
+#include "shmring.h"
 using std::function;
 
 
@@ -23,6 +25,7 @@ private:
 
     int video_test_ = 0;                                                // 一种模式。这里为测试模式。
     std::string input_yuv_name_;                                        // 输入yuv文件名字，用于测试
+    std::string source_;                                                // file 读yuv文件，pattern 合成测试图像，shm 共享内存
     int x_;                                                             // 采集的左上角起始坐标
     int y_;
     int width_ = 0;
@@ -41,6 +44,18 @@ private:
     FILE *yuv_fp_ = NULL;
     uint8_t *yuv_buf_ = NULL;                                           // 一帧缓存
     int yuv_buf_size = 0;                                               // 一帧的字节大小
+    VideoPattern *pattern_ = NULL;                                      // source_为pattern时生成测试图像
+    int64_t frame_index_ = 0;
+
+    // 共享内存采集，外部采集进程写入，详看ShmRing
+    void readShm();
+    RET_CODE checkShmFormat();
+    void logShmStats();
+    ShmRing *shm_ = NULL;
+    std::string shm_name_;
+    int64_t shm_frame_time_ = 0;                                        // 最后一次取到帧的时间，长时间没有帧时检查生产者
+    int64_t shm_repacked_ = 0;                                          // 行字节数不紧密、需要重新拷贝的帧数
+    int64_t pre_shm_stats_time_ = 0;
 
 
     function<void(uint8_t*, int32_t)> callable_object_ = NULL;          // 保存上层回调，采集到的数据，交由该回调处理，一般是编码。
@@ -0,0 +1,369 @@
+﻿#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "videocompositor.h"
+#include "dlog.h"
+#include "timesutil.h"
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+#if defined(__AVX2__)
+#define COMPOSITOR_USE_AVX2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define COMPOSITOR_USE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+RET_CODE ParseVideoOverlays(const std::string &str, std::vector<VideoOverlay> *overlays)
+{
+    overlays->clear();
+    size_t begin = 0;
+    while(begin < str.size()) {
+        size_t end = str.find(';', begin);
+        if(end == std::string::npos) {
+            end = str.size();
+        }
+        std::string item = str.substr(begin, end - begin);
+        VideoOverlay overlay;
+        overlay.alpha = 255;
+        size_t at = item.rfind('@');
+        size_t first = item.find(':');
+        size_t last = at == std::string::npos ? std::string::npos : item.rfind(':', at);
+        int count = 0;
+        if(at != std::string::npos && first != std::string::npos && last != std::string::npos && first < last) {
+            overlay.source = item.substr(0, first);
+            overlay.arg = item.substr(first + 1, last - first - 1);
+            count = sscanf(item.substr(last + 1, at - last - 1).c_str(), "%dx%d", &overlay.src_width, &overlay.src_height);
+            count += sscanf(item.c_str() + at + 1, "%d,%d,%dx%d,%d", &overlay.x, &overlay.y, &overlay.width,
+                            &overlay.height, &overlay.alpha);
+        }
+        if(count < 6 || overlay.arg.empty() || (overlay.source != "file" && overlay.source != "pattern"
+                                                && overlay.source != "shm" && overlay.source != "image")
+                || overlay.src_width <= 0 || overlay.src_height <= 0 || (overlay.src_width & 1) || (overlay.src_height & 1)
+                || overlay.x < 0 || overlay.y < 0 || (overlay.x & 1) || (overlay.y & 1)
+                || overlay.width <= 0 || overlay.height <= 0 || (overlay.width & 1) || (overlay.height & 1)
+                || overlay.alpha < 0 || overlay.alpha > 255) {
+            LogError("invalid video overlay: %s", item.c_str());
+            return RET_ERR_PARAMISMATCH;
+        }
+        overlays->push_back(overlay);
+        begin = end + 1;
+    }
+    return RET_OK;
+}
+
+VideoCompositor::VideoCompositor()
+{
+    memset(&stats_, 0, sizeof(VideoCompositorStats));
+}
+
+VideoCompositor::~VideoCompositor()
+{
+    for(size_t i = 0; i < layers_.size(); i++) {
+        sws_freeContext(layers_[i].sws);
+        sws_freeContext(layers_[i].alpha_sws);
+        delete layers_[i].mutex;
+    }
+}
+
+/**
+ * @brief 为每一层分配缓冲，源与叠加的大小不同时创建缩放上下文。
+ * @param width height 主画面的宽高。
+ * @return 成功 0 失败 other
+ */
+RET_CODE VideoCompositor::Init(int width, int height, const std::vector<VideoOverlay> &overlays)
+{
+    width_ = width;
+    height_ = height;
+    layers_.resize(overlays.size());
+    for(size_t i = 0; i < overlays.size(); i++) {
+        OverlayLayer &layer = layers_[i];
+        layer.config = overlays[i];
+        layer.sws = NULL;
+        layer.alpha_sws = NULL;
+        layer.mutex = new PushMutex(PUSH_LOCK_SITE("video_compositor_layer"));
+        const VideoOverlay &config = layer.config;
+        if(config.x + config.width > width_ || config.y + config.height > height_) {
+            LogError("overlay %d at %d,%d %dx%d is outside of %dx%d", (int)i, config.x, config.y, config.width,
+                     config.height, width_, height_);
+            return RET_ERR_PARAMISMATCH;
+        }
+        if(config.src_width != config.width || config.src_height != config.height) {
+            layer.sws = sws_getContext(config.src_width, config.src_height, AV_PIX_FMT_YUV420P, config.width,
+                                       config.height, AV_PIX_FMT_YUV420P, SWS_BILINEAR, NULL, NULL, NULL);
+            if(!layer.sws) {
+                LogError("sws_getContext %dx%d->%dx%d failed", config.src_width, config.src_height, config.width,
+                         config.height);
+                return RET_FAIL;
+            }
+        }
+        for(int k = 0; k < 3; k++) {
+            layer.buffers[k].yuv.resize(config.width * config.height * 3 / 2);
+        }
+        layer.back = &layer.buffers[0];
+        layer.middle = &layer.buffers[1];
+        layer.front = &layer.buffers[2];
+        layer.has_new = false;
+        layer.has_frame = false;
+        LogInfo("overlay %d: %s:%s %dx%d -> %d,%d %dx%d, alpha: %d", (int)i, config.source.c_str(), config.arg.c_str(),
+                config.src_width, config.src_height, config.x, config.y, config.width, config.height, config.alpha);
+    }
+    return RET_OK;
+}
+
+/**
+ * @brief 送入一层的新的一帧，在叠加源的线程调用(每一层只能有一个线程调用)，缩放与alpha的预处理都在这里完成。
+ * @param yuv 源大小的紧凑yuv420p。
+ * @param alpha 源大小的逐像素alpha，0-255，NULL表示只使用整体的alpha。
+ * @return void。
+ */
+void VideoCompositor::SetOverlayFrame(int index, const uint8_t *yuv, const uint8_t *alpha)
+{
+    if(index < 0 || index >= (int)layers_.size()) {
+        return;
+    }
+    int64_t begin = TimesUtil::GetTimeMicrosecond();
+    OverlayLayer &layer = layers_[index];
+    const VideoOverlay &config = layer.config;
+    OverlayBuffer *buffer = layer.back;
+    if(layer.sws) {
+        uint8_t *src_data[4], *dst_data[4];
+        int src_linesize[4], dst_linesize[4];
+        av_image_fill_arrays(src_data, src_linesize, yuv, AV_PIX_FMT_YUV420P, config.src_width, config.src_height, 1);
+        av_image_fill_arrays(dst_data, dst_linesize, &buffer->yuv[0], AV_PIX_FMT_YUV420P, config.width, config.height, 1);
+        sws_scale(layer.sws, src_data, src_linesize, 0, config.src_height, dst_data, dst_linesize);
+    } else {
+        memcpy(&buffer->yuv[0], yuv, buffer->yuv.size());
+    }
+
+    if(alpha) {
+        int plane = config.width * config.height;
+        int chroma_width = config.width / 2;
+        buffer->alpha.resize(plane + plane / 4);
+        uint8_t *a = &buffer->alpha[0];
+        if(layer.sws) {
+            if(!layer.alpha_sws) {
+                layer.alpha_sws = sws_getContext(config.src_width, config.src_height, AV_PIX_FMT_GRAY8, config.width,
+                                                 config.height, AV_PIX_FMT_GRAY8, SWS_BILINEAR, NULL, NULL, NULL);
+            }
+            int src_linesize = config.src_width;
+            int dst_linesize = config.width;
+            if(layer.alpha_sws) {
+                sws_scale(layer.alpha_sws, &alpha, &src_linesize, 0, config.src_height, &a, &dst_linesize);
+            } else {
+                memset(a, 255, plane);
+            }
+        } else {
+            memcpy(a, alpha, plane);
+        }
+        // 与整体的alpha合成，之后Compose只用逐像素的alpha
+        if(config.alpha != 255) {
+            int global = config.alpha + (config.alpha >> 7);
+            for(int i = 0; i < plane; i++) {
+                a[i] = (uint8_t)((a[i] * global) >> 8);
+            }
+        }
+        // 色度平面的alpha取2x2的平均
+        uint8_t *chroma = a + plane;
+        for(int y = 0; y < config.height / 2; y++) {
+            const uint8_t *row0 = a + 2 * y * config.width;
+            const uint8_t *row1 = row0 + config.width;
+            for(int x = 0; x < chroma_width; x++) {
+                chroma[y * chroma_width + x] = (uint8_t)((row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2);
+            }
+        }
+    } else {
+        buffer->alpha.clear();
+    }
+
+    {
+        std::lock_guard<PushMutex> lock(*layer.mutex);
+        std::swap(layer.back, layer.middle);
+        layer.has_new = true;
+    }
+    std::lock_guard<PushMutex> lock(stats_mutex_);
+    stats_.overlay_frames++;
+    stats_.scale_time += TimesUtil::GetTimeMicrosecond() - begin;
+}
+
+/**
+ * @brief 把各层最新的一帧按顺序叠加到主画面上，后面的层在上面。
+ * @param yuv 主画面，width*height的紧凑yuv420p，原地修改。
+ * @return void。
+ */
+void VideoCompositor::Compose(uint8_t *yuv)
+{
+    int64_t begin = TimesUtil::GetTimeMicrosecond();
+    uint8_t *y_plane = yuv;
+    uint8_t *u_plane = y_plane + width_ * height_;
+    uint8_t *v_plane = u_plane + (width_ / 2) * (height_ / 2);
+    int chroma_stride = width_ / 2;
+    for(size_t i = 0; i < layers_.size(); i++) {
+        OverlayLayer &layer = layers_[i];
+        {
+            std::lock_guard<PushMutex> lock(*layer.mutex);
+            if(layer.has_new) {
+                std::swap(layer.middle, layer.front);
+                layer.has_new = false;
+                layer.has_frame = true;
+            }
+        }
+        if(!layer.has_frame) {
+            continue;                                   // 叠加源还没有送来第一帧
+        }
+        const VideoOverlay &config = layer.config;
+        const OverlayBuffer *buffer = layer.front;
+        int plane = config.width * config.height;
+        const uint8_t *alpha = buffer->alpha.empty() ? NULL : &buffer->alpha[0];
+        const uint8_t *chroma_alpha = alpha ? alpha + plane : NULL;
+        blendPlane(y_plane + config.y * width_ + config.x, width_, &buffer->yuv[0], alpha,
+                   config.width, config.height, config.alpha);
+        int offset = (config.y / 2) * chroma_stride + config.x / 2;
+        blendPlane(u_plane + offset, chroma_stride, &buffer->yuv[plane], chroma_alpha,
+                   config.width / 2, config.height / 2, config.alpha);
+        blendPlane(v_plane + offset, chroma_stride, &buffer->yuv[plane + plane / 4], chroma_alpha,
+                   config.width / 2, config.height / 2, config.alpha);
+    }
+    int64_t cost = TimesUtil::GetTimeMicrosecond() - begin;
+    std::lock_guard<PushMutex> lock(stats_mutex_);
+    stats_.frames++;
+    stats_.compose_time += cost;
+    stats_.max_compose_time = std::max(stats_.max_compose_time, cost);
+}
+
+/**
+ * @brief 混合一个平面的叠加区域。
+ * @param dst 主画面上叠加区域的左上角，行字节数dst_stride。
+ * @param src 叠加层的平面，紧凑存放。
+ * @param alpha 与src同样大小的逐像素alpha，NULL时使用global_alpha。
+ * @return void。
+ */
+void VideoCompositor::blendPlane(uint8_t *dst, int dst_stride, const uint8_t *src, const uint8_t *alpha,
+                                 int width, int height, int global_alpha)
+{
+    if(!alpha && global_alpha == 0) {
+        return;
+    }
+    for(int y = 0; y < height; y++) {
+        uint8_t *dst_row = dst + y * dst_stride;
+        const uint8_t *src_row = src + y * width;
+        if(alpha) {
+            BlendRowAlpha(dst_row, src_row, alpha + y * width, width);
+        } else if(global_alpha == 255) {
+            memcpy(dst_row, src_row, width);
+        } else {
+            BlendRow(dst_row, src_row, width, global_alpha);
+        }
+    }
+}
+
+/**
+ * @brief dst = (src*a + dst*(256-a) + 128) >> 8，a = alpha + (alpha>>7)。
+ * @param alpha 整行相同的alpha，0-255。
+ * @return void。
+ */
+void VideoCompositor::BlendRow(uint8_t *dst, const uint8_t *src, int width, int alpha)
+{
+    int a = alpha + (alpha >> 7);
+    int i = 0;
+#if defined(COMPOSITOR_USE_AVX2)
+    __m256i va = _mm256_set1_epi16((int16_t)a);
+    __m256i via = _mm256_set1_epi16((int16_t)(256 - a));
+    __m256i round = _mm256_set1_epi16(128);
+    __m256i zero = _mm256_setzero_si256();
+    for(; i + 32 <= width; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        // unpack与packus都在128位的lane内，互为逆操作，顺序保持不变
+        __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(s, zero), va),
+                                      _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), via));
+        __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(s, zero), va),
+                                      _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), via));
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, round), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, round), 8);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+#elif defined(COMPOSITOR_USE_SSE2)
+    __m128i va = _mm_set1_epi16((int16_t)a);
+    __m128i via = _mm_set1_epi16((int16_t)(256 - a));
+    __m128i round = _mm_set1_epi16(128);
+    __m128i zero = _mm_setzero_si128();
+    for(; i + 16 <= width; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        // 乘积与和最大255*256+128，在16位无符号的范围内
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), va),
+                                   _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), via));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), va),
+                                   _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), via));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for(; i < width; i++) {
+        dst[i] = (uint8_t)((src[i] * a + dst[i] * (256 - a) + 128) >> 8);
+    }
+}
+
+/**
+ * @brief 逐像素alpha的混合，公式与BlendRow相同。
+ * @return void。
+ */
+void VideoCompositor::BlendRowAlpha(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, int width)
+{
+    int i = 0;
+#if defined(COMPOSITOR_USE_AVX2)
+    __m256i full = _mm256_set1_epi16(256);
+    __m256i round = _mm256_set1_epi16(128);
+    __m256i zero = _mm256_setzero_si256();
+    for(; i + 32 <= width; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i a = _mm256_loadu_si256((const __m256i *)(alpha + i));
+        __m256i a_lo = _mm256_unpacklo_epi8(a, zero);
+        __m256i a_hi = _mm256_unpackhi_epi8(a, zero);
+        a_lo = _mm256_add_epi16(a_lo, _mm256_srli_epi16(a_lo, 7));
+        a_hi = _mm256_add_epi16(a_hi, _mm256_srli_epi16(a_hi, 7));
+        __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(s, zero), a_lo),
+                                      _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_sub_epi16(full, a_lo)));
+        __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(s, zero), a_hi),
+                                      _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_sub_epi16(full, a_hi)));
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, round), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, round), 8);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+#elif defined(COMPOSITOR_USE_SSE2)
+    __m128i full = _mm_set1_epi16(256);
+    __m128i round = _mm_set1_epi16(128);
+    __m128i zero = _mm_setzero_si128();
+    for(; i + 16 <= width; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i a = _mm_loadu_si128((const __m128i *)(alpha + i));
+        __m128i a_lo = _mm_unpacklo_epi8(a, zero);
+        __m128i a_hi = _mm_unpackhi_epi8(a, zero);
+        a_lo = _mm_add_epi16(a_lo, _mm_srli_epi16(a_lo, 7));
+        a_hi = _mm_add_epi16(a_hi, _mm_srli_epi16(a_hi, 7));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), a_lo),
+                                   _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(full, a_lo)));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), a_hi),
+                                   _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(full, a_hi)));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for(; i < width; i++) {
+        int a = alpha[i] + (alpha[i] >> 7);
+        dst[i] = (uint8_t)((src[i] * a + dst[i] * (256 - a) + 128) >> 8);
+    }
+}
+
+void VideoCompositor::GetStats(VideoCompositorStats *stats)
+{
+    std::lock_guard<PushMutex> lock(stats_mutex_);
+    *stats = stats_;
+    memset(&stats_, 0, sizeof(VideoCompositorStats));
+}
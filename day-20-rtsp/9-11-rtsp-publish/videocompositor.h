@@ -0,0 +1,105 @@
+﻿#ifndef VIDEOCOMPOSITOR_H
+#define VIDEOCOMPOSITOR_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include "instrument.h"
+#include "mediabase.h"
+extern "C" {
+#include <libswscale/swscale.h>
+}
+
+// 一个叠加层的配置
+typedef struct video_overlay
+{
+    std::string source;                                 // file、pattern、shm与VideoCapturer的source相同，image为一张静态图
+    std::string arg;                                    // file、image为文件名，pattern为测试图像的类型，shm为共享内存名字
+    int src_width;                                      // 源的宽高
+    int src_height;
+    int x;                                              // 在主画面上的位置与大小，都是偶数
+    int y;
+    int width;
+    int height;
+    int alpha;                                          // 整体的不透明度，0-255，255为不透明
+}VideoOverlay;
+
+/**
+ * @brief 解析叠加层的配置，格式为"source:arg:源宽x源高@x,y,宽x高[,alpha]"，多个层用分号分隔，
+ *        例如"pattern:noise:1280x720@1440,60,400x224;image:logo_200x80.yuva:200x80@40,40,200x80,220"。
+ * @return 成功 0 失败 other
+ */
+RET_CODE ParseVideoOverlays(const std::string &str, std::vector<VideoOverlay> *overlays);
+
+// 合成的统计信息，GetStats之后清零
+typedef struct video_compositor_stats
+{
+    int64_t frames;                                     // 合成的帧数
+    int64_t compose_time;                               // Compose累计耗时，单位us
+    int64_t max_compose_time;
+    int64_t overlay_frames;                             // SetOverlayFrame收到的帧数(所有层)
+    int64_t scale_time;                                 // SetOverlayFrame缩放累计耗时，单位us，在叠加源的线程
+}VideoCompositorStats;
+
+/**
+ * 画中画合成：在编码之前把一个或者多个yuv420p的源(第二路摄像头、台标等)缩放后按alpha叠加到主画面上，所有帧都是紧凑的yuv420p。
+ * 1）缩放不在编码线程：叠加源的线程调用SetOverlayFrame，在那里缩放到叠加的大小，并把逐像素的alpha与整体的alpha合成，
+ *    再做色度平面的alpha(2x2平均)；编码线程的Compose只做混合。每层三个缓冲轮换，两边只在交换指针时加锁，不拷贝。
+ * 2）混合：out = (src*a + dst*(256-a) + 128) >> 8，a = alpha + (alpha>>7)，把0-255映射到0-256，255时正好是src，
+ *    16位无符号乘加不会溢出。SSE2一次16个像素，AVX2一次32个，标量实现的结果完全一致。
+ *    整体alpha为255且没有逐像素alpha时直接拷贝，为0时跳过。
+ * 3）只处理叠加的区域，1080p上叠加一个480x270的层只读写主画面的1/16，主画面原地修改，不拷贝整帧。
+ *
+ * 叠加源还没有送来第一帧时跳过这一层。叠加的区域必须完全在主画面内。
+ */
+class VideoCompositor
+{
+public:
+    VideoCompositor();
+    ~VideoCompositor();
+
+    RET_CODE Init(int width, int height, const std::vector<VideoOverlay> &overlays);
+    void SetOverlayFrame(int index, const uint8_t *yuv, const uint8_t *alpha);    // 任意线程，alpha为源大小的逐像素alpha，可以为NULL
+    void Compose(uint8_t *yuv);                                                   // 编码线程，原地修改主画面
+    void GetStats(VideoCompositorStats *stats);
+    inline int GetOverlayCount() {
+        return (int)layers_.size();
+    }
+
+    // 混合一行，width为像素数
+    static void BlendRow(uint8_t *dst, const uint8_t *src, int width, int alpha);
+    static void BlendRowAlpha(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, int width);
+
+private:
+    typedef struct overlay_buffer
+    {
+        std::vector<uint8_t> yuv;                       // 缩放到叠加大小的yuv420p
+        std::vector<uint8_t> alpha;                     // 与整体alpha合成后的逐像素alpha，y平面大小加上色度平面大小，空表示只用整体alpha
+    }OverlayBuffer;
+
+    typedef struct overlay_layer
+    {
+        VideoOverlay config;
+        SwsContext *sws;                                // 源与叠加的大小不同时缩放yuv
+        SwsContext *alpha_sws;                          // 缩放逐像素alpha(灰度)
+        OverlayBuffer buffers[3];
+        OverlayBuffer *back;                            // 叠加源的线程写入
+        OverlayBuffer *middle;                          // 最新写完的一帧
+        OverlayBuffer *front;                           // Compose读取
+        bool has_new;
+        bool has_frame;                                 // front中已经有一帧
+        PushMutex *mutex;
+    }OverlayLayer;
+
+    void blendPlane(uint8_t *dst, int dst_stride, const uint8_t *src, const uint8_t *alpha, int width, int height,
+                    int global_alpha);
+
+    int width_ = 0;
+    int height_ = 0;
+    std::vector<OverlayLayer> layers_;
+    PushMutex stats_mutex_{PUSH_LOCK_SITE("video_compositor_stats")};
+    VideoCompositorStats stats_;
+};
+
+#endif // VIDEOCOMPOSITOR_H
@@ -0,0 +1,459 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/**
+ * @file
+ * Load generator for http_multiclient.
+ *
+ * @example http_loadgen.c
+ * Opens many http connections to a live MPEG-TS or FLV stream from one epoll
+ * loop and reports the total throughput and the lag of every client once a
+ * second. The lag of a client is the wall clock time since its first media
+ * timestamp minus the media time it has received since, i.e. how far it has
+ * fallen behind real time. It goes down again when the server makes a slow
+ * client skip to the next keyframe.
+ *
+ * Some clients can be throttled to a fixed read rate to exercise the server's
+ * slow client handling. Linux only (epoll).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+
+#define MAX_EVENTS      256
+#define TS_PACKET_SIZE  188
+#define FLV_TAG_HEADER  11
+#define TICK            (10 * 1000)         /* throttle refill, us */
+
+enum {
+    CONN_CONNECTING,
+    CONN_RESPONSE,                          /* reading the http response header */
+    CONN_STREAMING,
+    CONN_CLOSED,
+};
+
+typedef struct Conn {
+    int fd;
+    int state;
+    int events;                             /* currently registered epoll events */
+    char response[1024];
+    int response_len;
+
+    /* stream parsing */
+    int format;                             /* 0 unknown, 'T' MPEG-TS, 'F' FLV */
+    uint8_t ts[TS_PACKET_SIZE];
+    int ts_len;
+    uint8_t tag[FLV_TAG_HEADER];
+    int tag_len;
+    int64_t skip;                           /* FLV bytes to skip before the next tag header */
+
+    int64_t bytes;
+    int64_t first_wall;                     /* us */
+    int64_t first_media;                    /* ms, -1 until the first timestamp */
+    int64_t last_media;
+    int64_t lag;                            /* ms */
+
+    int64_t rate;                           /* bytes per second, 0 unthrottled */
+    int64_t tokens;
+} Conn;
+
+typedef struct LoadGen {
+    struct addrinfo *ai;
+    char request[1024];
+    int epoll_fd;
+    Conn *conns;
+    int nb_conns;
+    int connected;
+    int64_t bytes;                          /* since the last report */
+    int errors;
+} LoadGen;
+
+static volatile sig_atomic_t request_exit;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    request_exit = 1;
+}
+
+static void set_events(LoadGen *g, Conn *c, int events)
+{
+    struct epoll_event ev = { 0 };
+
+    if (c->events == events)
+        return;
+    ev.events   = events;
+    ev.data.ptr = c;
+    epoll_ctl(g->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+}
+
+static void close_conn(LoadGen *g, Conn *c, int error)
+{
+    if (c->state == CONN_CLOSED)
+        return;
+    if (c->state == CONN_STREAMING)
+        g->connected--;
+    if (error)
+        g->errors++;
+    epoll_ctl(g->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->state = CONN_CLOSED;
+}
+
+static int open_conn(LoadGen *g, Conn *c)
+{
+    struct epoll_event ev = { 0 };
+
+    c->fd = socket(g->ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0)
+        return AVERROR(errno);
+    if (c->rate) {
+        /* a slow link does not buffer seconds of data at the receiver either */
+        int rcvbuf = (int)FFMAX(c->rate / 4, 4096);
+        setsockopt(c->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+    if (connect(c->fd, g->ai->ai_addr, g->ai->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        int ret = AVERROR(errno);
+        close(c->fd);
+        return ret;
+    }
+    c->state       = CONN_CONNECTING;
+    c->first_media = -1;
+    c->events      = EPOLLOUT;
+    ev.events      = EPOLLOUT;
+    ev.data.ptr    = c;
+    epoll_ctl(g->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+    return 0;
+}
+
+static void on_media_time(Conn *c, int64_t ms)
+{
+    int64_t now = av_gettime_relative();
+
+    if (c->first_media < 0) {
+        c->first_media = ms;
+        c->first_wall  = now;
+    }
+    /* audio and video timestamps interleave, only move forward */
+    if (ms > c->last_media)
+        c->last_media = ms;
+    c->lag = (now - c->first_wall) / 1000 - (c->last_media - c->first_media);
+}
+
+static void parse_ts_packet(Conn *c, const uint8_t *p)
+{
+    int offset = 4;
+
+    if (!(p[1] & 0x40) || !(p[3] & 0x10))   /* no payload unit start or no payload */
+        return;
+    if (p[3] & 0x20)
+        offset += 1 + p[4];
+    if (offset + 14 > TS_PACKET_SIZE)
+        return;
+    p += offset;
+    /* PES header with a PTS from an audio or video stream */
+    if (p[0] || p[1] || p[2] != 1 || p[3] < 0xC0 || p[3] > 0xEF || !(p[7] & 0x80))
+        return;
+    on_media_time(c, ((int64_t)(p[9] & 0x0E) << 29 | p[10] << 22 | (p[11] & 0xFE) << 14 |
+                      p[12] << 7 | p[13] >> 1) / 90);
+}
+
+static void parse_ts(Conn *c, const uint8_t *buf, int size)
+{
+    while (size > 0) {
+        int n;
+        if (!c->ts_len && buf[0] != 0x47) {  /* resync */
+            buf++;
+            size--;
+            continue;
+        }
+        n = FFMIN(size, TS_PACKET_SIZE - c->ts_len);
+        memcpy(c->ts + c->ts_len, buf, n);
+        c->ts_len += n;
+        buf  += n;
+        size -= n;
+        if (c->ts_len == TS_PACKET_SIZE) {
+            parse_ts_packet(c, c->ts);
+            c->ts_len = 0;
+        }
+    }
+}
+
+static void parse_flv(Conn *c, const uint8_t *buf, int size)
+{
+    while (size > 0) {
+        int n;
+        if (c->skip) {
+            n = (int)FFMIN(c->skip, size);
+            c->skip -= n;
+            buf  += n;
+            size -= n;
+            continue;
+        }
+        n = FFMIN(size, FLV_TAG_HEADER - c->tag_len);
+        memcpy(c->tag + c->tag_len, buf, n);
+        c->tag_len += n;
+        buf  += n;
+        size -= n;
+        if (c->tag_len == FLV_TAG_HEADER) {
+            const uint8_t *t = c->tag;
+            if (t[0] == 8 || t[0] == 9)      /* audio or video tag */
+                on_media_time(c, t[4] << 16 | t[5] << 8 | t[6] | (int64_t)t[7] << 24);
+            c->skip    = (t[1] << 16 | t[2] << 8 | t[3]) + 4;  /* body and PreviousTagSize */
+            c->tag_len = 0;
+        }
+    }
+}
+
+static void parse_stream(Conn *c, const uint8_t *buf, int size)
+{
+    if (!c->format && size > 0) {
+        if (buf[0] == 'F') {
+            c->format = 'F';
+            c->skip   = 9 + 4;              /* FLV header and PreviousTagSize0 */
+        } else {
+            c->format = 'T';
+        }
+    }
+    if (c->format == 'F')
+        parse_flv(c, buf, size);
+    else
+        parse_ts(c, buf, size);
+}
+
+static void read_conn(LoadGen *g, Conn *c)
+{
+    uint8_t buf[65536];
+
+    for (;;) {
+        int size = sizeof(buf);
+        ssize_t n;
+
+        if (c->rate) {
+            if (c->tokens <= 0) {
+                set_events(g, c, 0);        /* resumed by the next refill */
+                return;
+            }
+            size = (int)FFMIN(size, c->tokens);
+        }
+        n = recv(c->fd, buf, size, 0);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                close_conn(g, c, 1);
+            return;
+        }
+        if (n == 0) {
+            close_conn(g, c, 1);
+            return;
+        }
+        if (c->rate)
+            c->tokens -= n;
+        if (c->state == CONN_RESPONSE) {
+            char *end;
+            int len = FFMIN(n, (int)sizeof(c->response) - 1 - c->response_len);
+            memcpy(c->response + c->response_len, buf, len);
+            c->response_len += len;
+            c->response[c->response_len] = 0;
+            end = strstr(c->response, "\r\n\r\n");
+            if (!end) {
+                if (c->response_len == sizeof(c->response) - 1)
+                    close_conn(g, c, 1);
+                continue;
+            }
+            if (strncmp(c->response, "HTTP/1.1 200", 12) && strncmp(c->response, "HTTP/1.0 200", 12)) {
+                av_log(NULL, AV_LOG_ERROR, "unexpected response: %.*s\n",
+                       (int)strcspn(c->response, "\r\n"), c->response);
+                close_conn(g, c, 1);
+                return;
+            }
+            c->state = CONN_STREAMING;
+            g->connected++;
+            /* the rest of this read is already stream data */
+            len = c->response_len - (int)(end + 4 - c->response);
+            memmove(buf, buf + n - len, len);
+            n = len;
+        }
+        c->bytes += n;
+        g->bytes += n;
+        parse_stream(c, buf, n);
+    }
+}
+
+static void write_conn(LoadGen *g, Conn *c)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err || send(c->fd, g->request, strlen(g->request), MSG_NOSIGNAL) < 0) {
+        close_conn(g, c, 1);
+        return;
+    }
+    c->state = CONN_RESPONSE;
+    set_events(g, c, EPOLLIN);
+}
+
+static int compare_lag(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(LoadGen *g, int64_t elapsed, int64_t interval, int64_t *lags)
+{
+    int i, n = 0;
+    int64_t sum = 0, min_bytes = INT64_MAX;
+
+    for (i = 0; i < g->nb_conns; i++) {
+        Conn *c = &g->conns[i];
+        if (c->state != CONN_STREAMING || c->first_media < 0)
+            continue;
+        lags[n++] = c->lag;
+        sum += c->lag;
+        min_bytes = FFMIN(min_bytes, c->bytes);
+    }
+    qsort(lags, n, sizeof(*lags), compare_lag);
+    printf("%6.1fs clients: %d/%d errors: %d in: %.1f Mbit/s lag ms avg: %"PRId64" p50: %"PRId64
+           " p99: %"PRId64" max: %"PRId64" min client bytes: %"PRId64"\n",
+           elapsed / 1000000.0, g->connected, g->nb_conns, g->errors, g->bytes * 8.0 / interval,
+           n ? sum / n : 0, n ? lags[n / 2] : 0, n ? lags[n * 99 / 100] : 0, n ? lags[n - 1] : 0,
+           n ? min_bytes : 0);
+    fflush(stdout);
+    g->bytes = 0;
+}
+
+int main(int argc, char **argv)
+{
+    LoadGen gen = { 0 }, *g = &gen;
+    struct addrinfo hints = { 0 };
+    struct epoll_event events[MAX_EVENTS];
+    char proto[16], host[256], path[1024], port_str[16];
+    int64_t start, last_report, last_tick, duration, *lags = NULL;
+    int port, i, ret, opened = 0, connect_rate, slow_clients, slow_kbps;
+
+    if (argc < 2) {
+        printf("usage: %s http://hostname[:port][/path] [clients] [seconds] [connects_per_sec] "
+               "[slow_clients] [slow_kbps]\n"
+               "Load generator for http_multiclient, reports throughput and per client lag.\n"
+               "\n", argv[0]);
+        return 1;
+    }
+    g->nb_conns   = argc > 2 ? atoi(argv[2]) : 100;
+    duration      = (argc > 3 ? atoi(argv[3]) : 30) * (int64_t)AV_TIME_BASE;
+    connect_rate  = argc > 4 ? atoi(argv[4]) : 500;
+    slow_clients  = argc > 5 ? atoi(argv[5]) : 0;
+    slow_kbps     = argc > 6 ? atoi(argv[6]) : 256;
+    if (g->nb_conns <= 0 || connect_rate <= 0) {
+        fprintf(stderr, "invalid clients or connects_per_sec\n");
+        return 1;
+    }
+
+    av_url_split(proto, sizeof(proto), NULL, 0, host, sizeof(host), &port, path, sizeof(path), argv[1]);
+    if (port < 0)
+        port = 80;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((ret = getaddrinfo(host, port_str, &hints, &g->ai))) {
+        fprintf(stderr, "Failed to resolve %s: %s\n", host, gai_strerror(ret));
+        return 1;
+    }
+    snprintf(g->request, sizeof(g->request), "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: http_loadgen\r\n\r\n",
+             path[0] ? path : "/", host);
+
+    g->conns = av_mallocz_array(g->nb_conns, sizeof(*g->conns));
+    lags     = av_malloc_array(g->nb_conns, sizeof(*lags));
+    g->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!g->conns || !lags || g->epoll_fd < 0) {
+        fprintf(stderr, "Failed to allocate %d clients\n", g->nb_conns);
+        ret = 1;
+        goto end;
+    }
+    for (i = 0; i < g->nb_conns; i++) {
+        g->conns[i].state = CONN_CLOSED;
+        if (i < slow_clients)
+            g->conns[i].rate = slow_kbps * 1000LL / 8;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    start = last_report = last_tick = av_gettime_relative();
+    while (!request_exit) {
+        int64_t now = av_gettime_relative();
+        int n;
+
+        if (now - start >= duration)
+            break;
+        /* ramp up at connect_rate */
+        while (opened < g->nb_conns && opened < (now - start) * connect_rate / AV_TIME_BASE + 1) {
+            if (open_conn(g, &g->conns[opened]) < 0)
+                g->errors++;
+            opened++;
+        }
+        if (now - last_tick >= TICK) {
+            for (i = 0; i < opened; i++) {
+                Conn *c = &g->conns[i];
+                if (!c->rate || c->state == CONN_CLOSED)
+                    continue;
+                c->tokens = FFMIN(c->tokens + c->rate * (now - last_tick) / AV_TIME_BASE, c->rate / 10);
+                if (c->tokens > 0 && c->state != CONN_CONNECTING)
+                    set_events(g, c, EPOLLIN);
+            }
+            last_tick = now;
+        }
+        if (now - last_report >= AV_TIME_BASE) {
+            report(g, now - start, now - last_report, lags);
+            last_report = now;
+        }
+
+        n = epoll_wait(g->epoll_fd, events, MAX_EVENTS, TICK / 1000);
+        for (i = 0; i < n; i++) {
+            Conn *c = events[i].data.ptr;
+            if (c->state == CONN_CONNECTING)
+                write_conn(g, c);
+            else if (c->state != CONN_CLOSED)
+                read_conn(g, c);
+        }
+    }
+    report(g, av_gettime_relative() - start, av_gettime_relative() - last_report, lags);
+    ret = 0;
+
+end:
+    if (g->conns) {
+        for (i = 0; i < g->nb_conns; i++)
+            close_conn(g, &g->conns[i], 0);
+    }
+    if (g->epoll_fd >= 0)
+        close(g->epoll_fd);
+    freeaddrinfo(g->ai);
+    av_freep(&g->conns);
+    av_freep(&lags);
+    return ret;
+}
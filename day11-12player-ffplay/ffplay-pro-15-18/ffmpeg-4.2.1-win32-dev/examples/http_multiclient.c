@@ -22,132 +22,735 @@
 
 /**
  * @file
- * libavformat multi-client network API usage example.
+ * libavformat multi-client live streaming example.
  *
  * @example http_multiclient.c
- * This example will serve a file without decoding or demuxing it over http.
- * Multiple clients can connect and will receive the same file.
+ * This example demuxes the input once, in real time and looping at EOF,
+ * remuxes it into MPEG-TS or FLV and serves the same live stream over http
+ * to many clients from a single process.
+ *
+ * The muxer writes into a custom AVIOContext. Every muxed packet becomes one
+ * reference counted chunk, which is appended to the ring buffer of every
+ * client without copying. Clients are non-blocking sockets driven by one
+ * epoll loop. A client whose ring buffer overflows (too many chunks or bytes)
+ * loses its queued chunks and resumes at the next video keyframe, so a slow
+ * client never stalls the source or the other clients.
+ *
+ * Linux only (epoll). Use http_loadgen to measure throughput and lag.
  */
 
-#include <libavformat/avformat.h>
-#include <libavutil/opt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
 #include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/avstring.h>
+#include <libavutil/time.h>
+
+#define MAX_EVENTS      256
+#define RING_SIZE       256                 /* chunks per client, power of two */
+#define MAX_IOV         16
+#define REQUEST_MAX     2048
+#define MAX_BURST       64                  /* packets muxed between two epoll_wait */
+#define SOCKET_SNDBUF   (128 * 1024)        /* keep the backlog in the ring, not in the kernel */
+#define STATS_INTERVAL  (5 * AV_TIME_BASE)
+
+enum {
+    CLIENT_REQUEST,                         /* reading the http request */
+    CLIENT_STREAMING,
+    CLIENT_CLOSING,                         /* close once the queue is drained */
+};
+
+typedef struct Chunk {
+    AVBufferRef *buf;
+    int64_t time;                           /* when it was muxed, 0 for http reply and stream header */
+    int key;                                /* a client may start or resume here */
+} Chunk;
+
+typedef struct Client {
+    int fd;
+    int state;
+    char request[REQUEST_MAX];
+    int request_len;
+    Chunk ring[RING_SIZE];
+    unsigned head, tail;                    /* ring[head & (RING_SIZE - 1)] is sent first */
+    int offset;                             /* bytes of the head chunk already sent */
+    int64_t queued;                         /* bytes in the ring, minus offset */
+    int wait_key;
+    int want_write;
+    struct Client *prev, *next;
+} Client;
+
+typedef struct Server {
+    AVFormatContext *ifmt_ctx;
+    AVFormatContext *ofmt_ctx;
+    int *stream_mapping;
+    int has_video;
 
-static void process_client(AVIOContext *client, const char *in_uri)
-{
-    AVIOContext *input = NULL;
-    uint8_t buf[1024];
-    int ret, n, reply_code;
-    uint8_t *resource = NULL;
-    while ((ret = avio_handshake(client)) > 0) {
-        av_opt_get(client, "resource", AV_OPT_SEARCH_CHILDREN, &resource);
-        // check for strlen(resource) is necessary, because av_opt_get()
-        // may return empty string.
-        if (resource && strlen(resource))
+    /* muxer output of the current packet */
+    uint8_t *pending;
+    unsigned pending_size;
+    int pending_len;
+    AVBufferRef *header;                    /* muxer header, sent to every new client */
+    const char *content_type;
+
+    /* real time pacing and looping */
+    AVPacket pkt;
+    int pkt_ready;
+    int64_t pkt_due;
+    int64_t start_time;
+    int64_t first_dts;                      /* AV_TIME_BASE */
+    int64_t ts_offset;                      /* added to every packet after a loop, AV_TIME_BASE */
+    int64_t end_dts;                        /* largest dts + duration seen, AV_TIME_BASE */
+
+    int listen_fd;
+    int epoll_fd;
+    char path[1024];
+    int max_clients;
+    int64_t client_max_bytes;
+    Client *clients;
+    int nb_clients;
+
+    /* statistics since the last report */
+    int64_t stats_time;
+    int64_t sent_bytes;
+    int64_t skips;
+    int64_t total_skips;
+} Server;
+
+static volatile sig_atomic_t request_exit;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    request_exit = 1;
+}
+
+static int write_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    Server *s = opaque;
+    uint8_t *p = av_fast_realloc(s->pending, &s->pending_size, s->pending_len + buf_size);
+    if (!p)
+        return AVERROR(ENOMEM);
+    s->pending = p;
+    memcpy(s->pending + s->pending_len, buf, buf_size);
+    s->pending_len += buf_size;
+    return buf_size;
+}
+
+/* take whatever the muxer wrote since the last call */
+static AVBufferRef *take_pending(Server *s)
+{
+    AVBufferRef *buf;
+
+    avio_flush(s->ofmt_ctx->pb);
+    if (!s->pending_len)
+        return NULL;
+    buf = av_buffer_alloc(s->pending_len);
+    if (buf)
+        memcpy(buf->data, s->pending, s->pending_len);
+    s->pending_len = 0;
+    return buf;
+}
+
+static AVBufferRef *make_reply(int code, const char *content_type)
+{
+    char reply[256];
+    AVBufferRef *buf;
+    int len;
+
+    if (code == 200)
+        len = snprintf(reply, sizeof(reply),
+                       "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+                       "Cache-Control: no-cache\r\nConnection: close\r\n\r\n", content_type);
+    else
+        len = snprintf(reply, sizeof(reply),
+                       "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    buf = av_buffer_alloc(len);
+    if (buf)
+        memcpy(buf->data, reply, len);
+    return buf;
+}
+
+static void update_write(Server *s, Client *c, int want_write)
+{
+    struct epoll_event ev = { 0 };
+
+    if (c->want_write == want_write)
+        return;
+    ev.events   = EPOLLIN | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->want_write = want_write;
+}
+
+static void close_client(Server *s, Client *c)
+{
+    while (c->head != c->tail)
+        av_buffer_unref(&c->ring[c->head++ & (RING_SIZE - 1)].buf);
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        s->clients = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    s->nb_clients--;
+    av_free(c);
+}
+
+/* drop everything that has not started to go out, except the http reply and stream header */
+static void drop_queue(Client *c)
+{
+    unsigned keep = c->head;
+
+    while (keep != c->tail) {
+        Chunk *chunk = &c->ring[keep & (RING_SIZE - 1)];
+        if (chunk->time && !(keep == c->head && c->offset))
             break;
-        av_freep(&resource);
+        keep++;
     }
-    if (ret < 0)
-        goto end;
-    av_log(client, AV_LOG_TRACE, "resource=%p\n", resource);
-    if (resource && resource[0] == '/' && !strcmp((resource + 1), in_uri)) {
-        reply_code = 200;
-    } else {
-        reply_code = AVERROR_HTTP_NOT_FOUND;
+    while (c->tail != keep) {
+        Chunk *chunk = &c->ring[--c->tail & (RING_SIZE - 1)];
+        c->queued -= chunk->buf->size;
+        av_buffer_unref(&chunk->buf);
     }
-    if ((ret = av_opt_set_int(client, "reply_code", reply_code, AV_OPT_SEARCH_CHILDREN)) < 0) {
-        av_log(client, AV_LOG_ERROR, "Failed to set reply_code: %s.\n", av_err2str(ret));
-        goto end;
+}
+
+static int push_chunk(Client *c, AVBufferRef *buf, int64_t time, int key)
+{
+    Chunk *chunk;
+
+    if (c->tail - c->head == RING_SIZE)
+        return AVERROR(ENOSPC);
+    chunk = &c->ring[c->tail & (RING_SIZE - 1)];
+    chunk->buf = av_buffer_ref(buf);
+    if (!chunk->buf)
+        return AVERROR(ENOMEM);
+    chunk->time = time;
+    chunk->key  = key;
+    c->tail++;
+    c->queued += buf->size;
+    return 0;
+}
+
+/**
+ * Send as much of the ring as the socket takes.
+ * @return 0 on success, a negative value if the client has to be closed
+ */
+static int flush_client(Server *s, Client *c)
+{
+    struct iovec iov[MAX_IOV];
+
+    while (c->head != c->tail) {
+        unsigned i, n = 0;
+        ssize_t ret;
+
+        for (i = c->head; i != c->tail && n < MAX_IOV; i++, n++) {
+            AVBufferRef *buf = c->ring[i & (RING_SIZE - 1)].buf;
+            int skip = i == c->head ? c->offset : 0;
+            iov[n].iov_base = buf->data + skip;
+            iov[n].iov_len  = buf->size - skip;
+        }
+        ret = writev(c->fd, iov, n);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                update_write(s, c, 1);
+                return 0;
+            }
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        s->sent_bytes += ret;
+        c->queued     -= ret;
+        while (ret > 0) {
+            Chunk *chunk = &c->ring[c->head & (RING_SIZE - 1)];
+            int left = chunk->buf->size - c->offset;
+            if (ret < left) {
+                c->offset += ret;
+                break;
+            }
+            ret -= left;
+            c->offset = 0;
+            av_buffer_unref(&chunk->buf);
+            c->head++;
+        }
     }
-    av_log(client, AV_LOG_TRACE, "Set reply code to %d\n", reply_code);
+    update_write(s, c, 0);
+    return c->state == CLIENT_CLOSING ? AVERROR_EOF : 0;
+}
 
-    while ((ret = avio_handshake(client)) > 0);
+/* hand one muxed chunk to every streaming client */
+static void broadcast(Server *s, AVBufferRef *buf, int key)
+{
+    int64_t now = av_gettime_relative();
+    Client *c, *next;
 
-    if (ret < 0)
-        goto end;
+    for (c = s->clients; c; c = next) {
+        next = c->next;
+        if (c->state != CLIENT_STREAMING)
+            continue;
+        if (c->wait_key && !key)
+            continue;
+        if (c->tail - c->head == RING_SIZE ||
+            c->queued + buf->size > s->client_max_bytes) {
+            /* slow client: skip ahead instead of buffering without bound */
+            drop_queue(c);
+            c->wait_key = 1;
+            s->skips++;
+            s->total_skips++;
+            if (!key)
+                continue;
+        }
+        if (push_chunk(c, buf, now, key) < 0)
+            continue;
+        c->wait_key = 0;
+        if (!c->want_write && flush_client(s, c) < 0)
+            close_client(s, c);
+    }
+}
+
+static int handle_request(Server *s, Client *c)
+{
+    char method[16], path[1024];
+    AVBufferRef *reply;
+    int ok;
+
+    if (sscanf(c->request, "%15s %1023s", method, path) != 2)
+        return AVERROR_INVALIDDATA;
+    ok = !strcmp(method, "GET") && (!s->path[0] || !strcmp(path, s->path));
+    av_log(NULL, AV_LOG_DEBUG, "client %d: %s %s -> %d\n", c->fd, method, path, ok ? 200 : 404);
+    reply = make_reply(ok ? 200 : 404, s->content_type);
+    if (!reply)
+        return AVERROR(ENOMEM);
+    push_chunk(c, reply, 0, 0);
+    av_buffer_unref(&reply);
+    if (!ok) {
+        c->state = CLIENT_CLOSING;
+        return 0;
+    }
+    if (s->header)
+        push_chunk(c, s->header, 0, 0);
+    c->state    = CLIENT_STREAMING;
+    c->wait_key = 1;
+    return 0;
+}
 
-    fprintf(stderr, "Handshake performed.\n");
-    if (reply_code != 200)
+static int read_client(Server *s, Client *c)
+{
+    for (;;) {
+        char discard[1024];
+        char *buf  = c->state == CLIENT_REQUEST ? c->request + c->request_len : discard;
+        int size   = c->state == CLIENT_REQUEST ? REQUEST_MAX - 1 - c->request_len : (int)sizeof(discard);
+        ssize_t n;
+
+        if (size <= 0)
+            return AVERROR_INVALIDDATA;
+        n = recv(c->fd, buf, size, 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        if (n == 0)
+            return AVERROR_EOF;
+        if (c->state != CLIENT_REQUEST)
+            continue;
+        c->request_len += n;
+        c->request[c->request_len] = 0;
+        if (strstr(c->request, "\r\n\r\n")) {
+            int ret = handle_request(s, c);
+            if (ret < 0)
+                return ret;
+            return flush_client(s, c);
+        }
+    }
+}
+
+static void accept_clients(Server *s)
+{
+    int sndbuf = SOCKET_SNDBUF;
+
+    for (;;) {
+        struct epoll_event ev = { 0 };
+        Client *c;
+        int fd = accept(s->listen_fd, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                av_log(NULL, AV_LOG_ERROR, "accept failed: %s\n", strerror(errno));
+            return;
+        }
+        if (s->nb_clients >= s->max_clients || !(c = av_mallocz(sizeof(*c)))) {
+            av_log(NULL, AV_LOG_WARNING, "refusing client, %d connected\n", s->nb_clients);
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        c->fd       = fd;
+        c->state    = CLIENT_REQUEST;
+        ev.events   = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            av_free(c);
+            continue;
+        }
+        c->next = s->clients;
+        if (s->clients)
+            s->clients->prev = c;
+        s->clients = c;
+        s->nb_clients++;
+    }
+}
+
+static int open_listen(Server *s, const char *out_uri)
+{
+    char proto[16], host[256], path[1024];
+    struct addrinfo hints = { 0 }, *ai = NULL;
+    struct epoll_event ev = { 0 };
+    char port_str[16];
+    int port, ret, one = 1;
+
+    av_url_split(proto, sizeof(proto), NULL, 0, host, sizeof(host), &port,
+                 path, sizeof(path), out_uri);
+    if (strcmp(proto, "http")) {
+        av_log(NULL, AV_LOG_ERROR, "Only http:// output is supported: %s\n", out_uri);
+        return AVERROR(EINVAL);
+    }
+    if (port < 0)
+        port = 80;
+    if (strcmp(path, "/"))
+        av_strlcpy(s->path, path, sizeof(s->path));
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+    if ((ret = getaddrinfo(host[0] ? host : NULL, port_str, &hints, &ai))) {
+        av_log(NULL, AV_LOG_ERROR, "Failed to resolve %s: %s\n", host, gai_strerror(ret));
+        return AVERROR(EINVAL);
+    }
+    s->listen_fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s->listen_fd < 0) {
+        ret = AVERROR(errno);
         goto end;
-    fprintf(stderr, "Opening input file.\n");
-    if ((ret = avio_open2(&input, in_uri, AVIO_FLAG_READ, NULL, NULL)) < 0) {
-        av_log(input, AV_LOG_ERROR, "Failed to open input: %s: %s.\n", in_uri,
-               av_err2str(ret));
+    }
+    setsockopt(s->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(s->listen_fd, ai->ai_addr, ai->ai_addrlen) < 0 || listen(s->listen_fd, 1024) < 0) {
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "Failed to listen on %s:%d: %s\n", host, port, av_err2str(ret));
         goto end;
     }
-    for(;;) {
-        n = avio_read(input, buf, sizeof(buf));
-        if (n < 0) {
-            if (n == AVERROR_EOF)
-                break;
-            av_log(input, AV_LOG_ERROR, "Error reading from input: %s.\n",
-                   av_err2str(n));
+    s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (s->epoll_fd < 0) {
+        ret = AVERROR(errno);
+        goto end;
+    }
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL;                     /* NULL marks the listening socket */
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &ev) < 0) {
+        ret = AVERROR(errno);
+        goto end;
+    }
+    av_log(NULL, AV_LOG_INFO, "Listening on %s:%d%s\n", host[0] ? host : "*", port,
+           s->path[0] ? s->path : " (any path)");
+    ret = 0;
+end:
+    freeaddrinfo(ai);
+    return ret;
+}
+
+static int open_output(Server *s, const char *format)
+{
+    AVIOContext *pb;
+    uint8_t *buffer;
+    unsigned i;
+    int ret, stream_index = 0;
+
+    avformat_alloc_output_context2(&s->ofmt_ctx, NULL, format, NULL);
+    if (!s->ofmt_ctx) {
+        av_log(NULL, AV_LOG_ERROR, "Could not create %s muxer\n", format);
+        return AVERROR_MUXER_NOT_FOUND;
+    }
+    s->content_type = !strcmp(format, "flv") ? "video/x-flv" : "video/mp2t";
+
+    s->stream_mapping = av_mallocz_array(s->ifmt_ctx->nb_streams, sizeof(*s->stream_mapping));
+    if (!s->stream_mapping)
+        return AVERROR(ENOMEM);
+    for (i = 0; i < s->ifmt_ctx->nb_streams; i++) {
+        AVCodecParameters *in_codecpar = s->ifmt_ctx->streams[i]->codecpar;
+        AVStream *out_stream;
+
+        if (in_codecpar->codec_type != AVMEDIA_TYPE_AUDIO &&
+            in_codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
+            s->stream_mapping[i] = -1;
+            continue;
+        }
+        if (in_codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+            s->has_video = 1;
+        s->stream_mapping[i] = stream_index++;
+        out_stream = avformat_new_stream(s->ofmt_ctx, NULL);
+        if (!out_stream)
+            return AVERROR(ENOMEM);
+        if ((ret = avcodec_parameters_copy(out_stream->codecpar, in_codecpar)) < 0)
+            return ret;
+        out_stream->codecpar->codec_tag = 0;
+    }
+
+    buffer = av_malloc(32768);
+    if (!buffer)
+        return AVERROR(ENOMEM);
+    pb = avio_alloc_context(buffer, 32768, 1, s, NULL, write_packet, NULL);
+    if (!pb) {
+        av_free(buffer);
+        return AVERROR(ENOMEM);
+    }
+    pb->seekable = 0;
+    s->ofmt_ctx->pb     = pb;
+    s->ofmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    if ((ret = avformat_write_header(s->ofmt_ctx, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Failed to write %s header: %s\n", format, av_err2str(ret));
+        return ret;
+    }
+    s->header = take_pending(s);
+    return 0;
+}
+
+/* read the next packet to mux, looping at EOF, and work out when it is due */
+static int read_next(Server *s)
+{
+    AVStream *in_stream, *out_stream;
+    AVPacket *pkt = &s->pkt;
+    int64_t dts, end;
+    int ret, looped = 0;
+
+    for (;;) {
+        ret = av_read_frame(s->ifmt_ctx, pkt);
+        if (ret == AVERROR_EOF && !looped) {
+            /* live source: start over, keeping timestamps monotonic */
+            looped = 1;
+            s->ts_offset = s->end_dts - (s->first_dts == AV_NOPTS_VALUE ? 0 : s->first_dts);
+            if ((ret = av_seek_frame(s->ifmt_ctx, -1, 0, AVSEEK_FLAG_BACKWARD)) < 0)
+                return ret;
+            continue;
+        }
+        if (ret < 0)
+            return ret;
+        if ((unsigned)pkt->stream_index < s->ifmt_ctx->nb_streams && s->stream_mapping[pkt->stream_index] >= 0)
             break;
+        av_packet_unref(pkt);
+    }
+
+    in_stream  = s->ifmt_ctx->streams[pkt->stream_index];
+    pkt->stream_index = s->stream_mapping[pkt->stream_index];
+    out_stream = s->ofmt_ctx->streams[pkt->stream_index];
+
+    dts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    if (dts != AV_NOPTS_VALUE) {
+        dts = av_rescale_q(dts, in_stream->time_base, AV_TIME_BASE_Q);
+        if (s->first_dts == AV_NOPTS_VALUE)
+            s->first_dts = dts;
+        dts += s->ts_offset;
+        end = dts + av_rescale_q(pkt->duration, in_stream->time_base, AV_TIME_BASE_Q);
+        s->end_dts = FFMAX(s->end_dts, end);
+        s->pkt_due = s->start_time + dts - s->first_dts;
+    } else {
+        s->pkt_due = 0;                     /* no timestamp, send right away */
+    }
+
+    if (pkt->pts != AV_NOPTS_VALUE)
+        pkt->pts = av_rescale_q(pkt->pts, in_stream->time_base, out_stream->time_base) +
+                   av_rescale_q(s->ts_offset, AV_TIME_BASE_Q, out_stream->time_base);
+    if (pkt->dts != AV_NOPTS_VALUE)
+        pkt->dts = av_rescale_q(pkt->dts, in_stream->time_base, out_stream->time_base) +
+                   av_rescale_q(s->ts_offset, AV_TIME_BASE_Q, out_stream->time_base);
+    pkt->duration = av_rescale_q(pkt->duration, in_stream->time_base, out_stream->time_base);
+    pkt->pos      = -1;
+    s->pkt_ready  = 1;
+    return 0;
+}
+
+static int mux_due_packets(Server *s)
+{
+    int n, ret;
+
+    for (n = 0; n < MAX_BURST; n++) {
+        AVBufferRef *buf;
+        int key;
+
+        if (!s->pkt_ready && (ret = read_next(s)) < 0)
+            return ret;
+        if (s->pkt_due > av_gettime_relative())
+            return 0;
+        key = !s->has_video ||
+              (s->ofmt_ctx->streams[s->pkt.stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+               (s->pkt.flags & AV_PKT_FLAG_KEY));
+        ret = av_write_frame(s->ofmt_ctx, &s->pkt);
+        av_packet_unref(&s->pkt);
+        s->pkt_ready = 0;
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_WARNING, "Error muxing packet: %s\n", av_err2str(ret));
+            continue;
+        }
+        /* one chunk per packet, so a keyframe chunk starts with the keyframe's bytes */
+        if ((buf = take_pending(s))) {
+            broadcast(s, buf, key);
+            av_buffer_unref(&buf);
         }
-        avio_write(client, buf, n);
-        avio_flush(client);
     }
-end:
-    fprintf(stderr, "Flushing client\n");
-    avio_flush(client);
-    fprintf(stderr, "Closing client\n");
-    avio_close(client);
-    fprintf(stderr, "Closing input\n");
-    avio_close(input);
-    av_freep(&resource);
+    return 0;
+}
+
+static void log_stats(Server *s, int64_t now)
+{
+    int64_t lag_sum = 0, lag_max = 0, queued_max = 0;
+    int streaming = 0;
+    Client *c;
+
+    for (c = s->clients; c; c = c->next) {
+        unsigned i;
+        if (c->state != CLIENT_STREAMING)
+            continue;
+        streaming++;
+        queued_max = FFMAX(queued_max, c->queued);
+        /* lag: age of the oldest media chunk still waiting in the ring */
+        for (i = c->head; i != c->tail; i++) {
+            int64_t time = c->ring[i & (RING_SIZE - 1)].time;
+            if (time) {
+                lag_sum += now - time;
+                lag_max  = FFMAX(lag_max, now - time);
+                break;
+            }
+        }
+    }
+    av_log(NULL, AV_LOG_INFO, "clients: %d streaming: %d out: %.1f Mbit/s skips: %"PRId64" (total %"PRId64") "
+           "lag avg: %"PRId64" ms max: %"PRId64" ms queue max: %"PRId64" KB\n",
+           s->nb_clients, streaming, s->sent_bytes * 8.0 / (now - s->stats_time), s->skips, s->total_skips,
+           streaming ? lag_sum / streaming / 1000 : 0, lag_max / 1000, queued_max / 1024);
+    s->stats_time = now;
+    s->sent_bytes = 0;
+    s->skips      = 0;
 }
 
 int main(int argc, char **argv)
 {
-    AVDictionary *options = NULL;
-    AVIOContext *client = NULL, *server = NULL;
-    const char *in_uri, *out_uri;
-    int ret, pid;
-    av_log_set_level(AV_LOG_TRACE);
+    Server server = { 0 }, *s = &server;
+    struct epoll_event events[MAX_EVENTS];
+    const char *in_uri, *out_uri, *format;
+    Client *c;
+    int ret;
+
     if (argc < 3) {
-        printf("usage: %s input http://hostname[:port]\n"
-               "API example program to serve http to multiple clients.\n"
+        printf("usage: %s input http://hostname[:port][/path] [mpegts|flv] [client_buffer_kb] [max_clients]\n"
+               "API example program to serve a live stream over http to many clients.\n"
+               "The input is demuxed once, paced in real time and looped at EOF.\n"
                "\n", argv[0]);
         return 1;
     }
 
-    in_uri = argv[1];
+    in_uri  = argv[1];
     out_uri = argv[2];
+    format  = argc > 3 ? argv[3] : "mpegts";
+    s->client_max_bytes = (argc > 4 ? strtoll(argv[4], NULL, 10) : 2048) * 1024;
+    s->max_clients      = argc > 5 ? atoi(argv[5]) : 10000;
+    s->listen_fd  = -1;
+    s->epoll_fd   = -1;
+    s->first_dts  = AV_NOPTS_VALUE;
+    av_init_packet(&s->pkt);
 
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
     avformat_network_init();
 
-    if ((ret = av_dict_set(&options, "listen", "2", 0)) < 0) {
-        fprintf(stderr, "Failed to set listen mode for server: %s\n", av_err2str(ret));
-        return ret;
+    if ((ret = avformat_open_input(&s->ifmt_ctx, in_uri, NULL, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open input '%s': %s\n", in_uri, av_err2str(ret));
+        goto end;
     }
-    if ((ret = avio_open2(&server, out_uri, AVIO_FLAG_WRITE, NULL, &options)) < 0) {
-        fprintf(stderr, "Failed to open server: %s\n", av_err2str(ret));
-        return ret;
+    if ((ret = avformat_find_stream_info(s->ifmt_ctx, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Failed to retrieve input stream information\n");
+        goto end;
     }
-    fprintf(stderr, "Entering main loop.\n");
-    for(;;) {
-        if ((ret = avio_accept(server, &client)) < 0)
-            goto end;
-        fprintf(stderr, "Accepted client, forking process.\n");
-        // XXX: Since we don't reap our children and don't ignore signals
-        //      this produces zombie processes.
-        pid = fork();
-        if (pid < 0) {
-            perror("Fork failed");
+    av_dump_format(s->ifmt_ctx, 0, in_uri, 0);
+    if ((ret = open_output(s, format)) < 0)
+        goto end;
+    if ((ret = open_listen(s, out_uri)) < 0)
+        goto end;
+
+    s->start_time = s->stats_time = av_gettime_relative();
+    while (!request_exit) {
+        int i, n, timeout;
+        int64_t now;
+
+        if ((ret = mux_due_packets(s)) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Error reading input: %s\n", av_err2str(ret));
+            break;
+        }
+        now = av_gettime_relative();
+        timeout = s->pkt_due > now ? (int)FFMIN((s->pkt_due - now + 999) / 1000, 100) : 0;
+        n = epoll_wait(s->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
             ret = AVERROR(errno);
-            goto end;
+            break;
         }
-        if (pid == 0) {
-            fprintf(stderr, "In child.\n");
-            process_client(client, in_uri);
-            avio_close(server);
-            exit(0);
+        for (i = 0; i < n; i++) {
+            c = events[i].data.ptr;
+            if (!c) {
+                accept_clients(s);
+                continue;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                close_client(s, c);
+                continue;
+            }
+            if ((events[i].events & EPOLLIN) && read_client(s, c) < 0) {
+                close_client(s, c);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && flush_client(s, c) < 0)
+                close_client(s, c);
         }
-        if (pid > 0)
-            avio_close(client);
+        now = av_gettime_relative();
+        if (now - s->stats_time >= STATS_INTERVAL)
+            log_stats(s, now);
     }
+    if (request_exit)
+        ret = 0;
+
 end:
-    avio_close(server);
+    while (s->clients)
+        close_client(s, s->clients);
+    if (s->epoll_fd >= 0)
+        close(s->epoll_fd);
+    if (s->listen_fd >= 0)
+        close(s->listen_fd);
+    av_packet_unref(&s->pkt);
+    av_buffer_unref(&s->header);
+    if (s->ofmt_ctx) {
+        if (s->ofmt_ctx->pb)
+            av_freep(&s->ofmt_ctx->pb->buffer);
+        avio_context_free(&s->ofmt_ctx->pb);
+        avformat_free_context(s->ofmt_ctx);
+    }
+    avformat_close_input(&s->ifmt_ctx);
+    av_freep(&s->stream_mapping);
+    av_freep(&s->pending);
+    avformat_network_deinit();
+
     if (ret < 0 && ret != AVERROR_EOF) {
         fprintf(stderr, "Some errors occurred: %s\n", av_err2str(ret));
         return 1;